@@ -4,6 +4,7 @@
 
 #include <c-list.h>
 #include <c-macro.h>
+#include <c-rbtree.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
@@ -12,6 +13,7 @@
 #include <sys/types.h>
 #include "broker/broker.h"
 #include "broker/controller.h"
+#include "broker/handoff.h"
 #include "broker/main.h"
 #include "bus/bus.h"
 #include "dbus/connection.h"
@@ -43,40 +45,181 @@ static int broker_dispatch_signals(DispatchFile *file) {
         return DISPATCH_E_EXIT;
 }
 
-int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t max_fds, uint64_t max_matches, uint64_t max_objects) {
-        _c_cleanup_(broker_freep) Broker *broker = NULL;
+static void broker_dispatch_stall(DispatchContext *ctx, uint64_t nsec) {
+        Broker *broker = c_container_of(ctx, Broker, dispatcher);
+        BrokerBus *bus;
+
+        /*
+         * Only the bus that handled the stalled callback has a record for its
+         * generation, all other records are stale and ignored. Callbacks that
+         * do not dispatch peer messages (or which stalled while writing,
+         * rather than dispatching) cannot be attributed.
+         */
+        c_list_for_each_entry(bus, &broker->bus_list, broker_link)
+                if (bus_log_stall(&bus->bus, ctx->n_callbacks, nsec))
+                        return;
+
+        fprintf(stderr, "Dispatch stalled for %llu us\n", (unsigned long long)(nsec / 1000));
+}
+
+static int broker_dispatch_handoff(DispatchFile *file) {
+        Broker *broker = c_container_of(file, Broker, handoff_file);
+        ControllerListener *listener;
+        int r;
+
+        /*
+         * The predecessor started the handoff. It is received in one go, and
+         * only then the listeners start accepting connections, so new peers
+         * can never collide with the restored ones.
+         */
+        r = handoff_import(broker, broker->handoff_fd);
+        if (r) {
+                if (r > 0) {
+                        if (main_arg_verbose)
+                                fprintf(stderr, "Handoff failed: %d\n", r);
+                        return DISPATCH_E_FAILURE;
+                }
+
+                return error_fold(r);
+        }
+
+        dispatch_file_deinit(&broker->handoff_file);
+        broker->handoff_fd = c_close(broker->handoff_fd);
+
+        c_rbtree_for_each_entry(listener, &broker->primary->controller.listener_tree, controller_node)
+                dispatch_file_select(&listener->listener.socket_file, EPOLLIN);
+
+        return 0;
+}
+
+/**
+ * broker_bus_new() - create new bus
+ * @busp:               output argument for new bus
+ * @broker:             broker to host the bus
+ * @controller_fd:      controller socket of the bus
+ *
+ * This creates a new bus, hosted by @broker, which is controlled through
+ * @controller_fd. The bus is owned by the peer of @controller_fd. All buses
+ * of a broker share its dispatcher and its interned strings, but are
+ * otherwise entirely isolated from each other. The controller connection is
+ * not opened by this function, and the caller retains ownership of
+ * @controller_fd, unless it hands it over via @bus->controller_fd.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int broker_bus_new(BrokerBus **busp, Broker *broker, int controller_fd) {
+        _c_cleanup_(broker_bus_freep) BrokerBus *bus = NULL;
         struct ucred ucred;
         socklen_t z_ucred = sizeof(ucred);
-        sigset_t sigmask;
         int r;
 
         r = getsockopt(controller_fd, SOL_SOCKET, SO_PEERCRED, &ucred, &z_ucred);
         if (r < 0)
                 return error_origin(-errno);
 
-        broker = calloc(1, sizeof(*broker));
-        if (!broker)
+        bus = calloc(1, sizeof(*bus));
+        if (!bus)
                 return error_origin(-ENOMEM);
 
-        broker->bus = (Bus)BUS_NULL(broker->bus);
-        broker->dispatcher = (DispatchContext)DISPATCH_CONTEXT_NULL(broker->dispatcher);
-        broker->signals_fd = -1;
-        broker->signals_file = (DispatchFile)DISPATCH_FILE_NULL(broker->signals_file);
-        broker->controller = (Controller)CONTROLLER_NULL(broker->controller);
+        *bus = (BrokerBus)BROKER_BUS_NULL(*bus);
+        bus->broker = broker;
+        c_list_link_tail(&broker->bus_list, &bus->broker_link);
+
+        r = bus_init(&bus->bus,
+                     &broker->atoms,
+                     broker->max_bytes,
+                     broker->max_fds,
+                     broker->max_matches,
+                     broker->max_objects,
+                     broker->max_memfd_bytes);
+        if (r)
+                return error_fold(r);
 
-        r = bus_init(&broker->bus, max_bytes, max_fds, max_matches, max_objects);
+        bus->bus.pid = ucred.pid;
+        r = user_registry_ref_user(&bus->bus.users, &bus->bus.user, ucred.uid);
         if (r)
                 return error_fold(r);
 
-        broker->bus.pid = ucred.pid;
-        r = user_registry_ref_user(&broker->bus.users, &broker->bus.user, ucred.uid);
+        /* hosted buses are configured like the primary bus */
+        if (broker->primary) {
+                bus->bus.reply_timeout = broker->primary->bus.reply_timeout;
+                bus->bus.slow_consumer_bytes = broker->primary->bus.slow_consumer_bytes;
+        }
+
+        r = controller_init(&bus->controller, broker, &bus->bus, controller_fd);
         if (r)
                 return error_fold(r);
 
+        *busp = bus;
+        bus = NULL;
+        return 0;
+}
+
+/**
+ * broker_bus_free() - destroy bus
+ * @bus:                bus to operate on, or NULL
+ *
+ * This disconnects all peers of @bus, and destroys it.
+ *
+ * Return: NULL is returned.
+ */
+BrokerBus *broker_bus_free(BrokerBus *bus) {
+        if (!bus)
+                return NULL;
+
+        peer_registry_flush(&bus->bus.peers);
+        controller_deinit(&bus->controller);
+        bus_deinit(&bus->bus);
+        c_close(bus->controller_fd);
+        c_list_unlink(&bus->broker_link);
+        free(bus);
+
+        return NULL;
+}
+
+int broker_bus_update_environment(BrokerBus *bus, const char * const *env, size_t n_env) {
+        return controller_dbus_send_environment(&bus->controller, env, n_env);
+}
+
+int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t max_fds, uint64_t max_matches, uint64_t max_objects, uint64_t max_memfd_bytes) {
+        _c_cleanup_(broker_freep) Broker *broker = NULL;
+        sigset_t sigmask;
+        int r;
+
+        broker = calloc(1, sizeof(*broker));
+        if (!broker)
+                return error_origin(-ENOMEM);
+
+        broker->dispatcher = (DispatchContext)DISPATCH_CONTEXT_NULL(broker->dispatcher);
+        broker->atoms = (AtomRegistry)ATOM_REGISTRY_INIT;
+        broker->policy_batches = (PolicyBatchPool)POLICY_BATCH_POOL_INIT;
+        broker->signals_fd = -1;
+        broker->signals_file = (DispatchFile)DISPATCH_FILE_NULL(broker->signals_file);
+        broker->handoff_fd = -1;
+        broker->handoff_file = (DispatchFile)DISPATCH_FILE_NULL(broker->handoff_file);
+        broker->max_bytes = max_bytes;
+        broker->max_fds = max_fds;
+        broker->max_matches = max_matches;
+        broker->max_objects = max_objects;
+        broker->max_memfd_bytes = max_memfd_bytes;
+        broker->bus_list = (CList)C_LIST_INIT(broker->bus_list);
+
         r = dispatch_context_init(&broker->dispatcher);
         if (r)
                 return error_fold(r);
 
+        if (main_arg_io_uring) {
+                r = dispatch_context_init_uring(&broker->dispatcher);
+                if (r == DISPATCH_E_UNSUPPORTED) {
+                        if (main_arg_verbose)
+                                fprintf(stderr, "io_uring not supported, falling back to epoll\n");
+                } else if (r) {
+                        return error_fold(r);
+                }
+        }
+
+        broker->dispatcher.stall_fn = broker_dispatch_stall;
+
         sigemptyset(&sigmask);
         sigaddset(&sigmask, SIGTERM);
         sigaddset(&sigmask, SIGINT);
@@ -96,9 +239,9 @@ int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t
 
         dispatch_file_select(&broker->signals_file, EPOLLIN);
 
-        r = controller_init(&broker->controller, broker, controller_fd);
+        r = broker_bus_new(&broker->primary, broker, controller_fd);
         if (r)
-                return error_fold(r);
+                return error_trace(r);
 
         *brokerp = broker;
         broker = NULL;
@@ -106,21 +249,60 @@ int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t
 }
 
 Broker *broker_free(Broker *broker) {
+        BrokerBus *bus;
+
         if (!broker)
                 return NULL;
 
-        controller_deinit(&broker->controller);
+        while ((bus = c_list_first_entry(&broker->bus_list, BrokerBus, broker_link)))
+                broker_bus_free(bus);
+        broker->primary = NULL;
+
+        dispatch_file_deinit(&broker->handoff_file);
+        c_close(broker->handoff_fd);
         dispatch_file_deinit(&broker->signals_file);
         c_close(broker->signals_fd);
         dispatch_context_deinit(&broker->dispatcher);
-        bus_deinit(&broker->bus);
+        policy_batch_pool_deinit(&broker->policy_batches);
+        atom_registry_deinit(&broker->atoms);
         free(broker);
 
         return NULL;
 }
 
+/**
+ * broker_set_handoff() - take over from a predecessor
+ * @broker:             broker to operate on
+ * @handoff_fd:         handoff socket
+ *
+ * This makes @broker wait for a predecessor to hand its primary bus over on
+ * @handoff_fd, see handoff_export(). Until then, no listener of the bus
+ * accepts connections. Ownership of @handoff_fd is transferred to @broker.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int broker_set_handoff(Broker *broker, int handoff_fd) {
+        int r;
+
+        assert(broker->handoff_fd < 0);
+
+        r = dispatch_file_init(&broker->handoff_file,
+                               &broker->dispatcher,
+                               broker_dispatch_handoff,
+                               handoff_fd,
+                               EPOLLIN | EPOLLHUP,
+                               0);
+        if (r)
+                return error_fold(r);
+
+        dispatch_file_select(&broker->handoff_file, EPOLLIN | EPOLLHUP);
+        broker->handoff_fd = handoff_fd;
+        return 0;
+}
+
 int broker_run(Broker *broker) {
         sigset_t signew, sigold;
+        BrokerBus *bus;
         int r;
 
         sigemptyset(&signew);
@@ -129,7 +311,7 @@ int broker_run(Broker *broker) {
 
         sigprocmask(SIG_BLOCK, &signew, &sigold);
 
-        r = connection_open(&broker->controller.connection);
+        r = connection_open(&broker->primary->controller.connection);
         if (r == CONNECTION_E_EOF)
                 return MAIN_EXIT;
         else if (r)
@@ -145,13 +327,31 @@ int broker_run(Broker *broker) {
                         r = error_fold(r);
         } while (!r);
 
-        peer_registry_flush(&broker->bus.peers);
+        c_list_for_each_entry(bus, &broker->bus_list, broker_link)
+                peer_registry_flush(&bus->bus.peers);
 
         sigprocmask(SIG_SETMASK, &sigold, NULL);
 
         return r;
 }
 
-int broker_update_environment(Broker *broker, const char * const *env, size_t n_env) {
-        return controller_dbus_send_environment(&broker->controller, env, n_env);
+/**
+ * broker_hangup() - handle hangup of a controller
+ * @broker:             broker to operate on
+ * @controller:         controller that hung up
+ *
+ * This is called once the connection of @controller is gone. If it controls
+ * the primary bus, the broker exits. Otherwise, only the bus of @controller is
+ * destroyed, and all other buses continue to run.
+ *
+ * Return: 0 on success, DISPATCH_E_EXIT if the broker should exit.
+ */
+int broker_hangup(Broker *broker, Controller *controller) {
+        BrokerBus *bus = c_container_of(controller, BrokerBus, controller);
+
+        if (bus == broker->primary)
+                return DISPATCH_E_EXIT;
+
+        broker_bus_free(bus);
+        return 0;
 }
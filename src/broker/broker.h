@@ -4,47 +4,88 @@
  * Broker
  */
 
+#include <c-list.h>
 #include <c-macro.h>
 #include <stdlib.h>
 #include "broker/controller.h"
 #include "bus/bus.h"
+#include "bus/policy.h"
+#include "util/atom.h"
 #include "util/dispatch.h"
 
 typedef struct Broker Broker;
+typedef struct BrokerBus BrokerBus;
+
+struct BrokerBus {
+        Broker *broker;
+        CList broker_link;
+        int controller_fd;
 
-struct Broker {
         Bus bus;
+        Controller controller;
+};
+
+#define BROKER_BUS_NULL(_x) {                                                   \
+                .broker_link = C_LIST_INIT((_x).broker_link),                   \
+                .controller_fd = -1,                                            \
+                .bus = BUS_NULL((_x).bus),                                      \
+                .controller = CONTROLLER_NULL((_x).controller),                 \
+        }
+
+struct Broker {
         DispatchContext dispatcher;
+        AtomRegistry atoms;
+        PolicyBatchPool policy_batches;
 
         int signals_fd;
         DispatchFile signals_file;
 
-        Controller controller;
+        int handoff_fd;
+        DispatchFile handoff_file;
+
+        unsigned int max_bytes;
+        unsigned int max_fds;
+        unsigned int max_matches;
+        unsigned int max_objects;
+        unsigned int max_memfd_bytes;
+
+        BrokerBus *primary;
+        CList bus_list;
 };
 
+/* buses */
+
+int broker_bus_new(BrokerBus **busp, Broker *broker, int controller_fd);
+BrokerBus *broker_bus_free(BrokerBus *bus);
+
+int broker_bus_update_environment(BrokerBus *bus, const char * const *env, size_t n_env);
+
+C_DEFINE_CLEANUP(BrokerBus *, broker_bus_free);
+
 /* broker */
 
-int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t max_fds, uint64_t max_matches, uint64_t max_objects);
+int broker_new(Broker **brokerp, int controller_fd, uint64_t max_bytes, uint64_t max_fds, uint64_t max_matches, uint64_t max_objects, uint64_t max_memfd_bytes);
 Broker *broker_free(Broker *broker);
 
+int broker_set_handoff(Broker *broker, int handoff_fd);
 int broker_run(Broker *broker);
-int broker_update_environment(Broker *broker, const char * const *env, size_t n_env);
+int broker_hangup(Broker *broker, Controller *controller);
 
 C_DEFINE_CLEANUP(Broker *, broker_free);
 
 /* inline helpers */
 
-static inline Broker *BROKER(Bus *bus) {
+static inline BrokerBus *BROKER_BUS(Bus *bus) {
         /*
-         * This function up-casts a Bus to its parent class Broker. In our code
-         * base we pretend a Bus is an abstract class with several virtual
+         * This function up-casts a Bus to its parent class BrokerBus. In our
+         * code base we pretend a Bus is an abstract class with several virtual
          * methods. However, we only do this to clearly separate our code
          * bases. We never intended this to be modular. Hence, instead of
          * providing real vtables with userdata pointers, we instead allow
          * explicit up-casts to the parent type.
          *
          * This function performs the up-cast, relying on the fact that all our
-         * Bus objects are always owned by a Broker object.
+         * Bus objects are always owned by a BrokerBus object.
          */
-        return c_container_of(bus, Broker, bus);
+        return c_container_of(bus, BrokerBus, bus);
 }
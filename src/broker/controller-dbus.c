@@ -8,11 +8,15 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include "broker/broker.h"
 #include "broker/controller.h"
+#include "broker/handoff.h"
+#include "bus/bus.h"
 #include "bus/policy.h"
 #include "dbus/connection.h"
 #include "dbus/message.h"
 #include "dbus/protocol.h"
+#include "util/dispatch.h"
 #include "util/error.h"
 #include "util/fdlist.h"
 
@@ -63,6 +67,21 @@ static const CDVarType controller_type_in_ohsv[] = {
                 )
         )
 };
+static const CDVarType controller_type_in_oh[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE2(
+                        C_DVAR_T_o,
+                        C_DVAR_T_h
+                )
+        )
+};
+static const CDVarType controller_type_in_h[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE1(
+                        C_DVAR_T_h
+                )
+        )
+};
 static const CDVarType controller_type_in_osu[] = {
         C_DVAR_T_INIT(
                 C_DVAR_T_TUPLE3(
@@ -72,6 +91,42 @@ static const CDVarType controller_type_in_osu[] = {
                 )
         )
 };
+static const CDVarType controller_type_in_v[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE1(
+                        C_DVAR_T_v
+                )
+        )
+};
+static const CDVarType controller_type_in_bv[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE2(
+                        C_DVAR_T_b,
+                        C_DVAR_T_v
+                )
+        )
+};
+static const CDVarType controller_type_in_aosu[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE1(
+                        C_DVAR_T_ARRAY(
+                                C_DVAR_T_TUPLE3(
+                                        C_DVAR_T_o,
+                                        C_DVAR_T_s,
+                                        C_DVAR_T_u
+                                )
+                        )
+                )
+        )
+};
+static const CDVarType controller_type_in_uu[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE2(
+                        C_DVAR_T_u,
+                        C_DVAR_T_u
+                )
+        )
+};
 static const CDVarType controller_type_out_unit[] = {
         C_DVAR_T_INIT(
                 CONTROLLER_T_MESSAGE(
@@ -208,13 +263,99 @@ static int controller_method_add_name(Controller *controller, const char *_path,
         return 0;
 }
 
+static int controller_method_add_names(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        _c_cleanup_(c_freep) ControllerName **names = NULL;
+        const char *path, *name_str;
+        size_t i, n_names = 0, n_names_max = 0;
+        ControllerName *name, **t;
+        uid_t uid;
+        int r;
+
+        /*
+         * This behaves like AddName, but registers a whole batch of names in
+         * one go. Either all names are added, or none. Hence, remember every
+         * name we added, so we can drop them again if a later one fails.
+         */
+
+        c_dvar_read(in_v, "([");
+
+        while (c_dvar_more(in_v)) {
+                c_dvar_read(in_v, "(osu)", &path, &name_str, &uid);
+
+                if (strncmp(path, "/org/bus1/DBus/Name/", strlen("/org/bus1/DBus/Name/")) != 0) {
+                        r = CONTROLLER_E_UNEXPECTED_PATH;
+                        goto error;
+                }
+                if (!dbus_validate_name(name_str, strlen(name_str))) {
+                        r = CONTROLLER_E_NAME_INVALID;
+                        goto error;
+                }
+
+                if (n_names >= n_names_max) {
+                        n_names_max = n_names_max ? n_names_max * 2 : 64;
+                        t = realloc(names, n_names_max * sizeof(*names));
+                        if (!t) {
+                                r = error_origin(-ENOMEM);
+                                goto error;
+                        }
+
+                        names = t;
+                }
+
+                r = controller_add_name(controller, &name, path, name_str, uid);
+                if (r)
+                        goto error;
+
+                names[n_names++] = name;
+        }
+
+        c_dvar_read(in_v, "])");
+
+        r = controller_end_read(in_v);
+        if (r)
+                goto error;
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+
+error:
+        for (i = 0; i < n_names; ++i)
+                controller_name_free(names[i]);
+        return error_trace(r);
+}
+
+static int controller_get_listener_fd(const char *path, FDList *fds, uint32_t fd_index, int *fdp) {
+        int r, listener_fd, v1, v2;
+        socklen_t n;
+
+        if (strncmp(path, "/org/bus1/DBus/Listener/", strlen("/org/bus1/DBus/Listener/")) != 0)
+                return CONTROLLER_E_UNEXPECTED_PATH;
+
+        listener_fd = fdlist_get(fds, fd_index);
+        if (listener_fd < 0)
+                return CONTROLLER_E_LISTENER_INVALID_FD;
+
+        n = sizeof(v1);
+        r = getsockopt(listener_fd, SOL_SOCKET, SO_DOMAIN, &v1, &n);
+        n = sizeof(v2);
+        r = r ?: getsockopt(listener_fd, SOL_SOCKET, SO_TYPE, &v2, &n);
+
+        if (r < 0)
+                return (errno == EBADF || errno == ENOTSOCK) ? CONTROLLER_E_LISTENER_INVALID_FD : error_origin(-errno);
+        if (v1 != AF_UNIX || v2 != SOCK_STREAM)
+                return CONTROLLER_E_LISTENER_INVALID_FD;
+
+        *fdp = listener_fd;
+        return 0;
+}
+
 static int controller_method_add_listener(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
         _c_cleanup_(policy_registry_freep) PolicyRegistry *policy = NULL;
         const char *path, *policy_path;
         ControllerListener *listener;
-        int r, listener_fd, v1, v2;
         uint32_t fd_index;
-        socklen_t n;
+        int r, listener_fd;
 
         r = policy_registry_new(&policy, controller->sid);
         if (r)
@@ -232,29 +373,186 @@ static int controller_method_add_listener(Controller *controller, const char *_p
         if (r)
                 return error_trace(r);
 
-        if (strncmp(path, "/org/bus1/DBus/Listener/", strlen("/org/bus1/DBus/Listener/")) != 0)
-                return CONTROLLER_E_UNEXPECTED_PATH;
+        r = policy_registry_share(policy, &controller->broker->policy_batches);
+        if (r)
+                return error_fold(r);
 
-        listener_fd = fdlist_get(fds, fd_index);
-        if (listener_fd < 0)
-                return CONTROLLER_E_LISTENER_INVALID_FD;
+        r = controller_get_listener_fd(path, fds, fd_index, &listener_fd);
+        if (r)
+                return error_trace(r);
+
+        r = controller_add_listener(controller, &listener, path, listener_fd, policy);
+        if (r)
+                return error_trace(r);
+
+        policy = NULL;
+        fdlist_steal(fds, fd_index);
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
+static int controller_method_add_pending_listener(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        ControllerListener *listener;
+        uint32_t fd_index;
+        const char *path;
+        int r, listener_fd;
+
+        /*
+         * Like AddListener, but without a policy. Peers are accepted and
+         * authenticated right away, but are held back until SetPolicy() is
+         * called on the listener. This allows the caller to start accepting
+         * connections before it finished compiling the policy.
+         */
+
+        c_dvar_read(in_v, "(oh)", &path, &fd_index);
+
+        r = controller_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        r = controller_get_listener_fd(path, fds, fd_index, &listener_fd);
+        if (r)
+                return error_trace(r);
+
+        r = controller_add_listener(controller, &listener, path, listener_fd, NULL);
+        if (r)
+                return error_trace(r);
+
+        fdlist_steal(fds, fd_index);
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
+static int controller_method_set_user_priority(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        static const unsigned int priorities[] = {
+                DISPATCH_PRIORITY_NORMAL,
+                DISPATCH_PRIORITY_HIGH,
+        };
+        uint32_t uid, priority;
+        int r;
+
+        c_dvar_read(in_v, "(uu)", &uid, &priority);
+
+        r = controller_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        if (priority >= C_ARRAY_SIZE(priorities))
+                return CONTROLLER_E_PRIORITY_INVALID;
+
+        r = bus_set_user_priority(controller->bus, uid, priorities[priority]);
+        if (r)
+                return error_fold(r);
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
+static int controller_method_add_bus(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        _c_cleanup_(broker_bus_freep) BrokerBus *bus = NULL;
+        int r, controller_fd, v1, v2;
+        uint32_t fd_index;
+        socklen_t n;
+
+        /*
+         * This creates a new bus, hosted in this broker process. The new bus
+         * is driven by its own controller, speaking this very protocol on the
+         * passed socket, and is owned by the peer of that socket. It is
+         * destroyed once its controller disconnects. Only the controller of
+         * the primary bus can create buses.
+         */
+
+        if (controller->bus != &controller->broker->primary->bus)
+                return CONTROLLER_E_UNEXPECTED_METHOD;
+
+        c_dvar_read(in_v, "(h)", &fd_index);
+
+        r = controller_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        controller_fd = fdlist_get(fds, fd_index);
+        if (controller_fd < 0)
+                return CONTROLLER_E_BUS_INVALID_FD;
 
         n = sizeof(v1);
-        r = getsockopt(listener_fd, SOL_SOCKET, SO_DOMAIN, &v1, &n);
+        r = getsockopt(controller_fd, SOL_SOCKET, SO_DOMAIN, &v1, &n);
         n = sizeof(v2);
-        r = r ?: getsockopt(listener_fd, SOL_SOCKET, SO_TYPE, &v2, &n);
+        r = r ?: getsockopt(controller_fd, SOL_SOCKET, SO_TYPE, &v2, &n);
 
         if (r < 0)
-                return (errno == EBADF || errno == ENOTSOCK) ? CONTROLLER_E_LISTENER_INVALID_FD : error_origin(-errno);
+                return (errno == EBADF || errno == ENOTSOCK) ? CONTROLLER_E_BUS_INVALID_FD : error_origin(-errno);
         if (v1 != AF_UNIX || v2 != SOCK_STREAM)
-                return CONTROLLER_E_LISTENER_INVALID_FD;
+                return CONTROLLER_E_BUS_INVALID_FD;
 
-        r = controller_add_listener(controller, &listener, path, listener_fd, policy);
+        r = broker_bus_new(&bus, controller->broker, controller_fd);
         if (r)
                 return error_trace(r);
 
-        policy = NULL;
+        r = connection_open(&bus->controller.connection);
+        if (r)
+                return error_fold(r);
+
+        bus->controller_fd = controller_fd;
         fdlist_steal(fds, fd_index);
+        bus = NULL;
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
+static int controller_method_handoff(Controller *controller, const char *_path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        int r, handoff_fd, v1, v2;
+        uint32_t fd_index;
+        socklen_t n;
+
+        /*
+         * This hands all connections of the bus over to a successor broker,
+         * which was started with the other end of the passed socket as its
+         * handoff socket. On success, this broker no longer has any peers,
+         * nor does it accept new ones, and the controller is expected to
+         * hang up, so it exits. On failure, nothing changed. Only the
+         * controller of the primary bus can hand it over.
+         */
+
+        if (controller->bus != &controller->broker->primary->bus)
+                return CONTROLLER_E_UNEXPECTED_METHOD;
+
+        c_dvar_read(in_v, "(h)", &fd_index);
+
+        r = controller_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        handoff_fd = fdlist_get(fds, fd_index);
+        if (handoff_fd < 0)
+                return CONTROLLER_E_HANDOFF_INVALID_FD;
+
+        n = sizeof(v1);
+        r = getsockopt(handoff_fd, SOL_SOCKET, SO_DOMAIN, &v1, &n);
+        n = sizeof(v2);
+        r = r ?: getsockopt(handoff_fd, SOL_SOCKET, SO_TYPE, &v2, &n);
+
+        if (r < 0)
+                return (errno == EBADF || errno == ENOTSOCK) ? CONTROLLER_E_HANDOFF_INVALID_FD : error_origin(-errno);
+        if (v1 != AF_UNIX || v2 != SOCK_SEQPACKET)
+                return CONTROLLER_E_HANDOFF_INVALID_FD;
+
+        r = handoff_export(controller->broker, handoff_fd);
+        if (r) {
+                if (r == HANDOFF_E_UNSUPPORTED)
+                        return CONTROLLER_E_HANDOFF_UNSUPPORTED;
+                else if (r == HANDOFF_E_EOF)
+                        return CONTROLLER_E_HANDOFF_FAILED;
+
+                return error_fold(r);
+        }
 
         c_dvar_write(out_v, "()");
 
@@ -282,6 +580,102 @@ static int controller_method_listener_release(Controller *controller, const char
         return 0;
 }
 
+static int controller_method_listener_stage_policy(Controller *controller, const char *path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        ControllerListener *listener;
+        bool first;
+        int r;
+
+        /*
+         * Large policies are transferred in several parts, rather than in a
+         * single message. Each part adds uid and gid entries to a policy that
+         * is staged on the listener, and the following SetPolicy() completes
+         * it and puts it into effect. Until then, the listener keeps its
+         * current policy. If any part is invalid, the staged policy is
+         * dropped altogether.
+         *
+         * The first part of a transfer drops whatever was staged before, so
+         * the parts of a transfer that was aborted halfway never leak into
+         * the next one.
+         */
+
+        listener = controller_find_listener(controller, path);
+        if (!listener)
+                return CONTROLLER_E_LISTENER_NOT_FOUND;
+
+        c_dvar_read(in_v, "(b", &first);
+
+        if (first)
+                listener->staged_policy = policy_registry_free(listener->staged_policy);
+
+        if (!listener->staged_policy) {
+                r = policy_registry_new(&listener->staged_policy, controller->sid);
+                if (r)
+                        return error_fold(r);
+        }
+
+        r = policy_registry_import_nodes(listener->staged_policy, in_v);
+        if (r) {
+                listener->staged_policy = policy_registry_free(listener->staged_policy);
+                return (r == POLICY_E_INVALID) ? CONTROLLER_E_LISTENER_INVALID_POLICY : error_fold(r);
+        }
+
+        c_dvar_read(in_v, ")");
+
+        r = controller_end_read(in_v);
+        if (r) {
+                listener->staged_policy = policy_registry_free(listener->staged_policy);
+                return error_trace(r);
+        }
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
+static int controller_method_listener_set_policy(Controller *controller, const char *path, CDVar *in_v, FDList *fds, CDVar *out_v) {
+        _c_cleanup_(policy_registry_freep) PolicyRegistry *policy = NULL;
+        ControllerListener *listener;
+        int r;
+
+        /* complete the policy staged via StagePolicy(), if any */
+        listener = controller_find_listener(controller, path);
+        if (listener && listener->staged_policy) {
+                policy = listener->staged_policy;
+                listener->staged_policy = NULL;
+        } else {
+                r = policy_registry_new(&policy, controller->sid);
+                if (r)
+                        return error_fold(r);
+        }
+
+        c_dvar_read(in_v, "(");
+
+        r = policy_registry_import(policy, in_v);
+        if (r)
+                return (r == POLICY_E_INVALID) ? CONTROLLER_E_LISTENER_INVALID_POLICY : error_fold(r);
+
+        c_dvar_read(in_v, ")");
+
+        r = controller_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        r = policy_registry_share(policy, &controller->broker->policy_batches);
+        if (r)
+                return error_fold(r);
+
+        listener = controller_find_listener(controller, path);
+        if (!listener)
+                return CONTROLLER_E_LISTENER_NOT_FOUND;
+
+        listener_set_policy(&listener->listener, policy);
+        policy = NULL;
+
+        c_dvar_write(out_v, "()");
+
+        return 0;
+}
+
 static int controller_method_name_release(Controller *controller, const char *path, CDVar *in_v, FDList *fds, CDVar *out_v) {
         ControllerName *name;
         int r;
@@ -391,8 +785,13 @@ static int controller_handle_method(const ControllerMethod *method, Controller *
 
 static int controller_dispatch_controller(Controller *controller, uint32_t serial, const char *method, const char *path, const char *signature, Message *message) {
         static const ControllerMethod methods[] = {
-                { "AddName",            controller_method_add_name,     controller_type_in_osu,         controller_type_out_unit },
-                { "AddListener",        controller_method_add_listener, controller_type_in_ohsv,        controller_type_out_unit },
+                { "AddName",            controller_method_add_name,             controller_type_in_osu,         controller_type_out_unit },
+                { "AddNames",           controller_method_add_names,            controller_type_in_aosu,        controller_type_out_unit },
+                { "AddListener",        controller_method_add_listener,         controller_type_in_ohsv,        controller_type_out_unit },
+                { "AddPendingListener", controller_method_add_pending_listener, controller_type_in_oh,          controller_type_out_unit },
+                { "SetUserPriority",    controller_method_set_user_priority,    controller_type_in_uu,          controller_type_out_unit },
+                { "AddBus",             controller_method_add_bus,              controller_type_in_h,           controller_type_out_unit },
+                { "Handoff",            controller_method_handoff,              controller_type_in_h,           controller_type_out_unit },
         };
 
         for (size_t i = 0; i < C_ARRAY_SIZE(methods); i++) {
@@ -423,8 +822,9 @@ static int controller_dispatch_name(Controller *controller, uint32_t serial, con
 
 static int controller_dispatch_listener(Controller *controller, uint32_t serial, const char *method, const char *path, const char *signature, Message *message) {
         static const ControllerMethod methods[] = {
-                { "Release",    controller_method_listener_release,     c_dvar_type_unit,       controller_type_out_unit },
-                /* XXX: SetPolicy */
+                { "Release",            controller_method_listener_release,             c_dvar_type_unit,       controller_type_out_unit },
+                { "SetPolicy",          controller_method_listener_set_policy,          controller_type_in_v,   controller_type_out_unit },
+                { "StagePolicy",        controller_method_listener_stage_policy,        controller_type_in_bv,  controller_type_out_unit },
         };
 
         for (size_t i = 0; i < C_ARRAY_SIZE(methods); i++) {
@@ -512,6 +912,21 @@ int controller_dbus_dispatch(Controller *controller, Message *message) {
         case CONTROLLER_E_NAME_INVALID:
                 r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Name.Invalid");
                 break;
+        case CONTROLLER_E_PRIORITY_INVALID:
+                r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Broker.InvalidPriority");
+                break;
+        case CONTROLLER_E_BUS_INVALID_FD:
+                r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Broker.InvalidFD");
+                break;
+        case CONTROLLER_E_HANDOFF_INVALID_FD:
+                r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Broker.InvalidFD");
+                break;
+        case CONTROLLER_E_HANDOFF_UNSUPPORTED:
+                r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Broker.HandoffUnsupported");
+                break;
+        case CONTROLLER_E_HANDOFF_FAILED:
+                r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Broker.HandoffFailed");
+                break;
         case CONTROLLER_E_LISTENER_NOT_FOUND:
                 r = controller_send_error(connection, message_read_serial(message), "org.bus1.DBus.Listener.NotFound");
                 break;
@@ -525,10 +940,7 @@ int controller_dbus_dispatch(Controller *controller, Message *message) {
         return error_trace(r);
 }
 
-/**
- * controller_dbus_send_activation() - XXX
- */
-int controller_dbus_send_activation(Controller *controller, const char *path) {
+static int controller_dbus_new_activation(Message **messagep, const char *path) {
         static const CDVarType type[] = {
                 C_DVAR_T_INIT(
                         CONTROLLER_T_MESSAGE(
@@ -537,7 +949,6 @@ int controller_dbus_send_activation(Controller *controller, const char *path) {
                 )
         };
         _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
-        _c_cleanup_(message_unrefp) Message *message = NULL;
         size_t n_data;
         void *data;
         int r;
@@ -553,15 +964,48 @@ int controller_dbus_send_activation(Controller *controller, const char *path) {
         if (r)
                 return error_origin(r);
 
-        r = message_new_outgoing(&message, data, n_data);
+        r = message_new_outgoing(messagep, data, n_data);
         if (r)
                 return error_fold(r);
 
-        r = connection_queue(&controller->connection, NULL, message);
+        return 0;
+}
+
+/**
+ * controller_dbus_send_activation() - send activation requests
+ * @controller:         controller to operate on
+ * @names:              names to request activation for
+ * @n_names:            number of names
+ *
+ * This sends one Activate signal for each name in @names to the controller.
+ * The signals are queued as a single batch, so they are charged and written
+ * out together.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int controller_dbus_send_activation(Controller *controller, ControllerName **names, size_t n_names) {
+        Message *messages[CONTROLLER_ACTIVATION_BATCH_MAX] = {};
+        size_t i;
+        int r = 0;
+
+        assert(n_names <= C_ARRAY_SIZE(messages));
+
+        for (i = 0; i < n_names; ++i) {
+                r = controller_dbus_new_activation(&messages[i], names[i]->path);
+                if (r) {
+                        r = error_trace(r);
+                        goto exit;
+                }
+        }
+
+        r = connection_queue_batch(&controller->connection, NULL, messages, n_names);
         if (r)
-                return error_fold(r);
+                r = error_fold(r);
 
-        return 0;
+exit:
+        for (i = 0; i < n_names; ++i)
+                message_unref(messages[i]);
+        return r;
 }
 
 /**
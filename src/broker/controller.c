@@ -2,8 +2,10 @@
  * Broker Controller
  */
 
+#include <c-list.h>
 #include <c-macro.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include "broker/broker.h"
 #include "broker/controller.h"
@@ -30,6 +32,7 @@ ControllerName *controller_name_free(ControllerName *name) {
         if (!name)
                 return NULL;
 
+        c_list_unlink(&name->activation_link);
         activation_deinit(&name->activation);
         c_rbtree_remove_init(&name->controller->name_tree, &name->controller_node);
         free(name);
@@ -53,6 +56,7 @@ static int controller_name_new(ControllerName **namep, Controller *controller, c
 
         name->controller = controller;
         name->controller_node = (CRBNode)C_RBNODE_INIT(name->controller_node);
+        name->activation_link = (CList)C_LIST_INIT(name->activation_link);
         name->activation = (Activation)ACTIVATION_NULL(name->activation);
         memcpy(name->path, path, n_path + 1);
 
@@ -65,14 +69,55 @@ static int controller_name_new(ControllerName **namep, Controller *controller, c
  * controller_name_reset() - XXX
  */
 void controller_name_reset(ControllerName *name) {
+        c_list_unlink(&name->activation_link);
         activation_flush(&name->activation);
 }
 
 /**
- * controller_name_activate() - XXX
+ * controller_name_activate() - request activation of a name
+ * @name:               name to operate on
+ *
+ * This requests activation of @name from the controller. The request is not
+ * sent right away, but deferred until the controller connection is
+ * dispatched, later in the same dispatch round. All requests collected until
+ * then are sent as a batch. At startup, many names are activated in quick
+ * succession, and this way they travel in a single write, rather than one
+ * each.
+ *
+ * Return: 0 on success, negative error code on failure.
  */
 int controller_name_activate(ControllerName *name) {
-        return controller_dbus_send_activation(name->controller, name->path);
+        Controller *controller = name->controller;
+
+        if (!c_list_is_linked(&name->activation_link))
+                c_list_link_tail(&controller->activation_list, &name->activation_link);
+
+        dispatch_file_select(&controller->connection.socket_file, EPOLLOUT);
+        return 0;
+}
+
+static int controller_flush_activations(Controller *controller) {
+        ControllerName *names[CONTROLLER_ACTIVATION_BATCH_MAX], *name;
+        size_t i, n_names;
+        int r;
+
+        while (!c_list_is_empty(&controller->activation_list)) {
+                n_names = 0;
+                c_list_for_each_entry(name, &controller->activation_list, activation_link) {
+                        names[n_names++] = name;
+                        if (n_names >= C_ARRAY_SIZE(names))
+                                break;
+                }
+
+                r = controller_dbus_send_activation(controller, names, n_names);
+                if (r)
+                        return error_trace(r);
+
+                for (i = 0; i < n_names; ++i)
+                        c_list_unlink(&names[i]->activation_link);
+        }
+
+        return 0;
 }
 
 static int controller_listener_compare(CRBTree *t, void *k, CRBNode *rb) {
@@ -88,6 +133,7 @@ ControllerListener *controller_listener_free(ControllerListener *listener) {
         if (!listener)
                 return NULL;
 
+        listener->staged_policy = policy_registry_free(listener->staged_policy);
         listener_deinit(&listener->listener);
         c_rbtree_remove_init(&listener->controller->listener_tree, &listener->controller_node);
         free(listener);
@@ -122,6 +168,10 @@ static int controller_dispatch_connection(DispatchFile *file) {
         Controller *controller = c_container_of(file, Controller, connection.socket_file);
         int r;
 
+        r = controller_flush_activations(controller);
+        if (r)
+                return error_trace(r);
+
         r = connection_dispatch(&controller->connection, dispatch_file_events(file));
         if (r)
                 return error_fold(r);
@@ -145,10 +195,10 @@ static int controller_dispatch_connection(DispatchFile *file) {
 
         if (r == CONTROLLER_E_EOF) {
                 connection_shutdown(&controller->connection);
-                return connection_is_running(&controller->connection) ? 0 : DISPATCH_E_EXIT;
+                return connection_is_running(&controller->connection) ? 0 : broker_hangup(controller->broker, controller);
         } else if (r == CONTROLLER_E_PROTOCOL_VIOLATION) {
                 connection_close(&controller->connection);
-                return connection_is_running(&controller->connection) ? 0 : DISPATCH_E_EXIT;
+                return connection_is_running(&controller->connection) ? 0 : broker_hangup(controller->broker, controller);
         }
 
         return error_fold(r);
@@ -157,13 +207,14 @@ static int controller_dispatch_connection(DispatchFile *file) {
 /**
  * controller_init() - XXX
  */
-int controller_init(Controller *c, Broker *broker, int controller_fd) {
+int controller_init(Controller *c, Broker *broker, Bus *bus, int controller_fd) {
         _c_cleanup_(controller_deinitp) Controller *controller = c;
         _c_cleanup_(c_freep) char *seclabel = NULL;
         int r;
 
         *controller = (Controller)CONTROLLER_NULL(*controller);
         controller->broker = broker;
+        controller->bus = bus;
 
         /* XXX: replace this by sockopt_get_seclabel() once
          *      socketpair() created sockets support it.
@@ -179,7 +230,7 @@ int controller_init(Controller *c, Broker *broker, int controller_fd) {
         r = connection_init_server(&controller->connection,
                                    &broker->dispatcher,
                                    controller_dispatch_connection,
-                                   broker->bus.user,
+                                   bus->user,
                                    "0123456789abcdef",
                                    controller_fd);
         if (r)
@@ -202,7 +253,10 @@ void controller_deinit(Controller *controller) {
         c_rbtree_for_each_entry_unlink(listener, listener_safe, &controller->listener_tree, controller_node)
                 controller_listener_free(listener);
 
+        assert(c_list_is_empty(&controller->activation_list));
+
         connection_deinit(&controller->connection);
+        controller->bus = NULL;
         controller->broker = NULL;
 }
 
@@ -219,11 +273,11 @@ int controller_add_name(Controller *controller,
         _c_cleanup_(user_unrefp) User *user_entry = NULL;
         int r;
 
-        r = name_registry_ref_name(&controller->broker->bus.names, &name_entry, name_str);
+        r = name_registry_ref_name(&controller->bus->names, &name_entry, name_str);
         if (r)
                 return error_fold(r);
 
-        r = user_registry_ref_user(&controller->broker->bus.users, &user_entry, uid);
+        r = user_registry_ref_user(&controller->bus->users, &user_entry, uid);
         if (r)
                 return error_fold(r);
 
@@ -256,13 +310,17 @@ int controller_add_listener(Controller *controller,
                 return error_trace(r);
 
         r = listener_init_with_fd(&listener->listener,
-                                  &controller->broker->bus,
+                                  controller->bus,
                                   &controller->broker->dispatcher,
                                   listener_fd,
                                   policy);
         if (r)
                 return error_fold(r);
 
+        /* no connections are accepted before a pending handoff is done */
+        if (controller->broker->handoff_fd >= 0)
+                dispatch_file_deselect(&listener->listener.socket_file, EPOLLIN);
+
         *listenerp = listener;
         listener = NULL;
         return 0;
@@ -4,6 +4,7 @@
  * Broker Controller
  */
 
+#include <c-list.h>
 #include <c-macro.h>
 #include <c-rbtree.h>
 #include <stdlib.h>
@@ -21,6 +22,8 @@ typedef struct ControllerName ControllerName;
 typedef struct ControllerListener ControllerListener;
 typedef struct Message Message;
 
+#define CONTROLLER_ACTIVATION_BATCH_MAX (32) /* batches live on the stack; more are sent in further batches */
+
 enum {
         _CONTROLLER_E_SUCCESS,
 
@@ -42,6 +45,11 @@ enum {
         CONTROLLER_E_NAME_EXISTS,
         CONTROLLER_E_NAME_IS_ACTIVATABLE,
         CONTROLLER_E_NAME_INVALID,
+        CONTROLLER_E_PRIORITY_INVALID,
+        CONTROLLER_E_BUS_INVALID_FD,
+        CONTROLLER_E_HANDOFF_INVALID_FD,
+        CONTROLLER_E_HANDOFF_UNSUPPORTED,
+        CONTROLLER_E_HANDOFF_FAILED,
 
         CONTROLLER_E_LISTENER_NOT_FOUND,
         CONTROLLER_E_NAME_NOT_FOUND,
@@ -50,6 +58,7 @@ enum {
 struct ControllerName {
         Controller *controller;
         CRBNode controller_node;
+        CList activation_link;
         Activation activation;
         char path[];
 };
@@ -58,21 +67,25 @@ struct ControllerListener {
         Controller *controller;
         CRBNode controller_node;
         Listener listener;
+        PolicyRegistry *staged_policy;
         char path[];
 };
 
 struct Controller {
         Broker *broker;
+        Bus *bus;
         BusSELinuxID *sid;
         Connection connection;
         CRBTree name_tree;
         CRBTree listener_tree;
+        CList activation_list;
 };
 
 #define CONTROLLER_NULL(_x) {                                                   \
                 .connection = CONNECTION_NULL((_x).connection),                 \
                 .name_tree = C_RBTREE_INIT,                                     \
                 .listener_tree = C_RBTREE_INIT,                                 \
+                .activation_list = C_LIST_INIT((_x).activation_list),           \
         }
 
 /* names */
@@ -91,7 +104,7 @@ C_DEFINE_CLEANUP(ControllerListener *, controller_listener_free);
 
 /* controller */
 
-int controller_init(Controller *controller, Broker *broker, int controller_fd);
+int controller_init(Controller *controller, Broker *broker, Bus *bus, int controller_fd);
 void controller_deinit(Controller *controller);
 
 int controller_add_name(Controller *controller,
@@ -108,7 +121,7 @@ ControllerName *controller_find_name(Controller *controller, const char *path);
 ControllerListener *controller_find_listener(Controller *controller, const char *path);
 
 int controller_dbus_dispatch(Controller *controller, Message *message);
-int controller_dbus_send_activation(Controller *controller, const char *path);
+int controller_dbus_send_activation(Controller *controller, ControllerName **names, size_t n_names);
 int controller_dbus_send_environment(Controller *controller, const char * const *env, size_t n_env);
 
 C_DEFINE_CLEANUP(Controller *, controller_deinit);
@@ -0,0 +1,615 @@
+/*
+ * Broker Handoff
+ *
+ * A running broker can hand all its connections over to a successor, so the
+ * broker can be replaced without any of its clients noticing. The successor
+ * is started by the launcher with one end of a sequential-packet socket as
+ * its handoff socket, and configured exactly like the running broker. The
+ * running broker is then told via its controller to hand over on the other
+ * end of that socket.
+ *
+ * The running broker serializes the state of its bus, and passes duplicates
+ * of all connection sockets along. The successor restores the state, and
+ * acknowledges it. Only then does the running broker drop all its peers,
+ * silently. The peers keep their unique IDs, names, match rules and pending
+ * replies, and all queued input and output is restored, so the successor
+ * continues exactly where the running broker left off. If anything fails on
+ * the way, the running broker keeps its peers, and the launcher is expected
+ * to kill the successor.
+ *
+ * State that cannot be restored is not handed over. Instead, the handoff is
+ * refused, and can be retried later. This applies to monitors, captures,
+ * shared-memory transports, pending activations, and hosted buses. Policy
+ * snapshots are not serialized either, but taken afresh from the policy of
+ * the listeners of the successor, which the launcher configured equally.
+ */
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "broker/broker.h"
+#include "broker/controller.h"
+#include "broker/handoff.h"
+#include "bus/activation.h"
+#include "bus/bus.h"
+#include "bus/driver.h"
+#include "bus/listener.h"
+#include "bus/match.h"
+#include "bus/name.h"
+#include "bus/peer.h"
+#include "bus/reply.h"
+#include "dbus/connection.h"
+#include "dbus/message.h"
+#include "dbus/socket.h"
+#include "util/error.h"
+#include "util/serialize.h"
+
+/* the running broker does not dispatch meanwhile, so a hung successor must not stall it for long */
+#define HANDOFF_TIMEOUT_SEC (10)
+
+enum {
+        HANDOFF_RECORD_END,
+        HANDOFF_RECORD_LISTENER,
+        HANDOFF_RECORD_PEER,
+        HANDOFF_RECORD_NAME,
+        HANDOFF_RECORD_MATCH,
+        HANDOFF_RECORD_REPLY,
+};
+
+enum {
+        HANDOFF_PEER_REGISTERED                 = (1U << 0),
+        HANDOFF_PEER_COALESCE_SIGNALS           = (1U << 1),
+        HANDOFF_PEER_CHECKED                    = (1U << 2),
+        HANDOFF_PEER_SHUTDOWN                   = (1U << 3),
+};
+
+static int handoff_prepare_fd(int fd) {
+        struct timeval tv = { .tv_sec = HANDOFF_TIMEOUT_SEC };
+        int flags, r;
+
+        flags = fcntl(fd, F_GETFL);
+        if (flags < 0)
+                return error_origin(-errno);
+
+        if (flags & O_NONBLOCK) {
+                r = fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+                if (r < 0)
+                        return error_origin(-errno);
+        }
+
+        /* neither side must ever wait forever for the other one */
+        r = setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (r >= 0)
+                r = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (r < 0)
+                return error_origin(-errno);
+
+        return 0;
+}
+
+static int handoff_check(Broker *broker) {
+        Controller *controller = &broker->primary->controller;
+        Bus *bus = &broker->primary->bus;
+        ControllerName *name;
+        Activation *activation;
+        Socket *socket;
+        Peer *peer;
+        size_t i;
+
+        if (c_list_first(&broker->bus_list) != c_list_last(&broker->bus_list))
+                return HANDOFF_E_UNSUPPORTED;
+
+        if (bus->n_monitors)
+                return HANDOFF_E_UNSUPPORTED;
+
+        c_rbtree_for_each_entry(name, &controller->name_tree, controller_node) {
+                activation = &name->activation;
+                if (activation->requested ||
+                    !c_list_is_empty(&activation->activation_messages) ||
+                    !c_list_is_empty(&activation->activation_requests))
+                        return HANDOFF_E_UNSUPPORTED;
+        }
+
+        for (i = 0; i < bus->peers.n_slots; ++i) {
+                peer = bus->peers.slots[i];
+                if (!peer)
+                        continue;
+
+                socket = &peer->connection.socket;
+                if (peer->monitor || peer->capture || !peer->listener ||
+                    socket->shm || !socket_is_running(socket))
+                        return HANDOFF_E_UNSUPPORTED;
+        }
+
+        return 0;
+}
+
+static int handoff_export_peer(Serializer *s, Peer *peer) {
+        ControllerListener *listener = c_container_of(peer->listener, ControllerListener, listener);
+        uint32_t flags = 0;
+        int r;
+
+        if (peer->registered)
+                flags |= HANDOFF_PEER_REGISTERED;
+        if (peer->coalesce_signals)
+                flags |= HANDOFF_PEER_COALESCE_SIGNALS;
+        if (peer->policy)
+                flags |= HANDOFF_PEER_CHECKED;
+        if (peer->connection.socket.shutdown)
+                flags |= HANDOFF_PEER_SHUTDOWN;
+
+        r = serializer_write_u32(s, HANDOFF_RECORD_PEER);
+        r = r ?: serializer_write_fd(s, peer->connection.socket.fd);
+        r = r ?: serializer_write_u64(s, peer->id);
+        r = r ?: serializer_write_string(s, listener->path);
+        r = r ?: serializer_write_u32(s, flags);
+        r = r ?: connection_serialize(&peer->connection, s);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int handoff_export_state(Broker *broker, Serializer *s) {
+        Controller *controller = &broker->primary->controller;
+        Bus *bus = &broker->primary->bus;
+        ControllerListener *listener;
+        NameOwnership *ownership;
+        MatchRule *rule;
+        ReplySlot *slot;
+        Name *name;
+        Peer *peer;
+        size_t i;
+        int r;
+
+        r = serializer_write_u64(s, HANDOFF_MAGIC);
+        r = r ?: serializer_write_u32(s, HANDOFF_VERSION);
+        r = r ?: serializer_write(s, bus->guid, sizeof(bus->guid));
+        r = r ?: serializer_write_u64(s, bus->peers.ids);
+        if (r)
+                return error_trace(r);
+
+        c_rbtree_for_each_entry(listener, &controller->listener_tree, controller_node) {
+                r = serializer_write_u32(s, HANDOFF_RECORD_LISTENER);
+                r = r ?: serializer_write_string(s, listener->path);
+                r = r ?: serializer_write(s, listener->listener.guid, sizeof(listener->listener.guid));
+                if (r)
+                        return error_trace(r);
+        }
+
+        for (i = 0; i < bus->peers.n_slots; ++i) {
+                peer = bus->peers.slots[i];
+                if (!peer)
+                        continue;
+
+                r = handoff_export_peer(s, peer);
+                if (r)
+                        return error_trace(r);
+        }
+
+        /* ownerships are written in queue order, so they are restored in order */
+        c_rbtree_for_each_entry(name, &bus->names.name_tree, registry_node) {
+                c_list_for_each_entry(ownership, &name->ownership_list, name_link) {
+                        peer = c_container_of(ownership->owner, Peer, owned_names);
+
+                        r = serializer_write_u32(s, HANDOFF_RECORD_NAME);
+                        r = r ?: serializer_write_string(s, name->name);
+                        r = r ?: serializer_write_u64(s, peer->id);
+                        r = r ?: serializer_write_u64(s, ownership->flags);
+                        if (r)
+                                return error_trace(r);
+                }
+        }
+
+        for (i = 0; i < bus->peers.n_slots; ++i) {
+                peer = bus->peers.slots[i];
+                if (!peer)
+                        continue;
+
+                c_rbtree_for_each_entry(rule, &peer->owned_matches.rule_tree, owner_node) {
+                        r = serializer_write_u32(s, HANDOFF_RECORD_MATCH);
+                        r = r ?: serializer_write_u64(s, peer->id);
+                        r = r ?: serializer_write_string(s, rule->keys->string);
+                        r = r ?: serializer_write_u64(s, rule->n_user_refs);
+                        if (r)
+                                return error_trace(r);
+                }
+
+                c_list_for_each_entry(slot, &peer->replies_outgoing.reply_list, registry_link) {
+                        r = serializer_write_u32(s, HANDOFF_RECORD_REPLY);
+                        r = r ?: serializer_write_u64(s, peer->id);
+                        r = r ?: serializer_write_u64(s, slot->id);
+                        r = r ?: serializer_write_u32(s, slot->serial);
+                        if (r)
+                                return error_trace(r);
+                }
+        }
+
+        r = serializer_write_u32(s, HANDOFF_RECORD_END);
+        r = r ?: serializer_flush(s);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+/**
+ * handoff_export() - hand the primary bus over to a successor
+ * @broker:             broker to operate on
+ * @fd:                 handoff socket of the successor
+ *
+ * This serializes the state of the primary bus of @broker to @fd, and waits
+ * for the successor on the other end to acknowledge it. On success, all peers
+ * of the bus are dropped silently, and the listeners stop accepting
+ * connections, since the successor took over. On failure, nothing changed.
+ *
+ * Return: 0 on success, HANDOFF_E_UNSUPPORTED if the state of the bus cannot
+ *         be handed over right now, HANDOFF_E_EOF if the successor did not
+ *         take over, negative error code on failure.
+ */
+int handoff_export(Broker *broker, int fd) {
+        Controller *controller = &broker->primary->controller;
+        ControllerListener *listener;
+        Serializer *s = NULL;
+        Deserializer *d = NULL;
+        uint64_t ack;
+        int r;
+
+        r = handoff_check(broker);
+        if (r)
+                return error_trace(r);
+
+        r = handoff_prepare_fd(fd);
+        if (r)
+                return error_trace(r);
+
+        s = malloc(sizeof(*s));
+        d = malloc(sizeof(*d));
+        if (!s || !d) {
+                r = error_origin(-ENOMEM);
+                goto exit;
+        }
+
+        serializer_init(s, fd);
+        deserializer_init(d, fd);
+
+        r = handoff_export_state(broker, s);
+        r = r ?: deserializer_read_u64(d, &ack);
+        if (!r && ack != HANDOFF_MAGIC)
+                r = SERIALIZE_E_CORRUPT;
+        if (r) {
+                if (r == SERIALIZE_E_EOF || r == SERIALIZE_E_CORRUPT)
+                        r = HANDOFF_E_EOF;
+                else
+                        r = error_fold(r);
+        }
+
+        serializer_deinit(s);
+        deserializer_deinit(d);
+
+        if (!r) {
+                peer_registry_flush(&broker->primary->bus.peers);
+
+                c_rbtree_for_each_entry(listener, &controller->listener_tree, controller_node)
+                        dispatch_file_deselect(&listener->listener.socket_file, EPOLLIN);
+        }
+
+exit:
+        free(d);
+        free(s);
+        return r;
+}
+
+static int handoff_fold(int r) {
+        if (r == SERIALIZE_E_EOF)
+                return HANDOFF_E_EOF;
+        else if (r == SERIALIZE_E_CORRUPT)
+                return HANDOFF_E_CORRUPT;
+
+        return error_fold(r);
+}
+
+static int handoff_adopt_guid(Bus *bus, const char *guid) {
+        int r;
+
+        /* the bus ID is part of some constant driver replies */
+        memcpy(bus->guid, guid, sizeof(bus->guid));
+
+        bus->signal_name_owner_changed = message_unref(bus->signal_name_owner_changed);
+        bus->reply_get_id = message_unref(bus->reply_get_id);
+        bus->reply_introspect = message_unref(bus->reply_introspect);
+
+        r = driver_init_replies(bus);
+        if (r)
+                return error_fold(r);
+
+        return 0;
+}
+
+static int handoff_import_listener(Broker *broker, Deserializer *d) {
+        _c_cleanup_(c_freep) char *path = NULL;
+        ControllerListener *listener;
+        char guid[16];
+        int r;
+
+        r = deserializer_read_string(d, &path);
+        r = r ?: deserializer_read(d, guid, sizeof(guid));
+        if (r)
+                return handoff_fold(r);
+
+        listener = controller_find_listener(&broker->primary->controller, path);
+        if (!listener)
+                return HANDOFF_E_UNSUPPORTED;
+
+        memcpy(listener->listener.guid, guid, sizeof(guid));
+        return 0;
+}
+
+static int handoff_import_peer(Broker *broker, Deserializer *d) {
+        _c_cleanup_(c_closep) int fd = -1;
+        _c_cleanup_(c_freep) char *path = NULL;
+        _c_cleanup_(peer_freep) Peer *peer = NULL;
+        ControllerListener *listener;
+        uint32_t flags;
+        uint64_t id;
+        int r;
+
+        r = deserializer_read_fd(d, &fd);
+        r = r ?: deserializer_read_u64(d, &id);
+        r = r ?: deserializer_read_string(d, &path);
+        r = r ?: deserializer_read_u32(d, &flags);
+        if (r)
+                return handoff_fold(r);
+
+        listener = controller_find_listener(&broker->primary->controller, path);
+        if (!listener)
+                return HANDOFF_E_CORRUPT;
+
+        r = peer_new_restored(&peer,
+                              &broker->primary->bus,
+                              &listener->listener,
+                              &broker->dispatcher,
+                              fd,
+                              id,
+                              flags & HANDOFF_PEER_CHECKED);
+        if (r == PEER_E_QUOTA || r == PEER_E_CONNECTION_REFUSED)
+                return HANDOFF_E_UNSUPPORTED;
+        else if (r == PEER_E_ID_EXISTS)
+                return HANDOFF_E_CORRUPT;
+        else if (r)
+                return error_fold(r);
+        fd = -1; /* consume fd */
+
+        r = connection_deserialize(&peer->connection, d);
+        if (r)
+                return (r == CONNECTION_E_CORRUPT) ? HANDOFF_E_CORRUPT : error_fold(r);
+
+        /* the connection might have been closed on restore, due to quotas */
+        if (!socket_is_running(&peer->connection.socket))
+                return 0;
+
+        r = peer_spawn(peer);
+        if (r)
+                return error_fold(r);
+
+        if (flags & HANDOFF_PEER_REGISTERED)
+                peer_register(peer);
+        peer->coalesce_signals = !!(flags & HANDOFF_PEER_COALESCE_SIGNALS);
+        if (flags & HANDOFF_PEER_SHUTDOWN)
+                connection_shutdown(&peer->connection);
+
+        peer = NULL;
+        return 0;
+}
+
+static int handoff_import_name(Broker *broker, Deserializer *d) {
+        Bus *bus = &broker->primary->bus;
+        _c_cleanup_(c_freep) char *name = NULL;
+        uint64_t id, flags;
+        Peer *peer;
+        int r;
+
+        r = deserializer_read_string(d, &name);
+        r = r ?: deserializer_read_u64(d, &id);
+        r = r ?: deserializer_read_u64(d, &flags);
+        if (r)
+                return handoff_fold(r);
+
+        /* state of peers that were not restored is dropped */
+        peer = peer_registry_find_peer(&bus->peers, id);
+        if (!peer)
+                return 0;
+
+        r = name_registry_restore_name(&bus->names, &peer->owned_names, peer->user, name, flags);
+        if (r == NAME_E_QUOTA)
+                return HANDOFF_E_UNSUPPORTED;
+        else if (r == NAME_E_ALREADY_OWNER)
+                return HANDOFF_E_CORRUPT;
+        else if (r)
+                return error_fold(r);
+
+        return 0;
+}
+
+static int handoff_import_match(Broker *broker, Deserializer *d) {
+        Bus *bus = &broker->primary->bus;
+        _c_cleanup_(c_freep) char *rule = NULL;
+        uint64_t id, n_refs;
+        Peer *peer;
+        int r;
+
+        r = deserializer_read_u64(d, &id);
+        r = r ?: deserializer_read_string(d, &rule);
+        r = r ?: deserializer_read_u64(d, &n_refs);
+        if (r)
+                return handoff_fold(r);
+
+        if (!n_refs)
+                return HANDOFF_E_CORRUPT;
+
+        peer = peer_registry_find_peer(&bus->peers, id);
+        if (!peer)
+                return 0;
+
+        while (n_refs--) {
+                r = peer_add_match(peer, rule);
+                if (r == PEER_E_QUOTA)
+                        return HANDOFF_E_UNSUPPORTED;
+                else if (r == PEER_E_MATCH_INVALID)
+                        return HANDOFF_E_CORRUPT;
+                else if (r)
+                        return error_fold(r);
+        }
+
+        return 0;
+}
+
+static int handoff_import_reply(Broker *broker, Deserializer *d) {
+        Bus *bus = &broker->primary->bus;
+        uint64_t receiver_id, sender_id;
+        Peer *receiver, *sender;
+        uint32_t serial;
+        int r;
+
+        r = deserializer_read_u64(d, &receiver_id);
+        r = r ?: deserializer_read_u64(d, &sender_id);
+        r = r ?: deserializer_read_u32(d, &serial);
+        if (r)
+                return handoff_fold(r);
+
+        receiver = peer_registry_find_peer(&bus->peers, receiver_id);
+        sender = peer_registry_find_peer(&bus->peers, sender_id);
+        if (!receiver || !sender)
+                return 0;
+
+        r = peer_restore_reply(receiver, sender, serial);
+        if (r == PEER_E_QUOTA)
+                return HANDOFF_E_UNSUPPORTED;
+        else if (r == PEER_E_EXPECTED_REPLY_EXISTS)
+                return HANDOFF_E_CORRUPT;
+        else if (r)
+                return error_fold(r);
+
+        return 0;
+}
+
+static int handoff_import_state(Broker *broker, Deserializer *d) {
+        Bus *bus = &broker->primary->bus;
+        char guid[sizeof(bus->guid)];
+        uint32_t version, type;
+        uint64_t magic, ids;
+        int r;
+
+        r = deserializer_read_u64(d, &magic);
+        r = r ?: deserializer_read_u32(d, &version);
+        if (r)
+                return handoff_fold(r);
+
+        if (magic != HANDOFF_MAGIC)
+                return HANDOFF_E_CORRUPT;
+        if (version != HANDOFF_VERSION)
+                return HANDOFF_E_UNSUPPORTED;
+
+        r = deserializer_read(d, guid, sizeof(guid));
+        r = r ?: deserializer_read_u64(d, &ids);
+        if (r)
+                return handoff_fold(r);
+
+        r = handoff_adopt_guid(bus, guid);
+        if (r)
+                return error_trace(r);
+
+        bus->peers.ids = c_max(bus->peers.ids, ids);
+
+        for (;;) {
+                r = deserializer_read_u32(d, &type);
+                if (r)
+                        return handoff_fold(r);
+
+                switch (type) {
+                case HANDOFF_RECORD_END:
+                        return 0;
+                case HANDOFF_RECORD_LISTENER:
+                        r = handoff_import_listener(broker, d);
+                        break;
+                case HANDOFF_RECORD_PEER:
+                        r = handoff_import_peer(broker, d);
+                        break;
+                case HANDOFF_RECORD_NAME:
+                        r = handoff_import_name(broker, d);
+                        break;
+                case HANDOFF_RECORD_MATCH:
+                        r = handoff_import_match(broker, d);
+                        break;
+                case HANDOFF_RECORD_REPLY:
+                        r = handoff_import_reply(broker, d);
+                        break;
+                default:
+                        r = HANDOFF_E_CORRUPT;
+                        break;
+                }
+
+                if (r)
+                        return error_trace(r);
+        }
+}
+
+/**
+ * handoff_import() - take over the primary bus of a predecessor
+ * @broker:             broker to operate on
+ * @fd:                 handoff socket
+ *
+ * This restores the state of the primary bus of a predecessor broker, as
+ * sent via handoff_export() on the other end of @fd, and acknowledges it.
+ * The primary bus must be configured like the one of the predecessor, and
+ * must not have any peers, yet. On failure, the state of the bus is
+ * undefined, and the broker must not continue.
+ *
+ * Return: 0 on success, HANDOFF_E_UNSUPPORTED if the state cannot be
+ *         restored, HANDOFF_E_EOF if the predecessor hung up,
+ *         HANDOFF_E_CORRUPT if the state is invalid, negative error code on
+ *         failure.
+ */
+int handoff_import(Broker *broker, int fd) {
+        Serializer *s = NULL;
+        Deserializer *d = NULL;
+        int r;
+
+        if (broker->primary->bus.peers.table.n_entries)
+                return HANDOFF_E_UNSUPPORTED;
+
+        r = handoff_prepare_fd(fd);
+        if (r)
+                return error_trace(r);
+
+        s = malloc(sizeof(*s));
+        d = malloc(sizeof(*d));
+        if (!s || !d) {
+                r = error_origin(-ENOMEM);
+                goto exit;
+        }
+
+        serializer_init(s, fd);
+        deserializer_init(d, fd);
+
+        r = handoff_import_state(broker, d);
+        if (!r) {
+                r = serializer_write_u64(s, HANDOFF_MAGIC);
+                r = r ?: serializer_flush(s);
+                if (r)
+                        r = handoff_fold(r);
+        }
+
+        serializer_deinit(s);
+        deserializer_deinit(d);
+
+exit:
+        free(d);
+        free(s);
+        return error_trace(r);
+}
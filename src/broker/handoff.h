@@ -0,0 +1,24 @@
+#pragma once
+
+/*
+ * Broker Handoff
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+
+typedef struct Broker Broker;
+
+enum {
+        _HANDOFF_E_SUCCESS,
+
+        HANDOFF_E_UNSUPPORTED,
+        HANDOFF_E_EOF,
+        HANDOFF_E_CORRUPT,
+};
+
+#define HANDOFF_MAGIC (0x66666f646e616862ULL) /* "bhandoff" in little-endian */
+#define HANDOFF_VERSION (1U)
+
+int handoff_export(Broker *broker, int fd);
+int handoff_import(Broker *broker, int fd);
@@ -5,20 +5,40 @@
 #include <c-macro.h>
 #include <getopt.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include "broker/broker.h"
 #include "broker/main.h"
+#include "util/audit.h"
 #include "util/error.h"
+#include "util/metrics.h"
 #include "util/selinux.h"
+#include "util/sockopt.h"
 
 int main_arg_controller = 3;
+static int main_arg_handoff = -1;
 uint64_t main_arg_max_bytes = 16 * 1024 * 1024;
 uint64_t main_arg_max_fds = 64;
 uint64_t main_arg_max_matches = 10 * 1024;
 uint64_t main_arg_max_objects = 10 * 1024;
+uint64_t main_arg_max_memfd_bytes = 1024 * 1024 * 1024;
+uint64_t main_arg_reply_timeout = 0;
+uint64_t main_arg_slow_consumer_bytes = 0;
 bool main_arg_verbose = false;
+static cpu_set_t main_arg_cpu_affinity;
+static bool main_arg_cpu_affinity_set = false;
+static uint64_t main_arg_busy_poll = 0;
+static unsigned int main_arg_metrics_sample_rate = 16;
+static bool main_arg_lock_memory = false;
+bool main_arg_io_uring = false;
+static uint64_t main_arg_stall_threshold = 100 * 1000;
+
+/* stack pre-faulted with --lock-memory; well above the deepest dispatch path */
+#define MAIN_STACK_PREFAULT (256UL * 1024UL)
 
 static void help(void) {
         printf("%s [GLOBALS...] ...\n\n"
@@ -27,31 +47,98 @@ static void help(void) {
                "     --version                  Show package version\n"
                "  -v --verbose                  Print progress to terminal\n"
                "     --controller FD            Change controller file-descriptor\n"
+               "     --handoff FD               Take over the connections of a running broker via FD\n"
                "     --max-bytes BYTES          The maximum number of bytes each user may own in the broker\n"
                "     --max-fds FDS              The maximum number of file descriptors each user may own in the broker\n"
                "     --max-matches MATCHES      The maximum number of match rules each user may own in the broker\n"
                "     --max-objects OBJECTS      The maximum total number of names, peers, pending replies, etc each user may own in the broker\n"
+               "     --max-memfd-bytes BYTES    The maximum size of sealed memfds each user may have queued in the broker\n"
+               "     --reply-timeout MSEC       Fail method calls that were not replied to within MSEC milliseconds (0 disables)\n"
+               "     --slow-consumer-bytes BYTES\n"
+               "                                Drop signals to peers with more than BYTES queued, rather than queueing them (0 disables)\n"
+               "     --cpu-affinity CPUS        Pin the broker to the given list of CPUs (e.g., '0,2-3')\n"
+               "     --busy-poll USEC           Poll for up to USEC microseconds before going idle (0 disables)\n"
+               "     --lock-memory              Pre-fault and lock all memory of the broker\n"
+               "     --io-uring                 Dispatch through io_uring, if supported by the kernel\n"
+               "     --metrics-sample-rate N    Measure the CPU time of one in N dispatched messages (default: 16)\n"
+               "     --stall-threshold USEC     Log dispatch callbacks running longer than USEC microseconds (default: 100000, 0 disables)\n"
                , program_invocation_short_name);
 }
 
+static int parse_cpus(const char *list, cpu_set_t *cpus) {
+        unsigned long long first, last;
+        const char *p = list;
+        char *end;
+
+        CPU_ZERO(cpus);
+
+        for (;;) {
+                errno = 0;
+                first = strtoull(p, &end, 10);
+                if (errno != 0 || p == end || *p == '-' || *p == '+')
+                        return -1;
+
+                last = first;
+                if (*end == '-') {
+                        p = end + 1;
+                        last = strtoull(p, &end, 10);
+                        if (errno != 0 || p == end || *p == '-' || *p == '+')
+                                return -1;
+                }
+
+                if (first > last || last >= CPU_SETSIZE)
+                        return -1;
+
+                for ( ; first <= last; ++first)
+                        CPU_SET(first, cpus);
+
+                if (!*end)
+                        return 0;
+                else if (*end != ',')
+                        return -1;
+
+                p = end + 1;
+        }
+}
+
 static int parse_argv(int argc, char *argv[]) {
         enum {
                 ARG_VERSION = 0x100,
                 ARG_CONTROLLER,
+                ARG_HANDOFF,
                 ARG_MAX_BYTES,
                 ARG_MAX_FDS,
                 ARG_MAX_MATCHES,
                 ARG_MAX_OBJECTS,
+                ARG_REPLY_TIMEOUT,
+                ARG_SLOW_CONSUMER_BYTES,
+                ARG_MAX_MEMFD_BYTES,
+                ARG_CPU_AFFINITY,
+                ARG_BUSY_POLL,
+                ARG_LOCK_MEMORY,
+                ARG_IO_URING,
+                ARG_METRICS_SAMPLE_RATE,
+                ARG_STALL_THRESHOLD,
         };
         static const struct option options[] = {
                 { "help",               no_argument,            NULL,   'h'                     },
                 { "version",            no_argument,            NULL,   ARG_VERSION             },
                 { "verbose",            no_argument,            NULL,   'v'                     },
                 { "controller",         required_argument,      NULL,   ARG_CONTROLLER          },
+                { "handoff",            required_argument,      NULL,   ARG_HANDOFF             },
                 { "max-bytes",          required_argument,      NULL,   ARG_MAX_BYTES           },
                 { "max-fds",            required_argument,      NULL,   ARG_MAX_FDS             },
                 { "max-matches",        required_argument,      NULL,   ARG_MAX_MATCHES         },
                 { "max-objects",        required_argument,      NULL,   ARG_MAX_OBJECTS         },
+                { "reply-timeout",      required_argument,      NULL,   ARG_REPLY_TIMEOUT       },
+                { "slow-consumer-bytes", required_argument,     NULL,   ARG_SLOW_CONSUMER_BYTES },
+                { "max-memfd-bytes",    required_argument,      NULL,   ARG_MAX_MEMFD_BYTES     },
+                { "cpu-affinity",       required_argument,      NULL,   ARG_CPU_AFFINITY        },
+                { "busy-poll",          required_argument,      NULL,   ARG_BUSY_POLL           },
+                { "lock-memory",        no_argument,            NULL,   ARG_LOCK_MEMORY         },
+                { "io-uring",           no_argument,            NULL,   ARG_IO_URING            },
+                { "metrics-sample-rate", required_argument,     NULL,   ARG_METRICS_SAMPLE_RATE },
+                { "stall-threshold",    required_argument,      NULL,   ARG_STALL_THRESHOLD     },
                 {}
         };
         int r, c;
@@ -85,6 +172,21 @@ static int parse_argv(int argc, char *argv[]) {
                         break;
                 }
 
+                case ARG_HANDOFF: {
+                        unsigned long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoul(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul > INT_MAX) {
+                                fprintf(stderr, "%s: invalid handoff file-descriptor -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_handoff = vul;
+                        break;
+                }
+
                 case ARG_MAX_BYTES: {
                         unsigned long long vul;
                         char *end;
@@ -145,6 +247,113 @@ static int parse_argv(int argc, char *argv[]) {
                         break;
                 }
 
+                case ARG_REPLY_TIMEOUT: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul > UINT64_MAX / 1000) {
+                                fprintf(stderr, "%s: invalid reply timeout -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_reply_timeout = vul;
+                        break;
+                }
+
+                case ARG_SLOW_CONSUMER_BYTES: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end) {
+                                fprintf(stderr, "%s: invalid slow consumer number of bytes -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_slow_consumer_bytes = vul;
+                        break;
+                }
+
+                case ARG_MAX_MEMFD_BYTES: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end) {
+                                fprintf(stderr, "%s: invalid max number of memfd bytes -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_max_memfd_bytes = vul;
+                        break;
+                }
+
+                case ARG_CPU_AFFINITY:
+                        if (parse_cpus(optarg, &main_arg_cpu_affinity)) {
+                                fprintf(stderr, "%s: invalid CPU list -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_cpu_affinity_set = true;
+                        break;
+
+                case ARG_BUSY_POLL: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul > UINT32_MAX) {
+                                fprintf(stderr, "%s: invalid busy-poll interval -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_busy_poll = vul;
+                        break;
+                }
+
+                case ARG_LOCK_MEMORY:
+                        main_arg_lock_memory = true;
+                        break;
+
+                case ARG_IO_URING:
+                        main_arg_io_uring = true;
+                        break;
+
+                case ARG_METRICS_SAMPLE_RATE: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul < 1 || vul > UINT32_MAX) {
+                                fprintf(stderr, "%s: invalid metrics sample rate -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_metrics_sample_rate = vul;
+                        break;
+                }
+
+                case ARG_STALL_THRESHOLD: {
+                        unsigned long long vul;
+                        char *end;
+
+                        errno = 0;
+                        vul = strtoull(optarg, &end, 10);
+                        if (errno != 0 || *end || optarg == end || vul > UINT32_MAX) {
+                                fprintf(stderr, "%s: invalid stall threshold -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_stall_threshold = vul;
+                        break;
+                }
+
                 case '?':
                         /* getopt_long() prints warning */
                         return MAIN_FAILED;
@@ -186,6 +395,71 @@ static int parse_argv(int argc, char *argv[]) {
                 }
         }
 
+        /* same for the optional handoff-fd */
+        if (main_arg_handoff >= 0) {
+                socklen_t n;
+                int v1, v2;
+
+                n = sizeof(v1);
+                r = getsockopt(main_arg_handoff, SOL_SOCKET, SO_DOMAIN, &v1, &n);
+                n = sizeof(v2);
+                r = r ?: getsockopt(main_arg_handoff, SOL_SOCKET, SO_TYPE, &v2, &n);
+
+                if (r < 0) {
+                        if (errno != EBADF && errno != ENOTSOCK)
+                                return error_origin(-errno);
+
+                        fprintf(stderr, "%s: handoff file-descriptor not a socket -- '%d'\n", program_invocation_name, main_arg_handoff);
+                        return MAIN_FAILED;
+                } else if (v1 != AF_UNIX || v2 != SOCK_SEQPACKET) {
+                        fprintf(stderr, "%s: socket type of handoff file-descriptor not supported -- '%d'\n", program_invocation_name, main_arg_handoff);
+                        return MAIN_FAILED;
+                } else if (main_arg_handoff == main_arg_controller) {
+                        fprintf(stderr, "%s: handoff file-descriptor is the controller -- '%d'\n", program_invocation_name, main_arg_handoff);
+                        return MAIN_FAILED;
+                }
+        }
+
+        return 0;
+}
+
+static void prefault_stack(void) {
+        volatile char buffer[MAIN_STACK_PREFAULT];
+        size_t i;
+
+        for (i = 0; i < sizeof(buffer); i += 4096)
+                buffer[i] = 0;
+}
+
+static int setup_runtime(void) {
+        /*
+         * The dispatch loop runs on the main thread only. All helper threads
+         * (the audit queue and the group refresh of the NSS fallback) are
+         * spawned in run() before this, and thus keep the default affinity,
+         * so they never compete for the CPUs of the dispatch loop.
+         */
+        if (main_arg_cpu_affinity_set) {
+                if (sched_setaffinity(0, sizeof(main_arg_cpu_affinity), &main_arg_cpu_affinity) < 0) {
+                        if (errno != EINVAL && errno != EPERM)
+                                return error_origin(-errno);
+
+                        fprintf(stderr, "%s: cannot set CPU affinity -- %s\n", program_invocation_name, strerror(errno));
+                        return MAIN_FAILED;
+                }
+        }
+
+        if (main_arg_lock_memory) {
+                if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+                        if (errno != ENOMEM && errno != EPERM)
+                                return error_origin(-errno);
+
+                        fprintf(stderr, "%s: cannot lock memory -- %s\n", program_invocation_name, strerror(errno));
+                        return MAIN_FAILED;
+                }
+
+                prefault_stack();
+        }
+
         return 0;
 }
 
@@ -193,15 +467,38 @@ static int run(void) {
         _c_cleanup_(broker_freep) Broker *broker = NULL;
         int r;
 
-        r = bus_selinux_init_global();
+        r = util_audit_init_global();
         if (r)
                 return error_fold(r);
 
-        r = broker_new(&broker, main_arg_controller, main_arg_max_bytes, main_arg_max_fds, main_arg_max_matches, main_arg_max_objects);
+        r = bus_selinux_init_global();
+        if (r) {
+                util_audit_deinit_global();
+                return error_fold(r);
+        }
+
+        /* calibrate the cycle counter before the first message is timed */
+        metrics_calibrate();
+
+        r = sockopt_init_global();
         if (!r)
-                r = broker_run(broker);
+                r = setup_runtime();
+        if (!r)
+                r = broker_new(&broker, main_arg_controller, main_arg_max_bytes, main_arg_max_fds, main_arg_max_matches, main_arg_max_objects, main_arg_max_memfd_bytes);
+        if (!r) {
+                broker->dispatcher.busy_poll_usec = main_arg_busy_poll;
+                broker->dispatcher.stall_nsec = main_arg_stall_threshold * 1000;
+                broker->primary->bus.reply_timeout = main_arg_reply_timeout * 1000;
+                broker->primary->bus.slow_consumer_bytes = main_arg_slow_consumer_bytes;
+                metrics_set_sample_rate(&broker->primary->bus.metrics, main_arg_metrics_sample_rate);
+                if (main_arg_handoff >= 0)
+                        r = broker_set_handoff(broker, main_arg_handoff);
+                if (!r)
+                        r = broker_run(broker);
+        }
 
         bus_selinux_deinit_global();
+        util_audit_deinit_global();
 
         return error_trace(r);
 }
@@ -15,3 +15,4 @@ enum {
 
 extern int main_arg_controller;
 extern bool main_arg_verbose;
+extern bool main_arg_io_uring;
@@ -27,12 +27,72 @@ ActivationRequest *activation_request_free(ActivationRequest *request) {
 
 C_DEFINE_CLEANUP(ActivationRequest *, activation_request_free);
 
+static int activation_sender_new(ActivationSender **senderp,
+                                 uint64_t id,
+                                 uint64_t generation,
+                                 NameOwner *names,
+                                 PolicySnapshot *policy) {
+        _c_cleanup_(activation_sender_unrefp) ActivationSender *sender = NULL;
+        int r;
+
+        sender = calloc(1, sizeof(*sender));
+        if (!sender)
+                return error_origin(-ENOMEM);
+
+        sender->n_refs = 1;
+        sender->id = id;
+        sender->generation = generation;
+
+        sender->policy = policy_snapshot_ref(policy);
+
+        r = name_snapshot_new(&sender->names, names);
+        if (r)
+                return error_fold(r);
+
+        *senderp = sender;
+        sender = NULL;
+        return 0;
+}
+
+/**
+ * activation_sender_ref() - acquire reference to sender snapshot
+ * @sender:             sender snapshot to operate on, or NULL
+ *
+ * Return: @sender is returned.
+ */
+ActivationSender *activation_sender_ref(ActivationSender *sender) {
+        if (sender)
+                ++sender->n_refs;
+        return sender;
+}
+
+/**
+ * activation_sender_unref() - release reference to sender snapshot
+ * @sender:             sender snapshot to operate on, or NULL
+ *
+ * Return: NULL is returned.
+ */
+ActivationSender *activation_sender_unref(ActivationSender *sender) {
+        if (!sender || --sender->n_refs)
+                return NULL;
+
+        name_snapshot_free(sender->names);
+        policy_snapshot_unref(sender->policy);
+        free(sender);
+
+        return NULL;
+}
+
 ActivationMessage *activation_message_free(ActivationMessage *message) {
         if (!message)
                 return NULL;
 
-        name_snapshot_free(message->senders_names);
-        policy_snapshot_free(message->senders_policy);
+        if (message->activation) {
+                --message->activation->n_messages;
+                message->activation->n_bytes -= message->message->n_data;
+        }
+
+        activation_sender_unref(message->sender);
         message_unref(message->message);
         c_list_unlink_init(&message->link);
         user_charge_deinit(&message->charges[1]);
@@ -59,6 +119,7 @@ int activation_init(Activation *a, Name *name, User *user) {
         activation->user = user_ref(user);
 
         name->activation = activation;
+        ++name->registry->activation_generation;
         activation = NULL;
         return 0;
 }
@@ -76,6 +137,7 @@ void activation_deinit(Activation *activation) {
 
         if (activation->name) {
                 activation->name->activation = NULL;
+                ++activation->name->registry->activation_generation;
                 activation->name = name_unref(activation->name);
         }
 }
@@ -106,17 +168,46 @@ int activation_flush(Activation *activation) {
         while ((request = c_list_first_entry(&activation->activation_requests, ActivationRequest, link)))
                 activation_request_free(request);
 
+        /* the activation failed, so a new request must trigger it again */
+        activation->requested = false;
+
         return 0;
 }
 
+/**
+ * activation_queue_message() - queue message until the name is activated
+ * @activation:         activation to operate on
+ * @user:               user to charge
+ * @names:              names owned by the sender
+ * @policy:             policy of the sender
+ * @generation:         current name-ownership generation of the bus
+ * @m:                  message to queue
+ *
+ * This queues @m on @activation, together with a snapshot of the names and
+ * policy of its sender, and requests activation of the name. The snapshot is
+ * shared with the previously queued message if it came from the same sender,
+ * and @generation did not change in between.
+ *
+ * The number of pending messages and their size is bounded per activatable
+ * name, by ACTIVATION_MESSAGES_MAX and ACTIVATION_BYTES_MAX respectively.
+ *
+ * Return: 0 on success, ACTIVATION_E_QUOTA if the limits of @activation or
+ *         the quota of @user are exceeded, negative error code on failure.
+ */
 int activation_queue_message(Activation *activation,
                              User *user,
                              NameOwner *names,
                              PolicySnapshot *policy,
+                             uint64_t generation,
                              Message *m) {
         _c_cleanup_(activation_message_freep) ActivationMessage *message = NULL;
+        ActivationMessage *last;
         int r;
 
+        if (activation->n_messages >= ACTIVATION_MESSAGES_MAX ||
+            m->n_data > ACTIVATION_BYTES_MAX - activation->n_bytes)
+                return ACTIVATION_E_QUOTA;
+
         r = activation_request(activation);
         if (r)
                 return error_trace(r);
@@ -132,21 +223,31 @@ int activation_queue_message(Activation *activation,
         message->message = message_ref(m);
 
         r = user_charge(activation->user, &message->charges[0], user, USER_SLOT_BYTES,
-                        sizeof(ActivationMessage) + sizeof(Message) + m->n_data);
+                        sizeof(ActivationMessage) + message_get_footprint(m));
         r = r ?: user_charge(activation->user, &message->charges[1], user, USER_SLOT_FDS,
                              fdlist_count(m->fds));
         if (r)
                 return (r == USER_E_QUOTA) ? ACTIVATION_E_QUOTA : error_fold(r);
 
-        r = policy_snapshot_dup(policy, &message->senders_policy);
-        if (r)
-                return error_fold(r);
-
-        r = name_snapshot_new(&message->senders_names, names);
-        if (r)
-                return error_fold(r);
+        /*
+         * Senders tend to send bursts of messages to a service that is being
+         * activated, so share the snapshot with the previous message if
+         * nothing changed in between. Policies of peers never change, so the
+         * name-ownership generation is sufficient to detect this.
+         */
+        last = c_list_last_entry(&activation->activation_messages, ActivationMessage, link);
+        if (last && last->sender->id == m->sender_id && last->sender->generation == generation) {
+                message->sender = activation_sender_ref(last->sender);
+        } else {
+                r = activation_sender_new(&message->sender, m->sender_id, generation, names, policy);
+                if (r)
+                        return error_trace(r);
+        }
 
         c_list_link_tail(&activation->activation_messages, &message->link);
+        message->activation = activation;
+        ++activation->n_messages;
+        activation->n_bytes += m->n_data;
         message = NULL;
         return 0;
 }
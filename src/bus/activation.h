@@ -13,11 +13,16 @@
 typedef struct Activation Activation;
 typedef struct ActivationMessage ActivationMessage;
 typedef struct ActivationRequest ActivationRequest;
+typedef struct ActivationSender ActivationSender;
 typedef struct Message Message;
 typedef struct Name Name;
 typedef struct NameOwner NameOwner;
 typedef struct NameSnapshot NameSnapshot;
 
+/* max pending messages per activatable name; a backstop, user quotas apply first */
+#define ACTIVATION_MESSAGES_MAX (16UL * 1024UL)
+#define ACTIVATION_BYTES_MAX (64UL * 1024UL * 1024UL)
+
 enum {
         _ACTIVATION_E_SUCCESS,
 
@@ -33,13 +38,21 @@ struct ActivationRequest {
         CList link;
 };
 
+struct ActivationSender {
+        unsigned long n_refs;
+        uint64_t id;
+        uint64_t generation;
+        PolicySnapshot *policy;
+        NameSnapshot *names;
+};
+
 struct ActivationMessage {
+        Activation *activation;
         User *user;
         UserCharge charges[2];
         CList link;
         Message *message;
-        PolicySnapshot *senders_policy;
-        NameSnapshot *senders_names;
+        ActivationSender *sender;
 };
 
 struct Activation {
@@ -47,6 +60,8 @@ struct Activation {
         User *user;
         CList activation_messages;
         CList activation_requests;
+        size_t n_messages;
+        size_t n_bytes;
         bool requested : 1;
 };
 
@@ -59,6 +74,13 @@ struct Activation {
 
 ActivationRequest *activation_request_free(ActivationRequest *request);
 
+/* senders */
+
+ActivationSender *activation_sender_ref(ActivationSender *sender);
+ActivationSender *activation_sender_unref(ActivationSender *sender);
+
+C_DEFINE_CLEANUP(ActivationSender *, activation_sender_unref);
+
 /* messages */
 
 ActivationMessage *activation_message_free(ActivationMessage *message);
@@ -72,6 +94,7 @@ int activation_queue_message(Activation *activation,
                              User *user,
                              NameOwner *names,
                              PolicySnapshot *policy,
+                             uint64_t generation,
                              Message *m);
 int activation_queue_request(Activation *activation, User *user, uint64_t sender_id, uint32_t serial);
 
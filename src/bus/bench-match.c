@@ -0,0 +1,142 @@
+/*
+ * Benchmark Match Handling
+ */
+
+#include <c-macro.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bus/match.h"
+#include "dbus/protocol.h"
+#include "util/atom.h"
+
+#define BENCH_NSEC_MIN (UINT64_C(100) * 1000 * 1000)
+
+static uint64_t bench_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, size_t n_rules, size_t n_ops, uint64_t nsec) {
+        printf("{ \"benchmark\": \"%s\", \"rules\": %zu, \"operations\": %zu, \"nsec\": %llu, \"nsec_per_op\": %llu }\n",
+               name,
+               n_rules,
+               n_ops,
+               (unsigned long long)nsec,
+               (unsigned long long)(n_ops ? nsec / n_ops : 0));
+        fflush(stdout);
+}
+
+static void bench_match(const char *name, AtomRegistry *atoms, const char *format, size_t n_rules) {
+        MatchKeysRegistry keys = MATCH_KEYS_REGISTRY_INIT(atoms);
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchFilter filter = MATCH_FILTER_INIT;
+        MatchRule *rule, **rules;
+        MatchOwner owner;
+        size_t i, n_iterations = 0, n_matches = 0;
+        char buffer[MATCH_RULE_LENGTH_MAX];
+        uint64_t ts, now;
+        int r;
+
+        /*
+         * Create @n_rules rules from @format, each differing in a single
+         * number, and link them all into one registry. Then dispatch a filter
+         * that matches exactly one of them, until at least BENCH_NSEC_MIN
+         * passed.
+         */
+
+        rules = calloc(n_rules, sizeof(*rules));
+        assert(rules);
+
+        match_owner_init(&owner);
+
+        for (i = 0; i < n_rules; ++i) {
+                r = snprintf(buffer, sizeof(buffer), format, i, i);
+                assert(r > 0 && r < (int)sizeof(buffer));
+
+                r = match_owner_ref_rule(&owner, &rules[i], NULL, &keys, buffer);
+                assert(!r);
+
+                match_rule_link(rules[i], &registry, false);
+        }
+
+        filter.type = DBUS_MESSAGE_TYPE_SIGNAL;
+        filter.path = "/org/bus1/Bench/0";
+        filter.interface = "org.bus1.Bench0";
+        filter.member = "Signal";
+        filter.args[0] = "org.bus1.Bench0";
+        filter.args[1] = "0";
+        filter.argpaths[0] = "/org/bus1/Bench/0/";
+
+        if (atoms) {
+                filter.atoms = atoms;
+                filter.path = atom_registry_resolve(atoms, filter.path);
+                filter.interface = atom_registry_resolve(atoms, filter.interface);
+                filter.member = atom_registry_resolve(atoms, filter.member);
+        }
+
+        ts = bench_now();
+
+        do {
+                for (rule = match_rule_next_match(&registry, NULL, &filter);
+                     rule;
+                     rule = match_rule_next_match(&registry, rule, &filter))
+                        ++n_matches;
+
+                ++n_iterations;
+                now = bench_now();
+        } while (now - ts < BENCH_NSEC_MIN);
+
+        bench_report(name, n_rules, n_iterations, now - ts);
+
+        assert(n_matches == n_iterations);
+
+        for (i = 0; i < n_rules; ++i)
+                match_rule_user_unref(rules[i]);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+        match_keys_registry_deinit(&keys);
+        free(rules);
+}
+
+int main(int argc, char **argv) {
+        static const size_t n_rules[] = { 10, 100, 1000, 10000, 100000 };
+        AtomRegistry atoms = ATOM_REGISTRY_INIT;
+        size_t i;
+
+        for (i = 0; i < C_ARRAY_SIZE(n_rules); ++i) {
+                /* rules that can be looked up via the interface index */
+                bench_match("match-interface-unatomized",
+                            NULL,
+                            "type=signal,interface=org.bus1.Bench%zu,member=Signal,path=/org/bus1/Bench/%zu",
+                            n_rules[i]);
+                bench_match("match-interface-indexed",
+                            &atoms,
+                            "type=signal,interface=org.bus1.Bench%zu,member=Signal,path=/org/bus1/Bench/%zu",
+                            n_rules[i]);
+
+                /* rules that only differ in their arguments, hence are not indexed */
+                bench_match("match-arg0",
+                            &atoms,
+                            "type=signal,arg0=org.bus1.Bench%zu,arg1=%zu",
+                            n_rules[i]);
+
+                /* rules that can be looked up via the path indices */
+                bench_match("match-path-namespace",
+                            &atoms,
+                            "type=signal,path_namespace=/org/bus1/Bench/%zu,arg1=%zu",
+                            n_rules[i]);
+                bench_match("match-argpath",
+                            &atoms,
+                            "type=signal,arg0path=/org/bus1/Bench/%zu/,arg1=%zu",
+                            n_rules[i]);
+        }
+
+        atom_registry_deinit(&atoms);
+        return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Benchmark Policy Evaluation
+ */
+
+#include <c-dvar.h>
+#include <c-dvar-type.h>
+#include <c-macro.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bus/policy.h"
+#include "dbus/protocol.h"
+
+#define BENCH_NSEC_MIN (UINT64_C(100) * 1000 * 1000)
+
+#define BENCH_POLICY_T_BATCH                                                    \
+                "bt"                                                            \
+                "a(btbs)"                                                       \
+                "a(btssssub)"                                                   \
+                "a(btssssub)"
+
+#define BENCH_POLICY_T                                                          \
+                "(" BENCH_POLICY_T_BATCH ")"                                    \
+                "a(u(" BENCH_POLICY_T_BATCH "))"                                \
+                "a(u(" BENCH_POLICY_T_BATCH "))"                                \
+                "a(ss)"
+
+static uint64_t bench_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, size_t n_rules, size_t n_ops, uint64_t nsec) {
+        printf("{ \"benchmark\": \"%s\", \"rules\": %zu, \"operations\": %zu, \"nsec\": %llu, \"nsec_per_op\": %llu }\n",
+               name,
+               n_rules,
+               n_ops,
+               (unsigned long long)nsec,
+               (unsigned long long)(n_ops ? nsec / n_ops : 0));
+        fflush(stdout);
+}
+
+static void bench_policy_write_batch(CDVar *v, size_t n_rules) {
+        char interface[64];
+        size_t i;
+        int r;
+
+        c_dvar_write(v, "(bt[][", true, UINT64_C(1));
+
+        /*
+         * Allow everything, except for @n_rules interfaces on the driver, which
+         * are denied. Half of them are indexed by interface, the other half is
+         * restricted to a member, to cover both code-paths.
+         */
+        c_dvar_write(v, "(btssssub)", true, UINT64_C(1), "", "", "", "", 0, false);
+
+        for (i = 0; i < n_rules; ++i) {
+                r = snprintf(interface, sizeof(interface), "org.bus1.Bench%zu", i);
+                assert(r > 0 && r < (int)sizeof(interface));
+
+                c_dvar_write(v, "(btssssub)",
+                             false,
+                             UINT64_C(2) + i,
+                             "org.freedesktop.DBus",
+                             (i % 2) ? "/org/bus1/Bench" : "",
+                             interface,
+                             (i % 2) ? "Method" : "",
+                             (i % 2) ? DBUS_MESSAGE_TYPE_METHOD_CALL : 0,
+                             false);
+        }
+
+        c_dvar_write(v, "][(btssssub)])", true, UINT64_C(1), "", "", "", "", 0, false);
+}
+
+static void bench_policy_import(PolicyRegistry *registry, size_t n_rules) {
+        _c_cleanup_(c_dvar_type_freep) CDVarType *type = NULL, *policy_type = NULL;
+        _c_cleanup_(c_dvar_deinit) CDVar writer = C_DVAR_INIT, reader = C_DVAR_INIT;
+        _c_cleanup_(c_freep) void *data = NULL;
+        size_t n_data;
+        int r;
+
+        r = c_dvar_type_new_from_string(&type, "(v)");
+        assert(!r);
+
+        r = c_dvar_type_new_from_string(&policy_type, "(" BENCH_POLICY_T ")");
+        assert(!r);
+
+        c_dvar_begin_write(&writer, type, 1);
+        c_dvar_write(&writer, "(<(", policy_type);
+        bench_policy_write_batch(&writer, n_rules);
+        c_dvar_write(&writer, "[][][])>)");
+
+        r = c_dvar_end_write(&writer, &data, &n_data);
+        assert(!r);
+
+        c_dvar_begin_read(&reader, c_dvar_is_big_endian(&writer), type, 1, data, n_data);
+        c_dvar_read(&reader, "(");
+
+        r = policy_registry_import(registry, &reader);
+        assert(!r);
+
+        c_dvar_read(&reader, ")");
+
+        r = c_dvar_end_read(&reader);
+        assert(!r);
+}
+
+static void bench_policy(size_t n_rules) {
+        _c_cleanup_(policy_registry_freep) PolicyRegistry *registry = NULL;
+        _c_cleanup_(policy_snapshot_unrefp) PolicySnapshot *snapshot = NULL;
+        size_t n_iterations = 0;
+        char interface[64];
+        uint64_t ts, now;
+        int r;
+
+        r = policy_registry_new(&registry, NULL);
+        assert(!r);
+
+        ts = bench_now();
+        bench_policy_import(registry, n_rules);
+        bench_report("policy-import", n_rules, 1, bench_now() - ts);
+
+        r = policy_snapshot_new(&snapshot, registry, NULL, 1, NULL, 0);
+        assert(!r);
+
+        /* pick an interface that is denied, but only for one member */
+        r = snprintf(interface, sizeof(interface), "org.bus1.Bench%zu", n_rules ? n_rules - 1 : 0);
+        assert(r > 0 && r < (int)sizeof(interface));
+
+        ts = bench_now();
+
+        do {
+                r = policy_snapshot_check_send(snapshot,
+                                               NULL,
+                                               NULL,
+                                               interface,
+                                               "Method",
+                                               "/org/bus1/Bench",
+                                               DBUS_MESSAGE_TYPE_METHOD_CALL);
+                assert(r == (n_rules ? POLICY_E_ACCESS_DENIED : 0));
+
+                ++n_iterations;
+                now = bench_now();
+        } while (now - ts < BENCH_NSEC_MIN);
+
+        bench_report("policy-check-send", n_rules, n_iterations, now - ts);
+}
+
+int main(int argc, char **argv) {
+        static const size_t n_rules[] = { 10, 100, 1000, 10000, 100000 };
+        size_t i;
+
+        for (i = 0; i < C_ARRAY_SIZE(n_rules); ++i)
+                bench_policy(n_rules[i]);
+
+        return 0;
+}
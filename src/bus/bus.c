@@ -3,7 +3,10 @@
  */
 
 #include <c-macro.h>
+#include <c-rbtree.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/auxv.h>
 #include <sys/socket.h>
 #include "bus/bus.h"
@@ -11,19 +14,25 @@
 #include "bus/match.h"
 #include "bus/name.h"
 #include "dbus/address.h"
+#include "dbus/message.h"
+#include "util/dispatch.h"
 #include "util/error.h"
 #include "util/user.h"
 
 int bus_init(Bus *bus,
+             AtomRegistry *atoms,
              unsigned int max_bytes,
              unsigned int max_fds,
              unsigned int max_matches,
-             unsigned int max_objects) {
-        unsigned int maxima[] = { max_bytes, max_fds, max_matches, max_objects };
+             unsigned int max_objects,
+             unsigned int max_memfd_bytes) {
+        unsigned int maxima[] = { max_bytes, max_fds, max_matches, max_objects, max_memfd_bytes };
         void *random;
         int r;
 
         *bus = (Bus)BUS_NULL(*bus);
+        bus->atoms = atoms;
+        bus->match_keys = (MatchKeysRegistry)MATCH_KEYS_REGISTRY_INIT(atoms);
 
         random = (void *)getauxval(AT_RANDOM);
         assert(random);
@@ -36,18 +45,195 @@ int bus_init(Bus *bus,
         if (r)
                 return error_fold(r);
 
+        r = driver_init_replies(bus);
+        if (r)
+                return error_trace(r);
+
         return 0;
 }
 
 void bus_deinit(Bus *bus) {
+        bus_name_list_deinit(&bus->list_activatable_names);
+        bus_name_list_deinit(&bus->list_names);
+        bus->stall = (BusStall)BUS_STALL_NULL;
+        bus->signal_name_owner_changed = message_unref(bus->signal_name_owner_changed);
+        bus->reply_get_id = message_unref(bus->reply_get_id);
+        bus->reply_introspect = message_unref(bus->reply_introspect);
+        free(bus->priorities);
+        bus->priorities = NULL;
+        bus->n_priorities = 0;
         bus->pid = 0;
         bus->user = user_unref(bus->user);
+        histogram_deinit(&bus->histogram_write);
+        histogram_deinit(&bus->histogram_driver);
+        histogram_deinit(&bus->histogram_dispatch);
         metrics_deinit(&bus->metrics);
+        traffic_registry_deinit(&bus->traffic);
         peer_registry_deinit(&bus->peers);
         user_registry_deinit(&bus->users);
         name_registry_deinit(&bus->names);
         match_registry_deinit(&bus->driver_matches);
         match_registry_deinit(&bus->wildcard_matches);
+        match_keys_registry_deinit(&bus->match_keys);
+        bus->atoms = NULL;
+}
+
+/**
+ * bus_name_list_deinit() - drop cached name list
+ * @list:               name list to operate on
+ *
+ * This releases the cached reply of @list, if any, and resets it. The list
+ * is rebuilt by the driver on the next request.
+ */
+void bus_name_list_deinit(BusNameList *list) {
+        message_unref(list->reply);
+        free(list->names);
+        *list = (BusNameList)BUS_NAME_LIST_NULL;
+}
+
+static void bus_stall_copy(char *dst, const char *src) {
+        size_t n;
+
+        n = src ? strnlen(src, BUS_STALL_STRING_MAX) : 0;
+        memcpy(dst, src, n);
+        dst[n] = 0;
+}
+
+/**
+ * bus_note_stall() - remember a candidate for stall attribution
+ * @bus:                bus to operate on
+ * @generation:         dispatch callback the message was handled in
+ * @peer:               peer that sent the message
+ * @message:            message that was dispatched
+ * @nsec:               time spent dispatching @message
+ * @n_fanout:           number of receivers @message was broadcast to
+ *
+ * This records @message as the culprit of the dispatch callback @generation,
+ * unless a more expensive message was already recorded for it. If the
+ * callback ends up stalling the event loop, the record is logged via
+ * bus_log_stall(). Records of earlier callbacks are simply overwritten, so
+ * nothing ever has to be cleaned up.
+ */
+void bus_note_stall(Bus *bus, uint64_t generation, Peer *peer, Message *message, uint64_t nsec, uint64_t n_fanout) {
+        BusStall *stall = &bus->stall;
+
+        if (stall->generation == generation && stall->nsec >= nsec)
+                return;
+
+        stall->generation = generation;
+        stall->nsec = nsec;
+        stall->peer_id = peer->id;
+        stall->n_fanout = n_fanout;
+        bus_stall_copy(stall->interface, message->metadata.fields.interface);
+        bus_stall_copy(stall->member, message->metadata.fields.member);
+}
+
+/**
+ * bus_log_stall() - log attribution of a stalled dispatch callback
+ * @bus:                bus to operate on
+ * @generation:         dispatch callback that stalled
+ * @nsec:               time the callback took
+ *
+ * This logs the culprit recorded via bus_note_stall() for the dispatch
+ * callback @generation, if any, and then drops the record. The peer is looked
+ * up again, to report its primary well-known name, if it still has one.
+ *
+ * Return: True if the stall was attributed, false if nothing was recorded.
+ */
+bool bus_log_stall(Bus *bus, uint64_t generation, uint64_t nsec) {
+        BusStall *stall = &bus->stall;
+        NameOwnership *ownership;
+        const char *name = NULL;
+        Peer *peer;
+
+        if (!stall->nsec || stall->generation != generation)
+                return false;
+
+        peer = peer_registry_find_peer(&bus->peers, stall->peer_id);
+        if (peer) {
+                c_rbtree_for_each_entry(ownership, &peer->owned_names.ownership_tree, owner_node) {
+                        if (name_ownership_is_primary(ownership)) {
+                                name = ownership->name->name;
+                                break;
+                        }
+                }
+        }
+
+        fprintf(stderr,
+                "Dispatch stalled for %llu us: %s (%s) spent %llu us in %s%s%s, broadcast to %llu receivers\n",
+                (unsigned long long)(nsec / 1000),
+                address_to_string(&(Address)ADDRESS_INIT_ID(stall->peer_id)),
+                name ?: (peer ? "no name" : "disconnected"),
+                (unsigned long long)(stall->nsec / 1000),
+                stall->interface,
+                stall->interface[0] ? "." : "",
+                stall->member,
+                (unsigned long long)stall->n_fanout);
+
+        *stall = (BusStall)BUS_STALL_NULL;
+        return true;
+}
+
+/**
+ * bus_set_user_priority() - set dispatch priority of a user
+ * @bus:                bus to operate on
+ * @uid:                user to set priority of
+ * @priority:           DISPATCH_PRIORITY_* to use
+ *
+ * This sets the dispatch priority of all peers of the user @uid. It applies
+ * to all registered peers of the user right away, as well as to all peers
+ * of the user registering in the future. Peers are always dispatched with low
+ * priority until they are registered.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus_set_user_priority(Bus *bus, uint32_t uid, unsigned int priority) {
+        BusPriority *priorities;
+        Peer *peer;
+        size_t i;
+
+        for (i = 0; i < bus->n_priorities; ++i)
+                if (bus->priorities[i].uid == uid)
+                        break;
+
+        if (priority == DISPATCH_PRIORITY_NORMAL) {
+                if (i < bus->n_priorities)
+                        bus->priorities[i] = bus->priorities[--bus->n_priorities];
+        } else if (i < bus->n_priorities) {
+                bus->priorities[i].priority = priority;
+        } else {
+                priorities = realloc(bus->priorities, (bus->n_priorities + 1) * sizeof(*priorities));
+                if (!priorities)
+                        return error_origin(-ENOMEM);
+
+                bus->priorities = priorities;
+                bus->priorities[bus->n_priorities++] = (BusPriority){ .uid = uid, .priority = priority };
+        }
+
+        for (i = 0; i < bus->peers.n_slots; ++i) {
+                peer = bus->peers.slots[i];
+                if (peer && peer->registered && peer->user->uid == uid)
+                        dispatch_file_set_priority(&peer->connection.socket_file, priority);
+        }
+
+        return 0;
+}
+
+/**
+ * bus_get_user_priority() - query dispatch priority of a user
+ * @bus:                bus to operate on
+ * @uid:                user to query
+ *
+ * Return: The DISPATCH_PRIORITY_* peers of @uid are dispatched with.
+ */
+unsigned int bus_get_user_priority(Bus *bus, uint32_t uid) {
+        size_t i;
+
+        for (i = 0; i < bus->n_priorities; ++i)
+                if (bus->priorities[i].uid == uid)
+                        return bus->priorities[i].priority;
+
+        return DISPATCH_PRIORITY_NORMAL;
 }
 
 Peer *bus_find_peer_by_name(Bus *bus, Name **namep, const char *name_str) {
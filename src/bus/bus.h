@@ -6,11 +6,14 @@
 
 #include <c-macro.h>
 #include <c-rbtree.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include "bus/listener.h"
 #include "bus/match.h"
 #include "bus/name.h"
 #include "bus/peer.h"
+#include "bus/traffic.h"
+#include "util/atom.h"
 #include "util/metrics.h"
 #include "util/user.h"
 
@@ -21,40 +24,112 @@ enum {
 };
 
 typedef struct Bus Bus;
+typedef struct BusNameList BusNameList;
+typedef struct BusPriority BusPriority;
+typedef struct BusStall BusStall;
 typedef struct Message Message;
 typedef struct User User;
 
+struct BusPriority {
+        uint32_t uid;
+        unsigned int priority;
+};
+
+struct BusNameList {
+        uint64_t generation;
+        Message *reply;
+        const char **names;
+        size_t n_names;
+};
+
+#define BUS_NAME_LIST_NULL {}
+
+/*
+ * Messages below this fraction of the stall threshold are never blamed. Such
+ * a message cannot plausibly cause a stall on its own, and a stall made up of
+ * many of them has no single culprit worth reporting.
+ */
+#define BUS_STALL_FRACTION (8)
+#define BUS_STALL_STRING_MAX (255) /* taken from the spec */
+
+struct BusStall {
+        uint64_t generation;
+        uint64_t nsec;
+        uint64_t peer_id;
+        uint64_t n_fanout;
+        char interface[BUS_STALL_STRING_MAX + 1];
+        char member[BUS_STALL_STRING_MAX + 1];
+};
+
+#define BUS_STALL_NULL {}
+
 struct Bus {
         User *user;
         pid_t pid;
         char guid[16];
 
+        AtomRegistry *atoms;
+        MatchKeysRegistry match_keys;
         UserRegistry users;
         NameRegistry names;
         MatchRegistry wildcard_matches;
         MatchRegistry driver_matches;
         PeerRegistry peers;
+        TrafficRegistry traffic;
 
-        uint64_t transaction_ids;
         uint64_t listener_ids;
+        uint64_t policy_generation;
+        uint64_t name_generation;
+        uint64_t reply_timeout;
+        uint64_t slow_consumer_bytes;
+        uint64_t n_fanout;
+        size_t n_monitors;
+
+        BusPriority *priorities;
+        size_t n_priorities;
+
+        Message *reply_introspect;
+        Message *reply_get_id;
+        Message *signal_name_owner_changed;
+        BusNameList list_names;
+        BusNameList list_activatable_names;
+        BusStall stall;
 
         Metrics metrics;
+        Histogram histogram_dispatch;
+        Histogram histogram_driver;
+        Histogram histogram_write;
 };
 
 #define BUS_NULL(_x) {                                                          \
+                .match_keys = MATCH_KEYS_REGISTRY_INIT(NULL),                   \
                 .users = USER_REGISTRY_NULL,                                    \
                 .names = NAME_REGISTRY_INIT,                                    \
                 .wildcard_matches = MATCH_REGISTRY_INIT((_x).wildcard_matches), \
                 .driver_matches = MATCH_REGISTRY_INIT((_x).driver_matches),     \
                 .peers = PEER_REGISTRY_INIT,                                    \
+                .traffic = TRAFFIC_REGISTRY_INIT,                               \
                 .metrics = METRICS_INIT,                                        \
+                .histogram_dispatch = HISTOGRAM_INIT(METRICS_CLOCK_CYCLES),     \
+                .histogram_driver = HISTOGRAM_INIT(METRICS_CLOCK_CYCLES),       \
+                .histogram_write = HISTOGRAM_INIT(METRICS_CLOCK_CYCLES),        \
         }
 
 int bus_init(Bus *bus,
+             AtomRegistry *atoms,
              unsigned int max_bytes,
              unsigned int max_fds,
              unsigned int max_matches,
-             unsigned int max_objects);
+             unsigned int max_objects,
+             unsigned int max_memfd_bytes);
 void bus_deinit(Bus *bus);
 
+void bus_name_list_deinit(BusNameList *list);
+
+void bus_note_stall(Bus *bus, uint64_t generation, Peer *peer, Message *message, uint64_t nsec, uint64_t n_fanout);
+bool bus_log_stall(Bus *bus, uint64_t generation, uint64_t nsec);
+
+int bus_set_user_priority(Bus *bus, uint32_t uid, unsigned int priority);
+unsigned int bus_get_user_priority(Bus *bus, uint32_t uid);
+
 Peer *bus_find_peer_by_name(Bus *bus, Name **namep, const char *name);
@@ -0,0 +1,241 @@
+/*
+ * Message Capture
+ *
+ * A capture is a lossy, pcap-formatted message sink for monitors. Rather than
+ * queueing every monitored message on the connection of the monitor, which
+ * charges a socket buffer per message and disconnects the monitor once its
+ * quota is exceeded, the raw messages are appended to a single, fixed-size
+ * staging buffer as pcap records. The buffer is flushed to a stream socket
+ * handed over by the monitor whenever that socket is writable.
+ *
+ * If the buffer is full, messages are dropped and counted, rather than
+ * blocking or disconnecting the monitor. Similarly, if the socket fails (e.g.,
+ * the monitor closed the reading end), everything from then on is dropped.
+ * Hence, a slow or dead capture consumer never affects the bus.
+ *
+ * The stream uses the pcap format with the D-Bus link-type, in native
+ * endianness, as it is used by `dbus-monitor --pcap`. Each record carries the
+ * full message, as it was received by the broker, including the sender field
+ * stitched in by the broker.
+ */
+
+#include <c-macro.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "bus/capture.h"
+#include "dbus/message.h"
+#include "util/dispatch.h"
+#include "util/error.h"
+
+typedef struct CaptureHeader CaptureHeader;
+typedef struct CaptureRecord CaptureRecord;
+
+struct CaptureHeader {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t network;
+};
+
+struct CaptureRecord {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t incl_len;
+        uint32_t orig_len;
+};
+
+static bool capture_reserve(Capture *capture, size_t n) {
+        if (CAPTURE_BUFFER_SIZE - capture->n_buffer >= n)
+                return true;
+
+        /* move pending data to the front, if that makes enough room */
+        if (CAPTURE_BUFFER_SIZE - (capture->n_buffer - capture->i_buffer) < n)
+                return false;
+
+        memmove(capture->buffer,
+                capture->buffer + capture->i_buffer,
+                capture->n_buffer - capture->i_buffer);
+        capture->n_buffer -= capture->i_buffer;
+        capture->i_buffer = 0;
+        return true;
+}
+
+static void capture_write(Capture *capture, const void *data, size_t n_data) {
+        memcpy(capture->buffer + capture->n_buffer, data, n_data);
+        capture->n_buffer += n_data;
+}
+
+static int capture_dispatch(DispatchFile *file) {
+        Capture *capture = c_container_of(file, Capture, file);
+        ssize_t l;
+
+        while (capture->i_buffer < capture->n_buffer) {
+                l = send(file->fd,
+                         capture->buffer + capture->i_buffer,
+                         capture->n_buffer - capture->i_buffer,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (l < 0) {
+                        if (errno == EAGAIN) {
+                                dispatch_file_clear(file, EPOLLOUT);
+                                return 0;
+                        }
+
+                        /* the consumer is gone, drop everything from now on */
+                        capture->failed = true;
+                        break;
+                }
+
+                capture->i_buffer += l;
+        }
+
+        capture->i_buffer = 0;
+        capture->n_buffer = 0;
+        dispatch_file_deselect(file, EPOLLOUT);
+        return 0;
+}
+
+/**
+ * capture_new() - create new capture
+ * @capturep:           output argument for new capture
+ * @dispatcher:         dispatch context to flush the capture on
+ * @fd:                 stream socket to write the capture to
+ *
+ * This creates a new capture, writing to @fd. The caller retains ownership of
+ * @fd, the capture operates on a duplicate of it. The pcap header is queued
+ * right away, so the capture is valid even if no message is ever captured.
+ *
+ * Return: 0 on success, CAPTURE_E_INVALID_FD if @fd is not a stream socket,
+ *         negative error code on failure.
+ */
+int capture_new(Capture **capturep, DispatchContext *dispatcher, int fd) {
+        _c_cleanup_(capture_freep) Capture *capture = NULL;
+        CaptureHeader header = {
+                .magic = 0xa1b2c3d4,
+                .version_major = 2,
+                .version_minor = 4,
+                .snaplen = CAPTURE_SNAPLEN,
+                .network = CAPTURE_LINKTYPE_DBUS,
+        };
+        socklen_t n_type = sizeof(int);
+        struct stat st;
+        int r, type;
+
+        r = fstat(fd, &st);
+        if (r < 0)
+                return (errno == EBADF) ? CAPTURE_E_INVALID_FD : error_origin(-errno);
+
+        if (!S_ISSOCK(st.st_mode))
+                return CAPTURE_E_INVALID_FD;
+
+        r = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &n_type);
+        if (r < 0)
+                return error_origin(-errno);
+
+        if (type != SOCK_STREAM)
+                return CAPTURE_E_INVALID_FD;
+
+        capture = calloc(1, sizeof(*capture));
+        if (!capture)
+                return error_origin(-ENOMEM);
+
+        *capture = (Capture)CAPTURE_NULL(*capture);
+
+        capture->buffer = malloc(CAPTURE_BUFFER_SIZE);
+        if (!capture->buffer)
+                return error_origin(-ENOMEM);
+
+        fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return error_origin(-errno);
+
+        r = dispatch_file_init(&capture->file,
+                               dispatcher,
+                               capture_dispatch,
+                               fd,
+                               EPOLLOUT,
+                               EPOLLOUT);
+        if (r) {
+                close(fd);
+                return error_fold(r);
+        }
+
+        capture_write(capture, &header, sizeof(header));
+        dispatch_file_select(&capture->file, EPOLLOUT);
+
+        *capturep = capture;
+        capture = NULL;
+        return 0;
+}
+
+/**
+ * capture_free() - destroy capture
+ * @capture:            capture to operate on, or NULL
+ *
+ * This destroys the capture. Any data that was not yet flushed is discarded.
+ *
+ * Return: NULL is returned.
+ */
+Capture *capture_free(Capture *capture) {
+        int fd;
+
+        if (!capture)
+                return NULL;
+
+        fd = capture->file.fd;
+
+        dispatch_file_deinit(&capture->file);
+        if (fd >= 0)
+                close(fd);
+        free(capture->buffer);
+        free(capture);
+
+        return NULL;
+}
+
+/**
+ * capture_append() - append message to capture
+ * @capture:            capture to operate on
+ * @message:            message to append
+ *
+ * This appends @message as pcap record to the buffer of @capture, and
+ * schedules the buffer to be flushed. If the buffer has no room for the
+ * record, or if the capture failed, the message is dropped instead. Either
+ * way, this never blocks and never fails.
+ */
+void capture_append(Capture *capture, Message *message) {
+        CaptureRecord record = {};
+        struct timespec ts;
+        size_t i, n_message = 0;
+
+        for (i = 0; i < C_ARRAY_SIZE(message->vecs); ++i)
+                n_message += message->vecs[i].iov_len;
+
+        if (_c_unlikely_(capture->failed || !capture_reserve(capture, sizeof(record) + n_message))) {
+                ++capture->n_dropped;
+                return;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        record.ts_sec = ts.tv_sec;
+        record.ts_usec = ts.tv_nsec / 1000;
+        record.incl_len = n_message;
+        record.orig_len = n_message;
+
+        capture_write(capture, &record, sizeof(record));
+        for (i = 0; i < C_ARRAY_SIZE(message->vecs); ++i)
+                if (message->vecs[i].iov_len)
+                        capture_write(capture, message->vecs[i].iov_base, message->vecs[i].iov_len);
+
+        ++capture->n_captured;
+        dispatch_file_select(&capture->file, EPOLLOUT);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * Message Capture
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/dispatch.h"
+
+typedef struct Capture Capture;
+typedef struct Message Message;
+
+enum {
+        _CAPTURE_E_SUCCESS,
+
+        CAPTURE_E_INVALID_FD,
+};
+
+/* D-Bus messages are limited to 128MiB by the specification */
+#define CAPTURE_SNAPLEN (128U * 1024U * 1024U)
+
+/* LINKTYPE_DBUS, raw D-Bus messages without pseudo-header */
+#define CAPTURE_LINKTYPE_DBUS (231U)
+
+/* absorbs bursts while the reader catches up; further records are dropped */
+#define CAPTURE_BUFFER_SIZE (4UL * 1024UL * 1024UL)
+
+struct Capture {
+        DispatchFile file;
+        bool failed : 1;
+        uint64_t n_captured;
+        uint64_t n_dropped;
+        char *buffer;
+        size_t i_buffer;
+        size_t n_buffer;
+};
+
+#define CAPTURE_NULL(_x) {                                                      \
+                .file = DISPATCH_FILE_NULL((_x).file),                          \
+        }
+
+int capture_new(Capture **capturep, DispatchContext *dispatcher, int fd);
+Capture *capture_free(Capture *capture);
+
+void capture_append(Capture *capture, Message *message);
+
+C_DEFINE_CLEANUP(Capture *, capture_free);
@@ -6,30 +6,55 @@
 #include <c-dvar-type.h>
 #include <c-macro.h>
 #include <c-string.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <unistd.h>
 #include "broker/broker.h"
 #include "bus/activation.h"
 #include "bus/bus.h"
+#include "bus/capture.h"
 #include "bus/driver.h"
 #include "bus/match.h"
 #include "bus/peer.h"
 #include "dbus/address.h"
+#include "dbus/marshal.h"
 #include "dbus/message.h"
 #include "dbus/protocol.h"
 #include "dbus/socket.h"
+#include "util/dispatch.h"
 #include "util/error.h"
+#include "util/fdlist.h"
+#include "util/hash.h"
 #include "util/selinux.h"
+#include "util/sketch.h"
+#include "util/trace.h"
 
 typedef struct DriverMethod DriverMethod;
+
+#define DRIVER_LIST_NAMES_PAGE_MAX (1024) /* bus names are at most 255 bytes, so a page is at most 256KiB */
+
+/*
+ * Batched queries are answered in a single reply, so their size must be
+ * bounded. An entry takes at most a bus name plus a page-sized security label,
+ * hence this keeps replies in the low megabytes, far below MESSAGE_SIZE_MAX,
+ * and bounds the time a single call can hold up the event loop.
+ */
+#define DRIVER_BATCH_NAMES_MAX (1024)
+
 typedef int (*DriverMethodFn) (Peer *peer, CDVar *var_in, uint32_t serial, CDVar *var_out);
+typedef int (*DriverMethodWithFdsFn) (Peer *peer, CDVar *var_in, FDList *fds, uint32_t serial, CDVar *var_out);
 
 struct DriverMethod {
         const char *name;
+        const char *interface;
         const char *path;
         DriverMethodFn fn;
         const CDVarType *in;
         const CDVarType *out;
+        DriverMethodWithFdsFn fn_with_fds;
 };
 
 /*
@@ -59,6 +84,13 @@ struct DriverMethod {
                 _body                                   \
         )
 
+static const CDVarType driver_type_in_b[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE1(
+                        C_DVAR_T_b
+                )
+        )
+};
 static const CDVarType driver_type_in_s[] = {
         C_DVAR_T_INIT(
                 C_DVAR_T_TUPLE1(
@@ -86,6 +118,15 @@ static const CDVarType driver_type_in_apss[] = {
                 )
         )
 };
+static const CDVarType driver_type_in_as[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE1(
+                        C_DVAR_T_ARRAY(
+                                C_DVAR_T_s
+                        )
+                )
+        )
+};
 static const CDVarType driver_type_in_asu[] = {
         C_DVAR_T_INIT(
                 C_DVAR_T_TUPLE2(
@@ -96,6 +137,17 @@ static const CDVarType driver_type_in_asu[] = {
                 )
         )
 };
+static const CDVarType driver_type_in_asuh[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE3(
+                        C_DVAR_T_ARRAY(
+                                C_DVAR_T_s
+                        ),
+                        C_DVAR_T_u,
+                        C_DVAR_T_h
+                )
+        )
+};
 static const CDVarType driver_type_out_unit[] = {
         C_DVAR_T_INIT(
                 DRIVER_T_MESSAGE(
@@ -141,6 +193,18 @@ static const CDVarType driver_type_out_as[] = {
                 )
         )
 };
+static const CDVarType driver_type_out_ass[] = {
+        C_DVAR_T_INIT(
+                DRIVER_T_MESSAGE(
+                        C_DVAR_T_TUPLE2(
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_s
+                                ),
+                                C_DVAR_T_s
+                        )
+                )
+        )
+};
 static const CDVarType driver_type_out_ay[] = {
         C_DVAR_T_INIT(
                 DRIVER_T_MESSAGE(
@@ -166,6 +230,82 @@ static const CDVarType driver_type_out_apsv[] = {
                 )
         )
 };
+static const CDVarType driver_type_out_apss[] = {
+        C_DVAR_T_INIT(
+                DRIVER_T_MESSAGE(
+                        C_DVAR_T_TUPLE1(
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_PAIR(
+                                                C_DVAR_T_s,
+                                                C_DVAR_T_s
+                                        )
+                                )
+                        )
+                )
+        )
+};
+static const CDVarType driver_type_out_apsapsv[] = {
+        C_DVAR_T_INIT(
+                DRIVER_T_MESSAGE(
+                        C_DVAR_T_TUPLE1(
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_PAIR(
+                                                C_DVAR_T_s,
+                                                C_DVAR_T_ARRAY(
+                                                        C_DVAR_T_PAIR(
+                                                                C_DVAR_T_s,
+                                                                C_DVAR_T_v
+                                                        )
+                                                )
+                                        )
+                                )
+                        )
+                )
+        )
+};
+static const CDVarType driver_type_out_arssttt[] = {
+        C_DVAR_T_INIT(
+                DRIVER_T_MESSAGE(
+                        C_DVAR_T_TUPLE1(
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_TUPLE5(
+                                                C_DVAR_T_s,
+                                                C_DVAR_T_s,
+                                                C_DVAR_T_t,
+                                                C_DVAR_T_t,
+                                                C_DVAR_T_t
+                                        )
+                                )
+                        )
+                )
+        )
+};
+static const CDVarType driver_type_out_arssst[] = {
+        C_DVAR_T_INIT(
+                DRIVER_T_MESSAGE(
+                        C_DVAR_T_TUPLE1(
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_TUPLE4(
+                                                C_DVAR_T_s,
+                                                C_DVAR_T_s,
+                                                C_DVAR_T_s,
+                                                C_DVAR_T_t
+                                        )
+                                )
+                        )
+                )
+        )
+};
+static const CDVarType driver_type_out_hh[] = {
+        C_DVAR_T_INIT(
+                DRIVER_T_MESSAGE(
+                        C_DVAR_T_TUPLE2(
+                                C_DVAR_T_h,
+                                C_DVAR_T_h
+                        )
+                )
+        )
+};
 
 static void driver_write_bytes(CDVar *var, char *bytes, size_t n_bytes) {
         c_dvar_write(var, "[");
@@ -222,7 +362,7 @@ static int driver_dvar_verify_signature_in(const CDVarType *type, const char *si
         return 0;
 }
 
-static void driver_write_reply_header(CDVar *var, Peer *peer, uint32_t serial, const CDVarType *type) {
+static void driver_write_reply_header_with_fds(CDVar *var, Peer *peer, uint32_t serial, const CDVarType *type, uint32_t n_fds) {
         c_dvar_write(var, "(yyyyuu[(y<u>)(y<s>)(y<",
                      c_dvar_is_big_endian(var) ? 'B' : 'l', DBUS_MESSAGE_TYPE_METHOD_RETURN, DBUS_HEADER_FLAG_NO_REPLY_EXPECTED, 1, 0, (uint32_t)-1,
                      DBUS_MESSAGE_FIELD_REPLY_SERIAL, c_dvar_type_u, serial,
@@ -232,7 +372,14 @@ static void driver_write_reply_header(CDVar *var, Peer *peer, uint32_t serial, c
         c_dvar_write(var, ">)(y<",
                      DBUS_MESSAGE_FIELD_SIGNATURE, c_dvar_type_g);
         driver_dvar_write_signature_out(var, type);
-        c_dvar_write(var, ">)])");
+        c_dvar_write(var, ">)");
+        if (n_fds)
+                c_dvar_write(var, "(y<u>)", DBUS_MESSAGE_FIELD_UNIX_FDS, c_dvar_type_u, n_fds);
+        c_dvar_write(var, "])");
+}
+
+static void driver_write_reply_header(CDVar *var, Peer *peer, uint32_t serial, const CDVarType *type) {
+        driver_write_reply_header_with_fds(var, peer, serial, type, 0);
 }
 
 static void driver_write_signal_header(CDVar *var, Peer *peer, const char *member, const char *signature) {
@@ -253,11 +400,159 @@ static void driver_write_signal_header(CDVar *var, Peer *peer, const char *membe
                      DBUS_MESSAGE_FIELD_SIGNATURE, c_dvar_type_g, signature);
 }
 
+static const char *driver_introspection =
+        "<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
+        "\"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
+        "<node>\n"
+        "  <interface name=\"org.freedesktop.DBus\">\n"
+        "    <method name=\"Hello\">\n"
+        "      <arg direction=\"out\" type=\"s\"/>\n"
+        "    </method>\n"
+        "    <method name=\"RequestName\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"in\" type=\"u\"/>\n"
+        "      <arg direction=\"out\" type=\"u\"/>\n"
+        "    </method>\n"
+        "    <method name=\"ReleaseName\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"u\"/>\n"
+        "    </method>\n"
+        "    <method name=\"StartServiceByName\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"in\" type=\"u\"/>\n"
+        "      <arg direction=\"out\" type=\"u\"/>\n"
+        "    </method>\n"
+        "    <method name=\"UpdateActivationEnvironment\">\n"
+        "      <arg direction=\"in\" type=\"a{ss}\"/>\n"
+        "    </method>\n"
+        "    <method name=\"NameHasOwner\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"b\"/>\n"
+        "    </method>\n"
+        "    <method name=\"ListNames\">\n"
+        "      <arg direction=\"out\" type=\"as\"/>\n"
+        "    </method>\n"
+        "    <method name=\"ListNamesPaged\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"in\" type=\"u\"/>\n"
+        "      <arg direction=\"out\" type=\"as\"/>\n"
+        "      <arg direction=\"out\" type=\"s\"/>\n"
+        "    </method>\n"
+        "    <method name=\"ListActivatableNames\">\n"
+        "      <arg direction=\"out\" type=\"as\"/>\n"
+        "    </method>\n"
+        "    <method name=\"AddMatch\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "    </method>\n"
+        "    <method name=\"AddMatches\">\n"
+        "      <arg direction=\"in\" type=\"as\"/>\n"
+        "    </method>\n"
+        "    <method name=\"RemoveMatch\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "    </method>\n"
+        "    <method name=\"SetSignalCoalescing\">\n"
+        "      <arg direction=\"in\" type=\"b\"/>\n"
+        "    </method>\n"
+        "    <method name=\"SetReplyPriority\">\n"
+        "      <arg direction=\"in\" type=\"b\"/>\n"
+        "    </method>\n"
+        "    <method name=\"SetupSharedMemory\">\n"
+        "      <arg direction=\"out\" type=\"h\"/>\n"
+        "      <arg direction=\"out\" type=\"h\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetNameOwner\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"s\"/>\n"
+        "    </method>\n"
+        "    <method name=\"ListQueuedOwners\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"as\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetConnectionUnixUser\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"u\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetConnectionUnixProcessID\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"u\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetAdtAuditSessionData\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"ay\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetConnectionSELinuxSecurityContext\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"ay\"/>\n"
+        "    </method>\n"
+        "    <method name=\"ReloadConfig\">\n"
+        "    </method>\n"
+        "    <method name=\"GetId\">\n"
+        "      <arg direction=\"out\" type=\"s\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetConnectionCredentials\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"a{sv}\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetNameOwners\">\n"
+        "      <arg direction=\"in\" type=\"as\"/>\n"
+        "      <arg direction=\"out\" type=\"a{ss}\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetConnectionCredentialsBatch\">\n"
+        "      <arg direction=\"in\" type=\"as\"/>\n"
+        "      <arg direction=\"out\" type=\"a{sa{sv}}\"/>\n"
+        "    </method>\n"
+        "    <signal name=\"NameOwnerChanged\">\n"
+        "      <arg type=\"s\"/>\n"
+        "      <arg type=\"s\"/>\n"
+        "      <arg type=\"s\"/>\n"
+        "    </signal>\n"
+        "    <signal name=\"NameLost\">\n"
+        "      <arg type=\"s\"/>\n"
+        "    </signal>\n"
+        "    <signal name=\"NameAcquired\">\n"
+        "      <arg type=\"s\"/>\n"
+        "    </signal>\n"
+        "  </interface>\n"
+        "  <interface name=\"org.freedesktop.DBus.Introspectable\">\n"
+        "    <method name=\"Introspect\">\n"
+        "      <arg direction=\"out\" type=\"s\"/>\n"
+        "    </method>\n"
+        "  </interface>\n"
+        "  <interface name=\"org.freedesktop.DBus.Monitoring\">\n"
+        "    <method name=\"BecomeMonitor\">\n"
+        "      <arg direction=\"in\" type=\"as\"/>\n"
+        "      <arg direction=\"in\" type=\"u\"/>\n"
+        "    </method>\n"
+        "    <method name=\"BecomeCaptureMonitor\">\n"
+        "      <arg direction=\"in\" type=\"as\"/>\n"
+        "      <arg direction=\"in\" type=\"u\"/>\n"
+        "      <arg direction=\"in\" type=\"h\"/>\n"
+        "    </method>\n"
+        "  </interface>\n"
+        "  <interface name=\"org.freedesktop.DBus.Debug.Stats\">\n"
+        "    <method name=\"GetStats\">\n"
+        "      <arg direction=\"out\" type=\"a{sv}\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetConnectionStats\">\n"
+        "      <arg direction=\"in\" type=\"s\"/>\n"
+        "      <arg direction=\"out\" type=\"a{sv}\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetInterfaceStats\">\n"
+        "      <arg direction=\"out\" type=\"a(ssttt)\"/>\n"
+        "    </method>\n"
+        "    <method name=\"GetHeavyHitters\">\n"
+        "      <arg direction=\"out\" type=\"a(ssst)\"/>\n"
+        "    </method>\n"
+        "  </interface>\n"
+        "</node>\n";
+
+
 static const char *driver_error_to_string(int r) {
         static const char *error_strings[_DRIVER_E_MAX] = {
                 [DRIVER_E_INVALID_MESSAGE]                      = "Invalid message body",
                 [DRIVER_E_PEER_NOT_REGISTERED]                  = "Hello() was not the first method called",
                 [DRIVER_E_PEER_ALREADY_REGISTERED]              = "Hello() already called",
+                [DRIVER_E_SHARED_MEMORY_ENABLED]                = "Shared memory was already set up",
                 [DRIVER_E_PEER_NOT_PRIVILEGED]                  = "The caller does not have the necessary privileged to call this method",
                 [DRIVER_E_UNEXPECTED_MESSAGE_TYPE]              = "Unexpected message type",
                 [DRIVER_E_UNEXPECTED_PATH]                      = "Invalid object path",
@@ -266,6 +561,7 @@ static const char *driver_error_to_string(int r) {
                 [DRIVER_E_UNEXPECTED_SIGNATURE]                 = "Invalid signature for method",
                 [DRIVER_E_UNEXPECTED_REPLY]                     = "No pending reply with that serial",
                 [DRIVER_E_QUOTA]                                = "Sending user's quota exceeded",
+                [DRIVER_E_BATCH_TOO_LARGE]                      = "Too many entries in a single call",
                 [DRIVER_E_UNEXPECTED_FLAGS]                     = "Invalid flags",
                 [DRIVER_E_UNEXPECTED_ENVIRONMENT_UPDATE]        = "User is not authorized to update environment variables",
                 [DRIVER_E_SEND_DENIED]                          = "Sender is not authorized to send message",
@@ -282,8 +578,10 @@ static const char *driver_error_to_string(int r) {
                 [DRIVER_E_DESTINATION_NOT_FOUND]                = "Destination does not exist",
                 [DRIVER_E_MATCH_INVALID]                        = "Invalid match rule",
                 [DRIVER_E_MATCH_NOT_FOUND]                      = "The match does not exist",
+                [DRIVER_E_CAPTURE_INVALID]                      = "The capture file-descriptor must be a stream socket",
                 [DRIVER_E_ADT_NOT_SUPPORTED]                    = "Solaris ADT is not supported",
                 [DRIVER_E_SELINUX_NOT_SUPPORTED]                = "SELinux is not supported",
+                [DRIVER_E_FDS_REFUSED]                          = "File descriptors cannot be passed to a peer using shared memory",
         };
         assert(r >= 0 && r < _DRIVER_E_MAX && error_strings[r]);
 
@@ -298,6 +596,7 @@ static int driver_send_unicast(Peer *receiver, Message *message) {
         if (r)
                 return error_fold(r);
 
+        peer_account_queued(receiver, message);
         return 0;
 }
 
@@ -381,32 +680,35 @@ static int driver_send_reply(Peer *peer, CDVar *var, uint32_t serial) {
         return 0;
 }
 
-static int driver_notify_name_acquired(Peer *peer, const char *name) {
-        static const CDVarType type[] = {
-                C_DVAR_T_INIT(
-                        DRIVER_T_MESSAGE(
-                                C_DVAR_T_TUPLE1(
-                                        C_DVAR_T_s
-                                )
-                        )
-                )
-        };
+static int driver_send_shared_reply(Peer *peer, uint32_t serial, const CDVarType *type, Message *shared) {
         _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
         _c_cleanup_(message_unrefp) Message *message = NULL;
         void *data;
         size_t n_data;
         int r;
 
-        c_dvar_begin_write(&var, type, 1);
+        /* If no reply was expected, there is nothing to do. */
+        if (!serial)
+                return 0;
+
+        /*
+         * The body of @shared was serialized once, when the bus was set up.
+         * Only marshal a new header, carrying the serial, reply-serial and
+         * destination of this reply, and send it together with the shared
+         * body. @type describes the body, and is only used to write the
+         * signature.
+         */
+
+        c_dvar_begin_write(&var, driver_type_out_unit, 1);
         c_dvar_write(&var, "(");
-        driver_write_signal_header(&var, peer, "NameAcquired", "s");
-        c_dvar_write(&var, "(s)", name);
-        c_dvar_write(&var, ")");
+        driver_write_reply_header(&var, peer, serial, type);
+        c_dvar_write(&var, "())");
+
         r = c_dvar_end_write(&var, &data, &n_data);
         if (r)
                 return error_origin(r);
 
-        r = message_new_outgoing(&message, data, n_data);
+        r = message_new_outgoing_shared(&message, data, n_data, shared);
         if (r)
                 return error_fold(r);
 
@@ -417,204 +719,456 @@ static int driver_notify_name_acquired(Peer *peer, const char *name) {
         return 0;
 }
 
-static int driver_notify_name_lost(Peer *peer, const char *name) {
-        static const CDVarType type[] = {
-                C_DVAR_T_INIT(
-                        DRIVER_T_MESSAGE(
-                                C_DVAR_T_TUPLE1(
-                                        C_DVAR_T_s
-                                )
-                        )
-                )
-        };
+/*
+ * Replies carrying a single basic value are marshaled by the specialized
+ * writers of dbus/marshal.h, rather than through c-dvar. Handlers of methods
+ * with such an output type must not use their output variant, but call the
+ * matching driver_send_reply_*() helper directly.
+ */
+#define DRIVER_SEND_REPLY_DEFINE(_suffix, _signature, _type)                    \
+        static int driver_send_reply_##_suffix(Peer *peer, uint32_t serial, _type value) { \
+                _c_cleanup_(message_unrefp) Message *message = NULL;            \
+                int r;                                                          \
+                                                                                \
+                /* If no reply was expected, there is nothing to do. */         \
+                if (!serial)                                                    \
+                        return 0;                                               \
+                                                                                \
+                r = marshal_reply_##_suffix(&message, serial, "org.freedesktop.DBus", &peer->sender, value); \
+                if (r)                                                          \
+                        return error_fold(r);                                   \
+                                                                                \
+                r = driver_send_unicast(peer, message);                         \
+                if (r)                                                          \
+                        return error_trace(r);                                  \
+                                                                                \
+                return 0;                                                       \
+        }
+
+MARSHAL_REPLY_TYPES(DRIVER_SEND_REPLY_DEFINE)
+
+static bool driver_type_is_specialized(const CDVarType *type) {
+        return type == driver_type_out_b ||
+               type == driver_type_out_s ||
+               type == driver_type_out_u;
+}
+
+static int driver_new_shared_reply(Message **messagep, const char *string) {
         _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
-        _c_cleanup_(message_unrefp) Message *message = NULL;
         void *data;
         size_t n_data;
         int r;
 
-        c_dvar_begin_write(&var, type, 1);
-        c_dvar_write(&var, "(");
-        driver_write_signal_header(&var, peer, "NameLost", "s");
-        c_dvar_write(&var, "(s)", name);
-        c_dvar_write(&var, ")");
+        /*
+         * Serialize a reply carrying a single string. The header is never
+         * sent, it only makes this a valid message. Its body is shared with
+         * all replies sent via driver_send_shared_reply().
+         */
+
+        c_dvar_begin_write(&var, driver_type_out_s, 1);
+        c_dvar_write(&var, "((yyyyuu[(y<s>)(y<g>)])(s))",
+                     c_dvar_is_big_endian(&var) ? 'B' : 'l', DBUS_MESSAGE_TYPE_METHOD_RETURN, DBUS_HEADER_FLAG_NO_REPLY_EXPECTED, 1, 0, (uint32_t)-1,
+                     DBUS_MESSAGE_FIELD_SENDER, c_dvar_type_s, "org.freedesktop.DBus",
+                     DBUS_MESSAGE_FIELD_SIGNATURE, c_dvar_type_g, "s",
+                     string);
+
         r = c_dvar_end_write(&var, &data, &n_data);
         if (r)
                 return error_origin(r);
 
-        r = message_new_outgoing(&message, data, n_data);
+        r = message_new_outgoing(messagep, data, n_data);
         if (r)
                 return error_fold(r);
 
-        r = driver_send_unicast(peer, message);
+        return 0;
+}
+
+static int driver_new_signal_template(Message **messagep, const char *member, const char *signature) {
+        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
+        void *data;
+        size_t n_data;
+        int r;
+
+        /*
+         * Serialize a signal without destination and without body. Its
+         * header is copied verbatim into every signal built from this
+         * template, hence it is never sent itself.
+         */
+
+        c_dvar_begin_write(&var, driver_type_out_unit, 1);
+        c_dvar_write(&var, "(");
+        driver_write_signal_header(&var, NULL, member, signature);
+        c_dvar_write(&var, "())");
+
+        r = c_dvar_end_write(&var, &data, &n_data);
         if (r)
-                return error_trace(r);
+                return error_origin(r);
+
+        r = message_new_outgoing(messagep, data, n_data);
+        if (r)
+                return error_fold(r);
 
         return 0;
 }
 
-static int driver_notify_name_owner_changed(Bus *bus, const char *name, const char *old_owner, const char *new_owner) {
-        MatchFilter filter = {
-                .type = DBUS_MESSAGE_TYPE_SIGNAL,
-                .destination = ADDRESS_ID_INVALID,
-                .interface = "org.freedesktop.DBus",
-                .member = "NameOwnerChanged",
-                .path = "/org/freedesktop/DBus",
-                .args[0] = name,
-                .argpaths[0] = name,
-                .args[1] = old_owner,
-                .argpaths[1] = old_owner,
-                .args[2] = new_owner,
-                .argpaths[2] = new_owner,
-        };
-        static const CDVarType type[] = {
-                C_DVAR_T_INIT(
-                        DRIVER_T_MESSAGE(
-                                C_DVAR_T_TUPLE3(
-                                        C_DVAR_T_s,
-                                        C_DVAR_T_s,
-                                        C_DVAR_T_s
-                                )
-                        )
-                )
-        };
+static size_t driver_marshal_string(void *body, size_t offset, const char *string, bool big_endian) {
+        size_t n = strlen(string);
+        uint32_t length;
+
+        if (body) {
+                memset(body + offset, 0, C_ALIGN_TO(offset, 4) - offset);
+                length = big_endian ? htobe32(n) : htole32(n);
+                memcpy(body + C_ALIGN_TO(offset, 4), &length, sizeof(length));
+                memcpy(body + C_ALIGN_TO(offset, 4) + sizeof(length), string, n + 1);
+        }
+
+        return C_ALIGN_TO(offset, 4) + sizeof(length) + n + 1;
+}
+
+static int driver_notify_name(Peer *peer, const char *member, Message *signal, size_t n_body) {
         _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
         _c_cleanup_(message_unrefp) Message *message = NULL;
         void *data;
         size_t n_data;
         int r;
 
-        c_dvar_begin_write(&var, type, 1);
+        /*
+         * NameAcquired and NameLost carry the name as only argument, which is
+         * also the first argument of NameOwnerChanged. Hence, only marshal
+         * their header and share the first @n_body bytes of the body of the
+         * NameOwnerChanged @signal.
+         */
+
+        c_dvar_begin_write(&var, driver_type_out_unit, 1);
         c_dvar_write(&var, "(");
-        driver_write_signal_header(&var, NULL, "NameOwnerChanged", "sss");
-        c_dvar_write(&var, "(sss)", name, old_owner, new_owner);
-        c_dvar_write(&var, ")");
+        driver_write_signal_header(&var, peer, member, "s");
+        c_dvar_write(&var, "())");
+
         r = c_dvar_end_write(&var, &data, &n_data);
         if (r)
                 return error_origin(r);
 
-        r = message_new_outgoing(&message, data, n_data);
+        r = message_new_outgoing_shared_prefix(&message, data, n_data, signal, n_body);
         if (r)
                 return error_fold(r);
 
-        r = peer_broadcast(NULL, NULL, NULL, ADDRESS_ID_INVALID, NULL, bus, &filter, message);
+        r = driver_send_unicast(peer, message);
         if (r)
-                return error_fold(r);
+                return error_trace(r);
 
         return 0;
 }
 
-static int driver_name_owner_changed(Bus *bus, const char *name, Peer *old_owner, Peer *new_owner) {
-        const char *old_owner_str, *new_owner_str;
+static int driver_new_name_owner_changed(Bus *bus,
+                                         Message **messagep,
+                                         size_t *n_namep,
+                                         const char *name,
+                                         const char *old_owner,
+                                         const char *new_owner) {
+        Message *template = bus->signal_name_owner_changed;
+        size_t n_header, n_name, n_old_owner, n_body;
+        void *data;
         int r;
 
-        assert(old_owner || new_owner);
-        assert(name || !old_owner || !new_owner);
+        /*
+         * The header of NameOwnerChanged is constant, so copy it from the
+         * template and marshal the `(sss)' body right behind it. The offsets
+         * of the body only depend on the string lengths, and the offsets of
+         * the header are fixed by the template.
+         */
 
-        old_owner_str = old_owner ? address_to_string(&(Address)ADDRESS_INIT_ID(old_owner->id)) : "";
-        new_owner_str = new_owner ? address_to_string(&(Address)ADDRESS_INIT_ID(new_owner->id)) : "";
-        name = name ?: (old_owner ? old_owner_str : new_owner_str);
+        n_header = c_align8(template->n_header);
+        n_name = driver_marshal_string(NULL, 0, name, template->big_endian);
+        n_old_owner = driver_marshal_string(NULL, n_name, old_owner, template->big_endian);
+        n_body = driver_marshal_string(NULL, n_old_owner, new_owner, template->big_endian);
 
-        if (old_owner) {
-                r = driver_notify_name_lost(old_owner, name);
-                if (r)
-                        return error_trace(r);
-        }
+        data = malloc(n_header + n_body);
+        if (!data)
+                return error_origin(-ENOMEM);
 
-        r = driver_notify_name_owner_changed(bus, name, old_owner_str, new_owner_str);
-        if (r)
-                return error_trace(r);
+        memcpy(data, template->data, n_header);
+        driver_marshal_string(data + n_header, 0, name, template->big_endian);
+        driver_marshal_string(data + n_header, n_name, old_owner, template->big_endian);
+        driver_marshal_string(data + n_header, n_old_owner, new_owner, template->big_endian);
 
-        if (new_owner) {
-                r = driver_notify_name_acquired(new_owner, name);
-                if (r)
-                        return error_trace(r);
-        }
+        r = message_new_outgoing(messagep, data, n_header + n_body);
+        if (r)
+                return error_fold(r);
 
+        *n_namep = n_name;
         return 0;
 }
 
-static int driver_name_activated(Activation *activation, Peer *receiver) {
-        ActivationRequest *request, *request_safe;
-        ActivationMessage *message, *message_safe;
-        int r;
+static void driver_init_name_owner_changed_filter(Bus *bus, MatchFilter *filter) {
+        /*
+         * The indexed fields of NameOwnerChanged are constant, so resolve
+         * them against the bus atoms once. A filter initialized here can be
+         * used for any number of signals, only the arguments differ.
+         */
+        *filter = (MatchFilter)MATCH_FILTER_INIT;
+        filter->atoms = bus->atoms;
+        filter->type = DBUS_MESSAGE_TYPE_SIGNAL;
+        filter->interface = atom_registry_resolve(bus->atoms, "org.freedesktop.DBus");
+        filter->member = atom_registry_resolve(bus->atoms, "NameOwnerChanged");
+        filter->path = atom_registry_resolve(bus->atoms, "/org/freedesktop/DBus");
+}
 
-        if (!activation)
-                return 0;
+static void driver_monitor_collect(PeerRegistry *peers, MatchRegistry *matches, MatchFilter *filter) {
+        MatchRule *rule;
 
-        /* in case the name is dropped again in the future, we should request it again */
-        activation->requested = false;
+        if (c_list_is_empty(&matches->monitor_list))
+                return;
 
-        c_list_for_each_entry_safe(request, request_safe, &activation->activation_requests, link) {
-                Peer *sender;
+        for (rule = match_rule_next_monitor_match(matches, NULL, filter); rule; rule = match_rule_next_monitor_match(matches, rule, filter))
+                peer_registry_collect_receiver(peers, c_container_of(rule->owner, Peer, owned_matches));
+}
 
-                sender = peer_registry_find_peer(&receiver->bus->peers, request->sender_id);
-                if (sender) {
-                        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
+static int driver_monitor_deliver(PeerRegistry *peers, Message *message) {
+        Peer *receiver;
+        size_t i;
+        int r;
 
-                        c_dvar_begin_write(&var, driver_type_out_u, 1);
-                        c_dvar_write(&var, "(");
-                        driver_write_reply_header(&var, sender, request->serial, driver_type_out_u);
-                        c_dvar_write(&var, "(u)", DBUS_START_REPLY_SUCCESS);
+        for (i = 0; i < peers->n_receivers; ++i) {
+                receiver = peers->receivers[i];
 
-                        r = driver_send_reply(sender, &var, request->serial);
-                        if (r)
-                                return error_trace(r);
+                if (peer_refuses_fds(receiver, message))
+                        continue;
+
+                if (receiver->capture) {
+                        capture_append(receiver->capture, message);
+                        continue;
                 }
 
-                activation_request_free(request);
+                r = connection_queue(&receiver->connection, NULL, message);
+                if (r) {
+                        if (r == CONNECTION_E_QUOTA) {
+                                ++receiver->stats.n_quota_denials;
+                                connection_shutdown(&receiver->connection);
+                        } else {
+                                return error_fold(r);
+                        }
+                } else {
+                        peer_account_queued(receiver, message);
+                }
         }
 
-        c_list_for_each_entry_safe(message, message_safe, &activation->activation_messages, link) {
-                NameSet sender_names = NAME_SET_INIT_FROM_SNAPSHOT(message->senders_names);
-                Peer *sender;
+        return 0;
+}
 
-                sender = peer_registry_find_peer(&receiver->bus->peers, message->message->sender_id);
+static int driver_notify_name_owner_changed(Bus *bus,
+                                            MatchFilter *filter,
+                                            Message *message,
+                                            const char *name,
+                                            const char *old_owner,
+                                            const char *new_owner) {
+        int r;
 
-                /* XXX: deal with sender matches on the unique name */
-                r = peer_queue_call(message->senders_policy, &sender_names, NULL, sender ? &sender->owned_replies : NULL, message->user, message->message->sender_id, receiver, message->message);
-                if (r) {
-                        switch (r) {
-                        case PEER_E_QUOTA:
-                                if (sender)
-                                        r = driver_send_error(sender, message_read_serial(message->message),
-                                                              "org.freedesktop.DBus.Error.LimitsExceeded",
-                                                              driver_error_to_string(DRIVER_E_QUOTA));
-                                break;
-                        case PEER_E_EXPECTED_REPLY_EXISTS:
-                                if (sender)
-                                        r = driver_send_error(sender, message_read_serial(message->message),
-                                                              "org.freedesktop.DBus.Error.AccessDenied",
-                                                              driver_error_to_string(DRIVER_E_EXPECTED_REPLY_EXISTS));
-                                break;
-                        case PEER_E_RECEIVE_DENIED:
-                                if (sender)
-                                        r = driver_send_error(sender, message_read_serial(message->message),
-                                                              "org.freedesktop.DBus.Error.AccessDenied",
-                                                              driver_error_to_string(DRIVER_E_RECEIVE_DENIED));
-                                break;
-                        case PEER_E_SEND_DENIED:
-                                if (sender)
-                                        r = driver_send_error(sender, message_read_serial(message->message),
-                                                              "org.freedesktop.DBus.Error.AccessDenied",
-                                                              driver_error_to_string(DRIVER_E_SEND_DENIED));
-                                break;
-                        }
+        filter->args[0] = name;
+        filter->argpaths[0] = name;
+        filter->args[1] = old_owner;
+        filter->argpaths[1] = old_owner;
+        filter->args[2] = new_owner;
+        filter->argpaths[2] = new_owner;
 
-                        if (r)
-                                return error_fold(r);
-                }
+        /*
+         * Monitors see NameOwnerChanged like any other broadcast, so a
+         * capture can tell when peers connect, disconnect and change names
+         * without having to infer it from the driver calls.
+         */
+        if (_c_unlikely_(bus->n_monitors)) {
+                driver_monitor_collect(&bus->peers, &bus->wildcard_matches, filter);
+                driver_monitor_collect(&bus->peers, &bus->driver_matches, filter);
 
-                activation_message_free(message);
+                r = driver_monitor_deliver(&bus->peers, message);
+                peer_registry_clear_receivers(&bus->peers);
+                if (r)
+                        return error_trace(r);
         }
 
+        r = peer_broadcast(NULL, NULL, NULL, ADDRESS_ID_INVALID, NULL, bus, filter, message);
+        if (r)
+                return error_fold(r);
+
         return 0;
 }
 
-static int driver_end_read(CDVar *var) {
+static int driver_name_owner_changed_with_filter(Bus *bus, MatchFilter *filter, const char *name, Peer *old_owner, Peer *new_owner) {
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        const char *old_owner_str, *new_owner_str;
+        size_t n_name;
         int r;
 
-        r = c_dvar_end_read(var);
+        assert(old_owner || new_owner);
+        assert(name || !old_owner || !new_owner);
+
+        /* the primary owner of @name changed, drop all cached destinations */
+        ++bus->name_generation;
+
+        old_owner_str = old_owner ? address_to_string(&(Address)ADDRESS_INIT_ID(old_owner->id)) : "";
+        new_owner_str = new_owner ? address_to_string(&(Address)ADDRESS_INIT_ID(new_owner->id)) : "";
+        name = name ?: (old_owner ? old_owner_str : new_owner_str);
+
+        /*
+         * All three signals carry @name as first argument, so the body is
+         * marshalled once and shared. None of them is written to the socket
+         * right away, so if one peer receives several of them, they are all
+         * flushed with the next write of its connection.
+         */
+        r = driver_new_name_owner_changed(bus, &message, &n_name, name, old_owner_str, new_owner_str);
+        if (r)
+                return error_trace(r);
+
+        if (old_owner) {
+                r = driver_notify_name(old_owner, "NameLost", message, n_name);
+                if (r)
+                        return error_trace(r);
+        }
+
+        r = driver_notify_name_owner_changed(bus, filter, message, name, old_owner_str, new_owner_str);
+        if (r)
+                return error_trace(r);
+
+        if (new_owner) {
+                r = driver_notify_name(new_owner, "NameAcquired", message, n_name);
+                if (r)
+                        return error_trace(r);
+        }
+
+        return 0;
+}
+
+static int driver_name_owner_changed(Bus *bus, const char *name, Peer *old_owner, Peer *new_owner) {
+        MatchFilter filter;
+
+        driver_init_name_owner_changed_filter(bus, &filter);
+
+        return driver_name_owner_changed_with_filter(bus, &filter, name, old_owner, new_owner);
+}
+
+static int driver_name_activated_error(Peer *sender, Message *message, int error) {
+        int r;
+
+        if (!sender)
+                return 0;
+
+        switch (error) {
+        case PEER_E_QUOTA:
+                r = driver_send_error(sender, message_read_serial(message),
+                                      "org.freedesktop.DBus.Error.LimitsExceeded",
+                                      driver_error_to_string(DRIVER_E_QUOTA));
+                break;
+        case PEER_E_EXPECTED_REPLY_EXISTS:
+                r = driver_send_error(sender, message_read_serial(message),
+                                      "org.freedesktop.DBus.Error.AccessDenied",
+                                      driver_error_to_string(DRIVER_E_EXPECTED_REPLY_EXISTS));
+                break;
+        case PEER_E_RECEIVE_DENIED:
+                r = driver_send_error(sender, message_read_serial(message),
+                                      "org.freedesktop.DBus.Error.AccessDenied",
+                                      driver_error_to_string(DRIVER_E_RECEIVE_DENIED));
+                break;
+        case PEER_E_SEND_DENIED:
+                r = driver_send_error(sender, message_read_serial(message),
+                                      "org.freedesktop.DBus.Error.AccessDenied",
+                                      driver_error_to_string(DRIVER_E_SEND_DENIED));
+                break;
+        case PEER_E_FDS_REFUSED:
+                r = driver_send_error(sender, message_read_serial(message),
+                                      "org.freedesktop.DBus.Error.NotSupported",
+                                      driver_error_to_string(DRIVER_E_FDS_REFUSED));
+                break;
+        default:
+                return 0;
+        }
+
+        return error_trace(r);
+}
+
+static int driver_name_activated_batch(Peer *receiver, ActivationMessage **batch, size_t n_batch) {
+        NameSet sender_names = NAME_SET_INIT_FROM_SNAPSHOT(batch[0]->sender->names);
+        ActivationSender *activation_sender = batch[0]->sender;
+        Message *messages[PEER_BATCH_MAX];
+        int results[PEER_BATCH_MAX];
+        Peer *sender;
+        size_t i;
+        int r;
+
+        sender = peer_registry_find_peer(&receiver->bus->peers, activation_sender->id);
+
+        for (i = 0; i < n_batch; ++i)
+                messages[i] = batch[i]->message;
+
+        /* XXX: deal with sender matches on the unique name */
+        r = peer_queue_call_batch(activation_sender->policy, &sender_names, NULL, sender ? &sender->owned_replies : NULL,
+                                  batch[0]->user, activation_sender->id, receiver, messages, results, n_batch);
+        if (r)
+                return error_fold(r);
+
+        for (i = 0; i < n_batch; ++i) {
+                r = driver_name_activated_error(sender, messages[i], results[i]);
+                if (r)
+                        return error_trace(r);
+
+                activation_message_free(batch[i]);
+        }
+
+        return 0;
+}
+
+static int driver_name_activated(Activation *activation, Peer *receiver) {
+        ActivationRequest *request, *request_safe;
+        ActivationMessage *message, *message_safe, *batch[PEER_BATCH_MAX];
+        size_t n_batch = 0;
+        Peer *sender = NULL;
+        int r;
+
+        if (!activation)
+                return 0;
+
+        /* in case the name is dropped again in the future, we should request it again */
+        activation->requested = false;
+
+        c_list_for_each_entry_safe(request, request_safe, &activation->activation_requests, link) {
+                sender = peer_registry_find_peer(&receiver->bus->peers, request->sender_id);
+                if (sender) {
+                        r = driver_send_reply_u(sender, request->serial, DBUS_START_REPLY_SUCCESS);
+                        if (r)
+                                return error_trace(r);
+                }
+
+                activation_request_free(request);
+        }
+
+        /*
+         * All pending messages are routed to the same receiver. Consecutive
+         * messages of a sender share their sender snapshot, and are queued as
+         * one batch, so the quota of the receiver is charged once per batch,
+         * and the sender is only looked up once per batch, since it cannot
+         * disappear while we dispatch.
+         */
+        c_list_for_each_entry_safe(message, message_safe, &activation->activation_messages, link) {
+                batch[n_batch++] = message;
+
+                if (n_batch < PEER_BATCH_MAX &&
+                    &message_safe->link != &activation->activation_messages &&
+                    message_safe->sender == message->sender &&
+                    message_safe->user == message->user)
+                        continue;
+
+                r = driver_name_activated_batch(receiver, batch, n_batch);
+                if (r)
+                        return error_trace(r);
+
+                n_batch = 0;
+        }
+
+        return 0;
+}
+
+static int driver_end_read(CDVar *var) {
+        int r;
+
+        r = c_dvar_end_read(var);
         switch (r) {
         case C_DVAR_E_CORRUPT_DATA:
         case C_DVAR_E_OUT_OF_BOUNDS:
@@ -624,6 +1178,47 @@ static int driver_end_read(CDVar *var) {
         }
 }
 
+static int driver_read_strings(CDVar *var, size_t max, const char ***stringsp, size_t *n_stringsp) {
+        _c_cleanup_(c_freep) const char **strings = NULL;
+        size_t n_strings = 0, n_allocated = 0;
+        const char **tmp;
+        int r;
+
+        /*
+         * Read a single string array as the only argument and verify the
+         * input. The returned array points into the message, and must be
+         * released with free(), when no longer needed. Arrays with more than
+         * @max entries are refused.
+         */
+
+        c_dvar_read(var, "([");
+        while (c_dvar_more(var)) {
+                if (n_strings >= max)
+                        return DRIVER_E_BATCH_TOO_LARGE;
+
+                if (n_strings >= n_allocated) {
+                        n_allocated = n_allocated ? n_allocated * 2 : 16;
+                        tmp = realloc(strings, n_allocated * sizeof(*strings));
+                        if (!tmp)
+                                return error_origin(-ENOMEM);
+
+                        strings = tmp;
+                }
+
+                c_dvar_read(var, "s", &strings[n_strings++]);
+        }
+        c_dvar_read(var, "])");
+
+        r = driver_end_read(var);
+        if (r)
+                return error_trace(r);
+
+        *stringsp = strings;
+        *n_stringsp = n_strings;
+        strings = NULL;
+        return 0;
+}
+
 static int driver_method_hello(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
         const char *unique_name;
         int r;
@@ -640,9 +1235,7 @@ static int driver_method_hello(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *
         peer_register(peer);
         unique_name = address_to_string(&(Address)ADDRESS_INIT_ID(peer->id));
 
-        c_dvar_write(out_v, "(s)", unique_name);
-
-        r = driver_send_reply(peer, out_v, serial);
+        r = driver_send_reply_s(peer, serial, unique_name);
         if (r)
                 return error_trace(r);
 
@@ -688,9 +1281,7 @@ static int driver_method_request_name(Peer *peer, CDVar *in_v, uint32_t serial,
         else
                 return error_fold(r);
 
-        c_dvar_write(out_v, "(u)", reply);
-
-        r = driver_send_reply(peer, out_v, serial);
+        r = driver_send_reply_u(peer, serial, reply);
         if (r)
                 return error_trace(r);
 
@@ -742,9 +1333,7 @@ static int driver_method_release_name(Peer *peer, CDVar *in_v, uint32_t serial,
         else
                 return error_fold(r);
 
-        c_dvar_write(out_v, "(u)", reply);
-
-        r = driver_send_reply(peer, out_v, serial);
+        r = driver_send_reply_u(peer, serial, reply);
         if (r)
                 return error_trace(r);
 
@@ -799,9 +1388,164 @@ static int driver_method_list_queued_owners(Peer *peer, CDVar *in_v, uint32_t se
         return 0;
 }
 
-static int driver_method_list_names(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
-        Peer *p;
+/*
+ * Name listings are returned in a canonical order: the driver first, then all
+ * unique names ordered by their ID, then all well-known names in lexical
+ * order. Unique names all share the same prefix, followed by the ID in
+ * decimal, so comparing their lengths first yields the order of their IDs.
+ * This order is total on arbitrary strings, so any string can be used as
+ * cursor into a listing, even if that name is no longer on the bus.
+ */
+static int driver_name_rank(const char *name) {
+        if (!strcmp(name, "org.freedesktop.DBus"))
+                return 0;
+        else if (name[0] == ':')
+                return 1;
+        else
+                return 2;
+}
+
+static int driver_name_compare(const char *a, const char *b) {
+        int rank_a, rank_b;
+        size_t n_a, n_b;
+
+        rank_a = driver_name_rank(a);
+        rank_b = driver_name_rank(b);
+        if (rank_a != rank_b)
+                return rank_a < rank_b ? -1 : 1;
+
+        if (rank_a == 1) {
+                n_a = strlen(a);
+                n_b = strlen(b);
+                if (n_a != n_b)
+                        return n_a < n_b ? -1 : 1;
+        }
+
+        return strcmp(a, b);
+}
+
+static int driver_peer_compare(const void *a, const void *b) {
+        const Peer *peer_a = *(Peer * const *)a, *peer_b = *(Peer * const *)b;
+
+        return (peer_a->id > peer_b->id) - (peer_a->id < peer_b->id);
+}
+
+static int driver_name_list_update(BusNameList *list, Bus *bus, uint64_t generation, bool activatable) {
+        static const CDVarType type[] = {
+                C_DVAR_T_INIT(
+                        DRIVER_T_MESSAGE(
+                                C_DVAR_T_TUPLE1(
+                                        C_DVAR_T_ARRAY(
+                                                C_DVAR_T_s
+                                        )
+                                )
+                        )
+                )
+        };
+        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        _c_cleanup_(c_freep) Peer **peers = NULL;
+        _c_cleanup_(c_freep) const char **names = NULL;
+        size_t i, n_peers = 0, n_names = 0, offset;
+        const uint8_t *body;
+        uint32_t n_string;
         Name *name;
+        Peer *p;
+        void *data;
+        size_t n_data;
+        int r;
+
+        if (list->reply && list->generation == generation)
+                return 0;
+
+        /*
+         * Serialize the listing once, and share its body with all replies
+         * until the next change, just like driver_new_shared_reply() does.
+         * The header is never sent. Unique names are sorted by ID, so the
+         * listing is in canonical order, see driver_name_compare().
+         */
+
+        if (!activatable) {
+                peers = malloc(bus->peers.table.n_entries * sizeof(*peers) ?: 1);
+                if (!peers)
+                        return error_origin(-ENOMEM);
+
+                for (i = 0; i < bus->peers.n_slots; ++i) {
+                        p = bus->peers.slots[i];
+                        if (!p || !peer_is_registered(p))
+                                continue;
+
+                        assert(n_peers < bus->peers.table.n_entries);
+                        peers[n_peers++] = p;
+                }
+
+                qsort(peers, n_peers, sizeof(*peers), driver_peer_compare);
+        }
+
+        c_dvar_begin_write(&var, type, 1);
+        c_dvar_write(&var, "((yyyyuu[(y<s>)(y<g>)])([s",
+                     c_dvar_is_big_endian(&var) ? 'B' : 'l', DBUS_MESSAGE_TYPE_METHOD_RETURN, DBUS_HEADER_FLAG_NO_REPLY_EXPECTED, 1, 0, (uint32_t)-1,
+                     DBUS_MESSAGE_FIELD_SENDER, c_dvar_type_s, "org.freedesktop.DBus",
+                     DBUS_MESSAGE_FIELD_SIGNATURE, c_dvar_type_g, "as",
+                     "org.freedesktop.DBus");
+        ++n_names;
+
+        for (i = 0; i < n_peers; ++i) {
+                driver_dvar_write_unique_name(&var, peers[i]);
+                ++n_names;
+        }
+
+        c_rbtree_for_each_entry(name, &bus->names.name_tree, registry_node) {
+                if (activatable ? !name->activation : !name_primary(name))
+                        continue;
+
+                c_dvar_write(&var, "s", name->name);
+                ++n_names;
+        }
+
+        c_dvar_write(&var, "]))");
+
+        r = c_dvar_end_write(&var, &data, &n_data);
+        if (r)
+                return error_origin(r);
+
+        r = message_new_outgoing(&message, data, n_data);
+        if (r)
+                return error_fold(r);
+
+        /*
+         * Remember where each string is located in the body, so pages of
+         * the listing can be served without walking the registries. The body
+         * is a `as' in native endianness, hence each entry is a 4-byte
+         * aligned length, followed by the zero-terminated string.
+         */
+
+        names = malloc(n_names * sizeof(*names));
+        if (!names)
+                return error_origin(-ENOMEM);
+
+        body = message->body;
+        offset = sizeof(uint32_t);
+        for (i = 0; i < n_names; ++i) {
+                offset = C_ALIGN_TO(offset, sizeof(uint32_t));
+                memcpy(&n_string, body + offset, sizeof(n_string));
+                names[i] = (const char *)body + offset + sizeof(n_string);
+                offset += sizeof(n_string) + n_string + 1;
+        }
+        assert(offset == message->n_body);
+
+        bus_name_list_deinit(list);
+        list->generation = generation;
+        list->reply = message;
+        list->names = names;
+        list->n_names = n_names;
+        message = NULL;
+        names = NULL;
+        return 0;
+}
+
+static int driver_method_list_names(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        Bus *bus = peer->bus;
         int r;
 
         c_dvar_read(in_v, "()");
@@ -810,21 +1554,65 @@ static int driver_method_list_names(Peer *peer, CDVar *in_v, uint32_t serial, CD
         if (r)
                 return error_trace(r);
 
-        c_dvar_write(out_v, "([");
-        c_dvar_write(out_v, "s", "org.freedesktop.DBus");
-        c_rbtree_for_each_entry(p, &peer->bus->peers.peer_tree, registry_node) {
-                if (!peer_is_registered(p))
-                        continue;
+        r = driver_name_list_update(&bus->list_names, bus, bus->name_generation, false);
+        if (r)
+                return error_trace(r);
 
-                driver_dvar_write_unique_name(out_v, p);
-        }
-        c_rbtree_for_each_entry(name, &peer->bus->names.name_tree, registry_node) {
-                if (!name_primary(name))
-                        continue;
+        r = driver_send_shared_reply(peer, serial, driver_type_out_as, bus->list_names.reply);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
 
-                c_dvar_write(out_v, "s", name->name);
+static int driver_method_list_names_paged(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        BusNameList *list = &peer->bus->list_names;
+        size_t i, lower, upper, end;
+        const char *start;
+        uint32_t max;
+        int r;
+
+        /*
+         * This is a broker extension, which returns ListNames() in pages.
+         * It returns at most @max names following @start in canonical order,
+         * plus the cursor to pass as @start to fetch the next page, which is
+         * empty on the last page. An empty @start begins a new listing, and
+         * @max is capped to DRIVER_LIST_NAMES_PAGE_MAX, with 0 selecting the
+         * maximum. Names that appear or disappear between two pages might be
+         * missed, as they would be between two calls to ListNames().
+         */
+
+        c_dvar_read(in_v, "(su)", &start, &max);
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        r = driver_name_list_update(list, peer->bus, peer->bus->name_generation, false);
+        if (r)
+                return error_trace(r);
+
+        lower = 0;
+        if (*start) {
+                upper = list->n_names;
+                while (lower < upper) {
+                        i = lower + (upper - lower) / 2;
+                        if (driver_name_compare(list->names[i], start) <= 0)
+                                lower = i + 1;
+                        else
+                                upper = i;
+                }
         }
-        c_dvar_write(out_v, "])");
+
+        if (!max || max > DRIVER_LIST_NAMES_PAGE_MAX)
+                max = DRIVER_LIST_NAMES_PAGE_MAX;
+
+        end = lower + c_min((size_t)max, list->n_names - lower);
+
+        c_dvar_write(out_v, "([");
+        for (i = lower; i < end; ++i)
+                c_dvar_write(out_v, "s", list->names[i]);
+        c_dvar_write(out_v, "]s)", end < list->n_names ? list->names[end - 1] : "");
 
         r = driver_send_reply(peer, out_v, serial);
         if (r)
@@ -834,7 +1622,7 @@ static int driver_method_list_names(Peer *peer, CDVar *in_v, uint32_t serial, CD
 }
 
 static int driver_method_list_activatable_names(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
-        Name *name;
+        Bus *bus = peer->bus;
         int r;
 
         c_dvar_read(in_v, "()");
@@ -843,17 +1631,11 @@ static int driver_method_list_activatable_names(Peer *peer, CDVar *in_v, uint32_
         if (r)
                 return error_trace(r);
 
-        c_dvar_write(out_v, "([");
-        c_dvar_write(out_v, "s", "org.freedesktop.DBus");
-        c_rbtree_for_each_entry(name, &peer->bus->names.name_tree, registry_node) {
-                if (!name->activation)
-                        continue;
-
-                c_dvar_write(out_v, "s", name->name);
-        }
-        c_dvar_write(out_v, "])");
+        r = driver_name_list_update(&bus->list_activatable_names, bus, bus->names.activation_generation, true);
+        if (r)
+                return error_trace(r);
 
-        r = driver_send_reply(peer, out_v, serial);
+        r = driver_send_shared_reply(peer, serial, driver_type_out_as, bus->list_activatable_names.reply);
         if (r)
                 return error_trace(r);
 
@@ -872,14 +1654,12 @@ static int driver_method_name_has_owner(Peer *peer, CDVar *in_v, uint32_t serial
                 return error_trace(r);
 
         if (strcmp(name, "org.freedesktop.DBus") == 0) {
-                c_dvar_write(out_v, "(b)", true);
+                r = driver_send_reply_b(peer, serial, true);
         } else {
                 connection = bus_find_peer_by_name(peer->bus, NULL, name);
 
-                c_dvar_write(out_v, "(b)", !!connection);
+                r = driver_send_reply_b(peer, serial, !!connection);
         }
-
-        r = driver_send_reply(peer, out_v, serial);
         if (r)
                 return error_trace(r);
 
@@ -906,9 +1686,7 @@ static int driver_method_start_service_by_name(Peer *peer, CDVar *in_v, uint32_t
 
         ownership = name_primary(name);
         if (ownership) {
-                c_dvar_write(out_v, "(u)", DBUS_START_REPLY_ALREADY_RUNNING);
-
-                r = driver_send_reply(peer, out_v, serial);
+                r = driver_send_reply_u(peer, serial, DBUS_START_REPLY_ALREADY_RUNNING);
                 if (r)
                         return error_trace(r);
         } else {
@@ -953,7 +1731,7 @@ static int driver_method_update_activation_environment(Peer *peer, CDVar *in_v,
         if (r)
                 return error_trace(r);
 
-        r = broker_update_environment(BROKER(peer->bus), env, n_env);
+        r = broker_bus_update_environment(BROKER_BUS(peer->bus), env, n_env);
         if (r)
                 return error_fold(r);
 
@@ -991,9 +1769,7 @@ static int driver_method_get_name_owner(Peer *peer, CDVar *in_v, uint32_t serial
 
         owner_str = address_to_string(&addr);
 
-        c_dvar_write(out_v, "(s)", owner_str);
-
-        r = driver_send_reply(peer, out_v, serial);
+        r = driver_send_reply_s(peer, serial, owner_str);
         if (r)
                 return error_trace(r);
 
@@ -1012,16 +1788,14 @@ static int driver_method_get_connection_unix_user(Peer *peer, CDVar *in_v, uint3
                 return error_trace(r);
 
         if (!strcmp(name, "org.freedesktop.DBus")) {
-                c_dvar_write(out_v, "(u)", peer->bus->user->uid);
+                r = driver_send_reply_u(peer, serial, peer->bus->user->uid);
         } else {
                 connection = bus_find_peer_by_name(peer->bus, NULL, name);
                 if (!connection)
                         return DRIVER_E_PEER_NOT_FOUND;
 
-                c_dvar_write(out_v, "(u)", connection->user->uid);
+                r = driver_send_reply_u(peer, serial, connection->user->uid);
         }
-
-        r = driver_send_reply(peer, out_v, serial);
         if (r)
                 return error_trace(r);
 
@@ -1040,40 +1814,24 @@ static int driver_method_get_connection_unix_process_id(Peer *peer, CDVar *in_v,
                 return error_trace(r);
 
         if (!strcmp(name, "org.freedesktop.DBus")) {
-                c_dvar_write(out_v, "(u)", peer->bus->pid);
+                r = driver_send_reply_u(peer, serial, peer->bus->pid);
         } else {
                 connection = bus_find_peer_by_name(peer->bus, NULL, name);
                 if (!connection)
                         return DRIVER_E_PEER_NOT_FOUND;
 
-                c_dvar_write(out_v, "(u)", connection->pid);
+                r = driver_send_reply_u(peer, serial, connection->pid);
         }
-
-        r = driver_send_reply(peer, out_v, serial);
         if (r)
                 return error_trace(r);
 
         return 0;
 }
 
-static int driver_method_get_connection_credentials(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
-        Peer *connection;
-        const char *name;
-        int r;
-
-        c_dvar_read(in_v, "(s)", &name);
-
-        r = driver_end_read(in_v);
-        if (r)
-                return error_trace(r);
-
-        connection = bus_find_peer_by_name(peer->bus, NULL, name);
-        if (!connection)
-                return DRIVER_E_PEER_NOT_FOUND;
-
-        c_dvar_write(out_v, "([{s<u>}{s<u>}",
-                     "UnixUserID", c_dvar_type_u, connection->user->uid,
-                     "ProcessID", c_dvar_type_u, connection->pid);
+static void driver_write_credentials(CDVar *var, Peer *connection) {
+        c_dvar_write(var, "[{s<u>}{s<u>}",
+                     "UnixUserID", c_dvar_type_u, connection->user->uid,
+                     "ProcessID", c_dvar_type_u, connection->pid);
 
         if (connection->seclabel) {
                 /*
@@ -1086,9 +1844,104 @@ static int driver_method_get_connection_credentials(Peer *peer, CDVar *in_v, uin
                  * The @peer->seclabel field always has a trailing zero-byte,
                  * so we can safely copy from it.
                  */
-                c_dvar_write(out_v, "{s<", "LinuxSecurityLabel", (const CDVarType[]){ C_DVAR_T_INIT(C_DVAR_T_ARRAY(C_DVAR_T_y)) });
-                driver_write_bytes(out_v, connection->seclabel, connection->n_seclabel + 1);
-                c_dvar_write(out_v, ">}");
+                c_dvar_write(var, "{s<", "LinuxSecurityLabel", (const CDVarType[]){ C_DVAR_T_INIT(C_DVAR_T_ARRAY(C_DVAR_T_y)) });
+                driver_write_bytes(var, connection->seclabel, connection->n_seclabel + 1);
+                c_dvar_write(var, ">}");
+        }
+
+        c_dvar_write(var, "]");
+}
+
+static int driver_method_get_connection_credentials(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        Peer *connection;
+        const char *name;
+        int r;
+
+        c_dvar_read(in_v, "(s)", &name);
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        connection = bus_find_peer_by_name(peer->bus, NULL, name);
+        if (!connection)
+                return DRIVER_E_PEER_NOT_FOUND;
+
+        c_dvar_write(out_v, "(");
+        driver_write_credentials(out_v, connection);
+        c_dvar_write(out_v, ")");
+
+        r = driver_send_reply(peer, out_v, serial);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_get_name_owners(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        _c_cleanup_(c_freep) const char **names = NULL;
+        size_t i, n_names;
+        Peer *owner;
+        int r;
+
+        /*
+         * This is a broker extension, which behaves like calling
+         * GetNameOwner() for each entry of the array. Names without owner are
+         * omitted from the reply, rather than failing the whole call.
+         */
+
+        r = driver_read_strings(in_v, DRIVER_BATCH_NAMES_MAX, &names, &n_names);
+        if (r)
+                return error_trace(r);
+
+        c_dvar_write(out_v, "([");
+
+        for (i = 0; i < n_names; ++i) {
+                if (!strcmp(names[i], "org.freedesktop.DBus")) {
+                        c_dvar_write(out_v, "{ss}", names[i], "org.freedesktop.DBus");
+                } else {
+                        owner = bus_find_peer_by_name(peer->bus, NULL, names[i]);
+                        if (owner)
+                                c_dvar_write(out_v, "{ss}", names[i], address_to_string(&(Address)ADDRESS_INIT_ID(owner->id)));
+                }
+        }
+
+        c_dvar_write(out_v, "])");
+
+        r = driver_send_reply(peer, out_v, serial);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_get_connection_credentials_batch(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        _c_cleanup_(c_freep) const char **names = NULL;
+        size_t i, n_names;
+        Peer *connection;
+        int r;
+
+        /*
+         * This is a broker extension, which behaves like calling
+         * GetConnectionCredentials() for each entry of the array. Names
+         * without owner are omitted from the reply. Just like the single-name
+         * variant, the bus driver itself has no credentials to report.
+         */
+
+        r = driver_read_strings(in_v, DRIVER_BATCH_NAMES_MAX, &names, &n_names);
+        if (r)
+                return error_trace(r);
+
+        c_dvar_write(out_v, "([");
+
+        for (i = 0; i < n_names; ++i) {
+                connection = bus_find_peer_by_name(peer->bus, NULL, names[i]);
+                if (!connection)
+                        continue;
+
+                c_dvar_write(out_v, "{s", names[i]);
+                driver_write_credentials(out_v, connection);
+                c_dvar_write(out_v, "}");
         }
 
         c_dvar_write(out_v, "])");
@@ -1193,27 +2046,385 @@ static int driver_method_add_match(Peer *peer, CDVar *in_v, uint32_t serial, CDV
         return 0;
 }
 
+static int driver_method_add_matches(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        _c_cleanup_(c_freep) const char **rule_strings = NULL;
+        size_t n_rule_strings;
+        int r;
+
+        /*
+         * This is a broker extension, which behaves like calling AddMatch()
+         * for each entry of the array. However, all rules are added in one
+         * go, and either all of them are added, or none of them is.
+         */
+
+        r = driver_read_strings(in_v, SIZE_MAX, &rule_strings, &n_rule_strings);
+        if (r)
+                return error_trace(r);
+
+        r = peer_add_matches(peer, rule_strings, n_rule_strings);
+        if (r) {
+                if (r == PEER_E_QUOTA)
+                        return DRIVER_E_QUOTA;
+                else if (r == PEER_E_MATCH_INVALID)
+                        return DRIVER_E_MATCH_INVALID;
+                else
+                        return error_trace(r);
+        }
+
+        c_dvar_write(out_v, "()");
+
+        r = driver_send_reply(peer, out_v, serial);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_set_signal_coalescing(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        bool enable;
+        int r;
+
+        /*
+         * This is a broker extension. If enabled, a PropertiesChanged signal
+         * that is still queued for the caller is dropped, once a newer one for
+         * the same object and interface is queued, which lists all of its
+         * properties again, either with their new value or as invalidated.
+         * Signals that list other properties are kept. This bounds the queue
+         * of peers that cannot keep up with property updates, without hiding
+         * any change from them.
+         */
+
+        c_dvar_read(in_v, "(b)", &enable);
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        peer->coalesce_signals = enable;
+
+        c_dvar_write(out_v, "()");
+
+        r = driver_send_reply(peer, out_v, serial);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_set_reply_priority(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        bool enable;
+        int r;
+
+        /*
+         * This is a broker extension. If enabled, method returns and errors
+         * queued for the caller are written before any queued method calls,
+         * and those before any queued signals. Messages of the same type are
+         * still delivered in order, but the ordering guarantees across types
+         * are given up, hence this is only ever enabled on request. This
+         * keeps replies from being stuck behind signal floods.
+         */
+
+        c_dvar_read(in_v, "(b)", &enable);
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        socket_set_lanes(&peer->connection.socket, enable);
+
+        c_dvar_write(out_v, "()");
+
+        r = driver_send_reply(peer, out_v, serial);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_setup_shared_memory(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        _c_cleanup_(fdlist_freep) FDList *fds = NULL;
+        int r, fd_array[2];
+        void *data;
+        size_t n_data;
+
+        /*
+         * This is a broker extension. It sets up a pair of shared-memory
+         * rings, through which all further messages are exchanged with the
+         * caller, rather than through its socket. The reply hands over the
+         * memfd of the rings and the wake-up socket. Since the generic reply
+         * header does not announce FDs, the reply is marshalled here, rather
+         * than into @out_v. See socket_open_shm() for the protocol.
+         */
+
+        c_dvar_read(in_v, "()");
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        /* without a reply, the caller could never attach to the rings */
+        if (!serial)
+                return DRIVER_E_UNEXPECTED_FLAGS;
+
+        if (peer->connection.socket.shm)
+                return DRIVER_E_SHARED_MEMORY_ENABLED;
+
+        r = connection_open_shm(&peer->connection, &fd_array[0], &fd_array[1]);
+        if (r)
+                return (r == CONNECTION_E_QUOTA) ? DRIVER_E_QUOTA : error_fold(r);
+
+        r = fdlist_new_consume_fds(&fds, fd_array, C_ARRAY_SIZE(fd_array));
+        if (r) {
+                close(fd_array[1]);
+                close(fd_array[0]);
+                return error_fold(r);
+        }
+
+        c_dvar_begin_write(&var, driver_type_out_hh, 1);
+        c_dvar_write(&var, "(");
+        driver_write_reply_header_with_fds(&var, peer, serial, driver_type_out_hh, fdlist_count(fds));
+        c_dvar_write(&var, "(hh))", 0, 1);
+
+        r = c_dvar_end_write(&var, &data, &n_data);
+        if (r)
+                return error_origin(r);
+
+        r = message_new_outgoing(&message, data, n_data);
+        if (r)
+                return error_fold(r);
+
+        message->fds = fds;
+        fds = NULL;
+
+        r = driver_send_unicast(peer, message);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
 static int driver_method_remove_match(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
         const char *rule_string;
         int r;
 
-        c_dvar_read(in_v, "(s)", &rule_string);
+        c_dvar_read(in_v, "(s)", &rule_string);
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        r = peer_remove_match(peer, rule_string);
+        if (r) {
+                if (r == PEER_E_MATCH_NOT_FOUND)
+                        return DRIVER_E_MATCH_NOT_FOUND;
+                else if (r == PEER_E_MATCH_INVALID)
+                        return DRIVER_E_MATCH_INVALID;
+                else
+                        return error_fold(r);
+        }
+
+        c_dvar_write(out_v, "()");
+
+        r = driver_send_reply(peer, out_v, serial);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_get_id(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        int r;
+
+        /* verify the input argument */
+        c_dvar_read(in_v, "()");
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        r = driver_send_shared_reply(peer, serial, driver_type_out_s, peer->bus->reply_get_id);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_introspect(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        int r;
+
+        c_dvar_read(in_v, "()");
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        r = driver_send_shared_reply(peer, serial, driver_type_out_s, peer->bus->reply_introspect);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static void driver_write_histogram(CDVar *out_v, const char *prefix, Histogram *histogram) {
+        static const struct {
+                const char *suffix;
+                unsigned int permille;
+        } quantiles[] = {
+                { "P50", 500 },
+                { "P99", 990 },
+                { "P999", 999 },
+        };
+        char key[128];
+        size_t i;
+        int r;
+
+        for (i = 0; i < C_ARRAY_SIZE(quantiles); ++i) {
+                r = snprintf(key, sizeof(key), "org.bus1.DBus.Debug.Stats.%sLatency%s", prefix, quantiles[i].suffix);
+                assert(r > 0 && r < (int)sizeof(key));
+
+                c_dvar_write(out_v, "{s<t>}", key, c_dvar_type_t, histogram_read_quantile(histogram, quantiles[i].permille));
+        }
+}
+
+static int driver_method_get_stats(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        Metrics *metrics = &peer->bus->metrics;
+        const MessageStats *message_stats = message_get_stats();
+        uint32_t n_active = 0, n_incomplete = 0, n_names = 0;
+        uint64_t n_memory = 0, n_selinux_hits, n_selinux_misses;
+        Name *name;
+        Peer *p;
+        size_t i;
+        int r;
+
+        if (!peer_is_privileged(peer))
+                return DRIVER_E_PEER_NOT_PRIVILEGED;
+
+        c_dvar_read(in_v, "()");
+
+        r = driver_end_read(in_v);
+        if (r)
+                return error_trace(r);
+
+        for (i = 0; i < peer->bus->peers.n_slots; ++i) {
+                p = peer->bus->peers.slots[i];
+                if (!p)
+                        continue;
+
+                if (peer_is_registered(p))
+                        ++n_active;
+                else
+                        ++n_incomplete;
+
+                n_memory += peer_get_memory(p);
+        }
+
+        c_rbtree_for_each_entry(name, &peer->bus->names.name_tree, registry_node)
+                if (name_primary(name))
+                        ++n_names;
+
+        bus_selinux_get_cache_stats(&n_selinux_hits, &n_selinux_misses);
+
+        /*
+         * The first entries follow dbus-daemon(1), so existing tools keep
+         * working. The remaining entries are specific to this broker. They
+         * cover the time spent dispatching messages, in nanoseconds of CPU
+         * time (measured for one in --metrics-sample-rate messages on
+         * average), as well as the latency quantiles of message dispatch,
+         * driver calls and socket writes, in nanoseconds of wall-clock time.
+         * The stall count is the number of event-loop callbacks that ran
+         * longer than --stall-threshold.
+         *
+         * The SELinux counters report how many send checks were answered by
+         * the SELinux decision cache, and how many had to query the AVC.
+         */
+        c_dvar_write(out_v, "([{s<u>}{s<u>}{s<u>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}",
+                     "ActiveConnections", c_dvar_type_u, n_active,
+                     "IncompleteConnections", c_dvar_type_u, n_incomplete,
+                     "BusNames", c_dvar_type_u, n_names,
+                     "org.bus1.DBus.Debug.Stats.DispatchCount", c_dvar_type_t, metrics->count,
+                     "org.bus1.DBus.Debug.Stats.DispatchMinimum", c_dvar_type_t, metrics->count ? metrics->minimum : 0,
+                     "org.bus1.DBus.Debug.Stats.DispatchMaximum", c_dvar_type_t, metrics->maximum,
+                     "org.bus1.DBus.Debug.Stats.DispatchAverage", c_dvar_type_t, metrics->average,
+                     "org.bus1.DBus.Debug.Stats.DispatchStandardDeviation", c_dvar_type_t, (uint64_t)metrics_read_standard_deviation(metrics),
+                     "org.bus1.DBus.Debug.Stats.StitchCount", c_dvar_type_t, message_stats->n_stitched,
+                     "org.bus1.DBus.Debug.Stats.StitchInPlaceCount", c_dvar_type_t, message_stats->n_stitched_in_place,
+                     "org.bus1.DBus.Debug.Stats.ConnectionMemory", c_dvar_type_t, n_memory,
+                     "org.bus1.DBus.Debug.Stats.DispatchStalls", c_dvar_type_t, peer->connection.socket_file.context->n_stalls,
+                     "org.bus1.DBus.Debug.Stats.SELinuxCacheHits", c_dvar_type_t, n_selinux_hits,
+                     "org.bus1.DBus.Debug.Stats.SELinuxCacheMisses", c_dvar_type_t, n_selinux_misses);
+
+        driver_write_histogram(out_v, "Dispatch", &peer->bus->histogram_dispatch);
+        driver_write_histogram(out_v, "Driver", &peer->bus->histogram_driver);
+        driver_write_histogram(out_v, "Write", &peer->bus->histogram_write);
+
+        c_dvar_write(out_v, "])");
+
+        r = driver_send_reply(peer, out_v, serial);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int driver_method_get_connection_stats(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        NameOwnership *ownership;
+        MatchRule *rule;
+        Peer *connection;
+        uint32_t n_names = 0, n_matches = 0;
+        const char *name;
+        int r;
+
+        if (!peer_is_privileged(peer))
+                return DRIVER_E_PEER_NOT_PRIVILEGED;
+
+        c_dvar_read(in_v, "(s)", &name);
 
         r = driver_end_read(in_v);
         if (r)
                 return error_trace(r);
 
-        r = peer_remove_match(peer, rule_string);
-        if (r) {
-                if (r == PEER_E_MATCH_NOT_FOUND)
-                        return DRIVER_E_MATCH_NOT_FOUND;
-                else if (r == PEER_E_MATCH_INVALID)
-                        return DRIVER_E_MATCH_INVALID;
-                else
-                        return error_fold(r);
-        }
+        connection = bus_find_peer_by_name(peer->bus, NULL, name);
+        if (!connection)
+                return DRIVER_E_PEER_NOT_FOUND;
 
-        c_dvar_write(out_v, "()");
+        c_rbtree_for_each_entry(ownership, &connection->owned_names.ownership_tree, owner_node)
+                if (name_ownership_is_primary(ownership))
+                        ++n_names;
+
+        c_rbtree_for_each_entry(rule, &connection->owned_matches.rule_tree, owner_node)
+                ++n_matches;
+
+        /*
+         * Like dbus-daemon(1), OutgoingMessages and OutgoingBytes describe
+         * the messages currently queued on the connection. The broker
+         * specific entries are counters since the peer connected, except
+         * for the memory currently used by the connection, see
+         * peer_get_memory().
+         */
+        c_dvar_write(out_v, "([{s<s>}{s<u>}{s<u>}{s<u>}{s<u>}",
+                     "UniqueName", c_dvar_type_s, address_to_string(&(Address)ADDRESS_INIT_ID(connection->id)),
+                     "OutgoingMessages", c_dvar_type_u, (uint32_t)connection->connection.socket.out.n_messages,
+                     "OutgoingBytes", c_dvar_type_u, (uint32_t)c_min(connection->connection.socket.out.n_bytes, (size_t)UINT32_MAX),
+                     "BusNames", c_dvar_type_u, n_names,
+                     "MatchRules", c_dvar_type_u, n_matches);
+        c_dvar_write(out_v, "{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}{s<t>}",
+                     "org.bus1.DBus.Debug.Stats.MessagesReceived", c_dvar_type_t, connection->stats.n_messages_in,
+                     "org.bus1.DBus.Debug.Stats.BytesReceived", c_dvar_type_t, connection->stats.n_bytes_in,
+                     "org.bus1.DBus.Debug.Stats.MessagesSent", c_dvar_type_t, connection->stats.n_messages_out,
+                     "org.bus1.DBus.Debug.Stats.BytesSent", c_dvar_type_t, connection->stats.n_bytes_out,
+                     "org.bus1.DBus.Debug.Stats.QuotaDenials", c_dvar_type_t, connection->stats.n_quota_denials,
+                     "org.bus1.DBus.Debug.Stats.PolicyDenials", c_dvar_type_t, connection->stats.n_policy_denials,
+                     "org.bus1.DBus.Debug.Stats.SlowConsumerDrops", c_dvar_type_t, connection->stats.n_slow_consumer_drops,
+                     "org.bus1.DBus.Debug.Stats.CoalescedSignals", c_dvar_type_t, (uint64_t)connection->connection.socket.out.n_coalesced,
+                     "org.bus1.DBus.Debug.Stats.ConnectionMemory", c_dvar_type_t, (uint64_t)peer_get_memory(connection),
+                     "org.bus1.DBus.Debug.Stats.DispatchTime", c_dvar_type_t, connection->stats.n_dispatch_nsec);
+        if (connection->capture)
+                c_dvar_write(out_v, "{s<t>}{s<t>}",
+                             "org.bus1.DBus.Debug.Stats.CapturedMessages", c_dvar_type_t, connection->capture->n_captured,
+                             "org.bus1.DBus.Debug.Stats.CaptureDrops", c_dvar_type_t, connection->capture->n_dropped);
+        c_dvar_write(out_v, "])");
 
         r = driver_send_reply(peer, out_v, serial);
         if (r)
@@ -1222,20 +2433,45 @@ static int driver_method_remove_match(Peer *peer, CDVar *in_v, uint32_t serial,
         return 0;
 }
 
-static int driver_method_get_id(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
-        char buffer[sizeof(peer->bus->guid) * 2 + 1] = {};
+static int driver_method_get_interface_stats(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        TrafficRegistry *traffic = &peer->bus->traffic;
+        TrafficEntry *entry;
         int r;
 
-        /* verify the input argument */
+        if (!peer_is_privileged(peer))
+                return DRIVER_E_PEER_NOT_PRIVILEGED;
+
         c_dvar_read(in_v, "()");
 
         r = driver_end_read(in_v);
         if (r)
                 return error_trace(r);
 
-        /* write the output message */
-        c_string_to_hex(peer->bus->guid, sizeof(peer->bus->guid), buffer);
-        c_dvar_write(out_v, "(s)", buffer);
+        /*
+         * Traffic is only accounted once someone asks for it, so the first
+         * call returns no entries. The counters, like those of the peers,
+         * are totals, and the dispatch time is in nanoseconds of CPU time.
+         * Traffic that did not fit the registry is reported with an empty
+         * interface and member.
+         */
+        traffic->enabled = true;
+
+        c_dvar_write(out_v, "([");
+        c_rbtree_for_each_entry(entry, &traffic->entry_tree, registry_node)
+                c_dvar_write(out_v, "(ssttt)",
+                             entry->interface,
+                             entry->member,
+                             entry->counters.n_messages,
+                             entry->counters.n_bytes,
+                             entry->counters.n_dispatch_nsec);
+        if (traffic->overflow.n_messages)
+                c_dvar_write(out_v, "(ssttt)",
+                             "",
+                             "",
+                             traffic->overflow.n_messages,
+                             traffic->overflow.n_bytes,
+                             traffic->overflow.n_dispatch_nsec);
+        c_dvar_write(out_v, "])");
 
         r = driver_send_reply(peer, out_v, serial);
         if (r)
@@ -1244,114 +2480,52 @@ static int driver_method_get_id(Peer *peer, CDVar *in_v, uint32_t serial, CDVar
         return 0;
 }
 
-static int driver_method_introspect(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
-        static const char *introspection =
-                "<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
-                "\"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
-                "<node>\n"
-                "  <interface name=\"org.freedesktop.DBus\">\n"
-                "    <method name=\"Hello\">\n"
-                "      <arg direction=\"out\" type=\"s\"/>\n"
-                "    </method>\n"
-                "    <method name=\"RequestName\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"in\" type=\"u\"/>\n"
-                "      <arg direction=\"out\" type=\"u\"/>\n"
-                "    </method>\n"
-                "    <method name=\"ReleaseName\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"u\"/>\n"
-                "    </method>\n"
-                "    <method name=\"StartServiceByName\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"in\" type=\"u\"/>\n"
-                "      <arg direction=\"out\" type=\"u\"/>\n"
-                "    </method>\n"
-                "    <method name=\"UpdateActivationEnvironment\">\n"
-                "      <arg direction=\"in\" type=\"a{ss}\"/>\n"
-                "    </method>\n"
-                "    <method name=\"NameHasOwner\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"b\"/>\n"
-                "    </method>\n"
-                "    <method name=\"ListNames\">\n"
-                "      <arg direction=\"out\" type=\"as\"/>\n"
-                "    </method>\n"
-                "    <method name=\"ListActivatableNames\">\n"
-                "      <arg direction=\"out\" type=\"as\"/>\n"
-                "    </method>\n"
-                "    <method name=\"AddMatch\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "    </method>\n"
-                "    <method name=\"RemoveMatch\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "    </method>\n"
-                "    <method name=\"GetNameOwner\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"s\"/>\n"
-                "    </method>\n"
-                "    <method name=\"ListQueuedOwners\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"as\"/>\n"
-                "    </method>\n"
-                "    <method name=\"GetConnectionUnixUser\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"u\"/>\n"
-                "    </method>\n"
-                "    <method name=\"GetConnectionUnixProcessID\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"u\"/>\n"
-                "    </method>\n"
-                "    <method name=\"GetAdtAuditSessionData\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"ay\"/>\n"
-                "    </method>\n"
-                "    <method name=\"GetConnectionSELinuxSecurityContext\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"ay\"/>\n"
-                "    </method>\n"
-                "    <method name=\"ReloadConfig\">\n"
-                "    </method>\n"
-                "    <method name=\"GetId\">\n"
-                "      <arg direction=\"out\" type=\"s\"/>\n"
-                "    </method>\n"
-                "    <method name=\"GetConnectionCredentials\">\n"
-                "      <arg direction=\"in\" type=\"s\"/>\n"
-                "      <arg direction=\"out\" type=\"a{sv}\"/>\n"
-                "    </method>\n"
-                "    <signal name=\"NameOwnerChanged\">\n"
-                "      <arg type=\"s\"/>\n"
-                "      <arg type=\"s\"/>\n"
-                "      <arg type=\"s\"/>\n"
-                "    </signal>\n"
-                "    <signal name=\"NameLost\">\n"
-                "      <arg type=\"s\"/>\n"
-                "    </signal>\n"
-                "    <signal name=\"NameAcquired\">\n"
-                "      <arg type=\"s\"/>\n"
-                "    </signal>\n"
-                "  </interface>\n"
-                "  <interface name=\"org.freedesktop.DBus.Introspectable\">\n"
-                "    <method name=\"Introspect\">\n"
-                "      <arg direction=\"out\" type=\"s\"/>\n"
-                "    </method>\n"
-                "  </interface>\n"
-                "  <interface name=\"org.freedesktop.DBus.Monitoring\">\n"
-                "    <method name=\"BecomeMonitor\">\n"
-                "      <arg direction=\"in\" type=\"as\"/>\n"
-                "      <arg direction=\"in\" type=\"u\"/>\n"
-                "    </method>\n"
-                "  </interface>\n"
-                "</node>\n";
+static int driver_heavy_hitter_compare(const void *a, const void *b) {
+        const SketchEntry *ea = *(SketchEntry * const *)a, *eb = *(SketchEntry * const *)b;
+
+        /* highest first */
+        return ea->count < eb->count ? 1 : ea->count > eb->count ? -1 : 0;
+}
+
+static int driver_method_get_heavy_hitters(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        TrafficRegistry *traffic = &peer->bus->traffic;
+        SketchEntry *entries[SKETCH_TOP_MAX];
+        const char *interface, *member;
+        uint64_t sender_id;
+        size_t i;
         int r;
 
+        if (!peer_is_privileged(peer))
+                return DRIVER_E_PEER_NOT_PRIVILEGED;
+
         c_dvar_read(in_v, "()");
 
         r = driver_end_read(in_v);
         if (r)
                 return error_trace(r);
 
-        c_dvar_write(out_v, "(s)", introspection);
+        /*
+         * Like GetInterfaceStats(), this enables the traffic accounting. The
+         * counts are estimates, which are never lower than the real number
+         * of messages. Senders are reported even if they disconnected since.
+         */
+        traffic->enabled = true;
+
+        for (i = 0; i < traffic->heavy_hitters.n_top; ++i)
+                entries[i] = &traffic->heavy_hitters.top[i];
+
+        qsort(entries, traffic->heavy_hitters.n_top, sizeof(*entries), driver_heavy_hitter_compare);
+
+        c_dvar_write(out_v, "([");
+        for (i = 0; i < traffic->heavy_hitters.n_top; ++i) {
+                traffic_read_heavy_hitter(entries[i], &interface, &member, &sender_id);
+                c_dvar_write(out_v, "(ssst)",
+                             interface,
+                             member,
+                             address_to_string(&(Address)ADDRESS_INIT_ID(sender_id)),
+                             entries[i]->count);
+        }
+        c_dvar_write(out_v, "])");
 
         r = driver_send_reply(peer, out_v, serial);
         if (r)
@@ -1360,10 +2534,11 @@ static int driver_method_introspect(Peer *peer, CDVar *in_v, uint32_t serial, CD
         return 0;
 }
 
-static int driver_method_become_monitor(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+static int driver_become_monitor(Peer *peer, CDVar *in_v, bool with_capture, FDList *fds, uint32_t serial, CDVar *out_v) {
+        _c_cleanup_(capture_freep) Capture *capture = NULL;
         MatchOwner owned_matches;
         const char *match_string;
-        uint32_t flags;
+        uint32_t flags, index = 0;
         int r;
 
         if (!peer_is_privileged(peer))
@@ -1371,6 +2546,7 @@ static int driver_method_become_monitor(Peer *peer, CDVar *in_v, uint32_t serial
 
         /* first create all the match objects before modifying the peer */
         match_owner_init(&owned_matches);
+        owned_matches.arena = &peer->arena;
 
         c_dvar_read(in_v, "([");
         do {
@@ -1384,13 +2560,16 @@ static int driver_method_become_monitor(Peer *peer, CDVar *in_v, uint32_t serial
                 else
                         match_string = "";
 
-                r = match_owner_ref_rule(&owned_matches, NULL, peer->user, match_string);
+                r = match_owner_ref_rule(&owned_matches, NULL, peer->user, &peer->bus->match_keys, match_string);
                 if (r) {
                         r = (r == MATCH_E_INVALID) ? DRIVER_E_MATCH_INVALID : error_fold(r);
                         goto error;
                 }
         } while (c_dvar_more(in_v));
-        c_dvar_read(in_v, "]u)", &flags);
+        c_dvar_read(in_v, "]u", &flags);
+        if (with_capture)
+                c_dvar_read(in_v, "h", &index);
+        c_dvar_read(in_v, ")");
 
         /* verify the input arguments*/
         r = driver_end_read(in_v);
@@ -1404,6 +2583,14 @@ static int driver_method_become_monitor(Peer *peer, CDVar *in_v, uint32_t serial
                 goto error;
         }
 
+        if (with_capture) {
+                r = capture_new(&capture, peer->connection.socket_file.context, fdlist_get(fds, index));
+                if (r) {
+                        r = (r == CAPTURE_E_INVALID_FD) ? DRIVER_E_CAPTURE_INVALID : error_fold(r);
+                        goto error;
+                }
+        }
+
         /* write the output message */
         c_dvar_write(out_v, "()");
 
@@ -1429,6 +2616,8 @@ static int driver_method_become_monitor(Peer *peer, CDVar *in_v, uint32_t serial
 
         match_owner_deinit(&owned_matches);
 
+        peer->capture = capture;
+        capture = NULL;
         return 0;
 
 error:
@@ -1438,8 +2627,25 @@ error:
         return r;
 }
 
+static int driver_method_become_monitor(Peer *peer, CDVar *in_v, uint32_t serial, CDVar *out_v) {
+        return error_trace(driver_become_monitor(peer, in_v, false, NULL, serial, out_v));
+}
+
+/*
+ * BecomeCaptureMonitor() is an extension of BecomeMonitor(), which takes an
+ * additional stream socket. Rather than receiving all monitored messages on
+ * its connection, the monitor gets them written to that socket as pcap
+ * stream. If the socket cannot keep up, messages are dropped, rather than
+ * disconnecting the monitor. See capture.c for details.
+ */
+static int driver_method_become_capture_monitor(Peer *peer, CDVar *in_v, FDList *fds, uint32_t serial, CDVar *out_v) {
+        return error_trace(driver_become_monitor(peer, in_v, true, fds, serial, out_v));
+}
+
 static int driver_handle_method(const DriverMethod *method, Peer *peer, const char *path, uint32_t serial, const char *signature_in, Message *message_in) {
         _c_cleanup_(c_dvar_deinit) CDVar var_in = C_DVAR_INIT, var_out = C_DVAR_INIT;
+        Bus *bus = peer->bus;
+        uint64_t ts;
         int r;
 
         /*
@@ -1455,60 +2661,127 @@ static int driver_handle_method(const DriverMethod *method, Peer *peer, const ch
                 return error_trace(r);
 
         c_dvar_begin_read(&var_in, message_in->big_endian, method->in, 1, message_in->body, message_in->n_body);
-        c_dvar_begin_write(&var_out, method->out, 1);
 
         /*
          * Write the generic reply-header and then call into the method-handler
          * of the specific driver method. Note that the driver-methods are
          * responsible to call driver_end_read(var_in), to verify all read data
-         * was correct.
+         * was correct. Replies with a specialized writer are marshaled by the
+         * handlers themselves, so the output variant is left untouched.
          */
 
-        c_dvar_write(&var_out, "(");
-        driver_write_reply_header(&var_out, peer, serial, method->out);
+        if (!driver_type_is_specialized(method->out)) {
+                c_dvar_begin_write(&var_out, method->out, 1);
+                c_dvar_write(&var_out, "(");
+                driver_write_reply_header(&var_out, peer, serial, method->out);
+        }
 
-        r = method->fn(peer, &var_in, serial, &var_out);
+        ts = metrics_get_time(bus->histogram_driver.clock);
+        if (method->fn_with_fds)
+                r = method->fn_with_fds(peer, &var_in, message_in->fds, serial, &var_out);
+        else
+                r = method->fn(peer, &var_in, serial, &var_out);
+        histogram_sample_add(&bus->histogram_driver, ts);
         if (r)
                 return error_trace(r);
 
         return 0;
 }
 
-static int driver_dispatch_method(Peer *peer, uint32_t serial, const char *method, const char *path, const char *signature, Message *message) {
-        static const DriverMethod methods[] = {
-                { "Hello",                                      NULL,                           driver_method_hello,                                            c_dvar_type_unit,       driver_type_out_s },
-                { "RequestName",                                NULL,                           driver_method_request_name,                                     driver_type_in_su,      driver_type_out_u },
-                { "ReleaseName",                                NULL,                           driver_method_release_name,                                     driver_type_in_s,       driver_type_out_u },
-                { "ListQueuedOwners",                           NULL,                           driver_method_list_queued_owners,                               driver_type_in_s,       driver_type_out_as },
-                { "ListNames",                                  NULL,                           driver_method_list_names,                                       c_dvar_type_unit,       driver_type_out_as },
-                { "ListActivatableNames",                       NULL,                           driver_method_list_activatable_names,                           c_dvar_type_unit,       driver_type_out_as },
-                { "NameHasOwner",                               NULL,                           driver_method_name_has_owner,                                   driver_type_in_s,       driver_type_out_b },
-                { "StartServiceByName",                         NULL,                           driver_method_start_service_by_name,                            driver_type_in_su,      driver_type_out_u },
-                { "UpdateActivationEnvironment",                "/org/freedesktop/DBus",        driver_method_update_activation_environment,                    driver_type_in_apss,    driver_type_out_unit },
-                { "GetNameOwner",                               NULL,                           driver_method_get_name_owner,                                   driver_type_in_s,       driver_type_out_s },
-                { "GetConnectionUnixUser",                      NULL,                           driver_method_get_connection_unix_user,                         driver_type_in_s,       driver_type_out_u },
-                { "GetConnectionUnixProcessID",                 NULL,                           driver_method_get_connection_unix_process_id,                   driver_type_in_s,       driver_type_out_u },
-                { "GetConnectionCredentials",                   NULL,                           driver_method_get_connection_credentials,                       driver_type_in_s,       driver_type_out_apsv },
-                { "GetAdtAuditSessionData",                     NULL,                           driver_method_get_adt_audit_session_data,                       driver_type_in_s,       driver_type_out_ay },
-                { "GetConnectionSELinuxSecurityContext",        NULL,                           driver_method_get_connection_selinux_security_context,          driver_type_in_s,       driver_type_out_ay },
-                { "AddMatch",                                   NULL,                           driver_method_add_match,                                        driver_type_in_s,       driver_type_out_unit },
-                { "RemoveMatch",                                NULL,                           driver_method_remove_match,                                     driver_type_in_s,       driver_type_out_unit },
-                { "GetId",                                      NULL,                           driver_method_get_id,                                           c_dvar_type_unit,       driver_type_out_s },
-                { "Introspect",                                 NULL,                           driver_method_introspect,                                       c_dvar_type_unit,       driver_type_out_s },
-                { "BecomeMonitor",                              "/org/freedesktop/DBus",        driver_method_become_monitor,                                   driver_type_in_asu,     driver_type_out_unit },
-        };
+static const DriverMethod driver_methods[] = {
+        { "Hello",                                      "org.freedesktop.DBus",                 NULL,                           driver_method_hello,                                            c_dvar_type_unit,       driver_type_out_s },
+        { "RequestName",                                "org.freedesktop.DBus",                 NULL,                           driver_method_request_name,                                     driver_type_in_su,      driver_type_out_u },
+        { "ReleaseName",                                "org.freedesktop.DBus",                 NULL,                           driver_method_release_name,                                     driver_type_in_s,       driver_type_out_u },
+        { "ListQueuedOwners",                           "org.freedesktop.DBus",                 NULL,                           driver_method_list_queued_owners,                               driver_type_in_s,       driver_type_out_as },
+        { "ListNames",                                  "org.freedesktop.DBus",                 NULL,                           driver_method_list_names,                                       c_dvar_type_unit,       driver_type_out_as },
+        { "ListNamesPaged",                             "org.freedesktop.DBus",                 NULL,                           driver_method_list_names_paged,                                 driver_type_in_su,      driver_type_out_ass },
+        { "ListActivatableNames",                       "org.freedesktop.DBus",                 NULL,                           driver_method_list_activatable_names,                           c_dvar_type_unit,       driver_type_out_as },
+        { "NameHasOwner",                               "org.freedesktop.DBus",                 NULL,                           driver_method_name_has_owner,                                   driver_type_in_s,       driver_type_out_b },
+        { "StartServiceByName",                         "org.freedesktop.DBus",                 NULL,                           driver_method_start_service_by_name,                            driver_type_in_su,      driver_type_out_u },
+        { "UpdateActivationEnvironment",                "org.freedesktop.DBus",                 "/org/freedesktop/DBus",        driver_method_update_activation_environment,                    driver_type_in_apss,    driver_type_out_unit },
+        { "GetNameOwner",                               "org.freedesktop.DBus",                 NULL,                           driver_method_get_name_owner,                                   driver_type_in_s,       driver_type_out_s },
+        { "GetConnectionUnixUser",                      "org.freedesktop.DBus",                 NULL,                           driver_method_get_connection_unix_user,                         driver_type_in_s,       driver_type_out_u },
+        { "GetConnectionUnixProcessID",                 "org.freedesktop.DBus",                 NULL,                           driver_method_get_connection_unix_process_id,                   driver_type_in_s,       driver_type_out_u },
+        { "GetConnectionCredentials",                   "org.freedesktop.DBus",                 NULL,                           driver_method_get_connection_credentials,                       driver_type_in_s,       driver_type_out_apsv },
+        { "GetNameOwners",                              "org.freedesktop.DBus",                 NULL,                           driver_method_get_name_owners,                                  driver_type_in_as,      driver_type_out_apss },
+        { "GetConnectionCredentialsBatch",              "org.freedesktop.DBus",                 NULL,                           driver_method_get_connection_credentials_batch,                 driver_type_in_as,      driver_type_out_apsapsv },
+        { "GetAdtAuditSessionData",                     "org.freedesktop.DBus",                 NULL,                           driver_method_get_adt_audit_session_data,                       driver_type_in_s,       driver_type_out_ay },
+        { "GetConnectionSELinuxSecurityContext",        "org.freedesktop.DBus",                 NULL,                           driver_method_get_connection_selinux_security_context,          driver_type_in_s,       driver_type_out_ay },
+        { "AddMatch",                                   "org.freedesktop.DBus",                 NULL,                           driver_method_add_match,                                        driver_type_in_s,       driver_type_out_unit },
+        { "AddMatches",                                 "org.freedesktop.DBus",                 NULL,                           driver_method_add_matches,                                      driver_type_in_as,      driver_type_out_unit },
+        { "RemoveMatch",                                "org.freedesktop.DBus",                 NULL,                           driver_method_remove_match,                                     driver_type_in_s,       driver_type_out_unit },
+        { "SetSignalCoalescing",                        "org.freedesktop.DBus",                 NULL,                           driver_method_set_signal_coalescing,                            driver_type_in_b,       driver_type_out_unit },
+        { "SetReplyPriority",                           "org.freedesktop.DBus",                 NULL,                           driver_method_set_reply_priority,                               driver_type_in_b,       driver_type_out_unit },
+        { "SetupSharedMemory",                          "org.freedesktop.DBus",                 NULL,                           driver_method_setup_shared_memory,                              c_dvar_type_unit,       driver_type_out_hh },
+        { "GetId",                                      "org.freedesktop.DBus",                 NULL,                           driver_method_get_id,                                           c_dvar_type_unit,       driver_type_out_s },
+        { "Introspect",                                 "org.freedesktop.DBus.Introspectable",  NULL,                           driver_method_introspect,                                       c_dvar_type_unit,       driver_type_out_s },
+        { "BecomeMonitor",                              "org.freedesktop.DBus.Monitoring",      "/org/freedesktop/DBus",        driver_method_become_monitor,                                   driver_type_in_asu,     driver_type_out_unit },
+        { "BecomeCaptureMonitor",                       "org.freedesktop.DBus.Monitoring",      "/org/freedesktop/DBus",        NULL,                                                           driver_type_in_asuh,    driver_type_out_unit,   driver_method_become_capture_monitor },
+        { "GetStats",                                   "org.freedesktop.DBus.Debug.Stats",     "/org/freedesktop/DBus",        driver_method_get_stats,                                        c_dvar_type_unit,       driver_type_out_apsv },
+        { "GetConnectionStats",                         "org.freedesktop.DBus.Debug.Stats",     "/org/freedesktop/DBus",        driver_method_get_connection_stats,                             driver_type_in_s,       driver_type_out_apsv },
+        { "GetInterfaceStats",                          "org.freedesktop.DBus.Debug.Stats",     "/org/freedesktop/DBus",        driver_method_get_interface_stats,                              c_dvar_type_unit,       driver_type_out_arssttt },
+        { "GetHeavyHitters",                            "org.freedesktop.DBus.Debug.Stats",     "/org/freedesktop/DBus",        driver_method_get_heavy_hitters,                                c_dvar_type_unit,       driver_type_out_arssst },
+};
 
-        if (_c_unlikely_(!peer_is_registered(peer)) && strcmp(method, "Hello") != 0)
-                return DRIVER_E_PEER_NOT_REGISTERED;
+/*
+ * Driver methods are looked up through a static hash table, which is built
+ * on first use. Member names are unique across all driver interfaces, so
+ * the member alone is used as key, and the interface is verified against
+ * the entry that was found.
+ */
+#define DRIVER_POW2_SMEAR(_x, _s) ((_x) | ((_x) >> (_s)))
+#define DRIVER_POW2(_x) (DRIVER_POW2_SMEAR(DRIVER_POW2_SMEAR(DRIVER_POW2_SMEAR(DRIVER_POW2_SMEAR(DRIVER_POW2_SMEAR((size_t)(_x) - 1, 1), 2), 4), 8), 16) + 1)
 
-        for (size_t i = 0; i < C_ARRAY_SIZE(methods); i++) {
-                if (strcmp(methods[i].name, method) != 0)
-                        continue;
+/* the next power of two of twice the number of methods, to keep probes short */
+#define DRIVER_METHOD_BUCKETS DRIVER_POW2(C_ARRAY_SIZE(driver_methods) * 2)
+
+static const DriverMethod *driver_method_buckets[DRIVER_METHOD_BUCKETS];
+
+static size_t driver_method_probe(const char *member) {
+        size_t mask = C_ARRAY_SIZE(driver_method_buckets) - 1, i;
+
+        for (i = hash_string(member) & mask; driver_method_buckets[i]; i = (i + 1) & mask)
+                if (!strcmp(driver_method_buckets[i]->name, member))
+                        break;
+
+        return i;
+}
+
+static const DriverMethod *driver_find_method(const char *member) {
+        static bool initialized = false;
+        size_t i;
 
-                return driver_handle_method(&methods[i], peer, path, serial, signature, message);
+        if (_c_unlikely_(!initialized)) {
+                static_assert(!(DRIVER_METHOD_BUCKETS & (DRIVER_METHOD_BUCKETS - 1)) &&
+                              C_ARRAY_SIZE(driver_methods) * 2 <= DRIVER_METHOD_BUCKETS,
+                              "Driver method table is too small");
+
+                for (i = 0; i < C_ARRAY_SIZE(driver_methods); ++i)
+                        driver_method_buckets[driver_method_probe(driver_methods[i].name)] = &driver_methods[i];
+
+                initialized = true;
+        }
+
+        return driver_method_buckets[driver_method_probe(member)];
+}
+
+static int driver_dispatch_method(Peer *peer, uint32_t serial, const char *interface, const char *member, const char *path, const char *signature, Message *message) {
+        const DriverMethod *method;
+
+        method = driver_find_method(member);
+
+        if (interface) {
+                if (_c_unlikely_(strcmp(interface, method ? method->interface : "org.freedesktop.DBus") != 0))
+                        return DRIVER_E_UNEXPECTED_INTERFACE;
         }
 
-        return DRIVER_E_UNEXPECTED_METHOD;
+        if (_c_unlikely_(!peer_is_registered(peer)) && (!method || method->fn != driver_method_hello))
+                return DRIVER_E_PEER_NOT_REGISTERED;
+
+        if (!method)
+                return DRIVER_E_UNEXPECTED_METHOD;
+
+        return driver_handle_method(method, peer, path, serial, signature, message);
 }
 
 static int driver_dispatch_interface(Peer *peer, uint32_t serial, const char *interface, const char *member, const char *path, const char *signature, Message *message) {
@@ -1525,63 +2798,57 @@ static int driver_dispatch_interface(Peer *peer, uint32_t serial, const char *in
                 return error_fold(r);
         }
 
-        if (interface) {
-                if (_c_unlikely_(strcmp(member, "Introspect") == 0)) {
-                        if (strcmp(interface, "org.freedesktop.DBus.Introspectable") != 0)
-                                return DRIVER_E_UNEXPECTED_INTERFACE;
-                } else if (_c_unlikely_(strcmp(member, "BecomeMonitor") == 0)) {
-                        if (strcmp(interface, "org.freedesktop.DBus.Monitoring") != 0)
-                                return DRIVER_E_UNEXPECTED_INTERFACE;
-                } else {
-                        if (_c_unlikely_(strcmp(interface, "org.freedesktop.DBus") != 0))
-                                return DRIVER_E_UNEXPECTED_INTERFACE;
-                }
-        }
-
-        return driver_dispatch_method(peer, serial, member, path, signature, message);
+        return driver_dispatch_method(peer, serial, interface, member, path, signature, message);
 }
 
 int driver_goodbye(Peer *peer, bool silent) {
+        _c_cleanup_(c_freep) NameChange *changes = NULL;
         ReplySlot *reply, *reply_safe;
-        MatchRule *rule, *rule_safe;
-        NameOwnership *ownership, *ownership_safe;
-        int r;
+        MatchFilter filter;
+        size_t i, n_changes;
+        int r = 0;
 
         peer_flush_matches(peer);
 
         c_list_for_each_entry_safe(reply, reply_safe, &peer->owned_replies.reply_list, owner_link)
                 reply_slot_free(reply);
 
-        c_list_for_each_entry_safe(rule, rule_safe, &peer->matches.rule_list, registry_link)
-                match_rule_unlink(rule);
+        match_registry_flush(&peer->matches);
 
-        c_rbtree_for_each_entry_unlink(ownership, ownership_safe, &peer->owned_names.ownership_tree, owner_node) {
-                NameChange change;
+        /*
+         * Release all names in one go, and only then send out the resulting
+         * notifications. They all share the same match filter, whose indexed
+         * fields are resolved once. The arguments differ between the
+         * signals, so each of them still does its own match lookup.
+         */
+        r = peer_release_all_names(peer, &changes, &n_changes);
+        if (r)
+                return error_fold(r);
 
-                name_change_init(&change);
-                peer_release_name_ownership(peer, ownership, &change);
-                if (!silent && change.name)
-                        r = driver_name_owner_changed(peer->bus,
-                                                      change.name->name,
-                                                      c_container_of(change.old_owner, Peer, owned_names),
-                                                      c_container_of(change.new_owner, Peer, owned_names));
-                else
-                        r = 0;
-                name_change_deinit(&change);
-                if (r)
-                        return error_fold(r);
+        driver_init_name_owner_changed_filter(peer->bus, &filter);
+
+        for (i = 0; i < n_changes; ++i) {
+                if (!silent && !r)
+                        r = driver_name_owner_changed_with_filter(peer->bus,
+                                                                  &filter,
+                                                                  changes[i].name->name,
+                                                                  c_container_of(changes[i].old_owner, Peer, owned_names),
+                                                                  c_container_of(changes[i].new_owner, Peer, owned_names));
+                name_change_deinit(&changes[i]);
         }
+        if (r)
+                return error_fold(r);
 
         if (peer_is_registered(peer)) {
                 if (!silent) {
-                        r = driver_name_owner_changed(peer->bus, NULL, peer, NULL);
+                        r = driver_name_owner_changed_with_filter(peer->bus, &filter, NULL, peer, NULL);
                         if (r)
                                 return error_trace(r);
                 }
                 peer_unregister(peer);
         }
 
-        c_rbtree_for_each_entry_unlink(reply, reply_safe, &peer->replies_outgoing.reply_tree, registry_node) {
+        c_list_for_each_entry_safe(reply, reply_safe, &peer->replies_outgoing.reply_list, registry_link) {
                 Peer *sender = c_container_of(reply->owner, Peer, owned_replies);
 
                 if (!silent) {
@@ -1596,20 +2863,71 @@ int driver_goodbye(Peer *peer, bool silent) {
         return 0;
 }
 
+int driver_reply_timeout(DispatchTimer *timer) {
+        ReplySlot *reply = c_container_of(timer, ReplySlot, timeout);
+        Peer *sender = c_container_of(reply->owner, Peer, owned_replies);
+        uint32_t serial = reply->serial;
+        int r;
+
+        /*
+         * The callee did not reply in time. Drop the slot, so the reply quota
+         * of the caller is released and a late reply is refused, and tell the
+         * caller, just like we do if the callee disconnects.
+         */
+        reply_slot_free(reply);
+
+        r = driver_send_error(sender, serial, "org.freedesktop.DBus.Error.NoReply", "Remote peer did not reply in time");
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+/**
+ * driver_reply_refused() - tell a caller its reply cannot be delivered
+ * @receiver:           caller the reply was meant for
+ * @serial:             serial of the call
+ *
+ * This is called when a reply carries file descriptors, but @receiver
+ * exchanges its messages through shared memory, which cannot carry them. The
+ * reply is dropped, and @receiver gets an error in its place, so it does not
+ * wait for a reply that never arrives.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int driver_reply_refused(Peer *receiver, uint32_t serial) {
+        int r;
+
+        r = driver_send_error(receiver, serial, "org.freedesktop.DBus.Error.NotSupported", driver_error_to_string(DRIVER_E_FDS_REFUSED));
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
 static int driver_forward_unicast(Peer *sender, const char *destination, Message *message) {
         Peer *receiver;
         Name *name;
         NameSet sender_names = NAME_SET_INIT_FROM_OWNER(&sender->owned_names);
         int r;
 
-        receiver = bus_find_peer_by_name(sender->bus, &name, destination);
+        receiver = peer_find_destination(sender, &name, destination);
         if (!receiver) {
                 if (!name || !name->activation)
                         return DRIVER_E_DESTINATION_NOT_FOUND;
 
-                r = activation_queue_message(name->activation, sender->user, &sender->owned_names, sender->policy, message);
-                if (r)
-                        return error_fold(r);
+                r = activation_queue_message(name->activation,
+                                             sender->user,
+                                             &sender->owned_names,
+                                             sender->policy,
+                                             sender->bus->policy_generation,
+                                             message);
+                if (r) {
+                        if (r == ACTIVATION_E_QUOTA)
+                                return DRIVER_E_QUOTA;
+                        else
+                                return error_fold(r);
+                }
 
                 return 0;
         }
@@ -1624,6 +2942,8 @@ static int driver_forward_unicast(Peer *sender, const char *destination, Message
                         return DRIVER_E_SEND_DENIED;
                 else if (r == PEER_E_RECEIVE_DENIED)
                         return DRIVER_E_RECEIVE_DENIED;
+                else if (r == PEER_E_FDS_REFUSED)
+                        return DRIVER_E_FDS_REFUSED;
                 else
                         return error_fold(r);
         }
@@ -1631,67 +2951,30 @@ static int driver_forward_unicast(Peer *sender, const char *destination, Message
         return 0;
 }
 
-static int driver_monitor_to_matches(MatchRegistry *matches, MatchFilter *filter, uint64_t transaction_id, Message *message) {
-        MatchRule *rule;
-        int r;
-
-        for (rule = match_rule_next_monitor_match(matches, NULL, filter); rule; rule = match_rule_next_monitor_match(matches, rule, filter)) {
-                Peer *receiver = c_container_of(rule->owner, Peer, owned_matches);
-
-                if (transaction_id <= receiver->transaction_id)
-                        continue;
-
-                receiver->transaction_id = c_max(transaction_id, receiver->transaction_id);
-
-                r = connection_queue(&receiver->connection, NULL, message);
-                if (r) {
-                        if (r == CONNECTION_E_QUOTA)
-                                connection_shutdown(&receiver->connection);
-                        else
-                                return error_fold(r);
-                }
-        }
-
-        return 0;
-}
-
-static int driver_monitor(Peer *sender, Message *message) {
-        MatchFilter filter = MATCH_FILTER_INIT;
+static int driver_monitor(Peer *sender, MatchFilter *filter, Message *message) {
+        PeerRegistry *peers = &sender->bus->peers;
         NameOwnership *ownership;
         int r;
 
-        filter.type = message->metadata.header.type;
-        filter.sender = sender->id;
-        filter.interface = message->metadata.fields.interface;
-        filter.member = message->metadata.fields.member,
-        filter.path = message->metadata.fields.path;
-
-        for (size_t i = 0; i < 64; ++i) {
-                if (message->metadata.args[i].element == 's') {
-                        filter.args[i] = message->metadata.args[i].value;
-                        filter.argpaths[i] = message->metadata.args[i].value;
-                } else if (message->metadata.args[i].element == 'o') {
-                        filter.argpaths[i] = message->metadata.args[i].value;
-                }
-        }
-
-        /* start a new transaction, to avoid duplicates */
-        ++sender->bus->transaction_ids;
-
-        r = driver_monitor_to_matches(&sender->bus->wildcard_matches, &filter, sender->bus->transaction_ids, message);
-        if (r)
-                return error_trace(r);
+        /* collect all monitors first, to avoid duplicates */
+        driver_monitor_collect(peers, &sender->bus->wildcard_matches, filter);
 
         c_rbtree_for_each_entry(ownership, &sender->owned_names.ownership_tree, owner_node) {
                 if (!name_ownership_is_primary(ownership))
                         continue;
 
-                r = driver_monitor_to_matches(&ownership->name->matches, &filter, sender->bus->transaction_ids, message);
-                if (r)
-                        return error_trace(r);
+                driver_monitor_collect(peers, &ownership->name->matches, filter);
+        }
+
+        driver_monitor_collect(peers, &sender->matches, filter);
+
+        if (filter->error) {
+                peer_registry_clear_receivers(peers);
+                return error_trace(filter->error);
         }
 
-        r = driver_monitor_to_matches(&sender->matches, &filter, sender->bus->transaction_ids, message);
+        r = driver_monitor_deliver(peers, message);
+        peer_registry_clear_receivers(peers);
         if (r)
                 return error_trace(r);
 
@@ -1699,11 +2982,23 @@ static int driver_monitor(Peer *sender, Message *message) {
 }
 
 static int driver_dispatch_internal(Peer *peer, Message *message) {
+        MatchFilter filter, *filterp = NULL;
         int r;
 
-        r = driver_monitor(peer, message);
-        if (r)
-                return error_trace(r);
+        /*
+         * Monitors are rare, so the entire monitoring step is skipped unless
+         * there is at least one on the bus. If there is, the filter is shared
+         * with the broadcast below, so the message metadata is resolved, and
+         * its arguments parsed, at most once.
+         */
+        if (_c_unlikely_(peer->bus->n_monitors)) {
+                peer_broadcast_filter_init(&filter, peer->bus, peer->id, NULL, message);
+                filterp = &filter;
+
+                r = driver_monitor(peer, filterp, message);
+                if (r)
+                        return error_trace(r);
+        }
 
         if (_c_unlikely_(c_string_equal(message->metadata.fields.destination, "org.freedesktop.DBus"))) {
                 return error_trace(driver_dispatch_interface(peer,
@@ -1722,7 +3017,7 @@ static int driver_dispatch_internal(Peer *peer, Message *message) {
                 if (message->metadata.header.type == DBUS_MESSAGE_TYPE_SIGNAL) {
                         NameSet sender_names = NAME_SET_INIT_FROM_OWNER(&peer->owned_names);
 
-                        r = peer_broadcast(peer->policy, &sender_names, &peer->matches, peer->id, NULL, peer->bus, NULL, message);
+                        r = peer_broadcast(peer->policy, &sender_names, &peer->matches, peer->id, NULL, peer->bus, filterp, message);
                         if (r)
                                 return error_fold(r);
 
@@ -1746,6 +3041,8 @@ static int driver_dispatch_internal(Peer *peer, Message *message) {
                                      message);
                 if (r == PEER_E_UNEXPECTED_REPLY)
                         return DRIVER_E_UNEXPECTED_REPLY;
+                else if (r == PEER_E_FDS_REFUSED)
+                        return DRIVER_E_FDS_REFUSED;
                 else
                         return error_fold(r);
         default:
@@ -1753,21 +3050,7 @@ static int driver_dispatch_internal(Peer *peer, Message *message) {
         }
 }
 
-int driver_dispatch(Peer *peer, Message *message) {
-        int r;
-
-        if (peer_is_monitor(peer))
-                return DRIVER_E_PROTOCOL_VIOLATION;
-
-        r = message_parse_metadata(message);
-        if (r > 0)
-                return DRIVER_E_PROTOCOL_VIOLATION;
-        else if (r < 0)
-                return error_fold(r);
-
-        message_stitch_sender(message, peer->id);
-
-        r = driver_dispatch_internal(peer, message);
+static int driver_handle_result(Peer *peer, Message *message, int r) {
         switch (r) {
         case DRIVER_E_PEER_NOT_REGISTERED:
                 r = driver_send_error(peer, message_read_serial(message), "org.freedesktop.DBus.Error.AccessDenied", driver_error_to_string(r));
@@ -1777,6 +3060,7 @@ int driver_dispatch(Peer *peer, Message *message) {
         case DRIVER_E_INVALID_MESSAGE:
                 return DRIVER_E_PROTOCOL_VIOLATION;
         case DRIVER_E_PEER_ALREADY_REGISTERED:
+        case DRIVER_E_SHARED_MEMORY_ENABLED:
                 r = driver_send_error(peer, message_read_serial(message), "org.freedesktop.DBus.Error.Failed", driver_error_to_string(r));
                 break;
         case DRIVER_E_UNEXPECTED_PATH:
@@ -1801,9 +3085,11 @@ int driver_dispatch(Peer *peer, Message *message) {
         case DRIVER_E_NAME_RESERVED:
         case DRIVER_E_NAME_UNIQUE:
         case DRIVER_E_NAME_INVALID:
+        case DRIVER_E_CAPTURE_INVALID:
                 r = driver_send_error(peer, message_read_serial(message), "org.freedesktop.DBus.Error.InvalidArgs", driver_error_to_string(r));
                 break;
         case DRIVER_E_QUOTA:
+        case DRIVER_E_BATCH_TOO_LARGE:
                 r = driver_send_error(peer, message_read_serial(message), "org.freedesktop.DBus.Error.LimitsExceeded", driver_error_to_string(r));
                 break;
         case DRIVER_E_PEER_NOT_FOUND:
@@ -1827,9 +3113,135 @@ int driver_dispatch(Peer *peer, Message *message) {
         case DRIVER_E_SELINUX_NOT_SUPPORTED:
                 r = driver_send_error(peer, message_read_serial(message), "org.freedesktop.DBus.Error.SELinuxSecurityContextUnknown", driver_error_to_string(r));
                 break;
+        case DRIVER_E_FDS_REFUSED:
+                r = driver_send_error(peer, message_read_serial(message), "org.freedesktop.DBus.Error.NotSupported", driver_error_to_string(r));
+                break;
         default:
                 break;
         }
 
         return error_trace(r);
 }
+
+int driver_dispatch(Peer *peer, Message *message) {
+        int r;
+
+        if (peer_is_monitor(peer))
+                return DRIVER_E_PROTOCOL_VIOLATION;
+
+        r = message_parse_metadata(message);
+        if (r > 0)
+                return DRIVER_E_PROTOCOL_VIOLATION;
+        else if (r < 0)
+                return error_fold(r);
+
+        message_stitch_sender(message, &peer->sender);
+
+        TRACE_PROBE(message_parse, peer->id, message->metadata.header.serial, message->metadata.header.type);
+
+        r = driver_dispatch_internal(peer, message);
+
+        TRACE_PROBE(message_route, peer->id, message->metadata.header.serial, r);
+
+        return error_trace(driver_handle_result(peer, message, r));
+}
+
+/**
+ * driver_admit() - decide whether to receive a large message
+ * @peer:               sending peer
+ * @message:            partial message, only its header was received
+ * @admitp:             output argument for the decision
+ *
+ * This is called for large messages, once their header was received, but
+ * before their body is. If the message would be rejected anyway, since its
+ * destination does not exist, or policy or quota deny it, the error reply is
+ * sent right away and @admitp is set to false, so the body can be discarded
+ * without ever being buffered. Otherwise, @admitp is set to true, and the
+ * message is passed to driver_dispatch() once complete, which runs all
+ * checks again.
+ *
+ * Only unicasts to other peers are rejected early. Monitors must see every
+ * message in full, and invalid messages are left to driver_dispatch() to
+ * deal with.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int driver_admit(Peer *peer, Message *message, bool *admitp) {
+        const char *destination;
+        Peer *receiver;
+        Name *name;
+        int r;
+
+        *admitp = true;
+
+        if (_c_unlikely_(peer->bus->n_monitors) || peer_is_monitor(peer) || !peer_is_registered(peer))
+                return 0;
+
+        r = message_peek_metadata(message);
+        if (r)
+                return (r > 0) ? 0 : error_fold(r);
+
+        destination = message->metadata.fields.destination;
+        if (!destination || c_string_equal(destination, "org.freedesktop.DBus"))
+                return 0;
+
+        if (message->metadata.header.type != DBUS_MESSAGE_TYPE_METHOD_CALL &&
+            message->metadata.header.type != DBUS_MESSAGE_TYPE_SIGNAL)
+                return 0;
+
+        receiver = peer_find_destination(peer, &name, destination);
+        if (!receiver) {
+                if (name && name->activation)
+                        return 0;
+
+                r = DRIVER_E_DESTINATION_NOT_FOUND;
+        } else {
+                r = peer_admit_call(peer, receiver, message);
+                if (!r)
+                        return 0;
+                else if (r == PEER_E_QUOTA)
+                        r = DRIVER_E_QUOTA;
+                else if (r == PEER_E_SEND_DENIED)
+                        r = DRIVER_E_SEND_DENIED;
+                else if (r == PEER_E_RECEIVE_DENIED)
+                        r = DRIVER_E_RECEIVE_DENIED;
+                else
+                        return error_fold(r);
+        }
+
+        *admitp = false;
+        return error_trace(driver_handle_result(peer, message, r));
+}
+
+/**
+ * driver_init_replies() - prepare constant driver replies
+ * @bus:                bus to operate on
+ *
+ * Some driver methods reply with constant data, most prominently
+ * Introspect(), which replies with a large XML document. This serializes the
+ * bodies of those replies once, so they can be shared by all replies.
+ * Similarly, the constant header of NameOwnerChanged is serialized once, and
+ * used as template for all those signals.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int driver_init_replies(Bus *bus) {
+        char buffer[sizeof(bus->guid) * 2 + 1] = {};
+        int r;
+
+        r = driver_new_shared_reply(&bus->reply_introspect, driver_introspection);
+        if (r)
+                return error_trace(r);
+
+        c_string_to_hex(bus->guid, sizeof(bus->guid), buffer);
+
+        r = driver_new_shared_reply(&bus->reply_get_id, buffer);
+        if (r)
+                return error_trace(r);
+
+        r = driver_new_signal_template(&bus->signal_name_owner_changed, "NameOwnerChanged", "sss");
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
@@ -4,9 +4,11 @@
  * DBus Driver
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 
 typedef struct Bus Bus;
+typedef struct DispatchTimer DispatchTimer;
 typedef struct MatchOwner MatchOwner;
 typedef struct Message Message;
 typedef struct Peer Peer;
@@ -32,6 +34,7 @@ enum {
         DRIVER_E_UNEXPECTED_REPLY,
 
         DRIVER_E_QUOTA,
+        DRIVER_E_BATCH_TOO_LARGE,
 
         DRIVER_E_UNEXPECTED_FLAGS,
         DRIVER_E_UNEXPECTED_ENVIRONMENT_UPDATE,
@@ -53,12 +56,21 @@ enum {
         DRIVER_E_MATCH_INVALID,
         DRIVER_E_MATCH_NOT_FOUND,
 
+        DRIVER_E_CAPTURE_INVALID,
+
         DRIVER_E_ADT_NOT_SUPPORTED,
         DRIVER_E_SELINUX_NOT_SUPPORTED,
 
+        DRIVER_E_SHARED_MEMORY_ENABLED,
+        DRIVER_E_FDS_REFUSED,
+
         _DRIVER_E_MAX,
 };
 
+int driver_init_replies(Bus *bus);
 int driver_dispatch(Peer *peer, Message *message);
+int driver_admit(Peer *peer, Message *message, bool *admitp);
 void driver_matches_cleanup(MatchOwner *owner, Bus *bus, User *user);
 int driver_goodbye(Peer *peer, bool silent);
+int driver_reply_timeout(DispatchTimer *timer);
+int driver_reply_refused(Peer *receiver, uint32_t serial);
@@ -14,15 +14,11 @@
 #include "util/dispatch.h"
 #include "util/error.h"
 
-static int listener_dispatch(DispatchFile *file) {
-        Listener *listener = c_container_of(file, Listener, socket_file);
+static int listener_accept(Listener *listener) {
         _c_cleanup_(peer_freep) Peer *peer = NULL;
         _c_cleanup_(c_closep) int fd = -1;
         int r;
 
-        if (!(dispatch_file_events(file) & EPOLLIN))
-                return 0;
-
         fd = accept4(listener->socket_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
         if (fd < 0) {
                 if (errno == EAGAIN) {
@@ -32,7 +28,7 @@ static int listener_dispatch(DispatchFile *file) {
                          * caller about it.
                          */
                         dispatch_file_clear(&listener->socket_file, EPOLLIN);
-                        return 0;
+                        return LISTENER_E_DRAINED;
                 } else {
                         /*
                          * The linux UDS layer does not return pending errors
@@ -43,7 +39,7 @@ static int listener_dispatch(DispatchFile *file) {
                 }
         }
 
-        r = peer_new_with_fd(&peer, listener->bus, listener->policy, listener->guid, file->context, fd);
+        r = peer_new_with_fd(&peer, listener->bus, listener, listener->guid, listener->socket_file.context, fd);
         if (r == PEER_E_QUOTA || r == PEER_E_CONNECTION_REFUSED)
                 /*
                  * The user has too many open connections, or a policy disallows it to
@@ -63,6 +59,40 @@ static int listener_dispatch(DispatchFile *file) {
         return error_fold(r);
 }
 
+static int listener_dispatch(DispatchFile *file) {
+        Listener *listener = c_container_of(file, Listener, socket_file);
+        unsigned int i;
+        int r;
+
+        if (!(dispatch_file_events(file) & EPOLLIN))
+                return 0;
+
+        /*
+         * Accept up to a batch of connections per dispatch round. If the
+         * batch is exhausted, EPOLLIN stays set and the listener is
+         * dispatched again on the next round, after all other ready files had
+         * their turn. Hence, established peers are never starved by a login
+         * storm, while the listener no longer pays a full round per accept.
+         *
+         * The batch size adapts to the backlog: it grows while the backlog
+         * exceeds it, and shrinks again once the backlog drains early.
+         */
+        for (i = 0; i < listener->n_batch; ++i) {
+                r = listener_accept(listener);
+                if (r == LISTENER_E_DRAINED)
+                        break;
+                else if (r)
+                        return error_trace(r);
+        }
+
+        if (i >= listener->n_batch)
+                listener->n_batch = c_min(listener->n_batch * 2, LISTENER_BATCH_MAX);
+        else if (i < listener->n_batch / 2)
+                listener->n_batch = c_max(listener->n_batch / 2, LISTENER_BATCH_MIN);
+
+        return 0;
+}
+
 /**
  * listener_init_with_fd() - XXX
  */
@@ -107,11 +137,52 @@ int listener_init_with_fd(Listener *l,
         return 0;
 }
 
+/**
+ * listener_set_policy() - replace the policy of a listener
+ * @listener:           listener to operate on
+ * @policy:             new policy to use
+ *
+ * This replaces the policy of @listener with @policy, transferring ownership
+ * of @policy to @listener. New peers are created with the new policy right
+ * away. Peers that are already connected keep their current snapshot until
+ * it is used the next time, at which point it is rebound, see
+ * peer_refresh_policy(). Cached policy verdicts are invalidated.
+ *
+ * Note that the connect policy is only checked on connection setup, hence
+ * connected peers are never disconnected by a policy reload. The only
+ * exception are peers accepted while @listener had no policy at all. Those
+ * are checked against the first policy set, and refused if denied.
+ */
+void listener_set_policy(Listener *listener, PolicyRegistry *policy) {
+        Peer *peer;
+
+        policy_registry_free(listener->policy);
+        listener->policy = policy;
+        ++listener->bus->policy_generation;
+
+        /* pending peers are idle, kick them so they get promoted */
+        c_list_for_each_entry(peer, &listener->peer_list, listener_link)
+                if (!peer->policy)
+                        dispatch_file_yield(&peer->connection.socket_file);
+}
+
 /**
  * listener_deinit() - XXX
  */
 void listener_deinit(Listener *listener) {
-        assert(c_list_is_empty(&listener->peer_list));
+        Peer *peer, *t_peer;
+
+        /*
+         * Peers outlive their listener, they just keep their last policy.
+         * Pending peers never got one, kick them so they are refused.
+         */
+        c_list_for_each_entry_safe(peer, t_peer, &listener->peer_list, listener_link) {
+                c_list_unlink(&peer->listener_link);
+                peer->listener = NULL;
+
+                if (!peer->policy)
+                        dispatch_file_yield(&peer->connection.socket_file);
+        }
 
         policy_registry_free(listener->policy);
         dispatch_file_deinit(&listener->socket_file);
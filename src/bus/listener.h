@@ -14,6 +14,16 @@ typedef struct Bus Bus;
 typedef struct DispatchContext DispatchContext;
 typedef struct Listener Listener;
 
+/* connections accepted per round; a storm ramps up in a few rounds, but never stalls one */
+#define LISTENER_BATCH_MIN (4U)
+#define LISTENER_BATCH_MAX (64U)
+
+enum {
+        _LISTENER_E_SUCCESS,
+
+        LISTENER_E_DRAINED,
+};
+
 struct Listener {
         Bus *bus;
         char guid[16];
@@ -21,12 +31,14 @@ struct Listener {
         DispatchFile socket_file;
         PolicyRegistry *policy;
         CList peer_list;
+        unsigned int n_batch;
 };
 
 #define LISTENER_NULL(_x) {                                                     \
                 .socket_fd = -1,                                                \
                 .socket_file = DISPATCH_FILE_NULL((_x).socket_file),            \
                 .peer_list = C_LIST_INIT((_x).peer_list),                       \
+                .n_batch = LISTENER_BATCH_MIN,                                  \
         }
 
 int listener_init_with_fd(Listener *listener,
@@ -37,4 +49,6 @@ int listener_init_with_fd(Listener *listener,
 Listener *listener_free(Listener *free);
 void listener_deinit(Listener *listener);
 
+void listener_set_policy(Listener *listener, PolicyRegistry *policy);
+
 C_DEFINE_CLEANUP(Listener *, listener_deinit);
@@ -8,8 +8,14 @@
 #include <c-string.h>
 #include "bus/match.h"
 #include "dbus/address.h"
+#include "dbus/message.h"
 #include "dbus/protocol.h"
+#include "util/arena.h"
+#include "util/atom.h"
 #include "util/error.h"
+#include "util/pool.h"
+
+static Pool match_rule_pool = POOL_INIT(match_rule_pool, "MatchRule", sizeof(MatchRule), MATCH_RULE_POOL_MAX);
 
 static bool match_key_equal(const char *key1, const char *key2, size_t n_key2) {
         if (strlen(key1) != n_key2)
@@ -35,40 +41,56 @@ static int match_keys_assign(MatchKeys *keys, const char *key, size_t n_key, con
                         keys->filter.type = DBUS_MESSAGE_TYPE_ERROR;
                 else
                         return MATCH_E_INVALID;
+
+                keys->mask |= MATCH_KEY_TYPE;
         } else if (match_key_equal("sender", key, n_key)) {
                 if (keys->sender)
                         return MATCH_E_INVALID;
                 keys->sender = value;
+
+                /* well-known names are resolved by the registry the rule is linked on */
+                address_from_string(&addr, value);
+                if (addr.type == ADDRESS_TYPE_ID) {
+                        keys->filter.sender = addr.id;
+                        keys->mask |= MATCH_KEY_SENDER;
+                }
         } else if (match_key_equal("destination", key, n_key)) {
                 if (keys->destination)
                         return MATCH_E_INVALID;
                 keys->destination = value;
 
                 address_from_string(&addr, value);
-                if (addr.type == ADDRESS_TYPE_ID)
+                if (addr.type == ADDRESS_TYPE_ID) {
                         keys->filter.destination = addr.id;
-                else
+                        keys->mask |= MATCH_KEY_DESTINATION;
+                } else {
                         keys->filter.destination = ADDRESS_ID_INVALID;
+                }
         } else if (match_key_equal("interface", key, n_key)) {
                 if (keys->filter.interface)
                         return MATCH_E_INVALID;
                 keys->filter.interface = value;
+                keys->mask |= MATCH_KEY_INTERFACE;
         } else if (match_key_equal("member", key, n_key)) {
                 if (keys->filter.member)
                         return MATCH_E_INVALID;
                 keys->filter.member = value;
+                keys->mask |= MATCH_KEY_MEMBER;
         } else if (match_key_equal("path", key, n_key)) {
                 if (keys->filter.path || keys->path_namespace)
                         return MATCH_E_INVALID;
                 keys->filter.path = value;
+                keys->mask |= MATCH_KEY_PATH;
         } else if (match_key_equal("path_namespace", key, n_key)) {
                 if (keys->path_namespace || keys->filter.path)
                         return MATCH_E_INVALID;
                 keys->path_namespace = value;
+                keys->mask |= MATCH_KEY_PATH_NAMESPACE;
         } else if (match_key_equal("arg0namespace", key, n_key)) {
                 if (keys->arg0namespace || keys->filter.args[0] || keys->filter.argpaths[0])
                         return MATCH_E_INVALID;
                 keys->arg0namespace = value;
+                keys->mask |= MATCH_KEY_ARG0NAMESPACE;
         } else if (n_key >= strlen("arg") && match_key_equal("arg", key, strlen("arg"))) {
                 unsigned int i = 0;
 
@@ -96,6 +118,9 @@ static int match_keys_assign(MatchKeys *keys, const char *key, size_t n_key, con
                         keys->filter.argpaths[i] = value;
                 } else
                         return MATCH_E_INVALID;
+
+                keys->mask |= MATCH_KEY_ARGS;
+                keys->n_args = c_max(keys->n_args, i + 1);
         } else {
                 return MATCH_E_INVALID;
         }
@@ -207,44 +232,52 @@ static int match_keys_parse(MatchKeys *keys, const char *string) {
                         break;
         }
 
-        return (r == MATCH_E_EOF) ? 0 : error_trace(r);
-}
+        if (r != MATCH_E_EOF)
+                return error_trace(r);
 
-static void match_keys_deinit(MatchKeys *keys) {
-        *keys = (MatchKeys)MATCH_KEYS_NULL;
-}
+        /* rules are indexed by their first path argument, if any */
+        while (keys->i_argpath < keys->n_args && !keys->filter.argpaths[keys->i_argpath])
+                ++keys->i_argpath;
 
-C_DEFINE_CLEANUP(MatchKeys *, match_keys_deinit);
+        return 0;
+}
 
-static int match_keys_init(MatchKeys *k, const char *string, size_t n_string) {
-        _c_cleanup_(match_keys_deinitp) MatchKeys *keys = k;
-        int r;
+static MatchKeys *match_keys_free(MatchKeys *keys) {
+        if (!keys)
+                return NULL;
 
-        assert(n_string > 0);
-        assert(n_string - 1 <= MATCH_RULE_LENGTH_MAX);
+        assert(!keys->n_refs);
 
-        *keys = (MatchKeys)MATCH_KEYS_NULL;
+        if (keys->registry)
+                c_rbtree_remove_init(&keys->registry->keys_tree, &keys->registry_node);
+        for (size_t i = 0; i < C_ARRAY_SIZE(keys->atoms); ++i)
+                atom_unref(keys->atoms[i]);
+        free(keys);
 
-        r = match_keys_parse(keys, string);
-        if (r)
-                return error_trace(r);
+        return NULL;
+}
 
-        keys = NULL;
-        return 0;
+static MatchKeys *match_keys_ref(MatchKeys *keys) {
+        if (keys) {
+                assert(keys->n_refs > 0);
+                ++keys->n_refs;
+        }
+        return keys;
 }
 
-static MatchKeys *match_keys_free(MatchKeys *keys) {
+static MatchKeys *match_keys_unref(MatchKeys *keys) {
         if (keys) {
-                match_keys_deinit(keys);
-                free(keys);
+                assert(keys->n_refs > 0);
+                if (!--keys->n_refs)
+                        match_keys_free(keys);
         }
         return NULL;
 }
 
-C_DEFINE_CLEANUP(MatchKeys *, match_keys_free);
+C_DEFINE_CLEANUP(MatchKeys *, match_keys_unref);
 
 static int match_keys_new(MatchKeys **keysp, const char *string) {
-        _c_cleanup_(match_keys_freep) MatchKeys *keys = NULL;
+        _c_cleanup_(match_keys_unrefp) MatchKeys *keys = NULL;
         size_t n_string;
         int r;
 
@@ -252,14 +285,86 @@ static int match_keys_new(MatchKeys **keysp, const char *string) {
         if (n_string - 1 > MATCH_RULE_LENGTH_MAX)
                 return MATCH_E_INVALID;
 
-        keys = calloc(1, sizeof(*keys) + n_string);
+        /*
+         * The buffer carries the parsed values, followed by a verbatim copy
+         * of the rule string, which is used as key for sharing parsed keys.
+         */
+        keys = calloc(1, sizeof(*keys) + 2 * n_string);
         if (!keys)
                 return error_origin(-ENOMEM);
 
-        r = match_keys_init(keys, string, n_string);
+        *keys = (MatchKeys)MATCH_KEYS_NULL(*keys);
+        keys->string = memcpy(keys->buffer + n_string, string, n_string);
+
+        r = match_keys_parse(keys, string);
+        if (r)
+                return error_trace(r);
+
+        *keysp = keys;
+        keys = NULL;
+        return 0;
+}
+
+static int match_keys_intern(AtomRegistry *atoms, const char **keyp, Atom **atomp) {
+        int r;
+
+        if (!*keyp)
+                return 0;
+
+        r = atom_registry_ref_atom(atoms, atomp, *keyp);
+        if (r)
+                return error_fold(r);
+
+        *keyp = (*atomp)->string;
+        return 0;
+}
+
+static int match_keys_compare_string(CRBTree *tree, void *k, CRBNode *rb) {
+        MatchKeys *keys = c_container_of(rb, MatchKeys, registry_node);
+
+        return strcmp(k, keys->string);
+}
+
+static int match_keys_registry_ref_keys(MatchKeysRegistry *registry, MatchKeys **keysp, const char *string) {
+        _c_cleanup_(match_keys_unrefp) MatchKeys *keys = NULL;
+        CRBNode **slot = NULL, *parent = NULL;
+        AtomRegistry *atoms;
+        int r;
+
+        /*
+         * Many peers subscribe to byte-identical rule strings. If a registry
+         * is given, parsed keys are shared between all rules that were
+         * created from the same string, so each string is only parsed and
+         * interned once. Without a registry, the keys are private.
+         */
+        if (registry) {
+                slot = c_rbtree_find_slot(&registry->keys_tree, match_keys_compare_string, string, &parent);
+                if (!slot) {
+                        *keysp = match_keys_ref(c_container_of(parent, MatchKeys, registry_node));
+                        return 0;
+                }
+        }
+
+        r = match_keys_new(&keys, string);
         if (r)
                 return error_trace(r);
 
+        if (registry) {
+                atoms = registry->atoms;
+                if (atoms) {
+                        r = match_keys_intern(atoms, &keys->filter.path, &keys->atoms[MATCH_INDEX_PATH]);
+                        r = r ?: match_keys_intern(atoms, &keys->filter.member, &keys->atoms[MATCH_INDEX_MEMBER]);
+                        r = r ?: match_keys_intern(atoms, &keys->filter.interface, &keys->atoms[MATCH_INDEX_INTERFACE]);
+                        if (r)
+                                return error_trace(r);
+
+                        keys->filter.atoms = atoms;
+                }
+
+                keys->registry = registry;
+                c_rbtree_add(&registry->keys_tree, parent, slot, &keys->registry_node);
+        }
+
         *keysp = keys;
         keys = NULL;
         return 0;
@@ -289,33 +394,55 @@ static bool match_string_prefix(const char *string, const char *prefix, char del
         return true;
 }
 
-static bool match_keys_match_filter(MatchKeys *keys, MatchFilter *filter) {
-        if (keys->filter.type != DBUS_MESSAGE_TYPE_INVALID && keys->filter.type != filter->type)
-                return false;
+static bool match_keys_equal(MatchKeys *keys, const char *key, MatchFilter *filter, const char *value) {
+        /* atoms of the same registry are equal if, and only if, they are identical */
+        if (keys->filter.atoms && keys->filter.atoms == filter->atoms)
+                return key == value;
 
-        if (keys->filter.destination != ADDRESS_ID_INVALID && keys->filter.destination != filter->destination)
-                return false;
+        return c_string_equal(key, value);
+}
 
-        if (keys->filter.sender != ADDRESS_ID_INVALID && keys->filter.sender != filter->sender)
-                return false;
+static void match_filter_load_args(MatchFilter *filter) {
+        Message *message = filter->message;
+        int r;
 
-        if (keys->filter.interface && !c_string_equal(keys->filter.interface, filter->interface))
-                return false;
+        filter->message = NULL;
 
-        if (keys->filter.member && !c_string_equal(keys->filter.member, filter->member))
-                return false;
+        /*
+         * Bodies of forwarded messages are not validated on receipt (see
+         * message_parse_metadata()). If the body turns out to be invalid, the
+         * message is treated as if it did not carry any arguments, hence no
+         * rule with argument keys matches it. Any other failure cannot be
+         * returned from the middle of a lookup, so it is recorded in the
+         * filter, and the caller must check it once it is done.
+         */
+        r = message_parse_body(message);
+        if (r) {
+                if (r < 0)
+                        filter->error = error_trace(r);
+                return;
+        }
 
-        if (keys->filter.path && !c_string_equal(keys->filter.path, filter->path))
-                return false;
+        for (size_t i = 0; i < C_ARRAY_SIZE(filter->args); ++i) {
+                if (message->metadata.args[i].element == 's') {
+                        filter->args[i] = message->metadata.args[i].value;
+                        filter->argpaths[i] = message->metadata.args[i].value;
+                } else if (message->metadata.args[i].element == 'o') {
+                        filter->argpaths[i] = message->metadata.args[i].value;
+                }
+        }
+}
 
-        if (keys->path_namespace && !match_string_prefix(keys->path_namespace, filter->path, '/', false))
-                return false;
+static bool match_keys_match_args(MatchKeys *keys, MatchFilter *filter) {
+        if (filter->message)
+                match_filter_load_args(filter);
 
         /* XXX: verify that arg0 is a (potentially single-label) bus name */
         if (keys->arg0namespace && !match_string_prefix(keys->arg0namespace, filter->args[0], '.', false))
                 return false;
 
-        for (unsigned int i = 0; i < C_ARRAY_SIZE(filter->args); i ++) {
+        /* only the slots up to the highest argument of the rule are looked at */
+        for (unsigned int i = 0; i < keys->n_args; i ++) {
                 if (keys->filter.args[i] && !c_string_equal(keys->filter.args[i], filter->args[i]))
                         return false;
 
@@ -329,11 +456,74 @@ static bool match_keys_match_filter(MatchKeys *keys, MatchFilter *filter) {
         return true;
 }
 
+static bool match_keys_match_filter(MatchKeys *keys, MatchFilter *filter) {
+        unsigned int mask = keys->mask;
+
+        /*
+         * Most rules use one of a few shapes. Those are matched directly,
+         * everything else goes through the generic path below, which only
+         * looks at the keys the rule actually uses.
+         */
+        switch (mask) {
+        case 0:
+                return true;
+        case MATCH_KEY_TYPE | MATCH_KEY_INTERFACE | MATCH_KEY_MEMBER:
+                return keys->filter.type == filter->type &&
+                       match_keys_equal(keys, keys->filter.interface, filter, filter->interface) &&
+                       match_keys_equal(keys, keys->filter.member, filter, filter->member);
+        case MATCH_KEY_SENDER:
+                return keys->filter.sender == filter->sender;
+        case MATCH_KEY_TYPE | MATCH_KEY_PATH_NAMESPACE:
+                return keys->filter.type == filter->type &&
+                       match_string_prefix(keys->path_namespace, filter->path, '/', false);
+        case MATCH_KEY_PATH_NAMESPACE:
+                return match_string_prefix(keys->path_namespace, filter->path, '/', false);
+        case MATCH_KEY_ARGS:
+                if (keys->n_args == 1 && keys->filter.args[0]) {
+                        if (filter->message)
+                                match_filter_load_args(filter);
+
+                        return c_string_equal(keys->filter.args[0], filter->args[0]);
+                }
+
+                return match_keys_match_args(keys, filter);
+        }
+
+        if ((mask & MATCH_KEY_TYPE) && keys->filter.type != filter->type)
+                return false;
+
+        if ((mask & MATCH_KEY_DESTINATION) && keys->filter.destination != filter->destination)
+                return false;
+
+        if ((mask & MATCH_KEY_SENDER) && keys->filter.sender != filter->sender)
+                return false;
+
+        if ((mask & MATCH_KEY_INTERFACE) && !match_keys_equal(keys, keys->filter.interface, filter, filter->interface))
+                return false;
+
+        if ((mask & MATCH_KEY_MEMBER) && !match_keys_equal(keys, keys->filter.member, filter, filter->member))
+                return false;
+
+        if ((mask & MATCH_KEY_PATH) && !match_keys_equal(keys, keys->filter.path, filter, filter->path))
+                return false;
+
+        if ((mask & MATCH_KEY_PATH_NAMESPACE) && !match_string_prefix(keys->path_namespace, filter->path, '/', false))
+                return false;
+
+        if (mask & (MATCH_KEY_ARG0NAMESPACE | MATCH_KEY_ARGS))
+                return match_keys_match_args(keys, filter);
+
+        return true;
+}
+
 static int match_rule_compare(CRBTree *tree, void *k, CRBNode *rb) {
         MatchRule *rule = c_container_of(rb, MatchRule, owner_node);
-        MatchKeys *key1 = k, *key2 = &rule->keys;
+        MatchKeys *key1 = k, *key2 = rule->keys;
         int r;
 
+        if (key1 == key2)
+                return 0;
+
         if ((r = c_string_compare(key1->sender, key2->sender)) ||
             (r = c_string_compare(key1->destination, key2->destination)) ||
             (r = c_string_compare(key1->filter.interface, key2->filter.interface)) ||
@@ -363,19 +553,24 @@ static MatchRule *match_rule_free(MatchRule *rule) {
 
         assert(!rule->n_user_refs);
 
-        match_keys_deinit(&rule->keys);
+        /* the registry index is derived from the keys, so unlink first */
+        match_rule_unlink(rule);
+        c_rbtree_remove_init(&rule->owner->rule_tree, &rule->owner_node);
         user_charge_deinit(&rule->charge[1]);
         user_charge_deinit(&rule->charge[0]);
-        c_rbtree_remove_init(&rule->owner->rule_tree, &rule->owner_node);
-        match_rule_unlink(rule);
-        free(rule);
+        match_keys_unref(rule->keys);
+
+        if (rule->owner->arena)
+                arena_free(rule->owner->arena, rule, sizeof(*rule));
+        else
+                pool_free(&match_rule_pool, rule);
 
         return NULL;
 }
 
 C_DEFINE_CLEANUP(MatchRule *, match_rule_free);
 
-static int match_rule_new(MatchRule **rulep, MatchOwner *owner, User *user, const char *string) {
+static int match_rule_new(MatchRule **rulep, MatchOwner *owner, User *user, MatchKeysRegistry *keys, const char *string) {
         _c_cleanup_(match_rule_freep) MatchRule *rule = NULL;
         size_t n_string;
         int r;
@@ -384,19 +579,27 @@ static int match_rule_new(MatchRule **rulep, MatchOwner *owner, User *user, cons
         if (n_string - 1 > MATCH_RULE_LENGTH_MAX)
                 return MATCH_E_INVALID;
 
-        rule = calloc(1, sizeof(*rule) + n_string);
+        if (owner->arena)
+                rule = arena_alloc(owner->arena, sizeof(*rule));
+        else
+                rule = pool_alloc(&match_rule_pool);
         if (!rule)
                 return error_origin(-ENOMEM);
 
         *rule = (MatchRule)MATCH_RULE_NULL(*rule);
         rule->owner = owner;
 
+        /*
+         * Rules are charged for their full size, regardless of whether their
+         * keys end up being shared with other rules, so quotas do not depend
+         * on what other peers subscribed to.
+         */
         r = user_charge(user, &rule->charge[0], NULL, USER_SLOT_BYTES, sizeof(*rule) + n_string);
         r = r ?: user_charge(user, &rule->charge[1], NULL, USER_SLOT_MATCHES, 1);
         if (r)
                 return (r == USER_E_QUOTA) ? MATCH_E_QUOTA : error_fold(r);
 
-        r = match_keys_init(&rule->keys, string, n_string);
+        r = match_keys_registry_ref_keys(keys, &rule->keys, string);
         if (r)
                 return error_trace(r);
 
@@ -436,19 +639,353 @@ MatchRule *match_rule_user_unref(MatchRule *rule) {
         return NULL;
 }
 
+static const char *match_filter_get_index_key(MatchFilter *filter, unsigned int index) {
+        switch (index) {
+        case MATCH_INDEX_ARG0:
+        case MATCH_INDEX_ARG0NAMESPACE:
+                return filter->args[0];
+        case MATCH_INDEX_PATH:
+                return filter->path;
+        case MATCH_INDEX_MEMBER:
+                return filter->member;
+        case MATCH_INDEX_INTERFACE:
+                return filter->interface;
+        default:
+                return NULL;
+        }
+}
+
+static const char *match_keys_get_index_key(MatchKeys *keys, unsigned int index) {
+        switch (index) {
+        case MATCH_INDEX_ARG0NAMESPACE:
+                return keys->arg0namespace;
+        case MATCH_INDEX_PATH_NAMESPACE:
+                return keys->path_namespace;
+        case MATCH_INDEX_ARGPATH:
+                return keys->i_argpath < keys->n_args ? keys->filter.argpaths[keys->i_argpath] : NULL;
+        default:
+                return match_filter_get_index_key(&keys->filter, index);
+        }
+}
+
+static unsigned int match_keys_get_index_slot(MatchKeys *keys, unsigned int index) {
+        /* path arguments are indexed by their position, before their value */
+        return (index == MATCH_INDEX_ARGPATH) ? keys->i_argpath : 0;
+}
+
+static CRBTree *match_registry_get_index(MatchRegistry *registry, unsigned int index) {
+        switch (index) {
+        case MATCH_INDEX_ARG0:
+                return &registry->arg0_tree;
+        case MATCH_INDEX_ARG0NAMESPACE:
+                return &registry->arg0namespace_tree;
+        case MATCH_INDEX_PATH:
+                return &registry->path_tree;
+        case MATCH_INDEX_PATH_NAMESPACE:
+                return &registry->path_namespace_tree;
+        case MATCH_INDEX_ARGPATH:
+                return &registry->argpath_tree;
+        case MATCH_INDEX_MEMBER:
+                return &registry->member_tree;
+        case MATCH_INDEX_INTERFACE:
+                return &registry->interface_tree;
+        default:
+                return NULL;
+        }
+}
+
+static unsigned int match_rule_get_index(MatchRule *rule) {
+        unsigned int index;
+
+        /*
+         * Every rule is indexed on exactly one key. We prefer the first
+         * argument, as it is by far the most selective key where it is used
+         * (most prominently, NameOwnerChanged subscriptions for a single name,
+         * which otherwise all share the same path). Then comes the path, as
+         * signals are usually subscribed to per object, and the path
+         * namespace and path arguments, which usually narrow a subscription
+         * down to a subtree of objects. They are followed by the member and
+         * the interface. Rules that specify none of them end up in the
+         * fallback bucket, which is searched linearly.
+         */
+        for (index = 0; index < MATCH_INDEX_FALLBACK; ++index)
+                if (match_keys_get_index_key(rule->keys, index))
+                        break;
+
+        return index;
+}
+
+static bool match_index_key_continues(MatchRule *rule, unsigned int index, MatchFilter *filter, const char *key) {
+        const char *rule_key = match_keys_get_index_key(rule->keys, index);
+
+        switch (index) {
+        case MATCH_INDEX_ARG0:
+                /* arguments are never interned */
+                return !strcmp(rule_key, key);
+        case MATCH_INDEX_ARG0NAMESPACE:
+                /*
+                 * A namespace matches if the argument is a prefix of it, so
+                 * all candidates are adjacent, starting at the argument
+                 * itself. The delimiter is checked by the rule.
+                 */
+                return !!c_string_prefix(rule_key, key);
+        default:
+                return match_keys_equal(rule->keys, rule_key, filter, key);
+        }
+}
+
+/*
+ * Path namespaces and path arguments cannot be looked up by their exact
+ * value. Instead, their indices are ordered such that the candidates for a
+ * path are adjacent, or at least split into few runs of adjacent rules:
+ *
+ *  - A path namespace matches a path if it is the path itself, or one of the
+ *    objects below it. Namespaces are ordered as if they were followed by a
+ *    slash, so the path and everything below it, but none of its siblings
+ *    (e.g., `/foo/bar-baz' for `/foo/bar'), form a single run.
+ *
+ *  - A path argument matches an argument if either is equal to the other, or
+ *    if either ends in a slash and is a prefix of the other. The candidates
+ *    are hence every parent of the argument (that is, each of its prefixes
+ *    ending in a slash), and the argument itself. If the argument ends in a
+ *    slash, everything starting with it follows in the same run. Path
+ *    arguments are ordered by their position first, then by value, so all
+ *    runs of a position can be found by walking up the chain of parents of
+ *    the argument once, in order.
+ *
+ * Rather than allocating a separate trie, these are ordinary index trees,
+ * so linking a rule can never fail, and lookups are a single tree descent
+ * per run.
+ */
+static int match_path_compare(unsigned int index, unsigned int slot, const char *path, size_t n_path, MatchKeys *keys) {
+        unsigned int key_slot = match_keys_get_index_slot(keys, index);
+        const char *key = match_keys_get_index_key(keys, index);
+        size_t n_key;
+        int r;
+
+        if (slot != key_slot)
+                return (slot < key_slot) ? -1 : 1;
+
+        n_key = strlen(key);
+        r = memcmp(path, key, c_min(n_path, n_key));
+        if (r || n_path == n_key)
+                return r;
+
+        if (index == MATCH_INDEX_PATH_NAMESPACE) {
+                if (n_path < n_key)
+                        r = '/' - (unsigned char)key[n_path];
+                else
+                        r = (unsigned char)path[n_key] - '/';
+        }
+
+        return r ?: ((n_path < n_key) ? -1 : 1);
+}
+
+static bool match_path_continues(MatchRule *rule, unsigned int index, unsigned int slot, const char *path, size_t n_path, size_t n_prefix) {
+        const char *key = match_keys_get_index_key(rule->keys, index);
+
+        if (match_keys_get_index_slot(rule->keys, index) != slot || strncmp(key, path, n_prefix))
+                return false;
+
+        key += n_prefix;
+
+        if (index == MATCH_INDEX_PATH_NAMESPACE)
+                return !*key || *key == '/';
+
+        /* a parent must be the key itself, the argument can also be a parent of the key */
+        return !*key || (n_prefix == n_path && n_path && path[n_path - 1] == '/');
+}
+
+static size_t match_path_next_prefix(const char *path, size_t n_path, size_t n_prefix) {
+        /* find the next parent of @path, or @path itself if there is none */
+        while (n_prefix < n_path)
+                if (path[n_prefix++] == '/' && n_prefix < n_path)
+                        return n_prefix;
+
+        return n_path;
+}
+
+struct MatchIndexKey {
+        unsigned int index;
+        unsigned int slot;
+        const char *string;
+        MatchRule *rule;
+};
+
+static int match_rule_compare_index(CRBTree *tree, void *k, CRBNode *rb) {
+        MatchRule *rule = c_container_of(rb, MatchRule, registry_node);
+        struct MatchIndexKey *key = k;
+        int r;
+
+        if (key->index == MATCH_INDEX_PATH_NAMESPACE || key->index == MATCH_INDEX_ARGPATH)
+                r = match_path_compare(key->index, key->slot, key->string, strlen(key->string), rule->keys);
+        else
+                r = strcmp(key->string, match_keys_get_index_key(rule->keys, key->index));
+        if (r)
+                return r;
+
+        /*
+         * Rules with equal keys are ordered by their address, so all of them
+         * can be linked into the same tree and are adjacent to each other.
+         */
+        if (key->rule < rule)
+                return -1;
+        if (key->rule > rule)
+                return 1;
+
+        return 0;
+}
+
+static CRBNode *match_registry_find_index(CRBTree *tree, unsigned int index, const char *key) {
+        CRBNode *node = tree->root, *first = NULL;
+        MatchRule *rule;
+        int r;
+
+        /*
+         * Find the left-most rule with a key not smaller than the given one.
+         * The caller checks whether it is actually a candidate.
+         */
+        while (node) {
+                rule = c_container_of(node, MatchRule, registry_node);
+
+                r = strcmp(key, match_keys_get_index_key(rule->keys, index));
+                if (r > 0) {
+                        node = node->right;
+                } else {
+                        first = node;
+                        node = node->left;
+                }
+        }
+
+        return first;
+}
+
+static CRBNode *match_registry_find_path(CRBTree *tree, unsigned int index, unsigned int slot, const char *path, size_t n_path) {
+        CRBNode *node = tree->root, *first = NULL;
+        MatchRule *rule;
+
+        /* find the left-most rule not ordered before the given prefix of @path */
+        while (node) {
+                rule = c_container_of(node, MatchRule, registry_node);
+
+                if (match_path_compare(index, slot, path, n_path, rule->keys) > 0) {
+                        node = node->right;
+                } else {
+                        first = node;
+                        node = node->left;
+                }
+        }
+
+        return first;
+}
+
+/*
+ * Every registry keeps a counting bloom filter over the interfaces its rules
+ * require, or, for rules without an interface, their member. Rules that
+ * require neither are counted separately. A filter that hits none of them
+ * cannot match any rule of the registry, so callers can skip it entirely.
+ * Counters saturate and then stay put, so the filter never forgets a rule.
+ */
+#define MATCH_BLOOM_SEED_INTERFACE (UINT64_C(14695981039346656037))
+#define MATCH_BLOOM_SEED_MEMBER (UINT64_C(3421674724940046719))
+
+static uint64_t match_bloom_hash(const char *string, uint64_t hash) {
+        /* FNV-1a */
+        for ( ; *string; ++string) {
+                hash ^= (unsigned char)*string;
+                hash *= UINT64_C(1099511628211);
+        }
+
+        return hash;
+}
+
+static void match_bloom_update(MatchBloom *bloom, uint64_t hash, bool add) {
+        size_t i, slots[] = { hash % MATCH_BLOOM_SIZE, (hash >> 32) % MATCH_BLOOM_SIZE };
+
+        for (i = 0; i < C_ARRAY_SIZE(slots); ++i) {
+                if (bloom->counters[slots[i]] == UINT8_MAX)
+                        continue;
+
+                if (add)
+                        ++bloom->counters[slots[i]];
+                else
+                        --bloom->counters[slots[i]];
+        }
+}
+
+static bool match_bloom_test(MatchBloom *bloom, uint64_t hash) {
+        return bloom->counters[hash % MATCH_BLOOM_SIZE] &&
+               bloom->counters[(hash >> 32) % MATCH_BLOOM_SIZE];
+}
+
+static void match_bloom_account(MatchBloom *bloom, MatchKeys *keys, bool add) {
+        if (keys->filter.interface)
+                match_bloom_update(bloom, match_bloom_hash(keys->filter.interface, MATCH_BLOOM_SEED_INTERFACE), add);
+        else if (keys->filter.member)
+                match_bloom_update(bloom, match_bloom_hash(keys->filter.member, MATCH_BLOOM_SEED_MEMBER), add);
+        else if (add)
+                ++bloom->n_unfiltered;
+        else
+                --bloom->n_unfiltered;
+}
+
+/**
+ * match_bloom_key_init() - compute bloom filter key of a filter
+ * @key:                key to initialize
+ * @filter:             filter to compute the key for
+ *
+ * This hashes the interface and member of @filter, so it can be checked
+ * against any number of registries via match_registry_may_match().
+ */
+void match_bloom_key_init(MatchBloomKey *key, MatchFilter *filter) {
+        *key = (MatchBloomKey)MATCH_BLOOM_KEY_INIT;
+
+        if (filter->interface) {
+                key->has_interface = true;
+                key->interface = match_bloom_hash(filter->interface, MATCH_BLOOM_SEED_INTERFACE);
+        }
+
+        if (filter->member) {
+                key->has_member = true;
+                key->member = match_bloom_hash(filter->member, MATCH_BLOOM_SEED_MEMBER);
+        }
+}
+
 /**
  * match_rule_link() - XXX
  */
 void match_rule_link(MatchRule *rule, MatchRegistry *registry, bool monitor) {
+        struct MatchIndexKey key;
+        CRBNode **slot, *parent;
+        unsigned int index;
+        CRBTree *tree;
+
         if (rule->registry) {
                 assert(registry == rule->registry);
-                assert(c_list_is_linked(&rule->registry_link));
+                assert(c_list_is_linked(&rule->registry_link) || c_rbnode_is_linked(&rule->registry_node));
         } else {
                 rule->registry = registry;
-                if (monitor)
+                rule->monitor = monitor;
+                if (monitor) {
                         c_list_link_tail(&registry->monitor_list, &rule->registry_link);
-                else
-                        c_list_link_tail(&registry->rule_list, &rule->registry_link);
+                } else {
+                        match_bloom_account(&registry->bloom, rule->keys, true);
+
+                        index = match_rule_get_index(rule);
+                        tree = match_registry_get_index(registry, index);
+                        if (tree) {
+                                key.index = index;
+                                key.slot = match_keys_get_index_slot(rule->keys, index);
+                                key.string = match_keys_get_index_key(rule->keys, index);
+                                key.rule = rule;
+
+                                slot = c_rbtree_find_slot(tree, match_rule_compare_index, &key, &parent);
+                                assert(slot);
+                                c_rbtree_add(tree, parent, slot, &rule->registry_node);
+                        } else {
+                                c_list_link_tail(&registry->rule_list, &rule->registry_link);
+                        }
+                }
         }
 }
 
@@ -457,7 +994,14 @@ void match_rule_link(MatchRule *rule, MatchRegistry *registry, bool monitor) {
  */
 void match_rule_unlink(MatchRule *rule) {
         if (rule->registry) {
-                c_list_unlink_init(&rule->registry_link);
+                if (!rule->monitor)
+                        match_bloom_account(&rule->registry->bloom, rule->keys, false);
+
+                if (c_rbnode_is_linked(&rule->registry_node))
+                        c_rbtree_remove_init(match_registry_get_index(rule->registry, match_rule_get_index(rule)),
+                                             &rule->registry_node);
+                else
+                        c_list_unlink_init(&rule->registry_link);
                 rule->registry = NULL;
         }
 }
@@ -470,17 +1014,132 @@ static MatchRule *match_rule_next_match_internal(CList *rules, MatchRule *rule,
              entry = entry->next) {
                 rule = c_list_entry(entry, MatchRule, registry_link);
 
-                if (match_keys_match_filter(&rule->keys, filter))
+                if (match_keys_match_filter(rule->keys, filter))
+                        return rule;
+        }
+
+        return NULL;
+}
+
+static MatchRule *match_rule_next_match_indexed(CRBTree *tree, unsigned int index, const char *key, MatchRule *rule, MatchFilter *filter) {
+        CRBNode *node;
+
+        for (node = rule ? c_rbnode_next(&rule->registry_node) : match_registry_find_index(tree, index, key);
+             node;
+             node = c_rbnode_next(node)) {
+                rule = c_container_of(node, MatchRule, registry_node);
+
+                /* all candidates for this key are adjacent, bail out on the first mismatch */
+                if (!match_index_key_continues(rule, index, filter, key))
+                        break;
+
+                if (match_keys_match_filter(rule->keys, filter))
                         return rule;
         }
 
         return NULL;
 }
 
+static MatchRule *match_rule_next_match_path(CRBTree *tree, unsigned int index, MatchRule *rule, MatchFilter *filter) {
+        size_t n_path, n_prefix;
+        unsigned int slot, n_slots;
+        const char *path;
+        CRBNode *node;
+
+        /* the last rule is indexed by the highest position of all */
+        n_slots = match_keys_get_index_slot(c_container_of(c_rbtree_last(tree), MatchRule, registry_node)->keys, index) + 1;
+
+        for (slot = rule ? match_keys_get_index_slot(rule->keys, index) : 0; slot < n_slots; ++slot) {
+                path = (index == MATCH_INDEX_PATH_NAMESPACE) ? filter->path : filter->argpaths[slot];
+                if (!path) {
+                        rule = NULL;
+                        continue;
+                }
+
+                n_path = strlen(path);
+
+                /*
+                 * Resume in the run of the previous match. It is a parent of
+                 * the path, unless it is at least as long as the path.
+                 */
+                if (rule) {
+                        n_prefix = c_min(strlen(match_keys_get_index_key(rule->keys, index)), n_path);
+                        node = c_rbnode_next(&rule->registry_node);
+                } else {
+                        n_prefix = (index == MATCH_INDEX_PATH_NAMESPACE) ? n_path : match_path_next_prefix(path, n_path, 0);
+                        node = match_registry_find_path(tree, index, slot, path, n_prefix);
+                }
+
+                for (;;) {
+                        for ( ; node; node = c_rbnode_next(node)) {
+                                rule = c_container_of(node, MatchRule, registry_node);
+
+                                if (!match_path_continues(rule, index, slot, path, n_path, n_prefix))
+                                        break;
+
+                                if (match_keys_match_filter(rule->keys, filter))
+                                        return rule;
+                        }
+
+                        if (n_prefix == n_path)
+                                break;
+
+                        n_prefix = match_path_next_prefix(path, n_path, n_prefix);
+                        node = match_registry_find_path(tree, index, slot, path, n_prefix);
+                }
+
+                rule = NULL;
+        }
+
+        return NULL;
+}
+
+/**
+ * match_rule_next_match() - find next rule matching a filter
+ * @registry:           registry to search
+ * @rule:               previous match, or NULL to start a new search
+ * @filter:             filter to match against
+ *
+ * This returns the next rule in @registry that matches @filter, starting
+ * after @rule. Only the index buckets of the keys set in @filter, and the
+ * fallback bucket of rules without any indexed key, are searched. Hence,
+ * non-matching rules are mostly skipped without ever looking at them.
+ *
+ * Return: The next matching rule, or NULL if there are no more.
+ */
 MatchRule *match_rule_next_match(MatchRegistry *registry, MatchRule *rule, MatchFilter *filter) {
+        unsigned int index;
+        const char *key;
+        CRBTree *tree;
+
         if (filter->destination != ADDRESS_ID_INVALID)
                 return NULL;
 
+        for (index = rule ? match_rule_get_index(rule) : 0; index < MATCH_INDEX_FALLBACK; ++index) {
+                tree = match_registry_get_index(registry, index);
+                if (c_rbtree_is_empty(tree)) {
+                        rule = NULL;
+                        continue;
+                }
+
+                /* arguments are only parsed if a rule is indexed by them */
+                if (index == MATCH_INDEX_ARG0 || index == MATCH_INDEX_ARG0NAMESPACE || index == MATCH_INDEX_ARGPATH)
+                        if (filter->message)
+                                match_filter_load_args(filter);
+
+                if (index == MATCH_INDEX_PATH_NAMESPACE || index == MATCH_INDEX_ARGPATH) {
+                        rule = match_rule_next_match_path(tree, index, rule, filter);
+                        if (rule)
+                                return rule;
+                } else if ((key = match_filter_get_index_key(filter, index))) {
+                        rule = match_rule_next_match_indexed(tree, index, key, rule, filter);
+                        if (rule)
+                                return rule;
+                }
+
+                rule = NULL;
+        }
+
         return match_rule_next_match_internal(&registry->rule_list, rule, filter);
 }
 
@@ -488,6 +1147,29 @@ MatchRule *match_rule_next_monitor_match(MatchRegistry *registry, MatchRule *rul
         return match_rule_next_match_internal(&registry->monitor_list, rule, filter);
 }
 
+/**
+ * match_keys_registry_init() - initialize key registry
+ * @registry:           registry to operate on
+ * @atoms:              atom registry to intern keys in, or NULL
+ *
+ * This initializes a registry of parsed match keys, which are shared between
+ * all rules created from the same rule string.
+ */
+void match_keys_registry_init(MatchKeysRegistry *registry, AtomRegistry *atoms) {
+        *registry = (MatchKeysRegistry)MATCH_KEYS_REGISTRY_INIT(atoms);
+}
+
+/**
+ * match_keys_registry_deinit() - deinitialize key registry
+ * @registry:           registry to operate on
+ *
+ * This deinitializes a key registry. All rules using keys of it must have
+ * been destroyed, before.
+ */
+void match_keys_registry_deinit(MatchKeysRegistry *registry) {
+        assert(c_rbtree_is_empty(&registry->keys_tree));
+}
+
 /**
  * match_owner_init() - XXX
  */
@@ -505,18 +1187,18 @@ void match_owner_deinit(MatchOwner *owner) {
 /**
  * match_owner_ref_rule() - XXX
  */
-int match_owner_ref_rule(MatchOwner *owner, MatchRule **rulep, User *user, const char *rule_string) {
+int match_owner_ref_rule(MatchOwner *owner, MatchRule **rulep, User *user, MatchKeysRegistry *keys, const char *rule_string) {
         _c_cleanup_(match_rule_user_unrefp) MatchRule *rule = NULL;
         CRBNode **slot, *parent;
         int r;
 
-        r = match_rule_new(&rule, owner, user, rule_string);
+        r = match_rule_new(&rule, owner, user, keys, rule_string);
         if (r)
                 return error_trace(r);
 
         ++rule->n_user_refs;
 
-        slot = c_rbtree_find_slot(&owner->rule_tree, match_rule_compare, &rule->keys, &parent);
+        slot = c_rbtree_find_slot(&owner->rule_tree, match_rule_compare, rule->keys, &parent);
         if (!slot) {
                 /* one already exists, take a ref on that instead and drop the one we created */
                 if (rulep)
@@ -536,7 +1218,7 @@ int match_owner_ref_rule(MatchOwner *owner, MatchRule **rulep, User *user, const
  * match_owner_find_rule() - XXX
  */
 int match_owner_find_rule(MatchOwner *owner, MatchRule **rulep, const char *rule_string) {
-        _c_cleanup_(match_keys_freep) MatchKeys *keys = NULL;
+        _c_cleanup_(match_keys_unrefp) MatchKeys *keys = NULL;
         int r;
 
         r = match_keys_new(&keys, rule_string);
@@ -558,6 +1240,68 @@ void match_registry_init(MatchRegistry *registry) {
  * match_registry_deinit() - XXX
  */
 void match_registry_deinit(MatchRegistry *registry) {
+        assert(c_rbtree_is_empty(&registry->arg0_tree));
+        assert(c_rbtree_is_empty(&registry->arg0namespace_tree));
+        assert(c_rbtree_is_empty(&registry->path_tree));
+        assert(c_rbtree_is_empty(&registry->path_namespace_tree));
+        assert(c_rbtree_is_empty(&registry->argpath_tree));
+        assert(c_rbtree_is_empty(&registry->member_tree));
+        assert(c_rbtree_is_empty(&registry->interface_tree));
         assert(c_list_is_empty(&registry->rule_list));
         assert(c_list_is_empty(&registry->monitor_list));
+        assert(!registry->bloom.n_unfiltered);
+}
+
+/**
+ * match_registry_flush() - unlink all non-monitor rules
+ * @registry:           registry to operate on
+ *
+ * This unlinks all rules from @registry, that were not linked as monitors.
+ */
+void match_registry_flush(MatchRegistry *registry) {
+        MatchRule *rule, *rule_safe;
+        CRBNode *node;
+
+        while ((node = c_rbtree_first(&registry->arg0_tree)))
+                match_rule_unlink(c_container_of(node, MatchRule, registry_node));
+        while ((node = c_rbtree_first(&registry->arg0namespace_tree)))
+                match_rule_unlink(c_container_of(node, MatchRule, registry_node));
+        while ((node = c_rbtree_first(&registry->path_tree)))
+                match_rule_unlink(c_container_of(node, MatchRule, registry_node));
+        while ((node = c_rbtree_first(&registry->path_namespace_tree)))
+                match_rule_unlink(c_container_of(node, MatchRule, registry_node));
+        while ((node = c_rbtree_first(&registry->argpath_tree)))
+                match_rule_unlink(c_container_of(node, MatchRule, registry_node));
+        while ((node = c_rbtree_first(&registry->member_tree)))
+                match_rule_unlink(c_container_of(node, MatchRule, registry_node));
+        while ((node = c_rbtree_first(&registry->interface_tree)))
+                match_rule_unlink(c_container_of(node, MatchRule, registry_node));
+
+        c_list_for_each_entry_safe(rule, rule_safe, &registry->rule_list, registry_link)
+                match_rule_unlink(rule);
+}
+
+/**
+ * match_registry_may_match() - check whether a registry can match a filter
+ * @registry:           registry to check
+ * @key:                bloom filter key of the filter
+ *
+ * This checks the bloom filter of @registry against @key, as computed by
+ * match_bloom_key_init(). If this returns false, no rule of @registry can
+ * match the filter. Otherwise, it might, and the registry must be searched.
+ * Monitor rules are not covered.
+ *
+ * Return: False if no rule of @registry can match, true otherwise.
+ */
+bool match_registry_may_match(MatchRegistry *registry, MatchBloomKey *key) {
+        if (registry->bloom.n_unfiltered)
+                return true;
+
+        if (key->has_interface && match_bloom_test(&registry->bloom, key->interface))
+                return true;
+
+        if (key->has_member && match_bloom_test(&registry->bloom, key->member))
+                return true;
+
+        return false;
 }
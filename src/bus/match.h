@@ -8,15 +8,23 @@
 #include <c-rbtree.h>
 #include <stdlib.h>
 #include "dbus/address.h"
+#include "util/atom.h"
 #include "util/user.h"
 
+typedef struct Arena Arena;
+typedef struct MatchBloom MatchBloom;
+typedef struct MatchBloomKey MatchBloomKey;
 typedef struct MatchFilter MatchFilter;
 typedef struct MatchKeys MatchKeys;
+typedef struct MatchKeysRegistry MatchKeysRegistry;
 typedef struct MatchOwner MatchOwner;
 typedef struct MatchRegistry MatchRegistry;
 typedef struct MatchRule MatchRule;
+typedef struct Message Message;
 
 #define MATCH_RULE_LENGTH_MAX (1024UL) /* taken from dbus-daemon(1) */
+#define MATCH_RULE_POOL_MAX (256UL) /* covers the rules of a few peers reconnecting at once */
+#define MATCH_BLOOM_SIZE (64U) /* one cache line of counters per registry */
 
 enum {
         _MATCH_E_SUCCESS,
@@ -26,7 +34,34 @@ enum {
         MATCH_E_QUOTA,
 };
 
+enum {
+        MATCH_INDEX_ARG0,
+        MATCH_INDEX_ARG0NAMESPACE,
+        MATCH_INDEX_PATH,
+        MATCH_INDEX_PATH_NAMESPACE,
+        MATCH_INDEX_ARGPATH,
+        MATCH_INDEX_MEMBER,
+        MATCH_INDEX_INTERFACE,
+        MATCH_INDEX_FALLBACK,
+        _MATCH_INDEX_N,
+};
+
+enum {
+        MATCH_KEY_TYPE                  = (1U << 0),
+        MATCH_KEY_SENDER                = (1U << 1),
+        MATCH_KEY_DESTINATION           = (1U << 2),
+        MATCH_KEY_INTERFACE             = (1U << 3),
+        MATCH_KEY_MEMBER                = (1U << 4),
+        MATCH_KEY_PATH                  = (1U << 5),
+        MATCH_KEY_PATH_NAMESPACE        = (1U << 6),
+        MATCH_KEY_ARG0NAMESPACE         = (1U << 7),
+        MATCH_KEY_ARGS                  = (1U << 8),
+};
+
 struct MatchFilter {
+        AtomRegistry *atoms;
+        Message *message;
+        int error;
         uint8_t type;
         uint64_t destination;
         uint64_t sender;
@@ -44,39 +79,62 @@ struct MatchFilter {
         }
 
 struct MatchKeys {
+        unsigned long int n_refs;
+        MatchKeysRegistry *registry;
+        CRBNode registry_node;
+        Atom *atoms[MATCH_INDEX_FALLBACK];
+        const char *string;
+
         MatchFilter filter;
         const char *destination;
         const char *sender;
         const char *path_namespace;
         const char *arg0namespace;
+        unsigned int mask;
+        unsigned int n_args;
+        unsigned int i_argpath;
 
         char buffer[];
 };
 
-#define MATCH_KEYS_NULL {                                                       \
+#define MATCH_KEYS_NULL(_x) {                                                   \
+                .n_refs = 1,                                                    \
+                .registry_node = C_RBNODE_INIT((_x).registry_node),             \
                 .filter = MATCH_FILTER_INIT,                                    \
         }
 
+struct MatchKeysRegistry {
+        AtomRegistry *atoms;
+        CRBTree keys_tree;
+};
+
+#define MATCH_KEYS_REGISTRY_INIT(_atoms) {                                      \
+                .atoms = (_atoms),                                              \
+                .keys_tree = C_RBTREE_INIT,                                     \
+        }
+
 struct MatchRule {
         unsigned long int n_user_refs;
         MatchRegistry *registry;
         MatchOwner *owner;
         CList registry_link;
+        CRBNode registry_node;
         CRBNode owner_node;
 
         UserCharge charge[2];
-        MatchKeys keys;
-        /* @keys must be last, as it contains a VLA */
+        MatchKeys *keys;
+        bool monitor : 1;
 };
 
 #define MATCH_RULE_NULL(_x) {                                                   \
                 .registry_link = C_LIST_INIT((_x).registry_link),               \
+                .registry_node = C_RBNODE_INIT((_x).registry_node),             \
                 .owner_node = C_RBNODE_INIT((_x).owner_node),                   \
                 .charge = { USER_CHARGE_INIT, USER_CHARGE_INIT },               \
-                .keys = MATCH_KEYS_NULL,                                        \
         }
 
 struct MatchOwner {
+        Arena *arena;
         CRBTree rule_tree;
 };
 
@@ -84,12 +142,44 @@ struct MatchOwner {
                 .rule_tree = C_RBTREE_INIT,     \
         }
 
+struct MatchBloom {
+        size_t n_unfiltered;
+        uint8_t counters[MATCH_BLOOM_SIZE];
+};
+
+#define MATCH_BLOOM_INIT {}
+
+struct MatchBloomKey {
+        bool has_interface : 1;
+        bool has_member : 1;
+        uint64_t interface;
+        uint64_t member;
+};
+
+#define MATCH_BLOOM_KEY_INIT {}
+
 struct MatchRegistry {
+        MatchBloom bloom;
+        CRBTree arg0_tree;
+        CRBTree arg0namespace_tree;
+        CRBTree path_tree;
+        CRBTree path_namespace_tree;
+        CRBTree argpath_tree;
+        CRBTree member_tree;
+        CRBTree interface_tree;
         CList rule_list;
         CList monitor_list;
 };
 
 #define MATCH_REGISTRY_INIT(_x) {                                               \
+                .bloom = MATCH_BLOOM_INIT,                                      \
+                .arg0_tree = C_RBTREE_INIT,                                     \
+                .arg0namespace_tree = C_RBTREE_INIT,                            \
+                .path_tree = C_RBTREE_INIT,                                     \
+                .path_namespace_tree = C_RBTREE_INIT,                           \
+                .argpath_tree = C_RBTREE_INIT,                                  \
+                .member_tree = C_RBTREE_INIT,                                   \
+                .interface_tree = C_RBTREE_INIT,                                \
                 .rule_list = (CList)C_LIST_INIT((_x).rule_list),                \
                 .monitor_list = (CList)C_LIST_INIT((_x).monitor_list),          \
         }
@@ -105,17 +195,27 @@ void match_rule_unlink(MatchRule *rule);
 MatchRule *match_rule_next_match(MatchRegistry *registry, MatchRule *rule, MatchFilter *filter);
 MatchRule *match_rule_next_monitor_match(MatchRegistry *registry, MatchRule *rule, MatchFilter *filter);
 
+void match_bloom_key_init(MatchBloomKey *key, MatchFilter *filter);
+
 C_DEFINE_CLEANUP(MatchRule *, match_rule_user_unref);
 
+/* keys */
+
+void match_keys_registry_init(MatchKeysRegistry *registry, AtomRegistry *atoms);
+void match_keys_registry_deinit(MatchKeysRegistry *registry);
+
 /* owners */
 
 void match_owner_init(MatchOwner *owner);
 void match_owner_deinit(MatchOwner *owner);
 
-int match_owner_ref_rule(MatchOwner *owner, MatchRule **rulep, User *user, const char *rule_string);
+int match_owner_ref_rule(MatchOwner *owner, MatchRule **rulep, User *user, MatchKeysRegistry *keys, const char *rule_string);
 int match_owner_find_rule(MatchOwner *owner, MatchRule **rulep, const char *rule_string);
 
 /* registry */
 
 void match_registry_init(MatchRegistry *registry);
 void match_registry_deinit(MatchRegistry *registry);
+
+void match_registry_flush(MatchRegistry *registry);
+bool match_registry_may_match(MatchRegistry *registry, MatchBloomKey *key);
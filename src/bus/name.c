@@ -10,7 +10,9 @@
 #include "bus/name.h"
 #include "dbus/protocol.h"
 #include "dbus/socket.h"
+#include "util/arena.h"
 #include "util/error.h"
+#include "util/hash.h"
 #include "util/user.h"
 
 /**
@@ -62,7 +64,11 @@ static NameOwnership *name_ownership_free(NameOwnership *ownership) {
         user_charge_deinit(&ownership->charge);
         c_rbtree_remove_init(&ownership->owner->ownership_tree, &ownership->owner_node);
         name_unref(ownership->name);
-        free(ownership);
+
+        if (ownership->owner->arena)
+                arena_free(ownership->owner->arena, ownership, sizeof(*ownership));
+        else
+                free(ownership);
 
         return NULL;
 }
@@ -73,7 +79,10 @@ static int name_ownership_new(NameOwnership **ownershipp, NameOwner *owner, User
         _c_cleanup_(name_ownership_freep) NameOwnership *ownership = NULL;
         int r;
 
-        ownership = calloc(1, sizeof(*ownership));
+        if (owner->arena)
+                ownership = arena_alloc(owner->arena, sizeof(*ownership));
+        else
+                ownership = malloc(sizeof(*ownership));
         if (!ownership)
                 return error_origin(-ENOMEM);
 
@@ -197,10 +206,36 @@ static int name_compare(CRBTree *tree, void *k, CRBNode *rb) {
         return strcmp(k, name->name);
 }
 
+/*
+ * Names are kept in an ordered tree, so they can be listed in a stable order,
+ * but lookups go through a hash table. This keeps the cost of routing a
+ * unicast message independent of the number of names on the bus.
+ */
+
+static uint64_t name_hash(void *entry) {
+        Name *name = entry;
+
+        return name->hash;
+}
+
+static size_t name_registry_probe(NameRegistry *registry, const char *name_str, uint64_t hash) {
+        Name *name;
+        size_t i;
+
+        hash_table_for_each_probe(name, i, &registry->table, hash)
+                if (name->hash == hash && !strcmp(name->name, name_str))
+                        break;
+
+        return i;
+}
+
 static void name_link(Name *name, CRBNode *parent, CRBNode **slot) {
+        NameRegistry *registry = name->registry;
+
         assert(!c_rbnode_is_linked(&name->registry_node));
 
-        c_rbtree_add(&name->registry->name_tree, parent, slot, &name->registry_node);
+        c_rbtree_add(&registry->name_tree, parent, slot, &name->registry_node);
+        hash_table_insert(&registry->table, name_registry_probe(registry, name->name, name->hash), name);
 }
 
 static int name_new(Name **namep, NameRegistry *registry, const char *name_str) {
@@ -214,6 +249,7 @@ static int name_new(Name **namep, NameRegistry *registry, const char *name_str)
 
         *name = (Name)NAME_INIT(*name);
         name->registry = registry;
+        name->hash = hash_string(name_str);
         memcpy(name->name, name_str, n_name + 1);
 
         *namep = name;
@@ -228,7 +264,13 @@ void name_free(_Atomic unsigned long *n_refs, void *userdata) {
         assert(!name->activation);
 
         match_registry_deinit(&name->matches);
-        c_rbtree_remove_init(&name->registry->name_tree, &name->registry_node);
+        if (c_rbnode_is_linked(&name->registry_node)) {
+                c_rbtree_remove_init(&name->registry->name_tree, &name->registry_node);
+                hash_table_remove(&name->registry->table,
+                                  name_registry_probe(name->registry, name->name, name->hash),
+                                  name_hash,
+                                  NAME_REGISTRY_BUCKETS_MIN);
+        }
         free(name);
 }
 
@@ -253,6 +295,48 @@ void name_owner_deinit(NameOwner *owner) {
         assert(c_rbtree_is_empty(&owner->ownership_tree));
 }
 
+/**
+ * name_owner_release_all() - release all ownerships of an owner
+ * @owner:              owner to operate on
+ * @changesp:           output pointer to array of resulting changes
+ * @n_changesp:         output pointer to number of changes
+ *
+ * This releases all names owned or queued for by @owner in a single pass. For
+ * every name whose primary owner changed, a NameChange is returned in
+ * @changesp, in the order the ownerships were released. The caller must
+ * deinitialize all changes and free the array.
+ *
+ * The array is allocated before anything is released, so on failure @owner is
+ * left untouched.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int name_owner_release_all(NameOwner *owner, NameChange **changesp, size_t *n_changesp) {
+        NameOwnership *ownership, *ownership_safe;
+        NameChange *changes = NULL;
+        size_t n_ownerships = 0, n_changes = 0;
+
+        c_rbtree_for_each_entry(ownership, &owner->ownership_tree, owner_node)
+                ++n_ownerships;
+
+        if (n_ownerships) {
+                changes = calloc(n_ownerships, sizeof(*changes));
+                if (!changes)
+                        return error_origin(-ENOMEM);
+        }
+
+        c_rbtree_for_each_entry_unlink(ownership, ownership_safe, &owner->ownership_tree, owner_node) {
+                name_change_init(&changes[n_changes]);
+                name_ownership_release(ownership, &changes[n_changes]);
+                if (changes[n_changes].name)
+                        ++n_changes;
+        }
+
+        *changesp = changes;
+        *n_changesp = n_changes;
+        return 0;
+}
+
 /**
  * name_registry_init() - initialize registry
  * @registry:           object to operate on
@@ -272,6 +356,9 @@ void name_registry_init(NameRegistry *registry) {
  */
 void name_registry_deinit(NameRegistry *registry) {
         assert(c_rbtree_is_empty(&registry->name_tree));
+        assert(!registry->table.n_entries);
+
+        hash_table_deinit(&registry->table);
 }
 
 /**
@@ -289,19 +376,27 @@ void name_registry_deinit(NameRegistry *registry) {
  */
 int name_registry_ref_name(NameRegistry *registry, Name **namep, const char *name_str) {
         CRBNode **slot, *parent;
+        Name *name;
         int r;
 
+        name = name_registry_find_name(registry, name_str);
+        if (name) {
+                *namep = name_ref(name);
+                return 0;
+        }
+
+        r = hash_table_reserve(&registry->table, name_hash, NAME_REGISTRY_BUCKETS_MIN);
+        if (r)
+                return error_trace(r);
+
         slot = c_rbtree_find_slot(&registry->name_tree, name_compare, name_str, &parent);
-        if (!slot) {
-                *namep = name_ref(c_container_of(parent, Name, registry_node));
-        } else {
-                r = name_new(namep, registry, name_str);
-                if (r)
-                        return error_trace(r);
+        assert(slot);
 
-                name_link(*namep, parent, slot);
-        }
+        r = name_new(namep, registry, name_str);
+        if (r)
+                return error_trace(r);
 
+        name_link(*namep, parent, slot);
         return 0;
 }
 
@@ -315,7 +410,10 @@ int name_registry_ref_name(NameRegistry *registry, Name **namep, const char *nam
  * Return: Pointer to name-entry, or NULL if not found.
  */
 Name *name_registry_find_name(NameRegistry *registry, const char *name_str) {
-        return c_rbtree_find_entry(&registry->name_tree, name_compare, name_str, Name, registry_node);
+        if (!registry->table.n_entries)
+                return NULL;
+
+        return registry->table.buckets[name_registry_probe(registry, name_str, hash_string(name_str))];
 }
 
 /**
@@ -370,6 +468,55 @@ int name_registry_request_name(NameRegistry *registry,
         return error_trace(r);
 }
 
+/**
+ * name_registry_restore_name() - restore name ownership
+ * @registry:           registry to operate on
+ * @owner:              owner to act as
+ * @user:               user to charge as
+ * @name_str:           name to restore
+ * @flags:              flags of the ownership
+ *
+ * This appends an ownership of @name_str by @owner to the queue of the name,
+ * with exactly the flags given in @flags. Unlike
+ * name_registry_request_name(), no rules apply, and no notifications are
+ * generated. This is used to restore the name registry of another process,
+ * one ownership at a time, in queue order.
+ *
+ * Return: 0 on success, NAME_E_QUOTA if the quota failed,
+ *         NAME_E_ALREADY_OWNER if @owner is already queued on the name,
+ *         negative error code on failure.
+ */
+int name_registry_restore_name(NameRegistry *registry,
+                               NameOwner *owner,
+                               User *user,
+                               const char *name_str,
+                               uint32_t flags) {
+        _c_cleanup_(name_unrefp) Name *name = NULL;
+        NameOwnership *ownership;
+        CRBNode **slot, *parent;
+        int r;
+
+        r = name_registry_ref_name(registry, &name, name_str);
+        if (r)
+                return error_trace(r);
+
+        slot = c_rbtree_find_slot(&owner->ownership_tree,
+                                  name_ownership_compare,
+                                  name,
+                                  &parent);
+        if (!slot)
+                return NAME_E_ALREADY_OWNER;
+
+        r = name_ownership_new(&ownership, owner, user, name);
+        if (r)
+                return error_trace(r);
+
+        name_ownership_link(ownership, parent, slot);
+        ownership->flags = flags;
+        c_list_link_tail(&name->ownership_list, &ownership->name_link);
+        return 0;
+}
+
 /**
  * name_registry_release_name() - release name ownership
  * @registry:           registry to operate on
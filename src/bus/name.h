@@ -8,9 +8,11 @@
 #include <c-ref.h>
 #include <stdlib.h>
 #include "bus/match.h"
+#include "util/hashtable.h"
 #include "util/user.h"
 
 typedef struct Activation Activation;
+typedef struct Arena Arena;
 typedef struct Name Name;
 typedef struct NameChange NameChange;
 typedef struct NameOwner NameOwner;
@@ -19,6 +21,9 @@ typedef struct NameRegistry NameRegistry;
 typedef struct NameSet NameSet;
 typedef struct NameSnapshot NameSnapshot;
 
+/* a bus hosts a few dozen names as soon as it is up */
+#define NAME_REGISTRY_BUCKETS_MIN (64UL)
+
 enum {
         _NAME_E_SUCCESS,
 
@@ -58,6 +63,7 @@ struct Name {
         _Atomic unsigned long n_refs;
         NameRegistry *registry;
         CRBNode registry_node;
+        uint64_t hash;
 
         Activation *activation;
         MatchRegistry matches;
@@ -74,6 +80,7 @@ struct Name {
         }
 
 struct NameOwner {
+        Arena *arena;
         CRBTree ownership_tree;
 };
 
@@ -83,6 +90,8 @@ struct NameOwner {
 
 struct NameRegistry {
         CRBTree name_tree;
+        HashTable table;
+        uint64_t activation_generation;
 };
 
 #define NAME_REGISTRY_INIT {                                                    \
@@ -138,6 +147,8 @@ void name_free(_Atomic unsigned long *n_refs, void *userdata);
 void name_owner_init(NameOwner *owner);
 void name_owner_deinit(NameOwner *owner);
 
+int name_owner_release_all(NameOwner *owner, NameChange **changesp, size_t *n_changesp);
+
 /* registry */
 
 void name_registry_init(NameRegistry *registry);
@@ -156,6 +167,11 @@ int name_registry_release_name(NameRegistry *registry,
                                NameOwner *owner,
                                const char *name_str,
                                NameChange *change);
+int name_registry_restore_name(NameRegistry *registry,
+                               NameOwner *owner,
+                               User *user,
+                               const char *name_str,
+                               uint32_t flags);
 
 /* snapshots */
 
@@ -2,14 +2,21 @@
  * Peers
  */
 
+#include <c-dvar.h>
+#include <c-dvar-type.h>
+#include <c-list.h>
 #include <c-macro.h>
 #include <c-rbtree.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include "bus/bus.h"
+#include "bus/capture.h"
 #include "bus/driver.h"
+#include "bus/listener.h"
 #include "bus/match.h"
 #include "bus/name.h"
 #include "bus/peer.h"
@@ -19,28 +26,148 @@
 #include "dbus/message.h"
 #include "dbus/protocol.h"
 #include "dbus/socket.h"
+#include "util/atom.h"
 #include "util/dispatch.h"
 #include "util/error.h"
 #include "util/fdlist.h"
 #include "util/metrics.h"
+#include "util/pool.h"
 #include "util/selinux.h"
 #include "util/sockopt.h"
+#include "util/trace.h"
 #include "util/user.h"
 
-static int peer_dispatch_connection(Peer *peer, uint32_t events) {
+typedef struct PeerVerdictKey PeerVerdictKey;
+typedef struct PeerXmitGroup PeerXmitGroup;
+typedef struct PeerXmitGroups PeerXmitGroups;
+
+/*
+ * Peers are released to a pool, so login storms that follow a burst of
+ * disconnects do not have to go through the allocator for every accept.
+ */
+static Pool peer_pool = POOL_INIT_ALIGNED(peer_pool, "Peer", sizeof(Peer), alignof(Peer), PEER_POOL_MAX);
+
+struct PeerVerdictKey {
+        bool cacheable : 1;
+        bool resolved : 1;
+        uint64_t selinux_generation;
+        Atom *interface;
+        Atom *member;
+        Atom *path;
+};
+
+#define PEER_VERDICT_KEY_NULL {}
+
+/* groups are searched linearly, so few of them must stay cheaper than a policy check */
+#define PEER_XMIT_GROUPS_MAX (16)
+
+/*
+ * The verdict of a broadcast only depends on the sender, which is the same for
+ * all receivers, and on the policy snapshot, SELinux id and names of the
+ * receiver. Receivers without names that share their snapshot and SELinux id
+ * hence share their verdict, and it is evaluated once per group, rather than
+ * once per receiver. Only groups that were granted the transmission are
+ * recorded, since SELinux audits every denial it reports, and so denials must
+ * always be evaluated again.
+ */
+struct PeerXmitGroup {
+        PolicySnapshot *policy;
+        BusSELinuxID *sid;
+};
+
+struct PeerXmitGroups {
+        size_t n_groups;
+        PeerXmitGroup groups[PEER_XMIT_GROUPS_MAX];
+};
+
+#define PEER_XMIT_GROUPS_NULL {}
+
+/*
+ * Receivers are looked up by slot and checked against their policy, names and
+ * flags on every delivery. Make sure all of that stays in the first cache line
+ * of a peer, and that the sender-only state does not creep in front of the
+ * state used for delivery.
+ */
+static_assert(alignof(Peer) >= PEER_HOT_SIZE,
+              "Peers are not cache-line aligned");
+static_assert(offsetof(Peer, slot) + sizeof(((Peer *)NULL)->slot) <= PEER_HOT_SIZE,
+              "Peer routing header exceeds a cache line");
+static_assert(offsetof(Peer, user) == PEER_HOT_SIZE,
+              "Peer routing header is not packed");
+static_assert(offsetof(Peer, connection) < offsetof(Peer, destination),
+              "Peer sender state precedes delivery state");
+
+static int peer_dispatch_connection(Peer *peer, uint32_t events, size_t *n_messagesp, size_t *n_bytesp) {
+        uint64_t ts = 0, n_dispatch_nsec, n_wall_nsec, n_stall_nsec, n_fanout;
         int r;
 
-        if (!events)
+        if (events) {
+                if (events & EPOLLOUT)
+                        ts = metrics_get_time(peer->bus->histogram_write.clock);
+
+                r = connection_dispatch(&peer->connection, events);
+                if (r)
+                        return error_fold(r);
+
+                if (events & EPOLLOUT)
+                        histogram_sample_add(&peer->bus->histogram_write, ts);
+        }
+
+        if (_c_unlikely_(!peer->policy)) {
+                /*
+                 * The listener of this peer did not get its policy, yet. Run
+                 * the SASL exchange, so the peer is ready once it does, but
+                 * stop reading as soon as it is done. Anything the peer sent
+                 * beyond that stays queued until it is promoted.
+                 */
+                r = connection_authenticate(&peer->connection);
+                if (r)
+                        return (r == CONNECTION_E_EOF) ? PEER_E_EOF : error_fold(r);
+
+                if (peer->connection.authenticated)
+                        dispatch_file_deselect(&peer->connection.socket_file, EPOLLIN);
+
                 return 0;
+        }
 
-        r = connection_dispatch(&peer->connection, events);
-        if (r)
-                return error_fold(r);
+        n_stall_nsec = peer->connection.socket_file.context->stall_nsec;
+        n_stall_nsec = n_stall_nsec ? n_stall_nsec / BUS_STALL_FRACTION : UINT64_MAX;
 
         for (;;) {
                 _c_cleanup_(message_unrefp) Message *m = NULL;
+                bool admit;
+
+                /*
+                 * Once the budget of this dispatch round is used up, stop
+                 * handling messages, and continue on the next round, after
+                 * all other ready peers had their turn.
+                 */
+                if (!*n_messagesp || !*n_bytesp) {
+                        dispatch_file_yield(&peer->connection.socket_file);
+                        return 0;
+                }
 
                 r = connection_dequeue(&peer->connection, &m);
+                if (_c_unlikely_(r == CONNECTION_E_ADMISSION)) {
+                        r = driver_admit(peer, m, &admit);
+                        if (r)
+                                return error_fold(r);
+
+                        r = connection_admit(&peer->connection, admit);
+                        if (r)
+                                return error_fold(r);
+
+                        /* rejected messages use up the budget just the same */
+                        if (!admit) {
+                                --*n_messagesp;
+                                *n_bytesp -= c_min(*n_bytesp, m->n_data);
+
+                                ++peer->stats.n_messages_in;
+                                peer->stats.n_bytes_in += m->n_data;
+                        }
+
+                        continue;
+                }
                 if (r || !m) {
                         if (r == CONNECTION_E_EOF)
                                 return PEER_E_EOF;
@@ -48,15 +175,54 @@ static int peer_dispatch_connection(Peer *peer, uint32_t events) {
                         return error_fold(r);
                 }
 
+                --*n_messagesp;
+                *n_bytesp -= c_min(*n_bytesp, m->n_data);
+
+                TRACE_PROBE(peer_dequeue, peer->id, m->n_data);
+
+                ++peer->stats.n_messages_in;
+                peer->stats.n_bytes_in += m->n_data;
+
+                /*
+                 * The bus metrics only measure the CPU time of a randomly
+                 * picked fraction of all messages. The estimate they return is
+                 * scaled up accordingly, so the per-peer and per-member totals
+                 * stay unbiased.
+                 */
+                n_fanout = peer->bus->n_fanout;
+                histogram_sample_start(&peer->bus->histogram_dispatch);
                 metrics_sample_start(&peer->bus->metrics);
                 r = driver_dispatch(peer, m);
-                metrics_sample_end(&peer->bus->metrics);
+                n_dispatch_nsec = metrics_sample_end(&peer->bus->metrics);
+                n_wall_nsec = histogram_sample_end(&peer->bus->histogram_dispatch);
                 if (r) {
                         if (r == DRIVER_E_PROTOCOL_VIOLATION)
                                 return PEER_E_PROTOCOL_VIOLATION;
 
                         return error_fold(r);
                 }
+
+                /* remember the most expensive message, in case this turns out to stall */
+                if (_c_unlikely_(n_wall_nsec >= n_stall_nsec))
+                        bus_note_stall(peer->bus,
+                                       peer->connection.socket_file.context->n_callbacks,
+                                       peer,
+                                       m,
+                                       n_wall_nsec,
+                                       peer->bus->n_fanout - n_fanout);
+
+                peer->stats.n_dispatch_nsec += n_dispatch_nsec;
+
+                if (_c_unlikely_(traffic_registry_is_enabled(&peer->bus->traffic)) && m->metadata.fields.member) {
+                        r = traffic_registry_account(&peer->bus->traffic,
+                                                     m->metadata.fields.interface,
+                                                     m->metadata.fields.member,
+                                                     peer->id,
+                                                     m->n_data,
+                                                     n_dispatch_nsec);
+                        if (r)
+                                return error_fold(r);
+                }
         }
 
         return 0;
@@ -65,9 +231,13 @@ static int peer_dispatch_connection(Peer *peer, uint32_t events) {
 int peer_dispatch(DispatchFile *file) {
         Peer *peer = c_container_of(file, Peer, connection.socket_file);
         static const uint32_t interest[] = { EPOLLIN | EPOLLHUP, EPOLLOUT };
-        size_t i;
+        size_t i, n_messages = PEER_DISPATCH_MESSAGES_MAX, n_bytes = PEER_DISPATCH_BYTES_MAX;
         int r;
 
+        TRACE_PROBE(peer_dispatch, peer->id, peer->connection.socket.fd, dispatch_file_events(file));
+
+        r = peer_refresh_policy(peer);
+
         /*
          * Usually, we would just call
          * peer_dispatch_connection(peer, dispatch_file_events(file)) here.
@@ -96,12 +266,17 @@ int peer_dispatch(DispatchFile *file) {
          *
          * Lastly, the connection API explicitly allows splitting the events.
          * There is no requirement to provide them in-order.
+         *
+         * Both calls share a single budget of messages and bytes. If it is
+         * exhausted, the peer yields and the remaining messages are handled
+         * on the next dispatch round. Note that this also means we might be
+         * called without any events, in which case we only dequeue.
          */
-        for (i = 0; i < C_ARRAY_SIZE(interest); ++i) {
-                r = peer_dispatch_connection(peer, dispatch_file_events(file) & interest[i]);
-                if (r)
-                        break;
-        }
+        for (i = 0; !r && i < C_ARRAY_SIZE(interest); ++i)
+                r = peer_dispatch_connection(peer,
+                                             dispatch_file_events(file) & interest[i],
+                                             &n_messages,
+                                             &n_bytes);
 
         if (r) {
                 if (r == PEER_E_EOF) {
@@ -110,7 +285,7 @@ int peer_dispatch(DispatchFile *file) {
                                 return error_fold(r);
 
                         connection_shutdown(&peer->connection);
-                } else if (r == PEER_E_PROTOCOL_VIOLATION) {
+                } else if (r == PEER_E_PROTOCOL_VIOLATION || r == PEER_E_CONNECTION_REFUSED) {
                         connection_close(&peer->connection);
 
                         r = driver_goodbye(peer, false);
@@ -129,32 +304,133 @@ int peer_dispatch(DispatchFile *file) {
         return 0;
 }
 
-static int peer_compare(CRBTree *tree, void *k, CRBNode *rb) {
-        Peer *peer = c_container_of(rb, Peer, registry_node);
-        uint64_t id = *(uint64_t*)k;
+/*
+ * Peers are kept in a dense slot table, which is indexed by the slot of a
+ * peer. Slots are reused once their peer is gone, so the table stays compact
+ * and can be used by other subsystems to keep per-peer state in flat arrays.
+ *
+ * Unique IDs are handed out sequentially and never reused. Lookups by ID go
+ * through an open-addressing hash table that uses the ID itself as hash. As
+ * IDs are sequential, they rarely collide, so resolving a unique name is
+ * usually a single array access plus comparison of the stored ID, which
+ * doubles as generation tag of the bucket.
+ */
+
+static uint64_t peer_hash(void *entry) {
+        Peer *peer = entry;
+
+        return peer->id;
+}
+
+static size_t peer_registry_probe(PeerRegistry *registry, uint64_t id) {
+        Peer *peer;
+        size_t i;
+
+        hash_table_for_each_probe(peer, i, &registry->table, id)
+                if (peer->id == id)
+                        break;
+
+        return i;
+}
+
+static int peer_registry_alloc_slot(PeerRegistry *registry, size_t *slotp) {
+        unsigned long *slot_map, *receiver_map;
+        Peer **receivers, **slots;
+        size_t i, n_slots;
+
+        for (i = 0; i < registry->n_slots / PEER_SLOT_BITS; ++i) {
+                if (~registry->slot_map[i]) {
+                        *slotp = i * PEER_SLOT_BITS + __builtin_ctzl(~registry->slot_map[i]);
+                        registry->slot_map[i] |= 1UL << (*slotp % PEER_SLOT_BITS);
+                        return 0;
+                }
+        }
+
+        /*
+         * All slots are taken, so double the slot space. The slot table and
+         * the receiver set used for broadcasts are sized along with it, so
+         * collecting receivers never needs to allocate.
+         */
+        n_slots = registry->n_slots ? registry->n_slots * 2 : PEER_SLOTS_MIN;
+
+        slot_map = realloc(registry->slot_map, n_slots / 8);
+        if (!slot_map)
+                return error_origin(-ENOMEM);
+
+        registry->slot_map = slot_map;
+
+        receiver_map = realloc(registry->receiver_map, n_slots / 8);
+        if (!receiver_map)
+                return error_origin(-ENOMEM);
+
+        registry->receiver_map = receiver_map;
+
+        receivers = realloc(registry->receivers, n_slots * sizeof(*receivers));
+        if (!receivers)
+                return error_origin(-ENOMEM);
+
+        registry->receivers = receivers;
+
+        slots = realloc(registry->slots, n_slots * sizeof(*slots));
+        if (!slots)
+                return error_origin(-ENOMEM);
+
+        registry->slots = slots;
+
+        memset(registry->slots + registry->n_slots, 0, (n_slots - registry->n_slots) * sizeof(*slots));
+        memset(registry->slot_map + registry->n_slots / PEER_SLOT_BITS, 0, (n_slots - registry->n_slots) / 8);
+        memset(registry->receiver_map + registry->n_slots / PEER_SLOT_BITS, 0, (n_slots - registry->n_slots) / 8);
+
+        *slotp = registry->n_slots;
+        registry->slot_map[*slotp / PEER_SLOT_BITS] |= 1UL;
+        registry->n_slots = n_slots;
+        return 0;
+}
+
+static int peer_registry_add(PeerRegistry *registry, Peer *peer, uint64_t id) {
+        int r;
+
+        r = hash_table_reserve(&registry->table, peer_hash, PEER_REGISTRY_BUCKETS_MIN);
+        if (r)
+                return error_trace(r);
+
+        r = peer_registry_alloc_slot(registry, &peer->slot);
+        if (r)
+                return error_trace(r);
 
-        if (id < peer->id)
-                return -1;
-        if (id > peer->id)
-                return 1;
+        peer->id = id;
+        registry->ids = c_max(registry->ids, id + 1);
+        registry->slots[peer->slot] = peer;
+        hash_table_insert(&registry->table, peer_registry_probe(registry, peer->id), peer);
 
         return 0;
 }
 
-/**
- * peer_new() - XXX
- */
-int peer_new_with_fd(Peer **peerp,
-                     Bus *bus,
-                     PolicyRegistry *policy,
-                     const char guid[],
-                     DispatchContext *dispatcher,
-                     int fd) {
+static void peer_registry_unlink(PeerRegistry *registry, Peer *peer) {
+        size_t slot = peer->slot;
+
+        assert(slot < registry->n_slots);
+        assert(registry->slots[slot] == peer);
+
+        hash_table_remove(&registry->table, peer_registry_probe(registry, peer->id), peer_hash, PEER_REGISTRY_BUCKETS_MIN);
+        registry->slots[slot] = NULL;
+        registry->slot_map[slot / PEER_SLOT_BITS] &= ~(1UL << (slot % PEER_SLOT_BITS));
+        peer->slot = PEER_SLOT_INVALID;
+}
+
+static int peer_new(Peer **peerp,
+                    Bus *bus,
+                    Listener *listener,
+                    const char guid[],
+                    DispatchContext *dispatcher,
+                    int fd,
+                    uint64_t id,
+                    bool snapshot,
+                    bool check_connect) {
         _c_cleanup_(peer_freep) Peer *peer = NULL;
         _c_cleanup_(user_unrefp) User *user = NULL;
         _c_cleanup_(c_freep) gid_t *gids = NULL;
         _c_cleanup_(c_freep) char *seclabel = NULL;
-        CRBNode **slot, *parent;
         size_t n_seclabel, n_gids = 0;
         struct ucred ucred;
         socklen_t socklen = sizeof(ucred);
@@ -176,27 +452,39 @@ int peer_new_with_fd(Peer **peerp,
         if (r)
                 return error_trace(r);
 
-        peer = calloc(1, sizeof(*peer));
+        peer = pool_alloc(&peer_pool);
         if (!peer)
                 return error_origin(-ENOMEM);
 
+        memset(peer, 0, sizeof(*peer));
+
         peer->bus = bus;
         peer->connection = (Connection)CONNECTION_NULL(peer->connection);
-        peer->registry_node = (CRBNode)C_RBNODE_INIT(peer->registry_node);
+        peer->slot = PEER_SLOT_INVALID;
+        peer->sender = (MessageSender)MESSAGE_SENDER_NULL;
         peer->user = user;
         user = NULL;
         peer->pid = ucred.pid;
         peer->seclabel = seclabel;
         seclabel = NULL;
         peer->n_seclabel = n_seclabel;
+        peer->gids = gids;
+        gids = NULL;
+        peer->n_gids = n_gids;
         peer->charges[0] = (UserCharge)USER_CHARGE_INIT;
         peer->charges[1] = (UserCharge)USER_CHARGE_INIT;
         peer->charges[2] = (UserCharge)USER_CHARGE_INIT;
+        peer->listener_link = (CList)C_LIST_INIT(peer->listener_link);
+        peer->arena = (Arena)ARENA_INIT;
         peer->owned_names = (NameOwner)NAME_OWNER_INIT;
+        peer->owned_names.arena = &peer->arena;
         peer->matches = (MatchRegistry)MATCH_REGISTRY_INIT(peer->matches);
         peer->owned_matches = (MatchOwner)MATCH_OWNER_INIT;
-        peer->replies_outgoing = (ReplyRegistry)REPLY_REGISTRY_INIT;
+        peer->owned_matches.arena = &peer->arena;
+        peer->replies_outgoing = (ReplyRegistry)REPLY_REGISTRY_INIT(peer->replies_outgoing);
         peer->owned_replies = (ReplyOwner)REPLY_OWNER_INIT(peer->owned_replies);
+        peer->owned_replies.arena = &peer->arena;
+        peer->stats = (PeerStats)PEER_STATS_INIT;
 
         r = bus_selinux_id_init(&peer->sid, peer->seclabel);
         if (r)
@@ -212,13 +500,22 @@ int peer_new_with_fd(Peer **peerp,
                 return error_fold(r);
         }
 
-        r = policy_snapshot_new(&peer->policy, policy, peer->sid, ucred.uid, gids, n_gids);
-        if (r)
-                return error_fold(r);
+        /*
+         * If the listener has no policy yet, the peer is accepted as pending.
+         * Its snapshot is taken and the connect policy checked once the
+         * listener gets its policy, see peer_refresh_policy().
+         */
+        if (snapshot && listener->policy) {
+                r = policy_snapshot_new(&peer->policy, listener->policy, peer->sid, ucred.uid, peer->gids, peer->n_gids);
+                if (r)
+                        return error_fold(r);
 
-        r = policy_snapshot_check_connect(peer->policy);
-        if (r)
-                return (r == POLICY_E_ACCESS_DENIED) ? PEER_E_CONNECTION_REFUSED : error_fold(r);
+                if (check_connect) {
+                        r = policy_snapshot_check_connect(peer->policy);
+                        if (r)
+                                return (r == POLICY_E_ACCESS_DENIED) ? PEER_E_CONNECTION_REFUSED : error_fold(r);
+                }
+        }
 
         r = connection_init_server(&peer->connection,
                                    dispatcher,
@@ -229,16 +526,86 @@ int peer_new_with_fd(Peer **peerp,
         if (r < 0)
                 return error_fold(r);
 
-        peer->id = bus->peers.ids++;
-        slot = c_rbtree_find_slot(&bus->peers.peer_tree, peer_compare, &peer->id, &parent);
-        assert(slot); /* peer->id is guaranteed to be unique */
-        c_rbtree_add(&bus->peers.peer_tree, parent, slot, &peer->registry_node);
+        /* the body of large messages is only received once admitted */
+        socket_set_admission(&peer->connection.socket, true);
+
+        /*
+         * Until the peer said Hello, all it does is the SASL exchange and
+         * connection setup. Dispatch it with low priority, so connection
+         * storms cannot starve established peers.
+         */
+        dispatch_file_set_priority(&peer->connection.socket_file, DISPATCH_PRIORITY_LOW);
+
+        r = peer_registry_add(&bus->peers, peer, id);
+        if (r)
+                return error_trace(r);
+
+        /* the sender field is stitched into every message, even Hello() */
+        message_sender_init(&peer->sender, peer->id);
+
+        peer->listener = listener;
+        c_list_link_tail(&listener->peer_list, &peer->listener_link);
 
         *peerp = peer;
         peer = NULL;
         return 0;
 }
 
+/**
+ * peer_new_with_fd() - XXX
+ */
+int peer_new_with_fd(Peer **peerp,
+                     Bus *bus,
+                     Listener *listener,
+                     const char guid[],
+                     DispatchContext *dispatcher,
+                     int fd) {
+        return error_trace(peer_new(peerp, bus, listener, guid, dispatcher, fd, bus->peers.ids, true, true));
+}
+
+/**
+ * peer_new_restored() - create peer handed over from another process
+ * @peerp:              output argument for the new peer
+ * @bus:                bus to create the peer on
+ * @listener:           listener the peer originally connected through
+ * @dispatcher:         dispatcher to use
+ * @fd:                 connection socket
+ * @id:                 unique ID of the peer
+ * @checked:            whether the peer already passed the connect policy
+ *
+ * This is like peer_new_with_fd(), but the peer keeps the unique ID it had in
+ * the other process. If it passed the connect policy there, the policy is not
+ * checked again, but a snapshot is taken right away. Otherwise, the peer is
+ * pending, and is promoted as usual, see peer_refresh_policy(). The caller is
+ * responsible to restore the connection state, before spawning the peer.
+ *
+ * Return: 0 on success, PEER_E_QUOTA if the quota failed, PEER_E_ID_EXISTS if
+ *         another peer has the same ID, negative error code on failure.
+ */
+int peer_new_restored(Peer **peerp,
+                      Bus *bus,
+                      Listener *listener,
+                      DispatchContext *dispatcher,
+                      int fd,
+                      uint64_t id,
+                      bool checked) {
+        if (bus->peers.table.n_entries && bus->peers.table.buckets[peer_registry_probe(&bus->peers, id)])
+                return PEER_E_ID_EXISTS;
+
+        return error_trace(peer_new(peerp, bus, listener, listener->guid, dispatcher, fd, id, checked, false));
+}
+
+static void peer_flush_verdicts(Peer *peer) {
+        size_t i;
+
+        for (i = 0; i < C_ARRAY_SIZE(peer->verdicts); ++i) {
+                atom_unref(peer->verdicts[i].path);
+                atom_unref(peer->verdicts[i].member);
+                atom_unref(peer->verdicts[i].interface);
+                peer->verdicts[i] = (PeerVerdict)PEER_VERDICT_NULL;
+        }
+}
+
 /**
  * peer_free() - XXX
  */
@@ -250,23 +617,29 @@ Peer *peer_free(Peer *peer) {
 
         assert(!peer->registered);
 
-        c_rbtree_remove_init(&peer->bus->peers.peer_tree, &peer->registry_node);
+        if (peer->slot != PEER_SLOT_INVALID)
+                peer_registry_unlink(&peer->bus->peers, peer);
 
         fd = peer->connection.socket.fd;
 
+        c_list_unlink(&peer->listener_link);
+        capture_free(peer->capture);
+        peer_flush_verdicts(peer);
         reply_owner_deinit(&peer->owned_replies);
         reply_registry_deinit(&peer->replies_outgoing);
         match_owner_deinit(&peer->owned_matches);
         match_registry_deinit(&peer->matches);
         name_owner_deinit(&peer->owned_names);
-        policy_snapshot_free(peer->policy);
+        arena_deinit(&peer->arena);
+        policy_snapshot_unref(peer->policy);
         connection_deinit(&peer->connection);
         user_unref(peer->user);
         user_charge_deinit(&peer->charges[2]);
         user_charge_deinit(&peer->charges[1]);
         user_charge_deinit(&peer->charges[0]);
+        free(peer->gids);
         free(peer->seclabel);
-        free(peer);
+        pool_free(&peer_pool, peer);
 
         close(fd);
 
@@ -277,11 +650,75 @@ int peer_spawn(Peer *peer) {
         return error_fold(connection_open(&peer->connection));
 }
 
+/**
+ * peer_refresh_policy() - rebind the policy snapshot of a peer
+ * @peer:               peer to operate on
+ *
+ * If the policy of the listener this peer connected through was replaced
+ * since the policy snapshot of the peer was taken, this takes a new snapshot
+ * from the current policy. Snapshots are shared between peers with equal
+ * credentials, so after a reload only the first peer of each credential-set
+ * pays for the snapshot, all others just take a reference.
+ *
+ * This is called lazily whenever the snapshot of a peer is about to be used,
+ * so a reload does not have to walk all peers. Peers whose listener was
+ * released keep their last snapshot.
+ *
+ * Peers accepted while their listener had no policy have no snapshot at all.
+ * Those are promoted here, once the listener got its policy, including the
+ * connect check that was skipped on accept. If their listener is released
+ * before that, they are refused.
+ *
+ * Return: 0 on success, PEER_E_CONNECTION_REFUSED if a pending peer is not
+ *         allowed to connect, negative error code on failure.
+ */
+int peer_refresh_policy(Peer *peer) {
+        PolicySnapshot *snapshot;
+        int r;
+
+        if (!peer->listener)
+                return peer->policy ? 0 : PEER_E_CONNECTION_REFUSED;
+        if (!peer->listener->policy)
+                return 0;
+        if (peer->policy && peer->policy->registry == peer->listener->policy)
+                return 0;
+
+        r = policy_snapshot_new(&snapshot,
+                                peer->listener->policy,
+                                peer->sid,
+                                peer->user->uid,
+                                peer->gids,
+                                peer->n_gids);
+        if (r)
+                return error_fold(r);
+
+        if (!peer->policy) {
+                r = policy_snapshot_check_connect(snapshot);
+                if (r) {
+                        policy_snapshot_unref(snapshot);
+                        return (r == POLICY_E_ACCESS_DENIED) ? PEER_E_CONNECTION_REFUSED : error_fold(r);
+                }
+
+                /* resume reading, which was stopped after the SASL exchange */
+                dispatch_file_select(&peer->connection.socket_file, EPOLLIN);
+        }
+
+        policy_snapshot_unref(peer->policy);
+        peer->policy = snapshot;
+        return 0;
+}
+
 void peer_register(Peer *peer) {
         assert(!peer->registered);
         assert(!peer->monitor);
 
         peer->registered = true;
+
+        /* the set of unique names changed, drop cached name listings */
+        ++peer->bus->name_generation;
+
+        dispatch_file_set_priority(&peer->connection.socket_file,
+                                   bus_get_user_priority(peer->bus, peer->user->uid));
 }
 
 void peer_unregister(Peer *peer) {
@@ -289,6 +726,59 @@ void peer_unregister(Peer *peer) {
         assert(!peer->monitor);
 
         peer->registered = false;
+
+        /* peers may have cached us as destination, even on silent disconnects */
+        ++peer->bus->name_generation;
+}
+
+/**
+ * peer_find_destination() - resolve the destination of a unicast message
+ * @peer:               sending peer
+ * @namep:              output argument for the name object, or NULL
+ * @destination:        destination to resolve
+ *
+ * This behaves like bus_find_peer_by_name(), but remembers the last destination
+ * that was successfully resolved on behalf of @peer. Most peers talk to a
+ * single destination at a time, so consecutive messages skip parsing the
+ * address and looking it up.
+ *
+ * The cache is invalidated whenever any name on the bus changes its primary
+ * owner, or a peer is registered or unregistered, by bumping the name
+ * generation of the bus.
+ * Only successful lookups are cached, hence any cached peer and name are
+ * guaranteed to still be valid as long as the generation is unchanged.
+ *
+ * Return: The peer owning @destination, or NULL if there is none.
+ */
+Peer *peer_find_destination(Peer *peer, Name **namep, const char *destination) {
+        PeerDestination *cache = &peer->destination;
+        Peer *receiver;
+        Name *name;
+        size_t n_destination;
+
+        n_destination = strlen(destination);
+
+        if (cache->peer &&
+            cache->generation == peer->bus->name_generation &&
+            cache->n_name == n_destination &&
+            !memcmp(cache->name_str, destination, n_destination)) {
+                if (namep)
+                        *namep = cache->name;
+                return cache->peer;
+        }
+
+        receiver = bus_find_peer_by_name(peer->bus, &name, destination);
+        if (receiver && n_destination <= PEER_DESTINATION_LENGTH_MAX) {
+                cache->generation = peer->bus->name_generation;
+                cache->peer = receiver;
+                cache->name = name;
+                cache->n_name = n_destination;
+                memcpy(cache->name_str, destination, n_destination + 1);
+        }
+
+        if (namep)
+                *namep = name;
+        return receiver;
 }
 
 bool peer_is_privileged(Peer *peer) {
@@ -301,6 +791,27 @@ bool peer_is_privileged(Peer *peer) {
         return false;
 }
 
+/**
+ * peer_get_memory() - query memory used by a peer
+ * @peer:               peer to operate on
+ *
+ * This returns the number of bytes allocated for @peer itself, its
+ * credentials, and its input buffers, including a partially received
+ * message. Queued outgoing messages are not included, since they are usually
+ * shared with other receivers.
+ *
+ * Return: Number of bytes used by @peer.
+ */
+size_t peer_get_memory(Peer *peer) {
+        Socket *socket = &peer->connection.socket;
+
+        return sizeof(*peer) +
+               peer->n_seclabel + 1 +
+               peer->n_gids * sizeof(*peer->gids) +
+               iqueue_get_memory(&socket->in.queue) +
+               (socket->in.message ? socket->in.message->n_data : 0);
+}
+
 int peer_request_name(Peer *peer, const char *name, uint32_t flags, NameChange *change) {
         int r;
 
@@ -326,6 +837,10 @@ int peer_request_name(Peer *peer, const char *name, uint32_t flags, NameChange *
                                        name,
                                        flags,
                                        change);
+
+        /* ownership might have changed, invalidate all cached verdicts */
+        ++peer->bus->policy_generation;
+
         if (r == NAME_E_QUOTA)
                 return PEER_E_QUOTA;
         else if (r == NAME_E_ALREADY_OWNER)
@@ -352,6 +867,10 @@ int peer_release_name(Peer *peer, const char *name, NameChange *change) {
         /* XXX: refuse invalid names */
 
         r = name_registry_release_name(&peer->bus->names, &peer->owned_names, name, change);
+
+        /* ownership might have changed, invalidate all cached verdicts */
+        ++peer->bus->policy_generation;
+
         if (r == NAME_E_NOT_FOUND)
                 return PEER_E_NAME_NOT_FOUND;
         else if (r == NAME_E_NOT_OWNER)
@@ -364,6 +883,18 @@ int peer_release_name(Peer *peer, const char *name, NameChange *change) {
 
 void peer_release_name_ownership(Peer *peer, NameOwnership *ownership, NameChange *change) {
         name_ownership_release(ownership, change);
+        ++peer->bus->policy_generation;
+}
+
+int peer_release_all_names(Peer *peer, NameChange **changesp, size_t *n_changesp) {
+        int r;
+
+        r = name_owner_release_all(&peer->owned_names, changesp, n_changesp);
+        if (r)
+                return error_fold(r);
+
+        ++peer->bus->policy_generation;
+        return 0;
 }
 
 static int peer_link_match(Peer *peer, MatchRule *rule, bool monitor) {
@@ -371,12 +902,12 @@ static int peer_link_match(Peer *peer, MatchRule *rule, bool monitor) {
         Peer *sender;
         int r;
 
-        if (!rule->keys.sender) {
+        if (!rule->keys->sender) {
                 match_rule_link(rule, &peer->bus->wildcard_matches, monitor);
-        } else if (strcmp(rule->keys.sender, "org.freedesktop.DBus") == 0) {
+        } else if (strcmp(rule->keys->sender, "org.freedesktop.DBus") == 0) {
                 match_rule_link(rule, &peer->bus->driver_matches, monitor);
         } else {
-                address_from_string(&addr, rule->keys.sender);
+                address_from_string(&addr, rule->keys->sender);
                 switch (addr.type) {
                 case ADDRESS_TYPE_ID: {
                         sender = peer_registry_find_peer(&peer->bus->peers, addr.id);
@@ -390,9 +921,10 @@ static int peer_link_match(Peer *peer, MatchRule *rule, bool monitor) {
                                  * This works and is meant for compatibility.
                                  * It does not perform nicely, but there is
                                  * also no reason to ever guess the ID of a
-                                 * forthcoming peer.
+                                 * forthcoming peer. The sender ID is already
+                                 * part of the parsed keys, so the rule still
+                                 * only matches messages from that peer.
                                  */
-                                rule->keys.filter.sender = addr.id;
                                 match_rule_link(rule, &peer->bus->wildcard_matches, monitor);
                         } else {
                                 /*
@@ -417,7 +949,7 @@ static int peer_link_match(Peer *peer, MatchRule *rule, bool monitor) {
                          */
                         _c_cleanup_(name_unrefp) Name *name = NULL;
 
-                        r = name_registry_ref_name(&peer->bus->names, &name, rule->keys.sender);
+                        r = name_registry_ref_name(&peer->bus->names, &name, rule->keys->sender);
                         if (r)
                                 return error_fold(r);
 
@@ -437,7 +969,7 @@ int peer_add_match(Peer *peer, const char *rule_string) {
         _c_cleanup_(match_rule_user_unrefp) MatchRule *rule = NULL;
         int r;
 
-        r = match_owner_ref_rule(&peer->owned_matches, &rule, peer->user, rule_string);
+        r = match_owner_ref_rule(&peer->owned_matches, &rule, peer->user, &peer->bus->match_keys, rule_string);
         if (r) {
                 if (r == MATCH_E_QUOTA)
                         return PEER_E_QUOTA;
@@ -456,6 +988,64 @@ int peer_add_match(Peer *peer, const char *rule_string) {
         return 0;
 }
 
+/**
+ * peer_add_matches() - add a set of match rules
+ * @peer:               peer to operate on
+ * @rule_strings:       match rules to add
+ * @n_rule_strings:     number of match rules in @rule_strings
+ *
+ * This is the batched version of peer_add_match(). Either all rules are added,
+ * or none of them. All rules are parsed and charged first, and only if that
+ * succeeded for every single rule, they are linked into the match registries.
+ *
+ * Return: 0 on success, PEER_E_QUOTA if the quota of @peer does not suffice
+ *         for all rules, PEER_E_MATCH_INVALID if any rule is invalid, negative
+ *         error code on failure.
+ */
+int peer_add_matches(Peer *peer, const char **rule_strings, size_t n_rule_strings) {
+        MatchRule **rules;
+        size_t i;
+        int r;
+
+        if (!n_rule_strings)
+                return 0;
+
+        rules = calloc(n_rule_strings, sizeof(*rules));
+        if (!rules)
+                return error_origin(-ENOMEM);
+
+        for (i = 0; i < n_rule_strings; ++i) {
+                r = match_owner_ref_rule(&peer->owned_matches, &rules[i], peer->user, &peer->bus->match_keys, rule_strings[i]);
+                if (r) {
+                        while (i > 0)
+                                match_rule_user_unref(rules[--i]);
+                        free(rules);
+
+                        if (r == MATCH_E_QUOTA)
+                                return PEER_E_QUOTA;
+                        else if (r == MATCH_E_INVALID)
+                                return PEER_E_MATCH_INVALID;
+                        else
+                                return error_fold(r);
+                }
+        }
+
+        /* only fatal errors from here on */
+
+        for (i = 0; i < n_rule_strings; ++i) {
+                r = peer_link_match(peer, rules[i], false);
+                if (r) {
+                        while (i < n_rule_strings)
+                                match_rule_user_unref(rules[i++]);
+                        free(rules);
+                        return error_trace(r);
+                }
+        }
+
+        free(rules);
+        return 0;
+}
+
 int peer_remove_match(Peer *peer, const char *rule_string) {
         _c_cleanup_(name_unrefp) Name *name = NULL;
         MatchRule *rule;
@@ -469,7 +1059,7 @@ int peer_remove_match(Peer *peer, const char *rule_string) {
         else if (!rule)
                 return PEER_E_MATCH_NOT_FOUND;
 
-        if (rule->keys.sender && *rule->keys.sender != ':' && strcmp(rule->keys.sender, "org.freedesktop.DBus") != 0)
+        if (rule->keys->sender && *rule->keys->sender != ':' && strcmp(rule->keys->sender, "org.freedesktop.DBus") != 0)
                 name = c_container_of(rule->registry, Name, matches);
 
         match_rule_user_unref(rule);
@@ -485,6 +1075,7 @@ int peer_become_monitor(Peer *peer, MatchOwner *owned_matches) {
         assert(!peer->registered);
         assert(!peer->monitor);
         assert(c_rbtree_is_empty(&peer->owned_matches.rule_tree));
+        assert(owned_matches->arena == peer->owned_matches.arena);
 
         /* only fatal errors may occur after this point */
         peer->owned_matches = *owned_matches;
@@ -506,6 +1097,7 @@ int peer_become_monitor(Peer *peer, MatchOwner *owned_matches) {
                 return poison;
 
         peer->monitor = true;
+        ++peer->bus->n_monitors;
 
         return 0;
 }
@@ -513,23 +1105,303 @@ int peer_become_monitor(Peer *peer, MatchOwner *owned_matches) {
 void peer_flush_matches(Peer *peer) {
         CRBNode *node;
 
+        /* a monitor stops monitoring once its matches are gone */
+        if (peer->monitor && peer->owned_matches.rule_tree.root) {
+                assert(peer->bus->n_monitors > 0);
+                --peer->bus->n_monitors;
+        }
+
         while ((node = peer->owned_matches.rule_tree.root)) {
                 _c_cleanup_(name_unrefp) Name *name = NULL;
                 MatchRule *rule = c_container_of(node, MatchRule, owner_node);
 
-                if (rule->keys.sender && *rule->keys.sender != ':' && strcmp(rule->keys.sender, "org.freedesktop.DBus") != 0)
+                if (rule->keys->sender && *rule->keys->sender != ':' && strcmp(rule->keys->sender, "org.freedesktop.DBus") != 0)
                         name = c_container_of(rule->registry, Name, matches);
 
                 match_rule_user_unref(rule);
         }
 }
 
-int peer_queue_call(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, ReplyOwner *sender_replies, User *sender_user, uint64_t sender_id, Peer *receiver, Message *message) {
+/**
+ * peer_restore_reply() - restore expected reply
+ * @receiver:           peer that is expected to reply
+ * @sender:             peer that expects the reply
+ * @serial:             serial of the call to reply to
+ *
+ * This restores a reply slot of a call from @sender to @receiver, that was
+ * handed over from another process. If the bus uses reply timeouts, the
+ * timeout starts over.
+ *
+ * Return: 0 on success, PEER_E_EXPECTED_REPLY_EXISTS if the reply is already
+ *         expected, PEER_E_QUOTA if the quota failed, negative error code on
+ *         failure.
+ */
+int peer_restore_reply(Peer *receiver, Peer *sender, uint32_t serial) {
         _c_cleanup_(reply_slot_freep) ReplySlot *slot = NULL;
+        int r;
+
+        r = reply_slot_new(&slot, &receiver->replies_outgoing, &sender->owned_replies,
+                           receiver->user, sender->user, sender->id, serial);
+        if (r == REPLY_E_EXISTS)
+                return PEER_E_EXPECTED_REPLY_EXISTS;
+        else if (r == REPLY_E_QUOTA)
+                return PEER_E_QUOTA;
+        else if (r)
+                return error_fold(r);
+
+        if (receiver->bus->reply_timeout) {
+                dispatch_timer_init(&slot->timeout,
+                                    receiver->connection.socket_file.context,
+                                    driver_reply_timeout);
+
+                r = dispatch_timer_arm(&slot->timeout, receiver->bus->reply_timeout);
+                if (r)
+                        return error_fold(r);
+        }
+
+        slot = NULL;
+        return 0;
+}
+
+static Atom *peer_verdict_key_ref_atom(PeerVerdictKey *key, Bus *bus, const char *string) {
+        Atom *atom;
+
+        if (!string)
+                return NULL;
+
+        atom = atom_registry_find_atom(bus->atoms, string);
+        if (!atom)
+                key->resolved = false;
+
+        return atom_ref(atom);
+}
+
+static void peer_verdict_key_init(PeerVerdictKey *key, Bus *bus, NameSet *sender_names, Message *message) {
+        *key = (PeerVerdictKey)PEER_VERDICT_KEY_NULL;
+
+        /*
+         * Verdicts are only cached for live senders. Name snapshots (e.g., of
+         * messages queued on activation) are not covered by the generation
+         * counter, and the driver is not subject to policy at all. Neither
+         * are verdicts cached if SELinux cannot report policy reloads.
+         */
+        if (!sender_names || sender_names->type != NAME_SET_TYPE_OWNER)
+                return;
+
+        key->selinux_generation = bus_selinux_generation();
+        if (!key->selinux_generation)
+                return;
+
+        key->cacheable = true;
+        key->resolved = true;
+        key->interface = peer_verdict_key_ref_atom(key, bus, message->metadata.fields.interface);
+        key->member = peer_verdict_key_ref_atom(key, bus, message->metadata.fields.member);
+        key->path = peer_verdict_key_ref_atom(key, bus, message->metadata.fields.path);
+}
+
+static void peer_verdict_key_deinit(PeerVerdictKey *key) {
+        atom_unref(key->path);
+        atom_unref(key->member);
+        atom_unref(key->interface);
+        *key = (PeerVerdictKey)PEER_VERDICT_KEY_NULL;
+}
+
+C_DEFINE_CLEANUP(PeerVerdictKey *, peer_verdict_key_deinit);
+
+static int peer_verdict_key_resolve(PeerVerdictKey *key, Bus *bus, Message *message) {
+        int r;
+
+        /*
+         * Strings that are not interned, yet, are interned when a verdict is
+         * cached, so the cache can be probed by atom.
+         */
+        if (message->metadata.fields.interface && !key->interface) {
+                r = atom_registry_ref_atom(bus->atoms, &key->interface, message->metadata.fields.interface);
+                if (r)
+                        return error_fold(r);
+        }
+
+        if (message->metadata.fields.member && !key->member) {
+                r = atom_registry_ref_atom(bus->atoms, &key->member, message->metadata.fields.member);
+                if (r)
+                        return error_fold(r);
+        }
+
+        if (message->metadata.fields.path && !key->path) {
+                r = atom_registry_ref_atom(bus->atoms, &key->path, message->metadata.fields.path);
+                if (r)
+                        return error_fold(r);
+        }
+
+        key->resolved = true;
+        return 0;
+}
+
+static PeerVerdict *peer_get_verdict(Peer *peer, PeerVerdictKey *key, uint64_t sender_id, unsigned int type) {
+        uint64_t hash;
+
+        hash = sender_id;
+        hash = hash * 31 + (uintptr_t)key->interface;
+        hash = hash * 31 + (uintptr_t)key->member;
+        hash = hash * 31 + (uintptr_t)key->path;
+        hash = hash * 31 + type;
+        hash ^= hash >> 29;
+
+        return &peer->verdicts[hash % C_ARRAY_SIZE(peer->verdicts)];
+}
+
+static int peer_evaluate_xmit(PolicySnapshot *sender_policy,
+                              NameSet *sender_names,
+                              Peer *receiver,
+                              Message *message) {
         NameSet receiver_names = NAME_SET_INIT_FROM_OWNER(&receiver->owned_names);
+        int r;
+
+        r = policy_snapshot_check_receive(receiver->policy,
+                                          sender_names,
+                                          message->metadata.fields.interface,
+                                          message->metadata.fields.member,
+                                          message->metadata.fields.path,
+                                          message->header->type);
+        if (r) {
+                if (r != POLICY_E_ACCESS_DENIED)
+                        return error_fold(r);
+
+                return PEER_E_RECEIVE_DENIED;
+        }
+
+        if (sender_policy) {
+                r = policy_snapshot_check_send(sender_policy,
+                                               receiver->sid,
+                                               &receiver_names,
+                                               message->metadata.fields.interface,
+                                               message->metadata.fields.member,
+                                               message->metadata.fields.path,
+                                               message->header->type);
+                if (r) {
+                        if (r != POLICY_E_ACCESS_DENIED)
+                                return error_fold(r);
+
+                        return PEER_E_SEND_DENIED;
+                }
+        }
+
+        return 0;
+}
+
+static PeerXmitGroup *peer_xmit_groups_find(PeerXmitGroups *groups, Peer *receiver) {
+        size_t i;
+
+        for (i = 0; i < groups->n_groups; ++i)
+                if (groups->groups[i].policy == receiver->policy &&
+                    groups->groups[i].sid == receiver->sid)
+                        return &groups->groups[i];
+
+        return NULL;
+}
+
+static int peer_check_xmit(PolicySnapshot *sender_policy,
+                           NameSet *sender_names,
+                           uint64_t sender_id,
+                           Peer *receiver,
+                           PeerVerdictKey *key,
+                           PeerXmitGroups *groups,
+                           Message *message) {
+        PeerXmitGroup *group = NULL;
+        PeerVerdict *verdict = NULL;
+        int r;
+
+        /* only grants are cached, so every denial is evaluated and audited */
+        if (key->cacheable && key->resolved) {
+                verdict = peer_get_verdict(receiver, key, sender_id, message->header->type);
+                if (verdict->generation == receiver->bus->policy_generation &&
+                    verdict->selinux_generation == key->selinux_generation &&
+                    verdict->sender_id == sender_id &&
+                    verdict->type == message->header->type &&
+                    verdict->interface == key->interface &&
+                    verdict->member == key->member &&
+                    verdict->path == key->path)
+                        return 0;
+        }
+
+        r = peer_refresh_policy(receiver);
+        if (r)
+                return error_fold(r);
+
+        /*
+         * Receivers with names are always evaluated on their own, since
+         * comparing name sets would cost more than the evaluation. The
+         * snapshots referenced by @groups are pinned by the receivers they
+         * were recorded for, which are not released during a broadcast.
+         */
+        if (groups && c_rbtree_is_empty(&receiver->owned_names.ownership_tree))
+                group = peer_xmit_groups_find(groups, receiver);
+        else
+                groups = NULL;
+
+        if (!group) {
+                r = peer_evaluate_xmit(sender_policy, sender_names, receiver, message);
+                if (r)
+                        return error_trace(r);
+
+                if (groups && groups->n_groups < C_ARRAY_SIZE(groups->groups))
+                        groups->groups[groups->n_groups++] = (PeerXmitGroup){
+                                .policy = receiver->policy,
+                                .sid = receiver->sid,
+                        };
+        }
+
+        if (key->cacheable) {
+                if (!key->resolved) {
+                        r = peer_verdict_key_resolve(key, receiver->bus, message);
+                        if (r)
+                                return error_trace(r);
+
+                        verdict = peer_get_verdict(receiver, key, sender_id, message->header->type);
+                }
+
+                atom_unref(verdict->path);
+                atom_unref(verdict->member);
+                atom_unref(verdict->interface);
+
+                verdict->generation = receiver->bus->policy_generation;
+                verdict->selinux_generation = key->selinux_generation;
+                verdict->sender_id = sender_id;
+                verdict->type = message->header->type;
+                verdict->interface = atom_ref(key->interface);
+                verdict->member = atom_ref(key->member);
+                verdict->path = atom_ref(key->path);
+        }
+
+        return 0;
+}
+
+/**
+ * peer_refuses_fds() - check whether a message can be passed to a peer
+ * @receiver:           receiving peer
+ * @message:            message to check
+ *
+ * File descriptors cannot be passed through shared-memory rings (see
+ * socket_open_shm()). Hence, once @receiver switched to shared memory,
+ * messages carrying file descriptors must not be queued on it, as the
+ * receiver would never get the file descriptors its header announces.
+ *
+ * Return: True if @receiver cannot be passed @message.
+ */
+bool peer_refuses_fds(Peer *receiver, Message *message) {
+        return receiver->connection.socket.shm && fdlist_count(message->fds);
+}
+
+static int peer_prepare_call(PolicySnapshot *sender_policy, NameSet *sender_names, ReplyOwner *sender_replies, User *sender_user, uint64_t sender_id, Peer *receiver, Message *message, ReplySlot **slotp) {
+        _c_cleanup_(reply_slot_freep) ReplySlot *slot = NULL;
+        _c_cleanup_(peer_verdict_key_deinitp) PeerVerdictKey *key = NULL;
+        PeerVerdictKey key_storage;
         uint32_t serial;
         int r;
 
+        if (peer_refuses_fds(receiver, message))
+                return PEER_E_FDS_REFUSED;
+
         serial = message_read_serial(message);
 
         if (sender_replies && serial) {
@@ -541,47 +1413,187 @@ int peer_queue_call(PolicySnapshot *sender_policy, NameSet *sender_names, MatchR
                         return PEER_E_QUOTA;
                 else if (r)
                         return error_fold(r);
+
+                if (receiver->bus->reply_timeout) {
+                        dispatch_timer_init(&slot->timeout,
+                                            receiver->connection.socket_file.context,
+                                            driver_reply_timeout);
+
+                        r = dispatch_timer_arm(&slot->timeout, receiver->bus->reply_timeout);
+                        if (r)
+                                return error_fold(r);
+                }
         }
 
-        r = policy_snapshot_check_receive(receiver->policy,
-                                          sender_names,
-                                          message->metadata.fields.interface,
-                                          message->metadata.fields.member,
-                                          message->metadata.fields.path,
-                                          message->header->type);
+        peer_verdict_key_init(&key_storage, receiver->bus, sender_names, message);
+        key = &key_storage;
+
+        r = peer_check_xmit(sender_policy, sender_names, sender_id, receiver, key, NULL, message);
         if (r) {
-                if (r == POLICY_E_ACCESS_DENIED)
-                        return PEER_E_RECEIVE_DENIED;
+                if (r == PEER_E_RECEIVE_DENIED || r == PEER_E_SEND_DENIED) {
+                        ++receiver->stats.n_policy_denials;
+                        return r;
+                }
 
-                return error_fold(r);
+                return error_trace(r);
         }
 
-        r = policy_snapshot_check_send(sender_policy,
-                                       receiver->sid,
-                                       &receiver_names,
-                                       message->metadata.fields.interface,
-                                       message->metadata.fields.member,
-                                       message->metadata.fields.path,
-                                       message->header->type);
+        *slotp = slot;
+        slot = NULL;
+        return 0;
+}
+
+/**
+ * peer_admit_call() - check whether a call could be queued
+ * @sender:             sending peer
+ * @receiver:           receiving peer
+ * @message:            message to check
+ *
+ * This runs the policy and quota checks of peer_queue_call() for @message,
+ * without queueing it. Only the metadata of @message is needed, so this can
+ * be used to reject messages before their body was received. Passing these
+ * checks does not imply the message will be queued, since all checks are
+ * run again once it was received in full.
+ *
+ * Return: 0 on success, PEER_E_SEND_DENIED or PEER_E_RECEIVE_DENIED if the
+ *         policy denies the message, PEER_E_QUOTA if quota failed, negative
+ *         error code on failure.
+ */
+int peer_admit_call(Peer *sender, Peer *receiver, Message *message) {
+        _c_cleanup_(peer_verdict_key_deinitp) PeerVerdictKey *key = NULL;
+        NameSet sender_names = NAME_SET_INIT_FROM_OWNER(&sender->owned_names);
+        PeerVerdictKey key_storage;
+        int r;
+
+        peer_verdict_key_init(&key_storage, receiver->bus, &sender_names, message);
+        key = &key_storage;
+
+        r = peer_check_xmit(sender->policy, &sender_names, sender->id, receiver, key, NULL, message);
         if (r) {
-                if (r == POLICY_E_ACCESS_DENIED)
-                        return PEER_E_SEND_DENIED;
+                if (r == PEER_E_RECEIVE_DENIED || r == PEER_E_SEND_DENIED) {
+                        ++receiver->stats.n_policy_denials;
+                        return r;
+                }
+
+                return error_trace(r);
+        }
+
+        r = connection_check_quota(&receiver->connection, sender->user, message);
+        if (r) {
+                if (r == CONNECTION_E_QUOTA) {
+                        ++receiver->stats.n_quota_denials;
+                        return PEER_E_QUOTA;
+                }
 
                 return error_fold(r);
         }
 
+        return 0;
+}
+
+int peer_queue_call(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, ReplyOwner *sender_replies, User *sender_user, uint64_t sender_id, Peer *receiver, Message *message) {
+        _c_cleanup_(reply_slot_freep) ReplySlot *slot = NULL;
+        int r;
+
+        r = peer_prepare_call(sender_policy, sender_names, sender_replies, sender_user, sender_id, receiver, message, &slot);
+        if (r)
+                return error_trace(r);
+
         r = connection_queue(&receiver->connection, sender_user, message);
         if (r) {
-                if (CONNECTION_E_QUOTA)
+                if (CONNECTION_E_QUOTA) {
+                        ++receiver->stats.n_quota_denials;
                         return PEER_E_QUOTA;
-                else
+                } else {
                         return error_fold(r);
+                }
         }
 
+        peer_account_queued(receiver, message);
         slot = NULL;
         return 0;
 }
 
+/**
+ * peer_queue_call_batch() - queue multiple calls from one sender to a peer
+ * @sender_policy:      policy of the sender
+ * @sender_names:       names of the sender
+ * @sender_matches:     matches of the sender
+ * @sender_replies:     reply owner of the sender, or NULL
+ * @sender_user:        user of the sender
+ * @sender_id:          ID of the sender
+ * @receiver:           receiving peer
+ * @messages:           messages to queue
+ * @results:            output array for the result of each message
+ * @n_messages:         number of messages, at most PEER_BATCH_MAX
+ *
+ * This is like calling peer_queue_call() for each message in @messages, and
+ * storing its positive result in the respective entry of @results. However,
+ * all messages that pass the policy checks are queued on the receiver at
+ * once, so quota is only charged once. If the batch exceeds the quota as a
+ * whole, the messages are queued one by one instead, so exactly those
+ * messages fail that would have failed without batching.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int peer_queue_call_batch(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, ReplyOwner *sender_replies, User *sender_user, uint64_t sender_id, Peer *receiver, Message **messages, int *results, size_t n_messages) {
+        ReplySlot *slots[PEER_BATCH_MAX] = {};
+        Message *queue[PEER_BATCH_MAX];
+        size_t i, n_queue = 0;
+        bool single = false;
+        int r;
+
+        assert(n_messages <= PEER_BATCH_MAX);
+
+        for (i = 0; i < n_messages; ++i) {
+                r = peer_prepare_call(sender_policy, sender_names, sender_replies, sender_user, sender_id, receiver, messages[i], &slots[i]);
+                if (r < 0) {
+                        r = error_trace(r);
+                        goto exit;
+                }
+
+                results[i] = r;
+                if (!r)
+                        queue[n_queue++] = messages[i];
+        }
+
+        r = connection_queue_batch(&receiver->connection, sender_user, queue, n_queue);
+        if (r == CONNECTION_E_QUOTA) {
+                /* the batch exceeds the quota, fall back to single messages */
+                single = true;
+        } else if (r) {
+                r = error_fold(r);
+                goto exit;
+        }
+
+        for (i = 0; i < n_messages; ++i) {
+                if (results[i])
+                        continue;
+
+                if (single) {
+                        r = connection_queue(&receiver->connection, sender_user, messages[i]);
+                        if (r == CONNECTION_E_QUOTA) {
+                                ++receiver->stats.n_quota_denials;
+                                results[i] = PEER_E_QUOTA;
+                                continue;
+                        } else if (r) {
+                                r = error_fold(r);
+                                goto exit;
+                        }
+                }
+
+                peer_account_queued(receiver, messages[i]);
+                slots[i] = NULL;
+        }
+
+        r = 0;
+
+exit:
+        for (i = 0; i < n_messages; ++i)
+                reply_slot_free(slots[i]);
+        return r;
+}
+
 int peer_queue_reply(Peer *sender, const char *destination, uint32_t reply_serial, Message *message) {
         _c_cleanup_(reply_slot_freep) ReplySlot *slot = NULL;
         Peer *receiver;
@@ -598,110 +1610,263 @@ int peer_queue_reply(Peer *sender, const char *destination, uint32_t reply_seria
 
         receiver = c_container_of(slot->owner, Peer, owned_replies);
 
+        if (peer_refuses_fds(receiver, message)) {
+                r = driver_reply_refused(receiver, reply_serial);
+                if (r)
+                        return error_trace(r);
+
+                return PEER_E_FDS_REFUSED;
+        }
+
         r = connection_queue(&receiver->connection, NULL, message);
         if (r) {
-                if (r == CONNECTION_E_QUOTA)
+                if (r == CONNECTION_E_QUOTA) {
+                        ++receiver->stats.n_quota_denials;
                         connection_shutdown(&receiver->connection);
-                else
+                } else {
                         return error_fold(r);
+                }
+        } else {
+                peer_account_queued(receiver, message);
         }
 
         return 0;
 }
 
-static int peer_broadcast_to_matches(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *matches, MatchFilter *filter, uint64_t transaction_id, Message *message) {
+static void peer_broadcast_collect(PeerRegistry *peers, MatchRegistry *matches, MatchBloomKey *bloom, MatchFilter *filter) {
         MatchRule *rule;
+
+        /* skip registries that cannot match without looking at their rules */
+        if (!match_registry_may_match(matches, bloom))
+                return;
+
+        for (rule = match_rule_next_match(matches, NULL, filter); rule; rule = match_rule_next_match(matches, rule, filter))
+                peer_registry_collect_receiver(peers, c_container_of(rule->owner, Peer, owned_matches));
+}
+
+static int peer_message_get_coalescable(Message *message, bool *coalescablep) {
         int r;
 
-        for (rule = match_rule_next_match(matches, NULL, filter); rule; rule = match_rule_next_match(matches, rule, filter)) {
-                Peer *receiver = c_container_of(rule->owner, Peer, owned_matches);
-                NameSet receiver_names = NAME_SET_INIT_FROM_OWNER(&receiver->owned_names);
+        if (message->metadata.header.type != DBUS_MESSAGE_TYPE_SIGNAL ||
+            !message->metadata.fields.interface ||
+            !message->metadata.fields.member ||
+            strcmp(message->metadata.fields.interface, "org.freedesktop.DBus.Properties") ||
+            strcmp(message->metadata.fields.member, "PropertiesChanged")) {
+                *coalescablep = false;
+                return 0;
+        }
+
+        /*
+         * The first argument names the interface the properties belong to,
+         * so it is part of the coalescing key. If the body cannot be parsed,
+         * the signal is queued as is.
+         */
+        r = message_parse_body(message);
+        if (r < 0)
+                return error_fold(r);
+
+        *coalescablep = !r && !strcmp(message->metadata.fields.signature ?: "", "sa{sv}as");
+        return 0;
+}
+
+static const CDVarType peer_type_properties_changed[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE3(
+                        C_DVAR_T_s,
+                        C_DVAR_T_ARRAY(
+                                C_DVAR_T_PAIR(
+                                        C_DVAR_T_s,
+                                        C_DVAR_T_v
+                                )
+                        ),
+                        C_DVAR_T_ARRAY(C_DVAR_T_s)
+                )
+        )
+};
+
+static bool peer_properties_changed_mentions(Message *message, const char *property) {
+        _c_cleanup_(c_dvar_deinit) CDVar v = C_DVAR_INIT;
+        const char *interface, *name;
+        bool mentioned = false;
+
+        c_dvar_begin_read(&v, message->big_endian, peer_type_properties_changed, 1, message->body, message->n_body);
+
+        c_dvar_read(&v, "(s[", &interface);
+        while (c_dvar_more(&v)) {
+                c_dvar_read(&v, "{s", &name);
+                c_dvar_skip(&v, "v}");
+                mentioned = mentioned || !strcmp(name, property);
+        }
+        c_dvar_read(&v, "][");
+        while (c_dvar_more(&v)) {
+                c_dvar_read(&v, "s", &name);
+                mentioned = mentioned || !strcmp(name, property);
+        }
+        c_dvar_read(&v, "])");
+
+        return !c_dvar_end_read(&v) && mentioned;
+}
+
+/*
+ * A queued PropertiesChanged signal only carries one more state of the
+ * properties it lists. It can thus be dropped in favor of a newer signal for
+ * the same object and interface, but only if the newer one lists all of those
+ * properties as well, either with their new value, or as invalidated.
+ * Otherwise, the receiver would miss the changes of the properties that only
+ * the queued signal lists, so both are kept.
+ */
+static bool peer_properties_changed_supersedes(Message *queued, Message *message) {
+        _c_cleanup_(c_dvar_deinit) CDVar v = C_DVAR_INIT;
+        const char *interface, *name;
+        bool covered = true;
+
+        c_dvar_begin_read(&v, queued->big_endian, peer_type_properties_changed, 1, queued->body, queued->n_body);
+
+        c_dvar_read(&v, "(s[", &interface);
+        while (c_dvar_more(&v)) {
+                c_dvar_read(&v, "{s", &name);
+                c_dvar_skip(&v, "v}");
+                covered = covered && peer_properties_changed_mentions(message, name);
+        }
+        c_dvar_read(&v, "][");
+        while (c_dvar_more(&v)) {
+                c_dvar_read(&v, "s", &name);
+                covered = covered && peer_properties_changed_mentions(message, name);
+        }
+        c_dvar_read(&v, "])");
+
+        return !c_dvar_end_read(&v) && covered;
+}
+
+static int peer_broadcast_deliver(PolicySnapshot *sender_policy, NameSet *sender_names, uint64_t sender_id, PeerVerdictKey *key, Bus *bus, MatchFilter *filter, Message *message) {
+        PeerXmitGroups groups = PEER_XMIT_GROUPS_NULL;
+        PeerRegistry *peers = &bus->peers;
+        bool coalescable = false, resolved_coalescable = false;
+        Peer *receiver;
+        size_t i;
+        int r;
+
+        bus->n_fanout += peers->n_receivers;
+
+        for (i = 0; i < peers->n_receivers; ++i) {
+                receiver = peers->receivers[i];
 
                 /* exclude the destination from broadcasts */
                 if (filter->destination == receiver->id)
                         continue;
-                if (transaction_id <= receiver->transaction_id)
-                        continue;
-
-                receiver->transaction_id = c_max(transaction_id, receiver->transaction_id);
-
-                if (sender_policy) {
-                        r = policy_snapshot_check_send(sender_policy,
-                                                       receiver->sid,
-                                                       &receiver_names,
-                                                       message->metadata.fields.interface,
-                                                       message->metadata.fields.member,
-                                                       message->metadata.fields.path,
-                                                       message->header->type);
-                        if (r) {
-                                if (r == POLICY_E_ACCESS_DENIED)
-                                        continue;
 
-                                return error_fold(r);
-                        }
+                /*
+                 * If slow-consumer policing is enabled, receivers with more
+                 * than the configured number of bytes queued are considered
+                 * stalled, and broadcasts to them are dropped rather than
+                 * queued, until they caught up again. Only once they run into
+                 * their quota, they are disconnected. Signals of the driver
+                 * are never dropped, so peers can still track name owners.
+                 */
+                if (bus->slow_consumer_bytes &&
+                    sender_id != ADDRESS_ID_INVALID &&
+                    receiver->connection.socket.out.n_bytes >= bus->slow_consumer_bytes) {
+                        ++receiver->stats.n_slow_consumer_drops;
+                        continue;
                 }
 
-                r = policy_snapshot_check_receive(receiver->policy,
-                                                  sender_names,
-                                                  message->metadata.fields.interface,
-                                                  message->metadata.fields.member,
-                                                  message->metadata.fields.path,
-                                                  message->header->type);
+                r = peer_check_xmit(sender_policy, sender_names, sender_id, receiver, key, &groups, message);
                 if (r) {
-                        if (r == POLICY_E_ACCESS_DENIED)
+                        if (r == PEER_E_RECEIVE_DENIED || r == PEER_E_SEND_DENIED) {
+                                ++receiver->stats.n_policy_denials;
                                 continue;
+                        }
 
-                        return error_fold(r);
+                        return error_trace(r);
+                }
+
+                if (peer_refuses_fds(receiver, message))
+                        continue;
+
+                if (receiver->coalesce_signals && !resolved_coalescable) {
+                        r = peer_message_get_coalescable(message, &coalescable);
+                        if (r)
+                                return error_trace(r);
+
+                        resolved_coalescable = true;
                 }
 
-                r = connection_queue(&receiver->connection, NULL, message);
+                if (receiver->coalesce_signals && coalescable)
+                        r = connection_queue_coalesce(&receiver->connection, NULL, message, peer_properties_changed_supersedes);
+                else
+                        r = connection_queue(&receiver->connection, NULL, message);
                 if (r) {
-                        if (r == CONNECTION_E_QUOTA)
+                        if (r == CONNECTION_E_QUOTA) {
+                                ++receiver->stats.n_quota_denials;
                                 connection_shutdown(&receiver->connection);
-                        else
+                        } else {
                                 return error_fold(r);
+                        }
+                } else {
+                        peer_account_queued(receiver, message);
                 }
         }
 
         return 0;
 }
 
+/**
+ * peer_broadcast_filter_init() - initialize match filter for a message
+ * @filter:             filter to initialize
+ * @bus:                bus the message is routed on
+ * @sender_id:          id of the sender
+ * @destination:        destination peer, or NULL
+ * @message:            message to filter
+ *
+ * This initializes @filter from the metadata of @message. The indexed fields
+ * are resolved against the bus atoms once, so the match rules can compare
+ * them by pointer. Arguments are only parsed if a rule asks for them. Hence,
+ * the filter can be shared by all lookups for the same message, and the
+ * arguments are parsed at most once.
+ */
+void peer_broadcast_filter_init(MatchFilter *filter, Bus *bus, uint64_t sender_id, Peer *destination, Message *message) {
+        *filter = (MatchFilter)MATCH_FILTER_INIT;
+        filter->atoms = bus->atoms;
+        filter->type = message->metadata.header.type;
+        filter->sender = sender_id;
+        filter->destination = destination ? destination->id : ADDRESS_ID_INVALID;
+        filter->interface = atom_registry_resolve(bus->atoms, message->metadata.fields.interface);
+        filter->member = atom_registry_resolve(bus->atoms, message->metadata.fields.member);
+        filter->path = atom_registry_resolve(bus->atoms, message->metadata.fields.path);
+        filter->message = message;
+}
+
 int peer_broadcast(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, uint64_t sender_id, Peer *destination, Bus *bus, MatchFilter *filter, Message *message) {
-        MatchFilter fallback_filter = MATCH_FILTER_INIT;
+        _c_cleanup_(peer_verdict_key_deinitp) PeerVerdictKey *key = NULL;
+        MatchFilter fallback_filter;
+        PeerVerdictKey key_storage;
+        MatchBloomKey bloom;
         int r;
 
         if (!filter) {
                 filter = &fallback_filter;
-
-                filter->type = message->metadata.header.type;
-                filter->sender = sender_id;
-                filter->destination = destination ? destination->id : ADDRESS_ID_INVALID;
-                filter->interface = message->metadata.fields.interface;
-                filter->member = message->metadata.fields.member,
-                filter->path = message->metadata.fields.path;
-
-                for (size_t i = 0; i < 64; ++i) {
-                        if (message->metadata.args[i].element == 's') {
-                                filter->args[i] = message->metadata.args[i].value;
-                                filter->argpaths[i] = message->metadata.args[i].value;
-                        } else if (message->metadata.args[i].element == 'o') {
-                                filter->argpaths[i] = message->metadata.args[i].value;
-                        }
-                }
+                peer_broadcast_filter_init(filter, bus, sender_id, destination, message);
         }
 
-        /* start a new transaction, to avoid duplicates */
-        ++bus->transaction_ids;
+        /* hash the filter once, it is checked against every registry */
+        match_bloom_key_init(&bloom, filter);
 
-        r = peer_broadcast_to_matches(sender_policy, sender_names, &bus->wildcard_matches, filter, bus->transaction_ids, message);
-        if (r)
-                return error_trace(r);
+        /* resolve the policy cache key once, it is shared by all receivers */
+        peer_verdict_key_init(&key_storage, bus, sender_names, message);
+        key = &key_storage;
 
-        if (sender_matches) {
-                r = peer_broadcast_to_matches(sender_policy, sender_names, sender_matches, filter, bus->transaction_ids, message);
-                if (r)
-                        return error_trace(r);
-        }
+        /*
+         * Delivery happens in two phases. First, all matching receivers are
+         * collected into the receiver set of the peer registry, which is a
+         * dense bitmap indexed by peer slot, plus the list of receivers in
+         * order of collection. This deduplicates receivers that match via
+         * several rules, without touching anything but their slot. Then, the
+         * message is delivered to each receiver exactly once.
+         */
+        peer_broadcast_collect(&bus->peers, &bus->wildcard_matches, &bloom, filter);
+
+        if (sender_matches)
+                peer_broadcast_collect(&bus->peers, sender_matches, &bloom, filter);
 
         if (sender_names) {
                 NameOwner *owner;
@@ -716,30 +1881,34 @@ int peer_broadcast(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRe
                                 if (!name_ownership_is_primary(ownership))
                                         continue;
 
-                                r = peer_broadcast_to_matches(sender_policy, sender_names, &ownership->name->matches, filter, bus->transaction_ids, message);
-                                if (r)
-                                        return error_trace(r);
+                                peer_broadcast_collect(&bus->peers, &ownership->name->matches, &bloom, filter);
                         }
                         break;
                 case NAME_SET_TYPE_SNAPSHOT:
                         snapshot = sender_names->snapshot;
 
-                        for (size_t i = 0; i < snapshot->n_names; ++i) {
-                                r = peer_broadcast_to_matches(sender_policy, sender_names, &snapshot->names[i]->matches, filter, bus->transaction_ids, message);
-                                if (r)
-                                        return error_trace(r);
-                        }
+                        for (size_t i = 0; i < snapshot->n_names; ++i)
+                                peer_broadcast_collect(&bus->peers, &snapshot->names[i]->matches, &bloom, filter);
                         break;
                 default:
+                        peer_registry_clear_receivers(&bus->peers);
                         return error_origin(-ENOTRECOVERABLE);
                 }
         } else {
                 /* sent from the driver */
-                r = peer_broadcast_to_matches(NULL, NULL, &bus->driver_matches, filter, bus->transaction_ids, message);
-                if (r)
-                        return error_trace(r);
+                peer_broadcast_collect(&bus->peers, &bus->driver_matches, &bloom, filter);
+        }
+
+        if (filter->error) {
+                peer_registry_clear_receivers(&bus->peers);
+                return error_trace(filter->error);
         }
 
+        r = peer_broadcast_deliver(sender_policy, sender_names, sender_id, key, bus, filter, message);
+        peer_registry_clear_receivers(&bus->peers);
+        if (r)
+                return error_trace(r);
+
         return 0;
 }
 
@@ -748,15 +1917,32 @@ void peer_registry_init(PeerRegistry *registry) {
 }
 
 void peer_registry_deinit(PeerRegistry *registry) {
-        assert(c_rbtree_is_empty(&registry->peer_tree));
+        assert(!registry->table.n_entries);
+        assert(!registry->n_receivers);
+
+        hash_table_deinit(&registry->table);
+        free(registry->slots);
+        registry->slots = NULL;
+        free(registry->receivers);
+        registry->receivers = NULL;
+        free(registry->receiver_map);
+        registry->receiver_map = NULL;
+        free(registry->slot_map);
+        registry->slot_map = NULL;
+        registry->n_slots = 0;
         registry->ids = 0;
 }
 
 void peer_registry_flush(PeerRegistry *registry) {
-        Peer *peer, *safe;
+        Peer *peer;
+        size_t i;
         int r;
 
-        c_rbtree_for_each_entry_unlink(peer, safe, &registry->peer_tree, registry_node) {
+        for (i = 0; i < registry->n_slots; ++i) {
+                peer = registry->slots[i];
+                if (!peer)
+                        continue;
+
                 r = driver_goodbye(peer, true);
                 assert(!r); /* can not fail in silent mode */
                 peer_free(peer);
@@ -766,7 +1952,51 @@ void peer_registry_flush(PeerRegistry *registry) {
 Peer *peer_registry_find_peer(PeerRegistry *registry, uint64_t id) {
         Peer *peer;
 
-        peer = c_rbtree_find_entry(&registry->peer_tree, peer_compare, &id, Peer, registry_node);
+        if (!registry->table.n_entries)
+                return NULL;
+
+        peer = registry->table.buckets[peer_registry_probe(registry, id)];
 
         return peer && peer->registered ? peer : NULL;
 }
+
+/**
+ * peer_registry_collect_receiver() - add peer to receiver set
+ * @registry:           registry to operate on
+ * @peer:               peer to add
+ *
+ * This adds @peer to the receiver set of @registry, unless it is already part
+ * of it. The receiver set is used to deduplicate receivers of a single
+ * message, and must be cleared via peer_registry_clear_receivers() once the
+ * message was delivered.
+ *
+ * Return: True if @peer was added, false if it already was part of the set.
+ */
+bool peer_registry_collect_receiver(PeerRegistry *registry, Peer *peer) {
+        unsigned long *word = &registry->receiver_map[peer->slot / PEER_SLOT_BITS];
+        unsigned long mask = 1UL << (peer->slot % PEER_SLOT_BITS);
+
+        if (*word & mask)
+                return false;
+
+        *word |= mask;
+        registry->receivers[registry->n_receivers++] = peer;
+        return true;
+}
+
+/**
+ * peer_registry_clear_receivers() - clear receiver set
+ * @registry:           registry to operate on
+ *
+ * This removes all peers from the receiver set of @registry.
+ */
+void peer_registry_clear_receivers(PeerRegistry *registry) {
+        size_t i, slot;
+
+        for (i = 0; i < registry->n_receivers; ++i) {
+                slot = registry->receivers[i]->slot;
+                registry->receiver_map[slot / PEER_SLOT_BITS] &= ~(1UL << (slot % PEER_SLOT_BITS));
+        }
+
+        registry->n_receivers = 0;
+}
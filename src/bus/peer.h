@@ -4,6 +4,7 @@
  * Peers
  */
 
+#include <c-list.h>
 #include <c-macro.h>
 #include <c-rbtree.h>
 #include <stdlib.h>
@@ -13,12 +14,22 @@
 #include "bus/policy.h"
 #include "bus/reply.h"
 #include "dbus/connection.h"
+#include "dbus/message.h"
+#include "util/arena.h"
+#include "util/atom.h"
+#include "util/hashtable.h"
+#include "util/trace.h"
 
 typedef struct Bus Bus;
 typedef struct BusSELinuxID BusSELinuxID;
+typedef struct Capture Capture;
 typedef struct DispatchContext DispatchContext;
+typedef struct Listener Listener;
 typedef struct Peer Peer;
+typedef struct PeerDestination PeerDestination;
 typedef struct PeerRegistry PeerRegistry;
+typedef struct PeerStats PeerStats;
+typedef struct PeerVerdict PeerVerdict;
 typedef struct Socket Socket;
 typedef struct User User;
 
@@ -28,12 +39,14 @@ enum {
         PEER_E_QUOTA,
 
         PEER_E_CONNECTION_REFUSED,
+        PEER_E_ID_EXISTS,
 
         PEER_E_EOF,
         PEER_E_PROTOCOL_VIOLATION,
 
         PEER_E_SEND_DENIED,
         PEER_E_RECEIVE_DENIED,
+        PEER_E_FDS_REFUSED,
 
         PEER_E_NAME_RESERVED,
         PEER_E_NAME_UNIQUE,
@@ -51,61 +64,152 @@ enum {
         PEER_E_UNEXPECTED_REPLY,
 };
 
+#define PEER_VERDICTS_MAX (8)
+
+/* bus names are limited to 255 characters by the D-Bus specification */
+#define PEER_DESTINATION_LENGTH_MAX (255UL)
+
+/* size of the routing header of a peer; see struct Peer */
+#define PEER_HOT_SIZE (64UL)
+
+/* work done for a single peer per dispatch round, so a flood cannot starve others */
+#define PEER_DISPATCH_MESSAGES_MAX (64)
+#define PEER_DISPATCH_BYTES_MAX (256UL * 1024UL)
+
+#define PEER_POOL_MAX (64) /* one full accept batch, see LISTENER_BATCH_MAX */
+#define PEER_SLOTS_MIN (64UL) /* one word of the slot bitmaps on 64-bit machines */
+#define PEER_REGISTRY_BUCKETS_MIN (64UL) /* kept half full, so a small bus never grows it */
+#define PEER_BATCH_MAX (16) /* batches live on the stack; larger ones are split */
+
+#define PEER_SLOT_INVALID ((size_t)-1)
+
+#define PEER_SLOT_BITS (sizeof(unsigned long) * 8UL)
+
+struct PeerVerdict {
+        uint64_t generation;
+        uint64_t selinux_generation;
+        uint64_t sender_id;
+        Atom *interface;
+        Atom *member;
+        Atom *path;
+        unsigned int type;
+};
+
+#define PEER_VERDICT_NULL {}
+
+struct PeerStats {
+        uint64_t n_messages_in;
+        uint64_t n_bytes_in;
+        uint64_t n_messages_out;
+        uint64_t n_bytes_out;
+        uint64_t n_quota_denials;
+        uint64_t n_policy_denials;
+        uint64_t n_slow_consumer_drops;
+        uint64_t n_dispatch_nsec;
+};
+
+#define PEER_STATS_INIT {}
+
+struct PeerDestination {
+        uint64_t generation;
+        Peer *peer;
+        Name *name;
+        size_t n_name;
+        char name_str[PEER_DESTINATION_LENGTH_MAX + 1];
+};
+
+/*
+ * Peers are ordered by access pattern. Delivering a message to a receiver
+ * only needs its routing header, which fills the first cache line of a peer
+ * (peers are cache-line aligned), followed by its statistics and verdict
+ * cache, and its connection. Everything else is only touched when the peer
+ * acts as sender, or on setup and teardown, and goes last. See the layout
+ * assertions in peer.c.
+ */
 struct Peer {
+        alignas(PEER_HOT_SIZE) uint64_t id;
         Bus *bus;
-        User *user;
-        pid_t pid;
-        char *seclabel;
-        size_t n_seclabel;
+        PolicySnapshot *policy;
         BusSELinuxID *sid;
-        UserCharge charges[3];
-
-        uint64_t id;
-        CRBNode registry_node;
-
-        Connection connection;
+        NameOwner owned_names;
         bool registered : 1;
         bool monitor : 1;
+        bool coalesce_signals : 1;
+        size_t slot;
 
-        PolicySnapshot *policy;
-        NameOwner owned_names;
+        User *user;
+        PeerStats stats;
+        PeerVerdict verdicts[PEER_VERDICTS_MAX];
+        Connection connection;
+
+        PeerDestination destination;
+        MessageSender sender;
         MatchRegistry matches;
         MatchOwner owned_matches;
         ReplyRegistry replies_outgoing;
         ReplyOwner owned_replies;
+        Capture *capture;
 
-        uint64_t transaction_id;
+        pid_t pid;
+        char *seclabel;
+        size_t n_seclabel;
+        gid_t *gids;
+        size_t n_gids;
+        UserCharge charges[3];
+        Listener *listener;
+        CList listener_link;
+        Arena arena;
 };
 
 struct PeerRegistry {
-        CRBTree peer_tree;
         uint64_t ids;
+        HashTable table;
+
+        Peer **slots;
+        unsigned long *slot_map;
+        unsigned long *receiver_map;
+        Peer **receivers;
+        size_t n_receivers;
+        size_t n_slots;
 };
 
 #define PEER_REGISTRY_INIT {}
 
-int peer_new_with_fd(Peer **peerp, Bus *bus, PolicyRegistry *policy, const char guid[], DispatchContext *dispatcher, int fd);
+int peer_new_with_fd(Peer **peerp, Bus *bus, Listener *listener, const char guid[], DispatchContext *dispatcher, int fd);
+int peer_new_restored(Peer **peerp, Bus *bus, Listener *listener, DispatchContext *dispatcher, int fd, uint64_t id, bool checked);
 Peer *peer_free(Peer *peer);
 
 int peer_dispatch(DispatchFile *file);
 int peer_spawn(Peer *peer);
+int peer_refresh_policy(Peer *peer);
 
 void peer_register(Peer *peer);
 void peer_unregister(Peer *peer);
 
 bool peer_is_privileged(Peer *peer);
+size_t peer_get_memory(Peer *peer);
+
+Peer *peer_find_destination(Peer *peer, Name **namep, const char *destination);
 
 int peer_request_name(Peer *peer, const char *name, uint32_t flags, NameChange *change);
 int peer_release_name(Peer *peer, const char *name, NameChange *change);
 void peer_release_name_ownership(Peer *peer, NameOwnership *ownership, NameChange *change);
+int peer_release_all_names(Peer *peer, NameChange **changesp, size_t *n_changesp);
 
 int peer_add_match(Peer *peer, const char *rule_string);
+int peer_add_matches(Peer *peer, const char **rule_strings, size_t n_rule_strings);
 int peer_remove_match(Peer *peer, const char *rule_string);
 int peer_become_monitor(Peer *peer, MatchOwner *owner);
 void peer_flush_matches(Peer *peer);
 
+int peer_restore_reply(Peer *receiver, Peer *sender, uint32_t serial);
+
+int peer_admit_call(Peer *sender, Peer *receiver, Message *message);
 int peer_queue_call(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, ReplyOwner *sender_replies, User *sender_user, uint64_t sender_id, Peer *receiver, Message *message);
+int peer_queue_call_batch(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, ReplyOwner *sender_replies, User *sender_user, uint64_t sender_id, Peer *receiver, Message **messages, int *results, size_t n_messages);
 int peer_queue_reply(Peer *sender, const char *destination, uint32_t reply_serial, Message *message);
+bool peer_refuses_fds(Peer *receiver, Message *message);
+void peer_broadcast_filter_init(MatchFilter *filter, Bus *bus, uint64_t sender_id, Peer *destination, Message *message);
 int peer_broadcast(PolicySnapshot *sender_policy, NameSet *sender_names, MatchRegistry *sender_matches, uint64_t sender_id, Peer *destination, Bus *bus, MatchFilter *filter, Message *message);
 
 void peer_registry_init(PeerRegistry *registry);
@@ -113,6 +217,9 @@ void peer_registry_deinit(PeerRegistry *registry);
 void peer_registry_flush(PeerRegistry *registry);
 Peer *peer_registry_find_peer(PeerRegistry *registry, uint64_t id);
 
+bool peer_registry_collect_receiver(PeerRegistry *registry, Peer *peer);
+void peer_registry_clear_receivers(PeerRegistry *registry);
+
 static inline bool peer_is_registered(Peer *peer) {
         return peer->registered;
 }
@@ -122,3 +229,20 @@ static inline bool peer_is_monitor(Peer *peer) {
 }
 
 C_DEFINE_CLEANUP(Peer *, peer_free);
+
+/* inline helpers */
+
+/**
+ * peer_account_queued() - account message queued on peer
+ * @peer:               receiver of the message
+ * @message:            message that was queued
+ *
+ * This updates the statistics of @peer for a message that was successfully
+ * queued on its connection.
+ */
+static inline void peer_account_queued(Peer *peer, Message *message) {
+        TRACE_PROBE(message_queue, message->sender_id, message->metadata.header.serial, peer->id);
+
+        ++peer->stats.n_messages_out;
+        peer->stats.n_bytes_out += message->n_data;
+}
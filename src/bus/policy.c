@@ -6,11 +6,13 @@
 #include <c-list.h>
 #include <c-macro.h>
 #include <c-rbtree.h>
+#include <c-string.h>
 #include <stdlib.h>
 #include "bus/name.h"
 #include "bus/policy.h"
 #include "dbus/protocol.h"
 #include "util/error.h"
+#include "util/hash.h"
 #include "util/selinux.h"
 
 static PolicyXmit *policy_xmit_free(PolicyXmit *xmit) {
@@ -64,6 +66,45 @@ static int policy_xmit_new(PolicyXmit **xmitp,
         return 0;
 }
 
+static int policy_xmit_bucket_compare(CRBTree *t, void *k, CRBNode *n) {
+        PolicyXmitBucket *bucket = c_container_of(n, PolicyXmitBucket, tree_node);
+
+        return strcmp(k, bucket->interface);
+}
+
+static PolicyXmitBucket *policy_xmit_bucket_free(PolicyXmitBucket *bucket) {
+        PolicyXmit *xmit;
+
+        if (!bucket)
+                return NULL;
+
+        while ((xmit = c_list_first_entry(&bucket->xmit_list, PolicyXmit, batch_link)))
+                policy_xmit_free(xmit);
+
+        if (bucket->tree)
+                c_rbtree_remove_init(bucket->tree, &bucket->tree_node);
+        free(bucket);
+
+        return NULL;
+}
+
+C_DEFINE_CLEANUP(PolicyXmitBucket *, policy_xmit_bucket_free);
+
+static int policy_xmit_bucket_new(PolicyXmitBucket **bucketp, const char *interface) {
+        _c_cleanup_(policy_xmit_bucket_freep) PolicyXmitBucket *bucket = NULL;
+
+        bucket = calloc(1, sizeof(*bucket) + strlen(interface) + 1);
+        if (!bucket)
+                return error_origin(-ENOMEM);
+
+        *bucket = (PolicyXmitBucket)POLICY_XMIT_BUCKET_NULL(*bucket);
+        strcpy(bucket->interface, interface);
+
+        *bucketp = bucket;
+        bucket = NULL;
+        return 0;
+}
+
 static int policy_batch_name_compare(CRBTree *t, void *k, CRBNode *n) {
         PolicyBatchName *name = c_container_of(n, PolicyBatchName, batch_node);
 
@@ -71,16 +112,27 @@ static int policy_batch_name_compare(CRBTree *t, void *k, CRBNode *n) {
 }
 
 static PolicyBatchName *policy_batch_name_free(PolicyBatchName *name) {
+        PolicyXmitBucket *bucket, *t_bucket;
         PolicyXmit *xmit;
 
         if (!name)
                 return NULL;
 
+        c_rbtree_for_each_entry_unlink(bucket, t_bucket, &name->recv_tree, tree_node) {
+                bucket->tree = NULL;
+                policy_xmit_bucket_free(bucket);
+        }
+        c_rbtree_for_each_entry_unlink(bucket, t_bucket, &name->send_tree, tree_node) {
+                bucket->tree = NULL;
+                policy_xmit_bucket_free(bucket);
+        }
         while ((xmit = c_list_first_entry(&name->recv_unindexed, PolicyXmit, batch_link)))
                 policy_xmit_free(xmit);
         while ((xmit = c_list_first_entry(&name->send_unindexed, PolicyXmit, batch_link)))
                 policy_xmit_free(xmit);
 
+        if (name->batch->catchall == name)
+                name->batch->catchall = NULL;
         c_rbtree_remove_init(&name->batch->name_tree, &name->batch_node);
         free(name);
 
@@ -89,6 +141,58 @@ static PolicyBatchName *policy_batch_name_free(PolicyBatchName *name) {
 
 C_DEFINE_CLEANUP(PolicyBatchName *, policy_batch_name_free);
 
+static void policy_batch_name_link_xmit(CList *list, PolicyXmit *xmit) {
+        PolicyXmit *iter;
+
+        /*
+         * Keep the list sorted by descending priority. This way, lookups can
+         * stop at the first applicable entry, or as soon as no entry can beat
+         * the verdict found so far.
+         */
+        c_list_for_each_entry(iter, list, batch_link) {
+                if (xmit->verdict.priority > iter->verdict.priority) {
+                        c_list_link_before(&iter->batch_link, &xmit->batch_link);
+                        return;
+                }
+        }
+
+        c_list_link_tail(list, &xmit->batch_link);
+}
+
+static int policy_batch_name_add_xmit(PolicyBatchName *name, bool is_send, PolicyXmit *xmit) {
+        PolicyXmitBucket *bucket;
+        CRBNode *parent, **slot;
+        CRBTree *tree;
+        int r;
+
+        /*
+         * Entries with an interface are indexed by it, so lookups only ever
+         * look at entries that can possibly apply. Everything else is kept in
+         * the unindexed list, which is always searched.
+         */
+        if (!xmit->interface) {
+                policy_batch_name_link_xmit(is_send ? &name->send_unindexed : &name->recv_unindexed, xmit);
+                return 0;
+        }
+
+        tree = is_send ? &name->send_tree : &name->recv_tree;
+
+        slot = c_rbtree_find_slot(tree, policy_xmit_bucket_compare, xmit->interface, &parent);
+        if (slot) {
+                r = policy_xmit_bucket_new(&bucket, xmit->interface);
+                if (r)
+                        return error_trace(r);
+
+                bucket->tree = tree;
+                c_rbtree_add(tree, parent, slot, &bucket->tree_node);
+        } else {
+                bucket = c_container_of(parent, PolicyXmitBucket, tree_node);
+        }
+
+        policy_batch_name_link_xmit(&bucket->xmit_list, xmit);
+        return 0;
+}
+
 static int policy_batch_name_new(PolicyBatchName **namep, PolicyBatch *batch, const char *name_str) {
         _c_cleanup_(policy_batch_name_freep) PolicyBatchName *name = NULL;
 
@@ -98,6 +202,7 @@ static int policy_batch_name_new(PolicyBatchName **namep, PolicyBatch *batch, co
 
         *name = (PolicyBatchName)POLICY_BATCH_NAME_NULL(*name);
         name->batch = batch;
+        name->hash = hash_string(name_str);
         strcpy(name->name, name_str);
 
         *namep = name;
@@ -122,23 +227,57 @@ int policy_batch_new(PolicyBatch **batchp) {
         return 0;
 }
 
+static void policy_batch_pool_remove(PolicyBatchPool *pool, PolicyBatch *batch);
+
 /* internal callback for policy_batch_unref() */
 void policy_batch_free(_Atomic unsigned long *n_refs, void *userdata) {
         PolicyBatch *batch = c_container_of(n_refs, PolicyBatch, n_refs);
         PolicyBatchName *name, *t_name;
 
+        if (batch->pool)
+                policy_batch_pool_remove(batch->pool, batch);
+
         c_rbtree_for_each_entry_unlink(name, t_name, &batch->name_tree, batch_node)
                 policy_batch_name_free(name);
 
+        hash_table_deinit(&batch->table);
         free(batch);
 }
 
+/*
+ * Batches are never modified once they were imported, so apart from the tree,
+ * which keeps them ordered, names are indexed in an insert-only hash table.
+ * Lookups can be done on any prefix of a string, so the own-prefix checks can
+ * walk the components of a name without restarting from the root for each of
+ * them.
+ */
+
+static uint64_t policy_batch_name_hash(void *entry) {
+        PolicyBatchName *name = entry;
+
+        return name->hash;
+}
+
+static size_t policy_batch_probe(PolicyBatch *batch, const char *name_str, size_t n_name, uint64_t hash) {
+        PolicyBatchName *name;
+        size_t i;
+
+        hash_table_for_each_probe(name, i, &batch->table, hash)
+                if (name->hash == hash && !strncmp(name->name, name_str, n_name) && !name->name[n_name])
+                        break;
+
+        return i;
+}
+
+static PolicyBatchName *policy_batch_find_prefix(PolicyBatch *batch, const char *name_str, size_t n_name, uint64_t hash) {
+        if (!batch->table.n_entries)
+                return NULL;
+
+        return batch->table.buckets[policy_batch_probe(batch, name_str, n_name, hash)];
+}
+
 static PolicyBatchName *policy_batch_find_name(PolicyBatch *batch, const char *name_str) {
-        return c_rbtree_find_entry(&batch->name_tree,
-                                   policy_batch_name_compare,
-                                   name_str,
-                                   PolicyBatchName,
-                                   batch_node);
+        return policy_batch_find_prefix(batch, name_str, strlen(name_str), hash_string(name_str));
 }
 
 static int policy_batch_at_name(PolicyBatch *batch, PolicyBatchName **namep, const char *name_str) {
@@ -146,15 +285,25 @@ static int policy_batch_at_name(PolicyBatch *batch, PolicyBatchName **namep, con
         PolicyBatchName *name;
         int r;
 
-        slot = c_rbtree_find_slot(&batch->name_tree, policy_batch_name_compare, name_str, &parent);
-        if (slot) {
+        name = policy_batch_find_name(batch, name_str);
+        if (!name) {
+                r = hash_table_reserve(&batch->table, policy_batch_name_hash, POLICY_BATCH_BUCKETS_MIN);
+                if (r)
+                        return error_trace(r);
+
+                slot = c_rbtree_find_slot(&batch->name_tree, policy_batch_name_compare, name_str, &parent);
+                assert(slot);
+
                 r = policy_batch_name_new(&name, batch, name_str);
                 if (r)
                         return error_trace(r);
 
-                c_rbtree_add(&name->batch->name_tree, parent, slot, &name->batch_node);
-        } else {
-                name = c_container_of(parent, PolicyBatchName, batch_node);
+                c_rbtree_add(&batch->name_tree, parent, slot, &name->batch_node);
+                hash_table_insert(&batch->table, policy_batch_probe(batch, name->name, strlen(name->name), name->hash), name);
+
+                /* the empty name is the catch-all, which is always checked */
+                if (!*name_str)
+                        batch->catchall = name;
         }
 
         *namep = name;
@@ -222,7 +371,10 @@ static int policy_batch_add_send(PolicyBatch *batch,
         if (r)
                 return error_trace(r);
 
-        c_list_link_tail(&name->send_unindexed, &xmit->batch_link);
+        r = policy_batch_name_add_xmit(name, true, xmit);
+        if (r)
+                return error_trace(r);
+
         xmit = NULL;
         return 0;
 }
@@ -248,11 +400,219 @@ static int policy_batch_add_recv(PolicyBatch *batch,
         if (r)
                 return error_trace(r);
 
-        c_list_link_tail(&name->recv_unindexed, &xmit->batch_link);
+        r = policy_batch_name_add_xmit(name, false, xmit);
+        if (r)
+                return error_trace(r);
+
         xmit = NULL;
         return 0;
 }
 
+/*
+ * Batches with identical contents are shared via a batch pool, rather than
+ * kept once per registry, uid, or gid. Many users usually get the same
+ * policy, and all buses of a broker usually load the same configuration, so
+ * this saves most of the memory spent on policies. Only imported batches are
+ * ever pooled, since they are never modified afterwards. The pool does not
+ * own its batches, they remove themselves when they are freed.
+ */
+
+static uint64_t policy_digest_u64(uint64_t digest, uint64_t v) {
+        return hash_u64(digest ^ v) + UINT64_C(0x9e3779b97f4a7c15);
+}
+
+static uint64_t policy_digest_string(uint64_t digest, const char *s) {
+        return policy_digest_u64(digest, s ? hash_string(s) : 0);
+}
+
+static uint64_t policy_digest_verdict(uint64_t digest, PolicyVerdict verdict) {
+        digest = policy_digest_u64(digest, verdict.verdict);
+        return policy_digest_u64(digest, verdict.priority);
+}
+
+static uint64_t policy_digest_xmit_list(uint64_t digest, CList *list) {
+        PolicyXmit *xmit;
+
+        c_list_for_each_entry(xmit, list, batch_link) {
+                digest = policy_digest_verdict(digest, xmit->verdict);
+                digest = policy_digest_u64(digest, xmit->type);
+                digest = policy_digest_string(digest, xmit->path);
+                digest = policy_digest_string(digest, xmit->interface);
+                digest = policy_digest_string(digest, xmit->member);
+        }
+
+        return policy_digest_u64(digest, 0);
+}
+
+static uint64_t policy_digest_xmit_tree(uint64_t digest, CRBTree *tree) {
+        PolicyXmitBucket *bucket;
+
+        c_rbtree_for_each_entry(bucket, tree, tree_node) {
+                digest = policy_digest_string(digest, bucket->interface);
+                digest = policy_digest_xmit_list(digest, &bucket->xmit_list);
+        }
+
+        return policy_digest_u64(digest, 0);
+}
+
+static uint64_t policy_batch_get_digest(PolicyBatch *batch) {
+        PolicyBatchName *name;
+        uint64_t digest;
+
+        digest = policy_digest_verdict(0, batch->connect_verdict);
+
+        c_rbtree_for_each_entry(name, &batch->name_tree, batch_node) {
+                digest = policy_digest_u64(digest, name->hash);
+                digest = policy_digest_verdict(digest, name->own_verdict);
+                digest = policy_digest_verdict(digest, name->own_prefix_verdict);
+                digest = policy_digest_xmit_tree(digest, &name->send_tree);
+                digest = policy_digest_xmit_tree(digest, &name->recv_tree);
+                digest = policy_digest_xmit_list(digest, &name->send_unindexed);
+                digest = policy_digest_xmit_list(digest, &name->recv_unindexed);
+        }
+
+        return digest;
+}
+
+static bool policy_verdict_equal(PolicyVerdict a, PolicyVerdict b) {
+        return a.verdict == b.verdict && a.priority == b.priority;
+}
+
+static bool policy_xmit_list_equal(CList *a, CList *b) {
+        PolicyXmit *x, *y;
+        CList *i, *j;
+
+        for (i = a->next, j = b->next; i != a && j != b; i = i->next, j = j->next) {
+                x = c_list_entry(i, PolicyXmit, batch_link);
+                y = c_list_entry(j, PolicyXmit, batch_link);
+
+                if (!policy_verdict_equal(x->verdict, y->verdict) ||
+                    x->type != y->type ||
+                    !c_string_equal(x->path, y->path) ||
+                    !c_string_equal(x->interface, y->interface) ||
+                    !c_string_equal(x->member, y->member))
+                        return false;
+        }
+
+        return i == a && j == b;
+}
+
+static bool policy_xmit_tree_equal(CRBTree *a, CRBTree *b) {
+        PolicyXmitBucket *x, *y;
+        CRBNode *i, *j;
+
+        for (i = c_rbtree_first(a), j = c_rbtree_first(b); i && j; i = c_rbnode_next(i), j = c_rbnode_next(j)) {
+                x = c_container_of(i, PolicyXmitBucket, tree_node);
+                y = c_container_of(j, PolicyXmitBucket, tree_node);
+
+                if (strcmp(x->interface, y->interface) ||
+                    !policy_xmit_list_equal(&x->xmit_list, &y->xmit_list))
+                        return false;
+        }
+
+        return !i && !j;
+}
+
+static bool policy_batch_equal(PolicyBatch *a, PolicyBatch *b) {
+        PolicyBatchName *x, *y;
+        CRBNode *i, *j;
+
+        if (!policy_verdict_equal(a->connect_verdict, b->connect_verdict) ||
+            a->table.n_entries != b->table.n_entries)
+                return false;
+
+        for (i = c_rbtree_first(&a->name_tree), j = c_rbtree_first(&b->name_tree); i && j; i = c_rbnode_next(i), j = c_rbnode_next(j)) {
+                x = c_container_of(i, PolicyBatchName, batch_node);
+                y = c_container_of(j, PolicyBatchName, batch_node);
+
+                if (x->hash != y->hash ||
+                    strcmp(x->name, y->name) ||
+                    !policy_verdict_equal(x->own_verdict, y->own_verdict) ||
+                    !policy_verdict_equal(x->own_prefix_verdict, y->own_prefix_verdict) ||
+                    !policy_xmit_tree_equal(&x->send_tree, &y->send_tree) ||
+                    !policy_xmit_tree_equal(&x->recv_tree, &y->recv_tree) ||
+                    !policy_xmit_list_equal(&x->send_unindexed, &y->send_unindexed) ||
+                    !policy_xmit_list_equal(&x->recv_unindexed, &y->recv_unindexed))
+                        return false;
+        }
+
+        return !i && !j;
+}
+
+static uint64_t policy_batch_pool_hash(void *entry) {
+        PolicyBatch *batch = entry;
+
+        return batch->digest;
+}
+
+static void policy_batch_pool_remove(PolicyBatchPool *pool, PolicyBatch *batch) {
+        PolicyBatch *iter;
+        size_t i;
+
+        hash_table_for_each_probe(iter, i, &pool->table, batch->digest)
+                if (iter == batch)
+                        break;
+
+        assert(pool->table.buckets[i] == batch);
+        hash_table_remove(&pool->table, i, policy_batch_pool_hash, POLICY_BATCH_POOL_BUCKETS_MIN);
+        batch->pool = NULL;
+}
+
+/**
+ * policy_batch_pool_deinit() - deinitialize a batch pool
+ * @pool:               pool to operate on
+ *
+ * This releases all resources of @pool. Batches still alive are detached
+ * from the pool, and are just no longer shared with batches imported later.
+ */
+void policy_batch_pool_deinit(PolicyBatchPool *pool) {
+        PolicyBatch *batch;
+        size_t i;
+
+        for (i = 0; i < pool->table.n_buckets; ++i) {
+                batch = pool->table.buckets[i];
+                if (batch)
+                        batch->pool = NULL;
+        }
+
+        hash_table_deinit(&pool->table);
+}
+
+static int policy_batch_pool_intern(PolicyBatchPool *pool, PolicyBatch **batchp) {
+        PolicyBatch *batch = *batchp, *iter;
+        uint64_t digest;
+        size_t i;
+        int r;
+
+        if (batch->pool)
+                return 0;
+
+        digest = policy_batch_get_digest(batch);
+
+        if (pool->table.n_entries) {
+                hash_table_for_each_probe(iter, i, &pool->table, digest) {
+                        if (iter->digest == digest && policy_batch_equal(iter, batch)) {
+                                *batchp = policy_batch_ref(iter);
+                                policy_batch_unref(batch);
+                                return 0;
+                        }
+                }
+        }
+
+        r = hash_table_reserve(&pool->table, policy_batch_pool_hash, POLICY_BATCH_POOL_BUCKETS_MIN);
+        if (r)
+                return error_trace(r);
+
+        batch->pool = pool;
+        batch->digest = digest;
+
+        hash_table_for_each_probe(iter, i, &pool->table, digest)
+                ;
+
+        hash_table_insert(&pool->table, i, batch);
+        return 0;
+}
+
 static int policy_registry_node_compare(CRBTree *t, void *k, CRBNode *n) {
         PolicyRegistryNode *node = c_container_of(n, PolicyRegistryNode, registry_node);
         uint32_t uidgid = (uint32_t)(unsigned long)k;
@@ -330,10 +690,15 @@ int policy_registry_new(PolicyRegistry **registryp, BusSELinuxID *fallback_id) {
  */
 PolicyRegistry *policy_registry_free(PolicyRegistry *registry) {
         PolicyRegistryNode *node, *t_node;
+        PolicySnapshot *snapshot, *t_snapshot;
 
         if (!registry)
                 return NULL;
 
+        /* snapshots may outlive the registry, they just cannot be shared anymore */
+        c_rbtree_for_each_entry_unlink(snapshot, t_snapshot, &registry->snapshot_tree, registry_node)
+                snapshot->registry = NULL;
+
         c_rbtree_for_each_entry_unlink(node, t_node, &registry->gid_tree, registry_node)
                 policy_registry_node_free(node);
         c_rbtree_for_each_entry_unlink(node, t_node, &registry->uid_tree, registry_node)
@@ -476,21 +841,11 @@ static int policy_registry_import_batch(PolicyRegistry *registry,
         return 0;
 }
 
-/**
- * policy_registry_import() - XXX
- */
-int policy_registry_import(PolicyRegistry *registry, CDVar *v) {
+static int policy_registry_import_uidgid(PolicyRegistry *registry, CDVar *v) {
         PolicyRegistryNode *node;
         uint32_t uidgid;
         int r;
 
-        /* XXX: provide the type */
-        c_dvar_read(v, "<(", NULL);
-
-        r = policy_registry_import_batch(registry, registry->default_batch, v);
-        if (r)
-                return error_trace(r);
-
         c_dvar_read(v, "[");
 
         while (c_dvar_more(v)) {
@@ -523,7 +878,29 @@ int policy_registry_import(PolicyRegistry *registry, CDVar *v) {
                 c_dvar_read(v, ")");
         }
 
-        c_dvar_read(v, "][");
+        c_dvar_read(v, "]");
+
+        return 0;
+}
+
+/**
+ * policy_registry_import() - XXX
+ */
+int policy_registry_import(PolicyRegistry *registry, CDVar *v) {
+        int r;
+
+        /* XXX: provide the type */
+        c_dvar_read(v, "<(", NULL);
+
+        r = policy_registry_import_batch(registry, registry->default_batch, v);
+        if (r)
+                return error_trace(r);
+
+        r = policy_registry_import_uidgid(registry, v);
+        if (r)
+                return error_trace(r);
+
+        c_dvar_read(v, "[");
 
         while (c_dvar_more(v)) {
                 const char *name, *context;
@@ -545,7 +922,120 @@ int policy_registry_import(PolicyRegistry *registry, CDVar *v) {
 }
 
 /**
- * policy_snapshot_new() - XXX
+ * policy_registry_import_nodes() - import part of the uid and gid policies
+ * @registry:           registry to operate on
+ * @v:                  variant to read from
+ *
+ * This imports uid and gid entries into @registry, in the same format as
+ * they are carried by policy_registry_import(), but without the default
+ * batch and the SELinux names. This allows large policies to be transferred
+ * in several parts, which are then completed by a final call to
+ * policy_registry_import() on the same registry.
+ *
+ * Return: 0 on success, POLICY_E_INVALID if the variant was invalid, negative
+ *         error code on failure.
+ */
+int policy_registry_import_nodes(PolicyRegistry *registry, CDVar *v) {
+        int r;
+
+        c_dvar_read(v, "<(", NULL);
+
+        r = policy_registry_import_uidgid(registry, v);
+        if (r)
+                return error_trace(r);
+
+        c_dvar_read(v, ")>");
+
+        r = c_dvar_get_poison(v);
+        if (r)
+                return POLICY_E_INVALID;
+
+        return 0;
+}
+
+/**
+ * policy_registry_share() - share the batches of a registry via a pool
+ * @registry:           registry to operate on
+ * @pool:               pool to share the batches via
+ *
+ * This replaces each batch of @registry by an identical batch of @pool, if
+ * there is one, and adds it to @pool otherwise. This must be called once the
+ * import of @registry is complete, since pooled batches must never be
+ * modified. Snapshots are keyed by their batches, so this must also be called
+ * before the first snapshot of @registry is taken.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int policy_registry_share(PolicyRegistry *registry, PolicyBatchPool *pool) {
+        PolicyRegistryNode *node;
+        int r;
+
+        assert(c_rbtree_is_empty(&registry->snapshot_tree));
+
+        r = policy_batch_pool_intern(pool, &registry->default_batch);
+        if (r)
+                return error_trace(r);
+
+        c_rbtree_for_each_entry(node, &registry->uid_tree, registry_node) {
+                r = policy_batch_pool_intern(pool, &node->batch);
+                if (r)
+                        return error_trace(r);
+        }
+
+        c_rbtree_for_each_entry(node, &registry->gid_tree, registry_node) {
+                r = policy_batch_pool_intern(pool, &node->batch);
+                if (r)
+                        return error_trace(r);
+        }
+
+        return 0;
+}
+
+typedef struct PolicySnapshotKey {
+        BusSELinuxID *sid;
+        size_t n_batches;
+        PolicyBatch **batches;
+} PolicySnapshotKey;
+
+static int policy_snapshot_compare(CRBTree *tree, void *k, CRBNode *rb) {
+        PolicySnapshot *snapshot = c_container_of(rb, PolicySnapshot, registry_node);
+        PolicySnapshotKey *key = k;
+        size_t i;
+
+        if (key->sid < snapshot->sid)
+                return -1;
+        if (key->sid > snapshot->sid)
+                return 1;
+        if (key->n_batches < snapshot->n_batches)
+                return -1;
+        if (key->n_batches > snapshot->n_batches)
+                return 1;
+
+        for (i = 0; i < key->n_batches; ++i) {
+                if (key->batches[i] < snapshot->batches[i])
+                        return -1;
+                if (key->batches[i] > snapshot->batches[i])
+                        return 1;
+        }
+
+        return 0;
+}
+
+/**
+ * policy_snapshot_new() - get policy snapshot for a set of credentials
+ * @snapshotp:          output pointer to snapshot
+ * @registry:           registry to take the snapshot of
+ * @sid:                SELinux ID of the peer
+ * @uid:                UID of the peer
+ * @gids:               auxiliary GIDs of the peer
+ * @n_gids:             number of GIDs in @gids
+ *
+ * This returns a reference to a snapshot of the policy in @registry, that
+ * applies to a peer with the given credentials. Snapshots are immutable, so
+ * all peers whose credentials resolve to the same set of policy batches share
+ * a single snapshot, which is cached in @registry.
+ *
+ * Return: 0 on success, negative error code on failure.
  */
 int policy_snapshot_new(PolicySnapshot **snapshotp,
                         PolicyRegistry *registry,
@@ -553,74 +1043,79 @@ int policy_snapshot_new(PolicySnapshot **snapshotp,
                         uint32_t uid,
                         const uint32_t *gids,
                         size_t n_gids) {
-        _c_cleanup_(policy_snapshot_freep) PolicySnapshot *snapshot = NULL;
+        _c_cleanup_(policy_snapshot_unrefp) PolicySnapshot *snapshot = NULL;
+        _c_cleanup_(c_freep) PolicyBatch **batches_heap = NULL;
+        PolicyBatch *batches_stack[POLICY_SNAPSHOT_BATCHES_STACK];
+        PolicySnapshotKey key = { .sid = sid };
         PolicyRegistryNode *node;
+        CRBNode **slot, *parent;
+        size_t i;
 
-        snapshot = calloc(1, sizeof(*snapshot) + (n_gids + 1) * sizeof(*snapshot->batches));
-        if (!snapshot)
-                return error_origin(-ENOMEM);
+        /*
+         * Resolve the batches that apply to the credentials first. If a
+         * snapshot of exactly those batches exists, share it. Otherwise,
+         * create a new one and cache it.
+         */
 
-        *snapshot = (PolicySnapshot)POLICY_SNAPSHOT_NULL;
+        if (n_gids + 1 <= C_ARRAY_SIZE(batches_stack)) {
+                key.batches = batches_stack;
+        } else {
+                batches_heap = calloc(n_gids + 1, sizeof(*batches_heap));
+                if (!batches_heap)
+                        return error_origin(-ENOMEM);
 
-        snapshot->selinux = bus_selinux_registry_ref(registry->selinux);
-        snapshot->sid = sid;
+                key.batches = batches_heap;
+        }
 
         node = policy_registry_find_uid(registry, uid);
         if (node)
-                snapshot->batches[0] = policy_batch_ref(node->batch);
+                key.batches[key.n_batches++] = node->batch;
         else
-                snapshot->batches[0] = policy_batch_ref(registry->default_batch);
-
-        ++snapshot->n_batches;
+                key.batches[key.n_batches++] = registry->default_batch;
 
         while (n_gids-- > 0) {
                 node = policy_registry_find_gid(registry, gids[n_gids]);
                 if (node)
-                        snapshot->batches[snapshot->n_batches++] = policy_batch_ref(node->batch);
+                        key.batches[key.n_batches++] = node->batch;
         }
 
-        *snapshotp = snapshot;
-        snapshot = NULL;
-        return 0;
-}
+        slot = c_rbtree_find_slot(&registry->snapshot_tree, policy_snapshot_compare, &key, &parent);
+        if (!slot) {
+                *snapshotp = policy_snapshot_ref(c_container_of(parent, PolicySnapshot, registry_node));
+                return 0;
+        }
 
-/**
- * policy_snapshot_free() - XXX
- */
-PolicySnapshot *policy_snapshot_free(PolicySnapshot *snapshot) {
+        snapshot = calloc(1, sizeof(*snapshot) + key.n_batches * sizeof(*snapshot->batches));
         if (!snapshot)
-                return NULL;
+                return error_origin(-ENOMEM);
 
-        while (snapshot->n_batches-- > 0)
-                policy_batch_unref(snapshot->batches[snapshot->n_batches]);
-        bus_selinux_registry_unref(snapshot->selinux);
-        free(snapshot);
+        *snapshot = (PolicySnapshot)POLICY_SNAPSHOT_NULL(*snapshot);
 
-        return NULL;
-}
+        snapshot->selinux = bus_selinux_registry_ref(registry->selinux);
+        snapshot->sid = sid;
 
-/**
- * policy_snapshot_dup() - XXX
- */
-int policy_snapshot_dup(PolicySnapshot *snapshot, PolicySnapshot **newp) {
-        _c_cleanup_(policy_snapshot_freep) PolicySnapshot *new = NULL;
-        size_t i;
+        for (i = 0; i < key.n_batches; ++i)
+                snapshot->batches[snapshot->n_batches++] = policy_batch_ref(key.batches[i]);
 
-        new = calloc(1, sizeof(*new) + snapshot->n_batches * sizeof(*new->batches));
-        if (!new)
-                return error_origin(-ENOMEM);
+        snapshot->registry = registry;
+        c_rbtree_add(&registry->snapshot_tree, parent, slot, &snapshot->registry_node);
 
-        *new = (PolicySnapshot)POLICY_SNAPSHOT_NULL;
+        *snapshotp = snapshot;
+        snapshot = NULL;
+        return 0;
+}
 
-        new->selinux = bus_selinux_registry_ref(snapshot->selinux);
-        new->sid = snapshot->sid;
+/* internal callback for policy_snapshot_unref() */
+void policy_snapshot_free(_Atomic unsigned long *n_refs, void *userdata) {
+        PolicySnapshot *snapshot = c_container_of(n_refs, PolicySnapshot, n_refs);
 
-        for (i = 0; i < snapshot->n_batches; ++i)
-                new->batches[new->n_batches++] = policy_batch_ref(snapshot->batches[i]);
+        if (snapshot->registry)
+                c_rbtree_remove_init(&snapshot->registry->snapshot_tree, &snapshot->registry_node);
 
-        *newp = new;
-        new = NULL;
-        return 0;
+        while (snapshot->n_batches-- > 0)
+                policy_batch_unref(snapshot->batches[snapshot->n_batches]);
+        bus_selinux_registry_unref(snapshot->selinux);
+        free(snapshot);
 }
 
 /**
@@ -643,10 +1138,10 @@ int policy_snapshot_check_connect(PolicySnapshot *snapshot) {
 int policy_snapshot_check_own(PolicySnapshot *snapshot, const char *name_str) {
         PolicyVerdict verdict = POLICY_VERDICT_INIT;
         PolicyBatchName *name;
-        const char *end;
-        CRBNode *rb;
+        const char *start, *end;
+        uint64_t state, hash;
         size_t i;
-        int v, r;
+        int r;
 
         r = bus_selinux_check_own(snapshot->selinux, snapshot->sid, name_str);
         if (r) {
@@ -656,64 +1151,48 @@ int policy_snapshot_check_own(PolicySnapshot *snapshot, const char *name_str) {
                 return error_fold(r);
         }
 
-        for (i = 0; i < snapshot->n_batches; ++i) {
-                /*
-                 * Iterate all prefixes of @name_str, including the empty
-                 * prefix and the full string.
-                 */
-                for (end = name_str;
-                     ;
-                     end = strchrnul(end + 1, '.')) {
-                        rb = snapshot->batches[i]->name_tree.root;
-                        while (rb) {
-                                name = c_container_of(rb, PolicyBatchName, batch_node);
-                                v = strncmp(name_str, name->name, end - name_str);
-                                if (v < 0)
-                                        rb = rb->left;
-                                else if (v > 0)
-                                        rb = rb->right;
-                                else if (name->name[end - name_str])
-                                        rb = rb->left;
-                                else
-                                        break;
-                        }
-
-                        if (rb) {
+        /*
+         * Iterate all prefixes of @name_str, including the empty prefix and
+         * the full string. The hash of each prefix is computed incrementally
+         * from the previous one, so the lookups are independent of the number
+         * of names in the batches, as well as of the number of prefixes.
+         */
+        state = HASH_STRING_INIT;
+        for (start = end = name_str;
+             ;
+             start = end, end = strchrnul(end + 1, '.')) {
+                state = hash_string_feed(state, start, end - start);
+                hash = hash_string_finalize(state);
+
+                for (i = 0; i < snapshot->n_batches; ++i) {
+                        name = policy_batch_find_prefix(snapshot->batches[i], name_str, end - name_str, hash);
+                        if (name) {
                                 if (verdict.priority < name->own_verdict.priority)
                                         verdict = name->own_verdict;
                                 if (verdict.priority < name->own_prefix_verdict.priority)
                                         verdict = name->own_prefix_verdict;
                         }
-
-                        if (!*end)
-                                break;
                 }
+
+                if (!*end)
+                        break;
         }
 
         return verdict.verdict ? 0 : POLICY_E_ACCESS_DENIED;
 }
 
-static void policy_snapshot_check_xmit_name(PolicyBatch *batch,
-                                            bool is_send,
-                                            PolicyVerdict *verdict,
-                                            const char *name_str,
-                                            const char *interface,
-                                            const char *member,
-                                            const char *path,
-                                            unsigned int type) {
-        PolicyBatchName *name;
+static void policy_xmit_list_check(CList *list,
+                                   PolicyVerdict *verdict,
+                                   const char *interface,
+                                   const char *member,
+                                   const char *path,
+                                   unsigned int type) {
         PolicyXmit *xmit;
-        CList *list;
-
-        name = policy_batch_find_name(batch, name_str);
-        if (!name)
-                return;
-
-        list = is_send ? &name->send_unindexed : &name->recv_unindexed;
 
         c_list_for_each_entry(xmit, list, batch_link) {
+                /* sorted by priority, nothing left that could win */
                 if (verdict->priority >= xmit->verdict.priority)
-                        continue;
+                        break;
 
                 if (xmit->type)
                         if (type != xmit->type)
@@ -731,10 +1210,56 @@ static void policy_snapshot_check_xmit_name(PolicyBatch *batch,
                         if (!member || strcmp(member, xmit->member))
                                 continue;
 
+                /* sorted by priority, the first applicable entry wins */
                 *verdict = xmit->verdict;
+                break;
         }
 }
 
+static void policy_batch_name_check_xmit(PolicyBatchName *name,
+                                         bool is_send,
+                                         PolicyVerdict *verdict,
+                                         const char *interface,
+                                         const char *member,
+                                         const char *path,
+                                         unsigned int type) {
+        PolicyXmitBucket *bucket;
+
+        if (interface) {
+                bucket = c_rbtree_find_entry(is_send ? &name->send_tree : &name->recv_tree,
+                                             policy_xmit_bucket_compare,
+                                             interface,
+                                             PolicyXmitBucket,
+                                             tree_node);
+                if (bucket)
+                        policy_xmit_list_check(&bucket->xmit_list, verdict, interface, member, path, type);
+        }
+
+        policy_xmit_list_check(is_send ? &name->send_unindexed : &name->recv_unindexed,
+                               verdict,
+                               interface,
+                               member,
+                               path,
+                               type);
+}
+
+static void policy_snapshot_check_xmit_name(PolicyBatch *batch,
+                                            bool is_send,
+                                            PolicyVerdict *verdict,
+                                            const char *name_str,
+                                            const char *interface,
+                                            const char *member,
+                                            const char *path,
+                                            unsigned int type) {
+        PolicyBatchName *name;
+
+        name = policy_batch_find_name(batch, name_str);
+        if (!name)
+                return;
+
+        policy_batch_name_check_xmit(name, is_send, verdict, interface, member, path, type);
+}
+
 static void policy_snapshot_check_xmit(PolicyBatch *batch,
                                        bool is_send,
                                        PolicyVerdict *verdict,
@@ -748,20 +1273,17 @@ static void policy_snapshot_check_xmit(PolicyBatch *batch,
 
         /*
          * The empty name is a catch-all entry. Always check it for every
-         * policy decision.
-         *
-         * XXX: Maybe we should cache the pointer to the catch-all entry, since
-         *      doing the lookup on all messages seems rather expensive just
-         *      for the sake of simplicity.
+         * policy decision. Its entry is cached on the batch, so no lookup is
+         * needed.
          */
-        policy_snapshot_check_xmit_name(batch,
-                                        is_send,
-                                        verdict,
-                                        "",
-                                        interface,
-                                        method,
-                                        path,
-                                        type);
+        if (batch->catchall)
+                policy_batch_name_check_xmit(batch->catchall,
+                                             is_send,
+                                             verdict,
+                                             interface,
+                                             method,
+                                             path,
+                                             type);
 
         if (!nameset) {
                 /*
@@ -11,17 +11,24 @@
 #include <c-ref.h>
 #include <stdlib.h>
 #include "dbus/protocol.h"
+#include "util/hashtable.h"
 
 typedef struct BusSELinuxID BusSELinuxID;
 typedef struct BusSELinuxRegistry BusSELinuxRegistry;
 typedef struct NameSet NameSet;
 typedef struct PolicyBatch PolicyBatch;
 typedef struct PolicyBatchName PolicyBatchName;
+typedef struct PolicyBatchPool PolicyBatchPool;
 typedef struct PolicyRegistry PolicyRegistry;
 typedef struct PolicyRegistryNode PolicyRegistryNode;
 typedef struct PolicySnapshot PolicySnapshot;
 typedef struct PolicyVerdict PolicyVerdict;
 typedef struct PolicyXmit PolicyXmit;
+typedef struct PolicyXmitBucket PolicyXmitBucket;
+
+#define POLICY_BATCH_BUCKETS_MIN (16UL) /* most batches name just a few services */
+#define POLICY_BATCH_POOL_BUCKETS_MIN (16UL) /* policies have a default and a few uid and gid batches */
+#define POLICY_SNAPSHOT_BATCHES_STACK (32UL) /* uid plus groups of all but unusual users */
 
 enum {
         _POLICY_E_SUCCESS,
@@ -53,11 +60,26 @@ struct PolicyXmit {
                 .type = DBUS_MESSAGE_TYPE_INVALID,                              \
         }
 
+struct PolicyXmitBucket {
+        CRBTree *tree;
+        CRBNode tree_node;
+        CList xmit_list;
+        char interface[];
+};
+
+#define POLICY_XMIT_BUCKET_NULL(_x) {                                           \
+                .tree_node = C_RBNODE_INIT((_x).tree_node),                     \
+                .xmit_list = C_LIST_INIT((_x).xmit_list),                       \
+        }
+
 struct PolicyBatchName {
         PolicyBatch *batch;
         CRBNode batch_node;
+        uint64_t hash;
         PolicyVerdict own_verdict;
         PolicyVerdict own_prefix_verdict;
+        CRBTree send_tree;
+        CRBTree recv_tree;
         CList send_unindexed;
         CList recv_unindexed;
         char name[];
@@ -67,14 +89,20 @@ struct PolicyBatchName {
                 .batch_node = C_RBNODE_INIT((_x).batch_node),                   \
                 .own_verdict = POLICY_VERDICT_INIT,                             \
                 .own_prefix_verdict = POLICY_VERDICT_INIT,                      \
+                .send_tree = C_RBTREE_INIT,                                     \
+                .recv_tree = C_RBTREE_INIT,                                     \
                 .send_unindexed = C_LIST_INIT((_x).send_unindexed),             \
                 .recv_unindexed = C_LIST_INIT((_x).recv_unindexed),             \
         }
 
 struct PolicyBatch {
         _Atomic unsigned long n_refs;
+        PolicyBatchPool *pool;
+        uint64_t digest;
         PolicyVerdict connect_verdict;
+        PolicyBatchName *catchall;
         CRBTree name_tree;
+        HashTable table;
 };
 
 #define POLICY_BATCH_NULL(_x) {                                                 \
@@ -83,6 +111,12 @@ struct PolicyBatch {
                 .name_tree = C_RBTREE_INIT,                                     \
         }
 
+struct PolicyBatchPool {
+        HashTable table;
+};
+
+#define POLICY_BATCH_POOL_INIT {}
+
 struct PolicyRegistryNode {
         uint32_t uidgid;
         CRBTree *registry_tree;
@@ -99,33 +133,47 @@ struct PolicyRegistry {
         PolicyBatch *default_batch;
         CRBTree uid_tree;
         CRBTree gid_tree;
+        CRBTree snapshot_tree;
 };
 
 #define POLICY_REGISTRY_NULL {                                                  \
                 .uid_tree = C_RBTREE_INIT,                                      \
                 .gid_tree = C_RBTREE_INIT,                                      \
+                .snapshot_tree = C_RBTREE_INIT,                                 \
         }
 
 struct PolicySnapshot {
+        _Atomic unsigned long n_refs;
+        PolicyRegistry *registry;
+        CRBNode registry_node;
         BusSELinuxRegistry *selinux;
         BusSELinuxID *sid;
         size_t n_batches;
         PolicyBatch *batches[];
 };
 
-#define POLICY_SNAPSHOT_NULL {}
+#define POLICY_SNAPSHOT_NULL(_x) {                                              \
+                .n_refs = C_REF_INIT,                                           \
+                .registry_node = C_RBNODE_INIT((_x).registry_node),             \
+        }
 
 /* batches */
 
 int policy_batch_new(PolicyBatch **batchp);
 void policy_batch_free(_Atomic unsigned long *n_refs, void *userdata);
 
+/* batch pools */
+
+void policy_batch_pool_deinit(PolicyBatchPool *pool);
+
 /* registry */
 
 int policy_registry_new(PolicyRegistry **registryp, BusSELinuxID *fallback_id);
 PolicyRegistry *policy_registry_free(PolicyRegistry *registry);
 
 int policy_registry_import(PolicyRegistry *registry, CDVar *v);
+int policy_registry_import_nodes(PolicyRegistry *registry, CDVar *v);
+int policy_registry_share(PolicyRegistry *registry, PolicyBatchPool *pool);
 
 C_DEFINE_CLEANUP(PolicyRegistry *, policy_registry_free);
 
@@ -137,9 +185,7 @@ int policy_snapshot_new(PolicySnapshot **snapshotp,
                         uint32_t uid,
                         const uint32_t *gids,
                         size_t n_gids);
-PolicySnapshot *policy_snapshot_free(PolicySnapshot *snapshot);
-
-int policy_snapshot_dup(PolicySnapshot *snapshot, PolicySnapshot **newp);
+void policy_snapshot_free(_Atomic unsigned long *n_refs, void *userdata);
 
 int policy_snapshot_check_connect(PolicySnapshot *snapshot);
 int policy_snapshot_check_own(PolicySnapshot *snapshot, const char *name);
@@ -157,8 +203,6 @@ int policy_snapshot_check_receive(PolicySnapshot *snapshot,
                                   const char *path,
                                   unsigned int type);
 
-C_DEFINE_CLEANUP(PolicySnapshot *, policy_snapshot_free);
-
 /* inline helpers */
 
 static inline PolicyBatch *policy_batch_ref(PolicyBatch *batch) {
@@ -174,3 +218,17 @@ static inline PolicyBatch *policy_batch_unref(PolicyBatch *batch) {
 }
 
 C_DEFINE_CLEANUP(PolicyBatch *, policy_batch_unref);
+
+static inline PolicySnapshot *policy_snapshot_ref(PolicySnapshot *snapshot) {
+        if (snapshot)
+                c_ref_inc(&snapshot->n_refs);
+        return snapshot;
+}
+
+static inline PolicySnapshot *policy_snapshot_unref(PolicySnapshot *snapshot) {
+        if (snapshot)
+                c_ref_dec(&snapshot->n_refs, policy_snapshot_free, NULL);
+        return NULL;
+}
+
+C_DEFINE_CLEANUP(PolicySnapshot *, policy_snapshot_unref);
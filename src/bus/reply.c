@@ -4,66 +4,85 @@
 
 #include <c-list.h>
 #include <c-macro.h>
-#include <c-rbtree.h>
 #include <stdlib.h>
 #include "bus/reply.h"
+#include "util/arena.h"
+#include "util/dispatch.h"
 #include "util/error.h"
+#include "util/hash.h"
+#include "util/pool.h"
 #include "util/user.h"
 
-typedef struct ReplySlotKey ReplySlotKey;
+static Pool reply_slot_pool = POOL_INIT(reply_slot_pool, "ReplySlot", sizeof(ReplySlot), REPLY_SLOT_POOL_MAX);
 
-struct ReplySlotKey {
-        uint64_t id;
-        uint32_t serial;
-};
+/*
+ * Reply slots are kept in a hash table keyed on the (id, serial) tuple.
+ */
 
-static int reply_slot_compare(CRBTree *tree, void *k, CRBNode *rb) {
-        ReplySlot *slot = c_container_of(rb, ReplySlot, registry_node);
-        ReplySlotKey *key = k;
+static uint64_t reply_hash(uint64_t id, uint32_t serial) {
+        return hash_u64(id ^ ((uint64_t)serial << 32));
+}
 
-        if (key->id < slot->id)
-                return -1;
-        if (key->id > slot->id)
-                return 1;
+static uint64_t reply_slot_hash(void *entry) {
+        ReplySlot *slot = entry;
 
-        if (key->serial < slot->serial)
-                return -1;
-        if (key->serial > slot->serial)
-                return 1;
+        return reply_hash(slot->id, slot->serial);
+}
 
-        return 0;
+static size_t reply_registry_probe(ReplyRegistry *registry, uint64_t id, uint32_t serial) {
+        ReplySlot *slot;
+        size_t i;
+
+        hash_table_for_each_probe(slot, i, &registry->table, reply_hash(id, serial))
+                if (slot->id == id && slot->serial == serial)
+                        break;
+
+        return i;
+}
+
+static void reply_slot_release(ReplyOwner *owner, ReplySlot *slot) {
+        if (owner->arena)
+                arena_free(owner->arena, slot, sizeof(*slot));
+        else
+                pool_free(&reply_slot_pool, slot);
 }
 
 int reply_slot_new(ReplySlot **replyp, ReplyRegistry *registry, ReplyOwner *owner, User *user, User *actor, uint64_t id, uint32_t serial) {
         ReplySlot *reply;
-        CRBNode **slot, *parent;
-        ReplySlotKey key = {
-                .id = id,
-                .serial = serial,
-        };
         int r;
 
-        slot = c_rbtree_find_slot(&registry->reply_tree, reply_slot_compare, &key, &parent);
-        if (!slot)
+        if (registry->table.n_entries && registry->table.buckets[reply_registry_probe(registry, id, serial)])
                 return REPLY_E_EXISTS;
 
-        reply = calloc(1, sizeof(*reply));
+        r = hash_table_reserve(&registry->table, reply_slot_hash, REPLY_REGISTRY_BUCKETS_MIN);
+        if (r)
+                return error_trace(r);
+
+        if (owner->arena)
+                reply = arena_alloc(owner->arena, sizeof(*reply));
+        else
+                reply = pool_alloc(&reply_slot_pool);
         if (!reply)
                 return error_origin(-ENOMEM);
 
         reply->registry = registry;
         reply->owner = owner;
         reply->charge = (UserCharge)USER_CHARGE_INIT;
-        reply->registry_node = (CRBNode)C_RBNODE_INIT(reply->registry_node);
+        reply->registry_link = (CList)C_LIST_INIT(reply->registry_link);
         reply->owner_link = (CList)C_LIST_INIT(reply->owner_link);
+        reply->timeout = (DispatchTimer)DISPATCH_TIMER_NULL(reply->timeout);
         reply->id = id;
         reply->serial = serial;
 
         r = user_charge(user, &reply->charge, actor, USER_SLOT_OBJECTS, 1);
-        if (r)
+        if (r) {
+                reply_slot_release(owner, reply);
                 return (r == USER_E_QUOTA) ? REPLY_E_QUOTA : error_fold(r);
+        }
+
+        hash_table_insert(&registry->table, reply_registry_probe(registry, id, serial), reply);
 
-        c_rbtree_add(&registry->reply_tree, parent, slot, &reply->registry_node);
+        c_list_link_tail(&registry->reply_list, &reply->registry_link);
         c_list_link_tail(&owner->reply_list, &reply->owner_link);
 
         *replyp = reply;
@@ -72,33 +91,45 @@ int reply_slot_new(ReplySlot **replyp, ReplyRegistry *registry, ReplyOwner *owne
 }
 
 ReplySlot *reply_slot_free(ReplySlot *slot) {
+        ReplyRegistry *registry;
+        ReplyOwner *owner;
+
         if (!slot)
                 return NULL;
 
+        registry = slot->registry;
+        owner = slot->owner;
+
+        dispatch_timer_deinit(&slot->timeout);
         user_charge_deinit(&slot->charge);
         c_list_unlink(&slot->owner_link);
-        c_rbtree_remove_init(&slot->registry->reply_tree, &slot->registry_node);
+        c_list_unlink(&slot->registry_link);
+        hash_table_remove(&registry->table,
+                          reply_registry_probe(registry, slot->id, slot->serial),
+                          reply_slot_hash,
+                          REPLY_REGISTRY_BUCKETS_MIN);
 
-        free(slot);
+        reply_slot_release(owner, slot);
 
         return NULL;
 }
 
 ReplySlot *reply_slot_get_by_id(ReplyRegistry *registry, uint64_t id, uint32_t serial) {
-        ReplySlotKey key = {
-                .id = id,
-                .serial = serial,
-        };
+        if (!registry->table.n_entries)
+                return NULL;
 
-        return c_rbtree_find_entry(&registry->reply_tree, reply_slot_compare, &key, ReplySlot, registry_node);
+        return registry->table.buckets[reply_registry_probe(registry, id, serial)];
 }
 
 void reply_registry_init(ReplyRegistry *registry) {
-        *registry = (ReplyRegistry)REPLY_REGISTRY_INIT;
+        *registry = (ReplyRegistry)REPLY_REGISTRY_INIT(*registry);
 }
 
 void reply_registry_deinit(ReplyRegistry *registry) {
-        assert(c_rbtree_is_empty(&registry->reply_tree));
+        assert(!registry->table.n_entries);
+        assert(c_list_is_empty(&registry->reply_list));
+
+        hash_table_deinit(&registry->table);
 }
 
 void reply_owner_init(ReplyOwner *owner) {
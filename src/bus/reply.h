@@ -6,14 +6,19 @@
 
 #include <c-list.h>
 #include <c-macro.h>
-#include <c-rbtree.h>
 #include <stdlib.h>
+#include "util/dispatch.h"
+#include "util/hashtable.h"
 #include "util/user.h"
 
+typedef struct Arena Arena;
 typedef struct ReplySlot ReplySlot;
 typedef struct ReplyRegistry ReplyRegistry;
 typedef struct ReplyOwner ReplyOwner;
 
+#define REPLY_SLOT_POOL_MAX (1024UL) /* covers the calls in flight on a busy bus */
+#define REPLY_REGISTRY_BUCKETS_MIN (16UL) /* 8 pending calls per peer before it grows */
+
 enum {
         _REPLY_E_SUCCESS,
 
@@ -27,19 +32,22 @@ struct ReplySlot {
         UserCharge charge;
         uint64_t id;
         uint32_t serial;
-        CRBNode registry_node;
+        CList registry_link;
         CList owner_link;
+        DispatchTimer timeout;
 };
 
 struct ReplyRegistry {
-        CRBTree reply_tree;
+        HashTable table;
+        CList reply_list;
 };
 
-#define REPLY_REGISTRY_INIT {                   \
-                .reply_tree = C_RBTREE_INIT,    \
+#define REPLY_REGISTRY_INIT(_x) {                               \
+                .reply_list = C_LIST_INIT((_x).reply_list),     \
         }
 
 struct ReplyOwner {
+        Arena *arena;
         CList reply_list;
 };
 
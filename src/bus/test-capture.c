@@ -0,0 +1,155 @@
+/*
+ * Test Message Capture
+ */
+
+#include <c-macro.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bus/capture.h"
+#include "dbus/message.h"
+#include "util/dispatch.h"
+
+static Message *test_message_new(size_t n_body) {
+        Message *message;
+        MessageHeader *hdr;
+        int r;
+
+        hdr = calloc(1, sizeof(*hdr) + n_body);
+        assert(hdr);
+        hdr->endian = (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l';
+        hdr->serial = 1;
+        memset(hdr + 1, 'a', n_body);
+
+        r = message_new_outgoing(&message, hdr, sizeof(*hdr) + n_body);
+        assert(!r);
+
+        return message;
+}
+
+static void test_invalid(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        Capture *capture;
+        int r, p[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        /* only stream sockets are accepted */
+
+        r = capture_new(&capture, &dispatcher, -1);
+        assert(r == CAPTURE_E_INVALID_FD);
+
+        r = pipe2(p, O_CLOEXEC);
+        assert(!r);
+
+        r = capture_new(&capture, &dispatcher, p[1]);
+        assert(r == CAPTURE_E_INVALID_FD);
+
+        close(p[1]);
+        close(p[0]);
+
+        r = socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, p);
+        assert(!r);
+
+        r = capture_new(&capture, &dispatcher, p[0]);
+        assert(r == CAPTURE_E_INVALID_FD);
+
+        close(p[1]);
+        close(p[0]);
+}
+
+static void test_capture(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        _c_cleanup_(capture_freep) Capture *capture = NULL;
+        uint32_t buffer[6 + 4 + 4];
+        ssize_t l;
+        int r, s[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
+        assert(!r);
+
+        r = capture_new(&capture, &dispatcher, s[0]);
+        assert(!r);
+
+        /* the capture operates on its own fd */
+        close(s[0]);
+
+        /* a message is flushed as pcap record, preceded by the pcap header */
+
+        message = test_message_new(0);
+        capture_append(capture, message);
+        assert(capture->n_captured == 1);
+        assert(!capture->n_dropped);
+
+        r = dispatch_context_dispatch(&dispatcher);
+        assert(!r);
+
+        l = recv(s[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+        assert(l == sizeof(buffer));
+        assert(buffer[0] == 0xa1b2c3d4);
+        assert(buffer[4] == CAPTURE_SNAPLEN);
+        assert(buffer[5] == CAPTURE_LINKTYPE_DBUS);
+        assert(buffer[8] == sizeof(MessageHeader));
+        assert(buffer[9] == sizeof(MessageHeader));
+        assert(!memcmp(buffer + 10, message->header, sizeof(MessageHeader)));
+
+        l = recv(s[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+        assert(l < 0 && errno == EAGAIN);
+
+        /* once the consumer is gone, everything is dropped */
+
+        close(s[1]);
+
+        capture_append(capture, message);
+        r = dispatch_context_dispatch(&dispatcher);
+        assert(!r);
+        assert(capture->failed);
+
+        capture_append(capture, message);
+        assert(capture->n_captured == 2);
+        assert(capture->n_dropped == 1);
+}
+
+static void test_drop(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext dispatcher = DISPATCH_CONTEXT_NULL(dispatcher);
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        _c_cleanup_(capture_freep) Capture *capture = NULL;
+        size_t i;
+        int r, s[2];
+
+        r = dispatch_context_init(&dispatcher);
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
+        assert(!r);
+
+        r = capture_new(&capture, &dispatcher, s[0]);
+        assert(!r);
+
+        /* messages are dropped, rather than queued, if the buffer is full */
+
+        message = test_message_new(CAPTURE_BUFFER_SIZE / 4);
+
+        for (i = 0; i < 5; ++i)
+                capture_append(capture, message);
+
+        assert(capture->n_captured == 3);
+        assert(capture->n_dropped == 2);
+
+        close(s[1]);
+        close(s[0]);
+}
+
+int main(int argc, char **argv) {
+        test_invalid();
+        test_capture();
+        test_drop();
+        return 0;
+}
@@ -4,10 +4,12 @@
 
 #include <c-macro.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "bus/match.h"
 #include "dbus/protocol.h"
+#include "util/atom.h"
 
 static void test_arg(MatchOwner *owner,
                      const char *match,
@@ -15,9 +17,9 @@ static void test_arg(MatchOwner *owner,
         _c_cleanup_(match_rule_user_unrefp) MatchRule *rule = NULL;
         int r;
 
-        r = match_owner_ref_rule(owner, &rule, NULL, match);
+        r = match_owner_ref_rule(owner, &rule, NULL, NULL, match);
         assert(r == 0);
-        assert(strcmp(rule->keys.filter.args[0], arg0) == 0);
+        assert(strcmp(rule->keys->filter.args[0], arg0) == 0);
 }
 
 static void test_parse_key(MatchOwner *owner) {
@@ -35,12 +37,12 @@ static void test_args(MatchOwner *owner,
         _c_cleanup_(match_rule_user_unrefp) MatchRule *rule = NULL;
         int r;
 
-        r = match_owner_ref_rule(owner,  &rule, NULL, match);
+        r = match_owner_ref_rule(owner,  &rule, NULL, NULL, match);
         assert(r == 0);
-        assert(strcmp(rule->keys.filter.args[0], arg0) == 0);
-        assert(strcmp(rule->keys.filter.args[1], arg1) == 0);
-        assert(strcmp(rule->keys.filter.args[2], arg2) == 0);
-        assert(strcmp(rule->keys.filter.args[3], arg3) == 0);
+        assert(strcmp(rule->keys->filter.args[0], arg0) == 0);
+        assert(strcmp(rule->keys->filter.args[1], arg1) == 0);
+        assert(strcmp(rule->keys->filter.args[2], arg2) == 0);
+        assert(strcmp(rule->keys->filter.args[3], arg3) == 0);
 }
 
 static void test_parse_value(MatchOwner *owner) {
@@ -63,7 +65,7 @@ static bool test_validity(MatchOwner *owner, const char *match) {
         _c_cleanup_(match_rule_user_unrefp) MatchRule *rule = NULL;
         int r;
 
-        r = match_owner_ref_rule(owner, &rule, NULL, match);
+        r = match_owner_ref_rule(owner, &rule, NULL, NULL, match);
         assert(r == 0 || r == MATCH_E_INVALID);
 
         return !r;
@@ -123,7 +125,7 @@ static bool test_match(const char *match_string, MatchFilter *filter) {
         match_registry_init(&registry);
         match_owner_init(&owner);
 
-        r = match_owner_ref_rule(&owner, &rule, NULL, match_string);
+        r = match_owner_ref_rule(&owner, &rule, NULL, NULL, match_string);
         assert(!r);
 
         match_rule_link(rule, &registry, false);
@@ -241,6 +243,62 @@ static void test_individual_matches(void) {
         assert(!test_match("arg0namespace=com.example", &filter));
 }
 
+static void test_shape(const char *match_string, unsigned int mask, unsigned int n_args) {
+        _c_cleanup_(match_rule_user_unrefp) MatchRule *rule = NULL;
+        MatchOwner owner;
+        int r;
+
+        match_owner_init(&owner);
+
+        r = match_owner_ref_rule(&owner, &rule, NULL, NULL, match_string);
+        assert(!r);
+        assert(rule->keys->mask == mask);
+        assert(rule->keys->n_args == n_args);
+
+        rule = match_rule_user_unref(rule);
+        match_owner_deinit(&owner);
+}
+
+static void test_shapes(void) {
+        MatchFilter filter = MATCH_FILTER_INIT;
+
+        test_shape("", 0, 0);
+        test_shape("type=signal,interface=com.example.foo,member=Foo",
+                   MATCH_KEY_TYPE | MATCH_KEY_INTERFACE | MATCH_KEY_MEMBER, 0);
+        test_shape("sender=:1.5", MATCH_KEY_SENDER, 0);
+        test_shape("sender=com.example.foo", 0, 0);
+        test_shape("destination=com.example.foo", 0, 0);
+        test_shape("path_namespace=/com/example", MATCH_KEY_PATH_NAMESPACE, 0);
+        test_shape("arg0=foo", MATCH_KEY_ARGS, 1);
+        test_shape("arg0namespace=foo", MATCH_KEY_ARG0NAMESPACE, 0);
+        test_shape("arg3path=/foo,arg1=bar", MATCH_KEY_ARGS, 4);
+
+        /* the specialized shapes must match like the generic path */
+        filter.type = DBUS_MESSAGE_TYPE_SIGNAL;
+        filter.sender = 5;
+        filter.interface = "com.example.foo";
+        filter.member = "Foo";
+        filter.path = "/com/example/foo";
+        filter.args[0] = "foo";
+        filter.args[3] = "bar";
+        filter.argpaths[0] = "foo";
+        filter.argpaths[3] = "/foo/bar";
+
+        assert(test_match("type=signal,interface=com.example.foo,member=Foo", &filter));
+        assert(!test_match("type=method_call,interface=com.example.foo,member=Foo", &filter));
+        assert(!test_match("type=signal,interface=com.example.foo,member=Bar", &filter));
+        assert(test_match("sender=:1.5", &filter));
+        assert(!test_match("sender=:1.6", &filter));
+        assert(test_match("path_namespace=/com/example/foo", &filter));
+        assert(test_match("type=signal,path_namespace=/com/example/foo", &filter));
+        assert(!test_match("type=error,path_namespace=/com/example/foo", &filter));
+        assert(!test_match("path_namespace=/com/example/foobar", &filter));
+        assert(test_match("arg0=foo", &filter));
+        assert(!test_match("arg0=bar", &filter));
+        assert(test_match("arg0=foo,arg3path=/foo/", &filter));
+        assert(!test_match("arg0=foo,arg3path=/bar/", &filter));
+}
+
 static void test_iterator(void) {
         MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
         MatchFilter filter = MATCH_FILTER_INIT;
@@ -251,22 +309,22 @@ static void test_iterator(void) {
         match_owner_init(&owner1);
         match_owner_init(&owner2);
 
-        r = match_owner_ref_rule(&owner1, &rule1, NULL, "");
+        r = match_owner_ref_rule(&owner1, &rule1, NULL, NULL, "");
         assert(!r);
 
         match_rule_link(rule1, &registry, false);
 
-        r = match_owner_ref_rule(&owner1, &rule2, NULL, "");
+        r = match_owner_ref_rule(&owner1, &rule2, NULL, NULL, "");
         assert(!r);
 
         match_rule_link(rule2, &registry, false);
 
-        r = match_owner_ref_rule(&owner2, &rule3, NULL, "");
+        r = match_owner_ref_rule(&owner2, &rule3, NULL, NULL, "");
         assert(!r);
 
         match_rule_link(rule3, &registry, false);
 
-        r = match_owner_ref_rule(&owner2, &rule4, NULL, "");
+        r = match_owner_ref_rule(&owner2, &rule4, NULL, NULL, "");
         assert(!r);
 
         match_rule_link(rule4, &registry, false);
@@ -290,7 +348,383 @@ static void test_iterator(void) {
 
 }
 
+static void test_indexed(AtomRegistry *atoms) {
+        static const char *strings[] = {
+                "path=/com/example/foo",
+                "member=FooBar",
+                "interface=com.example.foo",
+                "interface=com.example.foo,member=FooBar",
+                "path=/com/example/foo,member=FooBar",
+                "",
+                "path=/com/example/bar",
+                "member=FooBaz",
+                "interface=com.example.bar",
+                "interface=com.example.foo,member=FooBaz",
+        };
+        MatchKeysRegistry keys = MATCH_KEYS_REGISTRY_INIT(atoms);
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchFilter filter = MATCH_FILTER_INIT;
+        MatchRule *rule, *rules[C_ARRAY_SIZE(strings)];
+        unsigned int seen[C_ARRAY_SIZE(strings)] = {};
+        MatchOwner owner;
+        size_t i;
+        int r;
+
+        match_owner_init(&owner);
+
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i) {
+                r = match_owner_ref_rule(&owner, &rules[i], NULL, &keys, strings[i]);
+                assert(!r);
+
+                match_rule_link(rules[i], &registry, false);
+        }
+
+        filter.path = "/com/example/foo";
+        filter.interface = "com.example.foo";
+        filter.member = "FooBar";
+
+        if (atoms) {
+                filter.atoms = atoms;
+                filter.path = atom_registry_resolve(atoms, filter.path);
+                filter.interface = atom_registry_resolve(atoms, filter.interface);
+                filter.member = atom_registry_resolve(atoms, filter.member);
+        }
+
+        for (rule = match_rule_next_match(&registry, NULL, &filter); rule; rule = match_rule_next_match(&registry, rule, &filter)) {
+                for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                        if (rules[i] == rule)
+                                ++seen[i];
+        }
+
+        /* the first six rules match, each exactly once */
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                assert(seen[i] == (i < 6));
+
+        /* unlinking all non-monitors must empty the registry */
+        match_registry_flush(&registry);
+        assert(!match_rule_next_match(&registry, NULL, &filter));
+
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                match_rule_user_unref(rules[i]);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+        match_keys_registry_deinit(&keys);
+}
+
+static void test_indexed_arg0(AtomRegistry *atoms) {
+        static const char *strings[] = {
+                "arg0=com.example.foo",
+                "path=/org/freedesktop/DBus,arg0=com.example.foo",
+                "arg0namespace=com.example.foo",
+                "arg0namespace=com.example.foo.bar",
+                "path=/org/freedesktop/DBus",
+                "",
+                "arg0=com.example.bar",
+                "arg0=com.example.fo",
+                "arg0=com.example.foo,arg1=:1.2",
+                "arg0namespace=com.example.foobar",
+                "arg0namespace=com.example",
+        };
+        MatchKeysRegistry keys = MATCH_KEYS_REGISTRY_INIT(atoms);
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchFilter filter = MATCH_FILTER_INIT;
+        MatchRule *rule, *rules[C_ARRAY_SIZE(strings)];
+        unsigned int seen[C_ARRAY_SIZE(strings)] = {};
+        MatchOwner owner;
+        size_t i;
+        int r;
+
+        match_owner_init(&owner);
+
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i) {
+                r = match_owner_ref_rule(&owner, &rules[i], NULL, &keys, strings[i]);
+                assert(!r);
+
+                match_rule_link(rules[i], &registry, false);
+        }
+
+        /* rules with a first argument are indexed by it, regardless of their path */
+        assert(c_rbtree_first(&registry.path_tree) == &rules[4]->registry_node);
+        assert(!c_rbnode_next(&rules[4]->registry_node));
+        assert(!c_rbtree_is_empty(&registry.arg0namespace_tree));
+
+        filter.path = "/org/freedesktop/DBus";
+        filter.args[0] = "com.example.foo";
+        filter.args[1] = ":1.1";
+
+        if (atoms) {
+                filter.atoms = atoms;
+                filter.path = atom_registry_resolve(atoms, filter.path);
+        }
+
+        for (rule = match_rule_next_match(&registry, NULL, &filter); rule; rule = match_rule_next_match(&registry, rule, &filter)) {
+                for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                        if (rules[i] == rule)
+                                ++seen[i];
+        }
+
+        /* the first six rules match, each exactly once */
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                assert(seen[i] == (i < 6));
+
+        match_registry_flush(&registry);
+        assert(!match_rule_next_match(&registry, NULL, &filter));
+
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                match_rule_user_unref(rules[i]);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+        match_keys_registry_deinit(&keys);
+}
+
+static bool test_match_linear(const char *match_string, MatchFilter *filter) {
+        MatchRegistry registry;
+        MatchOwner owner;
+        MatchRule *rule, *rule1;
+        int r;
+
+        /* monitors are never indexed, so this serves as reference */
+
+        match_registry_init(&registry);
+        match_owner_init(&owner);
+
+        r = match_owner_ref_rule(&owner, &rule, NULL, NULL, match_string);
+        assert(!r);
+
+        match_rule_link(rule, &registry, true);
+
+        rule1 = match_rule_next_monitor_match(&registry, NULL, filter);
+        assert(!rule1 || rule1 == rule);
+
+        match_rule_user_unref(rule);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+
+        return !!(rule1 == rule);
+}
+
+static void test_indexed_path(void) {
+        static const char *strings[] = {
+                "path_namespace=/com/example/foo",
+                "path_namespace=/com/example/foo/bar",
+                "path_namespace=/com/example/foo/bar/baz",
+                "path_namespace=/com/example/foo-bar",
+                "path_namespace=/com/example/foobar",
+                "path_namespace=/com/example",
+                "path_namespace=/",
+                "path_namespace=/com/example/foo,member=Foo",
+                "path_namespace=/com/example/foo,member=Bar",
+                "arg0path=/",
+                "arg0path=/com/",
+                "arg0path=/com/example/",
+                "arg0path=/com/example",
+                "arg0path=/com/example/foo",
+                "arg0path=/com/example/foo/",
+                "arg0path=/com/example/foo/bar",
+                "arg0path=/com/example/foo/bar/",
+                "arg0path=/com/example/foobar/",
+                "arg0path=/com/example/foo-bar/",
+                "arg1path=/com/example/",
+                "arg1path=/com/example/foo/",
+                "arg1path=/org/",
+                "arg0path=/com/,arg1path=/org/",
+                "arg2path=/com/example/foo/",
+                "arg3path=foo",
+        };
+        static const char *paths[] = {
+                "/",
+                "/com",
+                "/com/example",
+                "/com/example/foo",
+                "/com/example/foo/",
+                "/com/example/foo/bar",
+                "/com/example/foobar",
+                "foo",
+                "",
+                NULL,
+        };
+        MatchKeysRegistry keys = MATCH_KEYS_REGISTRY_INIT(NULL);
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchFilter filter;
+        MatchRule *rule, *rules[C_ARRAY_SIZE(strings)];
+        unsigned int seen[C_ARRAY_SIZE(strings)];
+        MatchOwner owner;
+        size_t i, j, k;
+        int r;
+
+        /*
+         * Link rules covering parents, children, and siblings of each other
+         * into one registry, and verify that searching it yields the same
+         * rules as matching each of them linearly, each exactly once.
+         */
+
+        match_owner_init(&owner);
+
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i) {
+                r = match_owner_ref_rule(&owner, &rules[i], NULL, &keys, strings[i]);
+                assert(!r);
+
+                match_rule_link(rules[i], &registry, false);
+        }
+
+        /* rules with a path namespace or path argument are never searched linearly */
+        assert(c_list_is_empty(&registry.rule_list));
+
+        for (j = 0; j < C_ARRAY_SIZE(paths); ++j) {
+                for (k = 0; k < C_ARRAY_SIZE(paths); ++k) {
+                        filter = (MatchFilter)MATCH_FILTER_INIT;
+                        filter.member = "Foo";
+                        filter.path = paths[j];
+                        filter.argpaths[0] = paths[j];
+                        filter.argpaths[1] = paths[k];
+                        filter.argpaths[2] = paths[k];
+                        filter.argpaths[3] = paths[j];
+
+                        memset(seen, 0, sizeof(seen));
+
+                        for (rule = match_rule_next_match(&registry, NULL, &filter);
+                             rule;
+                             rule = match_rule_next_match(&registry, rule, &filter)) {
+                                for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                                        if (rules[i] == rule)
+                                                ++seen[i];
+                        }
+
+                        for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                                assert(seen[i] == test_match_linear(strings[i], &filter));
+                }
+        }
+
+        match_registry_flush(&registry);
+
+        for (i = 0; i < C_ARRAY_SIZE(strings); ++i)
+                match_rule_user_unref(rules[i]);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+        match_keys_registry_deinit(&keys);
+}
+
+static bool test_may_match(MatchRegistry *registry, const char *interface, const char *member) {
+        MatchFilter filter = MATCH_FILTER_INIT;
+        MatchBloomKey key;
+
+        filter.interface = interface;
+        filter.member = member;
+        match_bloom_key_init(&key, &filter);
+
+        return match_registry_may_match(registry, &key);
+}
+
+static void test_bloom(void) {
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchRule *rule1, *rule2, *rule3, *monitor;
+        MatchOwner owner;
+        int r;
+
+        match_owner_init(&owner);
+
+        /* an empty registry never matches */
+        assert(!test_may_match(&registry, "com.example.foo", "Foo"));
+
+        r = match_owner_ref_rule(&owner, &rule1, NULL, NULL, "interface=com.example.foo,member=Foo");
+        assert(!r);
+        r = match_owner_ref_rule(&owner, &rule2, NULL, NULL, "member=Bar");
+        assert(!r);
+        r = match_owner_ref_rule(&owner, &rule3, NULL, NULL, "path=/com/example/foo");
+        assert(!r);
+        r = match_owner_ref_rule(&owner, &monitor, NULL, NULL, "");
+        assert(!r);
+
+        /* rules with an interface are filtered by it, others by their member */
+        match_rule_link(rule1, &registry, false);
+        assert(test_may_match(&registry, "com.example.foo", NULL));
+        assert(test_may_match(&registry, "com.example.foo", "Bar"));
+        assert(!test_may_match(&registry, NULL, "Foo"));
+
+        match_rule_link(rule2, &registry, false);
+        assert(test_may_match(&registry, NULL, "Bar"));
+        assert(test_may_match(&registry, "com.example.bar", "Bar"));
+
+        /* monitors are not covered */
+        match_rule_link(monitor, &registry, true);
+        assert(!test_may_match(&registry, NULL, NULL));
+
+        /* rules without interface or member always match */
+        match_rule_link(rule3, &registry, false);
+        assert(test_may_match(&registry, NULL, NULL));
+
+        /* rules are removed from the filter again */
+        match_rule_unlink(rule3);
+        match_rule_unlink(rule2);
+        assert(!test_may_match(&registry, NULL, "Bar"));
+        match_rule_unlink(rule1);
+        assert(!test_may_match(&registry, "com.example.foo", "Foo"));
+
+        match_rule_unlink(monitor);
+        match_rule_user_unref(monitor);
+        match_rule_user_unref(rule3);
+        match_rule_user_unref(rule2);
+        match_rule_user_unref(rule1);
+        match_owner_deinit(&owner);
+        match_registry_deinit(&registry);
+}
+
+static void test_shared(AtomRegistry *atoms) {
+        MatchKeysRegistry keys = MATCH_KEYS_REGISTRY_INIT(atoms);
+        MatchRegistry registry = MATCH_REGISTRY_INIT(registry);
+        MatchFilter filter = MATCH_FILTER_INIT;
+        MatchRule *rule, *rule1, *rule2, *rule3;
+        MatchOwner owner1, owner2;
+        size_t n_matches = 0;
+        int r;
+
+        match_owner_init(&owner1);
+        match_owner_init(&owner2);
+
+        /* identical strings share their keys, but not their rules */
+        r = match_owner_ref_rule(&owner1, &rule1, NULL, &keys, "type=signal,interface=com.example.foo");
+        assert(!r);
+        r = match_owner_ref_rule(&owner2, &rule2, NULL, &keys, "type=signal,interface=com.example.foo");
+        assert(!r);
+        assert(rule1 != rule2);
+        assert(rule1->keys == rule2->keys);
+        assert(rule1->keys->n_refs == 2);
+
+        /* equivalent rules of one owner are still merged, regardless of their keys */
+        r = match_owner_ref_rule(&owner2, &rule3, NULL, &keys, "interface=com.example.foo,type=signal");
+        assert(!r);
+        assert(rule3 == rule2);
+        match_rule_user_unref(rule3);
+
+        /* both rules are still delivered individually */
+        match_rule_link(rule1, &registry, false);
+        match_rule_link(rule2, &registry, false);
+
+        filter.type = DBUS_MESSAGE_TYPE_SIGNAL;
+        filter.interface = "com.example.foo";
+        if (atoms) {
+                filter.atoms = atoms;
+                filter.interface = atom_registry_resolve(atoms, filter.interface);
+        }
+
+        for (rule = match_rule_next_match(&registry, NULL, &filter); rule; rule = match_rule_next_match(&registry, rule, &filter))
+                ++n_matches;
+        assert(n_matches == 2);
+
+        /* keys must survive until their last user is gone */
+        match_rule_user_unref(rule1);
+        assert(rule2->keys->n_refs == 1);
+        assert(!strcmp(rule2->keys->filter.interface, "com.example.foo"));
+
+        match_rule_user_unref(rule2);
+        match_owner_deinit(&owner2);
+        match_owner_deinit(&owner1);
+        match_registry_deinit(&registry);
+        match_keys_registry_deinit(&keys);
+}
+
 int main(int argc, char **argv) {
+        AtomRegistry atoms = ATOM_REGISTRY_INIT;
         MatchOwner owner = {};
 
         test_splitting(&owner);
@@ -300,9 +734,19 @@ int main(int argc, char **argv) {
         test_validate_keys(&owner);
 
         test_individual_matches();
+        test_shapes();
 
         test_iterator();
+        test_indexed(NULL);
+        test_indexed(&atoms);
+        test_indexed_arg0(NULL);
+        test_indexed_arg0(&atoms);
+        test_indexed_path();
+        test_bloom();
+        test_shared(NULL);
+        test_shared(&atoms);
 
         match_owner_deinit(&owner);
+        atom_registry_deinit(&atoms);
         return 0;
 }
@@ -3,6 +3,7 @@
  */
 
 #include <c-macro.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include "bus/name.h"
@@ -219,9 +220,172 @@ static void test_queue(void) {
         name_registry_deinit(&registry);
 }
 
+static void test_many(void) {
+        NameRegistry registry;
+        NameOwner owner;
+        NameChange change;
+        const char *last = "";
+        char name_str[64];
+        Name *name;
+        size_t i, n;
+        int r;
+
+        name_registry_init(&registry);
+        name_owner_init(&owner);
+        name_change_init(&change);
+
+        /* grow the registry across several resizes */
+        for (i = 0; i < 1024; ++i) {
+                r = snprintf(name_str, sizeof(name_str), "org.bus1.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(name_str));
+
+                r = name_registry_request_name(&registry, &owner, NULL, name_str, 0, &change);
+                assert(!r);
+                name_change_deinit(&change);
+        }
+
+        assert(registry.table.n_entries == 1024);
+        assert(!name_registry_find_name(&registry, "org.bus1.Name"));
+        assert(!name_registry_find_name(&registry, "org.bus1.Name1024"));
+
+        /* the tree still lists all names in order */
+        n = 0;
+        c_rbtree_for_each_entry(name, &registry.name_tree, registry_node) {
+                assert(strcmp(last, name->name) < 0);
+                last = name->name;
+                ++n;
+        }
+        assert(n == 1024);
+
+        /* release every other name, to exercise removal from probe chains */
+        for (i = 0; i < 1024; i += 2) {
+                r = snprintf(name_str, sizeof(name_str), "org.bus1.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(name_str));
+
+                r = name_registry_release_name(&registry, &owner, name_str, &change);
+                assert(!r);
+                name_change_deinit(&change);
+        }
+
+        for (i = 0; i < 1024; ++i) {
+                r = snprintf(name_str, sizeof(name_str), "org.bus1.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(name_str));
+
+                if (i % 2)
+                        assert(resolve_owner(&registry, name_str) == &owner);
+                else
+                        assert(!name_registry_find_name(&registry, name_str));
+        }
+
+        for (i = 1; i < 1024; i += 2) {
+                r = snprintf(name_str, sizeof(name_str), "org.bus1.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(name_str));
+
+                r = name_registry_release_name(&registry, &owner, name_str, &change);
+                assert(!r);
+                name_change_deinit(&change);
+        }
+
+        assert(!registry.table.n_entries);
+        assert(!registry.table.n_buckets);
+
+        name_owner_deinit(&owner);
+        name_registry_deinit(&registry);
+}
+
+static void test_release_all(void) {
+        NameRegistry registry;
+        NameOwner owner1, owner2;
+        NameChange change, *changes;
+        char name_str[64];
+        size_t i, n_changes;
+        int r;
+
+        name_registry_init(&registry);
+        name_owner_init(&owner1);
+        name_owner_init(&owner2);
+        name_change_init(&change);
+
+        /* an owner without names releases nothing */
+        r = name_owner_release_all(&owner1, &changes, &n_changes);
+        assert(!r);
+        assert(!n_changes);
+        free(changes);
+
+        /* @owner1 owns 16 names, @owner2 is queued for half of them */
+        for (i = 0; i < 16; ++i) {
+                r = snprintf(name_str, sizeof(name_str), "org.bus1.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(name_str));
+
+                r = name_registry_request_name(&registry, &owner1, NULL, name_str, 0, &change);
+                assert(!r);
+                name_change_deinit(&change);
+
+                if (i % 2) {
+                        r = name_registry_request_name(&registry, &owner2, NULL, name_str, 0, &change);
+                        assert(r == NAME_E_IN_QUEUE);
+                        name_change_deinit(&change);
+                }
+        }
+
+        /* @owner2 only ever queued, so releasing it changes no primary owner */
+        r = name_owner_release_all(&owner2, &changes, &n_changes);
+        assert(!r);
+        assert(!n_changes);
+        assert(c_rbtree_is_empty(&owner2.ownership_tree));
+        free(changes);
+
+        for (i = 1; i < 16; i += 2) {
+                r = snprintf(name_str, sizeof(name_str), "org.bus1.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(name_str));
+
+                r = name_registry_request_name(&registry, &owner2, NULL, name_str, 0, &change);
+                assert(r == NAME_E_IN_QUEUE);
+                name_change_deinit(&change);
+        }
+
+        r = name_owner_release_all(&owner1, &changes, &n_changes);
+        assert(!r);
+        assert(n_changes == 16);
+        assert(c_rbtree_is_empty(&owner1.ownership_tree));
+
+        for (i = 0; i < n_changes; ++i) {
+                assert(changes[i].old_owner == &owner1);
+                if (changes[i].new_owner)
+                        assert(changes[i].new_owner == &owner2);
+                name_change_deinit(&changes[i]);
+        }
+        free(changes);
+
+        for (i = 0; i < 16; ++i) {
+                r = snprintf(name_str, sizeof(name_str), "org.bus1.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(name_str));
+
+                if (i % 2)
+                        assert(resolve_owner(&registry, name_str) == &owner2);
+                else
+                        assert(!name_registry_find_name(&registry, name_str));
+        }
+
+        r = name_owner_release_all(&owner2, &changes, &n_changes);
+        assert(!r);
+        assert(n_changes == 8);
+        for (i = 0; i < n_changes; ++i)
+                name_change_deinit(&changes[i]);
+        free(changes);
+
+        assert(!registry.table.n_entries);
+
+        name_owner_deinit(&owner2);
+        name_owner_deinit(&owner1);
+        name_registry_deinit(&registry);
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_release();
         test_queue();
+        test_many();
+        test_release_all();
         return 0;
 }
@@ -0,0 +1,128 @@
+/*
+ * Test Policy Registry
+ */
+
+#include <c-dvar.h>
+#include <c-dvar-type.h>
+#include <c-macro.h>
+#include <stdlib.h>
+#include "bus/policy.h"
+#include "dbus/protocol.h"
+
+#define TEST_POLICY_T_BATCH                                                     \
+                "bt"                                                            \
+                "a(btbs)"                                                       \
+                "a(btssssub)"                                                   \
+                "a(btssssub)"
+
+#define TEST_POLICY_T                                                           \
+                "(" TEST_POLICY_T_BATCH ")"                                     \
+                "a(u(" TEST_POLICY_T_BATCH "))"                                 \
+                "a(u(" TEST_POLICY_T_BATCH "))"                                 \
+                "a(ss)"
+
+static void test_write_batch(CDVar *v, const char *interface) {
+        c_dvar_write(v, "(bt[(btbs)][(btssssub)][])",
+                     true, UINT64_C(1),
+                     true, UINT64_C(1), false, "org.example.Foo",
+                     false, UINT64_C(2), "", "", interface, "", 0, false);
+}
+
+static void test_import(PolicyRegistry *registry, const char *interface) {
+        _c_cleanup_(c_dvar_type_freep) CDVarType *type = NULL, *policy_type = NULL;
+        _c_cleanup_(c_dvar_deinit) CDVar writer = C_DVAR_INIT, reader = C_DVAR_INIT;
+        _c_cleanup_(c_freep) void *data = NULL;
+        size_t n_data;
+        int r;
+
+        r = c_dvar_type_new_from_string(&type, "(v)");
+        assert(!r);
+
+        r = c_dvar_type_new_from_string(&policy_type, "(" TEST_POLICY_T ")");
+        assert(!r);
+
+        /* the default batch and two uids get identical batches, one gid a different one */
+        c_dvar_begin_write(&writer, type, 1);
+        c_dvar_write(&writer, "(<(", policy_type);
+        test_write_batch(&writer, interface);
+        c_dvar_write(&writer, "[(u", 1);
+        test_write_batch(&writer, interface);
+        c_dvar_write(&writer, ")(u", 2);
+        test_write_batch(&writer, interface);
+        c_dvar_write(&writer, ")][(u", 1);
+        test_write_batch(&writer, "org.example.Other");
+        c_dvar_write(&writer, ")][])>)");
+
+        r = c_dvar_end_write(&writer, &data, &n_data);
+        assert(!r);
+
+        c_dvar_begin_read(&reader, c_dvar_is_big_endian(&writer), type, 1, data, n_data);
+        c_dvar_read(&reader, "(");
+
+        r = policy_registry_import(registry, &reader);
+        assert(!r);
+
+        c_dvar_read(&reader, ")");
+
+        r = c_dvar_end_read(&reader);
+        assert(!r);
+}
+
+static PolicyBatch *test_find_batch(CRBTree *tree, uint32_t uidgid) {
+        PolicyRegistryNode *node;
+
+        c_rbtree_for_each_entry(node, tree, registry_node)
+                if (node->uidgid == uidgid)
+                        return node->batch;
+
+        return NULL;
+}
+
+static void test_share(void) {
+        _c_cleanup_(policy_batch_pool_deinit) PolicyBatchPool pool = POLICY_BATCH_POOL_INIT;
+        PolicyRegistry *a, *b, *c;
+        int r;
+
+        r = policy_registry_new(&a, NULL);
+        assert(!r);
+        r = policy_registry_new(&b, NULL);
+        assert(!r);
+        r = policy_registry_new(&c, NULL);
+        assert(!r);
+
+        test_import(a, "org.example.Foo");
+        test_import(b, "org.example.Foo");
+        test_import(c, "org.example.Bar");
+
+        r = policy_registry_share(a, &pool);
+        assert(!r);
+        r = policy_registry_share(b, &pool);
+        assert(!r);
+        r = policy_registry_share(c, &pool);
+        assert(!r);
+
+        /* identical batches are shared within and across registries */
+        assert(a->default_batch == test_find_batch(&a->uid_tree, 1));
+        assert(a->default_batch == test_find_batch(&a->uid_tree, 2));
+        assert(a->default_batch == b->default_batch);
+        assert(test_find_batch(&a->gid_tree, 1) == test_find_batch(&b->gid_tree, 1));
+        assert(test_find_batch(&a->gid_tree, 1) == test_find_batch(&c->gid_tree, 1));
+
+        /* different batches are not */
+        assert(a->default_batch != test_find_batch(&a->gid_tree, 1));
+        assert(a->default_batch != c->default_batch);
+        assert(pool.table.n_entries == 3);
+
+        /* shared batches stay pooled as long as any registry uses them */
+        a = policy_registry_free(a);
+        assert(pool.table.n_entries == 3);
+        b = policy_registry_free(b);
+        assert(pool.table.n_entries == 2);
+        c = policy_registry_free(c);
+        assert(pool.table.n_entries == 0);
+}
+
+int main(int argc, char **argv) {
+        test_share();
+        return 0;
+}
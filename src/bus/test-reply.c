@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "bus/reply.h"
+#include "util/dispatch.h"
 
 static void test_basic(void) {
         ReplyRegistry registry;
@@ -37,8 +38,82 @@ static void test_basic(void) {
         reply_registry_deinit(&registry);
 }
 
+static void test_many(void) {
+        ReplyRegistry registry;
+        ReplyOwner owner;
+        ReplySlot *slots[4096];
+        size_t i;
+        int r;
+
+        /*
+         * Create enough slots to force the registry to grow several times,
+         * then release every other one and verify all remaining slots can
+         * still be found, while the released ones are gone.
+         */
+
+        reply_registry_init(&registry);
+        reply_owner_init(&owner);
+
+        for (i = 0; i < C_ARRAY_SIZE(slots); ++i) {
+                r = reply_slot_new(&slots[i], &registry, &owner, NULL, NULL, i % 7, i);
+                assert(!r);
+        }
+
+        for (i = 0; i < C_ARRAY_SIZE(slots); ++i)
+                assert(reply_slot_get_by_id(&registry, i % 7, i) == slots[i]);
+
+        for (i = 0; i < C_ARRAY_SIZE(slots); i += 2)
+                slots[i] = reply_slot_free(slots[i]);
+
+        for (i = 0; i < C_ARRAY_SIZE(slots); ++i)
+                assert(reply_slot_get_by_id(&registry, i % 7, i) == slots[i]);
+
+        for (i = 1; i < C_ARRAY_SIZE(slots); i += 2)
+                reply_slot_free(slots[i]);
+
+        assert(!reply_slot_get_by_id(&registry, 1, 1));
+
+        reply_owner_deinit(&owner);
+        reply_registry_deinit(&registry);
+}
+
+static int test_timeout_fn(DispatchTimer *timer) {
+        assert(0);
+        return 0;
+}
+
+static void test_timeout(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext context = DISPATCH_CONTEXT_NULL(context);
+        ReplyRegistry registry;
+        ReplyOwner owner;
+        ReplySlot *slot;
+        int r;
+
+        /* verify releasing a slot cancels its pending timeout */
+
+        r = dispatch_context_init(&context);
+        assert(!r);
+
+        reply_registry_init(&registry);
+        reply_owner_init(&owner);
+
+        r = reply_slot_new(&slot, &registry, &owner, NULL, NULL, 1, 1);
+        assert(!r);
+
+        dispatch_timer_init(&slot->timeout, &context, test_timeout_fn);
+        r = dispatch_timer_arm(&slot->timeout, 1000 * 1000);
+        assert(!r);
+        assert(dispatch_timer_is_armed(&slot->timeout));
+
+        reply_slot_free(slot);
+        reply_owner_deinit(&owner);
+        reply_registry_deinit(&registry);
+}
+
 int main(int argc, char **argv) {
         test_basic();
+        test_many();
+        test_timeout();
 
         return 0;
 }
@@ -0,0 +1,152 @@
+/*
+ * Test Traffic Accounting
+ */
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bus/traffic.h"
+
+static TrafficEntry *test_lookup(TrafficRegistry *registry, const char *interface, const char *member) {
+        TrafficEntry *entry;
+
+        c_rbtree_for_each_entry(entry, &registry->entry_tree, registry_node)
+                if (!strcmp(entry->interface, interface) && !strcmp(entry->member, member))
+                        return entry;
+
+        return NULL;
+}
+
+static void test_basic(void) {
+        TrafficRegistry registry;
+        TrafficEntry *entry;
+        int r;
+
+        traffic_registry_init(&registry);
+
+        /* disabled registries must not account anything */
+        r = traffic_registry_account(&registry, "org.example.Foo", "Bar", 1, 64, 1000);
+        assert(!r);
+        assert(!registry.n_entries);
+        assert(c_rbtree_is_empty(&registry.entry_tree));
+
+        registry.enabled = true;
+        assert(traffic_registry_is_enabled(&registry));
+
+        r = traffic_registry_account(&registry, "org.example.Foo", "Bar", 1, 64, 1000);
+        assert(!r);
+        r = traffic_registry_account(&registry, "org.example.Foo", "Bar", 1, 32, 500);
+        assert(!r);
+        r = traffic_registry_account(&registry, "org.example.Foo", "Baz", 1, 16, 100);
+        assert(!r);
+        r = traffic_registry_account(&registry, NULL, "Bar", 1, 8, 10);
+        assert(!r);
+        assert(registry.n_entries == 3);
+
+        entry = test_lookup(&registry, "org.example.Foo", "Bar");
+        assert(entry);
+        assert(entry->counters.n_messages == 2);
+        assert(entry->counters.n_bytes == 96);
+        assert(entry->counters.n_dispatch_nsec == 1500);
+
+        entry = test_lookup(&registry, "org.example.Foo", "Baz");
+        assert(entry);
+        assert(entry->counters.n_messages == 1);
+        assert(entry->counters.n_bytes == 16);
+
+        /* messages without interface are accounted on the empty interface */
+        entry = test_lookup(&registry, "", "Bar");
+        assert(entry);
+        assert(entry->counters.n_messages == 1);
+        assert(entry->counters.n_bytes == 8);
+
+        assert(!registry.overflow.n_messages);
+
+        traffic_registry_deinit(&registry);
+        assert(!registry.n_entries);
+}
+
+static void test_heavy_hitters(void) {
+        TrafficRegistry registry;
+        const char *interface, *member;
+        uint64_t sender_id;
+        bool found = false;
+        size_t i;
+        int r;
+
+        traffic_registry_init(&registry);
+        registry.enabled = true;
+
+        for (i = 0; i < 16; ++i) {
+                r = traffic_registry_account(&registry, "org.example.Foo", "Bar", 7, 1, 1);
+                assert(!r);
+        }
+
+        r = traffic_registry_account(&registry, "org.example.Foo", "Bar", 9, 1, 1);
+        assert(!r);
+
+        /* the same member is tracked separately for each sender */
+        assert(registry.heavy_hitters.n_top == 2);
+
+        for (i = 0; i < registry.heavy_hitters.n_top; ++i) {
+                traffic_read_heavy_hitter(&registry.heavy_hitters.top[i], &interface, &member, &sender_id);
+                assert(!strcmp(interface, "org.example.Foo"));
+                assert(!strcmp(member, "Bar"));
+
+                if (sender_id == 7) {
+                        assert(registry.heavy_hitters.top[i].count == 16);
+                        found = true;
+                } else {
+                        assert(sender_id == 9);
+                        assert(registry.heavy_hitters.top[i].count == 1);
+                }
+        }
+        assert(found);
+
+        traffic_registry_deinit(&registry);
+        assert(!registry.heavy_hitters.n_top);
+}
+
+static void test_overflow(void) {
+        TrafficRegistry registry;
+        char member[32];
+        size_t i;
+        int r;
+
+        /*
+         * Fill the registry beyond its bound and verify all excess traffic
+         * ends up on the overflow counters, while known entries are still
+         * accounted individually.
+         */
+
+        traffic_registry_init(&registry);
+        registry.enabled = true;
+
+        for (i = 0; i < TRAFFIC_ENTRIES_MAX + 16; ++i) {
+                r = snprintf(member, sizeof(member), "Member%zu", i);
+                assert(r > 0 && r < (int)sizeof(member));
+
+                r = traffic_registry_account(&registry, "org.example.Foo", member, 1, 1, 1);
+                assert(!r);
+        }
+
+        assert(registry.n_entries == TRAFFIC_ENTRIES_MAX);
+        assert(registry.overflow.n_messages == 16);
+        assert(registry.overflow.n_bytes == 16);
+
+        r = traffic_registry_account(&registry, "org.example.Foo", "Member0", 1, 1, 1);
+        assert(!r);
+        assert(test_lookup(&registry, "org.example.Foo", "Member0")->counters.n_messages == 2);
+        assert(registry.overflow.n_messages == 16);
+
+        traffic_registry_deinit(&registry);
+}
+
+int main(int argc, char **argv) {
+        test_basic();
+        test_heavy_hitters();
+        test_overflow();
+        return 0;
+}
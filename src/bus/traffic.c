@@ -0,0 +1,182 @@
+/*
+ * Traffic Accounting
+ *
+ * A traffic registry counts the messages, bytes, and dispatch time of all
+ * method calls and signals on a bus, grouped by their interface and member.
+ * This allows tools to tell which interfaces cause the load on a bus, rather
+ * than only which peers do.
+ *
+ * Accounting costs a tree lookup per message, hence it is disabled until a
+ * tool asks for the counters for the first time. Furthermore, the number of
+ * entries is bounded, since interface and member names are chosen by the
+ * peers. Once the bound is reached, traffic of any new interface and member
+ * pair is accounted on a shared overflow entry.
+ *
+ * Exact counters per sender would multiply the number of entries by the
+ * number of peers. Instead, messages are also added to a heavy-hitter sketch,
+ * keyed by interface, member, and sender. It needs a fixed amount of memory,
+ * and it yields the senders of the most frequent interface and member pairs,
+ * with an estimate of their message counts. See util/sketch.c for details.
+ */
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bus/traffic.h"
+#include "util/error.h"
+#include "util/sketch.h"
+
+typedef struct TrafficKey TrafficKey;
+
+struct TrafficKey {
+        const char *interface;
+        const char *member;
+};
+
+static int traffic_entry_compare(CRBTree *tree, void *k, CRBNode *rb) {
+        TrafficEntry *entry = c_container_of(rb, TrafficEntry, registry_node);
+        TrafficKey *key = k;
+        int r;
+
+        r = strcmp(key->interface, entry->interface);
+        if (r)
+                return r;
+
+        return strcmp(key->member, entry->member);
+}
+
+static int traffic_entry_new(TrafficEntry **entryp, TrafficKey *key) {
+        TrafficEntry *entry;
+        size_t n_interface, n_member;
+
+        n_interface = strlen(key->interface) + 1;
+        n_member = strlen(key->member) + 1;
+
+        entry = calloc(1, sizeof(*entry) + n_interface + n_member);
+        if (!entry)
+                return error_origin(-ENOMEM);
+
+        entry->registry_node = (CRBNode)C_RBNODE_INIT(entry->registry_node);
+        memcpy(entry->interface, key->interface, n_interface);
+        memcpy(entry->interface + n_interface, key->member, n_member);
+        entry->member = entry->interface + n_interface;
+
+        *entryp = entry;
+        return 0;
+}
+
+/**
+ * traffic_registry_init() - initialize traffic registry
+ * @registry:           registry to operate on
+ *
+ * This initializes a new, empty, and disabled traffic registry.
+ */
+void traffic_registry_init(TrafficRegistry *registry) {
+        *registry = (TrafficRegistry)TRAFFIC_REGISTRY_INIT;
+}
+
+/**
+ * traffic_registry_deinit() - destroy traffic registry
+ * @registry:           registry to operate on
+ *
+ * This releases all entries of @registry.
+ */
+void traffic_registry_deinit(TrafficRegistry *registry) {
+        TrafficEntry *entry, *safe;
+
+        c_rbtree_for_each_entry_unlink(entry, safe, &registry->entry_tree, registry_node)
+                free(entry);
+
+        sketch_deinit(&registry->heavy_hitters);
+        traffic_registry_init(registry);
+}
+
+/**
+ * traffic_registry_account() - account a message
+ * @registry:           registry to operate on
+ * @interface:          interface of the message, or NULL
+ * @member:             member of the message
+ * @sender_id:          ID of the sending peer
+ * @n_bytes:            size of the message
+ * @n_dispatch_nsec:    time spent dispatching the message
+ *
+ * This adds a message to the counters of its interface and member, and to
+ * the heavy-hitter sketch. If the registry is disabled, this is a no-op.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int traffic_registry_account(TrafficRegistry *registry,
+                             const char *interface,
+                             const char *member,
+                             uint64_t sender_id,
+                             uint64_t n_bytes,
+                             uint64_t n_dispatch_nsec) {
+        TrafficKey key = { .interface = interface ?: "", .member = member };
+        char buffer[2 * (TRAFFIC_NAME_MAX + 1) + sizeof(sender_id)];
+        size_t n_interface, n_member;
+        TrafficCounters *counters;
+        CRBNode **slot, *parent;
+        TrafficEntry *entry;
+        int r;
+
+        if (!registry->enabled)
+                return 0;
+
+        n_interface = strlen(key.interface) + 1;
+        n_member = strlen(key.member) + 1;
+        if (_c_likely_(n_interface + n_member + sizeof(sender_id) <= sizeof(buffer))) {
+                memcpy(buffer, key.interface, n_interface);
+                memcpy(buffer + n_interface, key.member, n_member);
+                memcpy(buffer + n_interface + n_member, &sender_id, sizeof(sender_id));
+
+                r = sketch_add(&registry->heavy_hitters, buffer, n_interface + n_member + sizeof(sender_id), 1);
+                if (r)
+                        return error_fold(r);
+        }
+
+        slot = c_rbtree_find_slot(&registry->entry_tree, traffic_entry_compare, &key, &parent);
+        if (!slot) {
+                counters = &c_container_of(parent, TrafficEntry, registry_node)->counters;
+        } else if (registry->n_entries >= TRAFFIC_ENTRIES_MAX) {
+                counters = &registry->overflow;
+        } else {
+                r = traffic_entry_new(&entry, &key);
+                if (r)
+                        return error_trace(r);
+
+                c_rbtree_add(&registry->entry_tree, parent, slot, &entry->registry_node);
+                ++registry->n_entries;
+                counters = &entry->counters;
+        }
+
+        ++counters->n_messages;
+        counters->n_bytes += n_bytes;
+        counters->n_dispatch_nsec += n_dispatch_nsec;
+
+        return 0;
+}
+
+/**
+ * traffic_read_heavy_hitter() - decode heavy hitter
+ * @entry:              heavy-hitter entry of a traffic registry
+ * @interfacep:         output argument for the interface
+ * @memberp:            output argument for the member
+ * @sender_idp:         output argument for the sender ID
+ *
+ * This decodes the key of a heavy hitter, as stored by
+ * traffic_registry_account(). The returned strings point into @entry, and
+ * remain valid until the next call to traffic_registry_account().
+ */
+void traffic_read_heavy_hitter(SketchEntry *entry,
+                               const char **interfacep,
+                               const char **memberp,
+                               uint64_t *sender_idp) {
+        size_t n_interface;
+
+        n_interface = strlen(entry->key) + 1;
+
+        *interfacep = entry->key;
+        *memberp = entry->key + n_interface;
+        memcpy(sender_idp, entry->key + entry->n_key - sizeof(*sender_idp), sizeof(*sender_idp));
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+/*
+ * Traffic Accounting
+ */
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <stdlib.h>
+#include "util/sketch.h"
+
+typedef struct TrafficCounters TrafficCounters;
+typedef struct TrafficEntry TrafficEntry;
+typedef struct TrafficRegistry TrafficRegistry;
+
+#define TRAFFIC_ENTRIES_MAX (4096UL) /* bounds memory against made-up names, the rest is counted as overflow */
+#define TRAFFIC_NAME_MAX (255UL) /* interface and member names are limited by the spec */
+
+struct TrafficCounters {
+        uint64_t n_messages;
+        uint64_t n_bytes;
+        uint64_t n_dispatch_nsec;
+};
+
+struct TrafficEntry {
+        CRBNode registry_node;
+        TrafficCounters counters;
+        const char *member;
+        char interface[];
+};
+
+struct TrafficRegistry {
+        CRBTree entry_tree;
+        size_t n_entries;
+        TrafficCounters overflow;
+        Sketch heavy_hitters;
+        bool enabled : 1;
+};
+
+#define TRAFFIC_REGISTRY_INIT {                                                 \
+                .entry_tree = C_RBTREE_INIT,                                    \
+                .heavy_hitters = SKETCH_INIT,                                   \
+        }
+
+void traffic_registry_init(TrafficRegistry *registry);
+void traffic_registry_deinit(TrafficRegistry *registry);
+
+int traffic_registry_account(TrafficRegistry *registry,
+                             const char *interface,
+                             const char *member,
+                             uint64_t sender_id,
+                             uint64_t n_bytes,
+                             uint64_t n_dispatch_nsec);
+void traffic_read_heavy_hitter(SketchEntry *entry,
+                               const char **interfacep,
+                               const char **memberp,
+                               uint64_t *sender_idp);
+
+/* inline helpers */
+
+static inline bool traffic_registry_is_enabled(TrafficRegistry *registry) {
+        return registry->enabled;
+}
@@ -0,0 +1,193 @@
+/*
+ * Benchmark D-Bus Message Parsing
+ */
+
+#include <c-dvar.h>
+#include <c-dvar-type.h>
+#include <c-macro.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dbus/message.h"
+#include "dbus/protocol.h"
+
+#define BENCH_NSEC_MIN (UINT64_C(100) * 1000 * 1000)
+
+static uint64_t bench_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, size_t n_data, size_t n_ops, uint64_t nsec) {
+        printf("{ \"benchmark\": \"%s\", \"bytes\": %zu, \"operations\": %zu, \"nsec\": %llu, \"nsec_per_op\": %llu }\n",
+               name,
+               n_data,
+               n_ops,
+               (unsigned long long)nsec,
+               (unsigned long long)(n_ops ? nsec / n_ops : 0));
+        fflush(stdout);
+}
+
+static void bench_message_new_call(void **datap, size_t *n_datap) {
+        static const CDVarType type[] = {
+                C_DVAR_T_INIT(
+                        C_DVAR_T_TUPLE2(
+                                C_DVAR_T_TUPLE7(
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_u,
+                                        C_DVAR_T_u,
+                                        C_DVAR_T_ARRAY(
+                                                C_DVAR_T_TUPLE2(
+                                                        C_DVAR_T_y,
+                                                        C_DVAR_T_v
+                                                )
+                                        )
+                                ),
+                                C_DVAR_T_TUPLE2(
+                                        C_DVAR_T_s,
+                                        C_DVAR_T_u
+                                )
+                        )
+                )
+        };
+        _c_cleanup_(c_dvar_deinit) CDVar v = C_DVAR_INIT;
+        int r;
+
+        /* a typical method call on a well-known name, with small arguments */
+
+        c_dvar_begin_write(&v, type, 1);
+
+        c_dvar_write(&v, "((yyyyuu[(y<s>)(y<o>)(y<s>)(y<s>)(y<g>)])(su))",
+                     c_dvar_is_big_endian(&v) ? 'B' : 'l',
+                     DBUS_MESSAGE_TYPE_METHOD_CALL,
+                     0, 1, 0, 1,
+                     DBUS_MESSAGE_FIELD_DESTINATION, c_dvar_type_s, "org.bus1.Bench",
+                     DBUS_MESSAGE_FIELD_PATH, c_dvar_type_o, "/org/bus1/Bench",
+                     DBUS_MESSAGE_FIELD_INTERFACE, c_dvar_type_s, "org.bus1.Bench",
+                     DBUS_MESSAGE_FIELD_MEMBER, c_dvar_type_s, "Method",
+                     DBUS_MESSAGE_FIELD_SIGNATURE, c_dvar_type_g, "su",
+                     "org.bus1.Bench.Argument", 71);
+
+        r = c_dvar_end_write(&v, datap, n_datap);
+        assert(!r);
+}
+
+static void bench_message_new_signal(void **datap, size_t *n_datap) {
+        static const CDVarType type[] = {
+                C_DVAR_T_INIT(
+                        C_DVAR_T_TUPLE2(
+                                C_DVAR_T_TUPLE7(
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_y,
+                                        C_DVAR_T_u,
+                                        C_DVAR_T_u,
+                                        C_DVAR_T_ARRAY(
+                                                C_DVAR_T_TUPLE2(
+                                                        C_DVAR_T_y,
+                                                        C_DVAR_T_v
+                                                )
+                                        )
+                                ),
+                                C_DVAR_T_TUPLE3(
+                                        C_DVAR_T_s,
+                                        C_DVAR_T_ARRAY(
+                                                C_DVAR_T_PAIR(
+                                                        C_DVAR_T_s,
+                                                        C_DVAR_T_v
+                                                )
+                                        ),
+                                        C_DVAR_T_ARRAY(
+                                                C_DVAR_T_s
+                                        )
+                                )
+                        )
+                )
+        };
+        _c_cleanup_(c_dvar_deinit) CDVar v = C_DVAR_INIT;
+        char buffer[64];
+        size_t i;
+        int r;
+
+        /* a PropertiesChanged broadcast with a set of changed properties */
+
+        c_dvar_begin_write(&v, type, 1);
+
+        c_dvar_write(&v, "((yyyyuu[(y<o>)(y<s>)(y<s>)(y<g>)])(s[",
+                     c_dvar_is_big_endian(&v) ? 'B' : 'l',
+                     DBUS_MESSAGE_TYPE_SIGNAL,
+                     0, 1, 0, 1,
+                     DBUS_MESSAGE_FIELD_PATH, c_dvar_type_o, "/org/bus1/Bench",
+                     DBUS_MESSAGE_FIELD_INTERFACE, c_dvar_type_s, "org.freedesktop.DBus.Properties",
+                     DBUS_MESSAGE_FIELD_MEMBER, c_dvar_type_s, "PropertiesChanged",
+                     DBUS_MESSAGE_FIELD_SIGNATURE, c_dvar_type_g, "sa{sv}as",
+                     "org.bus1.Bench");
+
+        for (i = 0; i < 16; ++i) {
+                r = snprintf(buffer, sizeof(buffer), "Property%zu", i);
+                assert(r > 0 && r < (int)sizeof(buffer));
+
+                c_dvar_write(&v, "{s<u>}", buffer, c_dvar_type_u, (uint32_t)i);
+        }
+
+        c_dvar_write(&v, "][]))");
+
+        r = c_dvar_end_write(&v, datap, n_datap);
+        assert(!r);
+}
+
+static void bench_message(const char *name, void (*fn)(void **datap, size_t *n_datap), bool with_body) {
+        _c_cleanup_(c_freep) void *data = NULL;
+        size_t n_data, n_iterations = 0;
+        uint64_t ts, now;
+        int r;
+
+        fn(&data, &n_data);
+
+        ts = bench_now();
+
+        do {
+                _c_cleanup_(message_unrefp) Message *m = NULL;
+                void *copy;
+
+                copy = malloc(n_data);
+                assert(copy);
+                memcpy(copy, data, n_data);
+
+                /* consumes @copy */
+                r = message_new_outgoing(&m, copy, n_data);
+                assert(!r);
+
+                r = message_parse_metadata(m);
+                assert(!r);
+
+                if (with_body) {
+                        r = message_parse_body(m);
+                        assert(!r);
+                }
+
+                ++n_iterations;
+                now = bench_now();
+        } while (now - ts < BENCH_NSEC_MIN);
+
+        bench_report(name, n_data, n_iterations, now - ts);
+}
+
+int main(int argc, char **argv) {
+        bench_message("message-parse-call", bench_message_new_call, false);
+        bench_message("message-parse-signal", bench_message_new_signal, false);
+        bench_message("message-parse-signal-body", bench_message_new_signal, true);
+
+        return 0;
+}
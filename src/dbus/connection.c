@@ -6,11 +6,13 @@
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "dbus/connection.h"
 #include "dbus/message.h"
 #include "dbus/socket.h"
 #include "util/dispatch.h"
 #include "util/error.h"
+#include "util/serialize.h"
 #include "util/user.h"
 
 static int connection_init(Connection *c,
@@ -33,6 +35,8 @@ static int connection_init(Connection *c,
         if (r)
                 return error_fold(r);
 
+        connection->socket.file = &connection->socket_file;
+
         connection = NULL;
         return 0;
 }
@@ -90,6 +94,7 @@ int connection_init_client(Connection *c,
 void connection_deinit(Connection *connection) {
         sasl_client_deinit(&connection->sasl_client);
         sasl_server_deinit(&connection->sasl_server);
+        dispatch_file_deinit(&connection->shm_file);
         dispatch_file_deinit(&connection->socket_file);
         socket_deinit(&connection->socket);
 }
@@ -212,42 +217,221 @@ int connection_dispatch(Connection *connection, uint32_t events) {
         return 0;
 }
 
+static int connection_dispatch_shm(DispatchFile *file) {
+        Connection *connection = c_container_of(file, Connection, shm_file);
+        int r;
+
+        r = socket_dispatch_shm(&connection->socket);
+        if (r)
+                return error_fold(r);
+
+        /*
+         * The peer wakes us up if it wrote to an empty ring, or released
+         * space in a full one. Either way, the rings are handled as part of
+         * the socket, so make the socket dispatch both directions.
+         */
+        dispatch_file_clear(file, EPOLLIN);
+        dispatch_file_raise(&connection->socket_file, EPOLLIN | EPOLLOUT);
+        return 0;
+}
+
 /**
- * connection_dequeue() - XXX
+ * connection_open_shm() - set up a shared-memory transport
+ * @connection:         connection to operate on
+ * @memfdp:             output argument for the memfd of the rings
+ * @wake_fdp:           output argument for the wake-up socket of the peer
+ *
+ * This sets up a shared-memory transport for @connection, and starts
+ * listening for wake-ups of the peer. The returned file-descriptors are owned
+ * by the caller, and must be handed to the peer in the very next message
+ * queued on @connection. See socket_open_shm() for details.
+ *
+ * Return: 0 on success, CONNECTION_E_QUOTA if the quota failed, negative
+ *         error code on failure.
  */
-int connection_dequeue(Connection *connection, Message **messagep) {
+int connection_open_shm(Connection *connection, int *memfdp, int *wake_fdp) {
+        int r, memfd, wake_fd;
+
+        r = socket_open_shm(&connection->socket, &memfd, &wake_fd);
+        if (r)
+                return (r == SOCKET_E_QUOTA) ? CONNECTION_E_QUOTA : error_fold(r);
+
+        r = dispatch_file_init(&connection->shm_file,
+                               connection->socket_file.context,
+                               connection_dispatch_shm,
+                               connection->socket.shm->wake_fd,
+                               EPOLLIN,
+                               0);
+        if (r) {
+                close(wake_fd);
+                close(memfd);
+                return error_fold(r);
+        }
+
+        dispatch_file_select(&connection->shm_file, EPOLLIN);
+
+        *memfdp = memfd;
+        *wake_fdp = wake_fd;
+        return 0;
+}
+
+/**
+ * connection_authenticate() - run the SASL exchange on queued input
+ * @connection:         connection to operate on
+ *
+ * This feeds all queued input lines to the SASL exchange, until either the
+ * connection is authenticated, or no more input is queued. No messages are
+ * dequeued. Callers can check @connection->authenticated afterwards.
+ *
+ * Clients usually pipeline the entire exchange and their first messages into
+ * a single write. All of it is handled on the same read: the SASL replies are
+ * appended to a single line buffer, and any messages dequeued right after are
+ * queued behind it, so everything is answered in a single write as well.
+ *
+ * Return: 0 on success, CONNECTION_E_EOF if the connection hung up, negative
+ *         error code on failure.
+ */
+int connection_authenticate(Connection *connection) {
         const char *input;
         size_t n_input;
         int r;
 
+        while (!connection->authenticated) {
+                r = socket_dequeue_line(&connection->socket, &input, &n_input);
+                if (r)
+                        return (r == SOCKET_E_EOF) ? CONNECTION_E_EOF : error_fold(r);
+
+                if (!input)
+                        return 0;
+
+                r = connection_feed_sasl(connection, input, n_input);
+                if (r)
+                        return error_trace(r);
+        }
+
+        return 0;
+}
+
+/**
+ * connection_dequeue() - XXX
+ */
+int connection_dequeue(Connection *connection, Message **messagep) {
+        int r;
+
         if (_c_unlikely_(!connection->authenticated)) {
-                do {
-                        r = socket_dequeue_line(&connection->socket, &input, &n_input);
-                        if (r)
-                                return (r == SOCKET_E_EOF) ? CONNECTION_E_EOF : error_fold(r);
-
-                        if (!input) {
-                                *messagep = NULL;
-                                return 0;
-                        }
-
-                        r = connection_feed_sasl(connection, input, n_input);
-                        if (r)
-                                return error_trace(r);
-                } while (!connection->authenticated);
+                r = connection_authenticate(connection);
+                if (r)
+                        return error_trace(r);
+
+                if (!connection->authenticated) {
+                        *messagep = NULL;
+                        return 0;
+                }
         }
 
         r = socket_dequeue(&connection->socket, messagep);
+        if (r == SOCKET_E_ADMISSION)
+                return CONNECTION_E_ADMISSION;
+
         return (r == SOCKET_E_EOF) ? CONNECTION_E_EOF : error_fold(r);
 }
 
+/**
+ * connection_admit() - decide on pending message
+ * @connection:         connection to operate on
+ * @admit:              whether to admit the message
+ *
+ * This must be called after connection_dequeue() returned
+ * CONNECTION_E_ADMISSION. See socket_admit() for details.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int connection_admit(Connection *connection, bool admit) {
+        return error_fold(socket_admit(&connection->socket, admit));
+}
+
+/**
+ * connection_check_quota() - check whether a message could be queued
+ * @connection:         connection to operate on
+ * @user:               user to charge as
+ * @message:            message to check
+ *
+ * See socket_check_quota() for details.
+ *
+ * Return: 0 on success, CONNECTION_E_QUOTA if quota failed, negative error
+ *         code on failure.
+ */
+int connection_check_quota(Connection *connection, User *user, Message *message) {
+        int r;
+
+        r = socket_check_quota(&connection->socket, user, message);
+        if (r)
+                return (r == SOCKET_E_QUOTA) ? CONNECTION_E_QUOTA : error_fold(r);
+
+        return 0;
+}
+
+static int connection_queue_internal(Connection *connection, User *user, Message *message, bool coalesce, SocketSupersedeFn fn) {
+        int r;
+
+        if (coalesce)
+                r = socket_queue_coalesce(&connection->socket, user, message, fn);
+        else
+                r = socket_queue(&connection->socket, user, message);
+        if (r == SOCKET_E_QUOTA)
+                return CONNECTION_E_QUOTA;
+        else if (r == SOCKET_E_SHUTDOWN)
+                return 0;
+        else if (r)
+                return error_fold(r);
+
+        dispatch_file_select(&connection->socket_file, EPOLLOUT);
+        return 0;
+}
+
 /**
  * connection_queue() - XXX
  */
 int connection_queue(Connection *connection, User *user, Message *message) {
+        return connection_queue_internal(connection, user, message, false, NULL);
+}
+
+/**
+ * connection_queue_coalesce() - queue message, replacing superseded ones
+ * @connection:         connection to operate on
+ * @user:               user to charge as
+ * @message:            message to queue
+ * @fn:                 callback to confirm superseded messages, or NULL
+ *
+ * This is like connection_queue(), but drops queued messages that are
+ * superseded by @message. See socket_queue_coalesce() for details.
+ *
+ * Return: 0 on success, CONNECTION_E_QUOTA if quota failed, negative error
+ *         code on failure.
+ */
+int connection_queue_coalesce(Connection *connection, User *user, Message *message, SocketSupersedeFn fn) {
+        return connection_queue_internal(connection, user, message, true, fn);
+}
+
+/**
+ * connection_queue_batch() - queue multiple messages at once
+ * @connection:         connection to operate on
+ * @user:               user to charge as
+ * @messages:           messages to queue
+ * @n_messages:         number of messages to queue
+ *
+ * This is like calling connection_queue() for each message in @messages, but
+ * the quota is charged for all messages at once, and the connection is only
+ * scheduled for writing once. Either all messages are queued, or none. See
+ * socket_queue_batch() for details.
+ *
+ * Return: 0 on success, CONNECTION_E_QUOTA if quota failed, negative error
+ *         code on failure.
+ */
+int connection_queue_batch(Connection *connection, User *user, Message **messages, size_t n_messages) {
         int r;
 
-        r = socket_queue(&connection->socket, user, message);
+        r = socket_queue_batch(&connection->socket, user, messages, n_messages);
         if (r == SOCKET_E_QUOTA)
                 return CONNECTION_E_QUOTA;
         else if (r == SOCKET_E_SHUTDOWN)
@@ -258,3 +442,66 @@ int connection_queue(Connection *connection, User *user, Message *message) {
         dispatch_file_select(&connection->socket_file, EPOLLOUT);
         return 0;
 }
+
+/**
+ * connection_serialize() - serialize server connection
+ * @connection:         connection to operate on
+ * @s:                  serializer to write to
+ *
+ * This serializes the state of the SASL exchange of @connection, followed by
+ * its socket. See socket_serialize() for details.
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int connection_serialize(Connection *connection, Serializer *s) {
+        int r;
+
+        assert(connection->server);
+
+        r = serializer_write_u32(s, connection->sasl_server.state);
+        if (r)
+                return error_trace(r);
+
+        return error_trace(socket_serialize(&connection->socket, s));
+}
+
+/**
+ * connection_deserialize() - deserialize server connection
+ * @connection:         connection to operate on
+ * @d:                  deserializer to read from
+ *
+ * This restores the state of a server connection, as serialized by
+ * connection_serialize() in another process. @connection must be freshly
+ * initialized, and not yet opened. Once opened, it continues where it left
+ * off in the other process.
+ *
+ * Return: 0 on success, CONNECTION_E_CORRUPT if the serialized data is
+ *         invalid, negative error code on failure.
+ */
+int connection_deserialize(Connection *connection, Deserializer *d) {
+        uint32_t state;
+        int r;
+
+        assert(connection->server);
+        assert(!connection->authenticated);
+
+        r = deserializer_read_u32(d, &state);
+        if (r)
+                return (r == SERIALIZE_E_EOF || r == SERIALIZE_E_CORRUPT) ? CONNECTION_E_CORRUPT : error_fold(r);
+
+        if (state > SASL_SERVER_STATE_NEGOTIATED_FDS)
+                return CONNECTION_E_CORRUPT;
+
+        connection->sasl_server.state = state;
+        connection->authenticated = sasl_server_is_done(&connection->sasl_server);
+
+        r = socket_deserialize(&connection->socket, d);
+        if (r)
+                return (r == SOCKET_E_CORRUPT) ? CONNECTION_E_CORRUPT : error_fold(r);
+
+        /* restored input and output is not signalled by the kernel */
+        dispatch_file_select(&connection->socket_file, EPOLLOUT);
+        dispatch_file_yield(&connection->socket_file);
+        return 0;
+}
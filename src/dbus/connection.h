@@ -12,7 +12,9 @@
 #include "util/dispatch.h"
 
 typedef struct Connection Connection;
+typedef struct Deserializer Deserializer;
 typedef struct Message Message;
+typedef struct Serializer Serializer;
 typedef struct User User;
 
 enum {
@@ -20,11 +22,14 @@ enum {
 
         CONNECTION_E_EOF,
         CONNECTION_E_QUOTA,
+        CONNECTION_E_CORRUPT,
+        CONNECTION_E_ADMISSION,
 };
 
 struct Connection {
         Socket socket;
         DispatchFile socket_file;
+        DispatchFile shm_file;
         SASLServer sasl_server;
         SASLClient sasl_client;
 
@@ -35,6 +40,7 @@ struct Connection {
 #define CONNECTION_NULL(_x) {                                           \
                 .socket = SOCKET_NULL((_x).socket),                     \
                 .socket_file = DISPATCH_FILE_NULL((_x).socket_file),    \
+                .shm_file = DISPATCH_FILE_NULL((_x).shm_file),          \
                 .sasl_server = SASL_SERVER_NULL,                        \
                 .sasl_client = SASL_CLIENT_NULL,                        \
         }
@@ -56,9 +62,18 @@ int connection_open(Connection *connection);
 void connection_shutdown(Connection *connection);
 void connection_close(Connection *connection);
 int connection_dispatch(Connection *connection, uint32_t events);
+int connection_open_shm(Connection *connection, int *memfdp, int *wake_fdp);
 
+int connection_authenticate(Connection *connection);
 int connection_dequeue(Connection *connection, Message **messagep);
+int connection_admit(Connection *connection, bool admit);
+int connection_check_quota(Connection *connection, User *user, Message *message);
 int connection_queue(Connection *connection, User *user, Message *message);
+int connection_queue_coalesce(Connection *connection, User *user, Message *message, SocketSupersedeFn fn);
+int connection_queue_batch(Connection *connection, User *user, Message **messages, size_t n_messages);
+
+int connection_serialize(Connection *connection, Serializer *s);
+int connection_deserialize(Connection *connection, Deserializer *d);
 
 C_DEFINE_CLEANUP(Connection *, connection_deinit);
 
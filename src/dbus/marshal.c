@@ -0,0 +1,176 @@
+/*
+ * D-Bus Specialized Marshalling
+ *
+ * The c-dvar writer is driven by runtime type descriptors, and grows its
+ * buffer as it goes. That is the right tool for arbitrary messages, but for
+ * the most frequent driver replies, which carry a single basic value, it is
+ * mostly overhead. This generates one writer per reply signature instead,
+ * which marshals the message with straight-line code.
+ *
+ * Each writer runs twice over the same code: first without a buffer, which
+ * only computes the exact size of the message, and then into a buffer of
+ * exactly that size. The header layout is fixed: reply-serial, sender,
+ * destination and signature, in that order, which is what the c-dvar based
+ * writers of the driver produce as well. The destination field is copied
+ * from the pre-encoded sender field of the receiving peer, see
+ * message_sender_init(), and only its field code is patched.
+ *
+ * Messages are always written in native endianness.
+ */
+
+#include <c-macro.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dbus/marshal.h"
+#include "dbus/message.h"
+#include "dbus/protocol.h"
+#include "util/error.h"
+
+typedef struct MarshalWriter MarshalWriter;
+
+struct MarshalWriter {
+        uint8_t *data;
+        size_t n_data;
+};
+
+#define MARSHAL_WRITER_INIT {}
+
+static void marshal_pad(MarshalWriter *w, size_t alignment) {
+        size_t n = C_ALIGN_TO(w->n_data, alignment) - w->n_data;
+
+        if (w->data)
+                memset(w->data + w->n_data, 0, n);
+        w->n_data += n;
+}
+
+static void marshal_bytes(MarshalWriter *w, const void *bytes, size_t n_bytes) {
+        if (w->data)
+                memcpy(w->data + w->n_data, bytes, n_bytes);
+        w->n_data += n_bytes;
+}
+
+static void marshal_u8(MarshalWriter *w, uint8_t v) {
+        marshal_bytes(w, &v, sizeof(v));
+}
+
+static void marshal_u32(MarshalWriter *w, uint32_t v) {
+        marshal_pad(w, sizeof(v));
+        marshal_bytes(w, &v, sizeof(v));
+}
+
+static void marshal_string(MarshalWriter *w, const char *string) {
+        size_t n_string = strlen(string);
+
+        marshal_u32(w, n_string);
+        marshal_bytes(w, string, n_string + 1);
+}
+
+static void marshal_signature(MarshalWriter *w, const char *signature) {
+        size_t n_signature = strlen(signature);
+
+        marshal_u8(w, n_signature);
+        marshal_bytes(w, signature, n_signature + 1);
+}
+
+static void marshal_field(MarshalWriter *w, uint8_t code, char type) {
+        marshal_pad(w, 8);
+        marshal_u8(w, code);
+        marshal_u8(w, 1);
+        marshal_u8(w, type);
+        marshal_u8(w, 0);
+}
+
+static void marshal_reply_header(MarshalWriter *w,
+                                 uint32_t reply_serial,
+                                 const char *sender,
+                                 const MessageSender *destination,
+                                 const char *signature) {
+        size_t offset, n_fields;
+
+        /* the body length is filled in by message_new_outgoing() */
+        marshal_u8(w, (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l');
+        marshal_u8(w, DBUS_MESSAGE_TYPE_METHOD_RETURN);
+        marshal_u8(w, DBUS_HEADER_FLAG_NO_REPLY_EXPECTED);
+        marshal_u8(w, 1);
+        marshal_u32(w, 0);
+        marshal_u32(w, (uint32_t)-1);
+        marshal_u32(w, 0);
+
+        marshal_field(w, DBUS_MESSAGE_FIELD_REPLY_SERIAL, 'u');
+        marshal_u32(w, reply_serial);
+
+        marshal_field(w, DBUS_MESSAGE_FIELD_SENDER, 's');
+        marshal_string(w, sender);
+
+        marshal_pad(w, 8);
+        offset = w->n_data;
+        marshal_bytes(w, destination->patches[__BYTE_ORDER == __BIG_ENDIAN], destination->n_field);
+        if (w->data)
+                w->data[offset] = DBUS_MESSAGE_FIELD_DESTINATION;
+
+        marshal_field(w, DBUS_MESSAGE_FIELD_SIGNATURE, 'g');
+        marshal_signature(w, signature);
+
+        n_fields = w->n_data - sizeof(MessageHeader);
+        if (w->data)
+                ((MessageHeader *)w->data)->n_fields = n_fields;
+
+        marshal_pad(w, 8);
+}
+
+static void marshal_body_b(MarshalWriter *w, bool value) {
+        marshal_u32(w, value);
+}
+
+static void marshal_body_s(MarshalWriter *w, const char *value) {
+        marshal_string(w, value);
+}
+
+static void marshal_body_u(MarshalWriter *w, uint32_t value) {
+        marshal_u32(w, value);
+}
+
+static int marshal_finish(Message **messagep, MarshalWriter *w) {
+        int r;
+
+        r = message_new_outgoing(messagep, w->data, w->n_data);
+        if (r) {
+                free(w->data);
+                return error_fold(r);
+        }
+
+        return 0;
+}
+
+#define MARSHAL_REPLY_DEFINE(_suffix, _signature, _type)                        \
+        int marshal_reply_##_suffix(Message **messagep,                         \
+                                    uint32_t reply_serial,                      \
+                                    const char *sender,                         \
+                                    const MessageSender *destination,           \
+                                    _type value) {                              \
+                MarshalWriter w = MARSHAL_WRITER_INIT;                          \
+                size_t n_data;                                                  \
+                int r;                                                          \
+                                                                                \
+                marshal_reply_header(&w, reply_serial, sender, destination, _signature); \
+                marshal_body_##_suffix(&w, value);                              \
+                                                                                \
+                n_data = w.n_data;                                              \
+                w = (MarshalWriter){ .data = malloc(n_data) };                  \
+                if (!w.data)                                                    \
+                        return error_origin(-ENOMEM);                           \
+                                                                                \
+                marshal_reply_header(&w, reply_serial, sender, destination, _signature); \
+                marshal_body_##_suffix(&w, value);                              \
+                assert(w.n_data == n_data);                                     \
+                                                                                \
+                r = marshal_finish(messagep, &w);                               \
+                if (r)                                                          \
+                        return error_trace(r);                                  \
+                                                                                \
+                return 0;                                                       \
+        }
+
+MARSHAL_REPLY_TYPES(MARSHAL_REPLY_DEFINE)
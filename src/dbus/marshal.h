@@ -0,0 +1,30 @@
+#pragma once
+
+/*
+ * D-Bus Specialized Marshalling
+ */
+
+#include <c-macro.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct Message Message;
+typedef struct MessageSender MessageSender;
+
+/*
+ * Method returns carrying a single basic value, one specialized writer is
+ * generated for each of them. Entries are `(suffix, signature, C type)'.
+ */
+#define MARSHAL_REPLY_TYPES(_)                                                  \
+        _(b, "b", bool)                                                         \
+        _(s, "s", const char *)                                                 \
+        _(u, "u", uint32_t)
+
+#define MARSHAL_REPLY_DECLARE(_suffix, _signature, _type)                       \
+        int marshal_reply_##_suffix(Message **messagep,                         \
+                                    uint32_t reply_serial,                      \
+                                    const char *sender,                         \
+                                    const MessageSender *destination,           \
+                                    _type value);
+
+MARSHAL_REPLY_TYPES(MARSHAL_REPLY_DECLARE)
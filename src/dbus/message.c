@@ -7,32 +7,76 @@
 #include <c-macro.h>
 #include <c-ref.h>
 #include <endian.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "dbus/message.h"
 #include "dbus/protocol.h"
 #include "util/fdlist.h"
 #include "util/error.h"
+#include "util/pool.h"
+
+/*
+ * Messages with small payloads are allocated at message rate. They are served
+ * from a pool, with room for MESSAGE_POOL_DATA_MAX bytes of inline data.
+ * Bigger messages are allocated individually. Messages with more than
+ * MESSAGE_MAP_MIN bytes of data get their data mapped separately, so it is
+ * returned to the kernel as soon as the message is released, rather than
+ * being retained by the allocator, and so parts of it can be released early
+ * (see message_release_body()).
+ */
+static Pool message_pool = POOL_INIT(message_pool,
+                                     "Message",
+                                     sizeof(Message) + MESSAGE_POOL_DATA_MAX,
+                                     MESSAGE_POOL_MAX);
+
+static MessageStats message_stats;
 
 static_assert(_DBUS_MESSAGE_FIELD_N <= 8 * sizeof(unsigned int), "Header fields exceed bitmap");
 
 static int message_new(Message **messagep, bool big_endian, size_t n_extra) {
         _c_cleanup_(message_unrefp) Message *message = NULL;
-
-        message = malloc(sizeof(*message) + c_align8(n_extra));
+        void *map = NULL;
+        bool pooled;
+
+        pooled = c_align8(n_extra) <= MESSAGE_POOL_DATA_MAX;
+        if (pooled) {
+                message = pool_alloc(&message_pool);
+        } else if (n_extra >= MESSAGE_MAP_MIN) {
+                map = mmap(NULL, n_extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (map == MAP_FAILED)
+                        return error_origin(-ENOMEM);
+
+                message = malloc(sizeof(*message));
+                if (!message)
+                        munmap(map, n_extra);
+        } else {
+                message = malloc(sizeof(*message) + c_align8(n_extra));
+        }
         if (!message)
                 return error_origin(-ENOMEM);
 
         message->n_refs = C_REF_INIT;
         message->big_endian = big_endian;
         message->allocated_data = false;
+        message->mapped_data = !!map;
+        message->pooled = pooled;
         message->parsed = false;
+        message->parsed_body = false;
+        message->invalid_body = false;
         message->sender_id = ADDRESS_ID_INVALID;
         message->fds = NULL;
+        message->shared = NULL;
         message->n_data = 0;
+        message->n_map = map ? n_extra : 0;
         message->n_copied = 0;
         message->n_header = 0;
         message->n_body = 0;
-        message->data = NULL;
+        message->n_memfd = 0;
+        message->n_released = 0;
+        message->data = map ?: (void *)(message + 1);
         message->header = NULL;
         message->metadata = (MessageMetadata){};
         message->body = NULL;
@@ -72,7 +116,6 @@ int message_new_incoming(Message **messagep, MessageHeader header) {
         message->n_data = n_data;
         message->n_header = n_header;
         message->n_body = n_body;
-        message->data = message + 1;
         message->header = (void *)message->data;
         message->body = message->data + c_align8(n_header);
         message->vecs[0] = (struct iovec){ message->header, c_align8(n_header) };
@@ -129,17 +172,143 @@ int message_new_outgoing(Message **messagep, void *data, size_t n_data) {
         return 0;
 }
 
+/**
+ * message_new_outgoing_shared() - create outgoing message with shared body
+ * @messagep:           output pointer to new message
+ * @data:               header of the message
+ * @n_data:             size of @data
+ * @shared:             message to share the body with
+ *
+ * This creates a new outgoing message with the header taken from @data, and
+ * the body taken from @shared. @data must contain a full header, including
+ * its trailing padding, but no body. Ownership of @data is transferred to the
+ * new message. A reference to @shared is taken, and its body is sent
+ * unchanged as body of the new message. This allows sending pre-serialized
+ * bodies to many peers, without copying or re-marshalling them.
+ *
+ * Note that the data of the new message is not contiguous, hence it cannot be
+ * parsed. It is meant for messages that are only ever sent.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int message_new_outgoing_shared(Message **messagep, void *data, size_t n_data, Message *shared) {
+        return message_new_outgoing_shared_prefix(messagep, data, n_data, shared, shared->n_body);
+}
+
+/**
+ * message_new_outgoing_shared_prefix() - create outgoing message with shared body prefix
+ * @messagep:           output pointer to new message
+ * @data:               header of the message
+ * @n_data:             size of @data
+ * @shared:             message to share the body with
+ * @n_body:             size of the body prefix to share
+ *
+ * This is the same as message_new_outgoing_shared(), but only shares the first
+ * @n_body bytes of the body of @shared. The caller must make sure this prefix
+ * is a valid body on its own, matching the signature in @data. This is useful
+ * if the arguments of a message start with the arguments of another.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int message_new_outgoing_shared_prefix(Message **messagep, void *data, size_t n_data, Message *shared, size_t n_body) {
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        MessageHeader *header = data;
+        uint64_t n_header;
+        int r;
+
+        assert(n_data >= sizeof(MessageHeader));
+        assert(!((unsigned long)data & 0x7));
+        assert((header->endian == 'B') == shared->big_endian);
+        assert(n_data == sizeof(MessageHeader) + c_align8(header->n_fields));
+        assert(n_body <= shared->n_body);
+
+        n_header = sizeof(MessageHeader) + header->n_fields;
+
+        header->n_body = n_body;
+
+        r = message_new(&message, (header->endian == 'B'), 0);
+        if (r)
+                return error_trace(r);
+
+        message->allocated_data = true;
+        message->shared = message_ref(shared);
+        message->n_data = n_data + n_body;
+        message->n_header = n_header;
+        message->n_body = n_body;
+        message->data = data;
+        message->header = (void *)message->data;
+        message->body = shared->body;
+        message->vecs[0] = (struct iovec){ message->header, c_align8(n_header) };
+        message->vecs[1] = (struct iovec){ NULL, 0 };
+        message->vecs[2] = (struct iovec){ NULL, 0 };
+        message->vecs[3] = (struct iovec){ message->body, message->n_body };
+
+        *messagep = message;
+        message = NULL;
+        return 0;
+}
+
 /* internal callback for message_unref() */
 void message_free(_Atomic unsigned long *n_refs, void *userdata) {
         Message *message = c_container_of(n_refs, Message, n_refs);
 
         if (message->allocated_data)
                 free(message->data);
+        else if (message->mapped_data)
+                munmap(message->data, message->n_map);
         fdlist_free(message->fds);
-        free(message);
+        message_unref(message->shared);
+
+        if (message->pooled)
+                pool_free(&message_pool, message);
+        else
+                free(message);
 }
 
-static int message_parse_header(Message *message, MessageMetadata *metadata) {
+static int message_check_header(MessageMetadata *metadata) {
+        unsigned int mask;
+
+        /*
+         * Check mandatory fields. That is, depending on the message types, all
+         * mandatory fields must be present.
+         */
+
+        switch (metadata->header.type) {
+        case DBUS_MESSAGE_TYPE_METHOD_CALL:
+                mask = (1U << DBUS_MESSAGE_FIELD_PATH) |
+                       (1U << DBUS_MESSAGE_FIELD_MEMBER);
+                break;
+        case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+                mask = (1U << DBUS_MESSAGE_FIELD_REPLY_SERIAL);
+                break;
+        case DBUS_MESSAGE_TYPE_ERROR:
+                mask = (1U << DBUS_MESSAGE_FIELD_ERROR_NAME) |
+                       (1U << DBUS_MESSAGE_FIELD_REPLY_SERIAL);
+                break;
+        case DBUS_MESSAGE_TYPE_SIGNAL:
+                mask = (1U << DBUS_MESSAGE_FIELD_PATH) |
+                       (1U << DBUS_MESSAGE_FIELD_INTERFACE) |
+                       (1U << DBUS_MESSAGE_FIELD_MEMBER);
+                break;
+        default:
+                mask = 0;
+                break;
+        }
+
+        if ((metadata->fields.available & mask) != mask)
+                return MESSAGE_E_INVALID_HEADER;
+
+        /*
+         * Fix up the signature. The DBus spec states that missing signatures
+         * should be treated as empty.
+         */
+
+        metadata->fields.signature = metadata->fields.signature ?: "";
+
+        return 0;
+}
+
+static int message_parse_header_generic(Message *message, MessageMetadata *metadata) {
         static const CDVarType type[] = {
                 C_DVAR_T_INIT(
                         C_DVAR_T_TUPLE7(
@@ -159,7 +328,6 @@ static int message_parse_header(Message *message, MessageMetadata *metadata) {
                 ), /* (yyyyuua(yv)) */
         };
         _c_cleanup_(c_dvar_deinit) CDVar v = C_DVAR_INIT;
-        unsigned int mask;
         uint8_t field;
         int r;
 
@@ -287,42 +455,9 @@ static int message_parse_header(Message *message, MessageMetadata *metadata) {
                 }
         }
 
-        /*
-         * Check mandatory fields. That is, depending on the message types, all
-         * mandatory fields must be present.
-         */
-
-        switch (metadata->header.type) {
-        case DBUS_MESSAGE_TYPE_METHOD_CALL:
-                mask = (1U << DBUS_MESSAGE_FIELD_PATH) |
-                       (1U << DBUS_MESSAGE_FIELD_MEMBER);
-                break;
-        case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-                mask = (1U << DBUS_MESSAGE_FIELD_REPLY_SERIAL);
-                break;
-        case DBUS_MESSAGE_TYPE_ERROR:
-                mask = (1U << DBUS_MESSAGE_FIELD_ERROR_NAME) |
-                       (1U << DBUS_MESSAGE_FIELD_REPLY_SERIAL);
-                break;
-        case DBUS_MESSAGE_TYPE_SIGNAL:
-                mask = (1U << DBUS_MESSAGE_FIELD_PATH) |
-                       (1U << DBUS_MESSAGE_FIELD_INTERFACE) |
-                       (1U << DBUS_MESSAGE_FIELD_MEMBER);
-                break;
-        default:
-                mask = 0;
-                break;
-        }
-
-        if ((metadata->fields.available & mask) != mask)
-                return MESSAGE_E_INVALID_HEADER;
-
-        /*
-         * Fix up the signature. The DBus spec states that missing signatures
-         * should be treated as empty.
-         */
-
-        metadata->fields.signature = metadata->fields.signature ?: "";
+        r = message_check_header(metadata);
+        if (r)
+                return error_trace(r);
 
         /*
          * Finish the variant parser. If anything went wobbly in between, we
@@ -340,7 +475,233 @@ static int message_parse_header(Message *message, MessageMetadata *metadata) {
         return 0;
 }
 
-static int message_parse_body(Message *message, MessageMetadata *metadata) {
+static const char message_field_types[_DBUS_MESSAGE_FIELD_N] = {
+        [DBUS_MESSAGE_FIELD_PATH]               = 'o',
+        [DBUS_MESSAGE_FIELD_INTERFACE]          = 's',
+        [DBUS_MESSAGE_FIELD_MEMBER]             = 's',
+        [DBUS_MESSAGE_FIELD_ERROR_NAME]         = 's',
+        [DBUS_MESSAGE_FIELD_REPLY_SERIAL]       = 'u',
+        [DBUS_MESSAGE_FIELD_DESTINATION]        = 's',
+        [DBUS_MESSAGE_FIELD_SENDER]             = 's',
+        [DBUS_MESSAGE_FIELD_SIGNATURE]          = 'g',
+        [DBUS_MESSAGE_FIELD_UNIX_FDS]           = 'u',
+};
+
+static bool message_fast_align(const uint8_t *data, size_t *posp, size_t alignment, size_t n_data) {
+        size_t pos = *posp, aligned = (pos + alignment - 1) & ~(alignment - 1);
+
+        if (aligned > n_data)
+                return false;
+
+        for ( ; pos < aligned; ++pos)
+                if (data[pos])
+                        return false;
+
+        *posp = aligned;
+        return true;
+}
+
+static bool message_fast_validate_string(const char *string, size_t n_string, char element) {
+        /*
+         * Only plain ASCII is accepted here, which is what all the names and
+         * paths in a header are restricted to, anyway. Anything else is left
+         * to the generic parser.
+         */
+        if (element == 'o')
+                return dbus_validate_path(string, n_string);
+        else
+                return dbus_validate_ascii(string, n_string);
+}
+
+static int message_fast_validate_signature(const char *signature, size_t n_signature, bool *validp) {
+        CDVarType *t, *types;
+        size_t i;
+        int r;
+
+        types = alloca(n_signature * sizeof(CDVarType));
+
+        for (i = 0; i < n_signature; i += types[i].length) {
+                t = types + i;
+                r = c_dvar_type_new_from_signature(&t, signature + i, n_signature - i);
+                if (r) {
+                        if (r < 0)
+                                return error_origin(r);
+
+                        *validp = false;
+                        return 0;
+                }
+        }
+
+        *validp = true;
+        return 0;
+}
+
+/*
+ * This is a specialized decoder for little-endian headers, which validates
+ * and extracts all known header fields in a single pass over the raw data.
+ * It only handles the common case: every field has a known code and carries
+ * the type mandated for it, and all strings are plain ASCII. Whenever it
+ * encounters anything else, including any kind of invalid data, it bails out
+ * and leaves the message to the generic parser. Hence, it never rejects a
+ * message on its own, and the generic parser remains the sole authority on
+ * what is invalid.
+ *
+ * Return: 0 if the header was parsed, MESSAGE_E_INVALID_HEADER if the generic
+ *         parser must be used, negative error code on failure.
+ */
+static int message_parse_header_fast(Message *message, MessageMetadata *metadata) {
+        const uint8_t *data = (const void *)message->header;
+        const MessageHeader *header = message->header;
+        size_t pos = sizeof(*header), n_data = message->n_header;
+        const char *string;
+        uint32_t length, value;
+        uint8_t field;
+        char element;
+        bool valid;
+        int r;
+
+        if (message->big_endian)
+                return MESSAGE_E_INVALID_HEADER;
+
+        metadata->header.type = header->type;
+        metadata->header.flags = header->flags;
+        metadata->header.version = header->version;
+        metadata->header.serial = le32toh(header->serial);
+
+        if (metadata->header.type == DBUS_MESSAGE_TYPE_INVALID ||
+            metadata->header.version != 1 ||
+            !metadata->header.serial)
+                return MESSAGE_E_INVALID_HEADER;
+
+        while (pos < n_data) {
+                /* every field is an 8-byte aligned pair of code and variant */
+                if (!message_fast_align(data, &pos, 8, n_data) || n_data - pos < 4)
+                        return MESSAGE_E_INVALID_HEADER;
+
+                field = data[pos];
+                if (field == DBUS_MESSAGE_FIELD_INVALID ||
+                    field >= _DBUS_MESSAGE_FIELD_N ||
+                    (metadata->fields.available & (1U << field)))
+                        return MESSAGE_E_INVALID_HEADER;
+
+                /* the variant signature must be the single expected type */
+                element = data[pos + 2];
+                if (data[pos + 1] != 1 || data[pos + 3] || element != message_field_types[field])
+                        return MESSAGE_E_INVALID_HEADER;
+
+                pos += 4;
+                metadata->fields.available |= 1U << field;
+
+                switch (element) {
+                case 'u':
+                        if (!message_fast_align(data, &pos, 4, n_data) || n_data - pos < 4)
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        memcpy(&value, data + pos, sizeof(value));
+                        value = le32toh(value);
+                        pos += 4;
+
+                        if (field == DBUS_MESSAGE_FIELD_REPLY_SERIAL) {
+                                if (!value)
+                                        return MESSAGE_E_INVALID_HEADER;
+
+                                metadata->fields.reply_serial = value;
+                        } else {
+                                if (value > fdlist_count(message->fds))
+                                        return MESSAGE_E_INVALID_HEADER;
+
+                                metadata->fields.unix_fds = value;
+                        }
+
+                        continue;
+
+                case 'g':
+                        length = data[pos];
+                        if (n_data - pos < (size_t)length + 2 || data[pos + 1 + length])
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        string = (const char *)data + pos + 1;
+                        if (!message_fast_validate_string(string, length, element))
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        r = message_fast_validate_signature(string, length, &valid);
+                        if (r)
+                                return error_trace(r);
+                        if (!valid)
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        metadata->fields.signature = string;
+                        pos += length + 2;
+                        continue;
+
+                default:
+                        if (!message_fast_align(data, &pos, 4, n_data) || n_data - pos < 4)
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        memcpy(&length, data + pos, sizeof(length));
+                        length = le32toh(length);
+                        if (n_data - pos - 4 < (size_t)length + 1 || data[pos + 4 + length])
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        string = (const char *)data + pos + 4;
+                        if (!message_fast_validate_string(string, length, element))
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        pos += 4 + length + 1;
+                        break;
+                }
+
+                switch (field) {
+                case DBUS_MESSAGE_FIELD_PATH:
+                        if (!strcmp(string, "/org/freedesktop/DBus/Local"))
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        metadata->fields.path = string;
+                        break;
+                case DBUS_MESSAGE_FIELD_INTERFACE:
+                        if (!strcmp(string, "org.freedesktop.DBus.Local"))
+                                return MESSAGE_E_INVALID_HEADER;
+
+                        metadata->fields.interface = string;
+                        break;
+                case DBUS_MESSAGE_FIELD_MEMBER:
+                        metadata->fields.member = string;
+                        break;
+                case DBUS_MESSAGE_FIELD_ERROR_NAME:
+                        metadata->fields.error_name = string;
+                        break;
+                case DBUS_MESSAGE_FIELD_DESTINATION:
+                        metadata->fields.destination = string;
+                        break;
+                case DBUS_MESSAGE_FIELD_SENDER:
+                        metadata->fields.sender = string;
+
+                        /* cache sender in case it needs to be stitched out */
+                        message->original_sender = (void *)string;
+                        break;
+                default:
+                        return error_origin(-ENOTRECOVERABLE);
+                }
+        }
+
+        return message_check_header(metadata);
+}
+
+static int message_parse_header(Message *message, MessageMetadata *metadata) {
+        int r;
+
+        r = message_parse_header_fast(message, metadata);
+        if (r != MESSAGE_E_INVALID_HEADER)
+                return error_trace(r);
+
+        /* start over with the generic parser */
+        *metadata = (MessageMetadata){};
+        message->original_sender = NULL;
+
+        return message_parse_header_generic(message, metadata);
+}
+
+static int message_parse_args(Message *message, MessageMetadata *metadata) {
         _c_cleanup_(c_dvar_deinit) CDVar v = C_DVAR_INIT;
         const char *signature = metadata->fields.signature;
         size_t i, n_signature, n_types;
@@ -398,14 +759,58 @@ static int message_parse_body(Message *message, MessageMetadata *metadata) {
         return 0;
 }
 
-/**
- * message_parse_metadata() - XXX
- */
-int message_parse_metadata(Message *message) {
+static int message_parse_memfds(Message *message) {
+        const int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+        struct stat st;
+        size_t i, n_memfd = 0;
+        int r, fd;
+
+        /*
+         * Large payloads can be passed as sealed memfds, rather than inline.
+         * They are forwarded like any other FD, but they pin their memory
+         * while queued, so their size is accounted separately. Only memfds
+         * sealed against any modification of their size and contents are
+         * considered, since only those guarantee that size is stable. Any
+         * other FD is just an FD.
+         */
+        for (i = 0; i < fdlist_count(message->fds); ++i) {
+                fd = fdlist_get(message->fds, i);
+
+                r = fcntl(fd, F_GET_SEALS);
+                if (r < 0) {
+                        if (errno == EINVAL)
+                                continue;
+
+                        return error_origin(-errno);
+                }
+
+                if ((r & seals) != seals)
+                        continue;
+
+                r = fstat(fd, &st);
+                if (r < 0)
+                        return error_origin(-errno);
+
+                n_memfd += st.st_size;
+        }
+
+        message->n_memfd = n_memfd;
+        return 0;
+}
+
+static int message_parse_fields(Message *message) {
         void *p;
         int r;
 
-        assert(!message->parsed);
+        /*
+         * Metadata of a peeked message is parsed again from scratch, since
+         * the parsers rely on it being cleared.
+         */
+        if (_c_unlikely_(message->peeked)) {
+                message->metadata = (MessageMetadata){};
+                message->original_sender = NULL;
+                message->peeked = false;
+        }
 
         /*
          * As first step, parse the static header and the dynamic header
@@ -424,16 +829,70 @@ int message_parse_metadata(Message *message) {
                 if (*(const uint8_t *)p)
                         return MESSAGE_E_INVALID_HEADER;
 
-        /*
-         * Now that the header is validated, we read through the message body.
-         * Again, this is required for compatibility with dbus-daemon(1), but
-         * also to fetch the arguments for match-filters used by eavesdropping
-         * and common broadcasts.
-         */
-        r = message_parse_body(message, &message->metadata);
+        return 0;
+}
+
+/**
+ * message_peek_metadata() - parse header of partial message
+ * @message:            message to operate on
+ *
+ * This parses the header fields of @message into its metadata, just like
+ * message_parse_metadata() does, but only requires the header and its
+ * padding to be received. The body and FDs are not looked at. The message is
+ * not marked as parsed, and message_parse_metadata() must still be called
+ * once the message was fully received. It parses the header again from
+ * scratch.
+ *
+ * Return: 0 on success, MESSAGE_E_INVALID_HEADER if the header is invalid,
+ *         negative error code on failure.
+ */
+int message_peek_metadata(Message *message) {
+        int r;
+
+        assert(!message->parsed);
+
+        r = message_parse_fields(message);
+        message->peeked = true;
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+/**
+ * message_parse_metadata() - parse and validate message header
+ * @message:            message to operate on
+ *
+ * This parses the header of @message into its metadata, and validates it
+ * fully: the fixed header, every header field, the mandatory fields of the
+ * message type, and the padding up to the body. Furthermore, the FDs are
+ * truncated to the announced count, and attached memfds are accounted.
+ *
+ * The body is not validated here. It is only parsed if the driver is the
+ * destination, which reads it as the arguments of the called method, or by
+ * message_parse_body() once a match rule with argument keys is evaluated
+ * against @message. All other messages are forwarded with their body
+ * unchecked, and it is up to their receivers to validate it, as they would
+ * for messages from a peer-to-peer connection.
+ *
+ * Return: 0 on success, MESSAGE_E_INVALID_HEADER if the header is invalid,
+ *         negative error code on failure.
+ */
+int message_parse_metadata(Message *message) {
+        int r;
+
+        assert(!message->parsed);
+
+        r = message_parse_fields(message);
         if (r)
                 return error_trace(r);
 
+        /*
+         * Note that the body is not parsed here. Its arguments are only
+         * needed for match-filters on arguments, so they are fetched lazily
+         * via message_parse_body(), if at all.
+         */
+
         /*
          * dbus-daemon(1) only ever fetches the correct number of FDs from its
          * stream. This violates the D-Bus specification, which requires FDs to
@@ -442,54 +901,125 @@ int message_parse_metadata(Message *message) {
          * rejecting if the requested count exceeds the passed count. However,
          * we always discard any remaining FDs silently.
          */
-        if (message->fds)
+        if (message->fds) {
                 fdlist_truncate(message->fds, message->metadata.fields.unix_fds);
 
+                r = message_parse_memfds(message);
+                if (r)
+                        return error_trace(r);
+        }
+
         message->parsed = true;
         return 0;
 }
 
 /**
- * message_stitch_sender() - stitch in new sender field
- * @message:                    message to operate on
- * @sender_id:                  sender id to stitch in
+ * message_parse_body() - parse body arguments
+ * @message:            message to operate on
  *
- * When the broker forwards messages, it needs to fill in the sender-field
- * reliably. Unfortunately, this requires modifying the fields-array of the
- * D-Bus header. Since we do not want to re-write the entire array, we allow
- * some stitching magic here to happen.
+ * This walks the body of @message and caches every string and object-path
+ * argument in the metadata, so match-filters can access them directly. This
+ * is done lazily, on the first request for the arguments, since most messages
+ * are never matched against rules with argument filters. The metadata must
+ * already have been parsed via message_parse_metadata().
  *
- * This means, we use some nice properties of tuple-arrays in the D-Bus
- * marshalling (namely, they're 8-byte aligned, thus statically discoverable
- * when we know the offset), and simply cut out the existing sender field and
- * append a new one.
+ * This can be called any number of times, the body is only parsed once. If
+ * the body is invalid, no arguments are cached.
  *
- * This function must not be called more than once on any message (it will
- * throw a fatal error). Furthermore, this will cut the message in parts, such
- * that it is no longer readable linearly. However, none of the fields are
- * relocated nor overwritten. That is, any cached pointer stays valid, though
- * maybe no longer part of the actual message.
+ * Return: 0 on success, MESSAGE_E_INVALID_BODY if the body is invalid, or a
+ *         negative error code on failure.
  */
-void message_stitch_sender(Message *message, uint64_t sender_id) {
-        size_t n, n_stitch, n_field, n_sender;
-        const char *sender;
-        void *end, *field;
+int message_parse_body(Message *message) {
+        int r;
+
+        assert(message->parsed);
+
+        if (message->parsed_body)
+                return message->invalid_body ? MESSAGE_E_INVALID_BODY : 0;
+
+        message->parsed_body = true;
+
+        r = message_parse_args(message, &message->metadata);
+        if (r) {
+                memset(message->metadata.args, 0, sizeof(message->metadata.args));
+
+                if (r < 0) {
+                        message->parsed_body = false;
+                        return error_trace(r);
+                }
+
+                message->invalid_body = true;
+                return MESSAGE_E_INVALID_BODY;
+        }
+
+        return 0;
+}
+
+static bool message_stitch_in_place(Message *message, const char *sender, size_t n_sender, size_t n_field) {
+        size_t n, n_header;
+        void *field;
+
+        n = strlen(message->original_sender);
+        field = message->original_sender - (1 + 3 + 4);
 
         /*
-         * Must not be called more than once. We reserve the 2 iovecs between
-         * the original header and body to stitch the sender field. The caller
-         * must have parsed the metadata before.
+         * If the existing sender field has the same length as the new one,
+         * the string can simply be overwritten. This covers clients that
+         * already provide their correct unique name.
          */
-        assert(message->parsed);
-        assert(!message->vecs[1].iov_base && !message->vecs[1].iov_len);
-        assert(!message->vecs[2].iov_base && !message->vecs[2].iov_len);
+        if (n == n_sender) {
+                memcpy(message->original_sender, sender, n_sender);
+                return true;
+        }
+
+        /*
+         * If the existing sender field is the last field, it can be rewritten
+         * in place as long as the header keeps its aligned size, since the
+         * body must stay where it is.
+         */
+        if (message->original_sender + n + 1 != (void *)message->header + message->n_header)
+                return false;
+
+        n_header = field - (void *)message->header + n_field;
+        if (c_align8(n_header) != c_align8(message->n_header))
+                return false;
+
+        if (message->big_endian)
+                memcpy(field + 4, (uint32_t[1]){ htobe32(n_sender) }, sizeof(uint32_t));
+        else
+                memcpy(field + 4, (uint32_t[1]){ htole32(n_sender) }, sizeof(uint32_t));
+        memcpy(field + 8, sender, n_sender + 1);
+        memset((void *)message->header + n_header, 0, c_align8(n_header) - n_header);
+
+        message->n_header = n_header;
+
+        if (message->big_endian)
+                message->header->n_fields = htobe32(message->n_header - sizeof(*message->header));
+        else
+                message->header->n_fields = htole32(message->n_header - sizeof(*message->header));
+
+        return true;
+}
+
+/**
+ * message_sender_init() - prepare sender field of a peer
+ * @sender:                     sender object to initialize
+ * @id:                         sender id
+ *
+ * This formats the unique name of @id and encodes it as `(yv)' sender field,
+ * for either endianness, ready to be stitched into messages via
+ * message_stitch_sender(). The sender id of a peer never changes, so callers
+ * are expected to do this once per peer rather than once per message.
+ */
+void message_sender_init(MessageSender *sender, uint64_t id) {
+        const char *name;
+        size_t i, n_stitch;
 
         /*
          * Convert the sender id to a unique name. This should never fail on
          * a valid sender id.
          */
-        sender = address_to_string(&(Address)ADDRESS_INIT_ID(sender_id));
-        message->sender_id = sender_id;
+        name = address_to_string(&(Address)ADDRESS_INIT_ID(id));
 
         /*
          * Calculate string, field, and buffer lengths. We need to possibly cut
@@ -513,18 +1043,94 @@ void message_stitch_sender(Message *message, uint64_t sender_id) {
          *             - sender string:             n
          *             - zero termination:          1
          */
-        n_sender = strlen(sender);
-        n_field = 1 + 3 + 4 + n_sender + 1;
-        n_stitch = c_align8(n_field);
+        *sender = (MessageSender)MESSAGE_SENDER_NULL;
+        sender->id = id;
+        sender->n_sender = strlen(name);
+        sender->n_field = 1 + 3 + 4 + sender->n_sender + 1;
+        n_stitch = c_align8(sender->n_field);
+
+        /*
+         * The patch buffers are pre-allocated. Verify their size is
+         * sufficient to hold the stitched sender.
+         */
+        assert(sender->n_sender <= ADDRESS_ID_STRING_MAX);
+        assert(n_stitch <= sizeof(sender->patches[0]));
+
+        /* fill in `(yv)' with sender and padding, index 1 is big-endian */
+        for (i = 0; i < C_ARRAY_SIZE(sender->patches); ++i) {
+                sender->patches[i][0] = DBUS_MESSAGE_FIELD_SENDER;
+                sender->patches[i][1] = 1;
+                sender->patches[i][2] = 's';
+                sender->patches[i][3] = 0;
+                if (i)
+                        memcpy(sender->patches[i] + 4, (uint32_t[1]){ htobe32(sender->n_sender) }, sizeof(uint32_t));
+                else
+                        memcpy(sender->patches[i] + 4, (uint32_t[1]){ htole32(sender->n_sender) }, sizeof(uint32_t));
+                memcpy(sender->patches[i] + 8, name, sender->n_sender + 1);
+                memset(sender->patches[i] + 8 + sender->n_sender + 1, 0, n_stitch - sender->n_field);
+        }
+}
+
+/**
+ * message_stitch_sender() - stitch in new sender field
+ * @message:                    message to operate on
+ * @sender:                     sender to stitch in
+ *
+ * When the broker forwards messages, it needs to fill in the sender-field
+ * reliably. Unfortunately, this requires modifying the fields-array of the
+ * D-Bus header. Since we do not want to re-write the entire array, we allow
+ * some stitching magic here to happen.
+ *
+ * This means, we use some nice properties of tuple-arrays in the D-Bus
+ * marshalling (namely, they're 8-byte aligned, thus statically discoverable
+ * when we know the offset), and simply cut out the existing sender field and
+ * append a new one. The new field is copied from the pre-encoded field of
+ * @sender, see message_sender_init().
+ *
+ * If the new sender fits into the space of an existing sender field, it is
+ * rewritten in place instead, and the message stays contiguous. This is the
+ * case if the client already provided a sender of the same length, or if the
+ * sender field is the last field and the aligned header size does not change.
+ * No other field is relocated in that case, but the cached sender string then
+ * refers to the new sender.
+ *
+ * This function must not be called more than once on any message (it will
+ * throw a fatal error). Furthermore, unless stitched in place, this will cut
+ * the message in parts, such that it is no longer readable linearly. However,
+ * none of the fields are relocated nor overwritten. That is, any cached
+ * pointer stays valid, though maybe no longer part of the actual message.
+ */
+void message_stitch_sender(Message *message, const MessageSender *sender) {
+        size_t n, n_stitch, n_field, n_sender;
+        const char *name;
+        void *end, *field;
 
         /*
-         * The patch buffer is pre-allocated. Verify its size is sufficient to
-         * hold the stitched sender.
+         * Must not be called more than once. We reserve the 2 iovecs between
+         * the original header and body to stitch the sender field. The caller
+         * must have parsed the metadata before.
          */
-        assert(n_stitch <= sizeof(message->patch));
-        assert(n_sender <= ADDRESS_ID_STRING_MAX);
-        static_assert(1 + 3 + 4 + ADDRESS_ID_STRING_MAX + 1 <= sizeof(message->patch),
-                      "Message patch buffer has insufficient size");
+        assert(message->parsed);
+        assert(!message->vecs[1].iov_base && !message->vecs[1].iov_len);
+        assert(!message->vecs[2].iov_base && !message->vecs[2].iov_len);
+        assert(sender->id != ADDRESS_ID_INVALID);
+
+        message->sender_id = sender->id;
+
+        name = (const char *)sender->patches[0] + 8;
+        n_sender = sender->n_sender;
+        n_field = sender->n_field;
+        n_stitch = c_align8(n_field);
+
+        static_assert(sizeof(((MessageSender *)NULL)->patches[0]) == sizeof(message->patch),
+                      "Message patch buffer does not match sender patches");
+
+        ++message_stats.n_stitched;
+
+        if (message->original_sender && message_stitch_in_place(message, name, n_sender, n_field)) {
+                ++message_stats.n_stitched_in_place;
+                return;
+        }
 
         if (message->original_sender) {
                 /*
@@ -534,7 +1140,7 @@ void message_stitch_sender(Message *message, uint64_t sender_id) {
                  * @message->original_sender (pointing to the start of the
                  * sender string!). Hence, calculate the offset to its
                  * surrounding field and cut it out.
-                 * See above for size-calculations of `(yv)' fields.
+                 * See message_sender_init() for size-calculations of `(yv)' fields.
                  */
                 n = strlen(message->original_sender);
                 end = (void *)message->header + c_align8(message->n_header);
@@ -571,17 +1177,8 @@ void message_stitch_sender(Message *message, uint64_t sender_id) {
         message->vecs[2].iov_base = message->patch;
         message->vecs[2].iov_len = n_stitch;
 
-        /* fill in `(yv)' with sender and padding */
-        message->patch[0] = DBUS_MESSAGE_FIELD_SENDER;
-        message->patch[1] = 1;
-        message->patch[2] = 's';
-        message->patch[3] = 0;
-        if (message->big_endian)
-                memcpy(message->patch + 4, (uint32_t[1]){ htobe32(n_sender) }, sizeof(uint32_t));
-        else
-                memcpy(message->patch + 4, (uint32_t[1]){ htole32(n_sender) }, sizeof(uint32_t));
-        memcpy(message->patch + 8, sender, n_sender + 1);
-        memset(message->patch + 8 + n_sender + 1, 0, n_stitch - n_field);
+        /* the message may outlive the sender, so copy the encoded field */
+        memcpy(message->patch, sender->patches[message->big_endian], n_stitch);
 
         /*
          * After we cut the previous sender field and inserted the new, adjust
@@ -598,3 +1195,52 @@ void message_stitch_sender(Message *message, uint64_t sender_id) {
         else
                 message->header->n_fields = htole32(message->n_header - sizeof(*message->header));
 }
+
+/**
+ * message_get_stats() - query message statistics
+ *
+ * This returns the process-wide statistics of the message layer. So far,
+ * this only counts how many messages had their sender stitched, and how many
+ * of those could be stitched in place.
+ *
+ * Return: Pointer to the statistics object.
+ */
+const MessageStats *message_get_stats(void) {
+        return &message_stats;
+}
+
+/**
+ * message_release_body() - release the written prefix of a message body
+ * @message:            message to operate on
+ * @n_body:             number of body bytes that are no longer needed
+ *
+ * Big messages may take a long time to be written to slow receivers. If the
+ * caller holds the only reference to @message, this releases all pages fully
+ * covered by the first @n_body bytes of the body, so only the part still to be
+ * written stays resident. The header is never released.
+ *
+ * The released part of the body reads as zeroes afterwards. Hence, this must
+ * only be used by the last user of @message, once it wrote that part. If the
+ * data of @message was not mapped separately, or if there are other users
+ * left, this is a no-op.
+ */
+void message_release_body(Message *message, size_t n_body) {
+        uintptr_t from, to, page;
+        int r;
+
+        if (!message->mapped_data || message->n_refs != C_REF_INIT)
+                return;
+
+        assert(n_body <= message->n_body);
+
+        page = sysconf(_SC_PAGESIZE);
+        from = ((uintptr_t)message->body + message->n_released + page - 1) & ~(page - 1);
+        to = ((uintptr_t)message->body + n_body) & ~(page - 1);
+        if (to <= from)
+                return;
+
+        r = madvise((void *)from, to - from, MADV_DONTNEED);
+        assert(r >= 0);
+
+        message->n_released = to - (uintptr_t)message->body;
+}
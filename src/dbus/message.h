@@ -14,10 +14,19 @@ typedef struct FDList FDList;
 typedef struct Message Message;
 typedef struct MessageHeader MessageHeader;
 typedef struct MessageMetadata MessageMetadata;
+typedef struct MessageSender MessageSender;
+typedef struct MessageStats MessageStats;
 
 /* max message size; taken from spec */
 #define MESSAGE_SIZE_MAX (128UL * 1024UL * 1024UL)
 
+/* max inline data size of pooled messages */
+#define MESSAGE_POOL_DATA_MAX (2048UL) /* based on average message size */
+#define MESSAGE_POOL_MAX (256UL) /* keeps at most about 512KiB of idle messages */
+
+/* min data size of messages mapped individually; see message_release_body() */
+#define MESSAGE_MAP_MIN (1024UL * 1024UL) /* mapping costs little next to copying this much */
+
 /* max patch buffer size; see message_stitch_sender() */
 #define MESSAGE_PATCH_MAX (C_ALIGN_TO(1 + 3 + 4 + ADDRESS_ID_STRING_MAX + 1, 8))
 
@@ -57,21 +66,46 @@ struct MessageMetadata {
         } args[64];
 };
 
+struct MessageSender {
+        uint64_t id;
+        size_t n_sender;
+        size_t n_field;
+        alignas(uint64_t) uint8_t patches[2][MESSAGE_PATCH_MAX];
+};
+
+#define MESSAGE_SENDER_NULL {                                                   \
+                .id = ADDRESS_ID_INVALID,                                       \
+        }
+
+struct MessageStats {
+        uint64_t n_stitched;
+        uint64_t n_stitched_in_place;
+};
+
 struct Message {
         _Atomic unsigned long n_refs;
 
         bool big_endian : 1;
         bool allocated_data : 1;
+        bool mapped_data : 1;
+        bool pooled : 1;
         bool parsed : 1;
+        bool peeked : 1;
+        bool parsed_body : 1;
+        bool invalid_body : 1;
 
         uint64_t sender_id;
 
         FDList *fds;
+        Message *shared;
 
         size_t n_data;
+        size_t n_map;
         size_t n_copied;
         size_t n_header;
         size_t n_body;
+        size_t n_memfd;
+        size_t n_released;
 
         void *data;
         MessageHeader *header;
@@ -95,10 +129,18 @@ struct MessageHeader {
 
 int message_new_incoming(Message **messagep, MessageHeader header);
 int message_new_outgoing(Message **messagep, void *data, size_t n_data);
+int message_new_outgoing_shared(Message **messagep, void *data, size_t n_data, Message *shared);
+int message_new_outgoing_shared_prefix(Message **messagep, void *data, size_t n_data, Message *shared, size_t n_body);
 void message_free(_Atomic unsigned long *n_refs, void *userdata);
 
+int message_peek_metadata(Message *message);
 int message_parse_metadata(Message *message);
-void message_stitch_sender(Message *message, uint64_t sender_id);
+int message_parse_body(Message *message);
+void message_sender_init(MessageSender *sender, uint64_t id);
+void message_stitch_sender(Message *message, const MessageSender *sender);
+void message_release_body(Message *message, size_t n_body);
+
+const MessageStats *message_get_stats(void);
 
 /* inline helpers */
 
@@ -134,4 +176,23 @@ static inline uint32_t message_read_serial(Message *message) {
                 return be32toh(message->header->serial);
 }
 
+/**
+ * message_get_footprint() - query memory pinned by a message
+ * @message:            message to query
+ *
+ * This returns the number of bytes of memory @message occupies, and is what
+ * messages are charged with. Pooled messages always occupy a full pool slot,
+ * regardless of how much of its inline data they use.
+ *
+ * Return: The memory footprint of @message, in bytes.
+ */
+static inline size_t message_get_footprint(Message *message) {
+        if (message->pooled && !message->allocated_data)
+                return sizeof(Message) + MESSAGE_POOL_DATA_MAX;
+        else if (message->pooled)
+                return sizeof(Message) + MESSAGE_POOL_DATA_MAX + message->n_data;
+        else
+                return sizeof(Message) + message->n_data;
+}
+
 C_DEFINE_CLEANUP(Message *, message_unref);
@@ -1,11 +1,145 @@
 /*
  * DBus Protocol Constants and Definitions
+ *
+ * The validators of names and paths first check that all characters of a
+ * string are part of the respective character class, and only then verify
+ * its structure, which depends on just a few characters (the separators). The
+ * character class check is done 16 bytes at a time, using SSE2 on x86-64 and
+ * NEON on aarch64, both of which are part of the baseline of their
+ * architecture. The scalar code is the reference, and used for the remaining
+ * bytes, as well as on other architectures. Since all strings validated here
+ * are short, wider vectors would not pay off.
  */
 
 #include <c-macro.h>
 #include <stdlib.h>
+#include <string.h>
 #include "dbus/protocol.h"
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
+enum {
+        DBUS_CLASS_NAME,        /* [A-Za-z0-9_.-] */
+        DBUS_CLASS_PATH,        /* [A-Za-z0-9_/] */
+        DBUS_CLASS_ASCII,       /* [\x01-\x7f] */
+};
+
+static bool dbus_class_contains(unsigned int class, char c) {
+        if (class == DBUS_CLASS_ASCII)
+                return c > 0 && (unsigned char)c < 0x80;
+
+        if ((c >= 'a' && c <= 'z') ||
+            (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') ||
+            c == '_')
+                return true;
+
+        if (class == DBUS_CLASS_NAME)
+                return c == '.' || c == '-';
+        else
+                return c == '/';
+}
+
+#if defined(__SSE2__)
+
+static __m128i dbus_class_match16(unsigned int class, __m128i v) {
+        __m128i m;
+
+        /* bytes >= 0x80 are negative, hence never within any range below */
+        if (class == DBUS_CLASS_ASCII)
+                return _mm_cmpgt_epi8(v, _mm_setzero_si128());
+
+        m = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+                          _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+        m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1))));
+        m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+
+        if (class == DBUS_CLASS_NAME) {
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+        } else {
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+        }
+
+        return m;
+}
+
+static size_t dbus_class_span_vector(unsigned int class, const char *s, size_t n) {
+        unsigned int mask;
+        size_t i;
+
+        for (i = 0; i + 16 <= n; i += 16) {
+                mask = _mm_movemask_epi8(dbus_class_match16(class, _mm_loadu_si128((const void *)(s + i))));
+                if (mask != 0xffff)
+                        return i + __builtin_ctz(~mask);
+        }
+
+        return i;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+static uint8x16_t dbus_class_match16(unsigned int class, uint8x16_t v) {
+        uint8x16_t m;
+
+        if (class == DBUS_CLASS_ASCII)
+                return vandq_u8(vcgtq_u8(v, vdupq_n_u8(0)), vcltq_u8(v, vdupq_n_u8(0x80)));
+
+        m = vandq_u8(vcgeq_u8(v, vdupq_n_u8('a')), vcleq_u8(v, vdupq_n_u8('z')));
+        m = vorrq_u8(m, vandq_u8(vcgeq_u8(v, vdupq_n_u8('A')), vcleq_u8(v, vdupq_n_u8('Z'))));
+        m = vorrq_u8(m, vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')), vcleq_u8(v, vdupq_n_u8('9'))));
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('_')));
+
+        if (class == DBUS_CLASS_NAME) {
+                m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('.')));
+                m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('-')));
+        } else {
+                m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('/')));
+        }
+
+        return m;
+}
+
+static size_t dbus_class_span_vector(unsigned int class, const char *s, size_t n) {
+        size_t i;
+
+        /* the exact position of a mismatch is left to the scalar code */
+        for (i = 0; i + 16 <= n; i += 16)
+                if (vminvq_u8(dbus_class_match16(class, vld1q_u8((const uint8_t *)(s + i)))) != 0xff)
+                        break;
+
+        return i;
+}
+
+#else
+
+static size_t dbus_class_span_vector(unsigned int class, const char *s, size_t n) {
+        return 0;
+}
+
+#endif
+
+/*
+ * Return the length of the longest prefix of @s, which consists of characters
+ * of @class only.
+ */
+static size_t dbus_class_span(unsigned int class, const char *s, size_t n) {
+        size_t i;
+
+        for (i = dbus_class_span_vector(class, s, n); i < n; ++i)
+                if (!dbus_class_contains(class, s[i]))
+                        break;
+
+        return i;
+}
+
 /**
  * dbus_validate_name() - verify validity of well-known name
  * @name:               name
@@ -16,29 +150,78 @@
  * Return: True if @name is a valid well-known name, false otherwise.
  */
 bool dbus_validate_name(const char *name, size_t n_name) {
-        bool has_dot = false, dot = true;
-        size_t i;
+        const char *element, *end, *dot;
 
         if (n_name > 255)
                 return false;
 
-        for (i = 0; i < n_name; ++i) {
-                if (name[i] == '.') {
-                        if (dot)
-                                return false;
-
-                        has_dot = true;
-                        dot = true;
-                } else if (_c_unlikely_(!((name[i] >= 'a' && name[i] <= 'z') ||
-                                          (name[i] >= 'A' && name[i] <= 'Z') ||
-                                          (name[i] >= '0' && name[i] <= '9' && !dot) ||
-                                          name[i] == '_' ||
-                                          name[i] == '-'))) {
+        if (dbus_class_span(DBUS_CLASS_NAME, name, n_name) != n_name)
+                return false;
+
+        /*
+         * All characters are valid, so only the elements between the dots
+         * are left to check: there must be at least two, none of them may be
+         * empty, and none may start with a digit.
+         */
+        element = name;
+        end = name + n_name;
+        dot = memchr(element, '.', end - element);
+        if (!dot)
+                return false;
+
+        for (;;) {
+                if (element == (dot ?: end) || (*element >= '0' && *element <= '9'))
                         return false;
-                } else {
-                        dot = false;
-                }
+                if (!dot)
+                        return true;
+
+                element = dot + 1;
+                dot = memchr(element, '.', end - element);
         }
+}
 
-        return has_dot && !dot;
+/**
+ * dbus_validate_path() - verify validity of object path
+ * @path:               path
+ * @n_path:             length of path
+ *
+ * This verifies the validity of the passed object path. That is, it must
+ * start with a slash, followed by elements of [A-Za-z0-9_], separated by
+ * single slashes, and it must not end in a slash, unless it is the root path.
+ *
+ * Return: True if @path is a valid object path, false otherwise.
+ */
+bool dbus_validate_path(const char *path, size_t n_path) {
+        const char *slash, *end;
+
+        if (!n_path || path[0] != '/')
+                return false;
+        if (n_path == 1)
+                return true;
+        if (path[n_path - 1] == '/')
+                return false;
+
+        if (dbus_class_span(DBUS_CLASS_PATH, path, n_path) != n_path)
+                return false;
+
+        end = path + n_path;
+        for (slash = path; slash; slash = memchr(slash + 1, '/', end - slash - 1))
+                if (slash[1] == '/')
+                        return false;
+
+        return true;
+}
+
+/**
+ * dbus_validate_ascii() - verify string is plain ASCII
+ * @string:             string
+ * @n_string:           length of string
+ *
+ * This verifies that @string consists of ASCII characters only, and does not
+ * contain any NUL bytes.
+ *
+ * Return: True if @string is plain ASCII, false otherwise.
+ */
+bool dbus_validate_ascii(const char *string, size_t n_string) {
+        return dbus_class_span(DBUS_CLASS_ASCII, string, n_string) == n_string;
 }
@@ -61,3 +61,5 @@ enum {
 };
 
 bool dbus_validate_name(const char *name, size_t n_name);
+bool dbus_validate_path(const char *path, size_t n_path);
+bool dbus_validate_ascii(const char *string, size_t n_string);
@@ -7,6 +7,19 @@
 #include "dbus/queue.h"
 #include "util/fdlist.h"
 #include "util/error.h"
+#include "util/pool.h"
+
+/*
+ * Most connections are idle most of the time, so input queues do not embed
+ * their input buffer. Instead, a small buffer of IQUEUE_RECV_MIN bytes is
+ * taken from a shared pool whenever data is read, and returned once all of it
+ * was consumed. Bigger buffers for batched reads and long lines are allocated
+ * individually on top, as before.
+ */
+static Pool iqueue_buffer_pool = POOL_INIT(iqueue_buffer_pool,
+                                           "IQueue",
+                                           IQUEUE_RECV_MIN,
+                                           IQUEUE_POOL_MAX);
 
 /**
  * iqueue_init() - XXX
@@ -26,11 +39,15 @@ void iqueue_deinit(IQueue *iq) {
         assert(!iq->pending.data);
         assert(!iq->pending.fds);
 
-        if (iq->data != iq->buffer) {
+        if (iq->data != iq->buffer)
                 free(iq->data);
-                iq->data = iq->buffer;
-                iq->data_size = sizeof(iq->buffer);
-        }
+        if (iq->buffer)
+                pool_free(&iqueue_buffer_pool, iq->buffer);
+
+        iq->data = NULL;
+        iq->buffer = NULL;
+        iq->data_size = 0;
+        iq->recv_size = IQUEUE_RECV_MIN;
 
         user_charge_deinit(&iq->pending.charge_fds);
         user_charge_deinit(&iq->pending.charge_data);
@@ -94,6 +111,95 @@ int iqueue_set_target(IQueue *iq, void *data, size_t n_data) {
         return 0;
 }
 
+static void iqueue_release(IQueue *iq) {
+        /* we always shift before resizing, so data_start must be 0 */
+        assert(!iq->data_start);
+        assert(iq->data_end <= IQUEUE_RECV_MIN);
+
+        if (iq->data == iq->buffer)
+                return;
+
+        /* if no small buffer is available, just stick with the big one */
+        if (!iq->buffer) {
+                iq->buffer = pool_alloc(&iqueue_buffer_pool);
+                if (!iq->buffer)
+                        return;
+        }
+
+        memcpy(iq->buffer, iq->data, iq->data_end);
+        free(iq->data);
+        user_charge_deinit(&iq->charge_data);
+        iq->data = iq->buffer;
+        iq->data_size = IQUEUE_RECV_MIN;
+        ++iq->stats.n_releases;
+}
+
+static void iqueue_idle(IQueue *iq) {
+        assert(iq->data_start == iq->data_end);
+
+        /* all input was consumed, so no input buffer is needed at all */
+        iq->data_start = 0;
+        iq->data_end = 0;
+        iq->data_cursor = 0;
+
+        if (iq->data != iq->buffer) {
+                free(iq->data);
+                user_charge_deinit(&iq->charge_data);
+                ++iq->stats.n_releases;
+        }
+        if (iq->buffer)
+                pool_free(&iqueue_buffer_pool, iq->buffer);
+
+        iq->data = NULL;
+        iq->buffer = NULL;
+        iq->data_size = 0;
+}
+
+static int iqueue_resize(IQueue *iq, size_t n_data) {
+        UserCharge charge = USER_CHARGE_INIT;
+        void *p;
+        int r;
+
+        if (n_data <= IQUEUE_RECV_MIN) {
+                iqueue_release(iq);
+                return 0;
+        }
+
+        /* we always shift before resizing, so data_start must be 0 */
+        assert(!iq->data_start);
+        assert(iq->data_end <= n_data);
+
+        p = malloc(n_data);
+        if (!p)
+                return error_origin(-ENOMEM);
+
+        r = user_charge(iq->user,
+                        &charge,
+                        NULL,
+                        USER_SLOT_BYTES,
+                        n_data);
+        if (r) {
+                free(p);
+                return (r == USER_E_QUOTA) ? IQUEUE_E_QUOTA : error_fold(r);
+        }
+
+        memcpy(p, iq->data, iq->data_end);
+        if (iq->data != iq->buffer) {
+                free(iq->data);
+        } else {
+                pool_free(&iqueue_buffer_pool, iq->buffer);
+                iq->buffer = NULL;
+        }
+        user_charge_deinit(&iq->charge_data);
+
+        iq->charge_data = charge;
+        iq->data = p;
+        iq->data_size = n_data;
+        ++iq->stats.n_resizes;
+
+        return 0;
+}
+
 /**
  * iqueue_get_cursor() - XXX
  */
@@ -103,14 +209,22 @@ int iqueue_get_cursor(IQueue *iq,
                       size_t *top,
                       FDList ***fdsp,
                       UserCharge **charge_fdsp) {
-        void *p;
         int r;
 
+        if (_c_unlikely_(!iq->data)) {
+                iq->buffer = pool_alloc(&iqueue_buffer_pool);
+                if (!iq->buffer)
+                        return error_origin(-ENOMEM);
+
+                iq->data = iq->buffer;
+                iq->data_size = IQUEUE_RECV_MIN;
+        }
+
         /*
          * Always shift the input buffer. In case of the line-parser this
          * should never happen in normal operation: the only way to leave
          * behind a partial line is by filling the whole buffer, in that case
-         * at most IQUEUE_RECV_MAX bytes need to be moved. And for the
+         * at most IQUEUE_LINE_MAX bytes need to be moved. And for the
          * message-parser, there can be at most one message header left
          * behind (16 bytes).
          *
@@ -144,44 +258,25 @@ int iqueue_get_cursor(IQueue *iq,
          * buffer. Hence, in case the normal buffer size is exceeded, we
          * re-allocate to its maximum *ONCE*.
          *
-         * Once we finished reading lines *AND* we processed all the data in
-         * the input buffer, we can safely de-allocate the buffer and fall back
-         * to the input buffer again.
+         * Once we finished reading lines, the input buffer is sized according
+         * to the adaptive read size of the message-reader. See
+         * iqueue_note_read() for details. If the quota of the user does not
+         * allow for a bigger buffer, we simply stick with the current one.
+         * Like everywhere else, failing to allocate memory is fatal.
          */
         if (_c_unlikely_(iq->data_size <= iq->data_end)) {
                 if (iq->data_size >= IQUEUE_LINE_MAX)
                         return IQUEUE_E_VIOLATION;
 
-                p = malloc(IQUEUE_LINE_MAX);
-                if (!p)
-                        return error_origin(-ENOMEM);
-
-                r = user_charge(iq->user,
-                                &iq->charge_data,
-                                NULL,
-                                USER_SLOT_BYTES,
-                                IQUEUE_LINE_MAX);
-                if (r) {
-                        free(p);
-                        return (r == USER_E_QUOTA) ? IQUEUE_E_QUOTA : error_fold(r);
-                }
-
-                /* we always shift so data_start must be 0 */
-                assert(!iq->data_start);
-                assert(iq->data == iq->buffer);
-
-                memcpy(p, iq->data, iq->data_end);
-                iq->data = p;
-                iq->data_size = IQUEUE_LINE_MAX;
-        } else if (_c_unlikely_(iq->data != iq->buffer && iq->pending.data)) {
-                assert(!iq->data_start);
-                assert(iq->data_end <= sizeof(iq->buffer));
-
-                memcpy(iq->buffer, iq->data, iq->data_end);
-                free(iq->data);
-                user_charge_deinit(&iq->charge_data);
-                iq->data = iq->buffer;
-                iq->data_size = sizeof(iq->buffer);
+                r = iqueue_resize(iq, IQUEUE_LINE_MAX);
+                if (r)
+                        return error_trace(r);
+        } else if (iq->pending.data && iq->data_size != iq->recv_size) {
+                r = iqueue_resize(iq, iq->recv_size);
+                if (r == IQUEUE_E_QUOTA)
+                        iq->recv_size = iq->data_size;
+                else if (r)
+                        return error_trace(r);
         }
 
         /*
@@ -213,24 +308,191 @@ int iqueue_get_cursor(IQueue *iq,
          * Read more data into the input buffer, and store the file-descriptors
          * in the buffer as well.
          *
-         * Only ever read in IQUEUE_RECV_MAX in order to limit the number of
-         * incoming messages we may have in the buffer at once.
+         * Only ever read in chunks of the adaptive read size, in order to
+         * limit the number of incoming messages we may have in the buffer at
+         * once.
          *
          * Note that the kernel always breaks recvmsg() calls after an SKB with
-         * file-descriptor payload. Hence, this could be improvded with
-         * recvmmsg() so we get multiple messages at all cost. However, FD
-         * passing is no fast-path and should never be, so there is little
-         * reason to resort to recvmmsg() (which would be non-trivial, anyway,
-         * since we would need multiple input buffers).
+         * file-descriptor payload, but merges all other SKBs of a stream
+         * socket into a single read. Hence, a batched read into a larger
+         * buffer fetches many small messages at once, and we stop batching as
+         * soon as FDs show up. FD passing is no fast-path and should never
+         * be, so there is little reason to resort to recvmmsg() (which would
+         * be non-trivial, anyway, since we would need multiple input buffers
+         * and FD sets in the middle of them).
          */
         *bufferp = iq->data;
         *fromp = &iq->data_end;
-        *top = (iq->data_size - iq->data_end) > IQUEUE_RECV_MAX ? iq->data_end + IQUEUE_RECV_MAX : iq->data_size;
+        *top = (iq->data_size - iq->data_end) > iq->recv_size ? iq->data_end + iq->recv_size : iq->data_size;
         *fdsp = &iq->fds;
         *charge_fdsp = &iq->charge_fds;
         return 0;
 }
 
+/**
+ * iqueue_note_read() - account a read from the kernel
+ * @iq:                 input queue to operate on
+ * @from:               cursor position as returned by iqueue_get_cursor()
+ * @n_window:           size of the window that was offered to the kernel
+ * @n_read:             number of bytes that were read, or 0 if none were
+ *                      available
+ * @drained:            whether the read drained the kernel queue
+ *
+ * This must be called after data was read into a cursor returned by
+ * iqueue_get_cursor(). It adapts the read size of the message-reader to the
+ * traffic of the peer:
+ *
+ *  * If a read into the input buffer filled the entire window and did not
+ *    carry any FDs, the peer is most likely sending a burst of messages, hence
+ *    the read size is doubled, up to IQUEUE_RECV_MAX. This way, many small
+ *    messages are pulled in with a single call to recvmsg(2).
+ *
+ *  * If a read used less than a quarter of the window, the read size is
+ *    halved, down to IQUEUE_RECV_MIN.
+ *
+ *  * If FDs are passed, the read size is reset to IQUEUE_RECV_MIN. The kernel
+ *    breaks reads after each SKB with FDs, so there is no point in batching.
+ *
+ *  * If no data was available, the peer went idle and any allocated input
+ *    buffer is released. The read size is retained, so the buffer is
+ *    re-allocated at the same size on the next read. If data was read, but
+ *    the read drained the kernel queue, the buffer is released once all its
+ *    data was consumed (see iqueue_trim()).
+ *
+ * Reads directly into pending messages do not affect the read size. Neither
+ * does the line-reader, which always uses IQUEUE_RECV_MIN.
+ */
+void iqueue_note_read(IQueue *iq, size_t *from, size_t n_window, size_t n_read, bool drained) {
+        size_t i;
+
+        assert(n_read || drained);
+
+        iq->drained = drained;
+
+        if (n_read) {
+                for (i = 0; i + 1 < C_ARRAY_SIZE(iq->stats.reads); ++i)
+                        if (n_read < (IQUEUE_RECV_MIN << i))
+                                break;
+
+                ++iq->stats.reads[i];
+                ++iq->stats.n_reads;
+                iq->stats.n_bytes += n_read;
+        }
+
+        if (!iq->pending.data)
+                return;
+
+        if (!n_read) {
+                if (iq->data_start == iq->data_end)
+                        iqueue_idle(iq);
+                return;
+        }
+
+        if (from != &iq->data_end)
+                return;
+
+        if (iq->fds)
+                iq->recv_size = IQUEUE_RECV_MIN;
+        else if (n_read >= n_window)
+                iq->recv_size = c_min(iq->recv_size * 2, IQUEUE_RECV_MAX);
+        else if (n_read < n_window / 4)
+                iq->recv_size = c_max(iq->recv_size / 2, IQUEUE_RECV_MIN);
+}
+
+/**
+ * iqueue_inject() - inject data as if it was read
+ * @iq:                 input queue to operate on
+ * @data:               data to inject
+ * @n_data:             size of @data
+ * @fds:                FDs to inject along with @data, or NULL
+ *
+ * This appends @data to the input buffer of @iq, as if it was read from the
+ * kernel in a single chunk. Just like with reads, @fds is attached to the last
+ * byte of @data. Ownership of @fds is transferred to @iq, if, and only if,
+ * this function succeeds. The input buffer must have been consumed entirely,
+ * before more data can be injected.
+ *
+ * This is used to restore input queues of connections handed over from
+ * another process.
+ *
+ * Return: 0 on success, IQUEUE_E_QUOTA if the quota failed, negative error
+ *         code on failure.
+ */
+int iqueue_inject(IQueue *iq, const void *data, size_t n_data, FDList *fds) {
+        int r;
+
+        assert(iq->data_start == iq->data_end);
+        assert(!iq->fds);
+
+        if (!iq->data) {
+                iq->buffer = pool_alloc(&iqueue_buffer_pool);
+                if (!iq->buffer)
+                        return error_origin(-ENOMEM);
+
+                iq->data = iq->buffer;
+                iq->data_size = IQUEUE_RECV_MIN;
+        }
+
+        iq->data_start = 0;
+        iq->data_end = 0;
+        iq->data_cursor = 0;
+
+        if (n_data > iq->data_size) {
+                r = iqueue_resize(iq, n_data);
+                if (r)
+                        return error_trace(r);
+        }
+
+        if (fds) {
+                r = user_charge(iq->user,
+                                &iq->charge_fds,
+                                NULL,
+                                USER_SLOT_FDS,
+                                fdlist_count(fds));
+                if (r)
+                        return (r == USER_E_QUOTA) ? IQUEUE_E_QUOTA : error_fold(r);
+
+                iq->fds = fds;
+        }
+
+        if (n_data)
+                memcpy(iq->data, data, n_data);
+        iq->data_end = n_data;
+        return 0;
+}
+
+/**
+ * iqueue_trim() - release idle input buffer
+ * @iq:                 input queue to operate on
+ *
+ * If the last read drained the kernel queue, and all data of the input buffer
+ * was consumed since, the peer went idle. In that case, this releases the
+ * input buffer, just like iqueue_note_read() does if no data was available.
+ * This includes the line buffer of a finished SASL exchange. Otherwise, this
+ * is a no-op.
+ */
+void iqueue_trim(IQueue *iq) {
+        if (!iq->drained ||
+            !iq->data ||
+            iq->data_start != iq->data_end ||
+            iq->fds)
+                return;
+
+        iqueue_idle(iq);
+}
+
+/**
+ * iqueue_get_memory() - query memory used by input buffers
+ * @iq:                 input queue to operate on
+ *
+ * Return: Number of bytes currently allocated for input buffers of @iq, not
+ *         including pending messages.
+ */
+size_t iqueue_get_memory(IQueue *iq) {
+        return (iq->buffer ? IQUEUE_RECV_MIN : 0) +
+               (iq->data != iq->buffer ? iq->data_size : 0);
+}
+
 /**
  * iqueue_pop_line() - XXX
  */
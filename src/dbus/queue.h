@@ -11,9 +11,13 @@
 #include "util/user.h"
 
 typedef struct IQueue IQueue;
+typedef struct IQueueStats IQueueStats;
 
 #define IQUEUE_LINE_MAX (16UL * 1024UL) /* taken from dbus-daemon(1) */
-#define IQUEUE_RECV_MAX (2UL * 1024UL) /* based on average message size */
+#define IQUEUE_RECV_MIN (512UL) /* fits SASL exchanges and small messages */
+#define IQUEUE_RECV_MAX (32UL * 1024UL) /* bounds the buffer a burst of one connection grows to */
+#define IQUEUE_POOL_MAX (256UL) /* keeps at most 128KiB of idle buffers */
+#define IQUEUE_STATS_N_BUCKETS (9) /* log2 buckets of read sizes, starting at <512 */
 
 enum {
         _IQUEUE_E_SUCCESS,
@@ -23,6 +27,14 @@ enum {
         IQUEUE_E_VIOLATION,
 };
 
+struct IQueueStats {
+        uint64_t n_reads;
+        uint64_t n_bytes;
+        uint64_t n_resizes;
+        uint64_t n_releases;
+        uint64_t reads[IQUEUE_STATS_N_BUCKETS];
+};
+
 struct IQueue {
         User *user;
 
@@ -33,6 +45,8 @@ struct IQueue {
         size_t data_start;
         size_t data_end;
         size_t data_cursor;
+        size_t recv_size;
+        bool drained : 1;
         FDList *fds;
 
         struct {
@@ -44,14 +58,15 @@ struct IQueue {
                 FDList *fds;
         } pending;
 
-        char buffer[IQUEUE_RECV_MAX];
+        IQueueStats stats;
+
+        char *buffer;
 };
 
 #define IQUEUE_NULL(_x) {                                                       \
                 .charge_data = USER_CHARGE_INIT,                                \
                 .charge_fds = USER_CHARGE_INIT,                                 \
-                .data = (_x).buffer,                                            \
-                .data_size = sizeof((_x).buffer),                               \
+                .recv_size = IQUEUE_RECV_MIN,                                   \
                 .pending.charge_data = USER_CHARGE_INIT,                        \
                 .pending.charge_fds = USER_CHARGE_INIT,                         \
         }
@@ -81,6 +96,11 @@ int iqueue_get_cursor(IQueue *iq,
                       FDList ***fdsp,
                       UserCharge **charge_fdsp);
 
+void iqueue_note_read(IQueue *iq, size_t *from, size_t n_window, size_t n_read, bool drained);
+int iqueue_inject(IQueue *iq, const void *data, size_t n_data, FDList *fds);
+void iqueue_trim(IQueue *iq);
+size_t iqueue_get_memory(IQueue *iq);
+
 int iqueue_pop_line(IQueue *iq, const char **linep, size_t *np);
 int iqueue_pop_data(IQueue *iq, FDList **fds);
 
@@ -9,69 +9,127 @@
  *
  * Note that once the first real DBus message was read, you must not use the
  * line-helpers, anymore!
+ *
+ * Optionally, a socket can exchange its messages through a pair of
+ * shared-memory rings, rather than the socket itself. This is negotiated by
+ * the peer once it is connected. The socket stays the control channel (EOF,
+ * credentials), and is still read from. Whenever the rings are accessed, the
+ * socket is drained first: whatever was sent on the socket was sent before
+ * anything was written to a ring, so the stream order is retained. The other
+ * side must follow the same rule. See socket_open_shm() for details.
+ *
+ * If the dispatch-file of the socket is backed by io_uring, writes are
+ * staged on the dispatcher instead of being issued right away, and complete
+ * asynchronously. Reads are still issued
+ * right away, once the socket signals readiness.
  */
 
 #include <c-list.h>
 #include <c-macro.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <linux/sockios.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <unistd.h>
 #include "dbus/message.h"
+#include "dbus/protocol.h"
 #include "dbus/queue.h"
 #include "dbus/socket.h"
+#include "util/dispatch.h"
 #include "util/error.h"
 #include "util/fdlist.h"
+#include "util/pool.h"
+#include "util/serialize.h"
+#include "util/shmring.h"
+#include "util/trace.h"
 #include "util/user.h"
 
 struct SocketBuffer {
         CList link;
-        UserCharge charges[2];
+        CList coalesce_link;
+        CList lane_link;
+        UserCharge charges[3];
 
-        size_t n_total;
         Message *message;
 
         size_t n_vecs;
-        struct iovec *writer;
-        struct iovec vecs[];
+        const struct iovec *vecs;
+        size_t i_vec;
+        size_t n_vec;
+
+        size_t n_line;
+        struct iovec line;
+        char line_data[];
 };
 
-static char *socket_buffer_get_base(SocketBuffer *buffer) {
-        return (char *)(buffer->vecs + buffer->n_vecs);
-}
+/*
+ * Message buffers are queued for every receiver of a message, so they are
+ * allocated and released at message rate (and broadcasts allocate one for each
+ * receiver). They have a fixed size and do not carry any data on their own,
+ * as they reference the immutable iovec array of their message. Hence, they
+ * are served from a pool. Line buffers are allocated individually.
+ */
+static Pool socket_buffer_pool = POOL_INIT(socket_buffer_pool,
+                                           "SocketBuffer",
+                                           sizeof(SocketBuffer),
+                                           SOCKET_BUFFER_POOL_MAX);
+
+static_assert(SOCKET_FD_MAX <= FDLIST_FDS_MAX,
+              "FDList control buffers must fit all FDs of a message");
 
 static SocketBuffer *socket_buffer_free(SocketBuffer *buffer) {
         if (!buffer)
                 return NULL;
 
+        user_charge_deinit(&buffer->charges[2]);
         user_charge_deinit(&buffer->charges[1]);
         user_charge_deinit(&buffer->charges[0]);
+        c_list_unlink_init(&buffer->lane_link);
+        c_list_unlink_init(&buffer->coalesce_link);
         c_list_unlink_init(&buffer->link);
-        message_unref(buffer->message);
-        free(buffer);
+
+        if (buffer->message) {
+                message_unref(buffer->message);
+                pool_free(&socket_buffer_pool, buffer);
+        } else {
+                free(buffer);
+        }
 
         return NULL;
 }
 
 C_DEFINE_CLEANUP(SocketBuffer *, socket_buffer_free);
 
-static int socket_buffer_new_internal(SocketBuffer **bufferp, size_t n_vecs, size_t n_line) {
+static int socket_buffer_new_internal(SocketBuffer **bufferp, size_t n_line) {
         SocketBuffer *buffer;
 
-        buffer = malloc(sizeof(*buffer) + n_vecs * sizeof(*buffer->vecs) + n_line);
+        if (n_line)
+                buffer = malloc(sizeof(*buffer) + n_line);
+        else
+                buffer = pool_alloc(&socket_buffer_pool);
         if (!buffer)
                 return error_origin(-ENOMEM);
 
         buffer->link = (CList)C_LIST_INIT(buffer->link);
+        buffer->coalesce_link = (CList)C_LIST_INIT(buffer->coalesce_link);
+        buffer->lane_link = (CList)C_LIST_INIT(buffer->lane_link);
         user_charge_init(&buffer->charges[0]);
         user_charge_init(&buffer->charges[1]);
-        buffer->n_total = n_line;
+        user_charge_init(&buffer->charges[2]);
         buffer->message = NULL;
-        buffer->n_vecs = n_vecs;
-        buffer->writer = NULL;
+        buffer->n_vecs = 0;
+        buffer->vecs = NULL;
+        buffer->i_vec = 0;
+        buffer->n_vec = 0;
+        buffer->n_line = n_line;
+        buffer->line = (struct iovec){ buffer->line_data, 0 };
 
         *bufferp = buffer;
         return 0;
@@ -84,17 +142,18 @@ static int socket_buffer_new_line(SocketBuffer **bufferp,
         _c_cleanup_(socket_buffer_freep) SocketBuffer *buffer = NULL;
         int r;
 
-        r = socket_buffer_new_internal(&buffer, 1, c_max(n, SOCKET_LINE_PREALLOC));
+        r = socket_buffer_new_internal(&buffer, c_max(n, SOCKET_LINE_PREALLOC));
         if (r)
                 return error_trace(r);
 
-        buffer->vecs[0] = (struct iovec){ socket_buffer_get_base(buffer), 0 };
+        buffer->n_vecs = 1;
+        buffer->vecs = &buffer->line;
 
         r = user_charge(socket->user,
                         &buffer->charges[0],
                         user,
                         USER_SLOT_BYTES,
-                        sizeof(SocketBuffer) + buffer->n_total);
+                        sizeof(SocketBuffer) + buffer->n_line);
         if (r)
                 return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
 
@@ -103,6 +162,26 @@ static int socket_buffer_new_line(SocketBuffer **bufferp,
         return 0;
 }
 
+static int socket_buffer_new_message_uncharged(SocketBuffer **bufferp, Message *message) {
+        SocketBuffer *buffer;
+        int r;
+
+        r = socket_buffer_new_internal(&buffer, 0);
+        if (r)
+                return error_trace(r);
+
+        /*
+         * The iovecs of a message are immutable once it is queued, so all
+         * receivers share them. Our write position is tracked separately.
+         */
+        buffer->message = message_ref(message);
+        buffer->n_vecs = C_ARRAY_SIZE(message->vecs);
+        buffer->vecs = message->vecs;
+
+        *bufferp = buffer;
+        return 0;
+}
+
 static int socket_buffer_new_message(SocketBuffer **bufferp,
                                      Socket *socket,
                                      User *user,
@@ -110,18 +189,15 @@ static int socket_buffer_new_message(SocketBuffer **bufferp,
         _c_cleanup_(socket_buffer_freep) SocketBuffer *buffer = NULL;
         int r;
 
-        r = socket_buffer_new_internal(&buffer, C_ARRAY_SIZE(message->vecs), 0);
+        r = socket_buffer_new_message_uncharged(&buffer, message);
         if (r)
                 return error_trace(r);
 
-        buffer->message = message_ref(message);
-        memcpy(buffer->vecs, message->vecs, sizeof(message->vecs));
-
         r = user_charge(socket->user,
                         &buffer->charges[0],
                         user,
                         USER_SLOT_BYTES,
-                        sizeof(SocketBuffer) + sizeof(Message) + message->n_data);
+                        sizeof(SocketBuffer) + message_get_footprint(message));
         if (r)
                 return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
 
@@ -133,68 +209,209 @@ static int socket_buffer_new_message(SocketBuffer **bufferp,
         if (r)
                 return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
 
+        if (message->n_memfd > UINT_MAX)
+                return SOCKET_E_QUOTA;
+
+        r = user_charge(socket->user,
+                        &buffer->charges[2],
+                        user,
+                        USER_SLOT_MEMFD_BYTES,
+                        message->n_memfd);
+        if (r)
+                return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
+
         *bufferp = buffer;
         buffer = NULL;
         return 0;
 }
 
 static size_t socket_buffer_get_line_space(SocketBuffer *buffer) {
-        size_t n_remaining;
-
         assert(!buffer->message);
 
-        n_remaining = buffer->n_total;
-        n_remaining -= (char *)buffer->vecs[0].iov_base - socket_buffer_get_base(buffer);
-        n_remaining -= buffer->vecs[0].iov_len;
-
-        return n_remaining;
+        return buffer->n_line - buffer->line.iov_len;
 }
 
 static void socket_buffer_get_line_cursor(SocketBuffer *buffer, char **datap, size_t **posp) {
         assert(!buffer->message);
 
-        *datap = buffer->vecs[0].iov_base + buffer->vecs[0].iov_len;
-        *posp = &buffer->vecs[0].iov_len;
+        *datap = buffer->line_data + buffer->line.iov_len;
+        *posp = &buffer->line.iov_len;
 }
 
 static bool socket_buffer_is_uncomsumed(SocketBuffer *buffer) {
-        return !buffer->writer;
+        return !buffer->i_vec && !buffer->n_vec;
 }
 
 static bool socket_buffer_is_consumed(SocketBuffer *buffer) {
-        return buffer->writer >= buffer->vecs + buffer->n_vecs;
+        return buffer->i_vec >= buffer->n_vecs;
 }
 
-static bool socket_buffer_consume(SocketBuffer *buffer, size_t n) {
+static bool socket_buffer_consume(SocketBuffer *buffer, size_t *np) {
         size_t t;
 
-        if (!buffer->writer)
-                buffer->writer = buffer->vecs;
-
-        for ( ; !socket_buffer_is_consumed(buffer); ++buffer->writer) {
-                t = c_min(buffer->writer->iov_len, n);
-                buffer->writer->iov_len -= t;
-                buffer->writer->iov_base += t;
-                n -= t;
-                if (buffer->writer->iov_len)
+        /*
+         * Consume up to *@np bytes of @buffer and subtract them from *@np. If
+         * @buffer is consumed entirely, any remainder in *@np belongs to the
+         * buffers following it.
+         */
+        for ( ; !socket_buffer_is_consumed(buffer); ++buffer->i_vec, buffer->n_vec = 0) {
+                t = c_min(buffer->vecs[buffer->i_vec].iov_len - buffer->n_vec, *np);
+                buffer->n_vec += t;
+                *np -= t;
+                if (buffer->n_vec < buffer->vecs[buffer->i_vec].iov_len)
                         break;
         }
 
-        assert(!n);
-
         return socket_buffer_is_consumed(buffer);
 }
 
+static size_t socket_buffer_get_remaining(SocketBuffer *buffer, struct iovec *vecs) {
+        size_t i, n_vecs;
+
+        /*
+         * A partially written buffer cannot use the shared iovecs directly,
+         * so we copy the remaining iovecs into @vecs and adjust the first one
+         * by what has already been written.
+         */
+        n_vecs = buffer->n_vecs - buffer->i_vec;
+        for (i = 0; i < n_vecs; ++i)
+                vecs[i] = buffer->vecs[buffer->i_vec + i];
+
+        vecs[0].iov_base += buffer->n_vec;
+        vecs[0].iov_len -= buffer->n_vec;
+
+        return n_vecs;
+}
+
 static void socket_discard_input(Socket *socket) {
         iqueue_flush(&socket->in.queue);
         socket->in.message = message_unref(socket->in.message);
+        socket->in.n_drain = 0;
+        socket->in.fields = false;
+        socket->in.admitting = false;
+}
+
+static void socket_unqueue_buffer(Socket *socket, SocketBuffer *buffer) {
+        if (buffer->message) {
+                assert(socket->out.n_messages > 0);
+                assert(socket->out.n_bytes >= buffer->message->n_data);
+
+                --socket->out.n_messages;
+                socket->out.n_bytes -= buffer->message->n_data;
+        }
+
+        c_list_unlink_init(&buffer->lane_link);
+        c_list_unlink_init(&buffer->coalesce_link);
+        c_list_unlink_init(&buffer->link);
+}
+
+static size_t socket_buffer_get_lane(SocketBuffer *buffer) {
+        switch (buffer->message->header->type) {
+        case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+        case DBUS_MESSAGE_TYPE_ERROR:
+                return SOCKET_LANE_REPLY;
+        case DBUS_MESSAGE_TYPE_METHOD_CALL:
+                return SOCKET_LANE_CALL;
+        default:
+                return SOCKET_LANE_SIGNAL;
+        }
+}
+
+static void socket_link_buffer(Socket *socket, SocketBuffer *buffer) {
+        SocketBuffer *next = NULL;
+        size_t i, lane;
+
+        if (_c_likely_(!socket->lanes)) {
+                c_list_link_tail(&socket->out.queue, &buffer->link);
+                return;
+        }
+
+        /*
+         * With lanes enabled, every queued message buffer is linked into the
+         * lane of its message type, and the queue is kept ordered by lane.
+         * Hence, a new buffer is queued right in front of the first buffer of
+         * any lower-priority lane, or at the tail if there is none. Within a
+         * lane, buffers stay in order. Partially written buffers are removed
+         * from their lane, so nothing is ever queued in front of them.
+         */
+        lane = socket_buffer_get_lane(buffer);
+        for (i = lane + 1; !next && i < _SOCKET_LANE_N; ++i)
+                next = c_list_first_entry(&socket->out.lanes[i], SocketBuffer, lane_link);
+
+        if (next)
+                c_list_link_before(&next->link, &buffer->link);
+        else
+                c_list_link_tail(&socket->out.queue, &buffer->link);
+
+        c_list_link_tail(&socket->out.lanes[lane], &buffer->lane_link);
+}
+
+static bool socket_settle_output(Socket *socket, ssize_t *lp) {
+        bool done;
+
+        if (!socket->out.n_submitted)
+                return false;
+
+        /*
+         * A send submitted through the dispatcher refers to the queued
+         * buffers until it completed. Wait for it, before the queue is
+         * modified behind its back. If the dispatch-file is gone already, it
+         * waited for the send before.
+         */
+        socket->out.n_submitted = 0;
+        if (!dispatch_file_can_submit(socket->file))
+                return false;
+
+        dispatch_file_flush(socket->file);
+        done = dispatch_file_reap(socket->file, lp);
+        assert(done);
+
+        return true;
 }
 
 static void socket_discard_output(Socket *socket) {
         SocketBuffer *buffer;
+        ssize_t l;
+
+        socket_settle_output(socket, &l);
 
-        while ((buffer = c_list_first_entry(&socket->out.queue, SocketBuffer, link)))
+        while ((buffer = c_list_first_entry(&socket->out.queue, SocketBuffer, link))) {
+                socket_unqueue_buffer(socket, buffer);
                 socket_buffer_free(buffer);
+        }
+}
+
+static SocketShm *socket_shm_free(SocketShm *shm) {
+        if (!shm)
+                return NULL;
+
+        if (shm->wake_fd >= 0)
+                close(shm->wake_fd);
+        if (shm->map)
+                munmap(shm->map, 2 * SHMRING_MAP_SIZE);
+        user_charge_deinit(&shm->charge);
+        free(shm);
+
+        return NULL;
+}
+
+C_DEFINE_CLEANUP(SocketShm *, socket_shm_free);
+
+static int socket_shm_wake(SocketShm *shm) {
+        ssize_t l;
+
+        /*
+         * Wake-ups are sent as datagrams, rather than through an eventfd,
+         * since the peer shares the file description and could make an
+         * eventfd block. If the queue of the peer is full, it has wake-ups
+         * pending anyway. If the peer closed its end, it is gone, and will
+         * notice on its socket.
+         */
+        l = send(shm->wake_fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (l < 0 && errno != EAGAIN && errno != ECONNREFUSED && errno != ECONNRESET && errno != EPIPE)
+                return error_origin(-errno);
+
+        return 0;
 }
 
 /**
@@ -236,12 +453,15 @@ void socket_deinit(Socket *socket) {
 
         while ((buffer = c_list_first_entry(&socket->out.pending, SocketBuffer, link)))
                 socket_buffer_free(buffer);
+        socket->out.n_pending = 0;
 
         assert(c_list_is_empty(&socket->out.pending));
         assert(c_list_is_empty(&socket->out.queue));
+        assert(c_list_is_empty(&socket->out.coalescable));
         assert(!socket->in.message);
 
         iqueue_deinit(&socket->in.queue);
+        socket->shm = socket_shm_free(socket->shm);
         socket->fd = -1;
         socket->user = user_unref(socket->user);
 }
@@ -345,6 +565,37 @@ int socket_dequeue_line(Socket *socket, const char **linep, size_t *np) {
         return 0;
 }
 
+/*
+ * Bodies of rejected messages are read into this buffer and discarded. Its
+ * content is never looked at, hence it is shared by all sockets.
+ */
+static uint8_t socket_drain_buffer[SOCKET_DRAIN_MAX];
+
+static int socket_drain(Socket *socket) {
+        _c_cleanup_(fdlist_freep) FDList *fds = NULL;
+        int r;
+
+        while (socket->in.n_drain) {
+                if (!iqueue_get_target(&socket->in.queue)) {
+                        r = iqueue_set_target(&socket->in.queue,
+                                              socket_drain_buffer,
+                                              c_min(socket->in.n_drain, sizeof(socket_drain_buffer)));
+                        if (r)
+                                return r;
+                }
+
+                /* FDs are attached to the last chunk, and dropped with it */
+                r = iqueue_pop_data(&socket->in.queue,
+                                    (socket->in.n_drain > socket->in.queue.pending.n_data) ? NULL : &fds);
+                if (r)
+                        return r;
+
+                socket->in.n_drain -= c_min(socket->in.n_drain, sizeof(socket_drain_buffer));
+        }
+
+        return 0;
+}
+
 /**
  * socket_dequeue() - fetch message from input buffer
  * @socket:             socket to operate on
@@ -356,20 +607,43 @@ int socket_dequeue_line(Socket *socket, const char **linep, size_t *np) {
  * If no more messages can be fetched from the input buffer, NULL is put into
  * @messagep.
  *
+ * If admission control is enabled, and the header of a large message was
+ * received, SOCKET_E_ADMISSION is returned and @messagep points to the partial
+ * message, owning a reference to be released by the caller. Only its header
+ * is valid. The caller must decide via socket_admit() whether to receive the
+ * body, before calling socket_dequeue() again.
+ *
  * If the input stream was shutdown, SOCKET_E_EOF is returned and no further
  * data can be read.
  *
  * Return: On success, 0 is returned and @messagep will point to the read
  *         message (now owned by the caller). If no more messages can be
  *         fetched, NULL is put into @messagep.
+ *         SOCKET_E_ADMISSION is returned if a partial message waits for
+ *         admission.
  *         If the input-stream was closed and no more data is to be read,
  *         SOCKET_E_EOF is returned.
  *         On fatal errors, a negative error code is returned.
  */
 int socket_dequeue(Socket *socket, Message **messagep) {
         Message *message;
+        size_t n;
         int r;
 
+        assert(!socket->in.admitting);
+
+        if (_c_unlikely_(socket->in.n_drain)) {
+                r = socket_drain(socket);
+                if (r == IQUEUE_E_PENDING) {
+                        goto nodata;
+                } else if (r == IQUEUE_E_VIOLATION) {
+                        socket_close(socket);
+                        return SOCKET_E_EOF;
+                } else if (r) {
+                        return (r == IQUEUE_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
+                }
+        }
+
         if (!iqueue_get_target(&socket->in.queue)) {
                 r = iqueue_set_target(&socket->in.queue,
                                       &socket->in.header,
@@ -398,10 +672,22 @@ int socket_dequeue(Socket *socket, Message **messagep) {
                         return error_fold(r);
                 }
 
+                /*
+                 * Large messages are received in two steps, if requested. The
+                 * header fields are received first, so the caller can decide
+                 * whether to receive the body at all.
+                 */
+                n = message->n_data - sizeof(socket->in.header);
+                if (socket->in.admission && message->n_body >= SOCKET_ADMISSION_MIN) {
+                        n = c_align8(message->n_header) - sizeof(socket->in.header);
+                        socket->in.fields = true;
+                }
+
                 r = iqueue_set_target(&socket->in.queue,
                                       message->data + sizeof(socket->in.header),
-                                      message->n_data - sizeof(socket->in.header));
+                                      n);
                 if (r) {
+                        socket->in.fields = false;
                         message_unref(message);
                         return (r == IQUEUE_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
                 }
@@ -411,7 +697,8 @@ int socket_dequeue(Socket *socket, Message **messagep) {
 
         assert(socket->in.message);
 
-        r = iqueue_pop_data(&socket->in.queue, &socket->in.message->fds);
+        /* FDs stay pending until the body was received */
+        r = iqueue_pop_data(&socket->in.queue, socket->in.fields ? NULL : &socket->in.message->fds);
         if (r == IQUEUE_E_PENDING) {
                 goto nodata;
         } else if (r == IQUEUE_E_VIOLATION) {
@@ -421,11 +708,19 @@ int socket_dequeue(Socket *socket, Message **messagep) {
                 return error_fold(r);
         }
 
+        if (_c_unlikely_(socket->in.fields)) {
+                socket->in.fields = false;
+                socket->in.admitting = true;
+                *messagep = message_ref(socket->in.message);
+                return SOCKET_E_ADMISSION;
+        }
+
         *messagep = socket->in.message;
         socket->in.message = NULL;
         return 0;
 
 nodata:
+        iqueue_trim(&socket->in.queue);
         socket_might_reset(socket);
         if (_c_unlikely_(socket->hup_in))
                 return SOCKET_E_EOF;
@@ -434,6 +729,54 @@ nodata:
         return 0;
 }
 
+/**
+ * socket_set_admission() - control admission of large messages
+ * @socket:             socket to operate on
+ * @admission:          whether to enable admission control
+ *
+ * This enables or disables admission control on @socket. If enabled, the body
+ * of large messages is only received once the caller admitted them via
+ * socket_admit(). See socket_dequeue() for details.
+ */
+void socket_set_admission(Socket *socket, bool admission) {
+        socket->in.admission = admission;
+}
+
+/**
+ * socket_admit() - decide on pending message
+ * @socket:             socket to operate on
+ * @admit:              whether to admit the message
+ *
+ * This must be called after socket_dequeue() returned SOCKET_E_ADMISSION. If
+ * @admit is true, the body of the pending message is received and it is
+ * returned by socket_dequeue() as usual. Otherwise, the pending message is
+ * dropped, and its body is read in bounded chunks and discarded, without ever
+ * being buffered.
+ *
+ * Return: 0 on success, SOCKET_E_QUOTA if quota failed, negative error code
+ *         on failure.
+ */
+int socket_admit(Socket *socket, bool admit) {
+        Message *message = socket->in.message;
+        int r;
+
+        assert(socket->in.admitting);
+        assert(message);
+
+        socket->in.admitting = false;
+
+        if (admit) {
+                r = iqueue_set_target(&socket->in.queue, message->body, message->n_body);
+                if (r)
+                        return (r == IQUEUE_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
+        } else {
+                socket->in.n_drain = message->n_body;
+                socket->in.message = message_unref(message);
+        }
+
+        return 0;
+}
+
 /**
  * socket_queue_line() - queue line on socket
  * @socket:             socket to operate on
@@ -479,6 +822,36 @@ int socket_queue_line(Socket *socket, User *user, const char *line_in, size_t n)
         return 0;
 }
 
+/**
+ * socket_check_quota() - check whether a message could be queued
+ * @socket:             socket to operate on
+ * @user:               user to charge as
+ * @message:            message to check
+ *
+ * This checks whether the quota of @user on the socket owner of @socket
+ * suffices to queue @message, without queueing it. Only the bytes of the
+ * message are checked, so this can be used before its body and FDs were
+ * received.
+ *
+ * Return: 0 on success, SOCKET_E_QUOTA if quota failed, negative error code
+ *         on failure.
+ */
+int socket_check_quota(Socket *socket, User *user, Message *message) {
+        UserCharge charge = USER_CHARGE_INIT;
+        int r;
+
+        r = user_charge(socket->user,
+                        &charge,
+                        user,
+                        USER_SLOT_BYTES,
+                        sizeof(SocketBuffer) + message_get_footprint(message));
+        user_charge_deinit(&charge);
+        if (r)
+                return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
+
+        return 0;
+}
+
 /**
  * socket_queue() - queue socket buffer on socket
  * @socket:             socket to operate on
@@ -502,100 +875,406 @@ int socket_queue(Socket *socket, User *user, Message *message) {
         if (r)
                 return error_trace(r);
 
-        c_list_link_tail(&socket->out.queue, &buffer->link);
+        socket_link_buffer(socket, buffer);
+        ++socket->out.n_messages;
+        socket->out.n_bytes += message->n_data;
         buffer = NULL;
         return 0;
 }
 
-static int socket_recvmsg(Socket *socket,
-                          void *buffer,
-                          size_t *from,
-                          size_t to,
-                          FDList **fdsp,
-                          UserCharge *charge_fds) {
-        union {
-                struct cmsghdr cmsg;
-                char buffer[CMSG_SPACE(sizeof(int) * SOCKET_FD_MAX)];
-        } control;
-        struct cmsghdr *cmsg;
-        struct msghdr msg;
-        int r, *fds = NULL;
-        size_t n_fds = 0;
-        ssize_t l;
-
-        assert(to > *from);
+static bool socket_buffer_supersedes(SocketBuffer *buffer, Message *message) {
+        Message *queued = buffer->message;
+
+        if (queued->sender_id != message->sender_id ||
+            queued->metadata.header.type != message->metadata.header.type ||
+            strcmp(queued->metadata.fields.path ?: "", message->metadata.fields.path ?: "") ||
+            strcmp(queued->metadata.fields.interface ?: "", message->metadata.fields.interface ?: "") ||
+            strcmp(queued->metadata.fields.member ?: "", message->metadata.fields.member ?: ""))
+                return false;
+
+        if (queued->metadata.args[0].element != message->metadata.args[0].element)
+                return false;
+
+        switch (message->metadata.args[0].element) {
+        case 0:
+                return true;
+        case 's':
+                return !strcmp(queued->metadata.args[0].value, message->metadata.args[0].value);
+        default:
+                return false;
+        }
+}
 
-        msg = (struct msghdr){
-                .msg_iov = &(struct iovec){
-                        .iov_base = buffer + *from,
-                        .iov_len = to - *from,
-                },
-                .msg_iovlen = 1,
-                .msg_control = &control,
-                .msg_controllen = sizeof(control),
-        };
+/**
+ * socket_queue_coalesce() - queue message, replacing superseded ones
+ * @socket:             socket to operate on
+ * @user:               user to charge as
+ * @message:            message to queue
+ * @fn:                 callback to confirm superseded messages, or NULL
+ *
+ * This is like socket_queue(), but messages from the same sender, with the
+ * same type, path, interface and member, that were queued via this function
+ * before and were not written to the socket, yet, are dropped. If the body of
+ * the messages was parsed, their first argument must match as well, and must
+ * be a string. If @fn is given, a queued message is only dropped if @fn
+ * confirms that @message carries everything it carries. Otherwise, both are
+ * kept. The new message is appended to the queue, so it retains its order
+ * relative to all other queued messages.
+ *
+ * The caller is responsible to only use this for messages that are superseded
+ * by newer ones, and to parse their metadata before. Messages with
+ * file-descriptors are never coalesced.
+ *
+ * Every socket keeps a list of all buffers that can be coalesced, so the
+ * candidates are found without walking the entire queue. Without @fn, each
+ * key is queued at most once, plus once more while partially written. With
+ * @fn, a key is queued once for each message that was not superseded.
+ *
+ * Return: 0 on success, SOCKET_E_QUOTA if quota failed, SOCKET_E_SHUTDOWN if
+ *         write-side end is already shutdown, negative error code on failure.
+ */
+int socket_queue_coalesce(Socket *socket, User *user, Message *message, SocketSupersedeFn fn) {
+        _c_cleanup_(socket_buffer_freep) SocketBuffer *buffer = NULL;
+        SocketBuffer *queued, *safe;
+        int r;
 
-        l = recvmsg(socket->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
-        if (_c_unlikely_(!l)) {
-                /*
-                 * A 0 return of recvmsg() signals end-of-file. Hence, hangup
-                 * the input side, but keep the output alive. We might still
-                 * want to flush more data out.
-                 */
-                socket_hangup_input(socket);
-                return SOCKET_E_LOST_INTEREST;
-        } else if (_c_unlikely_(l < 0)) {
-                switch (errno) {
-                case EAGAIN:
-                        return 0;
-                case ECOMM:
-                case ECONNABORTED:
-                case ECONNRESET:
-                case EHOSTDOWN:
-                case EHOSTUNREACH:
-                case EIO:
-                case ENOBUFS:
-                case ENOMEM:
-                case EPIPE:
-                case EPROTO:
-                case EREMOTEIO:
-                case ESHUTDOWN:
-                case ETIMEDOUT:
-                        /*
-                         * If recvmsg(2) fails, this means both read-side *and*
-                         * write-side are shutdown. A mere read-side hangup is
-                         * signalled by a 0 return-value (handled above).
-                         */
-                        socket_hangup_input(socket);
-                        socket_hangup_output(socket);
-                        return SOCKET_E_LOST_INTEREST;
-                }
+        if (_c_unlikely_(socket->hup_out || socket->shutdown))
+                return SOCKET_E_SHUTDOWN;
 
-                return error_origin(-errno);
-        }
+        if (fdlist_count(message->fds))
+                return socket_queue(socket, user, message);
 
-        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-                if (cmsg->cmsg_level == SOL_SOCKET &&
-                    cmsg->cmsg_type == SCM_RIGHTS) {
-                        /*
-                         * Kernel breaks after SKB+fd, so we never get more
-                         * than one SCM_RIGHTS array.
-                         */
-                        assert(!n_fds);
-                        fds = (void *)CMSG_DATA(cmsg);
-                        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
-                        assert(n_fds <= SOCKET_FD_MAX);
+        c_list_for_each_entry_safe(queued, safe, &socket->out.coalescable, coalesce_link) {
+                if (socket_buffer_is_uncomsumed(queued) &&
+                    socket_buffer_supersedes(queued, message) &&
+                    (!fn || fn(queued->message, message))) {
+                        socket_unqueue_buffer(socket, queued);
+                        socket_buffer_free(queued);
+                        ++socket->out.n_coalesced;
                 }
         }
 
-        if (msg.msg_flags & MSG_CTRUNC) {
-                /*
-                 * This flag means the control-buffer was too small to retrieve
-                 * all data. If this can be triggered remotely, it means a peer
-                 * can cause us to miss FDs. Hence, we really must protect
-                 * against this.
-                 * We do provide suitably sized buffers to be prepared for any
-                 * possible scenario. So if this happens, something is fishy
+        r = socket_buffer_new_message(&buffer, socket, user, message);
+        if (r)
+                return error_trace(r);
+
+        socket_link_buffer(socket, buffer);
+        c_list_link_tail(&socket->out.coalescable, &buffer->coalesce_link);
+        ++socket->out.n_messages;
+        socket->out.n_bytes += message->n_data;
+        buffer = NULL;
+        return 0;
+}
+
+static void socket_message_get_charges(Message *message, size_t *amounts) {
+        amounts[0] = sizeof(SocketBuffer) + message_get_footprint(message);
+        amounts[1] = fdlist_count(message->fds);
+        amounts[2] = message->n_memfd;
+}
+
+/**
+ * socket_queue_batch() - queue multiple messages on socket
+ * @socket:             socket to operate on
+ * @user:               user to charge as
+ * @messages:           messages to queue
+ * @n_messages:         number of messages to queue
+ *
+ * This is like calling socket_queue() for each message in @messages, but the
+ * quota for all messages is charged at once, and the charge is then split
+ * across the individual messages. Either all messages are queued, or none.
+ *
+ * Return: 0 on success, SOCKET_E_QUOTA if quota failed, SOCKET_E_SHUTDOWN if
+ *         write-side end is already shutdown, negative error code on failure.
+ */
+int socket_queue_batch(Socket *socket, User *user, Message **messages, size_t n_messages) {
+        static const size_t slots[] = { USER_SLOT_BYTES, USER_SLOT_FDS, USER_SLOT_MEMFD_BYTES };
+        UserCharge charges[C_ARRAY_SIZE(slots)];
+        size_t amount[C_ARRAY_SIZE(slots)], amounts[C_ARRAY_SIZE(slots)] = {};
+        CList batch = C_LIST_INIT(batch);
+        SocketBuffer *buffer;
+        size_t i, j;
+        int r = 0;
+
+        if (_c_unlikely_(socket->hup_out || socket->shutdown))
+                return SOCKET_E_SHUTDOWN;
+
+        for (i = 0; i < C_ARRAY_SIZE(charges); ++i)
+                user_charge_init(&charges[i]);
+
+        for (i = 0; i < n_messages; ++i) {
+                r = socket_buffer_new_message_uncharged(&buffer, messages[i]);
+                if (r) {
+                        r = error_trace(r);
+                        goto exit;
+                }
+
+                c_list_link_tail(&batch, &buffer->link);
+
+                socket_message_get_charges(messages[i], amount);
+                for (j = 0; j < C_ARRAY_SIZE(slots); ++j)
+                        amounts[j] += amount[j];
+        }
+
+        for (i = 0; i < C_ARRAY_SIZE(slots); ++i) {
+                if (amounts[i] > UINT_MAX) {
+                        r = SOCKET_E_QUOTA;
+                        goto exit;
+                }
+
+                r = user_charge(socket->user, &charges[i], user, slots[i], amounts[i]);
+                if (r) {
+                        r = (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
+                        goto exit;
+                }
+        }
+
+        while ((buffer = c_list_first_entry(&batch, SocketBuffer, link))) {
+                socket_message_get_charges(buffer->message, amount);
+                for (i = 0; i < C_ARRAY_SIZE(slots); ++i)
+                        user_charge_split(&charges[i], &buffer->charges[i], amount[i]);
+
+                c_list_unlink(&buffer->link);
+                socket_link_buffer(socket, buffer);
+                ++socket->out.n_messages;
+                socket->out.n_bytes += buffer->message->n_data;
+        }
+
+exit:
+        while ((buffer = c_list_first_entry(&batch, SocketBuffer, link)))
+                socket_buffer_free(buffer);
+        for (i = 0; i < C_ARRAY_SIZE(charges); ++i)
+                user_charge_deinit(&charges[i]);
+        return r;
+}
+
+/**
+ * socket_set_lanes() - enable or disable output lanes
+ * @socket:             socket to operate on
+ * @lanes:              whether to enable lanes
+ *
+ * This enables or disables output lanes on @socket. With lanes enabled,
+ * messages queued from then on are written ordered by their type: method
+ * returns and errors first, then method calls, and signals last. Messages of
+ * the same type are written in the order they were queued. Messages queued
+ * before lanes were enabled are never overtaken.
+ *
+ * Note that this gives up the ordering guarantees of D-Bus between messages of
+ * different types, including messages from the same sender. The receiver must
+ * explicitly be prepared for that.
+ */
+void socket_set_lanes(Socket *socket, bool lanes) {
+        size_t i;
+
+        if (!lanes)
+                for (i = 0; i < _SOCKET_LANE_N; ++i)
+                        while (!c_list_is_empty(&socket->out.lanes[i]))
+                                c_list_unlink_init(c_list_first(&socket->out.lanes[i]));
+
+        socket->lanes = lanes;
+}
+
+/**
+ * socket_open_shm() - set up a shared-memory transport
+ * @socket:             socket to operate on
+ * @memfdp:             output argument for the memfd of the rings
+ * @wake_fdp:           output argument for the wake-up socket of the peer
+ *
+ * This sets up a pair of shared-memory rings for @socket, to be used instead
+ * of the socket to exchange messages. Both rings live in a single sealed
+ * memfd, each SHMRING_MAP_SIZE bytes in size: the first carries messages from
+ * the peer to us, the second carries messages from us to the peer. Both sides
+ * wake each other up by sending a datagram on a socket-pair, whenever their
+ * rings need attention. The memfd and the peer end of the socket-pair are
+ * returned to the caller, which is responsible to hand them to the peer, and
+ * to close them.
+ *
+ * Input is read from the rings right away, once the socket was drained.
+ * Output keeps being written to the socket until everything queued before the
+ * switch, including the reply that hands over the rings, was written. From
+ * then on, all output goes to the ring. File descriptors cannot be passed
+ * through the rings. Hence, apart from the reply that hands over the rings,
+ * the caller must not queue messages with file descriptors once this was
+ * called.
+ *
+ * The rings are charged to the user of @socket.
+ *
+ * Return: 0 on success, SOCKET_E_QUOTA if the quota failed, negative error
+ *         code on failure.
+ */
+int socket_open_shm(Socket *socket, int *memfdp, int *wake_fdp) {
+        _c_cleanup_(socket_shm_freep) SocketShm *shm = NULL;
+        _c_cleanup_(c_closep) int memfd = -1;
+        int r, pair[2];
+
+        assert(!socket->shm);
+
+        shm = calloc(1, sizeof(*shm));
+        if (!shm)
+                return error_origin(-ENOMEM);
+
+        *shm = (SocketShm)SOCKET_SHM_NULL;
+
+        r = user_charge(socket->user, &shm->charge, NULL, USER_SLOT_BYTES, 2 * SHMRING_MAP_SIZE);
+        if (r)
+                return (r == USER_E_QUOTA) ? SOCKET_E_QUOTA : error_fold(r);
+
+        memfd = memfd_create("dbus-broker-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (memfd < 0)
+                return error_origin(-errno);
+
+        r = ftruncate(memfd, 2 * SHMRING_MAP_SIZE);
+        if (r < 0)
+                return error_origin(-errno);
+
+        /* the peer must not be able to truncate the mapping under our feet */
+        r = fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+        if (r < 0)
+                return error_origin(-errno);
+
+        shm->map = mmap(NULL, 2 * SHMRING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (shm->map == MAP_FAILED) {
+                shm->map = NULL;
+                return error_origin(-errno);
+        }
+
+        r = socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, pair);
+        if (r < 0)
+                return error_origin(-errno);
+
+        shm->wake_fd = pair[0];
+        shmring_init(&shm->rx, shm->map);
+        shmring_init(&shm->tx, (uint8_t *)shm->map + SHMRING_MAP_SIZE);
+
+        socket->shm = shm;
+        shm = NULL;
+        *memfdp = memfd;
+        memfd = -1;
+        *wake_fdp = pair[1];
+        return 0;
+}
+
+/**
+ * socket_dispatch_shm() - dispatch shared-memory wake-ups
+ * @socket:             socket to operate on
+ *
+ * This consumes all pending wake-ups sent by the peer on the shared-memory
+ * transport of @socket. The caller must then dispatch both input and output
+ * of @socket, as either ring might need attention.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int socket_dispatch_shm(Socket *socket) {
+        char buffer[64];
+        ssize_t l;
+
+        assert(socket->shm);
+
+        do {
+                l = recv(socket->shm->wake_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        } while (l >= 0);
+
+        if (errno != EAGAIN)
+                return error_origin(-errno);
+
+        return 0;
+}
+
+static int socket_recvmsg(Socket *socket,
+                          void *buffer,
+                          size_t *from,
+                          size_t to,
+                          FDList **fdsp,
+                          UserCharge *charge_fds) {
+        _c_cleanup_(fdlist_freep) FDList *control = NULL;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        int r, *fds = NULL;
+        size_t n_fds = 0;
+        bool drained;
+        ssize_t l;
+
+        assert(to > *from);
+
+        /*
+         * The control buffer is taken from the FDList pools, rather than
+         * the stack, so received FDs can be handed out without copying
+         * them once more, see fdlist_consume_control().
+         */
+        r = fdlist_new_control(&control);
+        if (r)
+                return error_fold(r);
+
+        msg = (struct msghdr){
+                .msg_iov = &(struct iovec){
+                        .iov_base = buffer + *from,
+                        .iov_len = to - *from,
+                },
+                .msg_iovlen = 1,
+                .msg_control = control->cmsg,
+                .msg_controllen = FDLIST_CONTROL_SIZE,
+        };
+
+        l = recvmsg(socket->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (_c_unlikely_(!l)) {
+                /*
+                 * A 0 return of recvmsg() signals end-of-file. Hence, hangup
+                 * the input side, but keep the output alive. We might still
+                 * want to flush more data out.
+                 */
+                socket_hangup_input(socket);
+                return SOCKET_E_LOST_INTEREST;
+        } else if (_c_unlikely_(l < 0)) {
+                switch (errno) {
+                case EAGAIN:
+                        return 0;
+                case ECOMM:
+                case ECONNABORTED:
+                case ECONNRESET:
+                case EHOSTDOWN:
+                case EHOSTUNREACH:
+                case EIO:
+                case ENOBUFS:
+                case ENOMEM:
+                case EPIPE:
+                case EPROTO:
+                case EREMOTEIO:
+                case ESHUTDOWN:
+                case ETIMEDOUT:
+                        /*
+                         * If recvmsg(2) fails, this means both read-side *and*
+                         * write-side are shutdown. A mere read-side hangup is
+                         * signalled by a 0 return-value (handled above).
+                         */
+                        socket_hangup_input(socket);
+                        socket_hangup_output(socket);
+                        return SOCKET_E_LOST_INTEREST;
+                }
+
+                return error_origin(-errno);
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS) {
+                        /*
+                         * Kernel breaks after SKB+fd, so we never get more
+                         * than one SCM_RIGHTS array.
+                         */
+                        assert(!n_fds);
+                        fds = (void *)CMSG_DATA(cmsg);
+                        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                        assert(n_fds <= SOCKET_FD_MAX);
+                }
+        }
+
+        if (msg.msg_flags & MSG_CTRUNC) {
+                /*
+                 * This flag means the control-buffer was too small to retrieve
+                 * all data. If this can be triggered remotely, it means a peer
+                 * can cause us to miss FDs. Hence, we really must protect
+                 * against this.
+                 * We do provide suitably sized buffers to be prepared for any
+                 * possible scenario. So if this happens, something is fishy
                  * and we better report it.
                  * Note that this is also reported by the kernel if we exceeded
                  * our NOFILE limit. Since this implies resource
@@ -656,7 +1335,7 @@ static int socket_recvmsg(Socket *socket,
                         goto error;
                 }
 
-                r = fdlist_new_consume_fds(fdsp, fds, n_fds);
+                r = fdlist_consume_control(fdsp, &control, fds, n_fds);
                 if (r) {
                         user_charge_deinit(charge_fds);
                         r = error_fold(r);
@@ -664,8 +1343,20 @@ static int socket_recvmsg(Socket *socket,
                 }
         }
 
+        /*
+         * The kernel only cuts a stream read short if the queue ran empty,
+         * or after an SKB with FDs (or credentials, or at the out-of-band
+         * mark, neither of which D-Bus uses). Hence, if a read without FDs
+         * did not fill the buffer, the queue is drained. Treat it like EAGAIN
+         * right away, rather than calling into recvmsg(2) once more just to
+         * be told so. This saves one syscall on every wakeup. Since all
+         * sockets are edge-triggered, any data arriving later wakes us up
+         * again.
+         */
+        drained = !n_fds && (size_t)l < to - *from;
+
         *from += l;
-        return SOCKET_E_PREEMPTED;
+        return drained ? 0 : SOCKET_E_PREEMPTED;
 
 error:
         while (n_fds)
@@ -673,9 +1364,31 @@ error:
         return r;
 }
 
+static int socket_recv_shm(Socket *socket, void *buffer, size_t *from, size_t to) {
+        size_t n;
+        bool wake;
+        int r, k;
+
+        r = shmring_read(&socket->shm->rx, buffer + *from, to - *from, &n, &wake);
+        if (r == SHMRING_E_CORRUPT) {
+                socket_close(socket);
+                return SOCKET_E_LOST_INTEREST;
+        }
+
+        *from += n;
+
+        if (wake) {
+                k = socket_shm_wake(socket->shm);
+                if (k)
+                        return error_trace(k);
+        }
+
+        return r ? SOCKET_E_PREEMPTED : 0;
+}
+
 static int socket_dispatch_read(Socket *socket) {
         UserCharge *charge_fds;
-        size_t *from, to;
+        size_t *from, to, start;
         FDList **fds;
         void *buffer;
         int r;
@@ -699,155 +1412,323 @@ static int socket_dispatch_read(Socket *socket) {
                 return error_fold(r);
         }
 
-        return socket_recvmsg(socket,
-                              buffer,
-                              from,
-                              to,
-                              fds,
-                              charge_fds);
+        start = *from;
+
+        r = socket_recvmsg(socket,
+                           buffer,
+                           from,
+                           to,
+                           fds,
+                           charge_fds);
+
+        /*
+         * Only read from the ring once the socket was drained. Furthermore,
+         * FDs belong to the last byte of a socket read, so ring data must
+         * never be appended to it before the FDs were dequeued.
+         */
+        if (socket->shm && !r && !*fds)
+                r = socket_recv_shm(socket, buffer, from, to);
+
+        if (!r || r == SOCKET_E_PREEMPTED)
+                iqueue_note_read(&socket->in.queue, from, to - start, *from - start, !r);
+
+        TRACE_PROBE(socket_read, socket->fd, *from - start);
+
+        return r;
 }
 
-static int socket_dispatch_write(Socket *socket) {
+static void socket_trim_output(Socket *socket) {
+        SocketBuffer *buffer;
+
+        /*
+         * If a big message was only partially written, release the part of
+         * its body that is done, so a slow receiver does not keep the entire
+         * message resident while it drains it. The body is always the last
+         * iovec of a message.
+         */
+        buffer = c_list_first_entry(&socket->out.queue, SocketBuffer, link);
+        if (buffer &&
+            buffer->message &&
+            buffer->i_vec + 1 == buffer->n_vecs)
+                message_release_body(buffer->message, buffer->n_vec);
+
+        /* nothing must be queued in front of a partially written buffer */
+        if (buffer && !socket_buffer_is_uncomsumed(buffer))
+                c_list_unlink_init(&buffer->lane_link);
+}
+
+static int socket_send_shm(Socket *socket) {
         SocketBuffer *buffer, *safe;
-        struct mmsghdr msgs[SOCKET_MMSG_MAX];
-        struct msghdr *msg;
-        int r, i, v, n_msgs;
+        struct iovec vecs[SOCKET_IOV_MAX];
+        size_t n, n_vecs = 0, n_written;
+        bool wake;
+        int r, k;
 
-        if (!c_list_is_empty(&socket->out.pending)) {
-                r = ioctl(socket->fd, SIOCOUTQ, &v);
-                if (r < 0)
-                        return error_origin(-errno);
+        /*
+         * Gather as many queued buffers as fit into our iovecs, and copy them
+         * into the ring in one go, so the consumer is woken up at most once.
+         * FDs cannot be passed through the ring, so the caller never queues
+         * messages with FDs on sockets using shared memory (see
+         * socket_open_shm()).
+         */
+        c_list_for_each_entry(buffer, &socket->out.queue, link) {
+                assert(!buffer->message || !fdlist_count(buffer->message->fds));
 
-                if (v > 0) /* treat like EAGAIN */
-                        return 0;
+                n = buffer->n_vecs - buffer->i_vec;
+                if (n_vecs + n > C_ARRAY_SIZE(vecs))
+                        break;
 
-                c_list_for_each_entry_safe(buffer, safe, &socket->out.pending, link)
-                        socket_buffer_free(buffer);
+                if (_c_likely_(socket_buffer_is_uncomsumed(buffer)))
+                        memcpy(vecs + n_vecs, buffer->vecs, n * sizeof(*vecs));
+                else
+                        socket_buffer_get_remaining(buffer, vecs + n_vecs);
 
-                socket_might_reset(socket);
+                n_vecs += n;
         }
 
-        if (socket->hup_out)
+        r = shmring_write(&socket->shm->tx, vecs, n_vecs, &n_written, &wake);
+        if (r == SHMRING_E_CORRUPT) {
+                socket_hangup_output(socket);
+                socket_close(socket);
                 return SOCKET_E_LOST_INTEREST;
+        }
 
-        n_msgs = 0;
-        c_list_for_each_entry(buffer, &socket->out.queue, link) {
-                msg = &msgs[n_msgs].msg_hdr;
+        c_list_for_each_entry_safe(buffer, safe, &socket->out.queue, link) {
+                if (!socket_buffer_consume(buffer, &n_written))
+                        break;
 
-                msg->msg_name = NULL;
-                msg->msg_namelen = 0;
-                msg->msg_iov = buffer->vecs;
-                msg->msg_iovlen = buffer->n_vecs;
-                if (buffer->message &&
-                    buffer->message->fds &&
-                    socket_buffer_is_uncomsumed(buffer)) {
-                        msg->msg_control = buffer->message->fds->cmsg;
-                        msg->msg_controllen = buffer->message->fds->cmsg->cmsg_len;
-                } else {
-                        msg->msg_control = NULL;
-                        msg->msg_controllen = 0;
-                }
-                msg->msg_flags = 0;
+                if (buffer->message)
+                        TRACE_PROBE(socket_write,
+                                    socket->fd,
+                                    buffer->message->sender_id,
+                                    buffer->message->metadata.header.serial);
 
-                if (++n_msgs >= (ssize_t)C_ARRAY_SIZE(msgs))
-                        break;
+                socket_unqueue_buffer(socket, buffer);
+                socket_buffer_free(buffer);
+        }
 
-                /*
-                 * Right now, the only information the kernel gives us about
-                 * outgoing queues is whether there is data queued or not. That
-                 * is, a boolean state. There is some other data, but we cannot
-                 * reliable deduce any useful state from it.
-                 *
-                 * Hence, we only ever queue at most 1 message with FDs on it.
-                 * This way, we can reliably get notified about FDs being
-                 * queued and dequeued.
-                 *
-                 * We could, technically, avoid this and just spam out
-                 * messages. However, we better be notified as early as
-                 * possible about dequeued FDs, so our accounting actually
-                 * represents the real client-controlled state. If we were
-                 * notified late (because we continued queueing), then a client
-                 * might have dequeued the FDs at fault, but we still consider
-                 * them queued and thus might exceed its quota.
-                 */
-                if (buffer->message && fdlist_count(buffer->message->fds))
-                        break;
+        if (wake) {
+                k = socket_shm_wake(socket->shm);
+                if (k)
+                        return error_trace(k);
         }
 
-        if (!n_msgs)
-                return SOCKET_E_LOST_INTEREST;
+        socket_trim_output(socket);
 
-        n_msgs = sendmmsg(socket->fd, msgs, n_msgs, MSG_DONTWAIT | MSG_NOSIGNAL);
-        if (n_msgs < 0) {
-                switch (errno) {
-                case EAGAIN:
-                        return 0;
-                case ETOOMANYREFS:
-                        /*
-                         * The kernel used to return ETOOMANYREFS if we exceed
-                         * the fd-passing recursion limit. This was dropped in
-                         * commit:
-                         *
-                         *     commit 27eac47b00789522ba00501b0838026e1ecb6f05
-                         *     Author: David Herrmann <dh.herrmann@gmail.com>
-                         *     Commit: David S. Miller <davem@davemloft.net>
-                         *     Date:   Mon Jul 17 11:35:54 2017 +0200
-                         *
-                         *         net/unix: drop obsolete fd-recursion limits
-                         *
-                         * Since then the kernel no longer limits the recursion
-                         * depth, thus we will not trigger ETOOMANYREFS. You
-                         * are highly recommended to run >=linux-4.14,
-                         * otherwise clients can exploit this by modifying
-                         * file-descriptors while inflight.
-                         *
-                         * Note that the kernel also returns ETOOMANYREFS if we
-                         * exceeded our per-user limit of maximum inflight
-                         * file-descriptors. Since we employ quota-accounting,
-                         * ETOOMANYREFS should never occur, unless you
-                         * misconfigured your broker. Hence, we treat this as
-                         * fatal error.
-                         */
-                        break;
-                case ECOMM:
-                case ECONNABORTED:
-                case ECONNRESET:
-                case EHOSTDOWN:
-                case EHOSTUNREACH:
-                case EIO:
-                case ENOBUFS:
-                case ENOMEM:
-                case EPIPE:
-                case EPROTO:
-                case EREMOTEIO:
-                case ESHUTDOWN:
-                case ETIMEDOUT:
-                        socket_hangup_output(socket);
-                        return SOCKET_E_LOST_INTEREST;
-                }
+        if (c_list_is_empty(&socket->out.queue)) {
+                if (_c_unlikely_(socket->shutdown))
+                        socket_shutdown_now(socket);
 
-                return error_origin(-errno);
+                return c_list_is_empty(&socket->out.pending) ? SOCKET_E_LOST_INTEREST : 0;
         }
 
-        i = 0;
-        c_list_for_each_entry_safe(buffer, safe, &socket->out.queue, link) {
-                if (i >= n_msgs)
+        /* if the ring ran full, the consumer wakes us up once it has room */
+        return r ? 0 : SOCKET_E_PREEMPTED;
+}
+
+static size_t socket_gather_output(Socket *socket,
+                                   struct mmsghdr *msgs,
+                                   size_t n_max_msgs,
+                                   struct iovec *vecs,
+                                   size_t *n_buffers,
+                                   size_t *n_offeredp) {
+        SocketBuffer *buffer;
+        size_t j, n, n_msgs, n_vecs, n_offered;
+        struct msghdr *msg = NULL;
+        size_t n_inflight;
+        bool has_fds;
+
+        /*
+         * Gather as many queued buffers as possible into as few messages as
+         * possible. Consecutive buffers without FDs are merged into a single
+         * scatter-gather message, so a burst of small messages is written
+         * with a single sendmsg(2), and ends up in as few SKBs as possible on
+         * the receiving side.
+         *
+         * Buffers with FDs always start a new message, since the kernel
+         * attaches FDs to the first SKB of a sendmsg(2) call, and the
+         * receiver must see them with the last byte of the D-Bus message they
+         * belong to.
+         *
+         * The number of bytes gathered per call is limited by an adaptive
+         * batch size. It grows as long as the kernel takes everything we
+         * offer, and shrinks whenever the kernel queue runs full, so we do
+         * not build up iovecs the kernel will not take anyway.
+         */
+        n_msgs = 0;
+        n_vecs = 0;
+        n_offered = 0;
+        n_inflight = socket->out.n_pending;
+        c_list_for_each_entry(buffer, &socket->out.queue, link) {
+                has_fds = buffer->message &&
+                          buffer->message->fds &&
+                          socket_buffer_is_uncomsumed(buffer);
+                n = buffer->n_vecs - buffer->i_vec;
+
+                if (n_vecs + n > SOCKET_IOV_MAX || n_offered >= socket->out.n_batch)
                         break;
 
-                if (socket_buffer_consume(buffer, msgs[i].msg_len)) {
-                        if (buffer->message && buffer->message->fds) {
-                                c_list_unlink(&buffer->link);
-                                c_list_link_tail(&socket->out.pending, &buffer->link);
+                if (!msg || has_fds) {
+                        if (n_msgs >= n_max_msgs)
+                                break;
+
+                        msg = &msgs[n_msgs].msg_hdr;
+                        msg->msg_name = NULL;
+                        msg->msg_namelen = 0;
+                        msg->msg_iov = vecs + n_vecs;
+                        msg->msg_iovlen = 0;
+                        if (has_fds) {
+                                msg->msg_control = buffer->message->fds->cmsg;
+                                msg->msg_controllen = buffer->message->fds->cmsg->cmsg_len;
                         } else {
-                                socket_buffer_free(buffer);
+                                msg->msg_control = NULL;
+                                msg->msg_controllen = 0;
                         }
+                        msg->msg_flags = 0;
+
+                        n_buffers[n_msgs++] = 0;
+                }
+
+                if (_c_likely_(socket_buffer_is_uncomsumed(buffer))) {
+                        memcpy(vecs + n_vecs, buffer->vecs, n * sizeof(*vecs));
+                } else {
+                        /* only the first buffer can be partially written */
+                        assert(n_msgs == 1 && !n_buffers[0]);
+
+                        socket_buffer_get_remaining(buffer, vecs + n_vecs);
                 }
 
-                ++i;
+                for (j = 0; j < n; ++j)
+                        n_offered += vecs[n_vecs + j].iov_len;
+
+                msg->msg_iovlen += n;
+                n_vecs += n;
+                ++n_buffers[n_msgs - 1];
+
+                /*
+                 * Right now, the only information the kernel gives us about
+                 * outgoing queues is whether there is data queued or not. That
+                 * is, a boolean state. There is some other data, but we cannot
+                 * reliable deduce any useful state from it.
+                 *
+                 * Hence, we keep all buffers with FDs on them pending until
+                 * the entire outgoing queue ran empty. Only then do we know
+                 * that all FDs were dequeued by the receiver, and release
+                 * them (and their accounting). Until then, we keep queueing
+                 * data, but at most SOCKET_FD_INFLIGHT_MAX messages with FDs.
+                 *
+                 * This over-accounts FDs for as long as the receiver lags
+                 * behind, but never under-accounts them. If we were notified
+                 * late and released FDs early, a client might have dequeued
+                 * the FDs at fault, but we would still consider them
+                 * released, and it might thus exceed its quota. Bounding the
+                 * number of messages in flight, on the other hand, makes sure
+                 * the queue runs empty eventually and we get notified.
+                 */
+                if (buffer->message &&
+                    fdlist_count(buffer->message->fds) &&
+                    ++n_inflight >= SOCKET_FD_INFLIGHT_MAX)
+                        break;
         }
-        assert(i == n_msgs);
+
+        *n_offeredp = n_offered;
+        return n_msgs;
+}
+
+static int socket_fail_output(Socket *socket, int error) {
+        switch (error) {
+        case ETOOMANYREFS:
+                /*
+                 * The kernel used to return ETOOMANYREFS if we exceed
+                 * the fd-passing recursion limit. This was dropped in
+                 * commit:
+                 *
+                 *     commit 27eac47b00789522ba00501b0838026e1ecb6f05
+                 *     Author: David Herrmann <dh.herrmann@gmail.com>
+                 *     Commit: David S. Miller <davem@davemloft.net>
+                 *     Date:   Mon Jul 17 11:35:54 2017 +0200
+                 *
+                 *         net/unix: drop obsolete fd-recursion limits
+                 *
+                 * Since then the kernel no longer limits the recursion
+                 * depth, thus we will not trigger ETOOMANYREFS. You
+                 * are highly recommended to run >=linux-4.14,
+                 * otherwise clients can exploit this by modifying
+                 * file-descriptors while inflight.
+                 *
+                 * Note that the kernel also returns ETOOMANYREFS if we
+                 * exceeded our per-user limit of maximum inflight
+                 * file-descriptors. Since we employ quota-accounting,
+                 * ETOOMANYREFS should never occur, unless you
+                 * misconfigured your broker. Hence, we treat this as
+                 * fatal error.
+                 */
+                break;
+        case ECOMM:
+        case ECONNABORTED:
+        case ECONNRESET:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case EIO:
+        case ENOBUFS:
+        case ENOMEM:
+        case EPIPE:
+        case EPROTO:
+        case EREMOTEIO:
+        case ESHUTDOWN:
+        case ETIMEDOUT:
+                socket_hangup_output(socket);
+                return SOCKET_E_LOST_INTEREST;
+        }
+
+        return error_origin(-error);
+}
+
+static void socket_adapt_batch(Socket *socket, size_t n_written, size_t n_offered) {
+        if (n_written < n_offered)
+                socket->out.n_batch = c_max(socket->out.n_batch / 2, SOCKET_BATCH_MIN);
+        else
+                socket->out.n_batch = c_min(socket->out.n_batch * 2, SOCKET_BATCH_MAX);
+}
+
+static void socket_retire_buffer(Socket *socket, SocketBuffer *buffer) {
+        if (buffer->message)
+                TRACE_PROBE(socket_write,
+                            socket->fd,
+                            buffer->message->sender_id,
+                            buffer->message->metadata.header.serial);
+
+        socket_unqueue_buffer(socket, buffer);
+
+        if (buffer->message && buffer->message->fds) {
+                c_list_link_tail(&socket->out.pending, &buffer->link);
+                ++socket->out.n_pending;
+        } else {
+                socket_buffer_free(buffer);
+        }
+}
+
+static void socket_retire_output(Socket *socket, size_t n_written) {
+        SocketBuffer *buffer, *safe;
+
+        c_list_for_each_entry_safe(buffer, safe, &socket->out.queue, link) {
+                if (!socket_buffer_consume(buffer, &n_written))
+                        break;
+
+                socket_retire_buffer(socket, buffer);
+        }
+
+        assert(!n_written);
+}
+
+static int socket_finish_output(Socket *socket) {
+        socket_trim_output(socket);
 
         if (c_list_is_empty(&socket->out.queue)) {
+                /* everything queued before the switch went out, switch now */
+                if (_c_unlikely_(socket->shm))
+                        socket->shm->output = true;
+
                 if (_c_unlikely_(socket->shutdown))
                         socket_shutdown_now(socket);
 
@@ -858,6 +1739,147 @@ static int socket_dispatch_write(Socket *socket) {
         return 0;
 }
 
+static int socket_submit_output(Socket *socket) {
+        SocketBuffer *buffer;
+        struct mmsghdr msg;
+        struct iovec vecs[SOCKET_IOV_MAX];
+        size_t i, n_buffers, n_offered;
+        ssize_t l;
+        int r;
+
+        /*
+         * With io_uring, writes are submitted through the dispatcher, and
+         * batched with the writes of all other sockets into a single
+         * submission per dispatch round. Only a single message is in flight
+         * per socket, and we are called again once it completed. Everything
+         * else works like the synchronous path below.
+         */
+        if (socket->out.n_submitted) {
+                n_offered = socket->out.n_submitted;
+
+                if (!dispatch_file_reap(socket->file, &l))
+                        return 0;
+
+                socket->out.n_submitted = 0;
+
+                if (l < 0) {
+                        if (l != -EAGAIN)
+                                return socket_fail_output(socket, -l);
+
+                        socket->out.n_batch = c_max(socket->out.n_batch / 2, SOCKET_BATCH_MIN);
+                        return 0;
+                }
+
+                socket_adapt_batch(socket, l, n_offered);
+                socket_retire_output(socket, l);
+
+                r = socket_finish_output(socket);
+                if (r || c_list_is_empty(&socket->out.queue))
+                        return r;
+        }
+
+        if (!socket_gather_output(socket, &msg, 1, vecs, &n_buffers, &n_offered))
+                return SOCKET_E_LOST_INTEREST;
+
+        r = dispatch_file_sendmsg(socket->file, &msg.msg_hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r)
+                return error_fold(r);
+
+        /*
+         * The submitted buffers must stay in place until the send completed.
+         * Nothing may be queued in front of them, nor may they be coalesced,
+         * just like a partially written buffer.
+         */
+        i = 0;
+        c_list_for_each_entry(buffer, &socket->out.queue, link) {
+                if (i++ >= n_buffers)
+                        break;
+
+                c_list_unlink_init(&buffer->lane_link);
+                c_list_unlink_init(&buffer->coalesce_link);
+        }
+
+        socket->out.n_submitted = n_offered;
+        return 0;
+}
+
+static int socket_dispatch_write(Socket *socket) {
+        struct mmsghdr msgs[SOCKET_MMSG_MAX];
+        struct iovec vecs[SOCKET_IOV_MAX];
+        size_t n_buffers[SOCKET_MMSG_MAX];
+        size_t j, n, n_offered, n_written;
+        SocketBuffer *buffer, *safe;
+        int r, i, v, n_msgs;
+
+        if (!c_list_is_empty(&socket->out.pending)) {
+                r = ioctl(socket->fd, SIOCOUTQ, &v);
+                if (r < 0)
+                        return error_origin(-errno);
+
+                if (!v) {
+                        c_list_for_each_entry_safe(buffer, safe, &socket->out.pending, link)
+                                socket_buffer_free(buffer);
+                        socket->out.n_pending = 0;
+
+                        socket_might_reset(socket);
+                } else if (socket->out.n_pending >= SOCKET_FD_INFLIGHT_MAX) {
+                        /* treat like EAGAIN */
+                        return 0;
+                }
+        }
+
+        if (socket->hup_out)
+                return SOCKET_E_LOST_INTEREST;
+
+        if (socket->shm && socket->shm->output)
+                return socket_send_shm(socket);
+
+        if (socket->file && dispatch_file_can_submit(socket->file))
+                return socket_submit_output(socket);
+
+        n_msgs = socket_gather_output(socket, msgs, C_ARRAY_SIZE(msgs), vecs, n_buffers, &n_offered);
+        if (!n_msgs)
+                return SOCKET_E_LOST_INTEREST;
+
+        n_msgs = sendmmsg(socket->fd, msgs, n_msgs, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n_msgs < 0) {
+                if (errno == EAGAIN) {
+                        socket->out.n_batch = c_max(socket->out.n_batch / 2, SOCKET_BATCH_MIN);
+                        return 0;
+                }
+
+                return socket_fail_output(socket, errno);
+        }
+
+        n_written = 0;
+        for (i = 0; i < n_msgs; ++i)
+                n_written += msgs[i].msg_len;
+
+        socket_adapt_batch(socket, n_written, n_offered);
+
+        i = 0;
+        j = 0;
+        n = msgs[0].msg_len;
+        c_list_for_each_entry_safe(buffer, safe, &socket->out.queue, link) {
+                if (i >= n_msgs)
+                        break;
+
+                if (socket_buffer_consume(buffer, &n))
+                        socket_retire_buffer(socket, buffer);
+
+                if (++j >= n_buffers[i]) {
+                        assert(!n);
+
+                        j = 0;
+                        if (++i < n_msgs)
+                                n = msgs[i].msg_len;
+                }
+        }
+        assert(i == n_msgs);
+
+        return socket_finish_output(socket);
+}
+
 /**
  * socket_dispatch() - dispatch event
  * @socket:             socket to operate on
@@ -926,3 +1948,375 @@ void socket_close(Socket *socket) {
         socket_discard_input(socket);
         socket_might_reset(socket);
 }
+
+/*
+ * Sockets can be serialized, to hand them over to another process. The input
+ * queue is serialized as the part of the message that was already copied into
+ * its pending buffer, followed by the unparsed input buffer, each with their
+ * FDs. The output queue is serialized buffer by buffer. Buffers that were not
+ * written at all are serialized as messages, with their FDs. The remainder of
+ * a partially written buffer, and any line buffers, are serialized as raw
+ * data. Buffers that were written, but whose FDs are still in flight, are
+ * done with, and dropped. If the body of a rejected message is still being
+ * drained, only the number of bytes left to drain is serialized, as trailing
+ * record.
+ */
+
+enum {
+        SOCKET_RECORD_END,
+        SOCKET_RECORD_DATA,
+        SOCKET_RECORD_MESSAGE,
+        SOCKET_RECORD_DRAIN,
+};
+
+static int socket_serialize_fds(Serializer *s, FDList *fds) {
+        size_t i;
+        int r;
+
+        r = serializer_write_u32(s, fdlist_count(fds));
+        if (r)
+                return error_trace(r);
+
+        for (i = 0; i < fdlist_count(fds); ++i) {
+                r = serializer_write_fd(s, fdlist_get(fds, i));
+                if (r)
+                        return error_trace(r);
+        }
+
+        return 0;
+}
+
+static int socket_serialize_vecs(Serializer *s, unsigned int type, const struct iovec *vecs, size_t n_vecs) {
+        uint64_t n = 0;
+        size_t i;
+        int r;
+
+        for (i = 0; i < n_vecs; ++i)
+                n += vecs[i].iov_len;
+
+        r = serializer_write_u32(s, type);
+        r = r ?: serializer_write_u64(s, n);
+        if (r)
+                return error_trace(r);
+
+        for (i = 0; i < n_vecs; ++i) {
+                r = serializer_write(s, vecs[i].iov_base, vecs[i].iov_len);
+                if (r)
+                        return error_trace(r);
+        }
+
+        return 0;
+}
+
+/**
+ * socket_serialize() - serialize socket
+ * @socket:             socket to operate on
+ * @s:                  serializer to write to
+ *
+ * This serializes the input and output queues of @socket, so they can be
+ * restored in another process via socket_deserialize(). The FDs are still
+ * owned by @socket, so it must not be released before @s was flushed. The
+ * socket must be running, and must not use a shared-memory transport.
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int socket_serialize(Socket *socket, Serializer *s) {
+        struct iovec vecs[C_ARRAY_SIZE(((Message *)NULL)->vecs)];
+        IQueue *iq = &socket->in.queue;
+        SocketBuffer *buffer;
+        FDList *pending_fds = iq->pending.fds;
+        const void *prefix = NULL;
+        size_t n_prefix = 0, n_drain = 0;
+        ssize_t l;
+        int r;
+
+        assert(socket_is_running(socket));
+        assert(!socket->shm);
+
+        assert(!socket->in.admitting);
+
+        /* whatever an in-flight send wrote is done with */
+        if (socket_settle_output(socket, &l) && l > 0)
+                socket_retire_output(socket, l);
+
+        if (socket->in.n_drain) {
+                /* FDs of a dropped message are dropped as well */
+                n_drain = socket->in.n_drain - iq->pending.n_copied;
+                pending_fds = NULL;
+        } else if (socket->in.message) {
+                prefix = socket->in.message->data;
+                n_prefix = (uint8_t *)iq->pending.data - (uint8_t *)socket->in.message->data;
+                n_prefix += iq->pending.n_copied;
+        } else if (iq->pending.data) {
+                prefix = &socket->in.header;
+                n_prefix = iq->pending.n_copied;
+        }
+
+        r = serializer_write_u32(s, socket->lanes);
+        r = r ?: serializer_write_u32(s, n_prefix);
+        r = r ?: serializer_write(s, prefix, n_prefix);
+        r = r ?: socket_serialize_fds(s, pending_fds);
+        r = r ?: serializer_write_u32(s, iq->data_end - iq->data_start);
+        r = r ?: serializer_write(s, iq->data + iq->data_start, iq->data_end - iq->data_start);
+        r = r ?: socket_serialize_fds(s, iq->fds);
+        if (r)
+                return error_trace(r);
+
+        c_list_for_each_entry(buffer, &socket->out.queue, link) {
+                if (socket_buffer_is_consumed(buffer))
+                        continue;
+
+                if (buffer->message && socket_buffer_is_uncomsumed(buffer)) {
+                        r = socket_serialize_vecs(s, SOCKET_RECORD_MESSAGE, buffer->vecs, buffer->n_vecs);
+                        r = r ?: socket_serialize_fds(s, buffer->message->fds);
+                } else {
+                        r = socket_serialize_vecs(s, SOCKET_RECORD_DATA, vecs, socket_buffer_get_remaining(buffer, vecs));
+                }
+                if (r)
+                        return error_trace(r);
+        }
+
+        if (n_drain) {
+                r = serializer_write_u32(s, SOCKET_RECORD_DRAIN);
+                r = r ?: serializer_write_u64(s, n_drain);
+                if (r)
+                        return error_trace(r);
+        }
+
+        return error_trace(serializer_write_u32(s, SOCKET_RECORD_END));
+}
+
+static int socket_deserialize_fds(Deserializer *d, FDList **fdsp) {
+        int r, fds[SOCKET_FD_MAX];
+        uint32_t i, n_fds;
+
+        r = deserializer_read_u32(d, &n_fds);
+        if (r)
+                return error_trace(r);
+
+        if (n_fds > SOCKET_FD_MAX)
+                return SERIALIZE_E_CORRUPT;
+
+        for (i = 0; i < n_fds; ++i) {
+                r = deserializer_read_fd(d, &fds[i]);
+                if (r) {
+                        while (i)
+                                close(fds[--i]);
+                        return error_trace(r);
+                }
+        }
+
+        *fdsp = NULL;
+        if (n_fds) {
+                r = fdlist_new_consume_fds(fdsp, fds, n_fds);
+                if (r) {
+                        while (n_fds)
+                                close(fds[--n_fds]);
+                        return error_fold(r);
+                }
+        }
+
+        return 0;
+}
+
+static int socket_deserialize_input(Socket *socket, Deserializer *d, bool *injectedp) {
+        _c_cleanup_(fdlist_freep) FDList *fds = NULL;
+        _c_cleanup_(c_freep) void *data = NULL;
+        uint32_t n_data;
+        int r;
+
+        *injectedp = false;
+
+        r = deserializer_read_u32(d, &n_data);
+        if (r)
+                return error_trace(r);
+
+        if (n_data > MESSAGE_SIZE_MAX)
+                return SERIALIZE_E_CORRUPT;
+
+        data = malloc(n_data ?: 1);
+        if (!data)
+                return error_origin(-ENOMEM);
+
+        r = deserializer_read(d, data, n_data);
+        r = r ?: socket_deserialize_fds(d, &fds);
+        if (r)
+                return error_trace(r);
+
+        if ((!n_data && !fds) || !socket_is_running(socket))
+                return 0;
+
+        r = iqueue_inject(&socket->in.queue, data, n_data, fds);
+        if (r) {
+                if (r == IQUEUE_E_QUOTA) {
+                        socket_close(socket);
+                        return 0;
+                }
+
+                return error_fold(r);
+        }
+        fds = NULL;
+
+        *injectedp = true;
+        return 0;
+}
+
+static int socket_deserialize_message(Socket *socket, Deserializer *d, uint64_t n_data) {
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        MessageHeader header;
+        int r;
+
+        if (n_data < sizeof(header) || n_data > MESSAGE_SIZE_MAX)
+                return SERIALIZE_E_CORRUPT;
+
+        r = deserializer_read(d, &header, sizeof(header));
+        if (r)
+                return error_trace(r);
+
+        r = message_new_incoming(&message, header);
+        if (r)
+                return (r == MESSAGE_E_CORRUPT_HEADER || r == MESSAGE_E_TOO_LARGE) ?
+                       SERIALIZE_E_CORRUPT : error_fold(r);
+
+        if (message->n_data != n_data)
+                return SERIALIZE_E_CORRUPT;
+
+        r = deserializer_read(d, message->data + sizeof(header), n_data - sizeof(header));
+        r = r ?: socket_deserialize_fds(d, &message->fds);
+        if (r)
+                return error_trace(r);
+
+        message->n_copied = n_data;
+
+        /*
+         * The charges of all senders are replaced by a single charge on the
+         * owner. If that exceeds the quota, the message is dropped, just like
+         * it would have been, had it been queued under this quota.
+         */
+        r = socket_queue(socket, NULL, message);
+        if (r && r != SOCKET_E_QUOTA && r != SOCKET_E_SHUTDOWN)
+                return error_fold(r);
+
+        return 0;
+}
+
+static int socket_deserialize_data(Socket *socket, Deserializer *d, uint64_t n_data) {
+        _c_cleanup_(socket_buffer_freep) SocketBuffer *buffer = NULL;
+        int r;
+
+        if (n_data > MESSAGE_SIZE_MAX)
+                return SERIALIZE_E_CORRUPT;
+
+        r = socket_buffer_new_line(&buffer, socket, NULL, n_data);
+        if (r) {
+                if (r == SOCKET_E_QUOTA) {
+                        socket_close(socket);
+                        return 0;
+                }
+
+                return error_fold(r);
+        }
+
+        r = deserializer_read(d, buffer->line_data, n_data);
+        if (r)
+                return error_trace(r);
+
+        buffer->line.iov_len = n_data;
+        c_list_link_tail(&socket->out.queue, &buffer->link);
+        buffer = NULL;
+        return 0;
+}
+
+static int socket_deserialize_drain(Socket *socket, uint64_t n_data) {
+        if (!n_data || n_data > MESSAGE_SIZE_MAX || socket->in.message || iqueue_get_target(&socket->in.queue))
+                return SERIALIZE_E_CORRUPT;
+
+        /* the input queue continues with the rest of a dropped message */
+        socket->in.n_drain = n_data;
+        return 0;
+}
+
+/**
+ * socket_deserialize() - deserialize socket
+ * @socket:             socket to operate on
+ * @d:                  deserializer to read from
+ *
+ * This restores the input and output queues of @socket, as serialized by
+ * socket_serialize() in another process. @socket must be freshly initialized.
+ * Any partial message of the input queue is restored right away, the caller
+ * must then loop on socket_dequeue() as usual. Output is queued in its
+ * original order, and lanes are only enabled afterwards, if they were enabled
+ * before.
+ *
+ * Return: 0 on success, SOCKET_E_CORRUPT if the serialized data is invalid,
+ *         negative error code on failure.
+ */
+int socket_deserialize(Socket *socket, Deserializer *d) {
+        Message *message = NULL;
+        bool injected;
+        uint64_t n_data;
+        uint32_t lanes, type;
+        int r;
+
+        assert(!socket->lanes);
+        assert(c_list_is_empty(&socket->out.queue));
+
+        r = deserializer_read_u32(d, &lanes);
+        if (r)
+                return (r == SERIALIZE_E_EOF || r == SERIALIZE_E_CORRUPT) ? SOCKET_E_CORRUPT : error_fold(r);
+
+        /*
+         * Inject the part of the pending message first, and parse it, so the
+         * message is set up as pending again. The rest of the input buffer
+         * must then be injected separately, since its FDs might belong to a
+         * later message.
+         */
+        r = socket_deserialize_input(socket, d, &injected);
+        if (!r && injected) {
+                r = socket_dequeue(socket, &message);
+                if (r == SOCKET_E_ADMISSION) {
+                        /* the message was admitted on the old side already */
+                        message = message_unref(message);
+                        r = socket_admit(socket, true);
+                        r = r ?: socket_dequeue(socket, &message);
+                }
+                if (!r && message) {
+                        message_unref(message);
+                        r = SERIALIZE_E_CORRUPT;
+                } else if (r == SOCKET_E_QUOTA) {
+                        socket_close(socket);
+                        r = 0;
+                } else if (r == SOCKET_E_EOF) {
+                        r = SERIALIZE_E_CORRUPT;
+                }
+        }
+        r = r ?: socket_deserialize_input(socket, d, &injected);
+        if (r)
+                return (r == SERIALIZE_E_EOF || r == SERIALIZE_E_CORRUPT) ? SOCKET_E_CORRUPT : error_fold(r);
+
+        for (;;) {
+                r = deserializer_read_u32(d, &type);
+                if (!r && type == SOCKET_RECORD_END)
+                        break;
+
+                r = r ?: deserializer_read_u64(d, &n_data);
+                if (!r) {
+                        if (type == SOCKET_RECORD_MESSAGE)
+                                r = socket_deserialize_message(socket, d, n_data);
+                        else if (type == SOCKET_RECORD_DATA)
+                                r = socket_deserialize_data(socket, d, n_data);
+                        else if (type == SOCKET_RECORD_DRAIN)
+                                r = socket_deserialize_drain(socket, n_data);
+                        else
+                                r = SERIALIZE_E_CORRUPT;
+                }
+
+                if (r)
+                        return (r == SERIALIZE_E_EOF || r == SERIALIZE_E_CORRUPT) ? SOCKET_E_CORRUPT : error_fold(r);
+        }
+
+        /* anything restored so far is never overtaken, just like on the old side */
+        socket_set_lanes(socket, lanes);
+        return 0;
+}
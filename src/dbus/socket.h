@@ -9,15 +9,29 @@
 #include <stdlib.h>
 #include "dbus/message.h"
 #include "dbus/queue.h"
+#include "util/shmring.h"
 #include "util/user.h"
 
+typedef struct Deserializer Deserializer;
+typedef struct DispatchFile DispatchFile;
 typedef struct FDList FDList;
+typedef struct Serializer Serializer;
 typedef struct Socket Socket;
 typedef struct SocketBuffer SocketBuffer;
+typedef struct SocketShm SocketShm;
+
+typedef bool (*SocketSupersedeFn) (Message *queued, Message *message);
 
 #define SOCKET_LINE_PREALLOC (64UL) /* fits the longest sane SASL exchange */
 #define SOCKET_FD_MAX (253UL) /* taken from kernel SCM_MAX_FD */
-#define SOCKET_MMSG_MAX (16) /* randomly picked, no tuning done so far */
+#define SOCKET_MMSG_MAX (16) /* only FDs split messages, and few of those are in flight */
+#define SOCKET_IOV_MAX (1024) /* taken from kernel UIO_MAXIOV */
+#define SOCKET_FD_INFLIGHT_MAX (8UL) /* bounds FDs over-accounted while the receiver lags */
+#define SOCKET_BATCH_MIN (16UL * 1024UL) /* still fits a few messages of average size */
+#define SOCKET_BATCH_MAX (1024UL * 1024UL) /* bounds the data offered to a single sendmmsg(2) */
+#define SOCKET_BUFFER_POOL_MAX (4096UL) /* a broadcast to this many receivers is served from the pool */
+#define SOCKET_ADMISSION_MIN (64UL * 1024UL) /* smaller bodies are cheaper to receive than to defer */
+#define SOCKET_DRAIN_MAX (64UL * 1024UL) /* static scratch buffer, larger bodies take several reads */
 
 enum {
         _SOCKET_E_SUCCESS,
@@ -30,29 +44,74 @@ enum {
         SOCKET_E_EOF,
         SOCKET_E_QUOTA,
         SOCKET_E_SHUTDOWN,
+        SOCKET_E_CORRUPT,
+
+        /* admission control */
+        SOCKET_E_ADMISSION,
+};
+
+enum {
+        SOCKET_LANE_REPLY,
+        SOCKET_LANE_CALL,
+        SOCKET_LANE_SIGNAL,
+        _SOCKET_LANE_N,
 };
 
+/* shared-memory transport */
+
+struct SocketShm {
+        UserCharge charge;
+        void *map;
+        ShmRing rx;
+        ShmRing tx;
+        int wake_fd;
+        bool output : 1;
+};
+
+#define SOCKET_SHM_NULL {                                               \
+                .charge = USER_CHARGE_INIT,                             \
+                .rx = SHMRING_NULL,                                     \
+                .tx = SHMRING_NULL,                                     \
+                .wake_fd = -1,                                          \
+        }
+
 /* socket IO */
 
 struct Socket {
         User *user;
         int fd;
+        SocketShm *shm;
+        DispatchFile *file;
 
         bool shutdown : 1;
         bool reset : 1;
         bool hup_in : 1;
         bool hup_out : 1;
+        bool lanes : 1;
+
+        /* the output side is touched on every delivery, hence goes first */
+        struct SocketOut {
+                CList queue;
+                CList pending;
+                CList coalescable;
+                CList lanes[_SOCKET_LANE_N];
+                size_t n_pending;
+                size_t n_batch;
+                size_t n_submitted;
+                size_t n_messages;
+                size_t n_bytes;
+                size_t n_coalesced;
+        } out;
 
         struct {
                 IQueue queue;
                 MessageHeader header;
                 Message *message;
+                size_t n_drain;
+                bool admission : 1;
+                bool fields : 1;
+                bool admitting : 1;
         } in;
-
-        struct SocketOut {
-                CList queue;
-                CList pending;
-        } out;
 };
 
 #define SOCKET_NULL(_x) {                                               \
@@ -60,6 +119,13 @@ struct Socket {
                 .in.queue = IQUEUE_NULL((_x).in.queue),                 \
                 .out.queue = C_LIST_INIT((_x).out.queue),               \
                 .out.pending = C_LIST_INIT((_x).out.pending),           \
+                .out.coalescable = C_LIST_INIT((_x).out.coalescable),   \
+                .out.lanes = {                                          \
+                        C_LIST_INIT((_x).out.lanes[SOCKET_LANE_REPLY]), \
+                        C_LIST_INIT((_x).out.lanes[SOCKET_LANE_CALL]),  \
+                        C_LIST_INIT((_x).out.lanes[SOCKET_LANE_SIGNAL]), \
+                },                                                      \
+                .out.n_batch = SOCKET_BATCH_MIN,                        \
         }
 
 void socket_init(Socket *socket, User *user, int fd);
@@ -67,14 +133,25 @@ void socket_deinit(Socket *socket);
 
 int socket_dequeue_line(Socket *socket, const char **linep, size_t *np);
 int socket_dequeue(Socket *socket, Message **messagep);
+void socket_set_admission(Socket *socket, bool admission);
+int socket_admit(Socket *socket, bool admit);
 
 int socket_queue_line(Socket *socket, User *user, const char *line, size_t n);
+int socket_check_quota(Socket *socket, User *user, Message *message);
 int socket_queue(Socket *socket, User *user, Message *message);
+int socket_queue_coalesce(Socket *socket, User *user, Message *message, SocketSupersedeFn fn);
+int socket_queue_batch(Socket *socket, User *user, Message **messages, size_t n_messages);
+void socket_set_lanes(Socket *socket, bool lanes);
+int socket_open_shm(Socket *socket, int *memfdp, int *wake_fdp);
+int socket_dispatch_shm(Socket *socket);
 
 int socket_dispatch(Socket *socket, uint32_t event);
 void socket_shutdown(Socket *socket);
 void socket_close(Socket *socket);
 
+int socket_serialize(Socket *socket, Serializer *s);
+int socket_deserialize(Socket *socket, Deserializer *d);
+
 C_DEFINE_CLEANUP(Socket *, socket_deinit);
 
 /* inline helpers */
@@ -0,0 +1,216 @@
+/*
+ * Test D-Bus Specialized Marshalling
+ */
+
+#include <c-dvar.h>
+#include <c-dvar-type.h>
+#include <c-macro.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dbus/address.h"
+#include "dbus/marshal.h"
+#include "dbus/message.h"
+#include "dbus/protocol.h"
+
+static void test_dvar_reply(void **datap,
+                            size_t *n_datap,
+                            uint32_t reply_serial,
+                            uint64_t destination,
+                            const char *signature,
+                            const CDVarType *type,
+                            ...) {
+        _c_cleanup_(c_dvar_deinit) CDVar var = C_DVAR_INIT;
+        va_list args;
+        int r;
+
+        /*
+         * Marshal the same reply the specialized writers produce through
+         * c-dvar, so their output can be compared byte by byte.
+         */
+
+        c_dvar_begin_write(&var, type, 1);
+        c_dvar_write(&var, "((yyyyuu[(y<u>)(y<s>)(y<s>)(y<g>)])",
+                     c_dvar_is_big_endian(&var) ? 'B' : 'l', DBUS_MESSAGE_TYPE_METHOD_RETURN, DBUS_HEADER_FLAG_NO_REPLY_EXPECTED, 1, 0, (uint32_t)-1,
+                     DBUS_MESSAGE_FIELD_REPLY_SERIAL, c_dvar_type_u, reply_serial,
+                     DBUS_MESSAGE_FIELD_SENDER, c_dvar_type_s, "org.freedesktop.DBus",
+                     DBUS_MESSAGE_FIELD_DESTINATION, c_dvar_type_s, address_to_string(&(Address)ADDRESS_INIT_ID(destination)),
+                     DBUS_MESSAGE_FIELD_SIGNATURE, c_dvar_type_g, signature);
+
+        va_start(args, type);
+        c_dvar_vwrite(&var, signature[0] == 's' ? "(s))" : "(u))", args);
+        va_end(args);
+
+        r = c_dvar_end_write(&var, datap, n_datap);
+        assert(!r);
+}
+
+static void test_compare(Message *message, void *data, size_t n_data) {
+        MessageHeader *header = data;
+
+        /* the c-dvar output still carries the body length placeholder */
+        header->n_body = n_data - C_ALIGN_TO(sizeof(*header) + header->n_fields, 8);
+
+        assert(message->n_data == n_data);
+        assert(!memcmp(message->data, data, n_data));
+
+        free(data);
+}
+
+static const CDVarType test_type_b[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE2(
+                        C_DVAR_T_TUPLE7(
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_u,
+                                C_DVAR_T_u,
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_TUPLE2(
+                                                C_DVAR_T_y,
+                                                C_DVAR_T_v
+                                        )
+                                )
+                        ),
+                        C_DVAR_T_TUPLE1(
+                                C_DVAR_T_b
+                        )
+                )
+        )
+};
+
+static const CDVarType test_type_s[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE2(
+                        C_DVAR_T_TUPLE7(
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_u,
+                                C_DVAR_T_u,
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_TUPLE2(
+                                                C_DVAR_T_y,
+                                                C_DVAR_T_v
+                                        )
+                                )
+                        ),
+                        C_DVAR_T_TUPLE1(
+                                C_DVAR_T_s
+                        )
+                )
+        )
+};
+
+static const CDVarType test_type_u[] = {
+        C_DVAR_T_INIT(
+                C_DVAR_T_TUPLE2(
+                        C_DVAR_T_TUPLE7(
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_y,
+                                C_DVAR_T_u,
+                                C_DVAR_T_u,
+                                C_DVAR_T_ARRAY(
+                                        C_DVAR_T_TUPLE2(
+                                                C_DVAR_T_y,
+                                                C_DVAR_T_v
+                                        )
+                                )
+                        ),
+                        C_DVAR_T_TUPLE1(
+                                C_DVAR_T_u
+                        )
+                )
+        )
+};
+
+static void test_parse(Message *message, uint32_t reply_serial, uint64_t destination, const char *signature) {
+        int r;
+
+        r = message_parse_metadata(message);
+        assert(!r);
+
+        assert(message->metadata.header.type == DBUS_MESSAGE_TYPE_METHOD_RETURN);
+        assert(message->metadata.header.flags == DBUS_HEADER_FLAG_NO_REPLY_EXPECTED);
+        assert(message->metadata.header.serial == (uint32_t)-1);
+        assert(message->metadata.fields.reply_serial == reply_serial);
+        assert(!strcmp(message->metadata.fields.sender, "org.freedesktop.DBus"));
+        assert(!strcmp(message->metadata.fields.destination,
+                       address_to_string(&(Address)ADDRESS_INIT_ID(destination))));
+        assert(!strcmp(message->metadata.fields.signature, signature));
+}
+
+static void test_basic(void) {
+        MessageSender sender = MESSAGE_SENDER_NULL;
+        Message *message;
+        size_t n_data;
+        void *data;
+        int r;
+
+        message_sender_init(&sender, 7);
+
+        r = marshal_reply_b(&message, 1, "org.freedesktop.DBus", &sender, true);
+        assert(!r);
+        test_parse(message, 1, 7, "b");
+        assert(message->n_body == 4);
+        assert(*(uint32_t *)message->body == 1);
+        test_dvar_reply(&data, &n_data, 1, 7, "b", test_type_b, true);
+        test_compare(message, data, n_data);
+        message_unref(message);
+
+        r = marshal_reply_u(&message, 2, "org.freedesktop.DBus", &sender, 0xdeadbeef);
+        assert(!r);
+        test_parse(message, 2, 7, "u");
+        assert(message->n_body == 4);
+        assert(*(uint32_t *)message->body == 0xdeadbeef);
+        test_dvar_reply(&data, &n_data, 2, 7, "u", test_type_u, 0xdeadbeef);
+        test_compare(message, data, n_data);
+        message_unref(message);
+
+        r = marshal_reply_s(&message, 3, "org.freedesktop.DBus", &sender, "foobar");
+        assert(!r);
+        test_parse(message, 3, 7, "s");
+        assert(message->n_body == 4 + strlen("foobar") + 1);
+        assert(!strcmp((char *)message->body + 4, "foobar"));
+        test_dvar_reply(&data, &n_data, 3, 7, "s", test_type_s, "foobar");
+        test_compare(message, data, n_data);
+        message_unref(message);
+}
+
+static void test_destinations(void) {
+        static const uint64_t ids[] = { 0, 1, 9, 10, 99, 12345678, UINT32_MAX, ADDRESS_ID_INVALID - 1 };
+        MessageSender sender;
+        Message *message;
+        size_t i, n_data;
+        void *data;
+        int r;
+
+        /*
+         * The length of the destination field varies with the unique name,
+         * and so does the padding that follows it. Verify the layout matches
+         * c-dvar for names of all kinds of lengths.
+         */
+
+        for (i = 0; i < C_ARRAY_SIZE(ids); ++i) {
+                sender = (MessageSender)MESSAGE_SENDER_NULL;
+                message_sender_init(&sender, ids[i]);
+
+                r = marshal_reply_s(&message, i + 1, "org.freedesktop.DBus", &sender, "");
+                assert(!r);
+                test_parse(message, i + 1, ids[i], "s");
+                test_dvar_reply(&data, &n_data, i + 1, ids[i], "s", test_type_s, "");
+                test_compare(message, data, n_data);
+                message_unref(message);
+        }
+}
+
+int main(int argc, char **argv) {
+        test_basic();
+        test_destinations();
+        return 0;
+}
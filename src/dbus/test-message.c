@@ -3,8 +3,15 @@
  */
 
 #include <c-macro.h>
+#include <endian.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "dbus/message.h"
+#include "dbus/protocol.h"
+#include "util/fdlist.h"
 
 static void test_setup(void) {
         _c_cleanup_(message_unrefp) Message *m1 = NULL, *m2, *m3;
@@ -61,8 +68,438 @@ static void test_size(void) {
         assert(r == MESSAGE_E_TOO_LARGE);
 }
 
+static void test_footprint(void) {
+        MessageHeader hdr = { .endian = 'l' };
+        Message *m;
+        int r;
+
+        /* pooled messages are accounted with their full slot */
+
+        hdr.n_body = 128;
+        r = message_new_incoming(&m, hdr);
+        assert(r == 0);
+        assert(m->pooled);
+        assert(message_get_footprint(m) == sizeof(Message) + MESSAGE_POOL_DATA_MAX);
+        message_unref(m);
+
+        /* other messages are accounted with their data */
+
+        hdr.n_body = MESSAGE_POOL_DATA_MAX;
+        r = message_new_incoming(&m, hdr);
+        assert(r == 0);
+        assert(!m->pooled);
+        assert(message_get_footprint(m) == sizeof(Message) + sizeof(hdr) + MESSAGE_POOL_DATA_MAX);
+        message_unref(m);
+}
+
+static void test_release(void) {
+        _c_cleanup_(message_unrefp) Message *m = NULL;
+        MessageHeader hdr = { .endian = 'l' };
+        size_t n_page, n_body = 4 * MESSAGE_MAP_MIN;
+        int r;
+
+        n_page = sysconf(_SC_PAGESIZE);
+
+        /* small messages are never released */
+
+        hdr.n_body = 128;
+        r = message_new_incoming(&m, hdr);
+        assert(!r);
+        assert(!m->mapped_data);
+
+        memset(m->body, 'a', m->n_body);
+        message_release_body(m, m->n_body);
+        assert(!m->n_released);
+        assert(((char *)m->body)[0] == 'a');
+        m = message_unref(m);
+
+        /* big messages release all fully written pages of their body */
+
+        hdr.n_body = n_body;
+        r = message_new_incoming(&m, hdr);
+        assert(!r);
+        assert(m->mapped_data);
+
+        memset(m->body, 'a', m->n_body);
+        message_release_body(m, n_body / 2 + 1);
+        assert(m->n_released + sizeof(hdr) == n_body / 2);
+        assert(m->header->endian == 'l');
+        assert(((char *)m->body)[0] == 'a');
+        assert(((char *)m->body)[n_page] == 0);
+        assert(((char *)m->body)[m->n_released - 1] == 0);
+        assert(((char *)m->body)[m->n_released] == 'a');
+
+        /* nothing is released while the message is shared */
+
+        message_ref(m);
+        message_release_body(m, n_body);
+        assert(((char *)m->body)[n_body - 1] == 'a');
+        message_unref(m);
+}
+
+static void test_shared(void) {
+        _c_cleanup_(message_unrefp) Message *shared = NULL, *m1 = NULL, *m2 = NULL;
+        MessageHeader *hdr;
+        int r;
+
+        /* verify messages can share the body of another message */
+
+        hdr = calloc(1, sizeof(*hdr) + 16);
+        assert(hdr);
+        hdr->endian = (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l';
+        memset(hdr + 1, 'a', 16);
+
+        r = message_new_outgoing(&shared, hdr, sizeof(*hdr) + 16);
+        assert(r == 0);
+        assert(shared->n_body == 16);
+
+        hdr = calloc(1, sizeof(*hdr));
+        assert(hdr);
+        hdr->endian = (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l';
+        hdr->serial = 1;
+
+        r = message_new_outgoing_shared(&m1, hdr, sizeof(*hdr), shared);
+        assert(r == 0);
+        assert(m1->header->serial == 1);
+        assert(m1->header->n_body == 16);
+        assert(m1->n_data == sizeof(*hdr) + 16);
+        assert(m1->body == shared->body);
+        assert(m1->vecs[0].iov_len == sizeof(*hdr));
+        assert(m1->vecs[3].iov_base == shared->body);
+        assert(m1->vecs[3].iov_len == 16);
+
+        hdr = calloc(1, sizeof(*hdr));
+        assert(hdr);
+        hdr->endian = (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l';
+        hdr->serial = 2;
+
+        r = message_new_outgoing_shared(&m2, hdr, sizeof(*hdr), shared);
+        assert(r == 0);
+        assert(m2->header->serial == 2);
+        assert(m2->body == m1->body);
+
+        /* the body must stay around as long as any user is left */
+        shared = message_unref(shared);
+        m1 = message_unref(m1);
+        assert(!memcmp(m2->body, "aaaaaaaaaaaaaaaa", 16));
+
+        /* a prefix of the body can be shared as well */
+        hdr = calloc(1, sizeof(*hdr));
+        assert(hdr);
+        hdr->endian = (__BYTE_ORDER == __BIG_ENDIAN) ? 'B' : 'l';
+        hdr->serial = 3;
+
+        r = message_new_outgoing_shared_prefix(&m1, hdr, sizeof(*hdr), m2, 8);
+        assert(r == 0);
+        assert(m1->header->n_body == 8);
+        assert(m1->n_data == sizeof(*hdr) + 8);
+        assert(m1->body == m2->body);
+        assert(m1->vecs[3].iov_len == 8);
+}
+
+static size_t test_append_field(uint8_t *data, size_t pos, uint8_t field, char element, const char *value) {
+        uint32_t length = strlen(value);
+
+        pos = c_align8(pos);
+        data[pos++] = field;
+        data[pos++] = 1;
+        data[pos++] = element;
+        data[pos++] = 0;
+
+        if (element == 'g') {
+                data[pos++] = length;
+        } else {
+                pos = c_align_to(pos, 4);
+                length = htole32(length);
+                memcpy(data + pos, &length, sizeof(length));
+                length = le32toh(length);
+                pos += sizeof(length);
+        }
+
+        memcpy(data + pos, value, length + 1);
+        return pos + length + 1;
+}
+
+static size_t test_append_field_u(uint8_t *data, size_t pos, uint8_t field, uint32_t value) {
+        pos = c_align8(pos);
+        data[pos++] = field;
+        data[pos++] = 1;
+        data[pos++] = 'u';
+        data[pos++] = 0;
+
+        value = htole32(value);
+        memcpy(data + pos, &value, sizeof(value));
+        return pos + sizeof(value);
+}
+
+static Message *test_new_signal_with_body(const char *path,
+                                          const char *interface,
+                                          uint32_t n_fds,
+                                          const char *signature,
+                                          const void *body,
+                                          size_t n_body) {
+        Message *m;
+        MessageHeader *hdr;
+        uint8_t *data;
+        size_t pos;
+        int r;
+
+        data = calloc(1, 256 + n_body);
+        assert(data);
+
+        pos = sizeof(*hdr);
+        pos = test_append_field(data, pos, DBUS_MESSAGE_FIELD_PATH, 'o', path);
+        pos = test_append_field(data, pos, DBUS_MESSAGE_FIELD_INTERFACE, 's', interface);
+        pos = test_append_field(data, pos, DBUS_MESSAGE_FIELD_MEMBER, 's', "Signal");
+        pos = test_append_field(data, pos, DBUS_MESSAGE_FIELD_SENDER, 's', ":1.7");
+        pos = test_append_field(data, pos, DBUS_MESSAGE_FIELD_SIGNATURE, 'g', signature);
+        if (n_fds)
+                pos = test_append_field_u(data, pos, DBUS_MESSAGE_FIELD_UNIX_FDS, n_fds);
+
+        hdr = (void *)data;
+        hdr->endian = 'l';
+        hdr->type = DBUS_MESSAGE_TYPE_SIGNAL;
+        hdr->version = 1;
+        hdr->serial = htole32(7);
+        hdr->n_fields = pos - sizeof(*hdr);
+        hdr->n_body = htole32(n_body);
+
+        pos = c_align8(pos);
+        memcpy(data + pos, body, n_body);
+
+        r = message_new_outgoing(&m, data, pos + n_body);
+        assert(!r);
+
+        return m;
+}
+
+static Message *test_new_signal_with_fds(const char *path, const char *interface, uint32_t n_fds) {
+        return test_new_signal_with_body(path, interface, n_fds, "", NULL, 0);
+}
+
+static Message *test_new_signal(const char *path, const char *interface) {
+        return test_new_signal_with_fds(path, interface, 0);
+}
+
+static int test_new_memfd(size_t n, bool sealed) {
+        int r, fd;
+
+        fd = memfd_create("test-message", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        assert(fd >= 0);
+
+        r = ftruncate(fd, n);
+        assert(!r);
+
+        if (sealed) {
+                r = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+                assert(!r);
+        }
+
+        return fd;
+}
+
+static void test_memfd(void) {
+        _c_cleanup_(message_unrefp) Message *m = NULL;
+        int r, fds[4];
+
+        if (__BYTE_ORDER != __LITTLE_ENDIAN)
+                return;
+
+        /* only sealed memfds are accounted, with their full size */
+
+        r = pipe2(fds, O_CLOEXEC);
+        assert(!r);
+        fds[2] = test_new_memfd(4096, true);
+        fds[3] = test_new_memfd(8192, false);
+
+        m = test_new_signal_with_fds("/org/bus1/Test", "org.bus1.Test", 4);
+        r = fdlist_new_consume_fds(&m->fds, fds, 4);
+        assert(!r);
+
+        r = message_parse_metadata(m);
+        assert(!r);
+        assert(m->metadata.fields.unix_fds == 4);
+        assert(m->n_memfd == 4096);
+        m = message_unref(m);
+
+        /* FDs beyond the announced count are discarded before accounting */
+
+        fds[0] = test_new_memfd(4096, true);
+        fds[1] = test_new_memfd(8192, true);
+
+        m = test_new_signal_with_fds("/org/bus1/Test", "org.bus1.Test", 1);
+        r = fdlist_new_consume_fds(&m->fds, fds, 2);
+        assert(!r);
+
+        r = message_parse_metadata(m);
+        assert(!r);
+        assert(m->n_memfd == 4096);
+}
+
+static void test_parse(void) {
+        _c_cleanup_(message_unrefp) Message *m = NULL;
+        int r;
+
+        /* the common little-endian header is parsed in one go */
+
+        if (__BYTE_ORDER != __LITTLE_ENDIAN)
+                return;
+
+        m = test_new_signal("/org/bus1/Test", "org.bus1.Test");
+
+        r = message_parse_metadata(m);
+        assert(!r);
+        assert(m->metadata.header.type == DBUS_MESSAGE_TYPE_SIGNAL);
+        assert(m->metadata.header.serial == 7);
+        assert(!strcmp(m->metadata.fields.path, "/org/bus1/Test"));
+        assert(!strcmp(m->metadata.fields.interface, "org.bus1.Test"));
+        assert(!strcmp(m->metadata.fields.member, "Signal"));
+        assert(!strcmp(m->metadata.fields.sender, ":1.7"));
+        assert(!strcmp(m->metadata.fields.signature, ""));
+        assert(m->original_sender == m->metadata.fields.sender);
+        m = message_unref(m);
+
+        /* invalid headers are still rejected */
+
+        m = test_new_signal("/org/freedesktop/DBus/Local", "org.bus1.Test");
+        r = message_parse_metadata(m);
+        assert(r == MESSAGE_E_INVALID_HEADER);
+        m = message_unref(m);
+
+        m = test_new_signal("/org//Test", "org.bus1.Test");
+        r = message_parse_metadata(m);
+        assert(r == MESSAGE_E_INVALID_HEADER);
+        m = message_unref(m);
+
+        /* non-ASCII strings are left to the generic parser */
+
+        m = test_new_signal("/org/bus1/Test", "org.bus1.T\xc3\xa9st");
+        r = message_parse_metadata(m);
+        assert(!r);
+        assert(!strcmp(m->metadata.fields.path, "/org/bus1/Test"));
+        assert(!strcmp(m->metadata.fields.interface, "org.bus1.T\xc3\xa9st"));
+        m = message_unref(m);
+}
+
+static void test_parse_body(void) {
+        static const uint8_t valid[] = { 3, 0, 0, 0, 'f', 'o', 'o', 0 };
+        static const uint8_t invalid[] = { 3, 0, 0, 0, 'f', 'o', 'o', 'o' };
+        _c_cleanup_(message_unrefp) Message *m = NULL;
+        int r;
+
+        if (__BYTE_ORDER != __LITTLE_ENDIAN)
+                return;
+
+        /* arguments are only parsed on request, and only once */
+
+        m = test_new_signal_with_body("/org/bus1/Test", "org.bus1.Test", 0, "s", valid, sizeof(valid));
+
+        r = message_parse_metadata(m);
+        assert(!r);
+        assert(!m->parsed_body);
+        assert(!m->metadata.args[0].value);
+
+        r = message_parse_body(m);
+        assert(!r);
+        assert(m->parsed_body);
+        assert(!strcmp(m->metadata.args[0].value, "foo"));
+
+        r = message_parse_body(m);
+        assert(!r);
+        m = message_unref(m);
+
+        /* invalid bodies pass the metadata check, but never yield arguments */
+
+        m = test_new_signal_with_body("/org/bus1/Test", "org.bus1.Test", 0, "s", invalid, sizeof(invalid));
+
+        r = message_parse_metadata(m);
+        assert(!r);
+
+        r = message_parse_body(m);
+        assert(r == MESSAGE_E_INVALID_BODY);
+        assert(!m->metadata.args[0].value);
+
+        r = message_parse_body(m);
+        assert(r == MESSAGE_E_INVALID_BODY);
+        assert(!m->metadata.args[0].value);
+}
+
+static void test_stitch_mapped(void) {
+        _c_cleanup_(message_unrefp) Message *m = NULL;
+        MessageSender sender = MESSAGE_SENDER_NULL;
+        MessageHeader hdr = { .endian = 'l' };
+        size_t n_page, n_fields, n_map;
+        uint8_t fields[256] = {};
+        uint32_t n_array;
+        void *guard;
+        int r;
+
+        if (__BYTE_ORDER != __LITTLE_ENDIAN)
+                return;
+
+        /*
+         * Stitching the sender changes the size of a message, but its data
+         * must still be unmapped with the size it was mapped with. Size the
+         * message to end on a page boundary and map a guard page right
+         * behind it, which must survive the message.
+         */
+
+        n_page = sysconf(_SC_PAGESIZE);
+
+        n_fields = test_append_field(fields, 0, DBUS_MESSAGE_FIELD_PATH, 'o', "/org/bus1/Test");
+        n_fields = test_append_field(fields, n_fields, DBUS_MESSAGE_FIELD_INTERFACE, 's', "org.bus1.Test");
+        n_fields = test_append_field(fields, n_fields, DBUS_MESSAGE_FIELD_MEMBER, 's', "Signal");
+        n_fields = test_append_field(fields, n_fields, DBUS_MESSAGE_FIELD_SIGNATURE, 'g', "ay");
+
+        hdr.type = DBUS_MESSAGE_TYPE_SIGNAL;
+        hdr.version = 1;
+        hdr.serial = htole32(7);
+        hdr.n_fields = htole32(n_fields);
+        hdr.n_body = htole32(c_align_to(MESSAGE_MAP_MIN, n_page) - c_align8(sizeof(hdr) + n_fields));
+
+        r = message_new_incoming(&m, hdr);
+        assert(!r);
+        assert(m->mapped_data);
+        assert(m->n_data % n_page == 0);
+
+        memcpy(m->data + sizeof(hdr), fields, n_fields);
+        n_array = htole32(m->n_body - sizeof(n_array));
+        memcpy(m->body, &n_array, sizeof(n_array));
+
+        r = message_parse_metadata(m);
+        assert(!r);
+
+        n_map = m->n_data;
+        guard = mmap(m->data + n_map, n_page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (guard != MAP_FAILED && guard != m->data + n_map) {
+                munmap(guard, n_page);
+                guard = MAP_FAILED;
+        }
+
+        message_sender_init(&sender, 1);
+        message_stitch_sender(m, &sender);
+        assert(m->n_data > n_map);
+        assert(m->n_map == n_map);
+
+        m = message_unref(m);
+
+        if (guard != MAP_FAILED) {
+                r = msync(guard, n_page, MS_ASYNC);
+                assert(!r);
+                munmap(guard, n_page);
+        }
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_size();
+        test_footprint();
+        test_release();
+        test_shared();
+        test_parse();
+        test_parse_body();
+        test_memfd();
+        test_stitch_mapped();
         return 0;
 }
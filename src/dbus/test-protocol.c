@@ -0,0 +1,103 @@
+/*
+ * Test D-Bus Protocol Helpers
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dbus/protocol.h"
+
+static void test_name(void) {
+        char name[256];
+        size_t i;
+
+        assert(dbus_validate_name("org.foo", strlen("org.foo")));
+        assert(dbus_validate_name("org.foo-bar._1", strlen("org.foo-bar._1")));
+        assert(dbus_validate_name("a.b.c.d", strlen("a.b.c.d")));
+
+        assert(!dbus_validate_name("", 0));
+        assert(!dbus_validate_name("org", strlen("org")));
+        assert(!dbus_validate_name(".org.foo", strlen(".org.foo")));
+        assert(!dbus_validate_name("org.foo.", strlen("org.foo.")));
+        assert(!dbus_validate_name("org..foo", strlen("org..foo")));
+        assert(!dbus_validate_name("org.0foo", strlen("org.0foo")));
+        assert(!dbus_validate_name("0org.foo", strlen("0org.foo")));
+        assert(!dbus_validate_name(":1.7", strlen(":1.7")));
+        assert(!dbus_validate_name("org.foo/bar", strlen("org.foo/bar")));
+
+        /* verify an invalid character is found at any position */
+        memset(name, 'a', sizeof(name));
+        name[1] = '.';
+        for (i = 2; i < 255; ++i) {
+                assert(dbus_validate_name(name, i + 1));
+
+                name[i] = '*';
+                assert(!dbus_validate_name(name, i + 1));
+                name[i] = '\xc3';
+                assert(!dbus_validate_name(name, i + 1));
+                name[i] = 'a';
+        }
+
+        assert(!dbus_validate_name(name, 256));
+}
+
+static void test_path(void) {
+        char path[512];
+        size_t i;
+
+        assert(dbus_validate_path("/", strlen("/")));
+        assert(dbus_validate_path("/org", strlen("/org")));
+        assert(dbus_validate_path("/org/foo_1/Bar", strlen("/org/foo_1/Bar")));
+
+        assert(!dbus_validate_path("", 0));
+        assert(!dbus_validate_path("org", strlen("org")));
+        assert(!dbus_validate_path("//", strlen("//")));
+        assert(!dbus_validate_path("/org/", strlen("/org/")));
+        assert(!dbus_validate_path("/org//foo", strlen("/org//foo")));
+        assert(!dbus_validate_path("/org.foo", strlen("/org.foo")));
+        assert(!dbus_validate_path("/org-foo", strlen("/org-foo")));
+
+        /* verify an invalid character is found at any position */
+        memset(path, 'a', sizeof(path));
+        path[0] = '/';
+        for (i = 1; i < sizeof(path) - 1; ++i) {
+                assert(dbus_validate_path(path, i + 1));
+
+                path[i] = '.';
+                assert(!dbus_validate_path(path, i + 2));
+                path[i] = '\0';
+                assert(!dbus_validate_path(path, i + 2));
+                path[i] = 'a';
+        }
+}
+
+static void test_ascii(void) {
+        char string[512];
+        size_t i;
+
+        assert(dbus_validate_ascii("", 0));
+        assert(dbus_validate_ascii("foo bar", strlen("foo bar")));
+        assert(!dbus_validate_ascii("f\xc3\xa9", strlen("f\xc3\xa9")));
+        assert(!dbus_validate_ascii("foo\0bar", 7));
+
+        /* verify an invalid character is found at any position */
+        memset(string, '~', sizeof(string));
+        for (i = 0; i < sizeof(string); ++i) {
+                assert(dbus_validate_ascii(string, sizeof(string)));
+
+                string[i] = '\x80';
+                assert(!dbus_validate_ascii(string, sizeof(string)));
+                string[i] = '\0';
+                assert(!dbus_validate_ascii(string, sizeof(string)));
+                string[i] = '\x7f';
+                assert(dbus_validate_ascii(string, sizeof(string)));
+                string[i] = '~';
+        }
+}
+
+int main(int argc, char **argv) {
+        test_name();
+        test_path();
+        test_ascii();
+        return 0;
+}
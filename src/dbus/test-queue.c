@@ -330,12 +330,133 @@ static void test_in_lines(void) {
         }
 }
 
+static void test_in_adaptive(void) {
+        _c_cleanup_(iqueue_deinit) IQueue iq = IQUEUE_NULL(iq);
+        static char blob[IQUEUE_RECV_MAX];
+        UserCharge *charge_fds;
+        size_t i, *from, to, start;
+        void *buffer;
+        FDList **fds;
+        int r;
+
+        iqueue_init(&iq, NULL);
+
+        /* idle queues do not hold any input buffer */
+        assert(!iqueue_get_memory(&iq));
+
+        /*
+         * Fill the entire window of the input buffer repeatedly and verify
+         * the read size grows up to its maximum.
+         */
+
+        r = iqueue_set_target(&iq, blob, 8);
+        assert(!r);
+
+        for (;;) {
+                r = iqueue_get_cursor(&iq, &buffer, &from, &to, &fds, &charge_fds);
+                assert(!r);
+                assert(to - *from == iq.recv_size);
+                assert(iq.data_size == iq.recv_size);
+
+                if (iq.recv_size >= IQUEUE_RECV_MAX)
+                        break;
+
+                start = *from;
+                *from = to;
+                iqueue_note_read(&iq, from, to - start, to - start, false);
+
+                for (i = 0; i < (to - start) / 8; ++i) {
+                        r = iqueue_pop_data(&iq, NULL);
+                        assert(!r);
+
+                        r = iqueue_set_target(&iq, blob, 8);
+                        assert(!r);
+                }
+        }
+
+        assert(iq.stats.n_reads == 6);
+        assert(iq.stats.reads[0] == 0);
+        assert(iq.stats.reads[1] == 1);
+        assert(iq.stats.reads[6] == 1);
+
+        /*
+         * Cut the next read short and verify the read size shrinks. Then
+         * signal that no data is available and verify the input buffer is
+         * released, but re-allocated at the same size on the next read.
+         */
+
+        start = *from;
+        *from += 8;
+        iqueue_note_read(&iq, from, to - start, 8, true);
+
+        /* the short read drained the queue, so trimming needs it consumed */
+        iqueue_trim(&iq);
+        assert(iq.data != iq.buffer);
+
+        r = iqueue_pop_data(&iq, NULL);
+        assert(!r);
+
+        iqueue_trim(&iq);
+        assert(iq.data == iq.buffer);
+        assert(iq.stats.n_releases == 1);
+        assert(!iqueue_get_memory(&iq));
+
+        r = iqueue_set_target(&iq, blob, 8);
+        assert(!r);
+
+        r = iqueue_get_cursor(&iq, &buffer, &from, &to, &fds, &charge_fds);
+        assert(!r);
+        assert(to - *from == IQUEUE_RECV_MAX / 2);
+        assert(iq.data != iq.buffer);
+
+        iqueue_note_read(&iq, from, to - *from, 0, true);
+        assert(iq.data == iq.buffer);
+        assert(iq.stats.n_releases == 2);
+
+        r = iqueue_get_cursor(&iq, &buffer, &from, &to, &fds, &charge_fds);
+        assert(!r);
+        assert(to - *from == IQUEUE_RECV_MAX / 2);
+
+        /*
+         * Fill the entire window again, but this time with FDs attached, and
+         * verify this resets the read size.
+         */
+
+        start = *from;
+        *from = to;
+        r = fdlist_new_with_fds(fds, (int [1]){}, 1);
+        assert(!r);
+        iqueue_note_read(&iq, from, to - start, to - start, false);
+
+        for (i = 0; i < (to - start) / 8; ++i) {
+                FDList *f = NULL;
+
+                r = iqueue_pop_data(&iq, &f);
+                assert(!r);
+                fdlist_free(f);
+
+                r = iqueue_set_target(&iq, blob, 8);
+                assert(!r);
+        }
+
+        r = iqueue_get_cursor(&iq, &buffer, &from, &to, &fds, &charge_fds);
+        assert(!r);
+        assert(to - *from == IQUEUE_RECV_MIN);
+        assert(iq.data == iq.buffer);
+        assert(iqueue_get_memory(&iq) == IQUEUE_RECV_MIN);
+
+        r = iqueue_pop_data(&iq, NULL);
+        assert(r == IQUEUE_E_PENDING);
+        iqueue_flush(&iq);
+}
+
 int main(int argc, char **argv) {
         srand(0xabcdef);
 
         test_in_setup();
         test_in_special();
         test_in_lines();
+        test_in_adaptive();
 
         return 0;
 }
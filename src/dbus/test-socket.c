@@ -5,10 +5,17 @@
 #include <c-macro.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include "dbus/message.h"
+#include "dbus/sasl.h"
 #include "dbus/socket.h"
+#include "util/dispatch.h"
+#include "util/fdlist.h"
+#include "util/serialize.h"
+#include "util/shmring.h"
 
 static void test_setup(void) {
         _c_cleanup_(socket_deinit) Socket server = SOCKET_NULL(server), client = SOCKET_NULL(client);
@@ -79,9 +86,13 @@ static void test_message(void) {
 
         r = socket_queue(&client, NULL, message1);
         assert(!r);
+        assert(client.out.n_messages == 1);
+        assert(client.out.n_bytes == message1->n_data);
 
         r = socket_dispatch(&client, EPOLLOUT);
         assert(r == SOCKET_E_LOST_INTEREST);
+        assert(client.out.n_messages == 0);
+        assert(client.out.n_bytes == 0);
         r = socket_dispatch(&server, EPOLLIN);
         assert(!r || r == SOCKET_E_PREEMPTED);
 
@@ -91,9 +102,954 @@ static void test_message(void) {
         assert(memcmp(message1->header, message2->header, sizeof(header)) == 0);
 }
 
+static void test_shared(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        MessageHeader header = {
+                .endian = 'l',
+                .n_body = htole32(256 * 1024),
+        };
+        Message *received[2] = {};
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        r = setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &(int){ 4096 }, sizeof(int));
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        r = message_new_incoming(&message, header);
+        assert(!r);
+
+        for (i = 0; i < message->n_body; ++i)
+                ((uint8_t *)message->body)[i] = i;
+
+        /*
+         * Queue the same message twice, so both socket buffers share its
+         * iovecs. The small send buffer forces partial writes, which must
+         * not affect the second copy.
+         */
+        r = socket_queue(&client, NULL, message);
+        assert(!r);
+        r = socket_queue(&client, NULL, message);
+        assert(!r);
+
+        while (n_received < C_ARRAY_SIZE(received)) {
+                r = socket_dispatch(&client, EPOLLOUT);
+                assert(!r || r == SOCKET_E_LOST_INTEREST);
+
+                do {
+                        r = socket_dispatch(&server, EPOLLIN);
+                        assert(!r || r == SOCKET_E_PREEMPTED);
+
+                        for (;;) {
+                                Message *m = NULL;
+                                int k;
+
+                                k = socket_dequeue(&server, &m);
+                                assert(!k);
+                                if (!m)
+                                        break;
+
+                                assert(n_received < C_ARRAY_SIZE(received));
+                                received[n_received++] = m;
+                        }
+                } while (r == SOCKET_E_PREEMPTED);
+        }
+
+        for (i = 0; i < C_ARRAY_SIZE(received); ++i) {
+                assert(received[i]->n_data == message->n_data);
+                assert(!memcmp(received[i]->data, message->data, message->n_data));
+                message_unref(received[i]);
+        }
+}
+
+static void test_coalesce(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        MessageHeader header = {
+                .endian = 'l',
+        };
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        r = message_new_incoming(&message, header);
+        assert(!r);
+
+        /*
+         * Queue many more small messages than fit into a single sendmmsg(2)
+         * call if each was sent separately, and verify they are all merged
+         * and flushed in a single go.
+         */
+        for (i = 0; i < SOCKET_MMSG_MAX * 4; ++i) {
+                r = socket_queue(&client, NULL, message);
+                assert(!r);
+        }
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+
+        do {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                for (;;) {
+                        Message *m = NULL;
+                        int k;
+
+                        k = socket_dequeue(&server, &m);
+                        assert(!k);
+                        if (!m)
+                                break;
+
+                        assert(m->n_data == message->n_data);
+                        message_unref(m);
+                        ++n_received;
+                }
+        } while (r == SOCKET_E_PREEMPTED);
+
+        assert(n_received == SOCKET_MMSG_MAX * 4);
+}
+
+static void test_supersede(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        static const char *paths[] = { "/a", "/b", "/a" };
+        Message *messages[C_ARRAY_SIZE(paths)] = {}, *m;
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        /*
+         * Queue three signals, the last one superseding the first one. The
+         * first one must be dropped, and the last one must be written after
+         * the second one.
+         */
+        for (i = 0; i < C_ARRAY_SIZE(paths); ++i) {
+                MessageHeader header = {
+                        .endian = 'l',
+                        .type = DBUS_MESSAGE_TYPE_SIGNAL,
+                        .serial = htole32(i + 1),
+                };
+
+                r = message_new_incoming(&messages[i], header);
+                assert(!r);
+
+                messages[i]->sender_id = 1;
+                messages[i]->metadata.header.type = DBUS_MESSAGE_TYPE_SIGNAL;
+                messages[i]->metadata.fields.path = paths[i];
+                messages[i]->metadata.fields.interface = "org.freedesktop.DBus.Properties";
+                messages[i]->metadata.fields.member = "PropertiesChanged";
+
+                r = socket_queue_coalesce(&client, NULL, messages[i], NULL);
+                assert(!r);
+        }
+
+        assert(client.out.n_messages == 2);
+        assert(client.out.n_coalesced == 1);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+
+        do {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                for (;;) {
+                        int k;
+
+                        k = socket_dequeue(&server, &m);
+                        assert(!k);
+                        if (!m)
+                                break;
+
+                        assert(n_received < 2);
+                        assert(le32toh(m->header->serial) == (n_received ? 3 : 2));
+                        message_unref(m);
+                        ++n_received;
+                }
+        } while (r == SOCKET_E_PREEMPTED);
+
+        assert(n_received == 2);
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i)
+                message_unref(messages[i]);
+}
+
+static bool test_supersede_fn(Message *queued, Message *message) {
+        /* the first signal is not covered by any of the later ones */
+        return le32toh(queued->header->serial) != 1;
+}
+
+static void test_supersede_partial(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        Message *messages[3] = {}, *m;
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        /*
+         * Queue three signals with the same key, but only let the last one
+         * supersede the second one. The first one must be kept, since the
+         * callback refuses to drop it, and the order must be retained.
+         */
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i) {
+                MessageHeader header = {
+                        .endian = 'l',
+                        .type = DBUS_MESSAGE_TYPE_SIGNAL,
+                        .serial = htole32(i + 1),
+                };
+
+                r = message_new_incoming(&messages[i], header);
+                assert(!r);
+
+                messages[i]->sender_id = 1;
+                messages[i]->metadata.header.type = DBUS_MESSAGE_TYPE_SIGNAL;
+                messages[i]->metadata.fields.path = "/a";
+                messages[i]->metadata.fields.interface = "org.freedesktop.DBus.Properties";
+                messages[i]->metadata.fields.member = "PropertiesChanged";
+
+                r = socket_queue_coalesce(&client, NULL, messages[i], test_supersede_fn);
+                assert(!r);
+        }
+
+        assert(client.out.n_messages == 2);
+        assert(client.out.n_coalesced == 1);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+
+        do {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                for (;;) {
+                        int k;
+
+                        k = socket_dequeue(&server, &m);
+                        assert(!k);
+                        if (!m)
+                                break;
+
+                        assert(n_received < 2);
+                        assert(le32toh(m->header->serial) == (n_received ? 3 : 1));
+                        message_unref(m);
+                        ++n_received;
+                }
+        } while (r == SOCKET_E_PREEMPTED);
+
+        assert(n_received == 2);
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i)
+                message_unref(messages[i]);
+}
+
+static void test_lanes(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        static const uint8_t types[] = {
+                DBUS_MESSAGE_TYPE_SIGNAL,
+                DBUS_MESSAGE_TYPE_METHOD_CALL,
+                DBUS_MESSAGE_TYPE_METHOD_RETURN,
+                DBUS_MESSAGE_TYPE_SIGNAL,
+                DBUS_MESSAGE_TYPE_ERROR,
+                DBUS_MESSAGE_TYPE_METHOD_CALL,
+        };
+        static const uint32_t order[] = { 3, 5, 2, 6, 1, 4 };
+        Message *messages[C_ARRAY_SIZE(types)] = {}, *m;
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        socket_set_lanes(&client, true);
+
+        /*
+         * Queue messages of mixed types. They must be written replies first,
+         * then method calls, then signals, each in the order they were queued.
+         */
+        for (i = 0; i < C_ARRAY_SIZE(types); ++i) {
+                MessageHeader header = {
+                        .endian = 'l',
+                        .type = types[i],
+                        .serial = htole32(i + 1),
+                };
+
+                r = message_new_incoming(&messages[i], header);
+                assert(!r);
+
+                r = socket_queue(&client, NULL, messages[i]);
+                assert(!r);
+        }
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+
+        do {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                for (;;) {
+                        int k;
+
+                        k = socket_dequeue(&server, &m);
+                        assert(!k);
+                        if (!m)
+                                break;
+
+                        assert(n_received < C_ARRAY_SIZE(order));
+                        assert(le32toh(m->header->serial) == order[n_received]);
+                        message_unref(m);
+                        ++n_received;
+                }
+        } while (r == SOCKET_E_PREEMPTED);
+
+        assert(n_received == C_ARRAY_SIZE(order));
+
+        socket_set_lanes(&client, false);
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i)
+                message_unref(messages[i]);
+}
+
+static void test_batch(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        Message *messages[3] = {}, *m;
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        /* a batch of messages is queued at once, in order */
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i) {
+                MessageHeader header = {
+                        .endian = 'l',
+                        .type = DBUS_MESSAGE_TYPE_METHOD_CALL,
+                        .serial = htole32(i + 1),
+                };
+
+                r = message_new_incoming(&messages[i], header);
+                assert(!r);
+        }
+
+        r = socket_queue_batch(&client, NULL, messages, C_ARRAY_SIZE(messages));
+        assert(!r);
+        assert(client.out.n_messages == C_ARRAY_SIZE(messages));
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        assert(!client.out.n_messages);
+
+        do {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                for (;;) {
+                        int k;
+
+                        k = socket_dequeue(&server, &m);
+                        assert(!k);
+                        if (!m)
+                                break;
+
+                        assert(le32toh(m->header->serial) == ++n_received);
+                        message_unref(m);
+                }
+        } while (r == SOCKET_E_PREEMPTED);
+
+        assert(n_received == C_ARRAY_SIZE(messages));
+
+        for (i = 0; i < C_ARRAY_SIZE(messages); ++i)
+                message_unref(messages[i]);
+}
+
+static void test_uring(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext ctx = DISPATCH_CONTEXT_NULL(ctx);
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        DispatchFile file = DISPATCH_FILE_NULL(file);
+        MessageHeader header = {
+                .endian = 'l',
+        };
+        Message *message;
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = dispatch_context_init(&ctx);
+        assert(!r);
+
+        r = dispatch_context_init_uring(&ctx);
+        if (r == DISPATCH_E_UNSUPPORTED)
+                return;
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        r = dispatch_file_init(&file, &ctx, NULL, pair[0], EPOLLOUT, 0);
+        assert(!r);
+
+        client.file = &file;
+
+        /*
+         * Writes are only submitted with the next poll of the dispatcher,
+         * and the messages stay queued until the write completed.
+         */
+        for (i = 0; i < 3; ++i) {
+                r = message_new_incoming(&message, header);
+                assert(!r);
+
+                r = socket_queue(&client, NULL, message);
+                assert(!r);
+
+                message_unref(message);
+        }
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+        assert(client.out.n_messages == 3);
+
+        r = dispatch_context_poll(&ctx, 0);
+        assert(!r);
+        assert(file.events & EPOLLOUT);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        assert(!client.out.n_messages);
+
+        /* a hangup waits for the write in flight, before discarding output */
+
+        r = message_new_incoming(&message, header);
+        assert(!r);
+
+        r = socket_queue(&client, NULL, message);
+        assert(!r);
+
+        message_unref(message);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+
+        r = socket_dispatch(&client, EPOLLHUP);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        assert(!client.out.n_messages);
+
+        do {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                for (;;) {
+                        r = socket_dequeue(&server, &message);
+                        assert(!r);
+                        if (!message)
+                                break;
+
+                        message_unref(message);
+                        ++n_received;
+                }
+        } while (r == SOCKET_E_PREEMPTED);
+
+        assert(n_received == 4);
+
+        dispatch_file_deinit(&file);
+}
+
+static void test_fds(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        MessageHeader header = {
+                .endian = 'l',
+        };
+        Message *message;
+        size_t i, n_received = 0;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        /*
+         * Queue more messages with FDs than may be in flight at once, and
+         * verify that the first batch is written in one go, and the rest
+         * only after the receiver drained the queue.
+         */
+        for (i = 0; i < SOCKET_FD_INFLIGHT_MAX + 1; ++i) {
+                r = message_new_incoming(&message, header);
+                assert(!r);
+
+                r = fdlist_new_with_fds(&message->fds, (int [1]){ pair[0] }, 1);
+                assert(!r);
+
+                r = socket_queue(&client, NULL, message);
+                assert(!r);
+
+                message_unref(message);
+        }
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+        assert(client.out.n_pending == SOCKET_FD_INFLIGHT_MAX);
+
+        /* the queue did not drain, so nothing more may be written */
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+        assert(client.out.n_pending == SOCKET_FD_INFLIGHT_MAX);
+
+        while (n_received < SOCKET_FD_INFLIGHT_MAX) {
+                r = socket_dispatch(&server, EPOLLIN);
+                assert(!r || r == SOCKET_E_PREEMPTED);
+
+                for (;;) {
+                        r = socket_dequeue(&server, &message);
+                        assert(!r);
+                        if (!message)
+                                break;
+
+                        assert(fdlist_count(message->fds) == 1);
+                        message_unref(message);
+                        ++n_received;
+                }
+        }
+
+        /* the queue drained, so the pending FDs are released */
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(!r);
+        assert(client.out.n_pending == 1);
+}
+
+static void test_pipeline(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        static const char * const lines[] = {
+                "\0AUTH EXTERNAL", "DATA", "NEGOTIATE_UNIX_FD", "BEGIN",
+        };
+        static const size_t n_lines[] = {
+                sizeof("\0AUTH EXTERNAL") - 1, strlen("DATA"), strlen("NEGOTIATE_UNIX_FD"), strlen("BEGIN"),
+        };
+        MessageHeader header = {
+                .endian = 'l',
+        };
+        SASLServer sasl;
+        Message *message;
+        CList *link;
+        const char *line, *output;
+        char guid[16] = {}, data[256];
+        size_t i, n_line, n_output, n_buffers, n_expected;
+        ssize_t l;
+        int pair[2], r;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+        sasl_server_init(&sasl, getuid(), guid);
+
+        /*
+         * Pipeline the entire SASL exchange and the first message into a
+         * single write, like common clients do, and verify the server needs
+         * a single read to handle it, and a single write to answer it all.
+         */
+        for (i = 0; i < C_ARRAY_SIZE(lines); ++i) {
+                r = socket_queue_line(&client, NULL, lines[i], n_lines[i]);
+                assert(!r);
+        }
+
+        r = message_new_incoming(&message, header);
+        assert(!r);
+        r = socket_queue(&client, NULL, message);
+        assert(!r);
+        message_unref(message);
+
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        r = socket_dispatch(&server, EPOLLIN);
+        assert(!r || r == SOCKET_E_PREEMPTED);
+
+        while (!sasl_server_is_done(&sasl)) {
+                r = socket_dequeue_line(&server, &line, &n_line);
+                assert(!r && line);
+
+                r = sasl_server_dispatch(&sasl, line, n_line, &output, &n_output);
+                assert(!r);
+
+                if (output) {
+                        r = socket_queue_line(&server, NULL, output, n_output);
+                        assert(!r);
+                }
+        }
+
+        r = socket_dequeue(&server, &message);
+        assert(!r && message);
+        message_unref(message);
+
+        /* reply with two messages, as the driver does for Hello() */
+        for (i = 0; i < 2; ++i) {
+                r = message_new_incoming(&message, header);
+                assert(!r);
+                r = socket_queue(&server, NULL, message);
+                assert(!r);
+                message_unref(message);
+        }
+
+        /* all SASL replies share a single line buffer */
+        n_buffers = 0;
+        c_list_for_each(link, &server.out.queue)
+                ++n_buffers;
+        assert(n_buffers == 3);
+
+        r = socket_dispatch(&server, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+
+        n_expected = strlen("DATA\r\nOK 00000000000000000000000000000000\r\nAGREE_UNIX_FD\r\n") +
+                     2 * sizeof(header);
+        l = recv(pair[0], data, sizeof(data), MSG_DONTWAIT);
+        assert(l == (ssize_t)n_expected);
+
+        sasl_server_deinit(&sasl);
+}
+
+static void test_shm_dequeue(Socket *socket, uint32_t serial) {
+        Message *message;
+        int r;
+
+        r = socket_dispatch(socket, EPOLLIN);
+        assert(!r);
+
+        r = socket_dequeue(socket, &message);
+        assert(!r && message);
+        assert(le32toh(message->header->serial) == serial);
+        message_unref(message);
+}
+
+static void test_shm(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server);
+        MessageHeader header = {
+                .endian = 'l',
+                .type = DBUS_MESSAGE_TYPE_METHOD_CALL,
+        };
+        MessageHeader buffer[2];
+        int pair[2], memfd, wake_fd, r;
+        Message *message;
+        ShmRing rx, tx;
+        size_t n;
+        bool wake;
+        void *map;
+        ssize_t l;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        r = socket_open_shm(&server, &memfd, &wake_fd);
+        assert(!r);
+
+        /* the peer writes the first ring, and reads the second */
+        map = mmap(NULL, 2 * SHMRING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        assert(map != MAP_FAILED);
+        shmring_init(&tx, map);
+        shmring_init(&rx, (uint8_t *)map + SHMRING_MAP_SIZE);
+
+        /* the peer cannot truncate the rings */
+        r = ftruncate(memfd, 0);
+        assert(r < 0 && errno == EPERM);
+
+        /* output queued before the switch still goes to the socket */
+        header.serial = htole32(1);
+        r = message_new_incoming(&message, header);
+        assert(!r);
+        r = socket_queue(&server, NULL, message);
+        assert(!r);
+        message_unref(message);
+
+        assert(!server.shm->output);
+        r = socket_dispatch(&server, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        assert(server.shm->output);
+
+        test_shm_dequeue(&client, 1);
+
+        /* from then on, output goes to the ring and wakes up the peer */
+        header.serial = htole32(2);
+        r = message_new_incoming(&message, header);
+        assert(!r);
+        r = socket_queue(&server, NULL, message);
+        assert(!r);
+        message_unref(message);
+
+        r = socket_dispatch(&server, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+
+        l = recv(wake_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        assert(l == 1);
+
+        r = shmring_read(&rx, buffer, sizeof(buffer), &n, &wake);
+        assert(!r && !wake);
+        assert(n == sizeof(header));
+        assert(le32toh(buffer[0].serial) == 2);
+
+        l = recv(pair[0], buffer, sizeof(buffer), MSG_DONTWAIT);
+        assert(l < 0 && errno == EAGAIN);
+
+        /* input is read from the ring, once the socket is drained */
+        header.serial = htole32(3);
+        r = shmring_write(&tx, &(struct iovec){ &header, sizeof(header) }, 1, &n, &wake);
+        assert(!r && n == sizeof(header) && wake);
+
+        l = send(wake_fd, "", 1, 0);
+        assert(l == 1);
+
+        r = socket_dispatch_shm(&server);
+        assert(!r);
+
+        test_shm_dequeue(&server, 3);
+
+        munmap(map, 2 * SHMRING_MAP_SIZE);
+        close(wake_fd);
+        close(memfd);
+}
+
+static void test_serialize(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server), restored = SOCKET_NULL(restored);
+        _c_cleanup_(message_unrefp) Message *message1 = NULL, *message2 = NULL, *message = NULL;
+        MessageHeader header1 = {
+                .endian = 'l',
+                .serial = htole32(1),
+        };
+        MessageHeader header2 = {
+                .endian = 'l',
+                .serial = htole32(2),
+        };
+        Serializer *s;
+        Deserializer *d;
+        int pair[2], handoff[2], r;
+
+        s = malloc(sizeof(*s));
+        d = malloc(sizeof(*d));
+        assert(s && d);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+        r = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, handoff);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+
+        r = message_new_incoming(&message1, header1);
+        assert(!r);
+        r = message_new_incoming(&message2, header2);
+        assert(!r);
+
+        /* read input on the server, but leave it unparsed, and queue output */
+
+        r = socket_queue(&client, NULL, message1);
+        assert(!r);
+        r = socket_dispatch(&client, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        r = socket_dispatch(&server, EPOLLIN);
+        assert(!r || r == SOCKET_E_PREEMPTED);
+
+        r = socket_queue(&server, NULL, message2);
+        assert(!r);
+
+        /* both survive a round-trip into another socket on the same connection */
+
+        serializer_init(s, handoff[0]);
+        deserializer_init(d, handoff[1]);
+
+        r = socket_serialize(&server, s);
+        assert(!r);
+        r = serializer_flush(s);
+        assert(!r);
+
+        socket_init(&restored, NULL, dup(pair[1]));
+
+        r = socket_deserialize(&restored, d);
+        assert(!r);
+        assert(restored.out.n_messages == 1);
+
+        r = socket_dequeue(&restored, &message);
+        assert(!r && message);
+        assert(message->header->serial == htole32(1));
+        message = message_unref(message);
+
+        r = socket_dispatch(&restored, EPOLLOUT);
+        assert(r == SOCKET_E_LOST_INTEREST);
+        r = socket_dispatch(&client, EPOLLIN);
+        assert(!r || r == SOCKET_E_PREEMPTED);
+
+        r = socket_dequeue(&client, &message);
+        assert(!r && message);
+        assert(message->header->serial == htole32(2));
+
+        serializer_deinit(s);
+        deserializer_deinit(d);
+        close(handoff[1]);
+        close(handoff[0]);
+        free(d);
+        free(s);
+}
+
+static int test_admission_dequeue(Socket *client, Socket *server, Message **messagep) {
+        int r;
+
+        for (;;) {
+                r = socket_dequeue(server, messagep);
+                if (r || *messagep)
+                        return r;
+
+                r = socket_dispatch(client, EPOLLOUT);
+                assert(!r || r == SOCKET_E_LOST_INTEREST);
+                r = socket_dispatch(server, EPOLLIN);
+                assert(r >= 0);
+        }
+}
+
+static void test_admission(void) {
+        _c_cleanup_(socket_deinit) Socket client = SOCKET_NULL(client), server = SOCKET_NULL(server), restored = SOCKET_NULL(restored);
+        Message *message, *queued[3];
+        MessageHeader header = {
+                .endian = 'l',
+                .n_fields = htole32(8),
+        };
+        Serializer *s;
+        Deserializer *d;
+        size_t i;
+        int pair[2], handoff[2], r;
+
+        s = malloc(sizeof(*s));
+        d = malloc(sizeof(*d));
+        assert(s && d);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        assert(r >= 0);
+        r = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, handoff);
+        assert(r >= 0);
+
+        socket_init(&client, NULL, pair[0]);
+        socket_init(&server, NULL, pair[1]);
+        socket_set_admission(&server, true);
+
+        /* two large messages, followed by a small one */
+        for (i = 0; i < C_ARRAY_SIZE(queued); ++i) {
+                header.serial = htole32(i + 1);
+                header.n_body = htole32(i < 2 ? 2 * SOCKET_ADMISSION_MIN : 8);
+
+                r = message_new_incoming(&queued[i], header);
+                assert(!r);
+                memset(queued[i]->body, 'a' + i, queued[i]->n_body);
+                memset((uint8_t *)queued[i]->data + sizeof(header), 0, 8);
+
+                r = socket_queue(&client, NULL, queued[i]);
+                assert(!r);
+        }
+
+        /* the first message is rejected once its header was received */
+        r = test_admission_dequeue(&client, &server, &message);
+        assert(r == SOCKET_E_ADMISSION && message);
+        assert(message->header->serial == htole32(1));
+        message_unref(message);
+
+        r = socket_admit(&server, false);
+        assert(!r);
+        assert(!server.in.message);
+        assert(server.in.n_drain == 2 * SOCKET_ADMISSION_MIN);
+
+        /* drained bodies survive a handoff */
+        serializer_init(s, handoff[0]);
+        deserializer_init(d, handoff[1]);
+
+        r = socket_serialize(&server, s);
+        assert(!r);
+        r = serializer_flush(s);
+        assert(!r);
+
+        socket_init(&restored, NULL, dup(pair[1]));
+        socket_set_admission(&restored, true);
+
+        r = socket_deserialize(&restored, d);
+        assert(!r);
+
+        /* the second message is admitted and then received in full */
+        r = test_admission_dequeue(&client, &restored, &message);
+        assert(r == SOCKET_E_ADMISSION && message);
+        assert(message->header->serial == htole32(2));
+        message_unref(message);
+
+        r = socket_admit(&restored, true);
+        assert(!r);
+
+        r = test_admission_dequeue(&client, &restored, &message);
+        assert(!r && message);
+        assert(!restored.in.n_drain);
+        assert(message->header->serial == htole32(2));
+        assert(!memcmp(message->data, queued[1]->data, message->n_data));
+        message_unref(message);
+
+        /* small messages are never held back */
+        r = test_admission_dequeue(&client, &restored, &message);
+        assert(!r && message);
+        assert(message->header->serial == htole32(3));
+        assert(!memcmp(message->data, queued[2]->data, message->n_data));
+        message_unref(message);
+
+        for (i = 0; i < C_ARRAY_SIZE(queued); ++i)
+                message_unref(queued[i]);
+
+        serializer_deinit(s);
+        deserializer_deinit(d);
+        close(handoff[1]);
+        close(handoff[0]);
+        free(d);
+        free(s);
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_line();
         test_message();
+        test_shared();
+        test_coalesce();
+        test_supersede();
+        test_supersede_partial();
+        test_lanes();
+        test_batch();
+        test_uring();
+        test_fds();
+        test_pipeline();
+        test_shm();
+        test_serialize();
+        test_admission();
         return 0;
 }
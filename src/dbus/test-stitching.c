@@ -5,7 +5,10 @@
 #include <c-dvar.h>
 #include <c-dvar-type.h>
 #include <c-macro.h>
+#include <endian.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include "dbus/address.h"
 #include "dbus/message.h"
 #include "dbus/protocol.h"
@@ -112,12 +115,23 @@ static Message *test_new_message(size_t before, const char *sender_early, size_t
         return message;
 }
 
-static void test_assert_message(Message *message, size_t before, const char *sender, size_t after) {
+static void test_assert_message(Message *message, size_t before, const char *sender, size_t after, bool in_place) {
         _c_cleanup_(message_unrefp) Message *expected = NULL;
         _c_cleanup_(c_freep) void *p = NULL;
         size_t i, n;
 
-        expected = test_new_message(before, NULL, after, sender);
+        /*
+         * If the sender was stitched in place, it stays at its original
+         * position and the message must still be contiguous. Otherwise, it is
+         * moved to the end of the header fields.
+         */
+        if (in_place) {
+                expected = test_new_message(before, sender, after, NULL);
+                assert(!message->vecs[1].iov_len);
+                assert(!message->vecs[2].iov_len);
+        } else {
+                expected = test_new_message(before, NULL, after, sender);
+        }
 
         for (n = 0, i = 0; i < C_ARRAY_SIZE(message->vecs); ++i)
                 n += message->vecs[i].iov_len;
@@ -135,9 +149,10 @@ static void test_assert_message(Message *message, size_t before, const char *sen
 }
 
 static void test_stitching(void) {
+        MessageSender sender;
         Message *message;
         Address addr;
-        size_t i, n;
+        size_t i, n, n_in_place;
         char *from, *to;
 
         /*
@@ -172,9 +187,16 @@ static void test_stitching(void) {
                 address_from_string(&addr, to);
                 assert(addr.type == ADDRESS_TYPE_ID);
 
+                n_in_place = message_get_stats()->n_stitched_in_place;
+
+                message_sender_init(&sender, addr.id);
                 message = test_new_message(i % 13, from, i / 17, NULL);
-                message_stitch_sender(message, addr.id);
-                test_assert_message(message, i % 13, to, i / 17);
+                message_stitch_sender(message, &sender);
+                test_assert_message(message,
+                                    i % 13,
+                                    to,
+                                    i / 17,
+                                    message_get_stats()->n_stitched_in_place != n_in_place);
                 message_unref(message);
 
                 free(to);
@@ -182,7 +204,77 @@ static void test_stitching(void) {
         }
 }
 
+static void test_stitching_in_place(void) {
+        _c_cleanup_(message_unrefp) Message *message = NULL;
+        MessageSender sender;
+        MessageStats stats;
+        Address addr;
+
+        address_from_string(&addr, ":1.23");
+        assert(addr.type == ADDRESS_TYPE_ID);
+        message_sender_init(&sender, addr.id);
+
+        /* a sender of the same length is always overwritten in place */
+        stats = *message_get_stats();
+        message = test_new_message(3, ":1.99", 7, NULL);
+        message_stitch_sender(message, &sender);
+        assert(message_get_stats()->n_stitched == stats.n_stitched + 1);
+        assert(message_get_stats()->n_stitched_in_place == stats.n_stitched_in_place + 1);
+        test_assert_message(message, 3, ":1.23", 7, true);
+        message = message_unref(message);
+
+        /* a trailing sender is rewritten in place if the padding suffices */
+        stats = *message_get_stats();
+        message = test_new_message(3, NULL, 7, ":1.9");
+        message_stitch_sender(message, &sender);
+        assert(message_get_stats()->n_stitched_in_place == stats.n_stitched_in_place + 1);
+        test_assert_message(message, 3, ":1.23", 7, true);
+        message = message_unref(message);
+
+        /* a leading sender of different length must be cut out */
+        stats = *message_get_stats();
+        message = test_new_message(3, ":1.9", 7, NULL);
+        message_stitch_sender(message, &sender);
+        assert(message_get_stats()->n_stitched_in_place == stats.n_stitched_in_place);
+        test_assert_message(message, 3, ":1.23", 7, false);
+        message = message_unref(message);
+
+        /* without a sender, it is always appended */
+        stats = *message_get_stats();
+        message = test_new_message(3, NULL, 7, NULL);
+        message_stitch_sender(message, &sender);
+        assert(message_get_stats()->n_stitched_in_place == stats.n_stitched_in_place);
+        test_assert_message(message, 3, ":1.23", 7, false);
+}
+
+static void test_sender(void) {
+        MessageSender sender = MESSAGE_SENDER_NULL;
+        uint32_t n;
+
+        assert(sender.id == ADDRESS_ID_INVALID);
+
+        /* both encodings carry the same field, with the length in their byte order */
+        message_sender_init(&sender, 23);
+        assert(sender.id == 23);
+        assert(sender.n_sender == strlen(":1.23"));
+        assert(sender.n_field == 1 + 3 + 4 + strlen(":1.23") + 1);
+
+        assert(sender.patches[0][0] == DBUS_MESSAGE_FIELD_SENDER);
+        assert(!memcmp(sender.patches[0] + 1, "\1s", 3));
+        assert(!memcmp(sender.patches[0] + 8, ":1.23", strlen(":1.23") + 1));
+
+        memcpy(&n, sender.patches[0] + 4, sizeof(n));
+        assert(le32toh(n) == strlen(":1.23"));
+        memcpy(&n, sender.patches[1] + 4, sizeof(n));
+        assert(be32toh(n) == strlen(":1.23"));
+
+        assert(!memcmp(sender.patches[0], sender.patches[1], 4));
+        assert(!memcmp(sender.patches[0] + 8, sender.patches[1] + 8, sizeof(sender.patches[0]) - 8));
+}
+
 int main(int argc, char **argv) {
+        test_sender();
         test_stitching();
+        test_stitching_in_place();
         return 0;
 }
@@ -0,0 +1,356 @@
+/*
+ * Launcher Cache
+ *
+ * The launcher parses the XML configuration of the bus on every start. To
+ * skip this on warm starts, the result can be cached in a single file, which
+ * is mapped into memory and used as-is if none of its sources changed.
+ *
+ * A cache file consists of a header, a key, a list of sources, and the
+ * cached data. The key is an opaque string provided by the caller, which
+ * covers all non-file inputs (like the path of the root configuration, or
+ * the calling user). The sources are all files and directories the
+ * configuration parser looked at, each with the identity it had at the time
+ * it was read. A cache is only used if its key matches, and all sources are
+ * still identical. Sources that were missing are recorded as such, and must
+ * still be missing.
+ *
+ * Besides the configuration files, the password and group databases are
+ * recorded as sources, since user and group names are resolved while
+ * parsing. Only file-based databases can be tracked this way. Hence, setups
+ * that resolve names via other NSS modules must not use a cache.
+ *
+ * All data is stored in native endianness and alignment. Cache files are
+ * never shared across machines.
+ */
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "launch/cache.h"
+#include "launch/config.h"
+#include "util/error.h"
+
+typedef struct CacheHeader CacheHeader;
+typedef struct CacheSource CacheSource;
+
+struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_key;
+        uint64_t n_sources;
+        uint64_t n_data;
+};
+
+struct CacheSource {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        uint64_t mtime_sec;
+        uint64_t mtime_nsec;
+        uint64_t ctime_sec;
+        uint64_t ctime_nsec;
+        uint32_t mode;
+        uint32_t n_path;
+};
+
+static const char * const cache_nss_sources[] = {
+        "/etc/passwd",
+        "/etc/group",
+};
+
+static size_t cache_align(size_t n) {
+        return (n + 7) & ~(size_t)7;
+}
+
+static void cache_source_from_stat(CacheSource *source, const struct stat *st, size_t n_path) {
+        *source = (CacheSource){
+                .dev = st->st_dev,
+                .ino = st->st_ino,
+                .size = st->st_size,
+                .mtime_sec = st->st_mtim.tv_sec,
+                .mtime_nsec = st->st_mtim.tv_nsec,
+                .ctime_sec = st->st_ctim.tv_sec,
+                .ctime_nsec = st->st_ctim.tv_nsec,
+                .mode = st->st_mode,
+                .n_path = n_path,
+        };
+}
+
+static int cache_source_stat(CacheSource *source, const char *path) {
+        struct stat st = {};
+        int r;
+
+        r = stat(path, &st);
+        if (r < 0) {
+                if (errno != ENOENT && errno != ENOTDIR)
+                        return error_origin(-errno);
+
+                /* missing sources are recorded as all-zero */
+                st = (struct stat){};
+        }
+
+        cache_source_from_stat(source, &st, strlen(path));
+        return 0;
+}
+
+static int cache_validate(const void *map, size_t n_map, const char *key, const void **datap, size_t *n_datap) {
+        const CacheHeader *header = map;
+        const char *p = map, *path;
+        CacheSource source, current;
+        size_t offset, n_key;
+        uint64_t i;
+        int r;
+
+        n_key = strlen(key);
+
+        if (n_map < sizeof(*header) ||
+            memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) ||
+            header->version != CACHE_VERSION ||
+            header->n_key != n_key)
+                return CACHE_E_STALE;
+
+        offset = sizeof(*header);
+        if (n_map - offset < n_key + 1 ||
+            memcmp(p + offset, key, n_key + 1))
+                return CACHE_E_STALE;
+
+        offset += cache_align(n_key + 1);
+
+        for (i = 0; i < header->n_sources; ++i) {
+                if (offset > n_map || n_map - offset < sizeof(source))
+                        return CACHE_E_STALE;
+
+                memcpy(&source, p + offset, sizeof(source));
+                offset += sizeof(source);
+
+                if (n_map - offset < (size_t)source.n_path + 1)
+                        return CACHE_E_STALE;
+
+                path = p + offset;
+                if (path[source.n_path] || strlen(path) != source.n_path)
+                        return CACHE_E_STALE;
+
+                offset += cache_align(source.n_path + 1);
+
+                /* a source that cannot be inspected cannot be verified either */
+                r = cache_source_stat(&current, path);
+                if (r)
+                        return CACHE_E_STALE;
+
+                if (memcmp(&source, &current, sizeof(source)))
+                        return CACHE_E_STALE;
+        }
+
+        if (offset > n_map || n_map - offset != header->n_data)
+                return CACHE_E_STALE;
+
+        *datap = p + offset;
+        *n_datap = header->n_data;
+        return 0;
+}
+
+/**
+ * cache_map() - map a cache file
+ * @cache:              cache to initialize
+ * @path:               path to the cache file
+ * @key:                key the cache must have been written with
+ *
+ * This maps the cache file at @path into memory and verifies it is still
+ * valid. On success, the cached data is available via @cache->data, and stays
+ * valid until cache_deinit() is called.
+ *
+ * The cache is merely an optimization, so any failure to read it is treated
+ * like a stale cache, and the caller falls back to parsing the configuration.
+ *
+ * Return: 0 on success, CACHE_E_STALE if the cache does not exist, is
+ *         malformed, is out-of-date, or cannot be read.
+ */
+int cache_map(Cache *cache, const char *path, const char *key) {
+        _c_cleanup_(c_closep) int fd = -1;
+        const void *data;
+        struct stat st;
+        size_t n_data;
+        void *map;
+        int r;
+
+        *cache = (Cache)CACHE_NULL(*cache);
+
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0)
+                return CACHE_E_STALE;
+
+        r = fstat(fd, &st);
+        if (r < 0)
+                return CACHE_E_STALE;
+
+        if (!S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(CacheHeader))
+                return CACHE_E_STALE;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+                return CACHE_E_STALE;
+
+        r = cache_validate(map, st.st_size, key, &data, &n_data);
+        if (r) {
+                munmap(map, st.st_size);
+                return r;
+        }
+
+        cache->map = map;
+        cache->n_map = st.st_size;
+        cache->data = data;
+        cache->n_data = n_data;
+        return 0;
+}
+
+/**
+ * cache_deinit() - unmap a cache file
+ * @cache:              cache to operate on
+ *
+ * This releases the mapping of @cache, if any. Any data obtained from the
+ * cache must no longer be used afterwards.
+ */
+void cache_deinit(Cache *cache) {
+        if (cache->map)
+                munmap(cache->map, cache->n_map);
+
+        *cache = (Cache)CACHE_NULL(*cache);
+}
+
+static void cache_write_padding(FILE *f, size_t n) {
+        static const char zero[8] = {};
+
+        fwrite(zero, 1, cache_align(n) - n, f);
+}
+
+static void cache_write_source(FILE *f, const CacheSource *source, const char *path) {
+        fwrite(source, sizeof(*source), 1, f);
+        fwrite(path, 1, source->n_path + 1, f);
+        cache_write_padding(f, source->n_path + 1);
+}
+
+static int cache_write_sources(FILE *f, ConfigRoot *root, uint64_t *n_sourcesp) {
+        CacheSource source;
+        ConfigPath *file;
+        ConfigNode *node;
+        uint64_t n_sources = 0;
+        size_t i;
+        int r;
+
+        for (i = 0; i < C_ARRAY_SIZE(cache_nss_sources); ++i) {
+                r = cache_source_stat(&source, cache_nss_sources[i]);
+                if (r)
+                        return error_trace(r);
+
+                cache_write_source(f, &source, cache_nss_sources[i]);
+                ++n_sources;
+        }
+
+        /*
+         * Use the identity of the configuration files and directories as
+         * recorded by the parser, rather than querying them again. This way,
+         * modifications that race the parser are detected on the next start.
+         */
+        c_list_for_each_entry(node, &root->node_list, root_link) {
+                if (node->type == CONFIG_NODE_INCLUDE)
+                        file = node->include.file;
+                else if (node->type == CONFIG_NODE_INCLUDEDIR)
+                        file = node->includedir.dir;
+                else
+                        continue;
+
+                if (!file || !file->is_loaded)
+                        continue;
+
+                cache_source_from_stat(&source, &file->st, strlen(file->path));
+                cache_write_source(f, &source, file->path);
+                ++n_sources;
+        }
+
+        *n_sourcesp = n_sources;
+        return 0;
+}
+
+/**
+ * cache_write() - write a cache file
+ * @path:               path to the cache file
+ * @key:                key to write the cache with
+ * @root:               configuration the cached data was derived from
+ * @data:               data to cache
+ * @n_data:             size of @data
+ *
+ * This writes @data to a cache file at @path, keyed by @key and all sources
+ * of @root. Any existing cache file is replaced atomically.
+ *
+ * Return: 0 on success, CACHE_E_UNWRITABLE if the cache file cannot be
+ *         created, negative error code on failure.
+ */
+int cache_write(const char *path, const char *key, ConfigRoot *root, const void *data, size_t n_data) {
+        _c_cleanup_(c_freep) char *temp = NULL;
+        CacheHeader header = {
+                .version = CACHE_VERSION,
+                .n_key = strlen(key),
+                .n_data = n_data,
+        };
+        FILE *f;
+        int r, fd;
+
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+
+        r = asprintf(&temp, "%s.XXXXXX", path);
+        if (r < 0)
+                return error_origin(-ENOMEM);
+
+        fd = mkostemp(temp, O_CLOEXEC);
+        if (fd < 0) {
+                if (errno == EACCES || errno == EPERM || errno == EROFS || errno == ENOENT)
+                        return CACHE_E_UNWRITABLE;
+
+                return error_origin(-errno);
+        }
+
+        f = fdopen(fd, "w");
+        if (!f) {
+                r = error_origin(-errno);
+                close(fd);
+                unlink(temp);
+                return r;
+        }
+
+        /* the source count is only known afterwards, rewrite the header then */
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(key, 1, header.n_key + 1, f);
+        cache_write_padding(f, header.n_key + 1);
+
+        r = cache_write_sources(f, root, &header.n_sources);
+        if (r) {
+                fclose(f);
+                unlink(temp);
+                return error_trace(r);
+        }
+
+        fwrite(data, 1, n_data, f);
+
+        if (!ferror(f) && !fseek(f, 0, SEEK_SET))
+                fwrite(&header, sizeof(header), 1, f);
+
+        r = ferror(f);
+        if (fclose(f) || r) {
+                unlink(temp);
+                return CACHE_E_UNWRITABLE;
+        }
+
+        r = rename(temp, path);
+        if (r < 0) {
+                unlink(temp);
+                return CACHE_E_UNWRITABLE;
+        }
+
+        return 0;
+}
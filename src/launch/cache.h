@@ -0,0 +1,39 @@
+#pragma once
+
+/*
+ * Launcher Cache
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "launch/config.h"
+
+typedef struct Cache Cache;
+
+#define CACHE_MAGIC "DBBCACHE"
+#define CACHE_VERSION (1)
+
+enum {
+        _CACHE_E_SUCCESS,
+
+        CACHE_E_STALE,
+        CACHE_E_UNWRITABLE,
+};
+
+struct Cache {
+        void *map;
+        size_t n_map;
+        const void *data;
+        size_t n_data;
+};
+
+#define CACHE_NULL(_x) {                                                        \
+                .map = NULL,                                                    \
+        }
+
+int cache_map(Cache *cache, const char *path, const char *key);
+void cache_deinit(Cache *cache);
+
+int cache_write(const char *path, const char *key, ConfigRoot *root, const void *data, size_t n_data);
+
+C_DEFINE_CLEANUP(Cache *, cache_deinit);
@@ -967,6 +967,13 @@ static void config_parser_end_fn(void *userdata, const XML_Char *name) {
                         return;
                 }
 
+                /*
+                 * Remember the identity of the directory at the time it was
+                 * read, so caches can tell whether entries were added or
+                 * removed since. A missing directory is recorded as all-zero.
+                 */
+                state->current->includedir.dir->is_loaded = true;
+
                 dir = opendir(state->current->includedir.dir->path);
                 if (!dir) {
                         if (errno == ENOENT || errno == ENOTDIR)
@@ -976,6 +983,12 @@ static void config_parser_end_fn(void *userdata, const XML_Char *name) {
                         return;
                 }
 
+                r = fstat(dirfd(dir), &state->current->includedir.dir->st);
+                if (r < 0) {
+                        state->error = error_origin(-errno);
+                        return;
+                }
+
                 for (errno = 0, de = readdir(dir);
                      de;
                      errno = 0, de = readdir(dir)) {
@@ -1148,6 +1161,8 @@ static int config_parser_include(ConfigParser *parser, ConfigRoot *root, ConfigN
         XML_SetElementHandler(parser->xml, config_parser_begin_fn, config_parser_end_fn);
         XML_SetCharacterDataHandler(parser->xml, config_parser_blob_fn);
 
+        node->include.file->is_loaded = true;
+
         r = open(node->include.file->path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
         if (r < 0) {
                 if (errno == ENOENT || errno == ENOTDIR)
@@ -1157,6 +1172,10 @@ static int config_parser_include(ConfigParser *parser, ConfigRoot *root, ConfigN
         }
         fd = r;
 
+        r = fstat(fd, &node->include.file->st);
+        if (r < 0)
+                return error_origin(-errno);
+
         do {
                 len = read(fd, buffer, sizeof(buffer));
                 if (len < 0)
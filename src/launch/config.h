@@ -8,6 +8,7 @@
 #include <c-macro.h>
 #include <expat.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 typedef struct ConfigPath ConfigPath;
 typedef struct ConfigNode ConfigNode;
@@ -81,6 +82,8 @@ struct ConfigPath {
         unsigned long n_refs;
         ConfigPath *parent;
         bool is_dir;
+        bool is_loaded;
+        struct stat st;
         char path[];
 };
 
@@ -8,18 +8,24 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <glib.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-event.h>
+#include "launch/cache.h"
 #include "launch/config.h"
 #include "launch/policy.h"
 #include "util/error.h"
+#include "util/selinux.h"
 
 typedef struct Manager Manager;
 typedef struct Service Service;
@@ -33,10 +39,15 @@ enum {
 struct Service {
         Manager *manager;
         CRBNode rb;
+        CRBNode rb_path;
+        char *path;
+        struct stat st;
+        bool seen;
         char *name;
         char *unit;
         char **exec;
         size_t n_exec;
+        sd_bus_slot *slot_start;
         char id[];
 };
 
@@ -45,16 +56,52 @@ struct Manager {
         sd_bus *bus_controller;
         sd_bus *bus_regular;
         int fd_listen;
+        int fd_host;
+        sd_event_source *host_source;
+        pid_t broker_pid;
         CRBTree services;
+        CRBTree service_paths;
         uint64_t service_ids;
+        struct stat servicedir_st;
+        bool servicedir_loaded;
+};
+
+typedef struct ServiceFile ServiceFile;
+typedef struct ServiceScan ServiceScan;
+
+struct ServiceFile {
+        char *path;
+        struct stat st;
+        gchar *name;
+        gchar *unit;
+        gchar **exec;
+        gsize n_exec;
+};
+
+struct ServiceScan {
+        ServiceFile *files;
+        size_t n_files;
+        size_t n_files_max;
+        atomic_size_t i_next;
 };
 
+#define SERVICE_SCAN_NULL {}
+
+#define MAIN_CRITICAL_UIDS_MAX (64) /* far more than the system users worth prioritizing */
+#define MAIN_SERVICE_THREADS_MAX (8) /* parsing is cheap, more threads only add start-up cost */
+#define MAIN_SERVICE_FILES_PER_THREAD (64) /* small directories are not worth a thread */
+
+static const char *     main_arg_attach = NULL;
 static const char *     main_arg_broker = "/usr/bin/dbus-broker";
+static uint32_t         main_arg_critical_uids[MAIN_CRITICAL_UIDS_MAX];
+static size_t           main_arg_n_critical_uids = 0;
 static bool             main_arg_force = false;
+static const char *     main_arg_host = NULL;
 static const char *     main_arg_listen = NULL;
 static const char *     main_arg_scope = "system";
 static const char *     main_arg_servicedir = NULL;
 static const char *     main_arg_policypath = NULL;
+static const char *     main_arg_policycache = NULL;
 static bool             main_arg_verbose = false;
 
 static sd_bus *bus_close_unref(sd_bus *bus) {
@@ -84,16 +131,36 @@ static int service_compare(CRBTree *t, void *k, CRBNode *n) {
         return strcmp(k, service->id);
 }
 
+static int service_compare_path(CRBTree *t, void *k, CRBNode *n) {
+        Service *service = c_container_of(n, Service, rb_path);
+
+        return strcmp(k, service->path);
+}
+
+static bool service_stat_equal(const struct stat *a, const struct stat *b) {
+        return a->st_dev == b->st_dev &&
+               a->st_ino == b->st_ino &&
+               a->st_mode == b->st_mode &&
+               a->st_size == b->st_size &&
+               a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+               a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+               a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+               a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
 static Service *service_free(Service *service) {
         if (!service)
                 return NULL;
 
+        sd_bus_slot_unref(service->slot_start);
+        c_rbtree_remove_init(&service->manager->service_paths, &service->rb_path);
         c_rbtree_remove_init(&service->manager->services, &service->rb);
         for (size_t i = 0; i < service->n_exec; ++i)
                 free(service->exec[i]);
         free(service->exec);
         free(service->unit);
         free(service->name);
+        free(service->path);
         free(service);
 
         return NULL;
@@ -101,9 +168,12 @@ static Service *service_free(Service *service) {
 
 C_DEFINE_CLEANUP(Service *, service_free);
 
-static int service_new(Service **servicep, Manager *manager, const char *name, const char *unit, char **exec, size_t n_exec) {
+static int service_new(Service **servicep, Manager *manager, ServiceFile *file) {
         _c_cleanup_(service_freep) Service *service = NULL;
         CRBNode **slot, *parent;
+        const char *name = file->name, *unit = file->unit;
+        char **exec = file->exec;
+        size_t n_exec = file->n_exec;
 
         service = calloc(1, sizeof(*service) + C_DECIMAL_MAX(uint64_t) + 1);
         if (!service)
@@ -111,8 +181,14 @@ static int service_new(Service **servicep, Manager *manager, const char *name, c
 
         service->manager = manager;
         service->rb = (CRBNode)C_RBNODE_INIT(service->rb);
+        service->rb_path = (CRBNode)C_RBNODE_INIT(service->rb_path);
+        service->st = file->st;
         sprintf(service->id, "%" PRIu64, ++manager->service_ids);
 
+        service->path = strdup(file->path);
+        if (!service->path)
+                return error_origin(-ENOMEM);
+
         service->name = strdup(name);
         if (!service->name)
                 return error_origin(-ENOMEM);
@@ -141,6 +217,10 @@ static int service_new(Service **servicep, Manager *manager, const char *name, c
         assert(slot);
         c_rbtree_add(&manager->services, parent, slot, &service->rb);
 
+        slot = c_rbtree_find_slot(&manager->service_paths, service_compare_path, service->path, &parent);
+        assert(slot);
+        c_rbtree_add(&manager->service_paths, parent, slot, &service->rb_path);
+
         *servicep = service;
         service = NULL;
         return 0;
@@ -155,6 +235,8 @@ static Manager *manager_free(Manager *manager) {
         c_rbtree_for_each_entry_unlink(service, safe, &manager->services, rb)
                 service_free(service);
 
+        sd_event_source_unref(manager->host_source);
+        c_close(manager->fd_host);
         c_close(manager->fd_listen);
         bus_close_unref(manager->bus_regular);
         bus_close_unref(manager->bus_controller);
@@ -166,6 +248,9 @@ static Manager *manager_free(Manager *manager) {
 
 C_DEFINE_CLEANUP(Manager *, manager_free);
 
+static int manager_on_sighup(sd_event_source *source, const struct signalfd_siginfo *si, void *userdata);
+static int manager_on_sigusr2(sd_event_source *source, const struct signalfd_siginfo *si, void *userdata);
+
 static int manager_new(Manager **managerp) {
         _c_cleanup_(manager_freep) Manager *manager = NULL;
         int r;
@@ -175,6 +260,7 @@ static int manager_new(Manager **managerp) {
                 return error_origin(-ENOMEM);
 
         manager->fd_listen = -1;
+        manager->fd_host = -1;
 
         r = sd_event_default(&manager->event);
         if (r < 0)
@@ -188,6 +274,14 @@ static int manager_new(Manager **managerp) {
         if (r < 0)
                 return error_origin(r);
 
+        r = sd_event_add_signal(manager->event, NULL, SIGHUP, manager_on_sighup, manager);
+        if (r < 0)
+                return error_origin(r);
+
+        r = sd_event_add_signal(manager->event, NULL, SIGUSR2, manager_on_sigusr2, manager);
+        if (r < 0)
+                return error_origin(r);
+
         r = sd_bus_new(&manager->bus_controller);
         if (r < 0)
                 return error_origin(r);
@@ -266,14 +360,31 @@ static int manager_listen_path(Manager *manager, const char *path) {
         return 0;
 }
 
-static noreturn void manager_run_child(Manager *manager, int fd_controller) {
+static int manager_inherit_fd(int fd) {
+        int r;
+
+        r = fcntl(fd, F_GETFD);
+        if (r < 0)
+                return error_origin(-errno);
+
+        r = fcntl(fd, F_SETFD, r & ~FD_CLOEXEC);
+        if (r < 0)
+                return error_origin(-errno);
+
+        return 0;
+}
+
+static noreturn void manager_run_child(Manager *manager, int fd_controller, int fd_handoff) {
         char str_controller[C_DECIMAL_MAX(int) + 1];
-        const char * const argv[] = {
+        char str_handoff[C_DECIMAL_MAX(int) + 1];
+        const char * argv[] = {
                 "dbus-broker",
                 "-v",
                 "--controller",
                 str_controller,
                 NULL,
+                NULL,
+                NULL,
         };
         int r;
 
@@ -283,21 +394,25 @@ static noreturn void manager_run_child(Manager *manager, int fd_controller) {
                 goto exit;
         }
 
-        r = fcntl(fd_controller, F_GETFD);
-        if (r < 0) {
-                r = error_origin(-errno);
-                goto exit;
-        }
-
-        r = fcntl(fd_controller, F_SETFD, r & ~FD_CLOEXEC);
-        if (r < 0) {
-                r = error_origin(-errno);
+        r = manager_inherit_fd(fd_controller);
+        if (r)
                 goto exit;
-        }
 
         r = snprintf(str_controller, sizeof(str_controller), "%d", fd_controller);
         assert(r < (ssize_t)sizeof(str_controller));
 
+        if (fd_handoff >= 0) {
+                r = manager_inherit_fd(fd_handoff);
+                if (r)
+                        goto exit;
+
+                r = snprintf(str_handoff, sizeof(str_handoff), "%d", fd_handoff);
+                assert(r < (ssize_t)sizeof(str_handoff));
+
+                argv[4] = "--handoff";
+                argv[5] = str_handoff;
+        }
+
         r = execve(main_arg_broker, (char * const *)argv, environ);
         r = error_origin(-errno);
 
@@ -306,6 +421,12 @@ exit:
 }
 
 static int manager_on_child_exit(sd_event_source *source, const siginfo_t *si, void *userdata) {
+        Manager *manager = userdata;
+
+        /* a broker that handed over, or failed to take over, is expected to exit */
+        if (si->si_pid != manager->broker_pid)
+                return 0;
+
         if (main_arg_verbose)
                 fprintf(stderr, "Caught SIGCHLD of broker\n");
 
@@ -313,7 +434,7 @@ static int manager_on_child_exit(sd_event_source *source, const siginfo_t *si, v
                              (si->si_code == CLD_EXITED) ? si->si_status : EXIT_FAILURE);
 }
 
-static int manager_fork(Manager *manager, int fd_controller) {
+static int manager_fork(Manager *manager, pid_t *pidp, int fd_controller, int fd_handoff) {
         pid_t pid;
         int r;
 
@@ -322,12 +443,188 @@ static int manager_fork(Manager *manager, int fd_controller) {
                 return error_origin(-errno);
 
         if (!pid)
-                manager_run_child(manager, fd_controller);
+                manager_run_child(manager, fd_controller, fd_handoff);
 
         r = sd_event_add_child(manager->event, NULL, pid, WEXITED, manager_on_child_exit, manager);
         if (r < 0)
                 return error_origin(-errno);
 
+        close(fd_controller);
+        *pidp = pid;
+        return 0;
+}
+
+static int manager_on_add_bus(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        const sd_bus_error *e;
+
+        if (!sd_bus_message_is_method_error(m, NULL))
+                return 0;
+
+        e = sd_bus_message_get_error(m);
+
+        /* the attaching launcher notices on its own, as its controller hangs up */
+        if (main_arg_verbose)
+                fprintf(stderr, "Broker refused to host bus: %s\n", e->message ?: e->name);
+
+        return 0;
+}
+
+static int manager_on_host(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+        Manager *manager = userdata;
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(sizeof(int))];
+        } control;
+        struct ucred *ucred = NULL;
+        struct cmsghdr *cmsg;
+        char byte;
+        struct iovec iov = {
+                .iov_base = &byte,
+                .iov_len = sizeof(byte),
+        };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+        int r, *fds = NULL, controller_fd = -1;
+        size_t i, n_fds = 0;
+        ssize_t l;
+
+        l = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (l < 0)
+                return (errno == EAGAIN || errno == EINTR) ? 0 : error_origin(-errno);
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET)
+                        continue;
+
+                if (cmsg->cmsg_type == SCM_RIGHTS) {
+                        fds = (int *)CMSG_DATA(cmsg);
+                        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                } else if (cmsg->cmsg_type == SCM_CREDENTIALS &&
+                           cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred))) {
+                        ucred = (struct ucred *)CMSG_DATA(cmsg);
+                }
+        }
+
+        /*
+         * Every request carries exactly one FD, the controller socket of the
+         * new bus. Only the user running this launcher (or root) can attach
+         * buses, anyone else would get to run a bus in this broker process,
+         * accounted on this user. Rejected requests are dropped silently, and
+         * the requester notices as its controller hangs up.
+         */
+        if (n_fds == 1 && !(msg.msg_flags & MSG_CTRUNC) &&
+            ucred && (ucred->uid == getuid() || ucred->uid == 0))
+                controller_fd = fds[0];
+        else if (main_arg_verbose)
+                fprintf(stderr, "Rejected request to host bus\n");
+
+        r = 0;
+        if (controller_fd >= 0)
+                r = sd_bus_call_method_async(manager->bus_controller,
+                                             NULL,
+                                             NULL,
+                                             "/org/bus1/DBus/Broker",
+                                             "org.bus1.DBus.Broker",
+                                             "AddBus",
+                                             manager_on_add_bus,
+                                             manager,
+                                             "h",
+                                             controller_fd);
+
+        /* the message holds its own copy of the FD */
+        for (i = 0; i < n_fds; ++i)
+                close(fds[i]);
+
+        return (r < 0) ? error_origin(r) : 0;
+}
+
+static int manager_host_path(Manager *manager, const char *path) {
+        _c_cleanup_(c_closep) int s = -1;
+        struct sockaddr_un addr = {};
+        int r, one = 1;
+
+        assert(manager->fd_host < 0);
+
+        s = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (s < 0)
+                return error_origin(-errno);
+
+        r = setsockopt(s, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one));
+        if (r < 0)
+                return error_origin(-errno);
+
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path, strlen(path));
+        r = bind(s, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1);
+        if (r < 0)
+                return error_origin(-errno);
+
+        r = sd_event_add_io(manager->event, &manager->host_source, s, EPOLLIN, manager_on_host, manager);
+        if (r < 0)
+                return error_origin(r);
+
+        manager->fd_host = s;
+        s = -1;
+        return 0;
+}
+
+static int manager_attach(Manager *manager, int fd_controller) {
+        _c_cleanup_(c_closep) int s = -1;
+        struct sockaddr_un addr = {};
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        char byte = 0;
+        struct iovec iov = {
+                .iov_base = &byte,
+                .iov_len = sizeof(byte),
+        };
+        struct msghdr msg = {
+                .msg_name = &addr,
+                .msg_namelen = offsetof(struct sockaddr_un, sun_path) + strlen(main_arg_attach) + 1,
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+        ssize_t l;
+
+        /*
+         * Rather than spawning a broker, this hands the controller socket to
+         * the launcher of a running broker, which asks its broker to host a
+         * bus on it via AddBus(). From then on, this launcher controls its bus
+         * exactly as if it had spawned the broker, and exits once the broker
+         * hangs up.
+         */
+
+        s = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (s < 0)
+                return error_origin(-errno);
+
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, main_arg_attach, strlen(main_arg_attach));
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd_controller, sizeof(int));
+
+        l = sendmsg(s, &msg, MSG_NOSIGNAL);
+        if (l < 0) {
+                if (errno != ENOENT && errno != ECONNREFUSED)
+                        return error_origin(-errno);
+
+                fprintf(stderr, "No broker to attach to on '%s'\n", main_arg_attach);
+                return MAIN_FAILED;
+        }
+
         close(fd_controller);
         return 0;
 }
@@ -358,11 +655,75 @@ static int manager_request_activation(Manager *manager, const char *name, const
         return 0;
 }
 
-static int manager_start_transient_unit(Manager *manager, const char *name, char **exec, size_t n_exec) {
+static int manager_reset_name(Manager *manager, Service *service) {
+        _c_cleanup_(c_freep) char *object_path = NULL;
+        int r;
+
+        r = asprintf(&object_path, "/org/bus1/DBus/Name/%s", service->id);
+        if (r < 0)
+                return error_origin(-errno);
+
+        /*
+         * Resetting the name makes the broker drop all messages waiting for
+         * it, and request activation again on the next message. The reply
+         * is of no interest to us, so do not wait for it.
+         */
+        r = sd_bus_call_method_async(manager->bus_controller,
+                                     NULL,
+                                     NULL,
+                                     object_path,
+                                     "org.bus1.DBus.Name",
+                                     "Reset",
+                                     NULL,
+                                     NULL,
+                                     "");
+        if (r < 0)
+                return error_origin(r);
+
+        return 0;
+}
+
+static int manager_on_start_transient_unit(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Service *service = userdata;
+        const sd_bus_error *e;
+        int r;
+
+        service->slot_start = sd_bus_slot_unref(service->slot_start);
+
+        if (!sd_bus_message_is_method_error(m, NULL))
+                return 0;
+
+        e = sd_bus_message_get_error(m);
+
+        /* the unit is still around, so it will pick up the name on its own */
+        if (sd_bus_error_has_name(e, "org.freedesktop.systemd1.UnitExists"))
+                return 0;
+
+        fprintf(stderr, "Activation of '%s' failed: %s\n", service->name, e->message ?: e->name);
+
+        r = manager_reset_name(service->manager, service);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+static int manager_start_transient_unit(Manager *manager, Service *service) {
         _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *method_call = NULL;
         _c_cleanup_(c_freep) char *unit = NULL;
+        const char *name = service->name;
+        char **exec = service->exec;
+        size_t n_exec = service->n_exec;
         int r;
 
+        /*
+         * A start job of this service is still in flight. Its reply will
+         * either claim the name, or reset it, so there is no need to queue
+         * another job behind it.
+         */
+        if (service->slot_start)
+                return 0;
+
         if (main_arg_verbose)
                 fprintf(stderr, "Activation request for '%s'\n", name);
 
@@ -462,7 +823,13 @@ static int manager_start_transient_unit(Manager *manager, const char *name, char
         if (r < 0)
                 return error_origin(r);
 
-        r = sd_bus_send(manager->bus_regular, method_call, NULL);
+        /*
+         * Never block on the reply. The job is queued on the bus and its
+         * completion tracked via @service->slot_start, so requests for any
+         * number of services can be in flight at once.
+         */
+        r = sd_bus_call_async(manager->bus_regular, &service->slot_start, method_call,
+                              manager_on_start_transient_unit, service, 0);
         if (r < 0)
                 return error_origin(r);
 
@@ -491,7 +858,7 @@ static int manager_on_name_activate(Manager *manager, sd_bus_message *m, const c
                 if (r)
                         return error_trace(r);
         } else {
-                r = manager_start_transient_unit(manager, service->name, service->exec, service->n_exec);
+                r = manager_start_transient_unit(manager, service);
                 if (r)
                         return error_trace(r);
         }
@@ -572,13 +939,16 @@ static int manager_on_message(sd_bus_message *m, void *userdata, sd_bus_error *e
         return error_trace(r);
 }
 
-static int manager_load_service(Manager *manager, const char *path) {
-        gchar *name = NULL, *user = NULL, *unit = NULL, **exec = NULL;
-        gsize n_exec = 0;
-        _c_cleanup_(service_freep) Service *service = NULL;
-        _c_cleanup_(c_freep) char *object_path = NULL;
+static void service_file_deinit(ServiceFile *file) {
+        g_strfreev(file->exec);
+        g_free(file->unit);
+        g_free(file->name);
+        free(file->path);
+        *file = (ServiceFile){};
+}
+
+static void service_file_parse(ServiceFile *file) {
         GKeyFile *f;
-        int r;
 
         /*
          * There seems to be no trivial way to properly parse D-Bus service
@@ -587,186 +957,582 @@ static int manager_load_service(Manager *manager, const char *path) {
          *
          * Preferably, we'd not have the glib dependency here, but it does not
          * hurt much either. If anyone cares, feel free to provide `c-ini'.
+         *
+         * Note that this might be called on parallel threads, hence it must
+         * not touch any shared state.
          */
 
         if (main_arg_verbose)
-                fprintf(stderr, "Loading service '%s'\n", path);
+                fprintf(stderr, "Loading service '%s'\n", file->path);
 
         f = g_key_file_new();
 
-        if (!g_key_file_load_from_file(f, path, G_KEY_FILE_NONE, NULL)) {
-                fprintf(stderr, "Cannot load service file '%s'\n", path);
-                r = 0;
+        if (!g_key_file_load_from_file(f, file->path, G_KEY_FILE_NONE, NULL)) {
+                fprintf(stderr, "Cannot load service file '%s'\n", file->path);
                 goto exit;
         }
 
-        name = g_key_file_get_string(f, "D-BUS Service", "Name", NULL);
-        user = g_key_file_get_string(f, "D-BUS Service", "User", NULL);
-        unit = g_key_file_get_string(f, "D-BUS Service", "SystemdService", NULL);
+        file->name = g_key_file_get_string(f, "D-BUS Service", "Name", NULL);
+        file->unit = g_key_file_get_string(f, "D-BUS Service", "SystemdService", NULL);
 
         g_key_file_set_list_separator(f, ' ');
-        exec = g_key_file_get_string_list(f, "D-BUS Service", "Exec", &n_exec, NULL);
-
-        if (!name) {
-                fprintf(stderr, "Missing name in service file '%s'\n", path);
-                r = 0;
-                goto exit;
-        }
-
-        if (!unit && !exec) {
-                fprintf(stderr, "Missing exec or unit in service file '%s'\n", path);
-                r = 0;
-                goto exit;
-        }
+        file->exec = g_key_file_get_string_list(f, "D-BUS Service", "Exec", &file->n_exec, NULL);
 
-        /*
-         * XXX: @user is unused so far, and we pass `0' as uid to dbus-broker.
-         *      Preferably, we would resolve @user to a uid, but we also do not
-         *      want to call into NSS..
-         *      For now, using 'root' seems good enough.
-         */
-
-        r = service_new(&service, manager, name, unit, exec, n_exec);
-        if (r) {
-                r = error_trace(r);
-                goto exit;
-        }
-
-        r = asprintf(&object_path, "/org/bus1/DBus/Name/%s", service->id);
-        if (r < 0) {
-                r = error_origin(-ENOMEM);
+        if (!file->name) {
+                fprintf(stderr, "Missing name in service file '%s'\n", file->path);
                 goto exit;
         }
 
-        r = sd_bus_call_method(manager->bus_controller,
-                               NULL,
-                               "/org/bus1/DBus/Broker",
-                               "org.bus1.DBus.Broker",
-                               "AddName",
-                               NULL,
-                               NULL,
-                               "osu",
-                               object_path,
-                               service->name,
-                               0);
-        if (r < 0) {
-                r = error_origin(r);
+        if (!file->unit && !file->exec) {
+                fprintf(stderr, "Missing exec or unit in service file '%s'\n", file->path);
+                g_free(file->name);
+                file->name = NULL;
                 goto exit;
         }
 
-        service = NULL;
-        r = 0;
-
 exit:
-        g_free(unit);
-        g_free(user);
-        g_free(name);
-        g_strfreev(exec);
         g_key_file_free(f);
-        return r;
 }
 
-static int manager_load_services(Manager *manager) {
-        const char suffix[] = ".service";
-        _c_cleanup_(c_closedirp) DIR *dir = NULL;
-        const char *dirpath;
-        struct dirent *de;
-        char *path;
-        size_t n;
-        int r;
-
-        if (main_arg_servicedir)
-                dirpath = main_arg_servicedir;
-        else if (!strcmp(main_arg_scope, "user"))
-                dirpath = "/usr/share/dbus-1/services";
-        else if (!strcmp(main_arg_scope, "system"))
-                dirpath = "/usr/share/dbus-1/system-services";
-        else
-                return error_origin(-ENOTRECOVERABLE);
+static void service_scan_deinit(ServiceScan *scan) {
+        size_t i;
 
-        dir = opendir(dirpath);
-        if (!dir) {
-                if (errno == ENOENT || errno == ENOTDIR)
-                        return 0;
-                else
-                        return error_origin(-errno);
-        }
+        for (i = 0; i < scan->n_files; ++i)
+                service_file_deinit(&scan->files[i]);
+        free(scan->files);
+        *scan = (ServiceScan)SERVICE_SCAN_NULL;
+}
 
-        for (errno = 0, de = readdir(dir);
-             de;
-             errno = 0, de = readdir(dir)) {
-                if (de->d_name[0] == '.')
-                        continue;
+C_DEFINE_CLEANUP(ServiceScan *, service_scan_deinit);
 
-                n = strlen(de->d_name);
-                if (n <= strlen(suffix))
-                        continue;
-                if (strcmp(de->d_name + n - strlen(suffix), suffix))
-                        continue;
+static int service_scan_add(ServiceScan *scan, char *path, const struct stat *st) {
+        ServiceFile *files;
+        size_t n;
 
-                r = asprintf(&path, "%s/%s", dirpath, de->d_name);
-                if (r < 0)
+        if (scan->n_files >= scan->n_files_max) {
+                n = c_max(scan->n_files_max * 2, (size_t)MAIN_SERVICE_FILES_PER_THREAD);
+                files = realloc(scan->files, n * sizeof(*files));
+                if (!files)
                         return error_origin(-ENOMEM);
 
-                r = manager_load_service(manager, path);
-                free(path);
-                if (r)
-                        return error_trace(r);
+                scan->files = files;
+                scan->n_files_max = n;
         }
-        if (errno > 0)
-                return error_origin(-errno);
 
+        /* consumes @path */
+        scan->files[scan->n_files++] = (ServiceFile){ .path = path, .st = *st };
         return 0;
 }
 
-static int manager_add_listener(Manager *manager) {
-        _c_cleanup_(config_parser_deinit) ConfigParser parser = CONFIG_PARSER_NULL(parser);
-        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
-        _c_cleanup_(config_root_freep) ConfigRoot *root = NULL;
-        _c_cleanup_(policy_deinit) Policy policy = POLICY_INIT(policy);
-        const char *policypath;
-        int r;
+static void *service_scan_thread(void *userdata) {
+        ServiceScan *scan = userdata;
+        size_t i;
 
-        if (main_arg_policypath)
-                policypath = main_arg_policypath;
-        else if (!strcmp(main_arg_scope, "user"))
-                policypath = "/usr/share/dbus-1/session.conf";
-        else if (!strcmp(main_arg_scope, "system"))
-                policypath = "/usr/share/dbus-1/system.conf";
-        else
-                return error_origin(-ENOTRECOVERABLE);
+        while ((i = atomic_fetch_add_explicit(&scan->i_next, 1, memory_order_relaxed)) < scan->n_files)
+                service_file_parse(&scan->files[i]);
 
-        config_parser_init(&parser);
+        return NULL;
+}
 
-        r = config_parser_read(&parser, &root, policypath);
-        if (r)
-                return error_fold(r);
+static void service_scan_parse(ServiceScan *scan) {
+        pthread_t threads[MAIN_SERVICE_THREADS_MAX];
+        size_t i, n_threads;
 
-        r = policy_import(&policy, root);
-        if (r)
+        /*
+         * Service files are parsed independently of each other, so large
+         * directories are split across a small set of threads. The calling
+         * thread takes part as well, so if threads cannot be spawned we just
+         * end up parsing everything here.
+         */
+        atomic_init(&scan->i_next, 0);
+        n_threads = c_min(scan->n_files / MAIN_SERVICE_FILES_PER_THREAD, C_ARRAY_SIZE(threads));
+
+        for (i = 0; i < n_threads; ++i)
+                if (pthread_create(&threads[i], NULL, service_scan_thread, scan))
+                        break;
+
+        n_threads = i;
+        service_scan_thread(scan);
+
+        for (i = 0; i < n_threads; ++i)
+                pthread_join(threads[i], NULL);
+}
+
+static int manager_add_services(Manager *manager, ServiceScan *scan) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        char object_path[sizeof("/org/bus1/DBus/Name/") + C_DECIMAL_MAX(uint64_t)];
+        Service *service;
+        size_t i, n_services = 0;
+        int r;
+
+        /*
+         * XXX: The User= key is unused so far, and we pass `0' as uid to
+         *      dbus-broker. Preferably, we would resolve it to a uid, but we
+         *      also do not want to call into NSS..
+         *      For now, using 'root' seems good enough.
+         */
+
+        r = sd_bus_message_new_method_call(manager->bus_controller,
+                                           &m,
+                                           NULL,
+                                           "/org/bus1/DBus/Broker",
+                                           "org.bus1.DBus.Broker",
+                                           "AddNames");
+        if (r < 0)
+                return error_origin(r);
+
+        r = sd_bus_message_open_container(m, 'a', "(osu)");
+        if (r < 0)
+                return error_origin(r);
+
+        for (i = 0; i < scan->n_files; ++i) {
+                if (!scan->files[i].name)
+                        continue;
+
+                r = service_new(&service, manager, &scan->files[i]);
+                if (r)
+                        return error_trace(r);
+
+                sprintf(object_path, "/org/bus1/DBus/Name/%s", service->id);
+
+                r = sd_bus_message_append(m, "(osu)", object_path, service->name, 0);
+                if (r < 0) {
+                        service_free(service);
+                        return error_origin(r);
+                }
+
+                ++n_services;
+        }
+
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return error_origin(r);
+
+        /* all names are registered with a single round-trip */
+        if (n_services) {
+                r = sd_bus_call(manager->bus_controller, m, 0, NULL, NULL);
+                if (r < 0)
+                        return error_origin(r);
+        }
+
+        return 0;
+}
+
+static int manager_remove_service(Manager *manager, Service *service) {
+        _c_cleanup_(c_freep) char *object_path = NULL;
+        int r;
+
+        if (main_arg_verbose)
+                fprintf(stderr, "Removing service '%s'\n", service->path);
+
+        r = asprintf(&object_path, "/org/bus1/DBus/Name/%s", service->id);
+        if (r < 0)
+                return error_origin(-ENOMEM);
+
+        r = sd_bus_call_method(manager->bus_controller,
+                               NULL,
+                               object_path,
+                               "org.bus1.DBus.Name",
+                               "Release",
+                               NULL,
+                               NULL,
+                               "");
+        if (r < 0)
+                return error_origin(r);
+
+        service_free(service);
+        return 0;
+}
+
+static int manager_load_services(Manager *manager) {
+        const char suffix[] = ".service";
+        _c_cleanup_(service_scan_deinit) ServiceScan scan = SERVICE_SCAN_NULL;
+        _c_cleanup_(c_closedirp) DIR *dir = NULL;
+        Service *service, *safe;
+        struct stat st_dir = {}, st;
+        const char *dirpath;
+        struct dirent *de;
+        char *path;
+        size_t n;
+        int r;
+
+        if (main_arg_servicedir)
+                dirpath = main_arg_servicedir;
+        else if (!strcmp(main_arg_scope, "user"))
+                dirpath = "/usr/share/dbus-1/services";
+        else if (!strcmp(main_arg_scope, "system"))
+                dirpath = "/usr/share/dbus-1/system-services";
+        else
+                return error_origin(-ENOTRECOVERABLE);
+
+        dir = opendir(dirpath);
+        if (!dir) {
+                if (errno != ENOENT && errno != ENOTDIR)
+                        return error_origin(-errno);
+        } else {
+                r = fstat(dirfd(dir), &st_dir);
+                if (r < 0)
+                        return error_origin(-errno);
+        }
+
+        /*
+         * Service files are installed and removed by renaming them into
+         * place, which always changes the directory. So if the directory is
+         * unchanged since the last scan, there is nothing to do. Otherwise,
+         * only files that changed since are parsed again.
+         */
+        if (manager->servicedir_loaded && service_stat_equal(&manager->servicedir_st, &st_dir))
+                return 0;
+
+        c_rbtree_for_each_entry(service, &manager->service_paths, rb_path)
+                service->seen = false;
+
+        for (errno = 0, de = dir ? readdir(dir) : NULL;
+             de;
+             errno = 0, de = readdir(dir)) {
+                if (de->d_name[0] == '.')
+                        continue;
+
+                n = strlen(de->d_name);
+                if (n <= strlen(suffix))
+                        continue;
+                if (strcmp(de->d_name + n - strlen(suffix), suffix))
+                        continue;
+
+                r = fstatat(dirfd(dir), de->d_name, &st, 0);
+                if (r < 0) {
+                        if (errno == ENOENT)
+                                continue;
+
+                        return error_origin(-errno);
+                }
+
+                r = asprintf(&path, "%s/%s", dirpath, de->d_name);
+                if (r < 0)
+                        return error_origin(-ENOMEM);
+
+                service = c_rbtree_find_entry(&manager->service_paths,
+                                              service_compare_path,
+                                              path,
+                                              Service,
+                                              rb_path);
+                if (service && service_stat_equal(&service->st, &st)) {
+                        service->seen = true;
+                        free(path);
+                        continue;
+                }
+
+                r = service_scan_add(&scan, path, &st);
+                if (r) {
+                        free(path);
+                        return error_trace(r);
+                }
+        }
+        if (errno > 0)
+                return error_origin(-errno);
+
+        service_scan_parse(&scan);
+
+        /* release names of removed and changed files, before re-adding them */
+        c_rbtree_for_each_entry_safe(service, safe, &manager->service_paths, rb_path) {
+                if (service->seen)
+                        continue;
+
+                r = manager_remove_service(manager, service);
+                if (r)
+                        return error_trace(r);
+        }
+
+        r = manager_add_services(manager, &scan);
+        if (r)
+                return error_trace(r);
+
+        manager->servicedir_st = st_dir;
+        manager->servicedir_loaded = true;
+        return 0;
+}
+
+static const char *manager_get_policypath(void) {
+        if (main_arg_policypath)
+                return main_arg_policypath;
+        else if (!strcmp(main_arg_scope, "user"))
+                return "/usr/share/dbus-1/session.conf";
+        else if (!strcmp(main_arg_scope, "system"))
+                return "/usr/share/dbus-1/system.conf";
+        else
+                return NULL;
+}
+
+static int manager_read_policy(Policy *policy, const char *policypath, const char *key) {
+        _c_cleanup_(config_parser_deinit) ConfigParser parser = CONFIG_PARSER_NULL(parser);
+        _c_cleanup_(config_root_freep) ConfigRoot *root = NULL;
+        _c_cleanup_(c_freep) char *data = NULL;
+        size_t n_data;
+        int r;
+
+        config_parser_init(&parser);
+
+        r = config_parser_read(&parser, &root, policypath);
+        if (r)
+                return error_trace(r);
+
+        r = policy_import(policy, root);
+        if (r)
+                return error_trace(r);
+
+        policy_optimize(policy);
+
+        if (!main_arg_policycache)
+                return 0;
+
+        /*
+         * The cache is an optimization only. If it cannot be written, we
+         * simply parse the configuration again on the next start.
+         */
+        r = policy_save(policy, &data, &n_data);
+        if (r)
+                return error_trace(r);
+
+        r = cache_write(main_arg_policycache, key, root, data, n_data);
+        if (r < 0)
                 return error_fold(r);
+        else if (r > 0 && main_arg_verbose)
+                fprintf(stderr, "Cannot write policy cache '%s'\n", main_arg_policycache);
 
-        policy_optimize(&policy);
+        return 0;
+}
+
+static int manager_stage_policy(Manager *manager, Policy *policy, PolicyCursor *cursor, bool first) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(manager->bus_controller,
+                                           &m,
+                                           NULL,
+                                           "/org/bus1/DBus/Listener/0",
+                                           "org.bus1.DBus.Listener",
+                                           "StagePolicy");
+        if (r < 0)
+                return error_origin(r);
+
+        r = sd_bus_message_append(m, "b", first);
+        if (r < 0)
+                return error_origin(r);
+
+        r = policy_export_nodes(policy, cursor, m);
+        if (r)
+                return error_fold(r);
+
+        r = sd_bus_call(manager->bus_controller, m, 0, NULL, NULL);
+        if (r < 0)
+                return error_origin(r);
+
+        return 0;
+}
+
+static int manager_append_policy(Manager *manager, sd_bus_message *m, const char *policypath) {
+        _c_cleanup_(cache_deinit) Cache cache = CACHE_NULL(cache);
+        _c_cleanup_(policy_deinit) Policy policy = POLICY_INIT(policy);
+        _c_cleanup_(c_freep) char *key = NULL;
+        PolicyCursor cursor;
+        bool first = true;
+        int r;
+
+        if (main_arg_policycache) {
+                /* the cached policy depends on the calling user and the selinux state */
+                r = asprintf(&key, "uid=%u selinux=%s path=%s",
+                             (unsigned int)getuid(),
+                             bus_selinux_is_enabled() ? (bus_selinux_policy_root() ?: "") : "-",
+                             policypath);
+                if (r < 0)
+                        return error_origin(-ENOMEM);
+
+                /* any cache that cannot be used is ignored, and the policy compiled anew */
+                r = cache_map(&cache, main_arg_policycache, key);
+                if (!r) {
+                        /* the policy refers to strings in the mapped cache */
+                        r = policy_load(&policy, cache.data, cache.n_data);
+                        if (r < 0) {
+                                return error_fold(r);
+                        } else if (r) {
+                                policy_deinit(&policy);
+                                policy_init(&policy);
+                                cache_deinit(&cache);
+                        }
+                }
+        }
+
+        if (!cache.map) {
+                r = manager_read_policy(&policy, policypath, key);
+                if (r)
+                        return error_trace(r);
+        }
+
+        /*
+         * The uid and gid entries are staged on the listener in parts, so no
+         * single message grows without bound even for huge policies. The
+         * remainder is carried by @m, which then puts the policy into effect
+         * as a whole. At least one part is always staged, since the first
+         * part drops anything left over from an earlier transfer that failed
+         * halfway.
+         */
+        policy_cursor_init(&cursor, &policy);
+        do {
+                r = manager_stage_policy(manager, &policy, &cursor, first);
+                if (r)
+                        return error_trace(r);
+
+                first = false;
+        } while (cursor.n_nodes > POLICY_EXPORT_NODES_MAX);
+
+        r = policy_export(&policy, &cursor, m);
+        if (r)
+                return error_fold(r);
+
+        return 0;
+}
+
+static int manager_add_listener(Manager *manager) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        int r;
+
+        /*
+         * The listener is added without a policy, which is only set once it
+         * was compiled, see manager_reload_policy(). Until then, the broker
+         * accepts and authenticates connections, but holds them back.
+         */
 
         r = sd_bus_message_new_method_call(manager->bus_controller,
                                            &m,
                                            NULL,
                                            "/org/bus1/DBus/Broker",
                                            "org.bus1.DBus.Broker",
-                                           "AddListener");
+                                           "AddPendingListener");
         if (r < 0)
                 return error_origin(r);
 
-        r = sd_bus_message_append(m, "ohs",
+        r = sd_bus_message_append(m, "oh",
                                   "/org/bus1/DBus/Listener/0",
-                                  manager->fd_listen,
-                                  policypath);
+                                  manager->fd_listen);
         if (r < 0)
                 return error_origin(r);
 
-        r = policy_export(&policy, m);
+        r = sd_bus_call(manager->bus_controller, m, 0, NULL, NULL);
+        if (r < 0)
+                return error_origin(r);
+
+        return 0;
+}
+
+static int manager_reload_policy(Manager *manager) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        const char *policypath;
+        int r;
+
+        policypath = manager_get_policypath();
+        if (!policypath)
+                return error_origin(-ENOTRECOVERABLE);
+
+        r = sd_bus_message_new_method_call(manager->bus_controller,
+                                           &m,
+                                           NULL,
+                                           "/org/bus1/DBus/Listener/0",
+                                           "org.bus1.DBus.Listener",
+                                           "SetPolicy");
+        if (r < 0)
+                return error_origin(r);
+
+        /* a broken configuration must not take down a running bus */
+        r = manager_append_policy(manager, m, policypath);
         if (r)
-                return error_fold(r);
+                return error_trace(r);
+
+        r = sd_bus_call(manager->bus_controller, m, 0, NULL, NULL);
+        if (r < 0)
+                return error_origin(r);
+
+        return 0;
+}
+
+static int manager_on_sighup(sd_event_source *source, const struct signalfd_siginfo *si, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        if (main_arg_verbose)
+                fprintf(stderr, "Caught SIGHUP, reloading policy and services\n");
+
+        /*
+         * A reload must never take down a running bus. Whether the
+         * configuration is broken, or the broker rejects the new policy, the
+         * broker keeps the previous one in place, so any failure is merely
+         * logged.
+         */
+        r = manager_reload_policy(manager);
+        if (r)
+                fprintf(stderr, "Cannot reload policy, keeping the previous one\n");
+
+        r = manager_load_services(manager);
+        if (r)
+                return sd_event_exit(sd_event_source_get_event(source), error_fold(r));
+
+        return 0;
+}
+
+static int manager_set_priorities(Manager *manager) {
+        size_t i;
+        int r;
+
+        for (i = 0; i < main_arg_n_critical_uids; ++i) {
+                r = sd_bus_call_method(manager->bus_controller,
+                                       NULL,
+                                       "/org/bus1/DBus/Broker",
+                                       "org.bus1.DBus.Broker",
+                                       "SetUserPriority",
+                                       NULL,
+                                       NULL,
+                                       "uu",
+                                       main_arg_critical_uids[i],
+                                       1);
+                if (r < 0)
+                        return error_origin(r);
+        }
+
+        return 0;
+}
+
+static int manager_add_known_services(Manager *manager) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        char object_path[sizeof("/org/bus1/DBus/Name/") + C_DECIMAL_MAX(uint64_t)];
+        Service *service;
+        int r;
+
+        if (!c_rbtree_first(&manager->services))
+                return 0;
+
+        r = sd_bus_message_new_method_call(manager->bus_controller,
+                                           &m,
+                                           NULL,
+                                           "/org/bus1/DBus/Broker",
+                                           "org.bus1.DBus.Broker",
+                                           "AddNames");
+        if (r < 0)
+                return error_origin(r);
+
+        r = sd_bus_message_open_container(m, 'a', "(osu)");
+        if (r < 0)
+                return error_origin(r);
+
+        c_rbtree_for_each_entry(service, &manager->services, rb) {
+                sprintf(object_path, "/org/bus1/DBus/Name/%s", service->id);
+
+                r = sd_bus_message_append(m, "(osu)", object_path, service->name, 0);
+                if (r < 0)
+                        return error_origin(r);
+        }
+
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return error_origin(r);
 
         r = sd_bus_call(manager->bus_controller, m, 0, NULL, NULL);
         if (r < 0)
@@ -775,6 +1541,141 @@ static int manager_add_listener(Manager *manager) {
         return 0;
 }
 
+static int manager_handoff(Manager *manager, sd_bus *bus_successor, int fd_handoff) {
+        _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus *bus_predecessor = manager->bus_controller;
+        int r;
+
+        /*
+         * The successor is configured exactly like the running broker, using
+         * the same requests as on startup, just sent to the successor. Only
+         * then the running broker is told to hand over its connections. Any
+         * failure on the way leaves the running broker untouched, so an
+         * upgrade can never take down the bus.
+         */
+        manager->bus_controller = bus_successor;
+
+        r = sd_bus_add_filter(bus_successor, NULL, manager_on_message, manager);
+        if (r >= 0)
+                r = sd_bus_start(bus_successor);
+        if (r >= 0)
+                r = manager_set_priorities(manager);
+        if (!r)
+                r = manager_add_listener(manager);
+        if (!r)
+                r = manager_add_known_services(manager);
+        if (!r)
+                r = manager_reload_policy(manager);
+
+        manager->bus_controller = bus_predecessor;
+
+        if (r) {
+                if (main_arg_verbose)
+                        fprintf(stderr, "Cannot configure successor broker: %d\n", r);
+                return MAIN_FAILED;
+        }
+
+        r = sd_bus_call_method(bus_predecessor,
+                               NULL,
+                               "/org/bus1/DBus/Broker",
+                               "org.bus1.DBus.Broker",
+                               "Handoff",
+                               &error,
+                               NULL,
+                               "h",
+                               fd_handoff);
+        if (r < 0) {
+                if (main_arg_verbose)
+                        fprintf(stderr, "Broker refused handoff: %s\n", error.name ?: "-");
+                return MAIN_FAILED;
+        }
+
+        return 0;
+}
+
+static int manager_upgrade(Manager *manager) {
+        _c_cleanup_(bus_close_unrefp) sd_bus *bus_successor = NULL;
+        _c_cleanup_(c_closep) int fd_handoff = -1;
+        int r, controller[2], handoff[2];
+        pid_t pid;
+
+        /* an attached bus has no broker of its own to replace */
+        if (main_arg_attach) {
+                if (main_arg_verbose)
+                        fprintf(stderr, "Cannot upgrade the broker of an attached bus\n");
+                return MAIN_FAILED;
+        }
+
+        r = sd_bus_new(&bus_successor);
+        if (r < 0)
+                return error_origin(r);
+
+        r = socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, handoff);
+        if (r < 0)
+                return error_origin(-errno);
+
+        fd_handoff = handoff[0];
+
+        r = socketpair(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, controller);
+        if (r < 0) {
+                close(handoff[1]);
+                return error_origin(-errno);
+        }
+
+        /* consumes FD controller[0] */
+        r = sd_bus_set_fd(bus_successor, controller[0], controller[0]);
+        if (r < 0) {
+                close(controller[0]);
+                close(controller[1]);
+                close(handoff[1]);
+                return error_origin(r);
+        }
+
+        /* consumes FD controller[1] */
+        r = manager_fork(manager, &pid, controller[1], handoff[1]);
+        close(handoff[1]);
+        if (r) {
+                close(controller[1]);
+                return error_trace(r);
+        }
+
+        r = manager_handoff(manager, bus_successor, fd_handoff);
+        if (r) {
+                kill(pid, SIGTERM);
+                return error_trace(r);
+        }
+
+        r = sd_bus_attach_event(bus_successor, manager->event, SD_EVENT_PRIORITY_NORMAL);
+        if (r < 0) {
+                kill(pid, SIGTERM);
+                return error_origin(r);
+        }
+
+        /* the predecessor is done, and exits once its controller is gone */
+        sd_bus_detach_event(manager->bus_controller);
+        bus_close_unref(manager->bus_controller);
+        manager->bus_controller = bus_successor;
+        manager->broker_pid = pid;
+        bus_successor = NULL;
+        return 0;
+}
+
+static int manager_on_sigusr2(sd_event_source *source, const struct signalfd_siginfo *si, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        if (main_arg_verbose)
+                fprintf(stderr, "Caught SIGUSR2, upgrading broker\n");
+
+        r = manager_upgrade(manager);
+        if (r < 0)
+                return sd_event_exit(sd_event_source_get_event(source), error_trace(r));
+        else if (r > 0 && main_arg_verbose)
+                fprintf(stderr, "Cannot upgrade broker, keeping the running one\n");
+
+        return 0;
+}
+
 static int manager_connect(Manager *manager) {
         _c_cleanup_(bus_close_unrefp) sd_bus *b = NULL;
         _c_cleanup_(c_closep) int s = -1;
@@ -837,12 +1738,22 @@ static int manager_run(Manager *manager) {
         }
 
         /* consumes FD controller[1] */
-        r = manager_fork(manager, controller[1]);
+        if (main_arg_attach)
+                r = manager_attach(manager, controller[1]);
+        else
+                r = manager_fork(manager, &manager->broker_pid, controller[1], -1);
         if (r) {
                 close(controller[1]);
                 return error_trace(r);
         }
 
+        /* without a child, the hangup of the controller is the only sign of the broker exiting */
+        if (main_arg_attach) {
+                r = sd_bus_set_exit_on_disconnect(manager->bus_controller, true);
+                if (r < 0)
+                        return error_origin(r);
+        }
+
         r = sd_bus_add_filter(manager->bus_controller, NULL, manager_on_message, manager);
         if (r < 0)
                 return error_origin(r);
@@ -851,7 +1762,7 @@ static int manager_run(Manager *manager) {
         if (r < 0)
                 return error_origin(r);
 
-        r = manager_load_services(manager);
+        r = manager_set_priorities(manager);
         if (r)
                 return error_trace(r);
 
@@ -859,6 +1770,15 @@ static int manager_run(Manager *manager) {
         if (r)
                 return error_trace(r);
 
+        r = manager_load_services(manager);
+        if (r)
+                return error_trace(r);
+
+        /* unlike on reload, a broken configuration is fatal on startup */
+        r = manager_reload_policy(manager);
+        if (r)
+                return error_fold(r);
+
         r = manager_connect(manager);
         if (r)
                 return error_trace(r);
@@ -889,6 +1809,14 @@ static void help(void) {
                "     --listen PATH      Specify path of listener socket\n"
                "  -f --force            Ignore existing listener sockets\n"
                "     --scope SCOPE      Scope of message bus\n"
+               "     --critical-uid UID Dispatch peers of UID with priority\n"
+               "     --policy-cache PATH\n"
+               "                        Cache the compiled policy at PATH\n"
+               "     --host PATH        Host buses of attaching launchers\n"
+               "     --attach PATH      Attach to the broker hosting on PATH\n"
+               "\n"
+               "Send SIGHUP to reload the configuration, and SIGUSR2 to\n"
+               "replace the broker without dropping any connection.\n"
                , program_invocation_short_name);
 }
 
@@ -897,6 +1825,10 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_VERSION = 0x100,
                 ARG_LISTEN,
                 ARG_SCOPE,
+                ARG_CRITICAL_UID,
+                ARG_POLICY_CACHE,
+                ARG_HOST,
+                ARG_ATTACH,
         };
         static const struct option options[] = {
                 { "help",               no_argument,            NULL,   'h'                     },
@@ -905,8 +1837,14 @@ static int parse_argv(int argc, char *argv[]) {
                 { "listen",             required_argument,      NULL,   ARG_LISTEN              },
                 { "force",              no_argument,            NULL,   'f'                     },
                 { "scope",              required_argument,      NULL,   ARG_SCOPE               },
+                { "critical-uid",       required_argument,      NULL,   ARG_CRITICAL_UID        },
+                { "policy-cache",       required_argument,      NULL,   ARG_POLICY_CACHE        },
+                { "host",               required_argument,      NULL,   ARG_HOST                },
+                { "attach",             required_argument,      NULL,   ARG_ATTACH              },
                 {}
         };
+        unsigned long uid;
+        char *end;
         int c;
 
         while ((c = getopt_long(argc, argv, "hvf", options, NULL)) >= 0) {
@@ -941,6 +1879,44 @@ static int parse_argv(int argc, char *argv[]) {
                         main_arg_scope = optarg;
                         break;
 
+                case ARG_CRITICAL_UID:
+                        errno = 0;
+                        uid = strtoul(optarg, &end, 10);
+                        if (errno || end == optarg || *end || uid >= (uint32_t)-1) {
+                                fprintf(stderr, "%s: invalid user ID -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        if (main_arg_n_critical_uids >= C_ARRAY_SIZE(main_arg_critical_uids)) {
+                                fprintf(stderr, "%s: too many critical user IDs\n", program_invocation_name);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_critical_uids[main_arg_n_critical_uids++] = uid;
+                        break;
+
+                case ARG_POLICY_CACHE:
+                        main_arg_policycache = optarg;
+                        break;
+
+                case ARG_HOST:
+                        if (optarg[0] != '/') {
+                                fprintf(stderr, "%s: invalid host socket -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_host = optarg;
+                        break;
+
+                case ARG_ATTACH:
+                        if (optarg[0] != '/') {
+                                fprintf(stderr, "%s: invalid attach socket -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_attach = optarg;
+                        break;
+
                 case '?':
                         /* getopt_long() prints warning */
                         return MAIN_FAILED;
@@ -955,6 +1931,11 @@ static int parse_argv(int argc, char *argv[]) {
                 return MAIN_FAILED;
         }
 
+        if (main_arg_host && main_arg_attach) {
+                fprintf(stderr, "%s: cannot both host and attach buses\n", program_invocation_name);
+                return MAIN_FAILED;
+        }
+
         return 0;
 }
 
@@ -1017,9 +1998,24 @@ static int run(void) {
                 return MAIN_FAILED;
         }
 
+        if (main_arg_host) {
+                r = manager_host_path(manager, main_arg_host);
+                if (r) {
+                        if (unlink_path)
+                                unlink(unlink_path);
+                        return error_trace(r);
+                }
+
+                if (main_arg_verbose)
+                        fprintf(stderr, "Hosting buses on socket '%s'\n", main_arg_host);
+        }
+
         r = manager_run(manager);
         r = error_trace(r);
 
+        if (main_arg_host)
+                unlink(main_arg_host);
+
         if (unlink_path) {
                 r = unlink(unlink_path);
                 if (r < 0)
@@ -1045,6 +2041,8 @@ int main(int argc, char **argv) {
         sigaddset(&mask_new, SIGCHLD);
         sigaddset(&mask_new, SIGTERM);
         sigaddset(&mask_new, SIGINT);
+        sigaddset(&mask_new, SIGHUP);
+        sigaddset(&mask_new, SIGUSR2);
 
         sigprocmask(SIG_BLOCK, &mask_new, &mask_old);
         r = run();
@@ -5,7 +5,9 @@
 #include <c-list.h>
 #include <c-macro.h>
 #include <c-rbtree.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <systemd/sd-bus.h>
 #include "dbus/protocol.h"
 #include "launch/config.h"
@@ -863,19 +865,19 @@ static int policy_export_xmit(Policy *policy, CList *list1, CList *list2, sd_bus
                 "a(u(" POLICY_T_BATCH "))"                                      \
                 "a(ss)"
 
-/**
- * policy_export() - XXX
- */
-int policy_export(Policy *policy, sd_bus_message *m) {
-        PolicyNode *node;
-        PolicyRecord *i_record;
+static int policy_export_node(Policy *policy,
+                              PolicyNode *node,
+                              CList *own_default,
+                              CList *send_default,
+                              CList *recv_default,
+                              sd_bus_message *m) {
         int r;
 
-        r = sd_bus_message_open_container(m, 'v', "(" POLICY_T ")");
+        r = sd_bus_message_open_container(m, 'r', "u(" POLICY_T_BATCH ")");
         if (r < 0)
                 return error_origin(r);
 
-        r = sd_bus_message_open_container(m, 'r', POLICY_T);
+        r = sd_bus_message_append(m, "u", node->uidgid);
         if (r < 0)
                 return error_origin(r);
 
@@ -883,10 +885,10 @@ int policy_export(Policy *policy, sd_bus_message *m) {
         if (r < 0)
                 return error_origin(r);
 
-        r = policy_export_connect(policy, &policy->connect_default, NULL, m);
-        r = r ?: policy_export_own(policy, &policy->own_default, NULL, m);
-        r = r ?: policy_export_xmit(policy, &policy->send_default, NULL, m);
-        r = r ?: policy_export_xmit(policy, &policy->recv_default, NULL, m);
+        r = policy_export_connect(policy, &policy->connect_default, &node->connect_list, m);
+        r = r ?: policy_export_own(policy, own_default, &node->own_list, m);
+        r = r ?: policy_export_xmit(policy, send_default, &node->send_list, m);
+        r = r ?: policy_export_xmit(policy, recv_default, &node->recv_list, m);
         if (r)
                 return error_trace(r);
 
@@ -894,80 +896,152 @@ int policy_export(Policy *policy, sd_bus_message *m) {
         if (r < 0)
                 return error_origin(r);
 
-        r = sd_bus_message_open_container(m, 'a', "(u(" POLICY_T_BATCH "))");
+        r = sd_bus_message_close_container(m);
         if (r < 0)
                 return error_origin(r);
 
-        c_rbtree_for_each_entry(node, &policy->uid_tree, policy_node) {
-                r = sd_bus_message_open_container(m, 'r', "u(" POLICY_T_BATCH ")");
-                if (r < 0)
-                        return error_origin(r);
+        return 0;
+}
 
-                r = sd_bus_message_append(m, "u", node->uidgid);
-                if (r < 0)
-                        return error_origin(r);
+static PolicyNode *policy_node_next(PolicyNode *node) {
+        return c_rbnode_entry(c_rbnode_next(&node->policy_node), PolicyNode, policy_node);
+}
 
-                r = sd_bus_message_open_container(m, 'r', POLICY_T_BATCH);
-                if (r < 0)
-                        return error_origin(r);
+static int policy_export_uidgid(Policy *policy, PolicyCursor *cursor, size_t n_max, sd_bus_message *m) {
+        int r;
 
-                r = policy_export_connect(policy, &policy->connect_default, &node->connect_list, m);
-                r = r ?: policy_export_own(policy, &policy->own_default, &node->own_list, m);
-                r = r ?: policy_export_xmit(policy, &policy->send_default, &node->send_list, m);
-                r = r ?: policy_export_xmit(policy, &policy->recv_default, &node->recv_list, m);
+        r = sd_bus_message_open_container(m, 'a', "(u(" POLICY_T_BATCH "))");
+        if (r < 0)
+                return error_origin(r);
+
+        for ( ; cursor->uid && n_max; cursor->uid = policy_node_next(cursor->uid), --n_max, --cursor->n_nodes) {
+                r = policy_export_node(policy,
+                                       cursor->uid,
+                                       &policy->own_default,
+                                       &policy->send_default,
+                                       &policy->recv_default,
+                                       m);
                 if (r)
                         return error_trace(r);
+        }
 
-                r = sd_bus_message_close_container(m);
-                if (r < 0)
-                        return error_origin(r);
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return error_origin(r);
 
-                r = sd_bus_message_close_container(m);
-                if (r < 0)
-                        return error_origin(r);
+        r = sd_bus_message_open_container(m, 'a', "(u(" POLICY_T_BATCH "))");
+        if (r < 0)
+                return error_origin(r);
+
+        for ( ; cursor->gid && n_max; cursor->gid = policy_node_next(cursor->gid), --n_max, --cursor->n_nodes) {
+                /* the defaults are merged into the uid entries only */
+                r = policy_export_node(policy, cursor->gid, NULL, NULL, NULL, m);
+                if (r)
+                        return error_trace(r);
         }
 
         r = sd_bus_message_close_container(m);
         if (r < 0)
                 return error_origin(r);
 
-        r = sd_bus_message_open_container(m, 'a', "(u(" POLICY_T_BATCH "))");
+        return 0;
+}
+
+/**
+ * policy_cursor_init() - initialize export cursor
+ * @cursor:             cursor to operate on
+ * @policy:             policy to export
+ *
+ * This initializes @cursor to point at the first uid and gid entries of
+ * @policy, to be used with policy_export_nodes() and policy_export(). The
+ * cursor is only valid as long as @policy is not modified.
+ */
+void policy_cursor_init(PolicyCursor *cursor, Policy *policy) {
+        PolicyNode *i_node;
+
+        *cursor = (PolicyCursor)POLICY_CURSOR_NULL;
+        cursor->uid = c_rbnode_entry(c_rbtree_first(&policy->uid_tree), PolicyNode, policy_node);
+        cursor->gid = c_rbnode_entry(c_rbtree_first(&policy->gid_tree), PolicyNode, policy_node);
+
+        c_rbtree_for_each_entry(i_node, &policy->uid_tree, policy_node)
+                ++cursor->n_nodes;
+        c_rbtree_for_each_entry(i_node, &policy->gid_tree, policy_node)
+                ++cursor->n_nodes;
+}
+
+/**
+ * policy_export_nodes() - export part of the uid and gid entries
+ * @policy:             policy to export
+ * @cursor:             cursor to advance
+ * @m:                  message to append to
+ *
+ * This appends up to POLICY_EXPORT_NODES_MAX uid and gid entries of @policy
+ * to @m, starting at @cursor, and advances @cursor past them. The broker
+ * stages them on the listener via StagePolicy(), so huge policies do not
+ * have to fit into a single message.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int policy_export_nodes(Policy *policy, PolicyCursor *cursor, sd_bus_message *m) {
+        int r;
+
+        r = sd_bus_message_open_container(m, 'v', "(a(u(" POLICY_T_BATCH "))a(u(" POLICY_T_BATCH ")))");
         if (r < 0)
                 return error_origin(r);
 
-        c_rbtree_for_each_entry(node, &policy->gid_tree, policy_node) {
-                r = sd_bus_message_open_container(m, 'r', "u(" POLICY_T_BATCH ")");
-                if (r < 0)
-                        return error_origin(r);
+        r = sd_bus_message_open_container(m, 'r', "a(u(" POLICY_T_BATCH "))a(u(" POLICY_T_BATCH "))");
+        if (r < 0)
+                return error_origin(r);
 
-                r = sd_bus_message_append(m, "u", node->uidgid);
-                if (r < 0)
-                        return error_origin(r);
+        r = policy_export_uidgid(policy, cursor, POLICY_EXPORT_NODES_MAX, m);
+        if (r)
+                return error_trace(r);
 
-                r = sd_bus_message_open_container(m, 'r', POLICY_T_BATCH);
-                if (r < 0)
-                        return error_origin(r);
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return error_origin(r);
 
-                r = policy_export_connect(policy, &policy->connect_default, &node->connect_list, m);
-                r = r ?: policy_export_own(policy, NULL, &node->own_list, m);
-                r = r ?: policy_export_xmit(policy, NULL, &node->send_list, m);
-                r = r ?: policy_export_xmit(policy, NULL, &node->recv_list, m);
-                if (r)
-                        return error_trace(r);
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return error_origin(r);
 
-                r = sd_bus_message_close_container(m);
-                if (r < 0)
-                        return error_origin(r);
+        return 0;
+}
 
-                r = sd_bus_message_close_container(m);
-                if (r < 0)
-                        return error_origin(r);
-        }
+/**
+ * policy_export() - XXX
+ */
+int policy_export(Policy *policy, PolicyCursor *cursor, sd_bus_message *m) {
+        PolicyRecord *i_record;
+        int r;
+
+        r = sd_bus_message_open_container(m, 'v', "(" POLICY_T ")");
+        if (r < 0)
+                return error_origin(r);
+
+        r = sd_bus_message_open_container(m, 'r', POLICY_T);
+        if (r < 0)
+                return error_origin(r);
+
+        r = sd_bus_message_open_container(m, 'r', POLICY_T_BATCH);
+        if (r < 0)
+                return error_origin(r);
+
+        r = policy_export_connect(policy, &policy->connect_default, NULL, m);
+        r = r ?: policy_export_own(policy, &policy->own_default, NULL, m);
+        r = r ?: policy_export_xmit(policy, &policy->send_default, NULL, m);
+        r = r ?: policy_export_xmit(policy, &policy->recv_default, NULL, m);
+        if (r)
+                return error_trace(r);
 
         r = sd_bus_message_close_container(m);
         if (r < 0)
                 return error_origin(r);
 
+        r = policy_export_uidgid(policy, cursor, SIZE_MAX, m);
+        if (r)
+                return error_trace(r);
+
         r = sd_bus_message_open_container(m, 'a', "(ss)");
         if (r < 0)
                 return error_origin(r);
@@ -994,3 +1068,310 @@ int policy_export(Policy *policy, sd_bus_message *m) {
 
         return 0;
 }
+
+/*
+ * The serialized form of a policy is a flat sequence of native-endian
+ * integers and NUL-terminated strings, in the same order as they are
+ * exported. It is only ever read back by the same binary on the same machine
+ * (see launch/cache.h), hence no attempt is made to make it portable.
+ */
+
+#define POLICY_STRING_NULL ((uint32_t)-1)
+
+enum {
+        POLICY_KIND_CONNECT,
+        POLICY_KIND_OWN,
+        POLICY_KIND_XMIT,
+        POLICY_KIND_SELINUX,
+};
+
+typedef struct PolicyReader {
+        const char *data;
+        size_t n_data;
+} PolicyReader;
+
+static void policy_save_u32(FILE *f, uint32_t v) {
+        fwrite(&v, sizeof(v), 1, f);
+}
+
+static void policy_save_u64(FILE *f, uint64_t v) {
+        fwrite(&v, sizeof(v), 1, f);
+}
+
+static void policy_save_string(FILE *f, const char *s) {
+        size_t n;
+
+        if (!s) {
+                policy_save_u32(f, POLICY_STRING_NULL);
+                return;
+        }
+
+        n = strlen(s);
+        policy_save_u32(f, n);
+        fwrite(s, 1, n + 1, f);
+}
+
+static void policy_save_list(FILE *f, CList *list, unsigned int kind) {
+        PolicyRecord *i_record;
+        uint32_t n = 0;
+
+        c_list_for_each_entry(i_record, list, link)
+                ++n;
+
+        policy_save_u32(f, n);
+
+        c_list_for_each_entry(i_record, list, link) {
+                policy_save_u32(f, i_record->verdict);
+                policy_save_u64(f, i_record->priority);
+
+                switch (kind) {
+                case POLICY_KIND_OWN:
+                        policy_save_u32(f, i_record->own.prefix);
+                        policy_save_string(f, i_record->own.name);
+                        break;
+                case POLICY_KIND_XMIT:
+                        policy_save_string(f, i_record->xmit.name);
+                        policy_save_string(f, i_record->xmit.path);
+                        policy_save_string(f, i_record->xmit.interface);
+                        policy_save_string(f, i_record->xmit.member);
+                        policy_save_u32(f, i_record->xmit.type);
+                        policy_save_u32(f, i_record->xmit.eavesdrop);
+                        break;
+                case POLICY_KIND_SELINUX:
+                        policy_save_string(f, i_record->selinux.name);
+                        policy_save_string(f, i_record->selinux.context);
+                        break;
+                }
+        }
+}
+
+static void policy_save_tree(FILE *f, CRBTree *tree) {
+        PolicyNode *node;
+        uint32_t n = 0;
+
+        c_rbtree_for_each_entry(node, tree, policy_node)
+                ++n;
+
+        policy_save_u32(f, n);
+
+        c_rbtree_for_each_entry(node, tree, policy_node) {
+                policy_save_u32(f, node->uidgid);
+                policy_save_list(f, &node->connect_list, POLICY_KIND_CONNECT);
+                policy_save_list(f, &node->own_list, POLICY_KIND_OWN);
+                policy_save_list(f, &node->send_list, POLICY_KIND_XMIT);
+                policy_save_list(f, &node->recv_list, POLICY_KIND_XMIT);
+        }
+}
+
+/**
+ * policy_save() - serialize a policy
+ * @policy:             policy to serialize
+ * @datap:              output argument for the serialized policy
+ * @n_datap:            output argument for the size of the serialized policy
+ *
+ * This serializes @policy into a newly allocated buffer, which can later be
+ * turned back into an equivalent policy via policy_load(). This is meant to
+ * be called on an optimized policy, so a cached policy can be exported
+ * without parsing the configuration again.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int policy_save(Policy *policy, char **datap, size_t *n_datap) {
+        _c_cleanup_(c_freep) char *data = NULL;
+        size_t n_data;
+        FILE *f;
+        int r;
+
+        f = open_memstream(&data, &n_data);
+        if (!f)
+                return error_origin(-errno);
+
+        policy_save_list(f, &policy->connect_default, POLICY_KIND_CONNECT);
+        policy_save_list(f, &policy->own_default, POLICY_KIND_OWN);
+        policy_save_list(f, &policy->send_default, POLICY_KIND_XMIT);
+        policy_save_list(f, &policy->recv_default, POLICY_KIND_XMIT);
+        policy_save_tree(f, &policy->uid_tree);
+        policy_save_tree(f, &policy->gid_tree);
+        policy_save_list(f, &policy->selinux_list, POLICY_KIND_SELINUX);
+
+        r = ferror(f);
+        if (fclose(f) || r)
+                return error_origin(-ENOMEM);
+
+        *datap = data;
+        *n_datap = n_data;
+        data = NULL;
+        return 0;
+}
+
+static int policy_load_u32(PolicyReader *reader, uint32_t *vp) {
+        if (reader->n_data < sizeof(*vp))
+                return POLICY_E_CORRUPT;
+
+        memcpy(vp, reader->data, sizeof(*vp));
+        reader->data += sizeof(*vp);
+        reader->n_data -= sizeof(*vp);
+        return 0;
+}
+
+static int policy_load_u64(PolicyReader *reader, uint64_t *vp) {
+        if (reader->n_data < sizeof(*vp))
+                return POLICY_E_CORRUPT;
+
+        memcpy(vp, reader->data, sizeof(*vp));
+        reader->data += sizeof(*vp);
+        reader->n_data -= sizeof(*vp);
+        return 0;
+}
+
+static int policy_load_string(PolicyReader *reader, const char **sp) {
+        uint32_t n;
+        int r;
+
+        r = policy_load_u32(reader, &n);
+        if (r)
+                return error_trace(r);
+
+        if (n == POLICY_STRING_NULL) {
+                *sp = NULL;
+                return 0;
+        }
+
+        if (reader->n_data <= n || reader->data[n] || memchr(reader->data, 0, n))
+                return POLICY_E_CORRUPT;
+
+        *sp = reader->data;
+        reader->data += n + 1;
+        reader->n_data -= n + 1;
+        return 0;
+}
+
+static int policy_load_list(PolicyReader *reader, CList *list, unsigned int kind) {
+        uint32_t i, n, verdict, u1, u2;
+        int r;
+
+        r = policy_load_u32(reader, &n);
+        if (r)
+                return error_trace(r);
+
+        for (i = 0; i < n; ++i) {
+                _c_cleanup_(policy_record_freep) PolicyRecord *record = NULL;
+
+                switch (kind) {
+                case POLICY_KIND_CONNECT:
+                        r = policy_record_new_connect(&record);
+                        break;
+                case POLICY_KIND_OWN:
+                        r = policy_record_new_own(&record);
+                        break;
+                case POLICY_KIND_XMIT:
+                        r = policy_record_new_xmit(&record);
+                        break;
+                case POLICY_KIND_SELINUX:
+                        r = policy_record_new_selinux(&record);
+                        break;
+                default:
+                        return error_origin(-ENOTRECOVERABLE);
+                }
+                if (r)
+                        return error_trace(r);
+
+                r = policy_load_u32(reader, &verdict);
+                r = r ?: policy_load_u64(reader, &record->priority);
+                if (r)
+                        return error_trace(r);
+
+                record->verdict = verdict;
+
+                switch (kind) {
+                case POLICY_KIND_OWN:
+                        r = policy_load_u32(reader, &u1);
+                        r = r ?: policy_load_string(reader, &record->own.name);
+                        record->own.prefix = u1;
+                        break;
+                case POLICY_KIND_XMIT:
+                        r = policy_load_string(reader, &record->xmit.name);
+                        r = r ?: policy_load_string(reader, &record->xmit.path);
+                        r = r ?: policy_load_string(reader, &record->xmit.interface);
+                        r = r ?: policy_load_string(reader, &record->xmit.member);
+                        r = r ?: policy_load_u32(reader, &u1);
+                        r = r ?: policy_load_u32(reader, &u2);
+                        record->xmit.type = u1;
+                        record->xmit.eavesdrop = u2;
+                        break;
+                case POLICY_KIND_SELINUX:
+                        r = policy_load_string(reader, &record->selinux.name);
+                        r = r ?: policy_load_string(reader, &record->selinux.context);
+                        break;
+                }
+                if (r)
+                        return error_trace(r);
+
+                c_list_link_tail(list, &record->link);
+                record = NULL;
+        }
+
+        return 0;
+}
+
+static int policy_load_tree(PolicyReader *reader, CRBTree *tree) {
+        PolicyNode *node;
+        uint32_t i, n, uidgid;
+        int r;
+
+        r = policy_load_u32(reader, &n);
+        if (r)
+                return error_trace(r);
+
+        for (i = 0; i < n; ++i) {
+                r = policy_load_u32(reader, &uidgid);
+                if (r)
+                        return error_trace(r);
+
+                r = policy_at_uidgid(tree, &node, uidgid);
+                if (r)
+                        return error_trace(r);
+
+                r = policy_load_list(reader, &node->connect_list, POLICY_KIND_CONNECT);
+                r = r ?: policy_load_list(reader, &node->own_list, POLICY_KIND_OWN);
+                r = r ?: policy_load_list(reader, &node->send_list, POLICY_KIND_XMIT);
+                r = r ?: policy_load_list(reader, &node->recv_list, POLICY_KIND_XMIT);
+                if (r)
+                        return error_trace(r);
+        }
+
+        return 0;
+}
+
+/**
+ * policy_load() - deserialize a policy
+ * @policy:             empty policy to load into
+ * @data:               serialized policy
+ * @n_data:             size of the serialized policy
+ *
+ * This loads a policy previously serialized via policy_save() into @policy.
+ * No copy of the strings in @data is made, hence the caller must keep @data
+ * alive and unmodified for as long as @policy is used.
+ *
+ * Return: 0 on success, POLICY_E_CORRUPT if @data is not a valid serialized
+ *         policy, negative error code on failure.
+ */
+int policy_load(Policy *policy, const void *data, size_t n_data) {
+        PolicyReader reader = { .data = data, .n_data = n_data };
+        int r;
+
+        r = policy_load_list(&reader, &policy->connect_default, POLICY_KIND_CONNECT);
+        r = r ?: policy_load_list(&reader, &policy->own_default, POLICY_KIND_OWN);
+        r = r ?: policy_load_list(&reader, &policy->send_default, POLICY_KIND_XMIT);
+        r = r ?: policy_load_list(&reader, &policy->recv_default, POLICY_KIND_XMIT);
+        r = r ?: policy_load_tree(&reader, &policy->uid_tree);
+        r = r ?: policy_load_tree(&reader, &policy->gid_tree);
+        r = r ?: policy_load_list(&reader, &policy->selinux_list, POLICY_KIND_SELINUX);
+        if (r)
+                return error_trace(r);
+
+        if (reader.n_data)
+                return POLICY_E_CORRUPT;
+
+        return 0;
+}
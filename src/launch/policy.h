@@ -12,9 +12,23 @@
 #include "launch/config.h"
 
 typedef struct Policy Policy;
+typedef struct PolicyCursor PolicyCursor;
 typedef struct PolicyNode PolicyNode;
 typedef struct PolicyRecord PolicyRecord;
 
+/*
+ * uid and gid entries per StagePolicy() part; small enough that a part of
+ * ordinary per-user rules stays far below the message size limit, big enough
+ * that a handful of parts covers even site-wide policies
+ */
+#define POLICY_EXPORT_NODES_MAX (1024)
+
+enum {
+        _POLICY_E_SUCCESS,
+
+        POLICY_E_CORRUPT,
+};
+
 struct PolicyRecord {
         CList link;
 
@@ -103,6 +117,14 @@ struct Policy {
                 .selinux_list = C_LIST_INIT((_x).selinux_list)                  \
         }
 
+struct PolicyCursor {
+        PolicyNode *uid;
+        PolicyNode *gid;
+        size_t n_nodes;
+};
+
+#define POLICY_CURSOR_NULL {}
+
 /* records */
 
 int policy_record_new_connect(PolicyRecord **recordp);
@@ -120,6 +142,12 @@ void policy_deinit(Policy *policy);
 
 int policy_import(Policy *policy, ConfigRoot *root);
 void policy_optimize(Policy *policy);
-int policy_export(Policy *policy, sd_bus_message *m);
+
+void policy_cursor_init(PolicyCursor *cursor, Policy *policy);
+int policy_export_nodes(Policy *policy, PolicyCursor *cursor, sd_bus_message *m);
+int policy_export(Policy *policy, PolicyCursor *cursor, sd_bus_message *m);
+
+int policy_save(Policy *policy, char **datap, size_t *n_datap);
+int policy_load(Policy *policy, const void *data, size_t n_data);
 
 C_DEFINE_CLEANUP(Policy *, policy_deinit);
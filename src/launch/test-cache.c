@@ -0,0 +1,130 @@
+/*
+ * Test Launcher Cache
+ */
+
+#include <c-macro.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "launch/cache.h"
+#include "launch/config.h"
+
+static void test_write_file(const char *path, const char *contents) {
+        FILE *f;
+
+        f = fopen(path, "we");
+        assert(f);
+        fputs(contents, f);
+        fclose(f);
+}
+
+static void test_read_config(ConfigRoot **rootp, const char *path) {
+        _c_cleanup_(config_parser_deinit) ConfigParser parser = CONFIG_PARSER_NULL(parser);
+        int r;
+
+        config_parser_init(&parser);
+
+        r = config_parser_read(&parser, rootp, path);
+        assert(!r);
+}
+
+static void test_cache(void) {
+        char dir[] = "/tmp/test-cache-XXXXXX";
+        char *config, *includedir, *include, *cache_path;
+        ConfigRoot *root = NULL;
+        Cache cache;
+        int r;
+
+        assert(mkdtemp(dir));
+        r = asprintf(&config, "%s/bus.conf", dir);
+        assert(r > 0);
+        r = asprintf(&includedir, "%s/bus.d", dir);
+        assert(r > 0);
+        r = asprintf(&include, "%s/bus.d/foo.conf", dir);
+        assert(r > 0);
+        r = asprintf(&cache_path, "%s/cache", dir);
+        assert(r > 0);
+
+        test_write_file(config,
+                        "<busconfig>"
+                        "<includedir>bus.d</includedir>"
+                        "<include ignore_missing=\"yes\">missing.conf</include>"
+                        "</busconfig>");
+
+        /* no cache written yet */
+        r = cache_map(&cache, cache_path, "key");
+        assert(r == CACHE_E_STALE);
+
+        test_read_config(&root, config);
+        r = cache_write(cache_path, "key", root, "data", 5);
+        assert(!r);
+        root = config_root_free(root);
+
+        /* cache is valid for the same key only */
+        r = cache_map(&cache, cache_path, "key");
+        assert(!r);
+        assert(cache.n_data == 5);
+        assert(!memcmp(cache.data, "data", 5));
+        cache_deinit(&cache);
+
+        r = cache_map(&cache, cache_path, "other");
+        assert(r == CACHE_E_STALE);
+
+        /* creating a previously missing include directory invalidates it */
+        r = mkdir(includedir, 0755);
+        assert(!r);
+
+        r = cache_map(&cache, cache_path, "key");
+        assert(r == CACHE_E_STALE);
+
+        test_read_config(&root, config);
+        r = cache_write(cache_path, "key", root, "data", 5);
+        assert(!r);
+        root = config_root_free(root);
+
+        r = cache_map(&cache, cache_path, "key");
+        assert(!r);
+        cache_deinit(&cache);
+
+        /* so does adding an include file */
+        test_write_file(include, "<busconfig></busconfig>");
+
+        r = cache_map(&cache, cache_path, "key");
+        assert(r == CACHE_E_STALE);
+
+        unlink(cache_path);
+        unlink(include);
+        rmdir(includedir);
+        unlink(config);
+        rmdir(dir);
+        free(cache_path);
+        free(include);
+        free(includedir);
+        free(config);
+}
+
+static void test_unreadable(void) {
+        char path[PATH_MAX * 2];
+        Cache cache;
+        int r;
+
+        /* failures to read the cache are reported as a stale cache */
+        memset(path, 'a', sizeof(path) - 1);
+        path[0] = '/';
+        path[sizeof(path) - 1] = 0;
+
+        r = cache_map(&cache, path, "key");
+        assert(r == CACHE_E_STALE);
+
+        r = cache_map(&cache, "/", "key");
+        assert(r == CACHE_E_STALE);
+}
+
+int main(int argc, char **argv) {
+        test_cache();
+        test_unreadable();
+        return 0;
+}
@@ -0,0 +1,978 @@
+/*
+ * Message Bus Traffic Viewer
+ *
+ * dbus-broker-top samples the statistics of a running message bus in regular
+ * intervals and shows the peers, names, and interface members that cause the
+ * most traffic. All data is retrieved via the org.freedesktop.DBus.Debug.Stats
+ * interface of the driver, hence this requires a privileged connection.
+ *
+ * The broker reports totals only. Rates are derived from the difference of
+ * two consecutive samples. Peers that connected in between are compared
+ * against zero, since their counters start when they connect.
+ */
+
+#include <c-macro.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "util/error.h"
+
+typedef struct TopInterface TopInterface;
+typedef struct TopName TopName;
+typedef struct TopPeer TopPeer;
+typedef struct TopRates TopRates;
+typedef struct TopSample TopSample;
+
+enum {
+        _MAIN_SUCCESS,
+        MAIN_EXIT,
+        MAIN_FAILED,
+};
+
+enum {
+        TOP_SORT_MESSAGES,
+        TOP_SORT_BYTES,
+        TOP_SORT_QUEUE,
+        TOP_SORT_CPU,
+        _TOP_SORT_N,
+};
+
+struct TopRates {
+        double messages;
+        double bytes;
+        double cpu;
+        uint32_t n_queued;
+};
+
+struct TopPeer {
+        char *unique_name;
+        uint32_t pid;
+        char comm[17];
+        uint64_t n_messages;
+        uint64_t n_bytes;
+        uint64_t n_dispatch_nsec;
+        uint32_t n_queued;
+        TopRates rates;
+};
+
+struct TopName {
+        char *name;
+        TopPeer *owner;
+};
+
+struct TopInterface {
+        char *interface;
+        char *member;
+        uint64_t n_messages;
+        uint64_t n_bytes;
+        uint64_t n_dispatch_nsec;
+        TopRates rates;
+};
+
+struct TopSample {
+        uint64_t timestamp;
+        TopPeer *peers;
+        size_t n_peers;
+        TopName *names;
+        size_t n_names;
+        TopInterface *interfaces;
+        size_t n_interfaces;
+        bool has_interfaces : 1;
+};
+
+#define TOP_SAMPLE_NULL {}
+
+static const char *main_arg_address = NULL;
+static bool main_arg_user = false;
+static bool main_arg_batch = false;
+static uint64_t main_arg_interval_usec = 2 * 1000 * 1000;
+static uint64_t main_arg_iterations = 0;
+static size_t main_arg_lines = 10;
+static unsigned int main_arg_sort = TOP_SORT_MESSAGES;
+
+static const char * const main_sort_names[_TOP_SORT_N] = {
+        [TOP_SORT_MESSAGES] = "messages",
+        [TOP_SORT_BYTES] = "bytes",
+        [TOP_SORT_QUEUE] = "queue",
+        [TOP_SORT_CPU] = "cpu",
+};
+
+static volatile sig_atomic_t main_quit = 0;
+
+static uint64_t top_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void top_sample_deinit(TopSample *sample) {
+        size_t i;
+
+        for (i = 0; i < sample->n_interfaces; ++i) {
+                free(sample->interfaces[i].member);
+                free(sample->interfaces[i].interface);
+        }
+        free(sample->interfaces);
+
+        for (i = 0; i < sample->n_names; ++i)
+                free(sample->names[i].name);
+        free(sample->names);
+
+        for (i = 0; i < sample->n_peers; ++i)
+                free(sample->peers[i].unique_name);
+        free(sample->peers);
+
+        *sample = (TopSample)TOP_SAMPLE_NULL;
+}
+
+static int top_peer_compare(const void *a, const void *b) {
+        const TopPeer *pa = a, *pb = b;
+
+        return strcmp(pa->unique_name, pb->unique_name);
+}
+
+static int top_interface_compare(const void *a, const void *b) {
+        const TopInterface *ia = a, *ib = b;
+        int r;
+
+        r = strcmp(ia->interface, ib->interface);
+        if (r)
+                return r;
+
+        return strcmp(ia->member, ib->member);
+}
+
+static TopPeer *top_sample_find_peer(TopSample *sample, const char *unique_name) {
+        TopPeer key = { .unique_name = (char *)unique_name };
+
+        if (!sample->n_peers)
+                return NULL;
+
+        return bsearch(&key, sample->peers, sample->n_peers, sizeof(*sample->peers), top_peer_compare);
+}
+
+static TopInterface *top_sample_find_interface(TopSample *sample, const char *interface, const char *member) {
+        TopInterface key = { .interface = (char *)interface, .member = (char *)member };
+
+        if (!sample->n_interfaces)
+                return NULL;
+
+        return bsearch(&key, sample->interfaces, sample->n_interfaces, sizeof(*sample->interfaces), top_interface_compare);
+}
+
+static bool top_error_is_vanished(sd_bus_error *error) {
+        /* peers may disconnect at any time while we iterate the bus */
+        return sd_bus_error_has_name(error, "org.freedesktop.DBus.Error.NameHasNoOwner") ||
+               sd_bus_error_has_name(error, "org.freedesktop.DBus.Error.ServiceUnknown");
+}
+
+static int top_error_fatal(sd_bus_error *error, int r) {
+        if (sd_bus_error_has_name(error, "org.freedesktop.DBus.Error.AccessDenied")) {
+                fprintf(stderr, "%s: access denied, the bus statistics are only available to privileged peers\n",
+                        program_invocation_short_name);
+                return MAIN_FAILED;
+        }
+
+        if (sd_bus_error_is_set(error)) {
+                fprintf(stderr, "%s: %s\n", program_invocation_short_name, error->message ?: error->name);
+                return MAIN_FAILED;
+        }
+
+        return error_origin(r);
+}
+
+static void top_read_comm(TopPeer *peer) {
+        char path[64];
+        size_t n;
+        FILE *f;
+        int r;
+
+        r = snprintf(path, sizeof(path), "/proc/%" PRIu32 "/comm", peer->pid);
+        if (r < 0 || r >= (int)sizeof(path))
+                return;
+
+        f = fopen(path, "re");
+        if (!f)
+                return;
+
+        n = fread(peer->comm, 1, sizeof(peer->comm) - 1, f);
+        while (n > 0 && peer->comm[n - 1] == '\n')
+                --n;
+        peer->comm[n] = 0;
+
+        fclose(f);
+}
+
+static int top_sample_peer(sd_bus *bus, TopPeer *peer, TopSample *previous) {
+        _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        uint64_t n_messages_in = 0, n_messages_out = 0, n_bytes_in = 0, n_bytes_out = 0;
+        const char *key, *contents;
+        TopPeer *old;
+        uint64_t t;
+        uint32_t u;
+        int r;
+
+        r = sd_bus_call_method(bus,
+                               "org.freedesktop.DBus",
+                               "/org/freedesktop/DBus",
+                               "org.freedesktop.DBus.Debug.Stats",
+                               "GetConnectionStats",
+                               &error,
+                               &reply,
+                               "s",
+                               peer->unique_name);
+        if (r < 0)
+                return top_error_is_vanished(&error) ? 0 : top_error_fatal(&error, r);
+
+        r = sd_bus_message_enter_container(reply, 'a', "{sv}");
+        if (r < 0)
+                return error_origin(r);
+
+        while ((r = sd_bus_message_enter_container(reply, 'e', "sv")) > 0) {
+                r = sd_bus_message_read(reply, "s", &key);
+                if (r < 0)
+                        return error_origin(r);
+
+                r = sd_bus_message_peek_type(reply, NULL, &contents);
+                if (r < 0)
+                        return error_origin(r);
+
+                if (!strcmp(contents, "t")) {
+                        r = sd_bus_message_read(reply, "v", "t", &t);
+                        if (r < 0)
+                                return error_origin(r);
+
+                        if (!strcmp(key, "org.bus1.DBus.Debug.Stats.MessagesReceived"))
+                                n_messages_in = t;
+                        else if (!strcmp(key, "org.bus1.DBus.Debug.Stats.MessagesSent"))
+                                n_messages_out = t;
+                        else if (!strcmp(key, "org.bus1.DBus.Debug.Stats.BytesReceived"))
+                                n_bytes_in = t;
+                        else if (!strcmp(key, "org.bus1.DBus.Debug.Stats.BytesSent"))
+                                n_bytes_out = t;
+                        else if (!strcmp(key, "org.bus1.DBus.Debug.Stats.DispatchTime"))
+                                peer->n_dispatch_nsec = t;
+                } else if (!strcmp(contents, "u")) {
+                        r = sd_bus_message_read(reply, "v", "u", &u);
+                        if (r < 0)
+                                return error_origin(r);
+
+                        if (!strcmp(key, "OutgoingMessages"))
+                                peer->n_queued = u;
+                } else {
+                        r = sd_bus_message_skip(reply, "v");
+                        if (r < 0)
+                                return error_origin(r);
+                }
+
+                r = sd_bus_message_exit_container(reply);
+                if (r < 0)
+                        return error_origin(r);
+        }
+        if (r < 0)
+                return error_origin(r);
+
+        peer->n_messages = n_messages_in + n_messages_out;
+        peer->n_bytes = n_bytes_in + n_bytes_out;
+
+        /* the process of a peer cannot change, so only look it up once */
+        old = top_sample_find_peer(previous, peer->unique_name);
+        if (old) {
+                peer->pid = old->pid;
+                memcpy(peer->comm, old->comm, sizeof(peer->comm));
+                return 0;
+        }
+
+        sd_bus_error_free(&error);
+        reply = sd_bus_message_unref(reply);
+
+        r = sd_bus_call_method(bus,
+                               "org.freedesktop.DBus",
+                               "/org/freedesktop/DBus",
+                               "org.freedesktop.DBus",
+                               "GetConnectionUnixProcessID",
+                               &error,
+                               &reply,
+                               "s",
+                               peer->unique_name);
+        if (r < 0)
+                return top_error_is_vanished(&error) ? 0 : top_error_fatal(&error, r);
+
+        r = sd_bus_message_read(reply, "u", &peer->pid);
+        if (r < 0)
+                return error_origin(r);
+
+        top_read_comm(peer);
+        return 0;
+}
+
+static int top_sample_interfaces(sd_bus *bus, TopSample *sample) {
+        _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        const char *interface, *member;
+        uint64_t n_messages, n_bytes, n_dispatch_nsec;
+        TopInterface *interfaces;
+        size_t n_allocated = 0;
+        int r;
+
+        r = sd_bus_call_method(bus,
+                               "org.freedesktop.DBus",
+                               "/org/freedesktop/DBus",
+                               "org.freedesktop.DBus.Debug.Stats",
+                               "GetInterfaceStats",
+                               &error,
+                               &reply,
+                               NULL);
+        if (r < 0) {
+                /* other bus implementations do not account interfaces */
+                if (sd_bus_error_has_name(&error, "org.freedesktop.DBus.Error.UnknownMethod"))
+                        return 0;
+
+                return top_error_fatal(&error, r);
+        }
+
+        sample->has_interfaces = true;
+
+        r = sd_bus_message_enter_container(reply, 'a', "(ssttt)");
+        if (r < 0)
+                return error_origin(r);
+
+        while ((r = sd_bus_message_read(reply, "(ssttt)", &interface, &member, &n_messages, &n_bytes, &n_dispatch_nsec)) > 0) {
+                if (sample->n_interfaces >= n_allocated) {
+                        n_allocated = n_allocated ? n_allocated * 2 : 64;
+                        interfaces = realloc(sample->interfaces, n_allocated * sizeof(*interfaces));
+                        if (!interfaces)
+                                return error_origin(-ENOMEM);
+
+                        sample->interfaces = interfaces;
+                }
+
+                interfaces = &sample->interfaces[sample->n_interfaces];
+                *interfaces = (TopInterface){
+                        .interface = strdup(interface),
+                        .member = strdup(member),
+                        .n_messages = n_messages,
+                        .n_bytes = n_bytes,
+                        .n_dispatch_nsec = n_dispatch_nsec,
+                };
+                ++sample->n_interfaces;
+
+                if (!interfaces->interface || !interfaces->member)
+                        return error_origin(-ENOMEM);
+        }
+        if (r < 0)
+                return error_origin(r);
+
+        qsort(sample->interfaces, sample->n_interfaces, sizeof(*sample->interfaces), top_interface_compare);
+
+        return 0;
+}
+
+static int top_sample(sd_bus *bus, TopSample *sample, TopSample *previous) {
+        _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        char **names = NULL, **name;
+        const char *owner;
+        size_t n_names = 0;
+        int r;
+
+        sample->timestamp = top_now();
+
+        r = sd_bus_call_method(bus,
+                               "org.freedesktop.DBus",
+                               "/org/freedesktop/DBus",
+                               "org.freedesktop.DBus",
+                               "ListNames",
+                               &error,
+                               &reply,
+                               NULL);
+        if (r < 0)
+                return top_error_fatal(&error, r);
+
+        r = sd_bus_message_read_strv(reply, &names);
+        if (r < 0)
+                return error_origin(r);
+
+        for (name = names; *name; ++name)
+                ++n_names;
+
+        sample->peers = calloc(n_names ?: 1, sizeof(*sample->peers));
+        sample->names = calloc(n_names ?: 1, sizeof(*sample->names));
+        if (!sample->peers || !sample->names) {
+                r = error_origin(-ENOMEM);
+                goto exit;
+        }
+
+        /* first collect all peers, so names can be attributed to them */
+        for (name = names; *name; ++name) {
+                if (**name != ':')
+                        continue;
+
+                sample->peers[sample->n_peers].unique_name = *name;
+                *name = NULL;
+
+                r = top_sample_peer(bus, &sample->peers[sample->n_peers++], previous);
+                if (r)
+                        goto exit;
+        }
+
+        qsort(sample->peers, sample->n_peers, sizeof(*sample->peers), top_peer_compare);
+
+        for (name = names; name < names + n_names; ++name) {
+                if (!*name || !strcmp(*name, "org.freedesktop.DBus"))
+                        continue;
+
+                sd_bus_error_free(&error);
+                reply = sd_bus_message_unref(reply);
+
+                r = sd_bus_call_method(bus,
+                                       "org.freedesktop.DBus",
+                                       "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus",
+                                       "GetNameOwner",
+                                       &error,
+                                       &reply,
+                                       "s",
+                                       *name);
+                if (r < 0) {
+                        if (top_error_is_vanished(&error))
+                                continue;
+
+                        r = top_error_fatal(&error, r);
+                        goto exit;
+                }
+
+                r = sd_bus_message_read(reply, "s", &owner);
+                if (r < 0) {
+                        r = error_origin(r);
+                        goto exit;
+                }
+
+                sample->names[sample->n_names].owner = top_sample_find_peer(sample, owner);
+                if (!sample->names[sample->n_names].owner)
+                        continue;
+
+                sample->names[sample->n_names++].name = *name;
+                *name = NULL;
+        }
+
+        r = top_sample_interfaces(bus, sample);
+        if (r)
+                goto exit;
+
+exit:
+        for (name = names; name < names + n_names; ++name)
+                free(*name);
+        free(names);
+        return r;
+}
+
+static void top_rates(TopRates *rates,
+                      uint64_t n_messages,
+                      uint64_t n_bytes,
+                      uint64_t n_dispatch_nsec,
+                      uint64_t n_messages_old,
+                      uint64_t n_bytes_old,
+                      uint64_t n_dispatch_nsec_old,
+                      uint64_t n_duration_nsec) {
+        double seconds = n_duration_nsec / 1000000000.0;
+
+        /* counters of a peer are reset if it reconnects under the same name */
+        rates->messages = n_messages >= n_messages_old ? (n_messages - n_messages_old) / seconds : 0;
+        rates->bytes = n_bytes >= n_bytes_old ? (n_bytes - n_bytes_old) / seconds : 0;
+        rates->cpu = n_dispatch_nsec >= n_dispatch_nsec_old ? (n_dispatch_nsec - n_dispatch_nsec_old) * 100.0 / n_duration_nsec : 0;
+}
+
+static void top_sample_rates(TopSample *sample, TopSample *previous) {
+        uint64_t n_duration_nsec;
+        TopInterface *interface, *old_interface;
+        TopPeer *peer, *old_peer;
+
+        n_duration_nsec = previous->timestamp ? sample->timestamp - previous->timestamp : 0;
+        if (!n_duration_nsec)
+                return;
+
+        for (peer = sample->peers; peer < sample->peers + sample->n_peers; ++peer) {
+                old_peer = top_sample_find_peer(previous, peer->unique_name);
+                top_rates(&peer->rates,
+                          peer->n_messages,
+                          peer->n_bytes,
+                          peer->n_dispatch_nsec,
+                          old_peer ? old_peer->n_messages : 0,
+                          old_peer ? old_peer->n_bytes : 0,
+                          old_peer ? old_peer->n_dispatch_nsec : 0,
+                          n_duration_nsec);
+                peer->rates.n_queued = peer->n_queued;
+        }
+
+        for (interface = sample->interfaces; interface < sample->interfaces + sample->n_interfaces; ++interface) {
+                old_interface = top_sample_find_interface(previous, interface->interface, interface->member);
+                top_rates(&interface->rates,
+                          interface->n_messages,
+                          interface->n_bytes,
+                          interface->n_dispatch_nsec,
+                          old_interface ? old_interface->n_messages : 0,
+                          old_interface ? old_interface->n_bytes : 0,
+                          old_interface ? old_interface->n_dispatch_nsec : 0,
+                          n_duration_nsec);
+        }
+}
+
+static double top_rates_key(const TopRates *rates) {
+        switch (main_arg_sort) {
+        case TOP_SORT_BYTES:
+                return rates->bytes;
+        case TOP_SORT_QUEUE:
+                return rates->n_queued;
+        case TOP_SORT_CPU:
+                return rates->cpu;
+        case TOP_SORT_MESSAGES:
+        default:
+                return rates->messages;
+        }
+}
+
+static int top_rates_compare(const TopRates *a, const TopRates *b) {
+        double ka = top_rates_key(a), kb = top_rates_key(b);
+
+        /* highest first */
+        return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+static int top_peer_compare_rates(const void *a, const void *b) {
+        const TopPeer *pa = *(TopPeer * const *)a, *pb = *(TopPeer * const *)b;
+
+        return top_rates_compare(&pa->rates, &pb->rates) ?: strcmp(pa->unique_name, pb->unique_name);
+}
+
+static int top_name_compare_rates(const void *a, const void *b) {
+        const TopName *na = *(TopName * const *)a, *nb = *(TopName * const *)b;
+
+        return top_rates_compare(&na->owner->rates, &nb->owner->rates) ?: strcmp(na->name, nb->name);
+}
+
+static int top_interface_compare_rates(const void *a, const void *b) {
+        const TopInterface *ia = *(TopInterface * const *)a, *ib = *(TopInterface * const *)b;
+        int r;
+
+        /* interfaces have no queues, so fall back to the message rate */
+        if (main_arg_sort == TOP_SORT_QUEUE) {
+                r = ia->rates.messages < ib->rates.messages ? 1 : ia->rates.messages > ib->rates.messages ? -1 : 0;
+                if (r)
+                        return r;
+        } else {
+                r = top_rates_compare(&ia->rates, &ib->rates);
+                if (r)
+                        return r;
+        }
+
+        return top_interface_compare(ia, ib);
+}
+
+static int top_sort(void ***sortedp, void *array, size_t n, size_t size, int (*compare)(const void *, const void *)) {
+        void **sorted;
+        size_t i;
+
+        sorted = calloc(n ?: 1, sizeof(*sorted));
+        if (!sorted)
+                return error_origin(-ENOMEM);
+
+        for (i = 0; i < n; ++i)
+                sorted[i] = (char *)array + i * size;
+
+        qsort(sorted, n, sizeof(*sorted), compare);
+
+        *sortedp = sorted;
+        return 0;
+}
+
+static void top_print_rates(const TopRates *rates, bool with_queue) {
+        if (with_queue)
+                printf(" %10.1f %10.1f %7" PRIu32 " %6.2f\n",
+                       rates->messages, rates->bytes / 1024, rates->n_queued, rates->cpu);
+        else
+                printf(" %10.1f %10.1f %7s %6.2f\n",
+                       rates->messages, rates->bytes / 1024, "-", rates->cpu);
+}
+
+static int top_print(TopSample *sample) {
+        _c_cleanup_(c_freep) void **peers = NULL, **names = NULL, **interfaces = NULL;
+        TopInterface *interface;
+        char label[52];
+        TopName *name;
+        TopPeer *peer;
+        size_t i;
+        int r;
+
+        r = top_sort(&peers, sample->peers, sample->n_peers, sizeof(*sample->peers), top_peer_compare_rates);
+        if (r)
+                return error_trace(r);
+
+        r = top_sort(&names, sample->names, sample->n_names, sizeof(*sample->names), top_name_compare_rates);
+        if (r)
+                return error_trace(r);
+
+        r = top_sort(&interfaces, sample->interfaces, sample->n_interfaces, sizeof(*sample->interfaces), top_interface_compare_rates);
+        if (r)
+                return error_trace(r);
+
+        if (!main_arg_batch)
+                printf("\033[H\033[2J");
+
+        printf("%s - %zu peers, %zu names, sorted by %s\n",
+               program_invocation_short_name, sample->n_peers, sample->n_names, main_sort_names[main_arg_sort]);
+        if (!main_arg_batch)
+                printf("[m]essages [b]ytes [d]epth of queue [c]pu [q]uit\n");
+
+        printf("\n%-12s %8s %-16s %10s %10s %7s %6s\n", "PEER", "PID", "COMM", "MSG/s", "KiB/s", "QUEUE", "CPU%");
+        for (i = 0; i < sample->n_peers && i < main_arg_lines; ++i) {
+                peer = peers[i];
+                printf("%-12s %8" PRIu32 " %-16s", peer->unique_name, peer->pid, peer->comm);
+                top_print_rates(&peer->rates, true);
+        }
+
+        printf("\n%-38s %-12s %10s %10s %7s %6s\n", "NAME", "OWNER", "MSG/s", "KiB/s", "QUEUE", "CPU%");
+        for (i = 0; i < sample->n_names && i < main_arg_lines; ++i) {
+                name = names[i];
+                printf("%-38.38s %-12s", name->name, name->owner->unique_name);
+                top_print_rates(&name->owner->rates, true);
+        }
+
+        if (sample->has_interfaces) {
+                printf("\n%-51s %10s %10s %7s %6s\n", "INTERFACE.MEMBER", "MSG/s", "KiB/s", "QUEUE", "CPU%");
+                for (i = 0; i < sample->n_interfaces && i < main_arg_lines; ++i) {
+                        interface = interfaces[i];
+                        if (!*interface->member)
+                                snprintf(label, sizeof(label), "(other)");
+                        else
+                                snprintf(label, sizeof(label), "%s%s%s",
+                                         interface->interface,
+                                         *interface->interface ? "." : "",
+                                         interface->member);
+                        printf("%-51s", label);
+                        top_print_rates(&interface->rates, false);
+                }
+        }
+
+        if (main_arg_batch)
+                printf("\n");
+
+        fflush(stdout);
+        return 0;
+}
+
+static void top_signal(int signo) {
+        main_quit = 1;
+}
+
+/*
+ * Sleeps for the length of an interval, or until a key is pressed in
+ * interactive mode. Returns true if the tool shall exit.
+ */
+static bool top_wait(bool *redrawp) {
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        uint64_t deadline, now;
+        char c;
+        int r;
+
+        *redrawp = false;
+        deadline = top_now() + main_arg_interval_usec * 1000;
+
+        while (!main_quit && (now = top_now()) < deadline) {
+                r = poll(&pfd, main_arg_batch ? 0 : 1, (deadline - now) / 1000000 + 1);
+                if (r <= 0 || main_arg_batch)
+                        continue;
+
+                if (read(STDIN_FILENO, &c, 1) != 1)
+                        continue;
+
+                switch (c) {
+                case 'q':
+                        return true;
+                case 'm':
+                        main_arg_sort = TOP_SORT_MESSAGES;
+                        break;
+                case 'b':
+                        main_arg_sort = TOP_SORT_BYTES;
+                        break;
+                case 'd':
+                        main_arg_sort = TOP_SORT_QUEUE;
+                        break;
+                case 'c':
+                        main_arg_sort = TOP_SORT_CPU;
+                        break;
+                default:
+                        continue;
+                }
+
+                /* re-sort the current sample right away */
+                *redrawp = true;
+                return false;
+        }
+
+        return main_quit;
+}
+
+static int top_connect(sd_bus **busp) {
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+        int r;
+
+        if (main_arg_address) {
+                r = sd_bus_new(&bus);
+                if (r < 0)
+                        return error_origin(r);
+
+                r = sd_bus_set_address(bus, main_arg_address);
+                if (r < 0)
+                        return error_origin(r);
+
+                r = sd_bus_set_bus_client(bus, true);
+                if (r < 0)
+                        return error_origin(r);
+
+                r = sd_bus_start(bus);
+        } else if (main_arg_user) {
+                r = sd_bus_open_user(&bus);
+        } else {
+                r = sd_bus_open_system(&bus);
+        }
+        if (r < 0) {
+                fprintf(stderr, "%s: cannot connect to message bus: %s\n", program_invocation_short_name, strerror(-r));
+                return MAIN_FAILED;
+        }
+
+        *busp = bus;
+        bus = NULL;
+        return 0;
+}
+
+static int run(void) {
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+        TopSample samples[2] = { TOP_SAMPLE_NULL, TOP_SAMPLE_NULL };
+        TopSample *sample = &samples[0], *previous = &samples[1], *t;
+        struct termios termios_old, termios_new;
+        bool restore = false, redraw;
+        uint64_t i;
+        int r;
+
+        r = top_connect(&bus);
+        if (r)
+                return error_trace(r);
+
+        if (!main_arg_batch) {
+                r = tcgetattr(STDIN_FILENO, &termios_old);
+                if (!r) {
+                        termios_new = termios_old;
+                        termios_new.c_lflag &= ~(ICANON | ECHO);
+                        termios_new.c_cc[VMIN] = 0;
+                        termios_new.c_cc[VTIME] = 0;
+
+                        r = tcsetattr(STDIN_FILENO, TCSANOW, &termios_new);
+                        restore = !r;
+                }
+        }
+
+        /*
+         * The first sample only serves as baseline, and it enables the
+         * interface accounting of the broker. Hence, sample twice before
+         * showing anything.
+         */
+        r = top_sample(bus, sample, previous);
+        if (r)
+                goto exit;
+
+        i = 0;
+        while (!main_arg_iterations || i < main_arg_iterations) {
+                if (top_wait(&redraw))
+                        break;
+
+                if (!redraw) {
+                        t = previous;
+                        previous = sample;
+                        sample = t;
+
+                        top_sample_deinit(sample);
+                        r = top_sample(bus, sample, previous);
+                        if (r)
+                                goto exit;
+
+                        top_sample_rates(sample, previous);
+                        ++i;
+                }
+
+                r = top_print(sample);
+                if (r)
+                        goto exit;
+        }
+
+exit:
+        if (restore)
+                tcsetattr(STDIN_FILENO, TCSANOW, &termios_old);
+        top_sample_deinit(&samples[1]);
+        top_sample_deinit(&samples[0]);
+        return error_trace(r);
+}
+
+static void help(void) {
+        printf("%s [GLOBALS...] ...\n\n"
+               "Linux D-Bus Message Broker Traffic Viewer\n\n"
+               "  -h --help             Show this help\n"
+               "     --version          Show package version\n"
+               "     --address ADDRESS  Connect to the message bus at ADDRESS\n"
+               "     --system           Connect to the system bus (default)\n"
+               "     --user             Connect to the user bus\n"
+               "  -d --delay SECONDS    Sample every SECONDS\n"
+               "  -n --iterations N     Exit after N updates\n"
+               "  -l --lines N          Show the top N entries of each table\n"
+               "  -s --sort KEY         Sort by messages, bytes, queue, or cpu\n"
+               "  -b --batch            Do not clear the screen, nor read keys\n"
+               , program_invocation_short_name);
+}
+
+static int parse_argv(int argc, char *argv[]) {
+        enum {
+                ARG_VERSION = 0x100,
+                ARG_ADDRESS,
+                ARG_SYSTEM,
+                ARG_USER,
+        };
+        static const struct option options[] = {
+                { "help",               no_argument,            NULL,   'h'                     },
+                { "version",            no_argument,            NULL,   ARG_VERSION             },
+                { "address",            required_argument,      NULL,   ARG_ADDRESS             },
+                { "system",             no_argument,            NULL,   ARG_SYSTEM              },
+                { "user",               no_argument,            NULL,   ARG_USER                },
+                { "delay",              required_argument,      NULL,   'd'                     },
+                { "iterations",         required_argument,      NULL,   'n'                     },
+                { "lines",              required_argument,      NULL,   'l'                     },
+                { "sort",               required_argument,      NULL,   's'                     },
+                { "batch",              no_argument,            NULL,   'b'                     },
+                {}
+        };
+        unsigned long long value;
+        double delay;
+        char *end;
+        size_t i;
+        int c;
+
+        while ((c = getopt_long(argc, argv, "hd:n:l:s:b", options, NULL)) >= 0) {
+                switch (c) {
+                case 'h':
+                        help();
+                        return MAIN_EXIT;
+
+                case ARG_VERSION:
+                        printf("dbus-broker-top %d\n", PACKAGE_VERSION);
+                        return MAIN_EXIT;
+
+                case ARG_ADDRESS:
+                        main_arg_address = optarg;
+                        break;
+
+                case ARG_SYSTEM:
+                        main_arg_address = NULL;
+                        main_arg_user = false;
+                        break;
+
+                case ARG_USER:
+                        main_arg_address = NULL;
+                        main_arg_user = true;
+                        break;
+
+                case 'd':
+                        errno = 0;
+                        delay = strtod(optarg, &end);
+                        if (errno || end == optarg || *end || !(delay >= 0.1 && delay <= 3600)) {
+                                fprintf(stderr, "%s: invalid delay -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_interval_usec = delay * 1000 * 1000;
+                        break;
+
+                case 'n':
+                case 'l':
+                        errno = 0;
+                        value = strtoull(optarg, &end, 10);
+                        if (errno || end == optarg || *end || !value || value > SIZE_MAX) {
+                                fprintf(stderr, "%s: invalid number -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        if (c == 'n')
+                                main_arg_iterations = value;
+                        else
+                                main_arg_lines = value;
+                        break;
+
+                case 's':
+                        for (i = 0; i < C_ARRAY_SIZE(main_sort_names); ++i)
+                                if (!strcmp(optarg, main_sort_names[i]))
+                                        break;
+
+                        if (i >= C_ARRAY_SIZE(main_sort_names)) {
+                                fprintf(stderr, "%s: invalid sort key -- '%s'\n", program_invocation_name, optarg);
+                                return MAIN_FAILED;
+                        }
+
+                        main_arg_sort = i;
+                        break;
+
+                case 'b':
+                        main_arg_batch = true;
+                        break;
+
+                case '?':
+                        /* getopt_long() prints warning */
+                        return MAIN_FAILED;
+
+                default:
+                        return error_origin(-EINVAL);
+                }
+        }
+
+        if (optind != argc) {
+                fprintf(stderr, "%s: invalid arguments -- '%s'\n", program_invocation_name, argv[optind]);
+                return MAIN_FAILED;
+        }
+
+        /* without a terminal, behave like top(1) in batch mode */
+        if (!isatty(STDOUT_FILENO) || !isatty(STDIN_FILENO))
+                main_arg_batch = true;
+
+        return 0;
+}
+
+int main(int argc, char **argv) {
+        struct sigaction sa = { .sa_handler = top_signal };
+        int r;
+
+        r = parse_argv(argc, argv);
+        if (r)
+                goto exit;
+
+        /* no SA_RESTART, so a pending poll(2) returns right away */
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        r = run();
+
+exit:
+        r = error_trace(r);
+        if (r < 0)
+                fprintf(stderr, "Exiting due to fatal error: %d\n", r);
+        return (r == 0 || r == MAIN_EXIT) ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+/*
+ * Object Arenas
+ *
+ * An arena serves small objects that all share the lifetime of a single
+ * owner, usually a peer. Objects are carved out of larger chunks, and all
+ * chunks are released at once when the arena is destroyed. Objects released
+ * before that are kept on a free list per size class, and are re-used by the
+ * next allocation of the same class, so long-lived owners do not grow their
+ * arena without bound.
+ *
+ * Chunks are allocated lazily, starting at ARENA_CHUNK_MIN bytes and doubling
+ * up to ARENA_CHUNK_MAX bytes. A short-lived owner with a handful of objects
+ * thus costs a single allocation, regardless of how many objects it creates
+ * and destroys, and a single release when it goes away. Objects larger than
+ * ARENA_OBJECT_MAX are passed through to the allocator.
+ *
+ * Arenas track memory only. Objects must still be destroyed individually
+ * before their arena is, so they are unlinked from other objects and their
+ * quota is returned. All objects are aligned to ARENA_ALIGN.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/arena.h"
+
+/**
+ * arena_init() - initialize arena
+ * @arena:              arena to operate on
+ *
+ * This initializes a new, empty arena. No memory is allocated until the
+ * first object is.
+ */
+void arena_init(Arena *arena) {
+        *arena = (Arena)ARENA_INIT;
+}
+
+/**
+ * arena_deinit() - destroy arena
+ * @arena:              arena to operate on
+ *
+ * This releases all memory of @arena at once. Any object allocated from
+ * @arena becomes invalid, whether it was released or not.
+ */
+void arena_deinit(Arena *arena) {
+        ArenaChunk *chunk;
+
+        while ((chunk = arena->chunks)) {
+                arena->chunks = chunk->next;
+                free(chunk);
+        }
+
+        arena_init(arena);
+}
+
+static size_t arena_class(size_t n) {
+        return (c_max(n, (size_t)1) - 1) / ARENA_ALIGN;
+}
+
+/**
+ * arena_alloc() - allocate object from arena
+ * @arena:              arena to operate on
+ * @n:                  size of the object in bytes
+ *
+ * This allocates a new object of @n bytes from @arena. A previously released
+ * object of the same size class is re-used, if available. The content of the
+ * returned object is undefined.
+ *
+ * Return: A pointer to the new object, or NULL if out of memory.
+ */
+void *arena_alloc(Arena *arena, size_t n) {
+        ArenaChunk *chunk;
+        void *object;
+        size_t i;
+
+        if (_c_unlikely_(n > ARENA_OBJECT_MAX))
+                return malloc(n);
+
+        i = arena_class(n);
+        n = (i + 1) * ARENA_ALIGN;
+
+        object = arena->free_lists[i];
+        if (object) {
+                arena->free_lists[i] = *(void **)object;
+                return object;
+        }
+
+        if (_c_unlikely_(arena->n_left < n)) {
+                arena->n_chunk = c_min(c_max(arena->n_chunk * 2, ARENA_CHUNK_MIN), ARENA_CHUNK_MAX);
+
+                chunk = malloc(sizeof(*chunk) + arena->n_chunk);
+                if (!chunk)
+                        return NULL;
+
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+                arena->cursor = chunk->data;
+                arena->n_left = arena->n_chunk;
+        }
+
+        object = arena->cursor;
+        arena->cursor += n;
+        arena->n_left -= n;
+        return object;
+}
+
+/**
+ * arena_free() - release object to arena
+ * @arena:              arena to operate on
+ * @object:             object to release, or NULL
+ * @n:                  size of the object in bytes
+ *
+ * This releases an object previously allocated via arena_alloc() on the same
+ * arena, with the same size. Its memory is kept for re-use by @arena, until
+ * @arena is destroyed.
+ *
+ * If @object is NULL, this is a no-op.
+ */
+void arena_free(Arena *arena, void *object, size_t n) {
+        size_t i;
+
+        if (!object)
+                return;
+
+        if (_c_unlikely_(n > ARENA_OBJECT_MAX)) {
+                free(object);
+                return;
+        }
+
+        i = arena_class(n);
+        *(void **)object = arena->free_lists[i];
+        arena->free_lists[i] = object;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+/*
+ * Object Arenas
+ */
+
+#include <c-macro.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+typedef struct Arena Arena;
+typedef struct ArenaChunk ArenaChunk;
+
+#define ARENA_ALIGN alignof(max_align_t)
+#define ARENA_OBJECT_MAX (256UL)
+#define ARENA_CLASSES (ARENA_OBJECT_MAX / ARENA_ALIGN)
+#define ARENA_CHUNK_MIN (1024UL) /* a handful of match rules and reply slots */
+#define ARENA_CHUNK_MAX (16UL * 1024UL) /* bounds the slack a chunk leaves unused */
+
+struct ArenaChunk {
+        ArenaChunk *next;
+        alignas(max_align_t) unsigned char data[];
+};
+
+struct Arena {
+        ArenaChunk *chunks;
+        unsigned char *cursor;
+        size_t n_left;
+        size_t n_chunk;
+        void *free_lists[ARENA_CLASSES];
+};
+
+#define ARENA_INIT {}
+
+void arena_init(Arena *arena);
+void arena_deinit(Arena *arena);
+
+void *arena_alloc(Arena *arena, size_t n);
+void arena_free(Arena *arena, void *object, size_t n);
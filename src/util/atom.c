@@ -0,0 +1,148 @@
+/*
+ * String Atoms
+ *
+ * An atom registry interns strings, such that each distinct string is stored
+ * exactly once. Users of a registry can thus compare two atoms of the same
+ * registry by comparing their pointers, rather than their content.
+ *
+ * Furthermore, any string can be resolved against a registry without creating
+ * a new atom. If an equal atom exists, it is returned, otherwise the string
+ * itself is returned. Since a string that is not part of the registry cannot
+ * be equal to any atom, the result can be compared to atoms by pointer, too.
+ */
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <c-ref.h>
+#include <stdlib.h>
+#include "util/atom.h"
+#include "util/error.h"
+
+static int atom_compare(CRBTree *tree, void *k, CRBNode *rb) {
+        Atom *atom = c_container_of(rb, Atom, registry_node);
+
+        return strcmp(k, atom->string);
+}
+
+static int atom_new(Atom **atomp, AtomRegistry *registry, const char *string) {
+        Atom *atom;
+        size_t n_string;
+
+        n_string = strlen(string) + 1;
+
+        atom = malloc(sizeof(*atom) + n_string);
+        if (!atom)
+                return error_origin(-ENOMEM);
+
+        *atom = (Atom)ATOM_NULL(*atom);
+        atom->registry = registry;
+        memcpy(atom->string, string, n_string);
+
+        *atomp = atom;
+        return 0;
+}
+
+/**
+ * atom_free() - destroy atom
+ * @n_refs:             reference counter of atom to destroy
+ * @userdata:           unused
+ *
+ * This is the reference-counter callback of atom objects. It unlinks the atom
+ * from its registry and releases it.
+ */
+void atom_free(_Atomic unsigned long *n_refs, void *userdata) {
+        Atom *atom = c_container_of(n_refs, Atom, n_refs);
+
+        c_rbtree_remove_init(&atom->registry->atom_tree, &atom->registry_node);
+        --atom->registry->n_atoms;
+        free(atom);
+}
+
+/**
+ * atom_registry_init() - initialize atom registry
+ * @registry:           registry to operate on
+ *
+ * This initializes a new, empty atom registry.
+ */
+void atom_registry_init(AtomRegistry *registry) {
+        *registry = (AtomRegistry)ATOM_REGISTRY_INIT;
+}
+
+/**
+ * atom_registry_deinit() - destroy atom registry
+ * @registry:           registry to operate on
+ *
+ * This destroys an atom registry. All atoms must have been released before.
+ */
+void atom_registry_deinit(AtomRegistry *registry) {
+        assert(c_rbtree_is_empty(&registry->atom_tree));
+        assert(!registry->n_atoms);
+}
+
+/**
+ * atom_registry_ref_atom() - intern string
+ * @registry:           registry to operate on
+ * @atomp:              output argument for the atom
+ * @string:             string to intern
+ *
+ * This looks up the atom equal to @string in @registry, or creates it if it
+ * does not exist, yet. A new reference to the atom is returned in @atomp.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int atom_registry_ref_atom(AtomRegistry *registry, Atom **atomp, const char *string) {
+        CRBNode **slot, *parent;
+        Atom *atom;
+        int r;
+
+        slot = c_rbtree_find_slot(&registry->atom_tree, atom_compare, string, &parent);
+        if (slot) {
+                r = atom_new(&atom, registry, string);
+                if (r)
+                        return error_trace(r);
+
+                c_rbtree_add(&registry->atom_tree, parent, slot, &atom->registry_node);
+                ++registry->n_atoms;
+        } else {
+                atom = atom_ref(c_container_of(parent, Atom, registry_node));
+        }
+
+        *atomp = atom;
+        return 0;
+}
+
+/**
+ * atom_registry_find_atom() - find atom of a string
+ * @registry:           registry to operate on
+ * @string:             string to look up
+ *
+ * This looks up the atom equal to @string in @registry. No reference is taken
+ * and no new atom is created.
+ *
+ * Return: The atom equal to @string, or NULL if no such atom exists.
+ */
+Atom *atom_registry_find_atom(AtomRegistry *registry, const char *string) {
+        return c_rbtree_find_entry(&registry->atom_tree, atom_compare, string, Atom, registry_node);
+}
+
+/**
+ * atom_registry_resolve() - resolve string to its atom
+ * @registry:           registry to operate on
+ * @string:             string to resolve, or NULL
+ *
+ * This looks up the atom equal to @string in @registry. No reference is taken
+ * and no new atom is created.
+ *
+ * Return: The string of the atom equal to @string, or @string itself if no
+ *         such atom exists.
+ */
+const char *atom_registry_resolve(AtomRegistry *registry, const char *string) {
+        Atom *atom;
+
+        if (!string)
+                return NULL;
+
+        atom = atom_registry_find_atom(registry, string);
+
+        return atom ? atom->string : string;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+/*
+ * String Atoms
+ */
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <c-ref.h>
+#include <stdlib.h>
+
+typedef struct Atom Atom;
+typedef struct AtomRegistry AtomRegistry;
+
+struct Atom {
+        _Atomic unsigned long n_refs;
+        AtomRegistry *registry;
+        CRBNode registry_node;
+        char string[];
+};
+
+#define ATOM_NULL(_x) {                                                         \
+                .n_refs = C_REF_INIT,                                           \
+                .registry_node = C_RBNODE_INIT((_x).registry_node),             \
+        }
+
+struct AtomRegistry {
+        CRBTree atom_tree;
+        size_t n_atoms;
+};
+
+#define ATOM_REGISTRY_INIT {                                                    \
+                .atom_tree = C_RBTREE_INIT,                                     \
+        }
+
+/* atoms */
+
+void atom_free(_Atomic unsigned long *n_refs, void *userdata);
+
+/* registry */
+
+void atom_registry_init(AtomRegistry *registry);
+void atom_registry_deinit(AtomRegistry *registry);
+
+int atom_registry_ref_atom(AtomRegistry *registry, Atom **atomp, const char *string);
+Atom *atom_registry_find_atom(AtomRegistry *registry, const char *string);
+const char *atom_registry_resolve(AtomRegistry *registry, const char *string);
+
+/* inline helpers */
+
+static inline Atom *atom_ref(Atom *atom) {
+        if (atom)
+                c_ref_inc(&atom->n_refs);
+        return atom;
+}
+
+static inline Atom *atom_unref(Atom *atom) {
+        if (atom)
+                c_ref_dec(&atom->n_refs, atom_free, NULL);
+        return NULL;
+}
+
+C_DEFINE_CLEANUP(Atom *, atom_unref);
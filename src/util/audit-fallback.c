@@ -1,5 +1,5 @@
 /*
- * Audit Helpers
+ * Audit Backend
  *
  * This fallback is used when libaudit is not available, and is meant to be
  * functionally equivalent to util/audit.c in case audit is disabled at
@@ -13,7 +13,7 @@
 #include "util/audit.h"
 #include "util/error.h"
 
-int util_audit_log(const char *message, uid_t uid) {
+int util_audit_backend_write(const char *message, uid_t uid) {
         int r;
 
         r = fputs(message, stderr);
@@ -23,10 +23,10 @@ int util_audit_log(const char *message, uid_t uid) {
         return 0;
 }
 
-int util_audit_init_global(void) {
+int util_audit_backend_open(void) {
         return 0;
 }
 
-void util_audit_deinit_global(void) {
+void util_audit_backend_close(void) {
         return;
 }
@@ -0,0 +1,319 @@
+/*
+ * Audit Queue
+ *
+ * Writing to the audit subsystem (or to stderr, as fallback) might block on
+ * the other side. Since denials are logged on the main thread, and can be
+ * triggered at will by any client, audit messages are never written there.
+ * Instead, util_audit_log() pushes them onto a bounded ring, which is drained
+ * by a helper thread that hands them to the audit backend. The helper thread
+ * wakes up via an eventfd.
+ *
+ * On top of that, messages are rate-limited and coalesced on the main thread,
+ * before they are ever queued. A message equal to the previously logged one
+ * (same text and same uid) is suppressed, and so is any message beyond
+ * UTIL_AUDIT_BURST messages per UTIL_AUDIT_INTERVAL, or any message that
+ * would not fit into the ring. The number of suppressed messages is logged
+ * right before the next message that makes it through. Duplicates are only
+ * coalesced within an interval, so a repeated denial is still logged at least
+ * once per interval.
+ *
+ * If the queue was not initialized, messages are written synchronously.
+ */
+
+#include <c-macro.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "util/audit.h"
+#include "util/error.h"
+#include "util/ring.h"
+
+typedef struct UtilAuditEntry UtilAuditEntry;
+
+struct UtilAuditEntry {
+        uid_t uid;
+        char message[];
+};
+
+static struct {
+        Ring *ring;
+        int eventfd;
+        pthread_t thread;
+        _Atomic bool stopped;
+
+        /* only touched by the main thread */
+        char *last;
+        uid_t last_uid;
+        uint64_t window;
+        size_t n_window;
+        uint64_t n_pending;
+        uint64_t n_logged;
+        uint64_t n_suppressed;
+} util_audit_queue = {
+        .eventfd = -1,
+};
+
+static uint64_t util_audit_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void util_audit_drain(void) {
+        UtilAuditEntry *entry;
+
+        /* audit logging is best-effort, failures are ignored */
+        while ((entry = ring_pop(util_audit_queue.ring))) {
+                util_audit_backend_write(entry->message, entry->uid);
+                free(entry);
+        }
+}
+
+static void *util_audit_thread(void *userdata) {
+        uint64_t n;
+        ssize_t l;
+
+        while (!atomic_load(&util_audit_queue.stopped)) {
+                l = read(util_audit_queue.eventfd, &n, sizeof(n));
+                if (l < 0 && errno == EINTR)
+                        continue;
+                else if (l != sizeof(n))
+                        break;
+
+                util_audit_drain();
+        }
+
+        util_audit_drain();
+        return NULL;
+}
+
+static int util_audit_push(const char *message, uid_t uid) {
+        UtilAuditEntry *entry;
+        size_t n_message;
+        uint64_t n = 1;
+        int r;
+
+        n_message = strlen(message);
+
+        entry = malloc(sizeof(*entry) + n_message + 1);
+        if (!entry)
+                return error_origin(-ENOMEM);
+
+        entry->uid = uid;
+        memcpy(entry->message, message, n_message + 1);
+
+        r = ring_push(util_audit_queue.ring, entry);
+        if (r) {
+                free(entry);
+                return error_trace(r);
+        }
+
+        if (write(util_audit_queue.eventfd, &n, sizeof(n)) < 0)
+                return error_origin(-errno);
+
+        return 0;
+}
+
+static int util_audit_push_suppressed(uid_t uid) {
+        char message[128];
+        int r;
+
+        if (!util_audit_queue.n_pending)
+                return 0;
+
+        r = snprintf(message, sizeof(message),
+                     "%" PRIu64 " more audit messages suppressed\n",
+                     util_audit_queue.n_pending);
+        assert(r > 0 && r < (int)sizeof(message));
+
+        r = util_audit_push(message, uid);
+        if (r)
+                return error_trace(r);
+
+        util_audit_queue.n_pending = 0;
+        return 0;
+}
+
+/**
+ * util_audit_log() - log a message to the audit subsystem
+ * @message:    the message to be logged
+ * @uid:        the UID of the user causing the message to be logged
+ *
+ * Queue the message to be logged to the audit subsystem. If audit is
+ * disabled, it is logged to stderr instead. The message might be suppressed,
+ * if it is a duplicate of the previous message, if too many messages were
+ * logged recently, or if the queue is full. Either way, this never blocks on
+ * the audit subsystem.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int util_audit_log(const char *message, uid_t uid) {
+        uint64_t now;
+        char *last;
+        int r;
+
+        if (!util_audit_queue.ring)
+                return error_trace(util_audit_backend_write(message, uid));
+
+        now = util_audit_now();
+        if (now - util_audit_queue.window >= UTIL_AUDIT_INTERVAL) {
+                util_audit_queue.window = now;
+                util_audit_queue.n_window = 0;
+                free(util_audit_queue.last);
+                util_audit_queue.last = NULL;
+        }
+
+        if ((util_audit_queue.last &&
+             util_audit_queue.last_uid == uid &&
+             !strcmp(util_audit_queue.last, message)) ||
+            util_audit_queue.n_window >= UTIL_AUDIT_BURST)
+                goto suppress;
+
+        last = strdup(message);
+        if (!last)
+                return error_origin(-ENOMEM);
+
+        free(util_audit_queue.last);
+        util_audit_queue.last = last;
+        util_audit_queue.last_uid = uid;
+
+        r = util_audit_push_suppressed(uid);
+        if (r) {
+                if (r == RING_E_FULL)
+                        goto suppress;
+
+                return error_fold(r);
+        }
+
+        r = util_audit_push(message, uid);
+        if (r) {
+                if (r == RING_E_FULL)
+                        goto suppress;
+
+                return error_fold(r);
+        }
+
+        ++util_audit_queue.n_window;
+        ++util_audit_queue.n_logged;
+        return 0;
+
+suppress:
+        ++util_audit_queue.n_pending;
+        ++util_audit_queue.n_suppressed;
+        return 0;
+}
+
+/**
+ * util_audit_get_stats() - query the audit queue statistics
+ * @n_loggedp:          output argument for the number of queued messages
+ * @n_suppressedp:      output argument for the number of suppressed messages
+ *
+ * This returns the number of messages that were queued for logging, and the
+ * number of messages that were suppressed, since the audit queue was
+ * initialized.
+ */
+void util_audit_get_stats(uint64_t *n_loggedp, uint64_t *n_suppressedp) {
+        *n_loggedp = util_audit_queue.n_logged;
+        *n_suppressedp = util_audit_queue.n_suppressed;
+}
+
+/**
+ * util_audit_init_global() - initialize the global audit context
+ *
+ * Initialize the global audit context, and spawn the helper thread that
+ * drains the audit queue. This must be called before any other audit
+ * function.
+ *
+ * Return: the 0 on success, negative error code on failure.
+ */
+int util_audit_init_global(void) {
+        sigset_t mask, oldmask;
+        int r;
+
+        assert(!util_audit_queue.ring);
+
+        r = util_audit_backend_open();
+        if (r)
+                return error_trace(r);
+
+        r = ring_new(&util_audit_queue.ring, UTIL_AUDIT_QUEUE_MAX);
+        if (r) {
+                r = error_trace(r);
+                goto error;
+        }
+
+        util_audit_queue.eventfd = eventfd(0, EFD_CLOEXEC);
+        if (util_audit_queue.eventfd < 0) {
+                r = error_origin(-errno);
+                goto error;
+        }
+
+        /*
+         * The helper thread inherits the signal mask of its creator. This
+         * might be called before the main thread blocks the signals it
+         * handles via signalfd, so block all of them explicitly. Otherwise,
+         * the helper thread might be picked to handle them.
+         */
+        sigfillset(&mask);
+        pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+        r = pthread_create(&util_audit_queue.thread, NULL, util_audit_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+        if (r) {
+                r = error_origin(-r);
+                goto error;
+        }
+
+        return 0;
+
+error:
+        if (util_audit_queue.eventfd >= 0) {
+                close(util_audit_queue.eventfd);
+                util_audit_queue.eventfd = -1;
+        }
+        util_audit_queue.ring = ring_free(util_audit_queue.ring);
+        util_audit_backend_close();
+        return r;
+}
+
+/**
+ * util_audit_deinit_global() - deinitialize the global audit context
+ *
+ * Deinitialize the resources initialized by util_audit_init_global(). Any
+ * queued messages are flushed first. This must be called exactly once, after
+ * which no more audit functions may be called.
+ */
+void util_audit_deinit_global(void) {
+        uint64_t n = 1;
+
+        if (util_audit_queue.eventfd >= 0) {
+                /* report pending suppressions, if there is room for it */
+                util_audit_push_suppressed(util_audit_queue.last_uid);
+
+                atomic_store(&util_audit_queue.stopped, true);
+
+                /* if the helper cannot be woken up, it might still use the ring */
+                if (write(util_audit_queue.eventfd, &n, sizeof(n)) != sizeof(n))
+                        return;
+
+                pthread_join(util_audit_queue.thread, NULL);
+
+                close(util_audit_queue.eventfd);
+                util_audit_queue.eventfd = -1;
+        }
+
+        util_audit_queue.ring = ring_free(util_audit_queue.ring);
+        free(util_audit_queue.last);
+        util_audit_queue.last = NULL;
+        util_audit_backend_close();
+}
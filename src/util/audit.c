@@ -1,5 +1,9 @@
 /*
- * Audit Helpers
+ * Audit Backend
+ *
+ * This backend writes audit messages to the audit subsystem via libaudit. If
+ * audit is disabled, messages are written to stderr instead. It is only ever
+ * called through the audit queue, see util/audit-queue.c.
  */
 
 #include <c-macro.h>
@@ -11,7 +15,7 @@
 static int audit_fd = -1;
 
 /**
- * util_audit_log() - log a message to the audit subsystem
+ * util_audit_backend_write() - write a message to the audit subsystem
  * @message:    the message to be logged
  * @uid:        the UID of the user causing the message to be logged
  *
@@ -20,7 +24,7 @@ static int audit_fd = -1;
  *
  * Return: 0 on success, or a negative error code on failure.
  */
-int util_audit_log(const char *message, uid_t uid) {
+int util_audit_backend_write(const char *message, uid_t uid) {
         int r;
 
         if (audit_fd >= 0) {
@@ -37,14 +41,13 @@ int util_audit_log(const char *message, uid_t uid) {
 }
 
 /**
- * util_audit_init_global() - initialize the global audit context
+ * util_audit_backend_open() - open the audit subsystem
  *
- * Initialize the global audit context. This must be called before any
- * other audit function.
+ * Open the connection to the audit subsystem, if available.
  *
  * Return: the 0 on success, negative error code on failure.
  */
-int util_audit_init_global(void) {
+int util_audit_backend_open(void) {
         assert(audit_fd < 0);
 
         audit_fd = audit_open();
@@ -53,13 +56,11 @@ int util_audit_init_global(void) {
 }
 
 /**
- * util_audit_deinit_global() - deinitialize the global audit context
+ * util_audit_backend_close() - close the audit subsystem
  *
- * Deinitialize the resources initialized by util_audit_init_global(). This
- * must be called exactly once, after which no more audit functions may be
- * called.
+ * Close the connection opened by util_audit_backend_open(), if any.
  */
-void util_audit_deinit_global(void) {
+void util_audit_backend_close(void) {
         if (audit_fd < 0)
                 return;
 
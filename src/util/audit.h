@@ -7,7 +7,20 @@
 #include <c-macro.h>
 #include <stdlib.h>
 
+/* holds several full bursts, in case auditd is slow to take them */
+#define UTIL_AUDIT_QUEUE_MAX (256UL)
+/* messages per interval, so a denial storm cannot flood the audit log */
+#define UTIL_AUDIT_BURST (64UL)
+#define UTIL_AUDIT_INTERVAL (UINT64_C(1000) * 1000 * 1000) /* nsecs */
+
 int util_audit_log(const char *message, uid_t uid);
+void util_audit_get_stats(uint64_t *n_loggedp, uint64_t *n_suppressedp);
 
 int util_audit_init_global(void);
 void util_audit_deinit_global(void);
+
+/* backends */
+
+int util_audit_backend_open(void);
+void util_audit_backend_close(void);
+int util_audit_backend_write(const char *message, uid_t uid);
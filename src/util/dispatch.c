@@ -40,15 +40,117 @@
  *               You must explicitly clear events once you handled them. The
  *               kernel never tells us about falling edges, so we must detect
  *               them manually (usually via EAGAIN).
+ *
+ * Additionally, every DispatchFile has a priority. Files of high and normal
+ * priority are all dispatched on every round, high priority files first.
+ * Files of low priority are dispatched after all others, and at most
+ * DISPATCH_LOW_PRIORITY_BURST of them per round, in round-robin order. This
+ * allows critical files to be served ahead of everyone else, and bulk work
+ * (like connection setup) to be moved out of the way of latency-sensitive
+ * files, without ever starving it.
+ *
+ * Lastly, a callback can yield. That is, it stops handling its events before
+ * it is done, and asks to be called again on the next round, regardless of
+ * its event masks. Since ready files are dispatched in order, this allows
+ * callbacks to bound the time they take, and share the loop round-robin with
+ * all other ready files.
+ *
+ * On top of files, a context provides timers. They are kept on a hierarchical
+ * timer wheel of DISPATCH_TIMER_LEVELS levels with DISPATCH_TIMER_SLOTS slots
+ * each, where every slot of a level spans a full turn of the level below it.
+ * Timers are linked into the slot of the lowest level that covers their
+ * deadline, and are moved down a level whenever the wheel reaches their slot,
+ * until they expire. Hence, arming and cancelling a timer is O(1). A single
+ * timerfd, registered as internal dispatch-file, is armed for the next slot
+ * that needs attention, and it is only ever re-armed if a new timer precedes
+ * it. A wakeup without any expired timer is harmless.
+ *
+ * Finally, a context can watch for stalls. If @stall_nsec is non-zero, every
+ * callback is timed, and any callback that takes at least that long is
+ * counted as stall, and reported to @stall_fn, if set. The callback is not
+ * passed on, since it might have released its file. Instead, users attribute
+ * a stall to the work the last callback did, which they can tell apart from
+ * earlier callbacks via @n_callbacks.
+ *
+ * Instead of epoll, a context can be backed by io_uring. Every file is then
+ * watched by a multishot poll, whose completions are merged into its events
+ * just like the epoll events are, so files and their callbacks behave the
+ * same on both backends. On top, files can submit sends through the ring,
+ * rather than issuing them right away. All operations staged by a dispatch
+ * round are submitted together, with the wait for the next events. A send
+ * raises EPOLLOUT once it completed, and its result is then fetched via
+ * dispatch_file_reap(). Since the kernel refers to files via user data, it
+ * is handed a DispatchHandle, which outlives its file if needed, until the
+ * kernel posted the last completion that refers to it.
  */
 
 #include <c-list.h>
 #include <c-macro.h>
 #include <c-ref.h>
+#include <stdalign.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 #include "util/dispatch.h"
 #include "util/error.h"
+#include "util/metrics.h"
+#include "util/uring.h"
+
+enum {
+        DISPATCH_OP_POLL,
+        DISPATCH_OP_SEND,
+        _DISPATCH_OP_N,
+};
+
+/* operations are tagged in the low bits of the handle address */
+#define DISPATCH_OP_MASK ((uint64_t)alignof(DispatchHandle) - 1)
+
+struct DispatchHandle {
+        DispatchFile *file;
+        unsigned int n_refs;
+        bool polling : 1;
+        bool sending : 1;
+        bool sent : 1;
+        int32_t result;
+};
+
+static_assert(_DISPATCH_OP_N <= alignof(DispatchHandle),
+              "Handle alignment too small for operation tags");
+
+static uint64_t dispatch_handle_data(DispatchHandle *handle, unsigned int op) {
+        return (uint64_t)(uintptr_t)handle | op;
+}
+
+static void dispatch_handle_unref(DispatchContext *ctx, DispatchHandle *handle) {
+        if (--handle->n_refs)
+                return;
+
+        --ctx->n_handles;
+        free(handle);
+}
+
+static CList *dispatch_file_get_list(DispatchFile *file) {
+        switch (file->priority) {
+        case DISPATCH_PRIORITY_HIGH:
+                return &file->context->high_list;
+        case DISPATCH_PRIORITY_LOW:
+                return &file->context->low_list;
+        default:
+                return &file->context->ready_list;
+        }
+}
+
+static bool dispatch_file_is_ready(DispatchFile *file) {
+        return (file->events & file->user_mask) || file->yielded;
+}
+
+static void dispatch_file_link(DispatchFile *file) {
+        if (dispatch_file_is_ready(file) && !c_list_is_linked(&file->ready_link))
+                c_list_link_tail(dispatch_file_get_list(file), &file->ready_link);
+}
 
 /**
  * dispatch_file_init() - initialize dispatch file
@@ -63,6 +165,9 @@
  * dispatch-context. The file-descriptor @fd is added to the epoll-set of @ctx
  * with the event mask @mask.
  *
+ * If @ctx is backed by io_uring, @fd is polled by the ring instead, and
+ * further operations can be submitted for @file through the ring.
+ *
  * Note that all event handling is always edge-triggered. Hence, EPOLLET must
  * not be passed in @mask, but is added automatically. Furthermore, the event
  * mask in @mask is used to select kernel events for edge-triggered mode. To
@@ -82,28 +187,50 @@ int dispatch_file_init(DispatchFile *file,
                        int fd,
                        uint32_t mask,
                        uint32_t events) {
+        DispatchHandle *handle = NULL;
         int r;
 
         assert(!(mask & EPOLLET));
         assert(!(events & ~mask));
 
-        r = epoll_ctl(ctx->epoll_fd,
-                      EPOLL_CTL_ADD,
-                      fd,
-                      &(struct epoll_event) {
-                                .events = mask | EPOLLET,
-                                .data.ptr = file,
-                      });
-        if (r < 0)
-                return error_origin(-errno);
+        if (ctx->uring) {
+                handle = calloc(1, sizeof(*handle));
+                if (!handle)
+                        return error_origin(-ENOMEM);
+
+                r = uring_poll(ctx->uring, fd, mask, dispatch_handle_data(handle, DISPATCH_OP_POLL));
+                if (r) {
+                        free(handle);
+                        return error_fold(r);
+                }
+
+                /* one reference for the file, and one for the poll */
+                handle->file = file;
+                handle->n_refs = 2;
+                handle->polling = true;
+                ++ctx->n_handles;
+        } else {
+                r = epoll_ctl(ctx->epoll_fd,
+                              EPOLL_CTL_ADD,
+                              fd,
+                              &(struct epoll_event) {
+                                        .events = mask | EPOLLET,
+                                        .data.ptr = file,
+                              });
+                if (r < 0)
+                        return error_origin(-errno);
+        }
 
         file->context = ctx;
         file->ready_link = (CList)C_LIST_INIT(file->ready_link);
         file->fn = fn;
         file->fd = fd;
+        file->priority = DISPATCH_PRIORITY_NORMAL;
+        file->yielded = false;
         file->user_mask = 0;
         file->kernel_mask = mask;
         file->events = events;
+        file->handle = handle;
 
         ++file->context->n_files;
 
@@ -123,6 +250,7 @@ int dispatch_file_init(DispatchFile *file,
  * dispatch_file_deinit() *BEFORE* closing the FD.
  */
 void dispatch_file_deinit(DispatchFile *file) {
+        DispatchHandle *handle;
         int r;
 
         if (file->context) {
@@ -139,8 +267,31 @@ void dispatch_file_deinit(DispatchFile *file) {
                  * epoll-set, and require it to succeed. If the removal fails,
                  * you did something wrong and better fix it.
                  */
-                r = epoll_ctl(file->context->epoll_fd, EPOLL_CTL_DEL, file->fd, NULL);
-                assert(r >= 0);
+                if (file->handle) {
+                        handle = file->handle;
+
+                        /*
+                         * The same holds for the poll of the ring. On top,
+                         * the caller releases the buffers of a pending send
+                         * once we return, so it must complete first. Once
+                         * detached, the handle merely waits for the kernel
+                         * to post its last completions.
+                         */
+                        dispatch_file_flush(file);
+
+                        if (handle->polling) {
+                                r = uring_poll_remove(file->context->uring,
+                                                      dispatch_handle_data(handle, DISPATCH_OP_POLL));
+                                assert(!r);
+                        }
+
+                        handle->file = NULL;
+                        dispatch_handle_unref(file->context, handle);
+                        file->handle = NULL;
+                } else {
+                        r = epoll_ctl(file->context->epoll_fd, EPOLL_CTL_DEL, file->fd, NULL);
+                        assert(r >= 0);
+                }
 
                 --file->context->n_files;
                 c_list_unlink_init(&file->ready_link);
@@ -172,8 +323,7 @@ void dispatch_file_select(DispatchFile *file, uint32_t mask) {
         assert(!(mask & ~file->kernel_mask));
 
         file->user_mask |= mask;
-        if ((file->user_mask & file->events) && !c_list_is_linked(&file->ready_link))
-                c_list_link_tail(&file->context->ready_list, &file->ready_link);
+        dispatch_file_link(file);
 }
 
 /**
@@ -188,7 +338,7 @@ void dispatch_file_deselect(DispatchFile *file, uint32_t mask) {
         assert(!(mask & ~file->kernel_mask));
 
         file->user_mask &= ~mask;
-        if (!(file->events & file->user_mask))
+        if (!dispatch_file_is_ready(file))
                 c_list_unlink_init(&file->ready_link);
 }
 
@@ -205,8 +355,452 @@ void dispatch_file_clear(DispatchFile *file, uint32_t mask) {
         assert(!(mask & ~file->kernel_mask));
 
         file->events &= ~mask;
-        if (!(file->events & file->user_mask))
+        if (!dispatch_file_is_ready(file))
+                c_list_unlink_init(&file->ready_link);
+}
+
+/**
+ * dispatch_file_raise() - raise kernel events
+ * @file:               dispatch file
+ * @mask:               event mask
+ *
+ * This adds the events in @mask to the pending kernel event mask, as if the
+ * kernel signalled them. This is meant for files that get notified through
+ * a side-channel, rather than their own file-descriptor. The callback must
+ * cope with events that turn out to be spurious.
+ */
+void dispatch_file_raise(DispatchFile *file, uint32_t mask) {
+        assert(!(mask & ~file->kernel_mask));
+
+        file->events |= mask;
+        dispatch_file_link(file);
+}
+
+/**
+ * dispatch_file_set_priority() - change dispatch priority
+ * @file:               dispatch file
+ * @priority:           DISPATCH_PRIORITY_* to use
+ *
+ * This changes the priority @file is dispatched with. If @file is currently
+ * ready, it is moved to the tail of the ready-list of its new priority.
+ */
+void dispatch_file_set_priority(DispatchFile *file, unsigned int priority) {
+        assert(priority == DISPATCH_PRIORITY_NORMAL ||
+               priority == DISPATCH_PRIORITY_LOW ||
+               priority == DISPATCH_PRIORITY_HIGH);
+
+        if (file->priority == priority)
+                return;
+
+        file->priority = priority;
+        if (c_list_is_linked(&file->ready_link)) {
                 c_list_unlink_init(&file->ready_link);
+                dispatch_file_link(file);
+        }
+}
+
+/**
+ * dispatch_file_yield() - dispatch file again on the next round
+ * @file:               dispatch file
+ *
+ * This marks @file as ready, regardless of its event masks, such that its
+ * callback is invoked again on the next dispatch round. This is meant to be
+ * called by callbacks that stopped handling their events before being done,
+ * so they can continue where they left off, after all other ready files had
+ * their turn.
+ *
+ * The mark is dropped when the callback is invoked next.
+ */
+void dispatch_file_yield(DispatchFile *file) {
+        file->yielded = true;
+        dispatch_file_link(file);
+}
+
+/**
+ * dispatch_file_sendmsg() - submit send through the dispatcher
+ * @file:               dispatch file
+ * @msg:                message to send
+ * @flags:              MSG_* flags of the send
+ *
+ * This stages a sendmsg(2) of @msg on the file-descriptor of @file, to be
+ * submitted with the next poll of its context. Only a single send can be
+ * pending per file. Once it completed, EPOLLOUT is raised on @file, and its
+ * result must be fetched via dispatch_file_reap() before the next send can be
+ * staged. A send that would block raises nothing, though, since the kernel
+ * signals EPOLLOUT anyway once it can be retried.
+ *
+ * The message header is copied, but the buffers it points to must stay valid
+ * until the send completed. The send must not block, so @flags must contain
+ * MSG_DONTWAIT.
+ *
+ * This must only be called if dispatch_file_can_submit() is true.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int dispatch_file_sendmsg(DispatchFile *file, const struct msghdr *msg, int flags) {
+        DispatchHandle *handle = file->handle;
+        int r;
+
+        assert(handle && !handle->sending);
+        assert(file->kernel_mask & EPOLLOUT);
+        assert(flags & MSG_DONTWAIT);
+
+        r = uring_sendmsg(file->context->uring,
+                          file->fd,
+                          msg,
+                          flags,
+                          dispatch_handle_data(handle, DISPATCH_OP_SEND));
+        if (r)
+                return error_fold(r);
+
+        ++handle->n_refs;
+        handle->sending = true;
+        handle->sent = false;
+        return 0;
+}
+
+/**
+ * dispatch_file_reap() - fetch result of submitted send
+ * @file:               dispatch file
+ * @resultp:            output argument for the result
+ *
+ * This fetches the result of the send staged via dispatch_file_sendmsg(), if
+ * it completed. The result is what sendmsg(2) would have returned, with
+ * errors returned as negative error code. Afterwards, the next send can be
+ * staged. If the send is still pending, nothing is changed.
+ *
+ * Return: True if the send completed, false if it is still pending.
+ */
+bool dispatch_file_reap(DispatchFile *file, ssize_t *resultp) {
+        DispatchHandle *handle = file->handle;
+
+        assert(handle && handle->sending);
+
+        if (!handle->sent)
+                return false;
+
+        handle->sending = false;
+        handle->sent = false;
+        *resultp = handle->result;
+        return true;
+}
+
+static int dispatch_context_reap(DispatchContext *ctx);
+
+/**
+ * dispatch_file_flush() - wait for submitted send
+ * @file:               dispatch file
+ *
+ * This submits all staged operations of the context of @file, and waits until
+ * the pending send of @file, if any, completed. Its result is left to be
+ * fetched via dispatch_file_reap(). Other completions fetched meanwhile are
+ * merged as usual.
+ *
+ * This is meant to be called before releasing the buffers of a pending send.
+ * Since sends never block, this does not wait on the peer.
+ */
+void dispatch_file_flush(DispatchFile *file) {
+        DispatchHandle *handle = file->handle;
+        int r;
+
+        if (!handle)
+                return;
+
+        /*
+         * This is called from teardown paths that cannot fail, and sends
+         * complete right away. Hence, any failure here is a bug.
+         */
+        while (handle->sending && !handle->sent) {
+                r = uring_submit(file->context->uring, -1);
+                assert(!r);
+
+                r = dispatch_context_reap(file->context);
+                assert(!r);
+        }
+}
+
+static uint64_t dispatch_timer_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return (ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000) / DISPATCH_TIMER_TICK_USEC;
+}
+
+static void dispatch_context_link_timer(DispatchContext *ctx, DispatchTimer *timer) {
+        uint64_t now = ctx->timer_now, deadline = timer->deadline;
+        size_t level;
+
+        assert(deadline > now);
+
+        /*
+         * Pick the lowest level where @deadline is within the current turn
+         * of the next level. That is, all bits above this level are equal to
+         * @now, and the slot of @deadline is past the slot of @now.
+         */
+        for (level = 0; level < DISPATCH_TIMER_LEVELS; ++level)
+                if ((deadline >> (DISPATCH_TIMER_BITS * (level + 1))) ==
+                    (now >> (DISPATCH_TIMER_BITS * (level + 1))))
+                        break;
+
+        if (level >= DISPATCH_TIMER_LEVELS) {
+                timer->level = DISPATCH_TIMER_LEVELS;
+                timer->slot = 0;
+                c_list_link_tail(&ctx->timer_overflow, &timer->wheel_link);
+                return;
+        }
+
+        timer->level = level;
+        timer->slot = (deadline >> (DISPATCH_TIMER_BITS * level)) & (DISPATCH_TIMER_SLOTS - 1);
+        c_list_link_tail(&ctx->timer_slots[timer->level][timer->slot], &timer->wheel_link);
+        ctx->timer_maps[timer->level] |= UINT64_C(1) << timer->slot;
+}
+
+static uint64_t dispatch_context_next_tick(DispatchContext *ctx) {
+        uint64_t map, now = ctx->timer_now;
+        size_t level, shift;
+
+        /*
+         * Return the first tick after @now at which any slot of the wheel is
+         * reached. Only slots past the current slot of each level can be
+         * occupied, and lower levels are always reached first.
+         */
+        for (level = 0; level < DISPATCH_TIMER_LEVELS; ++level) {
+                shift = DISPATCH_TIMER_BITS * level;
+                map = ctx->timer_maps[level] & ~((UINT64_C(2) << ((now >> shift) & (DISPATCH_TIMER_SLOTS - 1))) - 1);
+                if (map)
+                        return ((now >> (shift + DISPATCH_TIMER_BITS)) << (shift + DISPATCH_TIMER_BITS)) |
+                               ((uint64_t)__builtin_ctzll(map) << shift);
+        }
+
+        if (!c_list_is_empty(&ctx->timer_overflow))
+                return ((now >> (DISPATCH_TIMER_BITS * DISPATCH_TIMER_LEVELS)) + 1) << (DISPATCH_TIMER_BITS * DISPATCH_TIMER_LEVELS);
+
+        return UINT64_MAX;
+}
+
+static void dispatch_context_advance(DispatchContext *ctx, uint64_t tick) {
+        CList todo = (CList)C_LIST_INIT(todo);
+        DispatchTimer *timer;
+        uint64_t next;
+        size_t level, slot;
+
+        while ((next = dispatch_context_next_tick(ctx)) <= tick) {
+                ctx->timer_now = next;
+
+                /* collect all slots that start at @next */
+                for (level = 0; level < DISPATCH_TIMER_LEVELS; ++level) {
+                        if (next & ((UINT64_C(1) << (DISPATCH_TIMER_BITS * level)) - 1))
+                                break;
+
+                        slot = (next >> (DISPATCH_TIMER_BITS * level)) & (DISPATCH_TIMER_SLOTS - 1);
+                        c_list_splice(&todo, &ctx->timer_slots[level][slot]);
+                        ctx->timer_maps[level] &= ~(UINT64_C(1) << slot);
+                }
+
+                if (!(next & ((UINT64_C(1) << (DISPATCH_TIMER_BITS * DISPATCH_TIMER_LEVELS)) - 1)))
+                        c_list_splice(&todo, &ctx->timer_overflow);
+
+                /* expire due timers and move all others down the wheel */
+                while ((timer = c_list_first_entry(&todo, DispatchTimer, wheel_link))) {
+                        c_list_unlink_init(&timer->wheel_link);
+
+                        if (timer->deadline <= next) {
+                                timer->level = DISPATCH_TIMER_LEVELS;
+                                timer->slot = 0;
+                                c_list_link_tail(&ctx->timer_expired, &timer->wheel_link);
+                        } else {
+                                dispatch_context_link_timer(ctx, timer);
+                        }
+                }
+        }
+
+        ctx->timer_now = c_max(ctx->timer_now, tick);
+}
+
+static int dispatch_context_arm(DispatchContext *ctx);
+
+static int dispatch_context_dispatch_timers(DispatchFile *file) {
+        DispatchContext *ctx = c_container_of(file, DispatchContext, timer_file);
+        DispatchTimer *timer;
+        uint64_t v;
+        ssize_t l;
+        int r;
+
+        l = read(ctx->timer_fd, &v, sizeof(v));
+        if (l < 0) {
+                if (errno != EAGAIN)
+                        return error_origin(-errno);
+        } else {
+                assert(l == sizeof(v));
+                ctx->timer_armed = UINT64_MAX;
+        }
+
+        dispatch_file_clear(file, EPOLLIN);
+
+        dispatch_context_advance(ctx, dispatch_timer_now());
+
+        r = dispatch_context_arm(ctx);
+        if (r)
+                return error_trace(r);
+
+        while ((timer = c_list_first_entry(&ctx->timer_expired, DispatchTimer, wheel_link))) {
+                c_list_unlink_init(&timer->wheel_link);
+
+                r = timer->fn(timer);
+                if (r) {
+                        /* continue with the remaining timers on the next round */
+                        if (!c_list_is_empty(&ctx->timer_expired))
+                                dispatch_file_yield(file);
+
+                        return r;
+                }
+        }
+
+        return 0;
+}
+
+static int dispatch_context_arm(DispatchContext *ctx) {
+        struct itimerspec spec = {};
+        uint64_t next, usec;
+        int r;
+
+        /*
+         * Never re-arm the timerfd for a later time than it is armed for
+         * already. If the timer it was armed for got cancelled, we merely get
+         * a spurious wakeup, but save a syscall on every cancellation. And in
+         * the common case, new timers expire after the pending ones anyway.
+         */
+        next = dispatch_context_next_tick(ctx);
+        if (next >= ctx->timer_armed)
+                return 0;
+
+        if (ctx->timer_fd < 0) {
+                ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+                if (ctx->timer_fd < 0)
+                        return error_origin(-errno);
+
+                r = dispatch_file_init(&ctx->timer_file,
+                                       ctx,
+                                       dispatch_context_dispatch_timers,
+                                       ctx->timer_fd,
+                                       EPOLLIN,
+                                       0);
+                if (r) {
+                        ctx->timer_fd = c_close(ctx->timer_fd);
+                        return error_fold(r);
+                }
+
+                dispatch_file_select(&ctx->timer_file, EPOLLIN);
+        }
+
+        usec = next * DISPATCH_TIMER_TICK_USEC;
+        spec.it_value.tv_sec = usec / UINT64_C(1000000);
+        spec.it_value.tv_nsec = (usec % UINT64_C(1000000)) * UINT64_C(1000);
+
+        r = timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+        if (r < 0)
+                return error_origin(-errno);
+
+        ctx->timer_armed = next;
+        return 0;
+}
+
+/**
+ * dispatch_timer_init() - initialize dispatch timer
+ * @timer:              dispatch timer
+ * @ctx:                dispatch context
+ * @fn:                 callback function
+ *
+ * This initializes a new dispatch-timer on the given dispatch-context. The
+ * timer is not armed. Use dispatch_timer_arm() to schedule it.
+ */
+void dispatch_timer_init(DispatchTimer *timer, DispatchContext *ctx, DispatchTimerFn fn) {
+        *timer = (DispatchTimer)DISPATCH_TIMER_NULL(*timer);
+        timer->context = ctx;
+        timer->fn = fn;
+}
+
+/**
+ * dispatch_timer_deinit() - deinitialize dispatch timer
+ * @timer:              dispatch timer
+ *
+ * This cancels @timer, if armed, and puts it into a deinitialized state.
+ * Hence, it is safe to call this function multiple times.
+ */
+void dispatch_timer_deinit(DispatchTimer *timer) {
+        if (timer->context)
+                dispatch_timer_cancel(timer);
+
+        timer->fn = NULL;
+        timer->context = NULL;
+}
+
+/**
+ * dispatch_timer_arm() - arm dispatch timer
+ * @timer:              dispatch timer
+ * @timeout:            relative timeout in microseconds
+ *
+ * This schedules @timer to expire @timeout microseconds from now, rounded up
+ * to the next tick of the timer wheel. If @timer is already armed, it is
+ * re-scheduled. Once expired, its callback is invoked from the dispatch loop,
+ * and the timer is no longer armed. Its return code is propagated like the
+ * return code of a dispatch-file callback.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int dispatch_timer_arm(DispatchTimer *timer, uint64_t timeout) {
+        DispatchContext *ctx = timer->context;
+        uint64_t now;
+        size_t level;
+        int r;
+
+        dispatch_timer_cancel(timer);
+
+        now = dispatch_timer_now();
+
+        /*
+         * The wheel only advances when timers expire. If it is empty anyway,
+         * move it to the current time, so new timers are placed relative to
+         * it, instead of to the last expiry.
+         */
+        for (level = 0; level < DISPATCH_TIMER_LEVELS; ++level)
+                if (ctx->timer_maps[level])
+                        break;
+        if (level >= DISPATCH_TIMER_LEVELS && c_list_is_empty(&ctx->timer_overflow))
+                ctx->timer_now = c_max(ctx->timer_now, now);
+
+        timer->deadline = now + (timeout + DISPATCH_TIMER_TICK_USEC - 1) / DISPATCH_TIMER_TICK_USEC;
+        timer->deadline = c_max(timer->deadline, ctx->timer_now + 1);
+        dispatch_context_link_timer(ctx, timer);
+
+        r = dispatch_context_arm(ctx);
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
+/**
+ * dispatch_timer_cancel() - cancel dispatch timer
+ * @timer:              dispatch timer
+ *
+ * This cancels @timer, if it is armed. Its callback will not be invoked. If
+ * @timer is not armed, this is a no-op.
+ */
+void dispatch_timer_cancel(DispatchTimer *timer) {
+        DispatchContext *ctx = timer->context;
+
+        if (!dispatch_timer_is_armed(timer))
+                return;
+
+        c_list_unlink_init(&timer->wheel_link);
+
+        if (timer->level < DISPATCH_TIMER_LEVELS &&
+            c_list_is_empty(&ctx->timer_slots[timer->level][timer->slot]))
+                ctx->timer_maps[timer->level] &= ~(UINT64_C(1) << timer->slot);
 }
 
 /**
@@ -218,8 +812,16 @@ void dispatch_file_clear(DispatchFile *file, uint32_t mask) {
  * Return: 0 on success, negative error code on failure.
  */
 int dispatch_context_init(DispatchContext *ctx) {
+        size_t i, j;
+
         *ctx = (DispatchContext)DISPATCH_CONTEXT_NULL(*ctx);
 
+        for (i = 0; i < DISPATCH_TIMER_LEVELS; ++i)
+                for (j = 0; j < DISPATCH_TIMER_SLOTS; ++j)
+                        ctx->timer_slots[i][j] = (CList)C_LIST_INIT(ctx->timer_slots[i][j]);
+
+        ctx->timer_now = dispatch_timer_now();
+
         ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
         if (ctx->epoll_fd < 0)
                 return error_origin(-errno);
@@ -227,20 +829,74 @@ int dispatch_context_init(DispatchContext *ctx) {
         return 0;
 }
 
+/**
+ * dispatch_context_init_uring() - back dispatch context by io_uring
+ * @ctx:                dispatch context
+ *
+ * This switches @ctx from epoll to io_uring. It must be called right after
+ * dispatch_context_init(), before any dispatch-file is registered. If neither
+ * the kernel nor the build support it, @ctx is left unchanged, and continues
+ * to use epoll.
+ *
+ * Return: 0 on success, DISPATCH_E_UNSUPPORTED if io_uring is not available,
+ *         negative error code on failure.
+ */
+int dispatch_context_init_uring(DispatchContext *ctx) {
+        int r;
+
+        assert(!ctx->n_files);
+        assert(!ctx->uring);
+
+        r = uring_new(&ctx->uring);
+        if (r) {
+                if (r == URING_E_UNSUPPORTED)
+                        return DISPATCH_E_UNSUPPORTED;
+
+                return error_fold(r);
+        }
+
+        ctx->epoll_fd = c_close(ctx->epoll_fd);
+        return 0;
+}
+
 /**
  * dispatch_context_deinit() - deinitialize dispatch context
  * @ctx:                dispatch context
  *
  * This deinitializes a dispatch context. The caller must make sure no
- * dispatch-file is registered on it.
+ * dispatch-file is registered on it, and no dispatch-timer is armed on it.
  *
  * The context will be set into an deinitialized state afterwards. Hence, it is
  * safe to call this function multiple times.
  */
 void dispatch_context_deinit(DispatchContext *ctx) {
+        size_t i;
+        int r;
+
+        for (i = 0; i < DISPATCH_TIMER_LEVELS; ++i)
+                assert(!ctx->timer_maps[i]);
+        assert(c_list_is_empty(&ctx->timer_overflow));
+        assert(c_list_is_empty(&ctx->timer_expired));
+
+        dispatch_file_deinit(&ctx->timer_file);
+        ctx->timer_fd = c_close(ctx->timer_fd);
+        ctx->timer_armed = UINT64_MAX;
+
         assert(!ctx->n_files);
+        assert(c_list_is_empty(&ctx->high_list));
         assert(c_list_is_empty(&ctx->ready_list));
+        assert(c_list_is_empty(&ctx->low_list));
+
+        /* the kernel might still refer to handles of deinitialized files */
+        while (ctx->n_handles) {
+                r = uring_submit(ctx->uring, -1);
+                assert(!r);
+
+                r = dispatch_context_reap(ctx);
+                assert(!r);
+        }
 
+        ctx->uring = uring_free(ctx->uring);
         ctx->epoll_fd = c_close(ctx->epoll_fd);
 }
 
@@ -257,27 +913,35 @@ void dispatch_context_deinit(DispatchContext *ctx) {
  * dispatch-files. Nothing is dispatched! The data is merely fetched from the
  * kernel.
  *
+ * At most DISPATCH_EVENTS_MAX events are fetched at a time, into a buffer
+ * owned by @ctx. Any further events stay queued in the kernel, and are
+ * fetched on the next call. Since all files are edge-triggered, this does not
+ * lose any events, and the cost of a call does not scale with the number of
+ * registered files.
+ *
+ * If @ctx is backed by io_uring, this submits all staged operations instead,
+ * waits for completions with the same @timeout, and merges them likewise.
+ *
  * Return: 0 on success, negative error code on failure.
  */
 int dispatch_context_poll(DispatchContext *ctx, int timeout) {
-        _c_cleanup_(c_freep) void *buffer = NULL;
-        struct epoll_event *events, *e;
+        struct epoll_event *e;
         DispatchFile *f;
-        size_t n;
         int r;
 
-        n = ctx->n_files * sizeof(*events);
-        if (n > 128UL * 1024UL) {
-                buffer = malloc(n);
-                if (!buffer)
-                        return error_origin(-ENOMEM);
+        if (ctx->uring) {
+                r = uring_submit(ctx->uring, timeout);
+                if (r)
+                        return error_fold(r);
 
-                events = buffer;
-        } else {
-                events = alloca(n);
+                r = dispatch_context_reap(ctx);
+                if (r)
+                        return error_trace(r);
+
+                return 0;
         }
 
-        r = epoll_wait(ctx->epoll_fd, events, ctx->n_files, timeout);
+        r = epoll_wait(ctx->epoll_fd, ctx->events, C_ARRAY_SIZE(ctx->events), timeout);
         if (r < 0) {
                 if (errno == EINTR)
                         return 0;
@@ -286,27 +950,193 @@ int dispatch_context_poll(DispatchContext *ctx, int timeout) {
         }
 
         while (r > 0) {
-                e = &events[--r];
+                e = &ctx->events[--r];
                 f = e->data.ptr;
 
                 assert(f->context == ctx);
 
                 f->events |= e->events & f->kernel_mask;
-                if ((f->events & f->user_mask) && !c_list_is_linked(&f->ready_link))
-                        c_list_link_tail(&f->context->ready_list, &f->ready_link);
+                dispatch_file_link(f);
         }
 
         return 0;
 }
 
+static int dispatch_context_complete(DispatchContext *ctx, const UringCompletion *completion) {
+        DispatchHandle *handle;
+        DispatchFile *file;
+        int r;
+
+        /* removals of polls are not tracked, only the polls themselves */
+        if (!completion->data)
+                return 0;
+
+        handle = (DispatchHandle *)(uintptr_t)(completion->data & ~DISPATCH_OP_MASK);
+        file = handle->file;
+
+        switch (completion->data & DISPATCH_OP_MASK) {
+        case DISPATCH_OP_POLL:
+                /* polls of live files are never cancelled, so this is a bug */
+                if (file && completion->res < 0)
+                        return error_origin(completion->res);
+
+                if (file) {
+                        file->events |= completion->res & file->kernel_mask;
+                        dispatch_file_link(file);
+                }
+
+                if (completion->more)
+                        break;
+
+                /*
+                 * The kernel terminates multishot polls if it cannot post
+                 * their completions in place, so re-arm it, unless it was
+                 * removed along with its file.
+                 */
+                if (file) {
+                        r = uring_poll(ctx->uring, file->fd, file->kernel_mask, completion->data);
+                        if (r)
+                                return error_fold(r);
+                } else {
+                        handle->polling = false;
+                        dispatch_handle_unref(ctx, handle);
+                }
+
+                break;
+        case DISPATCH_OP_SEND:
+                handle->result = completion->res;
+                handle->sent = true;
+
+                if (file && completion->res != -EAGAIN)
+                        dispatch_file_raise(file, EPOLLOUT);
+
+                dispatch_handle_unref(ctx, handle);
+                break;
+        default:
+                assert(0);
+                break;
+        }
+
+        return 0;
+}
+
+static int dispatch_context_reap(DispatchContext *ctx) {
+        UringCompletion completion;
+        size_t i;
+        int r;
+
+        /* bounded like epoll_wait(), further completions stay queued */
+        for (i = 0; i < DISPATCH_EVENTS_MAX; ++i) {
+                r = uring_reap(ctx->uring, &completion);
+                if (r == URING_E_EMPTY)
+                        break;
+                else if (r)
+                        return error_fold(r);
+
+                r = dispatch_context_complete(ctx, &completion);
+                if (r)
+                        return error_trace(r);
+        }
+
+        return 0;
+}
+
+static void dispatch_context_check_stall(DispatchContext *ctx, uint64_t timestamp) {
+        uint64_t nsec;
+
+        nsec = metrics_get_time(METRICS_CLOCK_CYCLES) - timestamp;
+        if (nsec < ctx->stall_nsec)
+                return;
+
+        ++ctx->n_stalls;
+        if (ctx->stall_fn)
+                ctx->stall_fn(ctx, nsec);
+}
+
+static int dispatch_context_run(DispatchContext *ctx, CList *list, size_t n_max) {
+        CList todo = (CList)C_LIST_INIT(todo);
+        DispatchFile *file;
+        uint64_t ts;
+        int r = 0;
+
+        /*
+         * We want to dispatch @list exactly once here. The trivial approach
+         * would be to iterate it via c_list_for_each(). However, we want to
+         * allow callbacks to modify their event masks, so we must allow them
+         * to add and remove files arbitrarily. At the same time, we want to
+         * prevent dispatching a single file twice, so we must make sure to
+         * detect detach+reattach cycles to avoid starvation.
+         *
+         * Therefore, we simply fetch the entire list into @todo and handle it
+         * one-by-one, moving them back onto their ready-list (unless they
+         * were only ready because they yielded). This is safe against
+         * entry-removal in the callbacks, and it has a clearly determined
+         * runtime.
+         *
+         * If @n_max is reached, the remaining files are put back to the
+         * front of @list, so they are the first to be dispatched next time.
+         */
+        c_list_swap(&todo, list);
+
+        while (n_max-- > 0 && (file = c_list_first_entry(&todo, DispatchFile, ready_link))) {
+                c_list_unlink_init(&file->ready_link);
+                file->yielded = false;
+                dispatch_file_link(file);
+
+                ++ctx->n_callbacks;
+
+                if (_c_unlikely_(ctx->stall_nsec)) {
+                        ts = metrics_get_time(METRICS_CLOCK_CYCLES);
+                        r = file->fn(file);
+                        dispatch_context_check_stall(ctx, ts);
+                } else {
+                        r = file->fn(file);
+                }
+                if (error_trace(r))
+                        break;
+        }
+
+        c_list_splice(&todo, list);
+        c_list_swap(list, &todo);
+
+        assert(c_list_is_empty(&todo));
+        return r;
+}
+
+static bool dispatch_context_is_idle(DispatchContext *ctx) {
+        return c_list_is_empty(&ctx->high_list) &&
+               c_list_is_empty(&ctx->ready_list) &&
+               c_list_is_empty(&ctx->low_list);
+}
+
+static uint64_t dispatch_context_now_usec(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
 /**
  * dispatch_context_dispatch() - dispatch pending events
  * @ctx:                dispatch context
  *
  * This runs one dispatch round on the given dispatch context. That is, it
- * dispatches all pending events and calls into the callbacks of the respective
+ * dispatches all pending events of high priority, then all pending events of
+ * normal priority, and then up to DISPATCH_LOW_PRIORITY_BURST pending events
+ * of low priority, and calls into the callbacks of the respective
  * dispatch-file.
  *
+ * If nothing is pending, this blocks until an event arrives. If
+ * @ctx->busy_poll_usec is non-zero, the kernel is polled without blocking for
+ * up to that many microseconds first.
+ *
+ * If @ctx->stall_nsec is non-zero, every callback that runs for at least that
+ * many nanoseconds is counted in @ctx->n_stalls, and reported to
+ * @ctx->stall_fn.
+ *
  * The first non-zero return code of any dispatch-file callback will break the
  * loop and cause a propagation of that error code to the caller.
  *
@@ -314,40 +1144,34 @@ int dispatch_context_poll(DispatchContext *ctx, int timeout) {
  *         dispatched file stops dispatching and is returned unmodified.
  */
 int dispatch_context_dispatch(DispatchContext *ctx) {
-        CList todo = (CList)C_LIST_INIT(todo);
-        DispatchFile *file;
+        uint64_t deadline;
         int r;
 
-        r = dispatch_context_poll(ctx, c_list_is_empty(&ctx->ready_list) ? -1 : 0);
-        if (r)
-                return error_fold(r);
-
         /*
-         * We want to dispatch @ctx->ready_list exactly once here. The trivial
-         * approach would be to iterate it via c_list_for_each(). However, we
-         * want to allow callbacks to modify their event masks, so we must
-         * allow them to add and remove files arbitrarily. At the same time, we
-         * want to prevent dispatching a single file twice, so we must make
-         * sure to detect detach+reattach cycles to avoid starvation.
-         *
-         * Therefore, we simply fetch the entire ready-list into @todo and
-         * handle it one-by-one, moving them back onto the ready-list. This is
-         * safe against entry-removal in the callbacks, and it has a clearly
-         * determined runtime.
+         * If nothing is ready and busy-polling is enabled, spin on the kernel
+         * for a bounded interval before going to sleep. This trades CPU time
+         * for not paying the scheduler wake-up latency on the next event.
          */
-        c_list_swap(&todo, &ctx->ready_list);
+        if (ctx->busy_poll_usec && dispatch_context_is_idle(ctx)) {
+                deadline = dispatch_context_now_usec() + ctx->busy_poll_usec;
+                do {
+                        r = dispatch_context_poll(ctx, 0);
+                        if (r)
+                                return error_fold(r);
+                } while (dispatch_context_is_idle(ctx) && dispatch_context_now_usec() < deadline);
+        }
 
-        while ((file = c_list_first_entry(&todo, DispatchFile, ready_link))) {
-                c_list_unlink(&file->ready_link);
-                c_list_link_tail(&ctx->ready_list, &file->ready_link);
+        r = dispatch_context_poll(ctx, dispatch_context_is_idle(ctx) ? -1 : 0);
+        if (r)
+                return error_fold(r);
 
-                r = file->fn(file);
-                if (error_trace(r)) {
-                        c_list_splice(&ctx->ready_list, &todo);
-                        break;
-                }
-        }
+        r = dispatch_context_run(ctx, &ctx->high_list, SIZE_MAX);
+        if (r)
+                return r;
 
-        assert(c_list_is_empty(&todo));
-        return r;
+        r = dispatch_context_run(ctx, &ctx->ready_list, SIZE_MAX);
+        if (r)
+                return r;
+
+        return dispatch_context_run(ctx, &ctx->low_list, DISPATCH_LOW_PRIORITY_BURST);
 }
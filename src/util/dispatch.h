@@ -8,17 +8,41 @@
 #include <c-macro.h>
 #include <c-ref.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+typedef struct Uring Uring;
 
 enum {
         _DISPATCH_E_SUCCESS,
 
         DISPATCH_E_EXIT,
         DISPATCH_E_FAILURE,
+        DISPATCH_E_UNSUPPORTED,
+};
+
+enum {
+        DISPATCH_PRIORITY_NORMAL,
+        DISPATCH_PRIORITY_LOW,
+        DISPATCH_PRIORITY_HIGH,
 };
 
+#define DISPATCH_LOW_PRIORITY_BURST (16) /* connection setups per round, so a login storm cannot delay traffic */
+#define DISPATCH_EVENTS_MAX (256) /* more stay in the kernel until the next call, nothing is lost */
+
+/* timer wheel geometry: 1ms ticks, 64 slots per level, ~4.6h until overflow */
+#define DISPATCH_TIMER_TICK_USEC (1000ULL)
+#define DISPATCH_TIMER_BITS (6)
+#define DISPATCH_TIMER_SLOTS (1U << DISPATCH_TIMER_BITS)
+#define DISPATCH_TIMER_LEVELS (4)
+
 typedef struct DispatchContext DispatchContext;
 typedef struct DispatchFile DispatchFile;
+typedef struct DispatchHandle DispatchHandle;
+typedef struct DispatchTimer DispatchTimer;
 typedef int (*DispatchFn) (DispatchFile *file);
+typedef int (*DispatchTimerFn) (DispatchTimer *timer);
+typedef void (*DispatchStallFn) (DispatchContext *ctx, uint64_t nsec);
 
 /* files */
 
@@ -28,9 +52,13 @@ struct DispatchFile {
         DispatchFn fn;
 
         int fd;
+        unsigned int priority;
+        bool yielded;
         uint32_t user_mask;
         uint32_t kernel_mask;
         uint32_t events;
+
+        DispatchHandle *handle;
 };
 
 #define DISPATCH_FILE_NULL(_x) {                                \
@@ -49,21 +77,78 @@ void dispatch_file_deinit(DispatchFile *file);
 void dispatch_file_select(DispatchFile *file, uint32_t mask);
 void dispatch_file_deselect(DispatchFile *file, uint32_t mask);
 void dispatch_file_clear(DispatchFile *file, uint32_t mask);
+void dispatch_file_raise(DispatchFile *file, uint32_t mask);
+void dispatch_file_set_priority(DispatchFile *file, unsigned int priority);
+void dispatch_file_yield(DispatchFile *file);
+
+int dispatch_file_sendmsg(DispatchFile *file, const struct msghdr *msg, int flags);
+bool dispatch_file_reap(DispatchFile *file, ssize_t *resultp);
+void dispatch_file_flush(DispatchFile *file);
+
+/* timers */
+
+struct DispatchTimer {
+        DispatchContext *context;
+        CList wheel_link;
+        DispatchTimerFn fn;
+
+        uint64_t deadline;
+        uint8_t level;
+        uint8_t slot;
+};
+
+#define DISPATCH_TIMER_NULL(_x) {                               \
+                .wheel_link = C_LIST_INIT((_x).wheel_link),     \
+        }
+
+void dispatch_timer_init(DispatchTimer *timer, DispatchContext *ctx, DispatchTimerFn fn);
+void dispatch_timer_deinit(DispatchTimer *timer);
+
+int dispatch_timer_arm(DispatchTimer *timer, uint64_t timeout);
+void dispatch_timer_cancel(DispatchTimer *timer);
 
 /* contexts */
 
 struct DispatchContext {
+        CList high_list;
         CList ready_list;
+        CList low_list;
         int epoll_fd;
+        Uring *uring;
         size_t n_files;
+        size_t n_handles;
+        uint64_t busy_poll_usec;
+        struct epoll_event events[DISPATCH_EVENTS_MAX];
+
+        uint64_t n_callbacks;
+        uint64_t n_stalls;
+        uint64_t stall_nsec;
+        DispatchStallFn stall_fn;
+
+        int timer_fd;
+        DispatchFile timer_file;
+        uint64_t timer_now;
+        uint64_t timer_armed;
+        uint64_t timer_maps[DISPATCH_TIMER_LEVELS];
+        CList timer_slots[DISPATCH_TIMER_LEVELS][DISPATCH_TIMER_SLOTS];
+        CList timer_overflow;
+        CList timer_expired;
 };
 
-#define DISPATCH_CONTEXT_NULL(_x) {                             \
-                .ready_list = C_LIST_INIT((_x).ready_list),     \
-                .epoll_fd = -1,                                 \
+#define DISPATCH_CONTEXT_NULL(_x) {                                     \
+                .high_list = C_LIST_INIT((_x).high_list),               \
+                .ready_list = C_LIST_INIT((_x).ready_list),             \
+                .low_list = C_LIST_INIT((_x).low_list),                 \
+                .epoll_fd = -1,                                         \
+                .timer_fd = -1,                                         \
+                .timer_file = DISPATCH_FILE_NULL((_x).timer_file),      \
+                .timer_armed = UINT64_MAX,                              \
+                .timer_overflow = C_LIST_INIT((_x).timer_overflow),     \
+                .timer_expired = C_LIST_INIT((_x).timer_expired),       \
         }
 
 int dispatch_context_init(DispatchContext *ctx);
+int dispatch_context_init_uring(DispatchContext *ctx);
 void dispatch_context_deinit(DispatchContext *ctx);
 
 int dispatch_context_poll(DispatchContext *ctx, int timeout);
@@ -74,3 +159,11 @@ int dispatch_context_dispatch(DispatchContext *ctx);
 static inline uint32_t dispatch_file_events(DispatchFile *file) {
         return file->events & file->user_mask;
 }
+
+static inline bool dispatch_file_can_submit(DispatchFile *file) {
+        return file->handle;
+}
+
+static inline bool dispatch_timer_is_armed(DispatchTimer *timer) {
+        return c_list_is_linked(&timer->wheel_link);
+}
@@ -7,6 +7,16 @@
  *
  * Furthermore, the FDList object is meant as supplement for AF_UNIX sockets.
  * Hence, it stores FDs as a cmsghdr entry, ready to be used with sendmsg(2).
+ *
+ * FDList objects are allocated at message rate on busses that pass FDs, so
+ * they are served from pools, one for each capacity class. Lists of more FDs
+ * than a single SCM_RIGHTS message can carry are allocated directly.
+ *
+ * To receive FDs, a list of the largest class serves as control buffer for
+ * recvmsg(2), see fdlist_new_control(). If the received FDs need the largest
+ * class anyway, that list is used as is, rather than copying the FDs. Small
+ * sets of FDs are copied into a list of their class, so messages queued for
+ * a long time do not pin the full control buffer.
  */
 
 #include <c-macro.h>
@@ -14,6 +24,52 @@
 #include <sys/socket.h>
 #include "util/error.h"
 #include "util/fdlist.h"
+#include "util/pool.h"
+
+#define FDLIST_SIZE(_n_fds) (sizeof(FDList) + CMSG_SPACE(sizeof(int) * (_n_fds)))
+
+static const size_t fdlist_classes[] = { 4, 16, 64, FDLIST_FDS_MAX };
+
+static Pool fdlist_pools[] = {
+        POOL_INIT(fdlist_pools[0], "FDList/4", FDLIST_SIZE(4), FDLIST_POOL_MAX),
+        POOL_INIT(fdlist_pools[1], "FDList/16", FDLIST_SIZE(16), FDLIST_POOL_MAX),
+        POOL_INIT(fdlist_pools[2], "FDList/64", FDLIST_SIZE(64), FDLIST_POOL_MAX),
+        POOL_INIT(fdlist_pools[3], "FDList/253", FDLIST_SIZE(FDLIST_FDS_MAX), FDLIST_POOL_MAX),
+};
+
+static_assert(C_ARRAY_SIZE(fdlist_classes) == C_ARRAY_SIZE(fdlist_pools),
+              "Every FDList capacity class needs a pool");
+
+static unsigned int fdlist_class(size_t n_fds) {
+        unsigned int i;
+
+        for (i = 0; i < C_ARRAY_SIZE(fdlist_classes); ++i)
+                if (n_fds <= fdlist_classes[i])
+                        break;
+
+        return i;
+}
+
+static FDList *fdlist_alloc(size_t n_fds) {
+        unsigned int n_class;
+        FDList *list;
+
+        n_class = fdlist_class(n_fds);
+        if (n_class < C_ARRAY_SIZE(fdlist_pools))
+                list = pool_alloc(&fdlist_pools[n_class]);
+        else
+                list = malloc(FDLIST_SIZE(n_fds));
+        if (!list)
+                return NULL;
+
+        list->n_class = n_class;
+        list->consumed = false;
+        list->cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        list->cmsg->cmsg_level = SOL_SOCKET;
+        list->cmsg->cmsg_type = SCM_RIGHTS;
+
+        return list;
+}
 
 /**
  * fdlist_new_with_fds() - create fdlist with a set of FDs
@@ -29,15 +85,12 @@
 int fdlist_new_with_fds(FDList **listp, const int *fds, size_t n_fds) {
         FDList *list;
 
-        list = malloc(sizeof(*list) + CMSG_SPACE(n_fds * sizeof(int)));
+        list = fdlist_alloc(n_fds);
         if (!list)
                 return error_origin(-ENOMEM);
 
-        list->consumed = false;
-        list->cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
-        list->cmsg->cmsg_level = SOL_SOCKET;
-        list->cmsg->cmsg_type = SCM_RIGHTS;
-        memcpy(fdlist_data(list), fds, n_fds * sizeof(int));
+        if (n_fds)
+                memcpy(fdlist_data(list), fds, n_fds * sizeof(int));
 
         *listp = list;
         return 0;
@@ -64,6 +117,61 @@ int fdlist_new_consume_fds(FDList **listp, const int *fds, size_t n_fds) {
         return r;
 }
 
+/**
+ * fdlist_new_control() - create fdlist to receive FDs into
+ * @listp:              output for new fdlist
+ *
+ * This creates a new, empty fdlist with room for FDLIST_FDS_MAX FDs. Its
+ * cmsghdr can be passed to recvmsg(2) as control buffer of size
+ * FDLIST_CONTROL_SIZE. Whatever is received into it is not owned by the
+ * fdlist, until it is passed to fdlist_consume_control().
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int fdlist_new_control(FDList **listp) {
+        FDList *list;
+
+        list = fdlist_alloc(FDLIST_FDS_MAX);
+        if (!list)
+                return error_origin(-ENOMEM);
+
+        list->cmsg->cmsg_len = CMSG_LEN(0);
+
+        *listp = list;
+        return 0;
+}
+
+/**
+ * fdlist_consume_control() - create fdlist from received FDs
+ * @listp:              output for new fdlist
+ * @controlp:           control buffer the FDs were received into
+ * @fds:                FD array to import, pointing into @controlp
+ * @n_fds:              array size of @fds
+ *
+ * This is the same as fdlist_new_consume_fds(), but @fds must have been
+ * received into the control buffer @controlp, see fdlist_new_control(). If
+ * @fds is the first control message of @controlp, and a smaller fdlist
+ * would not do, the control buffer itself is turned into the new fdlist,
+ * and @controlp is cleared. Otherwise, the FDs are copied and @controlp is
+ * left untouched.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int fdlist_consume_control(FDList **listp, FDList **controlp, const int *fds, size_t n_fds) {
+        FDList *control = *controlp;
+
+        if (fds == fdlist_data(control) &&
+            n_fds == fdlist_count(control) &&
+            fdlist_class(n_fds) == control->n_class) {
+                control->consumed = true;
+                *listp = control;
+                *controlp = NULL;
+                return 0;
+        }
+
+        return error_trace(fdlist_new_consume_fds(listp, fds, n_fds));
+}
+
 /**
  * fdlist_free() - free fdlist
  * @list:               fdlist to operate on, or NULL
@@ -88,7 +196,10 @@ FDList *fdlist_free(FDList *list) {
                         for (i = 0; i < n; ++i)
                                 c_close(p[i]);
 
-                free(list);
+                if (list->n_class < C_ARRAY_SIZE(fdlist_pools))
+                        pool_free(&fdlist_pools[list->n_class], list);
+                else
+                        free(list);
         }
 
         return NULL;
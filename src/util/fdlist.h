@@ -10,13 +10,20 @@
 
 typedef struct FDList FDList;
 
+#define FDLIST_FDS_MAX (253UL) /* taken from kernel SCM_MAX_FD */
+#define FDLIST_POOL_MAX (64) /* per size class, about 64KiB even in the largest one */
+#define FDLIST_CONTROL_SIZE CMSG_SPACE(sizeof(int) * FDLIST_FDS_MAX)
+
 struct FDList {
+        unsigned int n_class;
         bool consumed : 1;
         struct cmsghdr cmsg[];
 };
 
 int fdlist_new_with_fds(FDList **listp, const int *fds, size_t n_fds);
 int fdlist_new_consume_fds(FDList **listp, const int *fds, size_t n_fds);
+int fdlist_new_control(FDList **listp);
+int fdlist_consume_control(FDList **listp, FDList **controlp, const int *fds, size_t n_fds);
 FDList *fdlist_free(FDList *list);
 void fdlist_truncate(FDList *list, size_t n_fds);
 int fdlist_steal(FDList *list, size_t index);
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * String Hashing
+ *
+ * This implements FNV-1a over byte strings, followed by the 64-bit finalizer
+ * of MurmurHash3 to spread the low bits, which are used as bucket index by
+ * our power-of-two sized hash tables. The finalizer is available on its own
+ * as hash_u64(), to hash integer keys.
+ *
+ * The raw FNV-1a state can be fed incrementally via hash_string_feed(). This
+ * allows callers to hash all prefixes of a string in a single pass, which is
+ * what the reverse-DNS prefix lookups of names rely on.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+
+#define HASH_STRING_INIT UINT64_C(0xcbf29ce484222325)
+
+static inline uint64_t hash_string_feed(uint64_t state, const char *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; ++i) {
+                state ^= (unsigned char)s[i];
+                state *= UINT64_C(0x100000001b3);
+        }
+
+        return state;
+}
+
+static inline uint64_t hash_u64(uint64_t v) {
+        v ^= v >> 33;
+        v *= UINT64_C(0xff51afd7ed558ccd);
+        v ^= v >> 33;
+        v *= UINT64_C(0xc4ceb9fe1a85ec53);
+        v ^= v >> 33;
+
+        return v;
+}
+
+static inline uint64_t hash_string_finalize(uint64_t state) {
+        return hash_u64(state);
+}
+
+static inline uint64_t hash_string(const char *s) {
+        return hash_string_finalize(hash_string_feed(HASH_STRING_INIT, s, strlen(s)));
+}
@@ -0,0 +1,131 @@
+/*
+ * Open-Addressing Hash Tables
+ *
+ * A hash table indexes objects that are owned by its caller, using open
+ * addressing with linear probing over a power-of-two sized array of buckets.
+ * The table only stores pointers to the objects. It never compares them, so
+ * lookups are done by the caller, walking the probe sequence of a hash via
+ * hash_table_for_each_probe(). This keeps the comparison inline on the hot
+ * lookup paths. The hash of an entry is only queried via a callback when
+ * entries are moved, which happens on resize and on removal.
+ *
+ * The table is kept at most half full, and removal shifts following entries
+ * backwards, so no tombstones are needed and every probe sequence ends at the
+ * first empty bucket. Tables that grew once, but went idle again, release
+ * their buckets.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/error.h"
+#include "util/hashtable.h"
+
+static void hash_table_place(HashTable *table, void *entry, HashTableHashFn fn) {
+        size_t i;
+
+        for (i = fn(entry) & (table->n_buckets - 1); table->buckets[i]; i = hash_table_next(table, i))
+                /* empty */ ;
+
+        table->buckets[i] = entry;
+}
+
+/**
+ * hash_table_reserve() - make room for a new entry
+ * @table:              table to operate on
+ * @fn:                 hash function of the entries
+ * @n_min:              minimum number of buckets
+ *
+ * This makes sure @table can take one more entry, growing it if required.
+ * Growing invalidates all bucket indices, so the caller must probe for the
+ * new entry only afterwards. The number of buckets must be a power of two.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int hash_table_reserve(HashTable *table, HashTableHashFn fn, size_t n_min) {
+        void **buckets = table->buckets;
+        size_t i, n_buckets = table->n_buckets;
+
+        if ((table->n_entries + 1) * 2 <= n_buckets)
+                return 0;
+
+        table->buckets = calloc(c_max(n_buckets * 2, n_min), sizeof(*table->buckets));
+        if (!table->buckets) {
+                table->buckets = buckets;
+                return error_origin(-ENOMEM);
+        }
+
+        table->n_buckets = c_max(n_buckets * 2, n_min);
+
+        for (i = 0; i < n_buckets; ++i)
+                if (buckets[i])
+                        hash_table_place(table, buckets[i], fn);
+
+        free(buckets);
+        return 0;
+}
+
+/**
+ * hash_table_insert() - insert entry
+ * @table:              table to operate on
+ * @i:                  bucket to insert into
+ * @entry:              entry to insert
+ *
+ * This inserts @entry into bucket @i, which must be the empty bucket the probe
+ * sequence of the hash of @entry ended on. Room must have been made via
+ * hash_table_reserve() before probing.
+ */
+void hash_table_insert(HashTable *table, size_t i, void *entry) {
+        assert(i < table->n_buckets);
+        assert(!table->buckets[i]);
+        assert((table->n_entries + 1) * 2 <= table->n_buckets);
+
+        table->buckets[i] = entry;
+        ++table->n_entries;
+}
+
+/**
+ * hash_table_remove() - remove entry
+ * @table:              table to operate on
+ * @i:                  bucket to remove
+ * @fn:                 hash function of the entries
+ * @n_min:              minimum number of buckets
+ *
+ * This removes the entry in bucket @i. All following entries of the probe
+ * sequence are shifted back, if the hole is between their home bucket and
+ * their position. If the table is left empty, and it grew beyond @n_min
+ * buckets, its buckets are released.
+ */
+void hash_table_remove(HashTable *table, size_t i, HashTableHashFn fn, size_t n_min) {
+        size_t mask = table->n_buckets - 1, j, k;
+
+        assert(i < table->n_buckets);
+        assert(table->buckets[i]);
+
+        table->buckets[i] = NULL;
+        --table->n_entries;
+
+        for (j = (i + 1) & mask; table->buckets[j]; j = (j + 1) & mask) {
+                k = fn(table->buckets[j]) & mask;
+
+                if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+                        table->buckets[i] = table->buckets[j];
+                        table->buckets[j] = NULL;
+                        i = j;
+                }
+        }
+
+        if (!table->n_entries && table->n_buckets > n_min)
+                hash_table_deinit(table);
+}
+
+/**
+ * hash_table_deinit() - deinitialize table
+ * @table:              table to operate on
+ *
+ * This releases the buckets of @table and resets it to an empty table. The
+ * entries are not touched, they are owned by the caller.
+ */
+void hash_table_deinit(HashTable *table) {
+        free(table->buckets);
+        *table = (HashTable)HASH_TABLE_INIT;
+}
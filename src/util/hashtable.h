@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * Open-Addressing Hash Tables
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+
+typedef struct HashTable HashTable;
+
+typedef uint64_t (*HashTableHashFn) (void *entry);
+
+struct HashTable {
+        void **buckets;
+        size_t n_buckets;
+        size_t n_entries;
+};
+
+#define HASH_TABLE_INIT {}
+
+int hash_table_reserve(HashTable *table, HashTableHashFn fn, size_t n_min);
+void hash_table_insert(HashTable *table, size_t i, void *entry);
+void hash_table_remove(HashTable *table, size_t i, HashTableHashFn fn, size_t n_min);
+void hash_table_deinit(HashTable *table);
+
+/* inline helpers */
+
+static inline size_t hash_table_next(HashTable *table, size_t i) {
+        return (i + 1) & (table->n_buckets - 1);
+}
+
+/**
+ * hash_table_for_each_probe() - iterate the probe sequence of a hash
+ * @_entry:             iterator variable for the entries
+ * @_i:                 iterator variable for the bucket index
+ * @_table:             table to operate on
+ * @_hash:              hash to probe for
+ *
+ * This iterates all entries on the probe sequence of @_hash, up to the first
+ * empty bucket. Once the loop is left, @_i is the bucket of the current entry,
+ * or the empty bucket the sequence ended on, which is where a new entry with
+ * hash @_hash has to be inserted. The table must not be empty.
+ */
+#define hash_table_for_each_probe(_entry, _i, _table, _hash)                    \
+        for ((_i) = (_hash) & ((_table)->n_buckets - 1);                        \
+             ((_entry) = (_table)->buckets[_i]);                                \
+             (_i) = hash_table_next((_table), (_i)))
@@ -2,49 +2,229 @@
  * Metrics Helper
  *
  * The metrics object is used to compute the min/max/avg/std deviation of samples of
- * CPU time, in fixed size and without memory allocations.
+ * CPU time or wall-clock time, in fixed size and without memory allocations.
  *
  * The values of min/max/avg are meant to be read out of the struct directly, whereas
  * the standard deviation can only be accessed using a helper function (as it is not
  * actually stored directly, but computed on-demand).
  *
  * Only one sample may be active at any point in time, and every sample that is started,
- * must be stopped.
+ * must be stopped. A metrics object can be set to only measure one in every N samples
+ * on average, so the cost of reading the clock is only paid for a fraction of them. The
+ * number of samples skipped in between is picked at random, so the measured samples do
+ * not alias with periodic patterns of the workload. The statistics then describe the
+ * measured samples only.
  *
  * See `Note on a Method for Calculating Corrected Sums of Squares and Products' by
  * W. P. Welford, 1962.
+ *
+ * The histogram object records the distribution of samples, so tail latencies
+ * can be read out. It uses log-linear buckets, as popularized by HdrHistogram:
+ * every power-of-two range is split into a fixed number of linear buckets. This
+ * needs a fixed amount of memory, bounds the relative error of every read-out,
+ * and recording a sample is a constant-time operation.
+ *
+ * Reading the CPU time of a thread is a syscall, and even the vDSO-accelerated
+ * wall-clock takes tens of nanoseconds. METRICS_CLOCK_CYCLES instead reads the
+ * cycle counter of the CPU directly, and converts it to nanoseconds with a
+ * fixed-point factor. On x86-64, the factor is calibrated against the
+ * monotonic clock once, and the counter is only used if the kernel itself
+ * trusts it as clocksource, which implies it is invariant and synchronized
+ * across CPUs. On AArch64, the virtual counter has an architected frequency,
+ * so no calibration is needed.
  */
 
 #include <c-macro.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include "util/hash.h"
 #include "util/metrics.h"
 
+#if defined(__x86_64__) || defined(__aarch64__)
+#  define METRICS_HAVE_CYCLES 1
+#else
+#  define METRICS_HAVE_CYCLES 0
+#endif
+
+static struct {
+        bool calibrated;
+        bool available;
+        uint64_t base_cycles;
+        uint64_t base_nsec;
+        uint64_t mult;
+} metrics_cycles;
+
 void metrics_init(Metrics *metrics) {
         *metrics = (Metrics)METRICS_INIT;
 }
 
 void metrics_deinit(Metrics *metrics) {
-        assert(!metrics->timestamp);
+        assert(!metrics->running);
         metrics_init(metrics);
 }
 
+static uint64_t metrics_read_clock(clockid_t clock) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(clock, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+#if METRICS_HAVE_CYCLES
+
+static uint64_t metrics_read_cycles(void) {
+#  if defined(__x86_64__)
+        return __builtin_ia32_rdtsc();
+#  else
+        uint64_t v;
+
+        __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+        return v;
+#  endif
+}
+
+static uint64_t metrics_calibrate_frequency(void) {
+#  if defined(__x86_64__)
+        uint64_t c0, c1, t0, t1;
+        char buffer[32] = {};
+        FILE *f;
+
+        f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "re");
+        if (!f)
+                return 0;
+
+        if (!fgets(buffer, sizeof(buffer), f))
+                buffer[0] = 0;
+        fclose(f);
+
+        if (strcmp(buffer, "tsc\n"))
+                return 0;
+
+        t0 = metrics_read_clock(METRICS_CLOCK_WALL);
+        c0 = metrics_read_cycles();
+        do {
+                t1 = metrics_read_clock(METRICS_CLOCK_WALL);
+                c1 = metrics_read_cycles();
+        } while (t1 - t0 < METRICS_CALIBRATION_NSEC);
+
+        if (c1 <= c0)
+                return 0;
+
+        return (c1 - c0) * UINT64_C(1000000000) / (t1 - t0);
+#  else
+        uint64_t v;
+
+        __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(v));
+        return v;
+#  endif
+}
+
+#endif
+
 /**
- * metrics_get_time() - get the current thread CPU time
+ * metrics_calibrate() - calibrate the cycle counter
  *
- * Read the current thread CPU time to be used to record samples.
+ * This determines whether the cycle counter of the CPU can be used for
+ * METRICS_CLOCK_CYCLES, and its frequency. It is done implicitly on the first
+ * read of METRICS_CLOCK_CYCLES, but may take a millisecond, so callers should
+ * do it upfront. Calling it more than once has no effect.
+ */
+void metrics_calibrate(void) {
+#if METRICS_HAVE_CYCLES
+        uint64_t frequency;
+#endif
+
+        if (metrics_cycles.calibrated)
+                return;
+
+        metrics_cycles.calibrated = true;
+
+#if METRICS_HAVE_CYCLES
+        frequency = metrics_calibrate_frequency();
+        if (!frequency)
+                return;
+
+        metrics_cycles.mult = (uint64_t)(((unsigned __int128)UINT64_C(1000000000) << 32) / frequency);
+        metrics_cycles.base_nsec = metrics_read_clock(METRICS_CLOCK_WALL);
+        metrics_cycles.base_cycles = metrics_read_cycles();
+        metrics_cycles.available = true;
+#endif
+}
+
+static uint64_t metrics_get_cycles_time(void) {
+#if METRICS_HAVE_CYCLES
+        uint64_t delta;
+
+        if (_c_unlikely_(!metrics_cycles.calibrated))
+                metrics_calibrate();
+
+        if (_c_likely_(metrics_cycles.available)) {
+                delta = metrics_read_cycles() - metrics_cycles.base_cycles;
+                return metrics_cycles.base_nsec + (uint64_t)(((unsigned __int128)delta * metrics_cycles.mult) >> 32);
+        }
+#endif
+
+        return metrics_read_clock(METRICS_CLOCK_WALL);
+}
+
+/**
+ * metrics_get_time() - get the current time
+ * @clock:              clock to read
+ *
+ * Read the current time of @clock to be used to record samples. This is
+ * usually METRICS_CLOCK_CPU to measure the CPU time of the current thread,
+ * or METRICS_CLOCK_WALL to measure wall-clock time, including time spent
+ * blocked or preempted. METRICS_CLOCK_CYCLES measures wall-clock time as
+ * well, but is considerably cheaper to read.
  *
  * Return: the timestamp in nano seconds.
  */
-uint64_t metrics_get_time(void) {
-        struct timespec ts;
-        int r;
+uint64_t metrics_get_time(clockid_t clock) {
+        if (clock == METRICS_CLOCK_CYCLES)
+                return metrics_get_cycles_time();
 
-        r = clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
-        assert(r >= 0);
+        return metrics_read_clock(clock);
+}
 
-        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+/**
+ * metrics_set_sample_rate() - set the sample rate
+ * @metrics:            object to operate on
+ * @sample_rate:        measure one in @sample_rate samples
+ *
+ * This makes @metrics only measure one in @sample_rate samples that are
+ * started, on average. The others are skipped without reading the clock. A
+ * rate of 0 is treated as 1, that is, every sample is measured. The next
+ * sample started is always measured.
+ */
+void metrics_set_sample_rate(Metrics *metrics, unsigned int sample_rate) {
+        metrics->sample_rate = sample_rate ?: 1;
+        metrics->n_skip = 0;
+        metrics->seed = metrics_read_clock(METRICS_CLOCK_WALL);
+}
+
+static unsigned int metrics_next_skip(Metrics *metrics) {
+        uint64_t v;
+
+        if (metrics->sample_rate <= 1)
+                return 0;
+
+        /*
+         * Pick the number of samples to skip uniformly from [0, 2 * (rate - 1)].
+         * This averages to (rate - 1), so every sample is measured with a
+         * probability of 1/rate in the long run, regardless of any periodic
+         * pattern in the workload. The generator is a Weyl sequence, mixed
+         * with the 64-bit finalizer of util/hash.h.
+         */
+        metrics->seed += UINT64_C(0x9e3779b97f4a7c15);
+        v = hash_u64(metrics->seed);
+
+        return v % (2 * (uint64_t)(metrics->sample_rate - 1) + 1);
 }
 
 /**
@@ -54,11 +234,13 @@ uint64_t metrics_get_time(void) {
  *
  * Update the internal state with a new sample, started at @timestamp
  * and ending at the time the function is called.
+ *
+ * Return: the sample in nano seconds.
  */
-void metrics_sample_add(Metrics *metrics, uint64_t timestamp) {
+uint64_t metrics_sample_add(Metrics *metrics, uint64_t timestamp) {
         uint64_t sample, average_old;
 
-        sample = metrics_get_time() - timestamp;
+        sample = metrics_get_time(metrics->clock) - timestamp;
 
         metrics->count ++;
         metrics->sum += sample;
@@ -72,6 +254,8 @@ void metrics_sample_add(Metrics *metrics, uint64_t timestamp) {
 
         if (metrics->maximum < sample)
                 metrics->maximum = sample;
+
+        return sample;
 }
 
 /**
@@ -79,11 +263,20 @@ void metrics_sample_add(Metrics *metrics, uint64_t timestamp) {
  * @metrics:            object to operate on
  *
  * Start a new sample by recording the current timestamp, verifying that
- * a sample is not currently running.
+ * a sample is not currently running. If the sample is skipped due to the
+ * sample rate, no timestamp is recorded.
  */
 void metrics_sample_start(Metrics *metrics) {
-        assert(!metrics->timestamp);
-        metrics->timestamp = metrics_get_time();
+        assert(!metrics->running);
+        metrics->running = true;
+
+        if (metrics->n_skip) {
+                --metrics->n_skip;
+                return;
+        }
+
+        metrics->n_skip = metrics_next_skip(metrics);
+        metrics->timestamp = metrics_get_time(metrics->clock);
 }
 
 /**
@@ -91,13 +284,28 @@ void metrics_sample_start(Metrics *metrics) {
  * @metrics:            object to operate on
  *
  * End a currently running sample, and update the internal state.
+ *
+ * The returned estimate is the measured sample scaled by the sample rate,
+ * or 0 if the sample was skipped. Since every sample is measured with the
+ * same probability, summed up over many samples this is an unbiased estimate
+ * of the total time, so callers can use it to account the samples to their
+ * own counters.
+ *
+ * Return: the estimated sample in nano seconds.
  */
-void metrics_sample_end(Metrics *metrics) {
-        assert(metrics->timestamp);
+uint64_t metrics_sample_end(Metrics *metrics) {
+        uint64_t sample;
 
-        metrics_sample_add(metrics, metrics->timestamp);
+        assert(metrics->running);
+        metrics->running = false;
+
+        if (!metrics->timestamp)
+                return 0;
 
+        sample = metrics_sample_add(metrics, metrics->timestamp);
         metrics->timestamp = 0;
+
+        return sample * metrics->sample_rate;
 }
 
 /**
@@ -119,3 +327,138 @@ double metrics_read_standard_deviation(Metrics *metrics) {
 
         return sqrt(metrics->sum_of_squares / metrics->count);
 }
+
+void histogram_init(Histogram *histogram, clockid_t clock) {
+        *histogram = (Histogram)HISTOGRAM_INIT(clock);
+}
+
+void histogram_deinit(Histogram *histogram) {
+        assert(!histogram->timestamp);
+        histogram_init(histogram, histogram->clock);
+}
+
+static size_t histogram_bucket(uint64_t value) {
+        unsigned int exponent;
+
+        if (value < HISTOGRAM_SUB_BUCKETS)
+                return value;
+
+        exponent = 63 - __builtin_clzll(value);
+
+        return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+               ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static uint64_t histogram_bucket_maximum(size_t bucket) {
+        unsigned int shift;
+        uint64_t base;
+
+        if (bucket < HISTOGRAM_SUB_BUCKETS)
+                return bucket;
+
+        shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+        base = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+
+        return (base << shift) + ((UINT64_C(1) << shift) - 1);
+}
+
+/**
+ * histogram_add() - add one value
+ * @histogram:          object to operate on
+ * @value:              value to add
+ *
+ * Record @value in the bucket covering it.
+ */
+void histogram_add(Histogram *histogram, uint64_t value) {
+        ++histogram->buckets[histogram_bucket(value)];
+        ++histogram->count;
+
+        if (histogram->maximum < value)
+                histogram->maximum = value;
+}
+
+/**
+ * histogram_sample_add() - add one sample
+ * @histogram:          object to operate on
+ * @timestamp:          time the sample was started
+ *
+ * Record a new sample, started at @timestamp and ending at the time the
+ * function is called.
+ *
+ * Return: the recorded sample.
+ */
+uint64_t histogram_sample_add(Histogram *histogram, uint64_t timestamp) {
+        uint64_t value;
+
+        value = metrics_get_time(histogram->clock) - timestamp;
+        histogram_add(histogram, value);
+
+        return value;
+}
+
+/**
+ * histogram_sample_start() - start a new sample
+ * @histogram:          object to operate on
+ *
+ * Start a new sample by recording the current timestamp, verifying that
+ * a sample is not currently running.
+ */
+void histogram_sample_start(Histogram *histogram) {
+        assert(!histogram->timestamp);
+        histogram->timestamp = metrics_get_time(histogram->clock);
+}
+
+/**
+ * histogram_sample_end() - end a running sample
+ * @histogram:          object to operate on
+ *
+ * End a currently running sample, and record it.
+ *
+ * Return: the recorded sample.
+ */
+uint64_t histogram_sample_end(Histogram *histogram) {
+        uint64_t value;
+
+        assert(histogram->timestamp);
+
+        value = histogram_sample_add(histogram, histogram->timestamp);
+
+        histogram->timestamp = 0;
+        return value;
+}
+
+/**
+ * histogram_read_quantile() - read out a quantile
+ * @histogram:          object to operate on
+ * @permille:           quantile to read, in per-mille
+ *
+ * This returns the smallest value, such that at least @permille per-mille of
+ * all recorded samples are less than, or equal to it. That is, 500 yields the
+ * median, 990 the 99th and 999 the 99.9th percentile.
+ *
+ * The value is rounded up to the upper bound of its bucket, but never exceeds
+ * the maximum recorded sample.
+ *
+ * If no samples were recorded, then zero is returned.
+ *
+ * Return: the quantile, or 0 if not defined.
+ */
+uint64_t histogram_read_quantile(Histogram *histogram, unsigned int permille) {
+        uint64_t rank, n = 0;
+        size_t i;
+
+        if (!histogram->count)
+                return 0;
+
+        rank = (histogram->count * c_min(permille, 1000U) + 999) / 1000;
+        if (!rank)
+                rank = 1;
+
+        for (i = 0; i < HISTOGRAM_N_BUCKETS; ++i) {
+                n += histogram->buckets[i];
+                if (n >= rank)
+                        return c_min(histogram_bucket_maximum(i), histogram->maximum);
+        }
+
+        return histogram->maximum;
+}
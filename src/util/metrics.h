@@ -5,11 +5,37 @@
  */
 
 #include <c-macro.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 
+typedef struct Histogram Histogram;
 typedef struct Metrics Metrics;
 
+#define METRICS_CLOCK_CPU CLOCK_THREAD_CPUTIME_ID
+#define METRICS_CLOCK_WALL CLOCK_MONOTONIC
+
+/*
+ * Wall-clock time read from the cycle counter of the CPU, rather than via
+ * clock_gettime(2). It is not a valid clockid, and only understood by
+ * metrics_get_time(). If the cycle counter cannot be used, this falls back
+ * to METRICS_CLOCK_WALL.
+ */
+#define METRICS_CLOCK_CYCLES ((clockid_t)-1)
+
+#define METRICS_CALIBRATION_NSEC (1000ULL * 1000ULL) /* busy-waited once; clock jitter stays below 0.01% */
+
+/*
+ * Every power-of-two range of values is split into HISTOGRAM_SUB_BUCKETS
+ * linear buckets, which bounds the relative error of a read-out to
+ * 1/HISTOGRAM_SUB_BUCKETS. Values below HISTOGRAM_SUB_BUCKETS are exact.
+ */
+#define HISTOGRAM_SUB_BITS (4)
+#define HISTOGRAM_SUB_BUCKETS (1U << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_N_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
 struct Metrics {
+        clockid_t clock;
         uint64_t count;
         uint64_t sum;
         uint64_t minimum;
@@ -19,19 +45,54 @@ struct Metrics {
         /* internal state */
         uint64_t timestamp;
         uint64_t sum_of_squares;
+        uint64_t seed;
+        unsigned int sample_rate;
+        unsigned int n_skip;
+        bool running;
 };
 
-#define METRICS_INIT {                          \
+#define METRICS_INIT_CLOCK(_clock) {             \
+                .clock = (_clock),              \
                 .minimum = (uint64_t) -1,       \
+                .sample_rate = 1,               \
+        }
+
+#define METRICS_INIT METRICS_INIT_CLOCK(METRICS_CLOCK_CPU)
+
+struct Histogram {
+        clockid_t clock;
+        uint64_t count;
+        uint64_t maximum;
+        uint64_t buckets[HISTOGRAM_N_BUCKETS];
+
+        /* internal state */
+        uint64_t timestamp;
+};
+
+#define HISTOGRAM_INIT(_clock) {                \
+                .clock = (_clock),              \
         }
 
 void metrics_init(Metrics *metrics);
 void metrics_deinit(Metrics *metrics);
 
-uint64_t metrics_get_time(void);
-void metrics_sample_add(Metrics *metrics, uint64_t timestamp);
+void metrics_calibrate(void);
+uint64_t metrics_get_time(clockid_t clock);
+void metrics_set_sample_rate(Metrics *metrics, unsigned int sample_rate);
+uint64_t metrics_sample_add(Metrics *metrics, uint64_t timestamp);
 
 void metrics_sample_start(Metrics *metrics);
-void metrics_sample_end(Metrics *metrics);
+uint64_t metrics_sample_end(Metrics *metrics);
 
 double metrics_read_standard_deviation(Metrics *metrics);
+
+void histogram_init(Histogram *histogram, clockid_t clock);
+void histogram_deinit(Histogram *histogram);
+
+void histogram_add(Histogram *histogram, uint64_t value);
+uint64_t histogram_sample_add(Histogram *histogram, uint64_t timestamp);
+
+void histogram_sample_start(Histogram *histogram);
+uint64_t histogram_sample_end(Histogram *histogram);
+
+uint64_t histogram_read_quantile(Histogram *histogram, unsigned int permille);
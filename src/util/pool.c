@@ -0,0 +1,120 @@
+/*
+ * Object Pools
+ *
+ * A pool serves fixed-size objects of a single type, and keeps released
+ * objects on a free list to re-use them on the next allocation. This avoids
+ * going through the allocator for objects that are allocated and released at
+ * message rate, and it avoids fragmenting the heap of a long-running broker
+ * with lots of small, short-lived allocations.
+ *
+ * The free list is bounded by the pool, so bursts do not pin memory forever.
+ * Objects beyond the bound are released to the allocator right away.
+ *
+ * Pools are static objects of the modules that use them, and the broker is
+ * single-threaded, so no locking is done. Every pool that was ever used is
+ * linked into a global registry, so their statistics can be read out.
+ *
+ * Objects with alignment requirements beyond what malloc(3) guarantees can
+ * use pools initialized via POOL_INIT_ALIGNED(). Their object size must be a
+ * multiple of the alignment, which holds for any C type by definition.
+ */
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/pool.h"
+
+static CList pool_registry = C_LIST_INIT(pool_registry);
+
+/**
+ * pool_alloc() - allocate object from pool
+ * @pool:               pool to operate on
+ *
+ * This allocates a new object of the size of the objects in @pool. If the
+ * free list of @pool is non-empty, an object is taken from it, otherwise a
+ * new object is allocated. The content of the returned object is undefined.
+ * If @pool has an alignment set, the object is aligned accordingly.
+ *
+ * Return: A pointer to the new object, or NULL if out of memory.
+ */
+void *pool_alloc(Pool *pool) {
+        void *object;
+
+        if (_c_unlikely_(!c_list_is_linked(&pool->registry_link)))
+                c_list_link_tail(&pool_registry, &pool->registry_link);
+
+        ++pool->stats.n_allocs;
+
+        object = pool->free_list;
+        if (object) {
+                pool->free_list = *(void **)object;
+                --pool->n_free;
+                ++pool->stats.n_hits;
+                --pool->stats.n_cached;
+                return object;
+        }
+
+        if (pool->n_align)
+                return aligned_alloc(pool->n_align, pool->n_object);
+
+        return malloc(pool->n_object);
+}
+
+/**
+ * pool_free() - release object to pool
+ * @pool:               pool to operate on
+ * @object:             object to release, or NULL
+ *
+ * This releases an object previously allocated via pool_alloc() on the same
+ * pool. If the free list of @pool has room left, the object is put on it,
+ * otherwise it is returned to the allocator.
+ *
+ * If @object is NULL, this is a no-op.
+ */
+void pool_free(Pool *pool, void *object) {
+        if (!object)
+                return;
+
+        ++pool->stats.n_frees;
+
+        if (pool->n_free >= pool->n_max) {
+                free(object);
+                return;
+        }
+
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+        ++pool->n_free;
+        ++pool->stats.n_cached;
+}
+
+/**
+ * pool_flush() - release all cached objects
+ * @pool:               pool to operate on
+ *
+ * This returns all objects on the free list of @pool to the allocator. The
+ * pool stays usable.
+ */
+void pool_flush(Pool *pool) {
+        void *object;
+
+        while ((object = pool->free_list)) {
+                pool->free_list = *(void **)object;
+                free(object);
+        }
+
+        pool->n_free = 0;
+        pool->stats.n_cached = 0;
+}
+
+/**
+ * pool_get_registry() - get list of all pools
+ *
+ * This returns the list of all pools that were used so far. The list is
+ * linked via Pool.registry_link, and must not be modified by the caller.
+ *
+ * Return: The list of pools.
+ */
+CList *pool_get_registry(void) {
+        return &pool_registry;
+}
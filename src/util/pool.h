@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Object Pools
+ */
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <stdlib.h>
+
+typedef struct Pool Pool;
+typedef struct PoolStats PoolStats;
+
+struct PoolStats {
+        uint64_t n_allocs;
+        uint64_t n_hits;
+        uint64_t n_frees;
+        uint64_t n_cached;
+};
+
+struct Pool {
+        const char *name;
+        size_t n_object;
+        size_t n_align;
+        size_t n_max;
+
+        CList registry_link;
+        void *free_list;
+        size_t n_free;
+
+        PoolStats stats;
+};
+
+#define POOL_INIT(_x, _name, _n_object, _n_max) {                               \
+                .name = (_name),                                                \
+                .n_object = c_max((size_t)(_n_object), sizeof(void *)),         \
+                .n_max = (_n_max),                                              \
+                .registry_link = C_LIST_INIT((_x).registry_link),               \
+        }
+
+#define POOL_INIT_ALIGNED(_x, _name, _n_object, _n_align, _n_max) {             \
+                .name = (_name),                                                \
+                .n_object = c_max((size_t)(_n_object), sizeof(void *)),         \
+                .n_align = (_n_align),                                          \
+                .n_max = (_n_max),                                              \
+                .registry_link = C_LIST_INIT((_x).registry_link),               \
+        }
+
+void *pool_alloc(Pool *pool);
+void pool_free(Pool *pool, void *object);
+void pool_flush(Pool *pool);
+
+CList *pool_get_registry(void);
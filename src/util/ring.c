@@ -0,0 +1,136 @@
+/*
+ * Single-Producer/Single-Consumer Rings
+ *
+ * A ring is a bounded, lock-free FIFO of pointers, which is shared between
+ * exactly one producer and exactly one consumer thread. The audit queue uses
+ * it to hand messages from the main thread to its helper thread, without the
+ * main thread ever blocking on the helper.
+ *
+ * The producer only ever writes @tail and the consumer only ever writes
+ * @head. Both sides keep a cached copy of the index owned by the other side,
+ * and only re-read the shared index if the cached copy says the ring is full
+ * (or empty, respectively). This way, the shared cache-lines only bounce
+ * between CPUs when the ring runs full or empty.
+ *
+ * Note that the broker itself is single-threaded, and none of its objects
+ * are safe to be shared across threads. The ring merely transfers ownership
+ * of an object; it is up to the caller to make sure no other reference to it
+ * is used by the producer after it was pushed.
+ */
+
+#include <c-macro.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "util/error.h"
+#include "util/ring.h"
+
+/**
+ * ring_new() - create new ring
+ * @ringp:              output argument for new ring
+ * @n_slots:            minimum number of slots
+ *
+ * This creates a new, empty ring with at least @n_slots slots. The number of
+ * slots is rounded up to the next power of two.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int ring_new(Ring **ringp, size_t n_slots) {
+        Ring *ring;
+        size_t n;
+
+        if (n_slots < 2)
+                n_slots = 2;
+        if (n_slots > SIZE_MAX / 2 / sizeof(void *))
+                return error_origin(-ENOMEM);
+
+        for (n = 2; n < n_slots; n <<= 1)
+                ;
+
+        ring = aligned_alloc(RING_ALIGN,
+                             c_align_to(sizeof(*ring) + n * sizeof(void *), RING_ALIGN));
+        if (!ring)
+                return error_origin(-ENOMEM);
+
+        ring->mask = n - 1;
+        atomic_init(&ring->tail, 0);
+        ring->cached_head = 0;
+        atomic_init(&ring->head, 0);
+        ring->cached_tail = 0;
+
+        *ringp = ring;
+        return 0;
+}
+
+/**
+ * ring_free() - destroy ring
+ * @ring:               ring to operate on, or NULL
+ *
+ * This destroys @ring. The ring must be empty, and neither side must access
+ * it anymore.
+ *
+ * Return: NULL is returned.
+ */
+Ring *ring_free(Ring *ring) {
+        if (!ring)
+                return NULL;
+
+        assert(atomic_load_explicit(&ring->head, memory_order_relaxed) ==
+               atomic_load_explicit(&ring->tail, memory_order_relaxed));
+
+        free(ring);
+
+        return NULL;
+}
+
+/**
+ * ring_push() - push object onto ring
+ * @ring:               ring to operate on
+ * @object:             object to push, must not be NULL
+ *
+ * This appends @object to @ring. Must only be called by the producer.
+ *
+ * Return: 0 on success, RING_E_FULL if no slot is available.
+ */
+int ring_push(Ring *ring, void *object) {
+        size_t tail;
+
+        assert(object);
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (tail - ring->cached_head > ring->mask) {
+                ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+                if (tail - ring->cached_head > ring->mask)
+                        return RING_E_FULL;
+        }
+
+        ring->slots[tail & ring->mask] = object;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+        return 0;
+}
+
+/**
+ * ring_pop() - pop object from ring
+ * @ring:               ring to operate on
+ *
+ * This removes the oldest object from @ring. Must only be called by the
+ * consumer.
+ *
+ * Return: The removed object, or NULL if the ring is empty.
+ */
+void *ring_pop(Ring *ring) {
+        size_t head;
+        void *object;
+
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (head == ring->cached_tail) {
+                ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+                if (head == ring->cached_tail)
+                        return NULL;
+        }
+
+        object = ring->slots[head & ring->mask];
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+        return object;
+}
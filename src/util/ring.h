@@ -0,0 +1,42 @@
+#pragma once
+
+/*
+ * Single-Producer/Single-Consumer Rings
+ */
+
+#include <c-macro.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+typedef struct Ring Ring;
+
+enum {
+        _RING_E_SUCCESS,
+
+        RING_E_FULL,
+};
+
+/* cache-line size assumed to separate producer and consumer state */
+#define RING_ALIGN (64)
+
+struct Ring {
+        size_t mask;
+
+        /* producer side */
+        _Alignas(RING_ALIGN) _Atomic size_t tail;
+        size_t cached_head;
+
+        /* consumer side */
+        _Alignas(RING_ALIGN) _Atomic size_t head;
+        size_t cached_tail;
+
+        _Alignas(RING_ALIGN) void *slots[];
+};
+
+int ring_new(Ring **ringp, size_t n_slots);
+Ring *ring_free(Ring *ring);
+
+int ring_push(Ring *ring, void *object);
+void *ring_pop(Ring *ring);
+
+C_DEFINE_CLEANUP(Ring *, ring_free);
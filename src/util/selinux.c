@@ -7,7 +7,11 @@
 #include <c-ref.h>
 #include <selinux/selinux.h>
 #include <selinux/avc.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include "util/audit.h"
 #include "util/error.h"
 #include "util/selinux.h"
 
@@ -25,6 +29,34 @@ struct BusSELinuxName {
 
 typedef struct BusSELinuxName BusSELinuxName;
 
+struct BusSELinuxCacheEntry {
+        uint64_t generation;
+        security_id_t sender_sid;
+        security_id_t receiver_sid;
+};
+
+typedef struct BusSELinuxCacheEntry BusSELinuxCacheEntry;
+
+#define BUS_SELINUX_CACHE_SIZE          (512)
+
+/*
+ * The AVC is process-global, and so is our decision cache on top of it.
+ * Entries are only valid if their generation matches the global one, which
+ * is bumped whenever the kernel reports a policy load or an enforcing change.
+ * Generation 0 is never used, so zeroed entries are always invalid. Changes
+ * are only tracked if the kernel status page could be mapped (@status), since
+ * everything else would require a syscall per check.
+ */
+static struct {
+        bool status;
+        uint64_t generation;
+        uint64_t n_hits;
+        uint64_t n_misses;
+        BusSELinuxCacheEntry entries[BUS_SELINUX_CACHE_SIZE];
+} bus_selinux_cache = {
+        .generation = 1,
+};
+
 #define BUS_SELINUX_SID_FROM_ID(id)     ((security_id_t) (id))
 #define BUS_SELINUX_SID_TO_ID(sid)      ((BusSELinuxID*) (sid))
 
@@ -38,6 +70,53 @@ static struct security_class_mapping dbus_class_map[] = {
   { NULL }
 };
 
+static void bus_selinux_cache_flush(void) {
+        ++bus_selinux_cache.generation;
+}
+
+static int bus_selinux_cache_policyload(int seqno) {
+        bus_selinux_cache_flush();
+        return 0;
+}
+
+static int bus_selinux_cache_setenforce(int enforcing) {
+        bus_selinux_cache_flush();
+        return 0;
+}
+
+/*
+ * AVC denials are routed through the audit queue, so a client triggering
+ * denials in a loop cannot stall the bus on audit writes, and repeated
+ * denials are coalesced. Everything else is logged to stderr, as libselinux
+ * does by default.
+ */
+static int bus_selinux_log(int type, const char *fmt, ...) {
+        _c_cleanup_(c_freep) char *message = NULL;
+        va_list ap;
+        int r;
+
+        va_start(ap, fmt);
+        if (type == SELINUX_AVC) {
+                r = vasprintf(&message, fmt, ap);
+                if (r >= 0)
+                        util_audit_log(message, getuid());
+        } else {
+                vfprintf(stderr, fmt, ap);
+        }
+        va_end(ap);
+
+        return 0;
+}
+
+static BusSELinuxCacheEntry *bus_selinux_cache_get(security_id_t sender_sid, security_id_t receiver_sid) {
+        uint64_t hash;
+
+        hash = (uintptr_t)sender_sid * 31 + (uintptr_t)receiver_sid;
+        hash ^= hash >> 29;
+
+        return &bus_selinux_cache.entries[hash % C_ARRAY_SIZE(bus_selinux_cache.entries)];
+}
+
 /** bus_selinux_is_enabled() - checks if SELinux is currently enabled
  *
  * Returns: true if SELinux is enabled, false otherwise.
@@ -299,15 +378,34 @@ int bus_selinux_check_own(BusSELinuxRegistry *registry,
 int bus_selinux_check_send(BusSELinuxRegistry *registry,
                            BusSELinuxID *sender_id,
                            BusSELinuxID *receiver_id) {
-        security_id_t receiver_sid;
+        security_id_t sender_sid, receiver_sid;
+        BusSELinuxCacheEntry *entry;
+        uint64_t generation;
         int r;
 
         if (!is_selinux_enabled())
                 return 0;
 
+        sender_sid = BUS_SELINUX_SID_FROM_ID(sender_id);
         receiver_sid = receiver_id ? BUS_SELINUX_SID_FROM_ID(receiver_id) : registry->fallback_sid;
 
-        r = avc_has_perm(BUS_SELINUX_SID_FROM_ID(sender_id),
+        /*
+         * Only granted permissions are cached. Denials are always passed to
+         * the AVC, so they are audited just as before.
+         */
+        generation = bus_selinux_generation();
+        entry = bus_selinux_cache_get(sender_sid, receiver_sid);
+        if (generation &&
+            entry->generation == generation &&
+            entry->sender_sid == sender_sid &&
+            entry->receiver_sid == receiver_sid) {
+                ++bus_selinux_cache.n_hits;
+                return 0;
+        }
+
+        ++bus_selinux_cache.n_misses;
+
+        r = avc_has_perm(sender_sid,
                          receiver_sid,
                          BUS_SELINUX_CLASS_DBUS,
                          BUS_SELINUX_PERMISSION_SEND,
@@ -323,9 +421,57 @@ int bus_selinux_check_send(BusSELinuxRegistry *registry,
                 return error_origin(-errno);
         }
 
+        /* the AVC might have noticed a policy reload, so re-read the generation */
+        entry->generation = bus_selinux_generation();
+        entry->sender_sid = sender_sid;
+        entry->receiver_sid = receiver_sid;
+
         return 0;
 }
 
+/**
+ * bus_selinux_generation() - query the current SELinux policy generation
+ *
+ * This returns a counter that is bumped whenever the SELinux policy is
+ * reloaded, or the enforcing mode changes. Callers that cache the results of
+ * SELinux queries must drop their caches whenever this changes.
+ *
+ * If SELinux is enabled, but the kernel status page is not available, changes
+ * cannot be tracked without a syscall. 0 is returned in this case, and
+ * callers must not cache any results.
+ *
+ * Return: The current policy generation, or 0 if results must not be cached.
+ */
+uint64_t bus_selinux_generation(void) {
+        if (!is_selinux_enabled())
+                return bus_selinux_cache.generation;
+        if (!bus_selinux_cache.status)
+                return 0;
+
+        /*
+         * The status page is mapped from the kernel, so checking it only
+         * reads memory. Any pending notifications are dispatched to our
+         * callbacks, which flush the cache.
+         */
+        if (selinux_status_updated() > 0)
+                bus_selinux_cache_flush();
+
+        return bus_selinux_cache.generation;
+}
+
+/**
+ * bus_selinux_get_cache_stats() - query the decision cache statistics
+ * @n_hitsp:            output argument for the number of cache hits
+ * @n_missesp:          output argument for the number of cache misses
+ *
+ * This returns the number of send checks that were answered by the SELinux
+ * decision cache, and the number of those that had to query the AVC.
+ */
+void bus_selinux_get_cache_stats(uint64_t *n_hitsp, uint64_t *n_missesp) {
+        *n_hitsp = bus_selinux_cache.n_hits;
+        *n_missesp = bus_selinux_cache.n_misses;
+}
+
 /**
  * bus_selinux_init_global() - initialize the global SELinux context
  *
@@ -348,7 +494,18 @@ int bus_selinux_init_global(void) {
         if (r)
                 return error_origin(-errno);
 
-        /* XXX: set logging callbacks? */
+        /*
+         * The status page is only needed to track policy reloads for our
+         * caches. If it cannot be mapped, the caches are disabled and every
+         * check is passed to the AVC, which tracks reloads on its own (see
+         * bus_selinux_generation()). This is not fatal.
+         */
+        bus_selinux_cache.status = !selinux_status_open(1);
+
+        selinux_set_callback(SELINUX_CB_POLICYLOAD, (union selinux_callback){ .func_policyload = bus_selinux_cache_policyload });
+        selinux_set_callback(SELINUX_CB_SETENFORCE, (union selinux_callback){ .func_setenforce = bus_selinux_cache_setenforce });
+
+        selinux_set_callback(SELINUX_CB_LOG, (union selinux_callback){ .func_log = bus_selinux_log });
 
         return 0;
 }
@@ -364,5 +521,6 @@ void bus_selinux_deinit_global(void) {
         if (!is_selinux_enabled())
                 return;
 
+        selinux_status_close();
         avc_destroy();
 }
@@ -36,5 +36,8 @@ int bus_selinux_check_send(BusSELinuxRegistry *registry,
                            BusSELinuxID *id_sender,
                            BusSELinuxID *id_receiver);
 
+uint64_t bus_selinux_generation(void);
+void bus_selinux_get_cache_stats(uint64_t *n_hitsp, uint64_t *n_missesp);
+
 int bus_selinux_init_global(void);
 void bus_selinux_deinit_global(void);
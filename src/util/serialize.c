@@ -0,0 +1,430 @@
+/*
+ * State Serialization
+ *
+ * A serializer streams state of a process to another process, over a
+ * sequential-packet socket. The state is written as a plain byte stream of
+ * fields, without any framing or type information. Both sides must agree on
+ * the order and type of all fields. File-descriptors are passed alongside the
+ * stream: for each file-descriptor, a marker is written into the stream, and
+ * the file-descriptor is attached to the packet that carries the marker.
+ * Hence, the reader always receives a file-descriptor together with its
+ * marker, and file-descriptors can never get out of sync with the stream.
+ *
+ * All fields are written in native endianness, since both sides are required
+ * to run on the same machine.
+ *
+ * Both sides operate on blocking sockets. The serializer is meant to be used
+ * once, on startup or shutdown, rather than from a main-loop. If the socket
+ * has a send or receive timeout set, expiry of the timeout is treated like a
+ * hang-up of the other side.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "util/error.h"
+#include "util/serialize.h"
+
+/**
+ * serializer_init() - initialize serializer
+ * @s:                  serializer to operate on
+ * @fd:                 socket to write to
+ *
+ * This initializes a serializer, writing to @fd. @fd must be a blocking
+ * sequential-packet socket. It is still owned by the caller.
+ */
+void serializer_init(Serializer *s, int fd) {
+        s->fd = fd;
+        s->n_data = 0;
+        s->n_fds = 0;
+}
+
+/**
+ * serializer_deinit() - deinitialize serializer
+ * @s:                  serializer to operate on
+ *
+ * This drops any data that was not flushed, yet.
+ */
+void serializer_deinit(Serializer *s) {
+        s->n_fds = 0;
+        s->n_data = 0;
+        s->fd = -1;
+}
+
+/**
+ * serializer_flush() - flush serializer
+ * @s:                  serializer to operate on
+ *
+ * This writes all buffered data and file-descriptors to the socket.
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int serializer_flush(Serializer *s) {
+        char control[CMSG_SPACE(sizeof(s->fds))] = {};
+        struct iovec vec = { s->data, s->n_data };
+        struct msghdr msg = { .msg_iov = &vec, .msg_iovlen = 1 };
+        struct cmsghdr *cmsg;
+        ssize_t l;
+
+        if (!s->n_data)
+                return 0;
+
+        if (s->n_fds) {
+                msg.msg_control = control;
+                msg.msg_controllen = CMSG_SPACE(s->n_fds * sizeof(int));
+
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(s->n_fds * sizeof(int));
+                memcpy(CMSG_DATA(cmsg), s->fds, s->n_fds * sizeof(int));
+        }
+
+        do {
+                l = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        } while (l < 0 && errno == EINTR);
+
+        if (l < 0) {
+                if (errno == EPIPE || errno == ECONNRESET || errno == EAGAIN)
+                        return SERIALIZE_E_EOF;
+
+                return error_origin(-errno);
+        }
+
+        assert((size_t)l == s->n_data);
+
+        s->n_data = 0;
+        s->n_fds = 0;
+        return 0;
+}
+
+/**
+ * serializer_write() - write data
+ * @s:                  serializer to operate on
+ * @data:               data to write
+ * @n_data:             number of bytes to write
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int serializer_write(Serializer *s, const void *data, size_t n_data) {
+        size_t n;
+        int r;
+
+        while (n_data) {
+                if (s->n_data >= sizeof(s->data)) {
+                        r = serializer_flush(s);
+                        if (r)
+                                return error_trace(r);
+                }
+
+                n = c_min(n_data, sizeof(s->data) - s->n_data);
+                memcpy(s->data + s->n_data, data, n);
+                s->n_data += n;
+                data = (const char *)data + n;
+                n_data -= n;
+        }
+
+        return 0;
+}
+
+/**
+ * serializer_write_u32() - write 32-bit integer
+ * @s:                  serializer to operate on
+ * @v:                  value to write
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int serializer_write_u32(Serializer *s, uint32_t v) {
+        return error_trace(serializer_write(s, &v, sizeof(v)));
+}
+
+/**
+ * serializer_write_u64() - write 64-bit integer
+ * @s:                  serializer to operate on
+ * @v:                  value to write
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int serializer_write_u64(Serializer *s, uint64_t v) {
+        return error_trace(serializer_write(s, &v, sizeof(v)));
+}
+
+/**
+ * serializer_write_string() - write string
+ * @s:                  serializer to operate on
+ * @string:             string to write, or NULL
+ *
+ * This writes a string, prefixed by its length. NULL is written as the empty
+ * string. Strings are limited to SERIALIZE_STRING_MAX bytes.
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int serializer_write_string(Serializer *s, const char *string) {
+        size_t n;
+        int r;
+
+        n = string ? strlen(string) : 0;
+        assert(n <= SERIALIZE_STRING_MAX);
+
+        r = serializer_write_u32(s, n);
+        if (r)
+                return error_trace(r);
+
+        return error_trace(serializer_write(s, string, n));
+}
+
+/**
+ * serializer_write_fd() - write file-descriptor
+ * @s:                  serializer to operate on
+ * @fd:                 file-descriptor to write
+ *
+ * This writes a marker for @fd, and passes @fd along with it. @fd is still
+ * owned by the caller, but must not be closed before the serializer was
+ * flushed.
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the reader hung up, negative error
+ *         code on failure.
+ */
+int serializer_write_fd(Serializer *s, int fd) {
+        int r;
+
+        /* make sure the marker ends up in the same packet as the FD */
+        if (s->n_fds >= C_ARRAY_SIZE(s->fds) || s->n_data + sizeof(uint32_t) > sizeof(s->data)) {
+                r = serializer_flush(s);
+                if (r)
+                        return error_trace(r);
+        }
+
+        r = serializer_write_u32(s, s->n_fds);
+        if (r)
+                return error_trace(r);
+
+        s->fds[s->n_fds++] = fd;
+        return 0;
+}
+
+/**
+ * deserializer_init() - initialize deserializer
+ * @d:                  deserializer to operate on
+ * @fd:                 socket to read from
+ *
+ * This initializes a deserializer, reading from @fd. @fd must be a blocking
+ * sequential-packet socket. It is still owned by the caller.
+ */
+void deserializer_init(Deserializer *d, int fd) {
+        d->fd = fd;
+        d->n_data = 0;
+        d->i_data = 0;
+        d->n_fds = 0;
+        d->i_fds = 0;
+}
+
+static void deserializer_close_fds(Deserializer *d) {
+        while (d->i_fds < d->n_fds)
+                close(d->fds[d->i_fds++]);
+
+        d->n_fds = 0;
+        d->i_fds = 0;
+}
+
+/**
+ * deserializer_deinit() - deinitialize deserializer
+ * @d:                  deserializer to operate on
+ *
+ * This closes all received file-descriptors that were not read, yet.
+ */
+void deserializer_deinit(Deserializer *d) {
+        deserializer_close_fds(d);
+        d->n_data = 0;
+        d->i_data = 0;
+        d->fd = -1;
+}
+
+static int deserializer_fill(Deserializer *d) {
+        char control[CMSG_SPACE(sizeof(d->fds))];
+        struct iovec vec = { d->data, sizeof(d->data) };
+        struct msghdr msg = {
+                .msg_iov = &vec,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+        ssize_t l;
+        size_t n;
+
+        /* all FDs must have been read along with their markers */
+        if (d->i_fds < d->n_fds)
+                return SERIALIZE_E_CORRUPT;
+
+        do {
+                l = recvmsg(d->fd, &msg, MSG_CMSG_CLOEXEC);
+        } while (l < 0 && errno == EINTR);
+
+        if (l < 0) {
+                if (errno == ECONNRESET || errno == EAGAIN)
+                        return SERIALIZE_E_EOF;
+
+                return error_origin(-errno);
+        }
+
+        d->n_fds = 0;
+        d->i_fds = 0;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                        continue;
+
+                n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                assert(d->n_fds + n <= C_ARRAY_SIZE(d->fds));
+
+                memcpy(d->fds + d->n_fds, CMSG_DATA(cmsg), n * sizeof(int));
+                d->n_fds += n;
+        }
+
+        if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+                deserializer_close_fds(d);
+                return SERIALIZE_E_CORRUPT;
+        }
+
+        if (!l) {
+                deserializer_close_fds(d);
+                return SERIALIZE_E_EOF;
+        }
+
+        d->n_data = l;
+        d->i_data = 0;
+        return 0;
+}
+
+/**
+ * deserializer_read() - read data
+ * @d:                  deserializer to operate on
+ * @data:               buffer to read into
+ * @n_data:             number of bytes to read
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the stream ended early,
+ *         SERIALIZE_E_CORRUPT if the stream is corrupt, negative error code on
+ *         failure.
+ */
+int deserializer_read(Deserializer *d, void *data, size_t n_data) {
+        size_t n;
+        int r;
+
+        while (n_data) {
+                if (d->i_data >= d->n_data) {
+                        r = deserializer_fill(d);
+                        if (r)
+                                return error_trace(r);
+                }
+
+                n = c_min(n_data, d->n_data - d->i_data);
+                memcpy(data, d->data + d->i_data, n);
+                d->i_data += n;
+                data = (char *)data + n;
+                n_data -= n;
+        }
+
+        return 0;
+}
+
+/**
+ * deserializer_read_u32() - read 32-bit integer
+ * @d:                  deserializer to operate on
+ * @vp:                 output argument for the read value
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the stream ended early,
+ *         SERIALIZE_E_CORRUPT if the stream is corrupt, negative error code on
+ *         failure.
+ */
+int deserializer_read_u32(Deserializer *d, uint32_t *vp) {
+        return error_trace(deserializer_read(d, vp, sizeof(*vp)));
+}
+
+/**
+ * deserializer_read_u64() - read 64-bit integer
+ * @d:                  deserializer to operate on
+ * @vp:                 output argument for the read value
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the stream ended early,
+ *         SERIALIZE_E_CORRUPT if the stream is corrupt, negative error code on
+ *         failure.
+ */
+int deserializer_read_u64(Deserializer *d, uint64_t *vp) {
+        return error_trace(deserializer_read(d, vp, sizeof(*vp)));
+}
+
+/**
+ * deserializer_read_string() - read string
+ * @d:                  deserializer to operate on
+ * @stringp:            output argument for the read string
+ *
+ * This reads a string written by serializer_write_string(). The string is
+ * zero-terminated, and owned by the caller.
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the stream ended early,
+ *         SERIALIZE_E_CORRUPT if the stream is corrupt, negative error code on
+ *         failure.
+ */
+int deserializer_read_string(Deserializer *d, char **stringp) {
+        _c_cleanup_(c_freep) char *string = NULL;
+        uint32_t n;
+        int r;
+
+        r = deserializer_read_u32(d, &n);
+        if (r)
+                return error_trace(r);
+
+        if (n > SERIALIZE_STRING_MAX)
+                return SERIALIZE_E_CORRUPT;
+
+        string = malloc(n + 1);
+        if (!string)
+                return error_origin(-ENOMEM);
+
+        r = deserializer_read(d, string, n);
+        if (r)
+                return error_trace(r);
+
+        string[n] = 0;
+        if (strlen(string) != n)
+                return SERIALIZE_E_CORRUPT;
+
+        *stringp = string;
+        string = NULL;
+        return 0;
+}
+
+/**
+ * deserializer_read_fd() - read file-descriptor
+ * @d:                  deserializer to operate on
+ * @fdp:                output argument for the read file-descriptor
+ *
+ * This reads a file-descriptor written by serializer_write_fd(). The
+ * file-descriptor is owned by the caller.
+ *
+ * Return: 0 on success, SERIALIZE_E_EOF if the stream ended early,
+ *         SERIALIZE_E_CORRUPT if the stream is corrupt, negative error code on
+ *         failure.
+ */
+int deserializer_read_fd(Deserializer *d, int *fdp) {
+        uint32_t marker;
+        int r;
+
+        r = deserializer_read_u32(d, &marker);
+        if (r)
+                return error_trace(r);
+
+        if (marker != d->i_fds || d->i_fds >= d->n_fds)
+                return SERIALIZE_E_CORRUPT;
+
+        *fdp = d->fds[d->i_fds++];
+        return 0;
+}
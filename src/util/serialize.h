@@ -0,0 +1,80 @@
+#pragma once
+
+/*
+ * State Serialization
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+
+typedef struct Deserializer Deserializer;
+typedef struct Serializer Serializer;
+
+enum {
+        _SERIALIZE_E_SUCCESS,
+
+        SERIALIZE_E_EOF,
+        SERIALIZE_E_CORRUPT,
+};
+
+/* size of a packet; fits the default socket buffer, and amortizes the syscalls */
+#define SERIALIZE_RECORD_MAX (64UL * 1024UL)
+
+/* taken from kernel SCM_MAX_FD */
+#define SERIALIZE_FDS_MAX (253UL)
+
+/* maximum length of a serialized string; far beyond names, paths and match rules */
+#define SERIALIZE_STRING_MAX (64UL * 1024UL)
+
+struct Serializer {
+        int fd;
+        size_t n_data;
+        size_t n_fds;
+        int fds[SERIALIZE_FDS_MAX];
+        char data[SERIALIZE_RECORD_MAX];
+};
+
+#define SERIALIZER_NULL {                                                       \
+                .fd = -1,                                                       \
+        }
+
+struct Deserializer {
+        int fd;
+        size_t n_data;
+        size_t i_data;
+        size_t n_fds;
+        size_t i_fds;
+        int fds[SERIALIZE_FDS_MAX];
+        char data[SERIALIZE_RECORD_MAX];
+};
+
+#define DESERIALIZER_NULL {                                                     \
+                .fd = -1,                                                       \
+        }
+
+/* serializer */
+
+void serializer_init(Serializer *s, int fd);
+void serializer_deinit(Serializer *s);
+
+int serializer_write(Serializer *s, const void *data, size_t n_data);
+int serializer_write_u32(Serializer *s, uint32_t v);
+int serializer_write_u64(Serializer *s, uint64_t v);
+int serializer_write_string(Serializer *s, const char *string);
+int serializer_write_fd(Serializer *s, int fd);
+int serializer_flush(Serializer *s);
+
+C_DEFINE_CLEANUP(Serializer *, serializer_deinit);
+
+/* deserializer */
+
+void deserializer_init(Deserializer *d, int fd);
+void deserializer_deinit(Deserializer *d);
+
+int deserializer_read(Deserializer *d, void *data, size_t n_data);
+int deserializer_read_u32(Deserializer *d, uint32_t *vp);
+int deserializer_read_u64(Deserializer *d, uint64_t *vp);
+int deserializer_read_string(Deserializer *d, char **stringp);
+int deserializer_read_fd(Deserializer *d, int *fdp);
+
+C_DEFINE_CLEANUP(Deserializer *, deserializer_deinit);
@@ -0,0 +1,201 @@
+/*
+ * Shared-Memory Byte Rings
+ *
+ * A shared-memory ring is a bounded byte FIFO, which lives in a memory region
+ * shared between exactly one producer and exactly one consumer process. It is
+ * used to stream data between the broker and a co-located peer, without a
+ * copy into and out of the kernel for each chunk.
+ *
+ * The producer only ever writes @tail and the consumer only ever writes
+ * @head. Both indices grow monotonically, and are reduced modulo the ring
+ * size on access. Since the other side cannot be trusted, each side keeps
+ * its own index as @position and never reads it back from shared memory. The
+ * index of the other side is verified on every access, and any ring that
+ * claims to hold more data than fits into it is reported as corrupt.
+ *
+ * Neither side ever blocks on the other. Instead, the caller is told when
+ * the other side must be woken up, and is expected to do so via a side
+ * channel:
+ *
+ *  * If the producer makes data available in a ring that was empty, the
+ *    consumer must be woken up. If the ring was not empty, the consumer has
+ *    not yet caught up, and is guaranteed to see the new data before it
+ *    considers the ring drained.
+ *
+ *  * If the producer runs out of space, it sets @waiting, and the consumer
+ *    must wake the producer up once it released space.
+ *
+ * All accesses to the shared indices are sequentially consistent, so both
+ * sides are guaranteed to observe either the update of the other side, or
+ * the request to be woken up.
+ */
+
+#include <c-macro.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "util/shmring.h"
+
+static_assert(!(SHMRING_SIZE & (SHMRING_SIZE - 1)),
+              "Shared-memory ring size must be a power of two");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "Shared-memory rings require lock-free 64-bit atomics");
+
+static void shmring_copy_in(ShmRing *ring, uint64_t position, const void *data, size_t n_data) {
+        size_t offset = position & (SHMRING_SIZE - 1), n;
+
+        if (!n_data)
+                return;
+
+        n = c_min(n_data, SHMRING_SIZE - offset);
+        memcpy(ring->data + offset, data, n);
+        memcpy(ring->data, (const uint8_t *)data + n, n_data - n);
+}
+
+static void shmring_copy_out(ShmRing *ring, uint64_t position, void *data, size_t n_data) {
+        size_t offset = position & (SHMRING_SIZE - 1), n;
+
+        if (!n_data)
+                return;
+
+        n = c_min(n_data, SHMRING_SIZE - offset);
+        memcpy(data, ring->data + offset, n);
+        memcpy((uint8_t *)data + n, ring->data, n_data - n);
+}
+
+/**
+ * shmring_init() - initialize ring view
+ * @ring:               ring to operate on
+ * @map:                mapped ring, SHMRING_MAP_SIZE bytes in size
+ *
+ * This initializes @ring as a view of the shared ring at @map. The view is
+ * used either as producer or as consumer, but never both. The shared
+ * memory must be zeroed before either side attaches, which a freshly created
+ * memfd is. The memory is owned by the caller, and must stay mapped for as
+ * long as @ring is used.
+ */
+void shmring_init(ShmRing *ring, void *map) {
+        *ring = (ShmRing)SHMRING_NULL;
+        ring->header = map;
+        ring->data = (uint8_t *)map + sizeof(ShmRingHeader);
+}
+
+/**
+ * shmring_write() - write to ring
+ * @ring:               ring to operate on
+ * @vecs:               data to write
+ * @n_vecs:             number of vectors in @vecs
+ * @n_writtenp:         output argument for the number of bytes written
+ * @wakep:              output argument whether the consumer must be woken up
+ *
+ * This copies as much of the data in @vecs into the ring as fits, and makes
+ * it available to the consumer. If not everything fit, the consumer is asked
+ * to wake the producer up once it released space.
+ *
+ * Return: 0 if all data was written, SHMRING_E_FULL if the ring ran full,
+ *         SHMRING_E_CORRUPT if the consumer corrupted the ring.
+ */
+int shmring_write(ShmRing *ring, const struct iovec *vecs, size_t n_vecs, size_t *n_writtenp, bool *wakep) {
+        size_t i_vec = 0, offset = 0, n_written = 0, n_space, n;
+        uint64_t head, tail;
+        bool wake = false;
+
+        for (;;) {
+                head = atomic_load(&ring->header->head);
+                if (_c_unlikely_(ring->position - head > SHMRING_SIZE))
+                        return SHMRING_E_CORRUPT;
+
+                tail = ring->position;
+                n_space = SHMRING_SIZE - (tail - head);
+
+                while (n_space && i_vec < n_vecs) {
+                        n = c_min(n_space, (size_t)(vecs[i_vec].iov_len - offset));
+                        shmring_copy_in(ring, ring->position, (const uint8_t *)vecs[i_vec].iov_base + offset, n);
+
+                        ring->position += n;
+                        n_written += n;
+                        n_space -= n;
+                        offset += n;
+
+                        if (offset == vecs[i_vec].iov_len) {
+                                ++i_vec;
+                                offset = 0;
+                        }
+                }
+
+                if (ring->position != tail) {
+                        atomic_store(&ring->header->tail, ring->position);
+                        if (atomic_load(&ring->header->head) == tail)
+                                wake = true;
+                }
+
+                while (i_vec < n_vecs && !vecs[i_vec].iov_len)
+                        ++i_vec;
+
+                if (i_vec >= n_vecs)
+                        break;
+
+                /*
+                 * The ring ran full. Ask the consumer to wake us up, then
+                 * check once more whether it released space meanwhile, in
+                 * which case we missed its notification.
+                 */
+                atomic_store(&ring->header->waiting, 1);
+                if (atomic_load(&ring->header->head) == head) {
+                        *n_writtenp = n_written;
+                        *wakep = wake;
+                        return SHMRING_E_FULL;
+                }
+        }
+
+        *n_writtenp = n_written;
+        *wakep = wake;
+        return 0;
+}
+
+/**
+ * shmring_read() - read from ring
+ * @ring:               ring to operate on
+ * @data:               buffer to read into
+ * @n_data:             size of @data
+ * @n_readp:            output argument for the number of bytes read
+ * @wakep:              output argument whether the producer must be woken up
+ *
+ * This copies as much data from the ring into @data as is available and fits,
+ * and releases the space to the producer. If the producer waits for space, it
+ * must be woken up.
+ *
+ * Return: 0 if the ring was drained, SHMRING_E_PREEMPTED if more data is
+ *         available, SHMRING_E_CORRUPT if the producer corrupted the ring.
+ */
+int shmring_read(ShmRing *ring, void *data, size_t n_data, size_t *n_readp, bool *wakep) {
+        uint64_t tail;
+        size_t n;
+
+        tail = atomic_load(&ring->header->tail);
+        if (_c_unlikely_(tail - ring->position > SHMRING_SIZE))
+                return SHMRING_E_CORRUPT;
+
+        n = c_min(tail - ring->position, (uint64_t)n_data);
+        shmring_copy_out(ring, ring->position, data, n);
+        ring->position += n;
+
+        *n_readp = n;
+        *wakep = false;
+
+        /* if the ring was empty, the producer wakes us up on its next write */
+        if (!n)
+                return 0;
+
+        atomic_store(&ring->header->head, ring->position);
+        if (atomic_exchange(&ring->header->waiting, 0))
+                *wakep = true;
+
+        /*
+         * Check for data that arrived meanwhile. The producer only wakes us
+         * up if it saw the ring empty, which it might have not, if it looked
+         * before we released the data.
+         */
+        return (atomic_load(&ring->header->tail) == ring->position) ? 0 : SHMRING_E_PREEMPTED;
+}
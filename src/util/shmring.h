@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Shared-Memory Byte Rings
+ */
+
+#include <c-macro.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+typedef struct ShmRing ShmRing;
+typedef struct ShmRingHeader ShmRingHeader;
+
+enum {
+        _SHMRING_E_SUCCESS,
+
+        SHMRING_E_PREEMPTED,
+        SHMRING_E_FULL,
+        SHMRING_E_CORRUPT,
+};
+
+/* cache-line size assumed to separate producer and consumer state */
+#define SHMRING_ALIGN (64)
+
+/* about the default buffer of a unix socket it replaces; must be a power of two */
+#define SHMRING_SIZE (256UL * 1024UL)
+
+/* size of a mapped ring, including its header */
+#define SHMRING_MAP_SIZE (sizeof(ShmRingHeader) + SHMRING_SIZE)
+
+struct ShmRingHeader {
+        /* producer side */
+        _Alignas(SHMRING_ALIGN) _Atomic uint64_t tail;
+
+        /* consumer side */
+        _Alignas(SHMRING_ALIGN) _Atomic uint64_t head;
+        _Atomic uint32_t waiting;
+};
+
+struct ShmRing {
+        ShmRingHeader *header;
+        uint8_t *data;
+        uint64_t position;
+};
+
+#define SHMRING_NULL {}
+
+void shmring_init(ShmRing *ring, void *map);
+
+int shmring_write(ShmRing *ring, const struct iovec *vecs, size_t n_vecs, size_t *n_writtenp, bool *wakep);
+int shmring_read(ShmRing *ring, void *data, size_t n_data, size_t *n_readp, bool *wakep);
@@ -0,0 +1,207 @@
+/*
+ * Heavy-Hitter Sketch
+ *
+ * The sketch estimates how often each key was added, in fixed memory and
+ * without knowing the set of keys up front. It is a count-min sketch: every
+ * key maps to one counter in each of SKETCH_DEPTH rows, and its estimate is
+ * the minimum of those counters. Collisions can only make an estimate too
+ * high, never too low. Counters are raised conservatively, that is, only as
+ * far as needed for the new minimum, which considerably reduces the error
+ * for skewed distributions.
+ *
+ * Next to the counters, the sketch keeps the SKETCH_TOP_MAX keys with the
+ * highest estimate in a min-heap, so the heavy hitters can be read out
+ * directly. Only keys that enter the heap are copied. Every other key is
+ * never stored, hence the memory used is independent of the number of keys.
+ *
+ * See `An Improved Data Stream Summary: The Count-Min Sketch and its
+ * Applications' by G. Cormode and S. Muthukrishnan, 2005.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util/error.h"
+#include "util/hash.h"
+#include "util/sketch.h"
+
+/**
+ * sketch_init() - initialize sketch
+ * @sketch:             sketch to operate on
+ *
+ * This initializes a new, empty sketch.
+ */
+void sketch_init(Sketch *sketch) {
+        *sketch = (Sketch)SKETCH_INIT;
+}
+
+/**
+ * sketch_deinit() - destroy sketch
+ * @sketch:             sketch to operate on
+ *
+ * This releases all keys held by @sketch and resets it.
+ */
+void sketch_deinit(Sketch *sketch) {
+        size_t i;
+
+        for (i = 0; i < sketch->n_top; ++i)
+                free(sketch->top[i].key);
+
+        sketch_init(sketch);
+}
+
+static uint64_t sketch_hash(const void *key, size_t n_key) {
+        return hash_string_finalize(hash_string_feed(HASH_STRING_INIT, key, n_key));
+}
+
+/*
+ * The row indices are derived from a single hash, as suggested in `Less
+ * Hashing, Same Performance: Building a Better Bloom Filter' by A. Kirsch
+ * and M. Mitzenmacher, 2006.
+ */
+static size_t sketch_index(uint64_t hash, size_t row) {
+        uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+
+        return (h1 + row * h2) & (SKETCH_WIDTH - 1);
+}
+
+static uint64_t sketch_estimate_hash(Sketch *sketch, uint64_t hash) {
+        uint64_t estimate = UINT64_MAX;
+        size_t i;
+
+        for (i = 0; i < SKETCH_DEPTH; ++i)
+                estimate = c_min(estimate, sketch->counters[i][sketch_index(hash, i)]);
+
+        return estimate;
+}
+
+static void sketch_swap(Sketch *sketch, size_t a, size_t b) {
+        SketchEntry t = sketch->top[a];
+
+        sketch->top[a] = sketch->top[b];
+        sketch->top[b] = t;
+}
+
+static void sketch_sift_up(Sketch *sketch, size_t i) {
+        while (i && sketch->top[(i - 1) / 2].count > sketch->top[i].count) {
+                sketch_swap(sketch, i, (i - 1) / 2);
+                i = (i - 1) / 2;
+        }
+}
+
+static void sketch_sift_down(Sketch *sketch, size_t i) {
+        size_t min, child;
+
+        for (;;) {
+                min = i;
+
+                child = 2 * i + 1;
+                if (child < sketch->n_top && sketch->top[child].count < sketch->top[min].count)
+                        min = child;
+
+                ++child;
+                if (child < sketch->n_top && sketch->top[child].count < sketch->top[min].count)
+                        min = child;
+
+                if (min == i)
+                        break;
+
+                sketch_swap(sketch, i, min);
+                i = min;
+        }
+}
+
+static SketchEntry *sketch_find(Sketch *sketch, const void *key, size_t n_key, uint64_t hash) {
+        size_t i;
+
+        for (i = 0; i < sketch->n_top; ++i)
+                if (sketch->top[i].hash == hash &&
+                    sketch->top[i].n_key == n_key &&
+                    !memcmp(sketch->top[i].key, key, n_key))
+                        return &sketch->top[i];
+
+        return NULL;
+}
+
+/**
+ * sketch_add() - account a key
+ * @sketch:             sketch to operate on
+ * @key:                key to account
+ * @n_key:              length of @key in bytes
+ * @weight:             amount to add
+ *
+ * This adds @weight to the estimate of @key. If the new estimate is among the
+ * highest in @sketch, @key is copied into the set of heavy hitters, possibly
+ * replacing the one with the lowest estimate.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int sketch_add(Sketch *sketch, const void *key, size_t n_key, uint64_t weight) {
+        uint64_t hash, estimate;
+        SketchEntry *entry;
+        uint64_t *counter;
+        char *copy;
+        size_t i;
+
+        hash = sketch_hash(key, n_key);
+        estimate = sketch_estimate_hash(sketch, hash) + weight;
+
+        for (i = 0; i < SKETCH_DEPTH; ++i) {
+                counter = &sketch->counters[i][sketch_index(hash, i)];
+                *counter = c_max(*counter, estimate);
+        }
+
+        sketch->n_total += weight;
+
+        entry = sketch_find(sketch, key, n_key, hash);
+        if (entry) {
+                entry->count = estimate;
+                sketch_sift_down(sketch, entry - sketch->top);
+                return 0;
+        }
+
+        if (sketch->n_top >= SKETCH_TOP_MAX && estimate <= sketch->top[0].count)
+                return 0;
+
+        copy = malloc(n_key ?: 1);
+        if (!copy)
+                return error_origin(-ENOMEM);
+
+        memcpy(copy, key, n_key);
+
+        if (sketch->n_top < SKETCH_TOP_MAX) {
+                i = sketch->n_top++;
+        } else {
+                i = 0;
+                free(sketch->top[0].key);
+        }
+
+        sketch->top[i] = (SketchEntry){
+                .hash = hash,
+                .count = estimate,
+                .n_key = n_key,
+                .key = copy,
+        };
+
+        if (i)
+                sketch_sift_up(sketch, i);
+        else
+                sketch_sift_down(sketch, i);
+
+        return 0;
+}
+
+/**
+ * sketch_estimate() - estimate the count of a key
+ * @sketch:             sketch to operate on
+ * @key:                key to look up
+ * @n_key:              length of @key in bytes
+ *
+ * This returns the estimated sum of all weights added for @key. The estimate
+ * is never lower than the real sum.
+ *
+ * Return: The estimated count of @key.
+ */
+uint64_t sketch_estimate(Sketch *sketch, const void *key, size_t n_key) {
+        return sketch_estimate_hash(sketch, sketch_hash(key, n_key));
+}
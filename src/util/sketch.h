@@ -0,0 +1,40 @@
+#pragma once
+
+/*
+ * Heavy-Hitter Sketch
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+
+typedef struct Sketch Sketch;
+typedef struct SketchEntry SketchEntry;
+
+#define SKETCH_DEPTH (4)
+#define SKETCH_WIDTH (1024) /* overestimates by at most e/1024 of the total, in 32KiB */
+#define SKETCH_TOP_MAX (32) /* more than a screen of dbus-broker-top shows */
+
+static_assert(!(SKETCH_WIDTH & (SKETCH_WIDTH - 1)),
+              "Sketch width must be a power of two");
+
+struct SketchEntry {
+        uint64_t hash;
+        uint64_t count;
+        size_t n_key;
+        char *key;
+};
+
+struct Sketch {
+        uint64_t n_total;
+        size_t n_top;
+        SketchEntry top[SKETCH_TOP_MAX];
+        uint64_t counters[SKETCH_DEPTH][SKETCH_WIDTH];
+};
+
+#define SKETCH_INIT {}
+
+void sketch_init(Sketch *sketch);
+void sketch_deinit(Sketch *sketch);
+
+int sketch_add(Sketch *sketch, const void *key, size_t n_key, uint64_t weight);
+uint64_t sketch_estimate(Sketch *sketch, const void *key, size_t n_key);
@@ -3,13 +3,382 @@
  */
 
 #include <c-macro.h>
-#include <stdlib.h>
-#include <sys/socket.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 #include "util/error.h"
+#include "util/ring.h"
 #include "util/sockopt.h"
 
+typedef struct SockoptGroups SockoptGroups;
+
+struct SockoptGroups {
+        uid_t uid;
+        bool refreshing;
+        uint64_t timestamp;
+        size_t n_gids;
+        gid_t *gids;
+};
+
+/*
+ * The NSS fallback of sockopt_get_peergroups() caches the groups of each uid.
+ * Stale entries are still used, but refreshed asynchronously by a helper
+ * thread, so NSS is only ever called on the main thread for uids we have
+ * never seen before. Requests are handed to the helper via @requests, and it
+ * wakes up via @eventfd. Results are handed back via @results, and merged
+ * into the cache on the next lookup. The cache itself is only ever touched
+ * by the main thread.
+ *
+ * Every request yields exactly one result, even if the refresh failed, and
+ * only merging the result clears the @refreshing flag of its entry. To make
+ * sure the helper can always hand back its result, no more requests are
+ * issued than @results has room for. @n_pending counts the requests whose
+ * result was not merged, yet.
+ */
+static struct {
+        SockoptGroups entries[SOCKOPT_GROUPS_CACHE_MAX];
+        size_t n_entries;
+        Ring *requests;
+        Ring *results;
+        size_t n_pending;
+        uint64_t n_refreshes;
+        int eventfd;
+        bool failed;
+} sockopt_groups = {
+        .eventfd = -1,
+};
+
+static uint64_t sockopt_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static SockoptGroups *sockopt_groups_free(SockoptGroups *groups) {
+        if (!groups)
+                return NULL;
+
+        free(groups->gids);
+        free(groups);
+
+        return NULL;
+}
+
+C_DEFINE_CLEANUP(SockoptGroups *, sockopt_groups_free);
+
+static int sockopt_resolve_groups(uid_t uid, gid_t **gidsp, size_t *n_gidsp) {
+        _c_cleanup_(c_freep) gid_t *gids = NULL;
+        _c_cleanup_(c_freep) char *buffer = NULL;
+        struct passwd passwd, *result;
+        size_t n_buffer = 1024;
+        int r, n_gids = 64;
+        void *tmp;
+
+        /*
+         * This might be called from the refresh thread, so use the reentrant
+         * variants only.
+         */
+
+        for (;;) {
+                tmp = realloc(buffer, n_buffer);
+                if (!tmp)
+                        return error_origin(-ENOMEM);
+
+                buffer = tmp;
+                r = getpwuid_r(uid, &passwd, buffer, n_buffer, &result);
+                if (r != ERANGE)
+                        break;
+
+                n_buffer *= 2;
+        }
+        if (r)
+                return error_origin(-r);
+        if (!result)
+                return error_origin(-ENOENT);
+
+        do {
+                int n_gids_previous = n_gids;
+
+                tmp = realloc(gids, sizeof(*gids) * n_gids);
+                if (!tmp)
+                        return error_origin(-ENOMEM);
+
+                gids = tmp;
+                r = getgrouplist(passwd.pw_name, passwd.pw_gid, gids, &n_gids);
+                if (r == -1 && n_gids <= n_gids_previous)
+                        return error_origin(-ENOTRECOVERABLE);
+        } while (r == -1);
+
+        *gidsp = gids;
+        *n_gidsp = n_gids;
+        gids = NULL;
+        return 0;
+}
+
+static void *sockopt_groups_thread(void *userdata) {
+        SockoptGroups *groups;
+        uint64_t n;
+        ssize_t l;
+        int r;
+
+        for (;;) {
+                l = read(sockopt_groups.eventfd, &n, sizeof(n));
+                if (l < 0 && errno == EINTR)
+                        continue;
+                else if (l != sizeof(n))
+                        return NULL;
+
+                while ((groups = ring_pop(sockopt_groups.requests))) {
+                        r = sockopt_resolve_groups(groups->uid, &groups->gids, &groups->n_gids);
+                        if (r) {
+                                /* report the failure, so the entry can be refreshed again */
+                                groups->gids = NULL;
+                                groups->n_gids = 0;
+                        }
+
+                        /* the main thread never has more requests pending than fit */
+                        r = ring_push(sockopt_groups.results, groups);
+                        assert(!r);
+                }
+        }
+}
+
+static int sockopt_groups_start(void) {
+        sigset_t mask, oldmask;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int r;
+
+        if (sockopt_groups.eventfd >= 0)
+                return 0;
+
+        r = ring_new(&sockopt_groups.requests, SOCKOPT_GROUPS_REFRESH_MAX);
+        if (r)
+                return error_trace(r);
+
+        r = ring_new(&sockopt_groups.results, SOCKOPT_GROUPS_REFRESH_MAX);
+        if (r)
+                return error_trace(r);
+
+        sockopt_groups.eventfd = eventfd(0, EFD_CLOEXEC);
+        if (sockopt_groups.eventfd < 0)
+                return error_origin(-errno);
+
+        r = pthread_attr_init(&attr);
+        if (r)
+                return error_origin(-r);
+
+        /* the helper must never be picked to handle signals of the main thread */
+        sigfillset(&mask);
+        pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+        r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (!r)
+                r = pthread_create(&thread, &attr, sockopt_groups_thread, NULL);
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+        if (r)
+                return error_origin(-r);
+
+        return 0;
+}
+
+static SockoptGroups *sockopt_groups_find(uid_t uid) {
+        size_t i;
+
+        for (i = 0; i < sockopt_groups.n_entries; ++i)
+                if (sockopt_groups.entries[i].uid == uid)
+                        return &sockopt_groups.entries[i];
+
+        return NULL;
+}
+
+static SockoptGroups *sockopt_groups_insert(uid_t uid) {
+        SockoptGroups *entry;
+        size_t i;
+
+        entry = sockopt_groups_find(uid);
+        if (entry)
+                return entry;
+
+        if (sockopt_groups.n_entries < C_ARRAY_SIZE(sockopt_groups.entries)) {
+                entry = &sockopt_groups.entries[sockopt_groups.n_entries++];
+        } else {
+                /* evict the entry that was resolved the longest time ago */
+                entry = &sockopt_groups.entries[0];
+                for (i = 1; i < sockopt_groups.n_entries; ++i)
+                        if (sockopt_groups.entries[i].timestamp < entry->timestamp)
+                                entry = &sockopt_groups.entries[i];
+
+                free(entry->gids);
+        }
+
+        *entry = (SockoptGroups){ .uid = uid };
+        return entry;
+}
+
+static void sockopt_groups_merge(uint64_t now) {
+        SockoptGroups *groups, *entry;
+
+        if (!sockopt_groups.results)
+                return;
+
+        while ((groups = ring_pop(sockopt_groups.results))) {
+                assert(sockopt_groups.n_pending);
+                --sockopt_groups.n_pending;
+
+                entry = sockopt_groups_find(groups->uid);
+                if (entry) {
+                        entry->refreshing = false;
+
+                        /* keep the stale entry if the refresh failed */
+                        if (groups->gids) {
+                                free(entry->gids);
+                                entry->gids = groups->gids;
+                                entry->n_gids = groups->n_gids;
+                                entry->timestamp = now;
+                                groups->gids = NULL;
+                        }
+                }
+
+                sockopt_groups_free(groups);
+        }
+}
+
+static void sockopt_groups_refresh(SockoptGroups *entry) {
+        _c_cleanup_(sockopt_groups_freep) SockoptGroups *groups = NULL;
+        uint64_t n = 1;
+        int r;
+
+        /*
+         * Refreshing is best-effort. If anything fails, the stale entry is
+         * used until a later lookup retries.
+         */
+
+        if (entry->refreshing || sockopt_groups.failed)
+                return;
+        if (sockopt_groups.n_pending >= SOCKOPT_GROUPS_REFRESH_MAX)
+                return;
+
+        r = sockopt_groups_start();
+        if (r) {
+                sockopt_groups.failed = true;
+                return;
+        }
+
+        groups = calloc(1, sizeof(*groups));
+        if (!groups)
+                return;
+
+        groups->uid = entry->uid;
+
+        r = ring_push(sockopt_groups.requests, groups);
+        if (r)
+                return;
+
+        groups = NULL;
+        entry->refreshing = true;
+        ++sockopt_groups.n_pending;
+        ++sockopt_groups.n_refreshes;
+
+        if (write(sockopt_groups.eventfd, &n, sizeof(n)) < 0)
+                return;
+}
+
+/**
+ * sockopt_get_groups() - look up the groups of a user via the NSS cache
+ * @uid:                user to look up
+ * @now:                current time in nanoseconds of CLOCK_MONOTONIC
+ * @gidsp:              output argument for the group list, or NULL
+ * @n_gidsp:            output argument for the number of groups, or NULL
+ *
+ * This is the NSS fallback of sockopt_get_peergroups(). Users not seen before
+ * are resolved synchronously. Cached entries older than
+ * SOCKOPT_GROUPS_CACHE_TTL at @now are still returned, but refreshed in the
+ * background.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int sockopt_get_groups(uid_t uid, uint64_t now, gid_t **gidsp, size_t *n_gidsp) {
+        _c_cleanup_(c_freep) gid_t *gids = NULL;
+        SockoptGroups *entry;
+        size_t n_gids;
+        int r;
+
+        sockopt_groups_merge(now);
+
+        entry = sockopt_groups_find(uid);
+        if (!entry) {
+                r = sockopt_resolve_groups(uid, &gids, &n_gids);
+                if (r)
+                        return error_trace(r);
+
+                entry = sockopt_groups_insert(uid);
+                entry->timestamp = now;
+                entry->n_gids = n_gids;
+                entry->gids = gids;
+                gids = NULL;
+        } else if (now - entry->timestamp > SOCKOPT_GROUPS_CACHE_TTL) {
+                sockopt_groups_refresh(entry);
+        }
+
+        gids = malloc(c_max(entry->n_gids, (size_t)1) * sizeof(*gids));
+        if (!gids)
+                return error_origin(-ENOMEM);
+
+        memcpy(gids, entry->gids, entry->n_gids * sizeof(*gids));
+
+        if (gidsp) {
+                *gidsp = gids;
+                gids = NULL;
+        }
+        if (n_gidsp)
+                *n_gidsp = entry->n_gids;
+        return 0;
+}
+
+/**
+ * sockopt_get_groups_stats() - query statistics of the NSS cache
+ * @n_refreshesp:       output argument for the number of refreshes issued
+ * @n_pendingp:         output argument for the number of refreshes pending
+ */
+void sockopt_get_groups_stats(uint64_t *n_refreshesp, size_t *n_pendingp) {
+        *n_refreshesp = sockopt_groups.n_refreshes;
+        *n_pendingp = sockopt_groups.n_pending;
+}
+
+/**
+ * sockopt_init_global() - spawn the group refresh helper
+ *
+ * The helper thread that refreshes cached group lists is usually spawned on
+ * first use. Calling this spawns it right away, so it is created with the
+ * scheduling parameters (like the CPU affinity) the process started with,
+ * rather than the ones the main thread might have changed to later on.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int sockopt_init_global(void) {
+        int r;
+
+        r = sockopt_groups_start();
+        if (r)
+                return error_trace(r);
+
+        return 0;
+}
+
 int sockopt_get_peersec(int fd, char **labelp, size_t *lenp) {
         _c_cleanup_(c_freep) char *label = NULL;
         char *l;
@@ -51,7 +420,6 @@ int sockopt_get_peersec(int fd, char **labelp, size_t *lenp) {
 
 int sockopt_get_peergroups(int fd, uid_t uid, gid_t gid, gid_t **gidsp, size_t *n_gidsp) {
         _c_cleanup_(c_freep) gid_t *gids = NULL;
-        struct passwd *passwd;
         int r, n_gids = 64;
         void *tmp;
 
@@ -76,6 +444,10 @@ int sockopt_get_peergroups(int fd, uid_t uid, gid_t gid, gid_t **gidsp, size_t *
          * back into D-Bus). To avoid any recursion issues, you are really
          * strongly recommended to use SO_PEERGROUPS!
          *
+         * To limit the damage, the NSS results are cached per uid, and stale
+         * entries are refreshed asynchronously. Hence, NSS is only called
+         * synchronously the first time a uid connects.
+         *
          * XXX: Rather than warning about this, we should really make this
          *      mandatory once linux-4.13 is released. Lets defer the decision
          *      until then, but right now I see little reason to keep the
@@ -125,29 +497,10 @@ int sockopt_get_peergroups(int fd, uid_t uid, gid_t gid, gid_t **gidsp, size_t *
                 }
         }
 
-        passwd = getpwuid(uid);
-        if (!passwd)
-                return error_origin(-errno);
-
-        do {
-                int n_gids_previous = n_gids;
-
-                tmp = realloc(gids, sizeof(*gids) * n_gids);
-                if (!tmp)
-                        return error_origin(-ENOMEM);
+        r = sockopt_get_groups(uid, sockopt_now(), gidsp, n_gidsp);
+        if (r)
+                return error_trace(r);
 
-                gids = tmp;
-                r = getgrouplist(passwd->pw_name, passwd->pw_gid, gids, &n_gids);
-                if (r == -1 && n_gids <= n_gids_previous)
-                        return error_origin(-ENOTRECOVERABLE);
-        } while (r == -1);
-
-        if (gidsp) {
-                *gidsp = gids;
-                gids = NULL;
-        }
-        if (n_gidsp)
-                *n_gidsp = n_gids;
         return 0;
 }
 
@@ -7,5 +7,17 @@
 #include <c-macro.h>
 #include <stdlib.h>
 
+/* NSS group cache; more uids than even busy system buses see */
+#define SOCKOPT_GROUPS_CACHE_MAX (256UL)
+/* group changes of a connecting user are picked up within a minute */
+#define SOCKOPT_GROUPS_CACHE_TTL (UINT64_C(60) * 1000 * 1000 * 1000) /* nsecs */
+/* refreshes in flight, bounds the backlog of the helper after long idle times */
+#define SOCKOPT_GROUPS_REFRESH_MAX (64UL)
+
+int sockopt_init_global(void);
+
+int sockopt_get_groups(uid_t uid, uint64_t now, gid_t **gidsp, size_t *n_gidsp);
+void sockopt_get_groups_stats(uint64_t *n_refreshesp, size_t *n_pendingp);
+
 int sockopt_get_peersec(int fd, char **labelp, size_t *lenp);
 int sockopt_get_peergroups(int fd, uid_t uid, gid_t gid, gid_t **gidsp, size_t *n_gidsp);
@@ -0,0 +1,96 @@
+/*
+ * Test Object Arenas
+ */
+
+#include <c-macro.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util/arena.h"
+
+static void test_setup(void) {
+        Arena arena = ARENA_INIT;
+
+        arena_free(&arena, NULL, 16);
+        arena_deinit(&arena);
+        assert(!arena.chunks);
+
+        arena_init(&arena);
+        assert(!arena.chunks);
+        assert(!arena.n_left);
+}
+
+static void test_reuse(void) {
+        Arena arena;
+        void *o1, *o2, *o3, *p1, *p2;
+
+        arena_init(&arena);
+
+        /* objects are carved out of a single chunk, and properly aligned */
+        o1 = arena_alloc(&arena, 40);
+        o2 = arena_alloc(&arena, 48);
+        o3 = arena_alloc(&arena, 1);
+        assert(o1 && o2 && o3);
+        assert(arena.chunks && !arena.chunks->next);
+        assert(!((uintptr_t)o1 % ARENA_ALIGN));
+        assert(!((uintptr_t)o2 % ARENA_ALIGN));
+        assert(!((uintptr_t)o3 % ARENA_ALIGN));
+        memset(o1, 0, 40);
+        memset(o2, 0, 48);
+        memset(o3, 0, 1);
+
+        /* released objects are re-used by their size class only */
+        arena_free(&arena, o1, 40);
+        arena_free(&arena, o3, 1);
+
+        p1 = arena_alloc(&arena, 8);
+        assert(p1 == o3);
+        p2 = arena_alloc(&arena, 33);
+        assert(p2 == o1);
+
+        arena_free(&arena, o2, 48);
+        arena_free(&arena, p1, 8);
+        arena_free(&arena, p2, 33);
+        arena_deinit(&arena);
+        assert(!arena.chunks);
+}
+
+static void test_chunks(void) {
+        Arena arena;
+        void *o, *big;
+        size_t i, n_chunks = 0;
+        ArenaChunk *chunk;
+
+        arena_init(&arena);
+
+        /* allocate more than fits into the first chunk */
+        for (i = 0; i < 2 * ARENA_CHUNK_MIN / ARENA_OBJECT_MAX; ++i) {
+                o = arena_alloc(&arena, ARENA_OBJECT_MAX);
+                assert(o);
+                memset(o, 0, ARENA_OBJECT_MAX);
+        }
+
+        for (chunk = arena.chunks; chunk; chunk = chunk->next)
+                ++n_chunks;
+        assert(n_chunks == 2);
+        assert(arena.n_chunk == 2 * ARENA_CHUNK_MIN);
+
+        /* large objects are passed through to the allocator */
+        big = arena_alloc(&arena, ARENA_OBJECT_MAX + 1);
+        assert(big);
+        memset(big, 0, ARENA_OBJECT_MAX + 1);
+        assert(arena.chunks->next && !arena.chunks->next->next);
+        arena_free(&arena, big, ARENA_OBJECT_MAX + 1);
+
+        /* all chunks are released at once, without freeing each object */
+        arena_deinit(&arena);
+        assert(!arena.chunks);
+        assert(!arena.n_chunk);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+        test_reuse();
+        test_chunks();
+        return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Test String Atoms
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/atom.h"
+
+static void test_setup(void) {
+        AtomRegistry registry;
+        Atom *atom1, *atom2, *atom3;
+        const char *string;
+        int r;
+
+        atom_registry_init(&registry);
+
+        r = atom_registry_ref_atom(&registry, &atom1, "foo");
+        assert(!r);
+        assert(!strcmp(atom1->string, "foo"));
+
+        r = atom_registry_ref_atom(&registry, &atom2, "foo");
+        assert(!r);
+        assert(atom2 == atom1);
+
+        r = atom_registry_ref_atom(&registry, &atom3, "bar");
+        assert(!r);
+        assert(atom3 != atom1);
+        assert(registry.n_atoms == 2);
+
+        string = atom_registry_resolve(&registry, "foo");
+        assert(string == atom1->string);
+        assert(atom_registry_find_atom(&registry, "bar") == atom3);
+        assert(!atom_registry_find_atom(&registry, "baz"));
+
+        string = "baz";
+        assert(atom_registry_resolve(&registry, string) == string);
+        assert(!atom_registry_resolve(&registry, NULL));
+
+        atom_unref(atom3);
+        atom_unref(atom2);
+        assert(registry.n_atoms == 1);
+        atom_unref(atom1);
+        assert(registry.n_atoms == 0);
+
+        atom_registry_deinit(&registry);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+        return 0;
+}
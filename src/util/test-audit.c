@@ -0,0 +1,57 @@
+/*
+ * Test Audit Queue
+ */
+
+#include <c-macro.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "util/audit.h"
+
+static void test_suppress(void) {
+        uint64_t n_logged, n_suppressed;
+        char message[64];
+        size_t i;
+        int r;
+
+        r = util_audit_init_global();
+        assert(!r);
+
+        /* repeated messages are coalesced */
+        for (i = 0; i < 16; ++i) {
+                r = util_audit_log("test-audit: duplicate\n", 0);
+                assert(!r);
+        }
+
+        util_audit_get_stats(&n_logged, &n_suppressed);
+        assert(n_logged == 1);
+        assert(n_suppressed == 15);
+
+        /* messages from different users are not */
+        r = util_audit_log("test-audit: duplicate\n", 1);
+        assert(!r);
+
+        util_audit_get_stats(&n_logged, &n_suppressed);
+        assert(n_logged == 2);
+
+        /* distinct messages are rate-limited */
+        for (i = 0; i < UTIL_AUDIT_BURST * 2; ++i) {
+                r = snprintf(message, sizeof(message), "test-audit: distinct %zu\n", i);
+                assert(r > 0 && r < (int)sizeof(message));
+
+                r = util_audit_log(message, 0);
+                assert(!r);
+        }
+
+        /* allow for the rate-limit interval to roll over once */
+        util_audit_get_stats(&n_logged, &n_suppressed);
+        assert(n_logged + n_suppressed == 2 + 15 + UTIL_AUDIT_BURST * 2);
+        assert(n_logged <= UTIL_AUDIT_BURST * 2 + 2);
+        assert(n_suppressed >= 15);
+
+        util_audit_deinit_global();
+}
+
+int main(int argc, char **argv) {
+        test_suppress();
+        return 0;
+}
@@ -5,9 +5,11 @@
 #include <c-macro.h>
 #include <linux/sockios.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <time.h>
 #include "util/dispatch.h"
 
 static void q_assert(int s, bool has_in, bool has_out) {
@@ -27,6 +29,29 @@ static void q_assert(int s, bool has_in, bool has_out) {
         assert(!v == !has_out);
 }
 
+static bool test_init(DispatchContext *c, bool uring) {
+        int r;
+
+        /*
+         * Initialize @c, backed by io_uring if @uring is set. Returns false
+         * if io_uring is not supported, in which case the caller skips its
+         * test.
+         */
+
+        r = dispatch_context_init(c);
+        assert(!r);
+
+        if (uring) {
+                r = dispatch_context_init_uring(c);
+                if (r == DISPATCH_E_UNSUPPORTED)
+                        return false;
+
+                assert(!r);
+        }
+
+        return true;
+}
+
 /*
  * This test verifies that we get EPOLLOUT from UDS sockets whenever the
  * outgoing queue runs *EMPTY*. That is, when we send data to a socket, we rely
@@ -38,9 +63,10 @@ static void q_assert(int s, bool has_in, bool has_out) {
  * is signalled, we still want to be notified of queues running empty.
  *
  * Both of these invariants is relied on by our socket implementation for
- * accounting reasons. Hence, they better be granted by the kernel.
+ * accounting reasons. Hence, they better be granted by the kernel, for epoll
+ * and io_uring polls alike.
  */
-static void test_uds_edge(unsigned int run) {
+static void test_uds_edge(unsigned int run, bool uring) {
         _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
         DispatchFile f = DISPATCH_FILE_NULL(f);
         char b[] = { "foobar" };
@@ -48,8 +74,8 @@ static void test_uds_edge(unsigned int run) {
 
         /* setup */
 
-        r = dispatch_context_init(&c);
-        assert(!r);
+        if (!test_init(&c, uring))
+                return;
 
         r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
         assert(!r);
@@ -206,8 +232,552 @@ static void test_uds_edge(unsigned int run) {
         c_close(s[0]);
 }
 
+static DispatchFile *test_trace[64];
+static size_t test_n_trace;
+
+static int test_priority_fn(DispatchFile *file) {
+        assert(test_n_trace < C_ARRAY_SIZE(test_trace));
+        test_trace[test_n_trace++] = file;
+        return 0;
+}
+
+/*
+ * This test verifies that files of low priority are dispatched after files
+ * of normal priority, and only up to DISPATCH_LOW_PRIORITY_BURST of them per
+ * round, in round-robin order.
+ */
+static void test_priority(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchFile f[DISPATCH_LOW_PRIORITY_BURST + 3], *first[DISPATCH_LOW_PRIORITY_BURST + 1];
+        int r, s[C_ARRAY_SIZE(f)][2];
+        size_t i, j, n_low = C_ARRAY_SIZE(f) - 1;
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        for (i = 0; i < C_ARRAY_SIZE(f); ++i) {
+                f[i] = (DispatchFile)DISPATCH_FILE_NULL(f[i]);
+
+                r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s[i]);
+                assert(!r);
+
+                r = dispatch_file_init(&f[i], &c, test_priority_fn, s[i][0], EPOLLOUT, 0);
+                assert(!r);
+
+                /* all but the last file are low priority */
+                if (i < n_low)
+                        dispatch_file_set_priority(&f[i], DISPATCH_PRIORITY_LOW);
+
+                dispatch_file_select(&f[i], EPOLLOUT);
+        }
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+
+        /* the normal file goes first, then a burst of low files */
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_n_trace == 1 + DISPATCH_LOW_PRIORITY_BURST);
+        assert(test_trace[0] == &f[n_low]);
+        for (i = 1; i < test_n_trace; ++i)
+                assert(test_trace[i]->priority == DISPATCH_PRIORITY_LOW);
+
+        memcpy(first, test_trace, sizeof(first));
+
+        /* the low files left behind go first on the next round */
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_n_trace == 1 + DISPATCH_LOW_PRIORITY_BURST);
+        assert(test_trace[0] == &f[n_low]);
+
+        for (i = 1; i < 1 + n_low - DISPATCH_LOW_PRIORITY_BURST; ++i)
+                for (j = 0; j < C_ARRAY_SIZE(first); ++j)
+                        assert(test_trace[i] != first[j]);
+
+        /* raising the priority moves the file onto the normal list */
+
+        dispatch_file_set_priority(&f[0], DISPATCH_PRIORITY_NORMAL);
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_n_trace == 2 + DISPATCH_LOW_PRIORITY_BURST);
+        assert(test_trace[0] == &f[n_low] || test_trace[0] == &f[0]);
+        assert(test_trace[1] == &f[n_low] || test_trace[1] == &f[0]);
+
+        /* high priority files go ahead of everyone else */
+
+        dispatch_file_set_priority(&f[1], DISPATCH_PRIORITY_HIGH);
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_trace[0] == &f[1]);
+
+        for (i = 0; i < C_ARRAY_SIZE(f); ++i) {
+                dispatch_file_deinit(&f[i]);
+                close(s[i][1]);
+                close(s[i][0]);
+        }
+}
+
+static unsigned int test_n_yields;
+
+static int test_yield_fn(DispatchFile *file) {
+        if (test_n_yields) {
+                --test_n_yields;
+                dispatch_file_yield(file);
+        }
+
+        return test_priority_fn(file);
+}
+
+/*
+ * This test verifies that a yielding file is dispatched again on the next
+ * round, even if it has no events pending, and that it is dropped from the
+ * ready-list once it stops yielding.
+ */
+static void test_yield(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchFile f = DISPATCH_FILE_NULL(f);
+        int r, s[2];
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
+        assert(!r);
+
+        r = dispatch_file_init(&f, &c, test_yield_fn, s[0], EPOLLIN, 0);
+        assert(!r);
+
+        dispatch_file_select(&f, EPOLLIN);
+        assert(!c_list_is_linked(&f.ready_link));
+
+        /* yielding makes the file ready, without any events */
+
+        test_n_yields = 2;
+        dispatch_file_yield(&f);
+        assert(c_list_is_linked(&f.ready_link));
+        assert(!dispatch_file_events(&f));
+
+        /* clearing events does not drop a yielded file */
+
+        dispatch_file_clear(&f, EPOLLIN);
+        assert(c_list_is_linked(&f.ready_link));
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_n_trace == 1);
+        assert(c_list_is_linked(&f.ready_link));
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_n_trace == 1);
+        assert(c_list_is_linked(&f.ready_link));
+
+        /* the last call did not yield, so the file is idle again */
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_n_trace == 1);
+        assert(!c_list_is_linked(&f.ready_link));
+
+        dispatch_file_deinit(&f);
+        close(s[1]);
+        close(s[0]);
+}
+
+/*
+ * This test verifies that raised events are dispatched like kernel events,
+ * but only if selected.
+ */
+static void test_raise(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchFile f = DISPATCH_FILE_NULL(f);
+        int r, s[2];
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
+        assert(!r);
+
+        r = dispatch_file_init(&f, &c, test_priority_fn, s[0], EPOLLIN | EPOLLOUT, 0);
+        assert(!r);
+
+        dispatch_file_select(&f, EPOLLIN);
+
+        /* unselected events are remembered, but do not make the file ready */
+
+        dispatch_file_raise(&f, EPOLLOUT);
+        assert(!c_list_is_linked(&f.ready_link));
+
+        dispatch_file_raise(&f, EPOLLIN);
+        assert(c_list_is_linked(&f.ready_link));
+        assert(dispatch_file_events(&f) == EPOLLIN);
+
+        test_n_trace = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+        assert(test_n_trace == 1);
+
+        dispatch_file_clear(&f, EPOLLIN);
+        assert(!c_list_is_linked(&f.ready_link));
+
+        dispatch_file_select(&f, EPOLLOUT);
+        assert(c_list_is_linked(&f.ready_link));
+
+        dispatch_file_deinit(&f);
+        close(s[1]);
+        close(s[0]);
+}
+
+/*
+ * This test verifies that events are fetched in batches of at most
+ * DISPATCH_EVENTS_MAX, and that no event is lost if more files are ready.
+ */
+static void test_batch(bool uring) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        size_t i, n = DISPATCH_EVENTS_MAX + 8;
+        DispatchFile *f;
+        int r, (*s)[2];
+
+        f = calloc(n, sizeof(*f));
+        s = calloc(n, sizeof(*s));
+        assert(f && s);
+
+        if (!test_init(&c, uring)) {
+                free(s);
+                free(f);
+                return;
+        }
+
+        for (i = 0; i < n; ++i) {
+                f[i] = (DispatchFile)DISPATCH_FILE_NULL(f[i]);
+
+                r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s[i]);
+                assert(!r);
+
+                r = dispatch_file_init(&f[i], &c, NULL, s[i][0], EPOLLOUT, 0);
+                assert(!r);
+
+                dispatch_file_select(&f[i], EPOLLOUT);
+        }
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+        assert(c_list_length(&c.ready_list) == DISPATCH_EVENTS_MAX);
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+        assert(c_list_length(&c.ready_list) == n);
+
+        for (i = 0; i < n; ++i) {
+                dispatch_file_deinit(&f[i]);
+                close(s[i][1]);
+                close(s[i][0]);
+        }
+
+        free(s);
+        free(f);
+}
+
+/*
+ * This test verifies sends submitted through io_uring. They are staged until
+ * the next poll, raise EPOLLOUT once completed, unless they would block, and
+ * are waited for on flush and teardown.
+ */
+static void test_sendmsg(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchFile f = DISPATCH_FILE_NULL(f);
+        char b[] = { "foobar" }, buffer[4096];
+        struct iovec vec = { b, sizeof(b) };
+        struct msghdr msg = { .msg_iov = &vec, .msg_iovlen = 1 };
+        ssize_t l;
+        int r, s[2];
+
+        if (!test_init(&c, true))
+                return;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
+        assert(!r);
+
+        r = dispatch_file_init(&f, &c, NULL, s[0], EPOLLOUT, 0);
+        assert(!r);
+        assert(dispatch_file_can_submit(&f));
+
+        dispatch_file_select(&f, EPOLLOUT);
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+        assert(f.events & EPOLLOUT);
+
+        dispatch_file_clear(&f, EPOLLOUT);
+
+        /* a staged send completes with the next poll and raises EPOLLOUT */
+
+        r = dispatch_file_sendmsg(&f, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        assert(!r);
+        assert(!dispatch_file_reap(&f, &l));
+        q_assert(s[0], false, false);
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+        assert(f.events & EPOLLOUT);
+        assert(dispatch_file_reap(&f, &l) && l == sizeof(b));
+
+        l = recv(s[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+        assert(l == sizeof(b) && !memcmp(buffer, b, sizeof(b)));
+
+        /* fetch the edge of the drained queue, before clearing EPOLLOUT */
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+
+        dispatch_file_clear(&f, EPOLLOUT);
+
+        /* a send that would block raises nothing, until there is room */
+
+        do {
+                l = send(s[0], buffer, sizeof(buffer), MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (l > 0);
+        assert(l < 0 && errno == EAGAIN);
+
+        r = dispatch_file_sendmsg(&f, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        assert(!r);
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+        assert(!(f.events & EPOLLOUT));
+        assert(dispatch_file_reap(&f, &l) && l == -EAGAIN);
+
+        do {
+                l = recv(s[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+        } while (l > 0);
+        assert(l < 0 && errno == EAGAIN);
+
+        r = dispatch_context_poll(&c, 0);
+        assert(!r);
+        assert(f.events & EPOLLOUT);
+
+        /* a flush waits for the send, and leaves the result to be reaped */
+
+        r = dispatch_file_sendmsg(&f, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        assert(!r);
+
+        dispatch_file_flush(&f);
+        assert(dispatch_file_reap(&f, &l) && l == sizeof(b));
+
+        /* teardown waits for pending sends as well */
+
+        r = dispatch_file_sendmsg(&f, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        assert(!r);
+
+        dispatch_file_deinit(&f);
+
+        l = recv(s[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+        assert(l == 2 * sizeof(b));
+
+        c_close(s[1]);
+        c_close(s[0]);
+}
+
+static DispatchTimer *test_timer_trace[8];
+static size_t test_n_timer_trace;
+
+static int test_timer_fn(DispatchTimer *timer) {
+        assert(test_n_timer_trace < C_ARRAY_SIZE(test_timer_trace));
+        test_timer_trace[test_n_timer_trace++] = timer;
+        return 0;
+}
+
+static void test_timer(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchTimer t[5];
+        size_t i;
+        int r;
+
+        /*
+         * Arm a set of timers, cancel one and re-schedule another, and verify
+         * the remaining ones expire in order of their deadlines. The last one
+         * is far enough in the future to be placed on a higher level of the
+         * wheel, so it must be moved down before it expires.
+         */
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        for (i = 0; i < C_ARRAY_SIZE(t); ++i)
+                dispatch_timer_init(&t[i], &c, test_timer_fn);
+
+        r = dispatch_timer_arm(&t[0], 1000);
+        assert(!r);
+        r = dispatch_timer_arm(&t[1], 5000);
+        assert(!r);
+        r = dispatch_timer_arm(&t[2], 100 * 1000);
+        assert(!r);
+        r = dispatch_timer_arm(&t[3], 2000);
+        assert(!r);
+        r = dispatch_timer_arm(&t[4], 50 * 1000);
+        assert(!r);
+
+        dispatch_timer_cancel(&t[3]);
+        assert(!dispatch_timer_is_armed(&t[3]));
+
+        r = dispatch_timer_arm(&t[4], 3000);
+        assert(!r);
+
+        while (test_n_timer_trace < 4) {
+                r = dispatch_context_dispatch(&c);
+                assert(!r);
+        }
+
+        assert(test_timer_trace[0] == &t[0]);
+        assert(test_timer_trace[1] == &t[4]);
+        assert(test_timer_trace[2] == &t[1]);
+        assert(test_timer_trace[3] == &t[2]);
+
+        for (i = 0; i < C_ARRAY_SIZE(t); ++i) {
+                assert(!dispatch_timer_is_armed(&t[i]));
+                dispatch_timer_deinit(&t[i]);
+        }
+}
+
+static void test_busy_poll(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchTimer t[2];
+        size_t i;
+        int r;
+
+        /*
+         * Busy-poll once for longer than the first timer takes to expire, so
+         * it is caught while spinning, and once for shorter than the second
+         * timer takes, so the context falls back to blocking.
+         */
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        test_n_timer_trace = 0;
+        for (i = 0; i < C_ARRAY_SIZE(t); ++i)
+                dispatch_timer_init(&t[i], &c, test_timer_fn);
+
+        c.busy_poll_usec = 100 * 1000;
+        r = dispatch_timer_arm(&t[0], 1000);
+        assert(!r);
+
+        while (test_n_timer_trace < 1) {
+                r = dispatch_context_dispatch(&c);
+                assert(!r);
+        }
+
+        c.busy_poll_usec = 10;
+        r = dispatch_timer_arm(&t[1], 5000);
+        assert(!r);
+
+        while (test_n_timer_trace < 2) {
+                r = dispatch_context_dispatch(&c);
+                assert(!r);
+        }
+
+        assert(test_timer_trace[0] == &t[0]);
+        assert(test_timer_trace[1] == &t[1]);
+
+        for (i = 0; i < C_ARRAY_SIZE(t); ++i)
+                dispatch_timer_deinit(&t[i]);
+}
+
+static uint64_t test_stall_sleep_nsec;
+static uint64_t test_stall_nsec;
+static size_t test_n_stalls;
+
+static int test_stall_fn(DispatchFile *file) {
+        struct timespec ts = {
+                .tv_sec = test_stall_sleep_nsec / (1000ULL * 1000ULL * 1000ULL),
+                .tv_nsec = test_stall_sleep_nsec % (1000ULL * 1000ULL * 1000ULL),
+        };
+
+        if (test_stall_sleep_nsec)
+                nanosleep(&ts, NULL);
+
+        return 0;
+}
+
+static void test_stall_report_fn(DispatchContext *ctx, uint64_t nsec) {
+        ++test_n_stalls;
+        test_stall_nsec = nsec;
+}
+
+static void test_stall(void) {
+        _c_cleanup_(dispatch_context_deinit) DispatchContext c = DISPATCH_CONTEXT_NULL(c);
+        DispatchFile f = DISPATCH_FILE_NULL(f);
+        int r, s[2];
+
+        /*
+         * Run a callback that blocks for longer than the stall threshold and
+         * verify it is counted and reported, then run it without blocking and
+         * verify it is only counted as callback.
+         */
+
+        r = dispatch_context_init(&c);
+        assert(!r);
+
+        c.stall_nsec = 1000 * 1000;
+        c.stall_fn = test_stall_report_fn;
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, s);
+        assert(!r);
+
+        r = dispatch_file_init(&f, &c, test_stall_fn, s[0], EPOLLOUT, 0);
+        assert(!r);
+
+        dispatch_file_select(&f, EPOLLOUT);
+
+        test_stall_sleep_nsec = 5 * 1000 * 1000;
+        while (!c.n_callbacks) {
+                r = dispatch_context_dispatch(&c);
+                assert(!r);
+        }
+
+        assert(c.n_callbacks == 1);
+        assert(c.n_stalls == 1);
+        assert(test_n_stalls == 1);
+        assert(test_stall_nsec >= c.stall_nsec);
+
+        test_stall_sleep_nsec = 0;
+        r = dispatch_context_dispatch(&c);
+        assert(!r);
+
+        assert(c.n_callbacks == 2);
+        assert(c.n_stalls == 1);
+        assert(test_n_stalls == 1);
+
+        dispatch_file_deinit(&f);
+        close(s[1]);
+        close(s[0]);
+}
+
 int main(int argc, char **argv) {
-        test_uds_edge(0);
-        test_uds_edge(1);
+        test_uds_edge(0, false);
+        test_uds_edge(1, false);
+        test_uds_edge(0, true);
+        test_uds_edge(1, true);
+        test_priority();
+        test_yield();
+        test_raise();
+        test_batch(false);
+        test_batch(true);
+        test_sendmsg();
+        test_timer();
+        test_busy_poll();
+        test_stall();
         return 0;
 }
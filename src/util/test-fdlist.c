@@ -84,9 +84,88 @@ static void test_consumer(void) {
         l = fdlist_free(l);
 }
 
+static void test_classes(void) {
+        int dummies[FDLIST_FDS_MAX + 1];
+        FDList *l, *m;
+        size_t i, n;
+        int r;
+
+        /*
+         * Allocate lists around the boundaries of all capacity classes, as
+         * well as beyond the largest class. Released lists are re-used by
+         * the next allocation of the same class.
+         */
+
+        for (i = 0; i < C_ARRAY_SIZE(dummies); ++i)
+                dummies[i] = i;
+
+        for (n = 0; n <= C_ARRAY_SIZE(dummies); ++n) {
+                r = fdlist_new_with_fds(&l, dummies, n);
+                assert(!r);
+                assert(fdlist_count(l) == n);
+                assert(!memcmp(fdlist_data(l), dummies, n * sizeof(int)));
+
+                m = l;
+                l = fdlist_free(l);
+
+                r = fdlist_new_with_fds(&l, dummies, n);
+                assert(!r);
+                assert(n > FDLIST_FDS_MAX || l == m);
+                assert(fdlist_count(l) == n);
+
+                l = fdlist_free(l);
+        }
+}
+
+static void test_control(void) {
+        int dummies[FDLIST_FDS_MAX];
+        FDList *control, *l;
+        size_t i;
+        int r;
+
+        /*
+         * Simulate recvmsg(2) by writing FDs into a control buffer by hand.
+         * Small sets of FDs are copied out of the control buffer, large sets
+         * take it over. Since all FDs are dummies, nothing must be consumed
+         * until the list is created.
+         */
+
+        for (i = 0; i < C_ARRAY_SIZE(dummies); ++i)
+                dummies[i] = -1;
+
+        r = fdlist_new_control(&control);
+        assert(!r);
+        assert(!fdlist_count(control));
+
+        control->cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        memcpy(fdlist_data(control), dummies, 2 * sizeof(int));
+
+        r = fdlist_consume_control(&l, &control, fdlist_data(control), 2);
+        assert(!r);
+        assert(control);
+        assert(l != control);
+        assert(fdlist_count(l) == 2);
+        l = fdlist_free(l);
+        control = fdlist_free(control);
+
+        r = fdlist_new_control(&control);
+        assert(!r);
+
+        control->cmsg->cmsg_len = CMSG_LEN(C_ARRAY_SIZE(dummies) * sizeof(int));
+        memcpy(fdlist_data(control), dummies, sizeof(dummies));
+
+        r = fdlist_consume_control(&l, &control, fdlist_data(control), C_ARRAY_SIZE(dummies));
+        assert(!r);
+        assert(!control);
+        assert(fdlist_count(l) == C_ARRAY_SIZE(dummies));
+        l = fdlist_free(l);
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_dummy();
         test_consumer();
+        test_classes();
+        test_control();
         return 0;
 }
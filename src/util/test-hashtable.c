@@ -0,0 +1,110 @@
+/*
+ * Test Open-Addressing Hash Tables
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/hashtable.h"
+
+typedef struct TestEntry TestEntry;
+
+struct TestEntry {
+        uint64_t key;
+};
+
+/* collide all keys with the same low bits, to exercise the probe sequences */
+static uint64_t test_hash(void *entry) {
+        TestEntry *e = entry;
+
+        return e->key & 3;
+}
+
+static size_t test_probe(HashTable *table, uint64_t key) {
+        TestEntry *e;
+        size_t i;
+
+        hash_table_for_each_probe(e, i, table, key & 3)
+                if (e->key == key)
+                        break;
+
+        return i;
+}
+
+static TestEntry *test_find(HashTable *table, uint64_t key) {
+        if (!table->n_entries)
+                return NULL;
+
+        return table->buckets[test_probe(table, key)];
+}
+
+static void test_add(HashTable *table, TestEntry *e) {
+        int r;
+
+        r = hash_table_reserve(table, test_hash, 4);
+        assert(!r);
+
+        hash_table_insert(table, test_probe(table, e->key), e);
+}
+
+static void test_setup(void) {
+        HashTable table = HASH_TABLE_INIT;
+        TestEntry e = { .key = 7 };
+
+        assert(!test_find(&table, 7));
+
+        test_add(&table, &e);
+        assert(table.n_entries == 1);
+        assert(table.n_buckets == 4);
+        assert(test_find(&table, 7) == &e);
+        assert(!test_find(&table, 3));
+
+        /* tables at their minimum size are kept when they run empty */
+        hash_table_remove(&table, test_probe(&table, 7), test_hash, 4);
+        assert(!table.n_entries);
+        assert(table.n_buckets == 4);
+        assert(!test_find(&table, 7));
+
+        hash_table_deinit(&table);
+        assert(!table.buckets);
+}
+
+static void test_many(void) {
+        HashTable table = HASH_TABLE_INIT;
+        TestEntry entries[64];
+        size_t i, j;
+
+        for (i = 0; i < C_ARRAY_SIZE(entries); ++i) {
+                entries[i].key = i;
+                test_add(&table, &entries[i]);
+                assert(table.n_entries * 2 <= table.n_buckets);
+        }
+
+        assert(table.n_buckets == 128);
+
+        for (i = 0; i < C_ARRAY_SIZE(entries); ++i)
+                assert(test_find(&table, i) == &entries[i]);
+
+        /* removal keeps all remaining entries on their probe sequence */
+        for (i = 0; i < C_ARRAY_SIZE(entries); i += 3) {
+                hash_table_remove(&table, test_probe(&table, i), test_hash, 4);
+                assert(!test_find(&table, i));
+
+                for (j = i + 1; j < C_ARRAY_SIZE(entries); ++j)
+                        assert(test_find(&table, j) == &entries[j]);
+        }
+
+        /* tables that grew once release their buckets when they run empty */
+        for (i = 0; i < C_ARRAY_SIZE(entries); ++i)
+                if (i % 3)
+                        hash_table_remove(&table, test_probe(&table, i), test_hash, 4);
+
+        assert(!table.n_entries);
+        assert(!table.n_buckets);
+        assert(!table.buckets);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+        test_many();
+        return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Test Metrics Helper
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include "util/metrics.h"
+
+static void test_setup(void) {
+        Histogram histogram = HISTOGRAM_INIT(METRICS_CLOCK_WALL);
+        Metrics metrics = METRICS_INIT;
+
+        assert(metrics.clock == METRICS_CLOCK_CPU);
+        assert(!histogram_read_quantile(&histogram, 500));
+
+        metrics_sample_start(&metrics);
+        metrics_sample_end(&metrics);
+        assert(metrics.count == 1);
+
+        histogram_sample_start(&histogram);
+        histogram_sample_end(&histogram);
+        assert(histogram.count == 1);
+
+        metrics_deinit(&metrics);
+        histogram_deinit(&histogram);
+        assert(!histogram.count);
+        assert(histogram.clock == METRICS_CLOCK_WALL);
+}
+
+static void test_exact(void) {
+        Histogram histogram = HISTOGRAM_INIT(METRICS_CLOCK_WALL);
+        uint64_t i;
+
+        /* small values are recorded exactly */
+        for (i = 1; i <= HISTOGRAM_SUB_BUCKETS; ++i)
+                histogram_add(&histogram, i);
+
+        assert(histogram_read_quantile(&histogram, 0) == 1);
+        assert(histogram_read_quantile(&histogram, 500) == HISTOGRAM_SUB_BUCKETS / 2);
+        assert(histogram_read_quantile(&histogram, 1000) == HISTOGRAM_SUB_BUCKETS);
+}
+
+static void test_quantiles(void) {
+        Histogram histogram = HISTOGRAM_INIT(METRICS_CLOCK_WALL);
+        uint64_t i, v;
+
+        for (i = 1; i <= 100000; ++i)
+                histogram_add(&histogram, i * 1000);
+
+        assert(histogram.count == 100000);
+        assert(histogram.maximum == 100000 * 1000);
+
+        /* read-outs are rounded up, within the relative error of a bucket */
+        v = histogram_read_quantile(&histogram, 500);
+        assert(v >= 50000 * 1000 && v <= 50000 * 1000 + 50000 * 1000 / HISTOGRAM_SUB_BUCKETS);
+
+        v = histogram_read_quantile(&histogram, 990);
+        assert(v >= 99000 * 1000 && v <= 99000 * 1000 + 99000 * 1000 / HISTOGRAM_SUB_BUCKETS);
+
+        v = histogram_read_quantile(&histogram, 999);
+        assert(v >= 99900 * 1000 && v <= histogram.maximum);
+
+        assert(histogram_read_quantile(&histogram, 1000) == histogram.maximum);
+
+        /* the full range of values is covered */
+        histogram_add(&histogram, (uint64_t)-1);
+        assert(histogram_read_quantile(&histogram, 1000) == (uint64_t)-1);
+}
+
+static void test_sampling(void) {
+        Metrics metrics = METRICS_INIT_CLOCK(METRICS_CLOCK_WALL);
+        uint64_t estimate, n, n_estimates = 0;
+        bool gaps[16] = {};
+        size_t i, last = 0;
+
+        metrics_set_sample_rate(&metrics, 4);
+
+        /* the first sample is always measured */
+        metrics_sample_start(&metrics);
+        assert(metrics.timestamp);
+        metrics_sample_end(&metrics);
+
+        /* about one in 4 samples is measured, at random intervals */
+        for (i = 1; i < 4096; ++i) {
+                metrics_sample_start(&metrics);
+                if (metrics.timestamp) {
+                        gaps[c_min(i - last, C_ARRAY_SIZE(gaps) - 1)] = true;
+                        last = i;
+                }
+                estimate = metrics_sample_end(&metrics);
+                if (estimate)
+                        ++n_estimates;
+        }
+
+        assert(metrics.count >= 768 && metrics.count <= 1280);
+        assert(n_estimates <= metrics.count);
+        /* up to 6 samples are skipped in between, each count showing up */
+        for (i = 0; i < C_ARRAY_SIZE(gaps); ++i)
+                assert(gaps[i] == (i >= 1 && i <= 7));
+
+        /* a rate of 0 measures every sample */
+        n = metrics.count;
+        metrics_set_sample_rate(&metrics, 0);
+        assert(metrics.sample_rate == 1);
+        metrics_sample_start(&metrics);
+        assert(metrics.timestamp);
+        metrics_sample_end(&metrics);
+        assert(metrics.count == n + 1);
+
+        metrics_deinit(&metrics);
+}
+
+static void test_cycles(void) {
+        uint64_t c0, c1, t0, t1;
+
+        metrics_calibrate();
+
+        /* the cycle clock is monotonic and follows the wall-clock */
+        t0 = metrics_get_time(METRICS_CLOCK_WALL);
+        c0 = metrics_get_time(METRICS_CLOCK_CYCLES);
+        do {
+                t1 = metrics_get_time(METRICS_CLOCK_WALL);
+                c1 = metrics_get_time(METRICS_CLOCK_CYCLES);
+                assert(c1 >= c0);
+        } while (t1 - t0 < 10 * METRICS_CALIBRATION_NSEC);
+
+        assert(c1 - c0 >= (t1 - t0) / 2);
+        assert(c1 - c0 <= (t1 - t0) * 2);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+        test_exact();
+        test_quantiles();
+        test_sampling();
+        test_cycles();
+        return 0;
+}
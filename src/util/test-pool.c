@@ -0,0 +1,87 @@
+/*
+ * Test Object Pools
+ */
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "util/pool.h"
+
+static void test_setup(void) {
+        Pool pool = POOL_INIT(pool, "test", 1, 2);
+
+        assert(pool.n_object >= sizeof(void *));
+
+        pool_free(&pool, NULL);
+        pool_flush(&pool);
+        assert(!pool.stats.n_frees);
+}
+
+static void test_reuse(void) {
+        Pool pool = POOL_INIT(pool, "test", 64, 2);
+        void *o1, *o2, *o3, *p1, *p2;
+
+        o1 = pool_alloc(&pool);
+        o2 = pool_alloc(&pool);
+        o3 = pool_alloc(&pool);
+        assert(o1 && o2 && o3);
+        assert(pool.stats.n_allocs == 3);
+        assert(!pool.stats.n_hits);
+
+        /* the pool is registered on first use */
+        assert(c_list_contains(pool_get_registry(), &pool.registry_link));
+
+        /* only 2 objects are cached, the 3rd one is released */
+        pool_free(&pool, o1);
+        pool_free(&pool, o2);
+        pool_free(&pool, o3);
+        assert(pool.n_free == 2);
+        assert(pool.stats.n_frees == 3);
+        assert(pool.stats.n_cached == 2);
+
+        /* cached objects are re-used in LIFO order */
+        p1 = pool_alloc(&pool);
+        p2 = pool_alloc(&pool);
+        assert(p1 == o2);
+        assert(p2 == o1);
+        assert(pool.stats.n_hits == 2);
+        assert(!pool.stats.n_cached);
+
+        pool_free(&pool, p1);
+        pool_free(&pool, p2);
+        pool_flush(&pool);
+        assert(!pool.n_free);
+        assert(!pool.free_list);
+
+        c_list_unlink(&pool.registry_link);
+}
+
+static void test_aligned(void) {
+        Pool pool = POOL_INIT_ALIGNED(pool, "test", 128, 64, 1);
+        void *o1, *o2;
+
+        o1 = pool_alloc(&pool);
+        o2 = pool_alloc(&pool);
+        assert(o1 && o2);
+        assert(!((uintptr_t)o1 % 64));
+        assert(!((uintptr_t)o2 % 64));
+
+        /* cached objects keep their alignment */
+        pool_free(&pool, o1);
+        o1 = pool_alloc(&pool);
+        assert(!((uintptr_t)o1 % 64));
+
+        pool_free(&pool, o1);
+        pool_free(&pool, o2);
+        pool_flush(&pool);
+
+        c_list_unlink(&pool.registry_link);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+        test_reuse();
+        test_aligned();
+        return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Test Single-Producer/Single-Consumer Rings
+ */
+
+#include <c-macro.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "util/ring.h"
+
+#define TEST_N_OBJECTS (1024 * 1024)
+
+static void test_setup(void) {
+        _c_cleanup_(ring_freep) Ring *ring = NULL;
+        int r;
+
+        r = ring_new(&ring, 5);
+        assert(!r);
+        assert(ring->mask == 7);
+
+        assert(!ring_pop(ring));
+}
+
+static void test_fifo(void) {
+        _c_cleanup_(ring_freep) Ring *ring = NULL;
+        int r, v[5];
+        size_t i;
+
+        r = ring_new(&ring, 4);
+        assert(!r);
+
+        for (i = 0; i < 4; ++i) {
+                r = ring_push(ring, &v[i]);
+                assert(!r);
+        }
+
+        r = ring_push(ring, &v[4]);
+        assert(r == RING_E_FULL);
+
+        assert(ring_pop(ring) == &v[0]);
+
+        r = ring_push(ring, &v[4]);
+        assert(!r);
+
+        for (i = 1; i < 5; ++i)
+                assert(ring_pop(ring) == &v[i]);
+
+        assert(!ring_pop(ring));
+}
+
+static void *test_producer(void *userdata) {
+        Ring *ring = userdata;
+        uintptr_t i;
+        int r;
+
+        for (i = 1; i <= TEST_N_OBJECTS; ) {
+                r = ring_push(ring, (void *)i);
+                assert(r == 0 || r == RING_E_FULL);
+                if (!r)
+                        ++i;
+                else
+                        sched_yield();
+        }
+
+        return NULL;
+}
+
+static void test_threads(void) {
+        _c_cleanup_(ring_freep) Ring *ring = NULL;
+        pthread_t thread;
+        uintptr_t i, v;
+        int r;
+
+        r = ring_new(&ring, 64);
+        assert(!r);
+
+        r = pthread_create(&thread, NULL, test_producer, ring);
+        assert(!r);
+
+        /* objects must arrive in order, and none may be lost */
+        for (i = 1; i <= TEST_N_OBJECTS; ) {
+                v = (uintptr_t)ring_pop(ring);
+                if (v) {
+                        assert(v == i);
+                        ++i;
+                } else {
+                        sched_yield();
+                }
+        }
+
+        r = pthread_join(thread, NULL);
+        assert(!r);
+
+        assert(!ring_pop(ring));
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+        test_fifo();
+        test_threads();
+        return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Test State Serialization
+ */
+
+#include <c-macro.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "util/serialize.h"
+
+static void test_pair(int *fds) {
+        int r;
+
+        r = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds);
+        assert(r >= 0);
+}
+
+static void test_fifo(void) {
+        Serializer *s;
+        Deserializer *d;
+        char *string;
+        uint64_t v64;
+        uint32_t v32;
+        int r, fds[2], pipe_fds[2], fd;
+        char c;
+
+        s = malloc(sizeof(*s));
+        d = malloc(sizeof(*d));
+        assert(s && d);
+
+        test_pair(fds);
+        r = pipe2(pipe_fds, O_CLOEXEC);
+        assert(r >= 0);
+
+        serializer_init(s, fds[0]);
+        deserializer_init(d, fds[1]);
+
+        /* fields are read back in order, with FDs passed alongside */
+
+        r = serializer_write_u32(s, 71);
+        assert(!r);
+        r = serializer_write_string(s, "foo");
+        assert(!r);
+        r = serializer_write_fd(s, pipe_fds[1]);
+        assert(!r);
+        r = serializer_write_string(s, NULL);
+        assert(!r);
+        r = serializer_write_u64(s, UINT64_MAX);
+        assert(!r);
+        r = serializer_flush(s);
+        assert(!r);
+
+        close(pipe_fds[1]);
+
+        r = deserializer_read_u32(d, &v32);
+        assert(!r && v32 == 71);
+        r = deserializer_read_string(d, &string);
+        assert(!r && !strcmp(string, "foo"));
+        free(string);
+        r = deserializer_read_fd(d, &fd);
+        assert(!r && fd >= 0);
+        r = deserializer_read_string(d, &string);
+        assert(!r && !strcmp(string, ""));
+        free(string);
+        r = deserializer_read_u64(d, &v64);
+        assert(!r && v64 == UINT64_MAX);
+
+        /* the received FD refers to the same pipe */
+
+        r = write(fd, "x", 1);
+        assert(r == 1);
+        r = read(pipe_fds[0], &c, 1);
+        assert(r == 1 && c == 'x');
+
+        close(fd);
+        close(pipe_fds[0]);
+
+        /* a hang-up of the writer is reported as EOF */
+
+        serializer_deinit(s);
+        close(fds[0]);
+
+        r = deserializer_read_u32(d, &v32);
+        assert(r == SERIALIZE_E_EOF);
+
+        deserializer_deinit(d);
+        close(fds[1]);
+        free(d);
+        free(s);
+}
+
+static void test_chunks(void) {
+        Serializer *s;
+        Deserializer *d;
+        uint8_t *data, *buffer;
+        size_t i, n_data = 3 * SERIALIZE_RECORD_MAX + 7;
+        int r, fds[2], fd;
+        pid_t pid;
+
+        s = malloc(sizeof(*s));
+        d = malloc(sizeof(*d));
+        data = malloc(n_data);
+        buffer = malloc(n_data);
+        assert(s && d && data && buffer);
+
+        for (i = 0; i < n_data; ++i)
+                data[i] = i % 251;
+
+        test_pair(fds);
+
+        /* write from a child, since the data exceeds the socket buffers */
+
+        pid = fork();
+        assert(pid >= 0);
+
+        if (!pid) {
+                close(fds[1]);
+                serializer_init(s, fds[0]);
+
+                r = serializer_write(s, data, n_data);
+                assert(!r);
+
+                /* more FDs than fit into a single packet */
+                for (i = 0; i < 2 * SERIALIZE_FDS_MAX; ++i) {
+                        r = serializer_write_fd(s, fds[0]);
+                        assert(!r);
+                }
+
+                r = serializer_flush(s);
+                assert(!r);
+                _exit(0);
+        }
+
+        close(fds[0]);
+        deserializer_init(d, fds[1]);
+
+        r = deserializer_read(d, buffer, n_data);
+        assert(!r);
+        assert(!memcmp(buffer, data, n_data));
+
+        for (i = 0; i < 2 * SERIALIZE_FDS_MAX; ++i) {
+                r = deserializer_read_fd(d, &fd);
+                assert(!r && fd >= 0);
+                close(fd);
+        }
+
+        r = deserializer_read(d, buffer, 1);
+        assert(r == SERIALIZE_E_EOF);
+
+        deserializer_deinit(d);
+        close(fds[1]);
+        free(buffer);
+        free(data);
+        free(d);
+        free(s);
+}
+
+static void test_corrupt(void) {
+        Serializer *s;
+        Deserializer *d;
+        char *string;
+        int r, fds[2], fd;
+
+        s = malloc(sizeof(*s));
+        d = malloc(sizeof(*d));
+        assert(s && d);
+
+        test_pair(fds);
+        serializer_init(s, fds[0]);
+        deserializer_init(d, fds[1]);
+
+        /* lengths and FD markers are never trusted */
+
+        r = serializer_write_u32(s, SERIALIZE_STRING_MAX + 1);
+        assert(!r);
+        r = serializer_write_u32(s, 0);
+        assert(!r);
+        r = serializer_flush(s);
+        assert(!r);
+
+        r = deserializer_read_string(d, &string);
+        assert(r == SERIALIZE_E_CORRUPT);
+        r = deserializer_read_fd(d, &fd);
+        assert(r == SERIALIZE_E_CORRUPT);
+
+        serializer_deinit(s);
+        deserializer_deinit(d);
+        close(fds[1]);
+        close(fds[0]);
+        free(d);
+        free(s);
+}
+
+int main(int argc, char **argv) {
+        test_fifo();
+        test_chunks();
+        test_corrupt();
+        return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Test Shared-Memory Byte Rings
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "util/shmring.h"
+
+static void *test_map_new(void) {
+        void *map;
+
+        map = aligned_alloc(SHMRING_ALIGN, SHMRING_MAP_SIZE);
+        assert(map);
+        memset(map, 0, SHMRING_MAP_SIZE);
+
+        return map;
+}
+
+static void test_fifo(void) {
+        ShmRing producer, consumer;
+        char buffer[8];
+        size_t n;
+        void *map;
+        bool wake;
+        int r;
+
+        map = test_map_new();
+        shmring_init(&producer, map);
+        shmring_init(&consumer, map);
+
+        /* an empty ring is drained */
+
+        r = shmring_read(&consumer, buffer, sizeof(buffer), &n, &wake);
+        assert(!r && !n && !wake);
+
+        /* only the first write into an empty ring wakes the consumer */
+
+        r = shmring_write(&producer, &(struct iovec){ "foo", 3 }, 1, &n, &wake);
+        assert(!r && n == 3 && wake);
+
+        r = shmring_write(&producer, (struct iovec[]){ { "ba", 2 }, { NULL, 0 }, { "r", 1 } }, 3, &n, &wake);
+        assert(!r && n == 3 && !wake);
+
+        /* data is read in order, and partial reads keep the ring pending */
+
+        r = shmring_read(&consumer, buffer, 4, &n, &wake);
+        assert(r == SHMRING_E_PREEMPTED && n == 4 && !wake);
+        assert(!memcmp(buffer, "foob", 4));
+
+        r = shmring_read(&consumer, buffer, sizeof(buffer), &n, &wake);
+        assert(!r && n == 2 && !wake);
+        assert(!memcmp(buffer, "ar", 2));
+
+        /* once drained, the next write wakes the consumer again */
+
+        r = shmring_write(&producer, &(struct iovec){ "foo", 3 }, 1, &n, &wake);
+        assert(!r && n == 3 && wake);
+
+        free(map);
+}
+
+static void test_full(void) {
+        ShmRing producer, consumer;
+        size_t i, n, n_total = 0;
+        uint8_t *data, *buffer;
+        void *map;
+        bool wake;
+        int r;
+
+        map = test_map_new();
+        shmring_init(&producer, map);
+        shmring_init(&consumer, map);
+
+        data = malloc(SHMRING_SIZE + 1);
+        buffer = malloc(SHMRING_SIZE);
+        assert(data && buffer);
+
+        for (i = 0; i < SHMRING_SIZE + 1; ++i)
+                data[i] = i % 251;
+
+        /* misalign the indices, so the data wraps around */
+
+        r = shmring_write(&producer, &(struct iovec){ data, 7 }, 1, &n, &wake);
+        assert(!r && n == 7);
+        r = shmring_read(&consumer, buffer, 7, &n, &wake);
+        assert(!r && n == 7 && !wake);
+
+        /* a full ring asks the consumer to wake up the producer */
+
+        r = shmring_write(&producer, &(struct iovec){ data, SHMRING_SIZE + 1 }, 1, &n, &wake);
+        assert(r == SHMRING_E_FULL && n == SHMRING_SIZE && wake);
+
+        r = shmring_write(&producer, &(struct iovec){ data + n, 1 }, 1, &n, &wake);
+        assert(r == SHMRING_E_FULL && !n && !wake);
+
+        r = shmring_read(&consumer, buffer, 1, &n, &wake);
+        assert(r == SHMRING_E_PREEMPTED && n == 1 && wake);
+        n_total += n;
+
+        /* the wake-up request is only reported once */
+
+        r = shmring_read(&consumer, buffer + n_total, 1, &n, &wake);
+        assert(r == SHMRING_E_PREEMPTED && n == 1 && !wake);
+        n_total += n;
+
+        r = shmring_read(&consumer, buffer + n_total, SHMRING_SIZE - n_total, &n, &wake);
+        assert(!r && n == SHMRING_SIZE - n_total && !wake);
+        assert(!memcmp(buffer, data, SHMRING_SIZE));
+
+        free(buffer);
+        free(data);
+        free(map);
+}
+
+static void test_corrupt(void) {
+        ShmRing producer, consumer;
+        ShmRingHeader *header;
+        char buffer[8];
+        size_t n;
+        void *map;
+        bool wake;
+        int r;
+
+        map = test_map_new();
+        header = map;
+        shmring_init(&producer, map);
+        shmring_init(&consumer, map);
+
+        /* indices of the other side are never trusted */
+
+        atomic_store(&header->tail, SHMRING_SIZE + 1);
+        r = shmring_read(&consumer, buffer, sizeof(buffer), &n, &wake);
+        assert(r == SHMRING_E_CORRUPT);
+
+        atomic_store(&header->head, 1);
+        r = shmring_write(&producer, &(struct iovec){ "foo", 3 }, 1, &n, &wake);
+        assert(r == SHMRING_E_CORRUPT);
+
+        free(map);
+}
+
+int main(int argc, char **argv) {
+        test_fifo();
+        test_full();
+        test_corrupt();
+        return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Test Heavy-Hitter Sketch
+ */
+
+#include <c-macro.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util/sketch.h"
+
+static SketchEntry *test_find(Sketch *sketch, const char *key) {
+        size_t i;
+
+        for (i = 0; i < sketch->n_top; ++i)
+                if (sketch->top[i].n_key == strlen(key) && !memcmp(sketch->top[i].key, key, strlen(key)))
+                        return &sketch->top[i];
+
+        return NULL;
+}
+
+static void test_basic(void) {
+        Sketch *sketch;
+        SketchEntry *entry;
+        int r;
+
+        sketch = malloc(sizeof(*sketch));
+        assert(sketch);
+
+        sketch_init(sketch);
+        assert(!sketch->n_top);
+        assert(!sketch_estimate(sketch, "foo", 3));
+
+        r = sketch_add(sketch, "foo", 3, 1);
+        assert(!r);
+        r = sketch_add(sketch, "foo", 3, 2);
+        assert(!r);
+        r = sketch_add(sketch, "bar", 3, 5);
+        assert(!r);
+
+        /* without collisions, estimates are exact */
+        assert(sketch_estimate(sketch, "foo", 3) == 3);
+        assert(sketch_estimate(sketch, "bar", 3) == 5);
+        assert(sketch->n_total == 8);
+        assert(sketch->n_top == 2);
+
+        entry = test_find(sketch, "foo");
+        assert(entry && entry->count == 3);
+        entry = test_find(sketch, "bar");
+        assert(entry && entry->count == 5);
+
+        /* the heap is ordered by count */
+        assert(sketch->top[0].count == 3);
+
+        sketch_deinit(sketch);
+        assert(!sketch->n_top);
+        assert(!sketch->n_total);
+        free(sketch);
+}
+
+static void test_heavy_hitters(void) {
+        char key[32];
+        Sketch *sketch;
+        SketchEntry *entry;
+        size_t i, j;
+        int r;
+
+        /*
+         * Add a skewed distribution: a few keys are added very often, while
+         * many more keys are added once each, in-between them. All heavy
+         * hitters must end up in the heap, and their estimates must never
+         * be lower than their real counts.
+         */
+
+        sketch = malloc(sizeof(*sketch));
+        assert(sketch);
+
+        sketch_init(sketch);
+
+        for (i = 0; i < 16 * 1024; ++i) {
+                r = snprintf(key, sizeof(key), "noise%zu", i);
+                assert(r > 0 && r < (int)sizeof(key));
+
+                r = sketch_add(sketch, key, strlen(key), 1);
+                assert(!r);
+
+                if (i % 64)
+                        continue;
+
+                for (j = 0; j < 8; ++j) {
+                        r = snprintf(key, sizeof(key), "heavy%zu", j);
+                        assert(r > 0 && r < (int)sizeof(key));
+
+                        r = sketch_add(sketch, key, strlen(key), j + 1);
+                        assert(!r);
+                }
+        }
+
+        assert(sketch->n_top == SKETCH_TOP_MAX);
+
+        for (j = 0; j < 8; ++j) {
+                r = snprintf(key, sizeof(key), "heavy%zu", j);
+                assert(r > 0 && r < (int)sizeof(key));
+
+                entry = test_find(sketch, key);
+                assert(entry);
+                assert(entry->count >= 256 * (j + 1));
+                assert(sketch_estimate(sketch, key, strlen(key)) == entry->count);
+        }
+
+        for (i = 1; i < sketch->n_top; ++i)
+                assert(sketch->top[(i - 1) / 2].count <= sketch->top[i].count);
+
+        sketch_deinit(sketch);
+        free(sketch);
+}
+
+int main(int argc, char **argv) {
+        test_basic();
+        test_heavy_hitters();
+        return 0;
+}
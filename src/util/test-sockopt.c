@@ -0,0 +1,109 @@
+/*
+ * Test Socket Options Helpers
+ */
+
+#include <c-macro.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "util/sockopt.h"
+
+static void test_wait_refreshed(uint64_t now, const uid_t *uids, size_t n_uids) {
+        uint64_t n_refreshes;
+        size_t i, j, n_pending;
+        int r;
+
+        /* lookups merge the results of the helper, until none is left */
+        for (i = 0; i < 10 * 1000; ++i) {
+                for (j = 0; j < n_uids; ++j) {
+                        r = sockopt_get_groups(uids[j], now, NULL, NULL);
+                        assert(!r);
+                }
+
+                sockopt_get_groups_stats(&n_refreshes, &n_pending);
+                if (!n_pending)
+                        return;
+
+                usleep(1000);
+        }
+
+        assert(0);
+}
+
+static void test_refresh(void) {
+        uid_t uids[SOCKOPT_GROUPS_REFRESH_MAX * 2];
+        uint64_t n_refreshes, n_previous, now = 1;
+        size_t i, n_pending, n_uids = 0;
+        struct passwd *pw;
+        gid_t *gids = NULL;
+        size_t n_gids = 0;
+        int r;
+
+        /* collect as many distinct users as the system has, and the cache fits */
+        uids[n_uids++] = getuid();
+        setpwent();
+        while (n_uids < C_ARRAY_SIZE(uids) && (pw = getpwent())) {
+                for (i = 0; i < n_uids; ++i)
+                        if (uids[i] == pw->pw_uid)
+                                break;
+                if (i == n_uids)
+                        uids[n_uids++] = pw->pw_uid;
+        }
+        endpwent();
+
+        /* new users are resolved synchronously */
+        r = sockopt_get_groups(uids[0], now, &gids, &n_gids);
+        assert(!r);
+        assert(gids);
+        free(gids);
+
+        for (i = 1; i < n_uids; ++i) {
+                r = sockopt_get_groups(uids[i], now, NULL, NULL);
+                assert(!r);
+        }
+
+        sockopt_get_groups_stats(&n_refreshes, &n_pending);
+        assert(!n_refreshes);
+        assert(!n_pending);
+
+        /* stale entries are refreshed once, never more than fit in flight */
+        now += SOCKOPT_GROUPS_CACHE_TTL + 1;
+        for (i = 0; i < n_uids; ++i) {
+                r = sockopt_get_groups(uids[i], now, NULL, NULL);
+                assert(!r);
+
+                sockopt_get_groups_stats(&n_refreshes, &n_pending);
+                assert(n_pending <= SOCKOPT_GROUPS_REFRESH_MAX);
+        }
+
+        sockopt_get_groups_stats(&n_previous, &n_pending);
+        assert(n_previous >= 1);
+
+        test_wait_refreshed(now, uids, n_uids);
+
+        /* once merged, entries can be refreshed again */
+        now += SOCKOPT_GROUPS_CACHE_TTL + 1;
+        r = sockopt_get_groups(uids[0], now, NULL, NULL);
+        assert(!r);
+
+        sockopt_get_groups_stats(&n_refreshes, &n_pending);
+        assert(n_refreshes > n_previous);
+        assert(n_pending >= 1);
+
+        /* a pending refresh is not issued twice */
+        n_previous = n_refreshes;
+        r = sockopt_get_groups(uids[0], now, NULL, NULL);
+        assert(!r);
+
+        sockopt_get_groups_stats(&n_refreshes, &n_pending);
+        assert(n_refreshes == n_previous);
+
+        test_wait_refreshed(now, uids, n_uids);
+}
+
+int main(int argc, char **argv) {
+        test_refresh();
+        return 0;
+}
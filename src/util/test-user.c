@@ -90,8 +90,109 @@ static void test_quota(void) {
         user_registry_deinit(&registry);
 }
 
+static void test_actors(void) {
+        UserRegistry registry;
+        User *owner, *actors[64];
+        UserCharge charges[64], charge;
+        size_t i;
+        int r;
+
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 1024 * 1024, 1024, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &owner, 0);
+        assert(!r);
+
+        /* use more actors than fit into the usage cache, so entries collide */
+        for (i = 0; i < C_ARRAY_SIZE(actors); ++i) {
+                r = user_registry_ref_user(&registry, &actors[i], i + 1);
+                assert(!r);
+
+                user_charge_init(&charges[i]);
+                r = user_charge(owner, &charges[i], actors[i], USER_SLOT_BYTES, 1);
+                assert(!r);
+        }
+
+        assert(owner->n_usages == C_ARRAY_SIZE(actors));
+
+        /* separate charges of the same actor share its usage object */
+        for (i = 0; i < C_ARRAY_SIZE(actors); ++i) {
+                user_charge_init(&charge);
+                r = user_charge(owner, &charge, actors[i], USER_SLOT_BYTES, 1);
+                assert(!r);
+                assert(charge.usage == charges[i].usage);
+                user_charge_deinit(&charge);
+        }
+
+        assert(owner->n_usages == C_ARRAY_SIZE(actors));
+
+        /* a failed charge of a new actor must not leave a usage behind */
+        r = user_charge(owner, &charges[0], actors[0], USER_SLOT_BYTES, 1);
+        assert(!r);
+        user_charge_init(&charge);
+        r = user_charge(owner, &charge, owner, USER_SLOT_FDS, 1025);
+        assert(r == USER_E_QUOTA);
+        assert(!charge.usage);
+        assert(owner->n_usages == C_ARRAY_SIZE(actors));
+
+        for (i = 0; i < C_ARRAY_SIZE(actors); ++i) {
+                user_charge_deinit(&charges[i]);
+                user_unref(actors[i]);
+        }
+
+        assert(owner->n_usages == 0);
+
+        user_unref(owner);
+        user_registry_deinit(&registry);
+}
+
+static void test_split(void) {
+        UserRegistry registry;
+        User *owner, *actor;
+        UserCharge charge, parts[2];
+        int r;
+
+        r = user_registry_init(&registry, _USER_SLOT_N, (unsigned int[]){ 1024, 1024, 1024, 1024, 1024 });
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &owner, 1);
+        assert(!r);
+
+        r = user_registry_ref_user(&registry, &actor, 2);
+        assert(!r);
+
+        user_charge_init(&charge);
+        user_charge_init(&parts[0]);
+        user_charge_init(&parts[1]);
+
+        /* split a charge into parts, which are released independently */
+        r = user_charge(owner, &charge, actor, USER_SLOT_BYTES, 300);
+        assert(!r);
+        assert(owner->slots[USER_SLOT_BYTES].n == 1024 - 300);
+
+        user_charge_split(&charge, &parts[0], 100);
+        user_charge_split(&charge, &parts[1], 200);
+        assert(!charge.charge);
+        assert(owner->slots[USER_SLOT_BYTES].n == 1024 - 300);
+
+        user_charge_deinit(&parts[1]);
+        assert(owner->slots[USER_SLOT_BYTES].n == 1024 - 100);
+
+        user_charge_deinit(&charge);
+        assert(owner->slots[USER_SLOT_BYTES].n == 1024 - 100);
+
+        user_charge_deinit(&parts[0]);
+        assert(owner->slots[USER_SLOT_BYTES].n == 1024);
+
+        user_unref(actor);
+        user_unref(owner);
+        user_registry_deinit(&registry);
+}
+
 int main(int argc, char **argv) {
         test_setup();
         test_quota();
+        test_actors();
+        test_split();
         return 0;
 }
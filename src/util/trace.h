@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+ * Tracepoints
+ *
+ * The message hot-path carries static tracepoints, so its individual stages
+ * can be timed in production, using tools like bpftrace(8) or perf(1). They
+ * are compiled in via the 'usdt' meson option, and implemented as sys/sdt.h
+ * probes in the 'dbus_broker' provider. Enabled probes are a single NOP
+ * instruction, unless a tracer is attached. If the option is disabled, they
+ * compile to nothing, and their arguments are not evaluated.
+ *
+ * Every probe that relates to a message carries the unique ID of the sending
+ * peer and the serial of the message, which together identify a message on
+ * the bus. Socket-level probes carry the file-descriptor instead, which can
+ * be mapped to a peer via the 'peer_dispatch' probe.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+
+#if defined(DBUS_BROKER_USDT) && DBUS_BROKER_USDT
+#  include <sys/sdt.h>
+#  define TRACE_PROBE(_name, ...) STAP_PROBEV(dbus_broker, _name, ##__VA_ARGS__)
+#else
+#  define TRACE_PROBE(_name, ...) do { } while (0)
+#endif
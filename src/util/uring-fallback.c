@@ -0,0 +1,45 @@
+/*
+ * io_uring Submission Fallback Helpers
+ *
+ * This fallback is used when liburing is not available, and is meant to be
+ * functionally equivalent to util/uring.c on a kernel without io_uring, but
+ * without requiring the library. Since no ring is ever created, none of the
+ * other helpers can be reached.
+ *
+ * See util/uring.c for details.
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include "util/error.h"
+#include "util/uring.h"
+
+int uring_new(Uring **uringp) {
+        return URING_E_UNSUPPORTED;
+}
+
+Uring *uring_free(Uring *uring) {
+        assert(!uring);
+        return NULL;
+}
+
+int uring_poll(Uring *uring, int fd, uint32_t mask, uint64_t data) {
+        return error_origin(-ENOTRECOVERABLE);
+}
+
+int uring_poll_remove(Uring *uring, uint64_t target) {
+        return error_origin(-ENOTRECOVERABLE);
+}
+
+int uring_sendmsg(Uring *uring, int fd, const struct msghdr *msg, int flags, uint64_t data) {
+        return error_origin(-ENOTRECOVERABLE);
+}
+
+int uring_submit(Uring *uring, int timeout) {
+        return error_origin(-ENOTRECOVERABLE);
+}
+
+int uring_reap(Uring *uring, UringCompletion *completion) {
+        return error_origin(-ENOTRECOVERABLE);
+}
@@ -0,0 +1,324 @@
+/*
+ * io_uring Submission Helpers
+ *
+ * This wraps an io_uring instance for the event dispatcher. Operations are
+ * staged as submission queue entries, and only passed to the kernel by the
+ * next call to uring_submit(), which also waits for completions. Hence, any
+ * number of operations on any number of files costs a single syscall per
+ * dispatch round. If the queue runs full in between, it is submitted early.
+ *
+ * Polls are always multishot. They stay armed after posting a completion,
+ * until the kernel reports otherwise, and are only torn down explicitly.
+ *
+ * Sends are staged with their message header and iovecs copied into the
+ * ring, since the kernel does not read them before the entry is submitted.
+ * The data they point to stays owned by the caller, and must stay valid until
+ * the send completed.
+ *
+ * The ring is only set up if the kernel supports all this, and furthermore
+ * submits all entries regardless of errors and never drops completions.
+ * Otherwise, URING_E_UNSUPPORTED is returned, and the caller is expected to
+ * fall back to epoll.
+ */
+
+#include <c-macro.h>
+#include <liburing.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "util/error.h"
+#include "util/uring.h"
+
+struct Uring {
+        struct io_uring ring;
+        size_t n_msgs;
+        size_t n_vecs;
+        struct msghdr msgs[URING_ENTRIES];
+        struct iovec vecs[URING_VECS_MAX];
+};
+
+static bool uring_probe(struct io_uring *ring) {
+        struct io_uring_probe *probe;
+        bool supported;
+
+        probe = io_uring_get_probe_ring(ring);
+        if (!probe)
+                return false;
+
+        supported = io_uring_opcode_supported(probe, IORING_OP_POLL_ADD) &&
+                    io_uring_opcode_supported(probe, IORING_OP_POLL_REMOVE) &&
+                    io_uring_opcode_supported(probe, IORING_OP_SENDMSG);
+
+        io_uring_free_probe(probe);
+        return supported;
+}
+
+/**
+ * uring_new() - create new ring
+ * @uringp:             output argument for new ring
+ *
+ * This creates a new io_uring instance with URING_ENTRIES submission queue
+ * entries and URING_COMPLETIONS completion queue entries.
+ *
+ * Return: 0 on success, URING_E_UNSUPPORTED if the kernel lacks any required
+ *         feature, negative error code on failure.
+ */
+int uring_new(Uring **uringp) {
+        _c_cleanup_(uring_freep) Uring *uring = NULL;
+        struct io_uring_params params = {
+                .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL,
+                .cq_entries = URING_COMPLETIONS,
+        };
+        int r;
+
+        uring = calloc(1, sizeof(*uring));
+        if (!uring)
+                return error_origin(-ENOMEM);
+
+        uring->ring.ring_fd = -1;
+
+        r = io_uring_queue_init_params(URING_ENTRIES, &uring->ring, &params);
+        if (r < 0) {
+                uring->ring.ring_fd = -1;
+
+                /*
+                 * Old kernels reject unknown setup flags, and io_uring might
+                 * be disabled entirely, or denied by seccomp or LSMs.
+                 */
+                if (r == -EINVAL || r == -ENOSYS || r == -EPERM || r == -EACCES)
+                        return URING_E_UNSUPPORTED;
+
+                return error_origin(r);
+        }
+
+        if (!(params.features & IORING_FEAT_NODROP) ||
+            !(params.features & IORING_FEAT_SUBMIT_STABLE) ||
+            !uring_probe(&uring->ring))
+                return URING_E_UNSUPPORTED;
+
+        *uringp = uring;
+        uring = NULL;
+        return 0;
+}
+
+/**
+ * uring_free() - destroy ring
+ * @uring:              ring to destroy, or NULL
+ *
+ * This destroys @uring. Any staged entry is dropped, and any operation still
+ * in flight is cancelled by the kernel.
+ *
+ * Return: NULL is returned.
+ */
+Uring *uring_free(Uring *uring) {
+        if (!uring)
+                return NULL;
+
+        if (uring->ring.ring_fd >= 0)
+                io_uring_queue_exit(&uring->ring);
+
+        free(uring);
+
+        return NULL;
+}
+
+static int uring_flush(Uring *uring) {
+        int r;
+
+        do {
+                r = io_uring_submit(&uring->ring);
+        } while (r == -EINTR);
+
+        /*
+         * Since completions are never dropped, the kernel only refuses
+         * submissions if it failed to allocate room for their completions.
+         * This is treated like any other allocation failure.
+         */
+        if (r < 0)
+                return error_origin(r);
+
+        uring->n_msgs = 0;
+        uring->n_vecs = 0;
+        return 0;
+}
+
+static int uring_get_sqe(Uring *uring, struct io_uring_sqe **sqep) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        sqe = io_uring_get_sqe(&uring->ring);
+        if (!sqe) {
+                r = uring_flush(uring);
+                if (r)
+                        return error_trace(r);
+
+                sqe = io_uring_get_sqe(&uring->ring);
+                assert(sqe);
+        }
+
+        *sqep = sqe;
+        return 0;
+}
+
+/**
+ * uring_poll() - stage multishot poll
+ * @uring:              ring to operate on
+ * @fd:                 file descriptor to poll
+ * @mask:               EPOLL* event mask
+ * @data:               user data of the completions
+ *
+ * This stages a multishot poll of @fd for the events in @mask. A completion is
+ * posted whenever any of them is signalled, with the signalled events as
+ * result. If a completion is not flagged as @more, the poll is gone, and must
+ * be staged again, if still needed.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int uring_poll(Uring *uring, int fd, uint32_t mask, uint64_t data) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        r = uring_get_sqe(uring, &sqe);
+        if (r)
+                return error_trace(r);
+
+        io_uring_prep_poll_multishot(sqe, fd, mask);
+        io_uring_sqe_set_data64(sqe, data);
+        return 0;
+}
+
+/**
+ * uring_poll_remove() - stage removal of poll
+ * @uring:              ring to operate on
+ * @target:             user data of the poll to remove
+ *
+ * This stages the removal of the poll staged with @target as user data. The
+ * poll posts its final completion once it is removed. The completion of the
+ * removal itself carries 0 as user data.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int uring_poll_remove(Uring *uring, uint64_t target) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        r = uring_get_sqe(uring, &sqe);
+        if (r)
+                return error_trace(r);
+
+        io_uring_prep_poll_remove(sqe, target);
+        io_uring_sqe_set_data64(sqe, 0);
+        return 0;
+}
+
+/**
+ * uring_sendmsg() - stage send
+ * @uring:              ring to operate on
+ * @fd:                 socket to send on
+ * @msg:                message to send
+ * @flags:              MSG_* flags of the send
+ * @data:               user data of the completion
+ *
+ * This stages a sendmsg(2) of @msg on @fd. The message header and its iovecs
+ * are copied, but the data and control buffers they point to must stay valid
+ * until the completion was reaped. Its result is what sendmsg(2) would
+ * return, with errors as negative error codes.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int uring_sendmsg(Uring *uring, int fd, const struct msghdr *msg, int flags, uint64_t data) {
+        struct io_uring_sqe *sqe;
+        struct msghdr *m;
+        int r;
+
+        assert(msg->msg_iovlen <= C_ARRAY_SIZE(uring->vecs));
+
+        if (uring->n_msgs >= C_ARRAY_SIZE(uring->msgs) ||
+            msg->msg_iovlen > C_ARRAY_SIZE(uring->vecs) - uring->n_vecs) {
+                r = uring_flush(uring);
+                if (r)
+                        return error_trace(r);
+        }
+
+        r = uring_get_sqe(uring, &sqe);
+        if (r)
+                return error_trace(r);
+
+        m = &uring->msgs[uring->n_msgs++];
+        *m = *msg;
+        m->msg_iov = uring->vecs + uring->n_vecs;
+        memcpy(m->msg_iov, msg->msg_iov, msg->msg_iovlen * sizeof(*msg->msg_iov));
+        uring->n_vecs += msg->msg_iovlen;
+
+        io_uring_prep_sendmsg(sqe, fd, m, flags);
+        io_uring_sqe_set_data64(sqe, data);
+        return 0;
+}
+
+/**
+ * uring_submit() - submit staged entries and wait for completions
+ * @uring:              ring to operate on
+ * @timeout:            timeout in milliseconds
+ *
+ * This passes all staged entries to the kernel. If @timeout is non-zero, it
+ * then waits until at least one completion is pending, or until @timeout
+ * passed. A negative @timeout waits indefinitely. Like poll(2), an interrupted
+ * wait is not considered an error.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int uring_submit(Uring *uring, int timeout) {
+        struct __kernel_timespec ts;
+        struct io_uring_cqe *cqe;
+        int r;
+
+        if (!timeout)
+                return uring_flush(uring);
+
+        if (timeout < 0) {
+                r = io_uring_submit_and_wait(&uring->ring, 1);
+        } else {
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (timeout % 1000) * 1000000LL;
+                r = io_uring_submit_and_wait_timeout(&uring->ring, &cqe, 1, &ts, NULL);
+        }
+        if (r < 0 && r != -EINTR && r != -ETIME)
+                return error_origin(r);
+
+        /* interrupted waits might have left entries behind */
+        if (io_uring_sq_ready(&uring->ring))
+                return uring_flush(uring);
+
+        uring->n_msgs = 0;
+        uring->n_vecs = 0;
+        return 0;
+}
+
+/**
+ * uring_reap() - fetch next completion
+ * @uring:              ring to operate on
+ * @completion:         output argument for the completion
+ *
+ * This fetches the next pending completion, if any, and releases its slot in
+ * the completion queue. This never waits.
+ *
+ * Return: 0 on success, URING_E_EMPTY if no completion is pending, negative
+ *         error code on failure.
+ */
+int uring_reap(Uring *uring, UringCompletion *completion) {
+        struct io_uring_cqe *cqe;
+        int r;
+
+        r = io_uring_peek_cqe(&uring->ring, &cqe);
+        if (r == -EAGAIN)
+                return URING_E_EMPTY;
+        else if (r < 0)
+                return error_origin(r);
+
+        completion->data = io_uring_cqe_get_data64(cqe);
+        completion->res = cqe->res;
+        completion->more = cqe->flags & IORING_CQE_F_MORE;
+
+        io_uring_cqe_seen(&uring->ring, cqe);
+        return 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * io_uring Submission Helpers
+ */
+
+#include <c-macro.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+typedef struct Uring Uring;
+typedef struct UringCompletion UringCompletion;
+
+enum {
+        _URING_E_SUCCESS,
+
+        URING_E_UNSUPPORTED,
+        URING_E_EMPTY,
+};
+
+/* entries staged per submission; a full queue is submitted right away */
+#define URING_ENTRIES (256U)
+/* completions of multishot polls pile up, so the queue is sized for bursts */
+#define URING_COMPLETIONS (4096U)
+/* iovecs staged for pending sends, room for several full socket writes */
+#define URING_VECS_MAX (4096U)
+
+struct UringCompletion {
+        uint64_t data;
+        int32_t res;
+        bool more;
+};
+
+int uring_new(Uring **uringp);
+Uring *uring_free(Uring *uring);
+
+int uring_poll(Uring *uring, int fd, uint32_t mask, uint64_t data);
+int uring_poll_remove(Uring *uring, uint64_t target);
+int uring_sendmsg(Uring *uring, int fd, const struct msghdr *msg, int flags, uint64_t data);
+
+int uring_submit(Uring *uring, int timeout);
+int uring_reap(Uring *uring, UringCompletion *completion);
+
+C_DEFINE_CLEANUP(Uring *, uring_free);
@@ -44,6 +44,11 @@ static void user_usage_link(UserUsage *usage, CRBNode *parent, CRBNode **slot) {
 }
 
 static void user_usage_unlink(UserUsage *usage) {
+        UserUsage **cache = &usage->user->usage_cache[usage->uid % USER_USAGE_CACHE_MAX];
+
+        if (*cache == usage)
+                *cache = NULL;
+
         c_rbtree_remove_init(&usage->user->usage_tree, &usage->user_node);
         --usage->user->n_usages;
 }
@@ -132,6 +137,32 @@ void user_charge_deinit(UserCharge *charge) {
         }
 }
 
+/**
+ * user_charge_split() - move part of a charge to another charge object
+ * @charge:     charge object to split
+ * @target:     unused charge object to move the split charge to
+ * @amount:     amount to move
+ *
+ * This moves @amount of the charge of @charge to @target, so it can be
+ * released independently. No quota is checked, as the total amount charged
+ * does not change. This allows charging a batch of objects at once, and
+ * splitting the charge accordingly afterwards.
+ */
+void user_charge_split(UserCharge *charge, UserCharge *target, unsigned int amount) {
+        assert(!target->usage);
+
+        /* nothing was charged, if accounting was skipped */
+        if (!charge->usage || !amount)
+                return;
+
+        assert(amount <= charge->charge);
+
+        target->usage = user_usage_ref(charge->usage);
+        target->slot = charge->slot;
+        target->charge = amount;
+        charge->charge -= amount;
+}
+
 static int user_charge_check(unsigned int remaining,
                              unsigned int users,
                              unsigned int share,
@@ -187,22 +218,41 @@ void user_free(_Atomic unsigned long *n_refs, void *userdata) {
         free(user);
 }
 
-static int user_ref_usage(User *user, UserUsage **usagep, User *actor) {
+static UserUsage *user_find_usage(User *user, uid_t uid) {
+        UserUsage **cache, *usage;
+
+        /*
+         * Charges are applied several times for every message, and usually
+         * by a small set of actors. Hence, we keep a direct-mapped cache of
+         * usage objects indexed by UID in front of the usage tree, so the
+         * common case does not need to walk the tree. The cache does not
+         * pin its entries, they are evicted when unlinked.
+         */
+        cache = &user->usage_cache[uid % USER_USAGE_CACHE_MAX];
+        if (*cache && (*cache)->uid == uid)
+                return *cache;
+
+        usage = c_rbtree_find_entry(&user->usage_tree, user_usage_compare, &uid, UserUsage, user_node);
+        if (usage)
+                *cache = usage;
+
+        return usage;
+}
+
+static int user_add_usage(User *user, UserUsage **usagep, uid_t uid) {
         UserUsage *usage;
         CRBNode **slot, *parent;
         int r;
 
-        slot = c_rbtree_find_slot(&user->usage_tree, user_usage_compare, &actor->uid, &parent);
-        if (slot) {
-                r = user_usage_new(&usage, user, actor->uid);
-                if (r)
-                        return r;
+        slot = c_rbtree_find_slot(&user->usage_tree, user_usage_compare, &uid, &parent);
+        assert(slot);
 
-                user_usage_link(usage, parent, slot);
-        } else {
-                usage = c_container_of(parent, UserUsage, user_node);
-                user_usage_ref(usage);
-        }
+        r = user_usage_new(&usage, user, uid);
+        if (r)
+                return r;
+
+        user_usage_link(usage, parent, slot);
+        user->usage_cache[uid % USER_USAGE_CACHE_MAX] = usage;
 
         *usagep = usage;
         return 0;
@@ -234,8 +284,9 @@ static int user_ref_usage(User *user, UserUsage **usagep, User *actor) {
  * Return: 0 on success, error code on failure.
  */
 int user_charge(User *user, UserCharge *charge, User *actor, size_t slot, unsigned int amount) {
-        _c_cleanup_(user_usage_unrefp) UserUsage *usage = NULL;
+        _c_cleanup_(user_usage_unrefp) UserUsage *created = NULL;
         unsigned int *user_slot, *usage_slot;
+        UserUsage *usage;
         int r;
 
         /* no charge, no work */
@@ -254,11 +305,16 @@ int user_charge(User *user, UserCharge *charge, User *actor, size_t slot, unsign
                 assert(user == charge->usage->user);
                 assert(actor->uid == charge->usage->uid);
                 assert(slot == charge->slot);
-                usage = user_usage_ref(charge->usage);
+                usage = charge->usage;
         } else {
-                r = user_ref_usage(user, &usage, actor);
-                if (r)
-                        return error_trace(r);
+                usage = user_find_usage(user, actor->uid);
+                if (!usage) {
+                        r = user_add_usage(user, &created, actor->uid);
+                        if (r)
+                                return error_trace(r);
+
+                        usage = created;
+                }
         }
 
         assert(slot < user->registry->n_slots);
@@ -281,8 +337,8 @@ int user_charge(User *user, UserCharge *charge, User *actor, size_t slot, unsign
 
         if (!charge->usage) {
                 charge->slot = slot;
-                charge->usage = usage;
-                usage = NULL;
+                charge->usage = created ?: user_usage_ref(usage);
+                created = NULL;
         }
 
         return 0;
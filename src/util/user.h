@@ -15,12 +15,16 @@ typedef struct UserUsage UserUsage;
 typedef struct User User;
 typedef struct UserRegistry UserRegistry;
 
+/* users are charged by few distinct actors, so collisions are rare */
+#define USER_USAGE_CACHE_MAX (16)
+
 /* XXX: move this to some global broker header file */
 enum {
         USER_SLOT_BYTES,
         USER_SLOT_FDS,
         USER_SLOT_MATCHES,
         USER_SLOT_OBJECTS,
+        USER_SLOT_MEMFD_BYTES,
         _USER_SLOT_N,
 };
 
@@ -42,6 +46,7 @@ struct UserCharge {
 
 void user_charge_init(UserCharge *charge);
 void user_charge_deinit(UserCharge *charge);
+void user_charge_split(UserCharge *charge, UserCharge *target, unsigned int amount);
 
 /* user */
 
@@ -53,6 +58,7 @@ struct User {
 
         CRBTree usage_tree;
         unsigned int n_usages;
+        UserUsage *usage_cache[USER_USAGE_CACHE_MAX];
 
         struct {
                 unsigned int n;
@@ -0,0 +1,329 @@
+/*
+ * Broker Benchmarks
+ *
+ * This runs a set of end-to-end benchmarks against a broker spawned via the
+ * test infrastructure. If DBUS_BROKER_TEST_DAEMON is set, the benchmarks are
+ * run against dbus-daemon(1) instead, so results can be compared.
+ *
+ * Results are written to stdout, one JSON object per line and benchmark.
+ */
+
+#include <c-macro.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include "util-broker.h"
+
+#define BENCH_PING_PONG_N (16 * 1024)
+#define BENCH_BROADCAST_N (1024)
+#define BENCH_BROADCAST_RECEIVERS (32)
+#define BENCH_NAME_CHURN_N (4 * 1024)
+#define BENCH_CONNECT_N (1024)
+#define BENCH_FD_PASSING_N (8 * 1024)
+
+typedef struct BenchPingPong BenchPingPong;
+typedef struct BenchBroadcast BenchBroadcast;
+
+struct BenchPingPong {
+        sd_event *event;
+        sd_bus *client;
+        const char *destination;
+        int fd;
+        size_t n_sent;
+        size_t n_total;
+};
+
+struct BenchBroadcast {
+        sd_event *event;
+        sd_bus *sender;
+        size_t n_sent;
+        size_t n_received;
+        size_t n_receivers;
+        size_t n_total;
+};
+
+static uint64_t bench_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, size_t n_ops, uint64_t nsec) {
+        printf("{ \"benchmark\": \"%s\", \"daemon\": \"%s\", \"operations\": %zu, \"nsec\": %llu, \"nsec_per_op\": %llu }\n",
+               name,
+               getenv("DBUS_BROKER_TEST_DAEMON") ? "dbus-daemon" : "dbus-broker",
+               n_ops,
+               (unsigned long long)nsec,
+               (unsigned long long)(n_ops ? nsec / n_ops : 0));
+        fflush(stdout);
+}
+
+static int bench_server_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        return sd_bus_reply_method_return(m, NULL);
+}
+
+static void bench_ping_pong_send(BenchPingPong *pp);
+
+static int bench_ping_pong_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        BenchPingPong *pp = userdata;
+
+        assert(!sd_bus_message_get_error(m));
+
+        if (pp->n_sent < pp->n_total)
+                bench_ping_pong_send(pp);
+        else
+                return sd_event_exit(pp->event, 0);
+
+        return 0;
+}
+
+static void bench_ping_pong_send(BenchPingPong *pp) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(pp->client,
+                                           &m,
+                                           pp->destination,
+                                           "/org/bus1/Bench",
+                                           "org.bus1.Bench",
+                                           "Ping");
+        assert(r >= 0);
+
+        if (pp->fd >= 0) {
+                r = sd_bus_message_append(m, "h", pp->fd);
+                assert(r >= 0);
+        }
+
+        r = sd_bus_call_async(pp->client, NULL, m, bench_ping_pong_fn, pp, 0);
+        assert(r >= 0);
+
+        ++pp->n_sent;
+}
+
+static void bench_ping_pong_run(Broker *broker, const char *name, size_t n_total, bool with_fd) {
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *server = NULL, *client = NULL;
+        _c_cleanup_(c_closep) int fd = -1;
+        BenchPingPong pp = {};
+        const char *unique;
+        uint64_t ts;
+        int r;
+
+        r = sd_event_new(&event);
+        assert(r >= 0);
+
+        util_broker_connect(broker, &server);
+        r = sd_bus_attach_event(server, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(r >= 0);
+
+        r = sd_bus_add_object(server, NULL, "/org/bus1/Bench", bench_server_fn, NULL);
+        assert(r >= 0);
+
+        util_broker_connect(broker, &client);
+        r = sd_bus_attach_event(client, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(r >= 0);
+
+        r = sd_bus_get_unique_name(server, &unique);
+        assert(r >= 0);
+
+        if (with_fd) {
+                fd = eventfd(0, EFD_CLOEXEC);
+                assert(fd >= 0);
+        }
+
+        pp.event = event;
+        pp.client = client;
+        pp.destination = unique;
+        pp.fd = fd;
+        pp.n_total = n_total;
+
+        ts = bench_now();
+
+        bench_ping_pong_send(&pp);
+
+        r = sd_event_loop(event);
+        assert(!r);
+
+        bench_report(name, n_total, bench_now() - ts);
+}
+
+static void bench_ping_pong(Broker *broker) {
+        /*
+         * Unicast method-call round-trips between two peers. Only a single
+         * call is in flight at any time, so this measures the latency of a
+         * call and its reply through the broker.
+         */
+        bench_ping_pong_run(broker, "ping-pong", BENCH_PING_PONG_N, false);
+}
+
+static void bench_fd_passing(Broker *broker) {
+        /*
+         * Same as the ping-pong benchmark, but every call carries a single
+         * file-descriptor. This measures the overhead of FD-passing through
+         * the broker, including its in-flight accounting.
+         */
+        bench_ping_pong_run(broker, "fd-passing", BENCH_FD_PASSING_N, true);
+}
+
+static void bench_broadcast_send(BenchBroadcast *bb) {
+        int r;
+
+        r = sd_bus_emit_signal(bb->sender, "/org/bus1/Bench", "org.bus1.Bench", "Signal", NULL);
+        assert(r >= 0);
+
+        ++bb->n_sent;
+}
+
+static int bench_broadcast_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        BenchBroadcast *bb = userdata;
+
+        /*
+         * Only send the next signal once all receivers got the previous one,
+         * so we never overrun the receive queues of our peers.
+         */
+        if (++bb->n_received < bb->n_sent * bb->n_receivers)
+                return 0;
+
+        if (bb->n_sent < bb->n_total)
+                bench_broadcast_send(bb);
+        else
+                return sd_event_exit(bb->event, 0);
+
+        return 0;
+}
+
+static void bench_broadcast(Broker *broker) {
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *sender = NULL;
+        sd_bus *receivers[BENCH_BROADCAST_RECEIVERS] = {};
+        BenchBroadcast bb = {};
+        const char *unique;
+        char match[256];
+        uint64_t ts;
+        size_t i;
+        int r;
+
+        /*
+         * One sender emits signals that are matched by a set of receivers.
+         * This measures the fan-out cost of the broker, which has to find
+         * and serve all matching receivers of every signal.
+         */
+
+        r = sd_event_new(&event);
+        assert(r >= 0);
+
+        util_broker_connect(broker, &sender);
+        r = sd_bus_attach_event(sender, event, SD_EVENT_PRIORITY_NORMAL);
+        assert(r >= 0);
+
+        r = sd_bus_get_unique_name(sender, &unique);
+        assert(r >= 0);
+
+        r = snprintf(match, sizeof(match),
+                     "type='signal',sender='%s',interface='org.bus1.Bench',member='Signal'",
+                     unique);
+        assert(r > 0 && r < (int)sizeof(match));
+
+        bb.event = event;
+        bb.sender = sender;
+        bb.n_receivers = BENCH_BROADCAST_RECEIVERS;
+        bb.n_total = BENCH_BROADCAST_N;
+
+        for (i = 0; i < C_ARRAY_SIZE(receivers); ++i) {
+                util_broker_connect(broker, &receivers[i]);
+
+                r = sd_bus_add_match(receivers[i], NULL, match, bench_broadcast_fn, &bb);
+                assert(r >= 0);
+
+                r = sd_bus_attach_event(receivers[i], event, SD_EVENT_PRIORITY_NORMAL);
+                assert(r >= 0);
+        }
+
+        ts = bench_now();
+
+        bench_broadcast_send(&bb);
+
+        r = sd_event_loop(event);
+        assert(!r);
+
+        bench_report("broadcast", bb.n_received, bench_now() - ts);
+
+        for (i = 0; i < C_ARRAY_SIZE(receivers); ++i)
+                sd_bus_flush_close_unref(receivers[i]);
+}
+
+static void bench_name_churn(Broker *broker) {
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+        uint64_t ts;
+        size_t i;
+        int r;
+
+        /*
+         * Acquire and release a well-known name in a loop. Every iteration
+         * involves two synchronous driver calls, as well as the
+         * NameOwnerChanged broadcasts triggered by them.
+         */
+
+        util_broker_connect(broker, &bus);
+
+        ts = bench_now();
+
+        for (i = 0; i < BENCH_NAME_CHURN_N; ++i) {
+                r = sd_bus_request_name(bus, "org.bus1.Bench", 0);
+                assert(r > 0);
+
+                r = sd_bus_release_name(bus, "org.bus1.Bench");
+                assert(r > 0);
+        }
+
+        bench_report("name-churn", BENCH_NAME_CHURN_N, bench_now() - ts);
+}
+
+static void bench_connect(Broker *broker) {
+        const char *unique;
+        uint64_t ts;
+        size_t i;
+        int r;
+
+        /*
+         * Connect, authenticate, and say Hello, then disconnect again. This
+         * measures the cost of connection setup and teardown.
+         */
+
+        ts = bench_now();
+
+        for (i = 0; i < BENCH_CONNECT_N; ++i) {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+
+                util_broker_connect(broker, &bus);
+
+                /* blocks until the Hello() reply was received */
+                r = sd_bus_get_unique_name(bus, &unique);
+                assert(r >= 0);
+        }
+
+        bench_report("connect", BENCH_CONNECT_N, bench_now() - ts);
+}
+
+int main(int argc, char **argv) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        bench_ping_pong(broker);
+        bench_broadcast(broker);
+        bench_name_churn(broker);
+        bench_connect(broker);
+        bench_fd_passing(broker);
+
+        util_broker_terminate(broker);
+
+        return 0;
+}
@@ -0,0 +1,1213 @@
+/*
+ * Traffic Replay Benchmark
+ *
+ * This records the traffic of a running bus via a capture monitor, and then
+ * replays it against a broker spawned via the test infrastructure:
+ *
+ *     bench-replay record [--address ADDRESS] FILE
+ *     bench-replay replay [--speed FACTOR|max] FILE
+ *
+ * The capture is a pcap file of raw D-Bus messages, as written by
+ * BecomeCaptureMonitor(). Apart from the messages sent by peers, including
+ * their Hello() and AddMatch() calls, it carries the NameOwnerChanged signals
+ * of the driver, which tell when a peer disconnected.
+ *
+ * For every peer in the capture, an equivalent peer is connected to the test
+ * broker. Its messages are re-sent with their original serials, flags, header
+ * fields and bodies. Only unique names in the destination field are mapped to
+ * the peers of the replay, unique names in bodies and match rules are not.
+ * File-descriptors are replaced by /dev/null. Replies are only sent once the
+ * call they answer was received by the replaying peer, so the order of
+ * events seen by the broker does not depend on the replay speed.
+ *
+ * The replay runs at the speed of the capture, scaled by FACTOR, or as fast
+ * as possible with a bounded number of outstanding calls. If
+ * DBUS_BROKER_TEST_DAEMON is set, the replay runs against dbus-daemon(1)
+ * instead, so results can be compared.
+ *
+ * Results are written to stdout as a single JSON object.
+ */
+
+#include <c-macro.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <search.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "util-broker.h"
+
+#define REPLAY_LINKTYPE_DBUS (231) /* taken from the pcap link-type registry */
+#define REPLAY_FD_MAX (253) /* taken from kernel SCM_MAX_FD */
+#define REPLAY_WINDOW_MAX (256) /* keeps the broker saturated, without exhausting quotas */
+#define REPLAY_TIMEOUT_NSEC (1000ULL * 1000ULL * 1000ULL) /* a lost reply costs at most this, per wait */
+#define REPLAY_EVENTS_MAX (64) /* further events are fetched on the next call */
+
+typedef struct Replay Replay;
+typedef struct ReplayMessage ReplayMessage;
+typedef struct ReplayPeer ReplayPeer;
+typedef struct ReplayStats ReplayStats;
+
+enum {
+        REPLAY_ACTION_SKIP,
+        REPLAY_ACTION_CONNECT,
+        REPLAY_ACTION_SEND,
+        REPLAY_ACTION_DISCONNECT,
+};
+
+enum {
+        REPLAY_CLASS_CONNECT,
+        REPLAY_CLASS_CALL,
+        REPLAY_CLASS_SIGNAL,
+        _REPLAY_CLASS_N,
+};
+
+struct ReplayMessage {
+        uint64_t ts;
+        unsigned int action;
+        bool big_endian : 1;
+        bool sent : 1;
+        bool delivered : 1;
+        bool answered : 1;
+        bool replied : 1;
+        bool windowed : 1;
+
+        uint8_t type;
+        uint8_t flags;
+        uint32_t serial;
+        uint32_t reply_serial;
+        uint32_t n_fds;
+        const char *path;
+        const char *interface;
+        const char *member;
+        const char *error_name;
+        const char *destination;
+        const char *sender;
+        const char *signature;
+        const uint8_t *body;
+        size_t n_body;
+
+        ReplayPeer *peer;
+        ReplayPeer *target;
+        ReplayMessage *call;
+        uint64_t ts_sent;
+};
+
+struct ReplayPeer {
+        char *name;
+        char *unique;
+        int fd;
+        bool seen : 1;
+        bool implicit : 1;
+        bool dead : 1;
+
+        ReplayMessage *hello;
+        ReplayMessage hello_storage;
+        size_t n_pending;
+        size_t n_auth;
+
+        uint8_t *in;
+        size_t n_in;
+        size_t n_in_size;
+};
+
+struct ReplayStats {
+        uint64_t *latencies;
+        size_t n_latencies;
+        size_t n_latencies_size;
+};
+
+struct Replay {
+        Broker *broker;
+        int epoll_fd;
+        int null_fd;
+        double speed;
+
+        const uint8_t *data;
+        size_t n_data;
+        ReplayMessage *messages;
+        size_t n_messages;
+        ReplayPeer **peers;
+        size_t n_peers;
+
+        void *names;
+        void *uniques;
+        void *serials;
+
+        size_t n_window;
+        size_t n_sent;
+        size_t n_received;
+        size_t n_skipped;
+        ReplayStats stats[_REPLAY_CLASS_N];
+};
+
+#define REPLAY_NULL {                                                           \
+                .epoll_fd = -1,                                                 \
+                .null_fd = -1,                                                  \
+                .speed = 1,                                                     \
+        }
+
+static void replay_free_nothing(void *p) {
+}
+
+static void replay_deinit(Replay *replay) {
+        ReplayPeer *peer;
+        size_t i;
+
+        tdestroy(replay->serials, replay_free_nothing);
+        tdestroy(replay->uniques, replay_free_nothing);
+        tdestroy(replay->names, replay_free_nothing);
+
+        for (i = 0; i < replay->n_peers; ++i) {
+                peer = replay->peers[i];
+                if (peer->fd >= 0)
+                        close(peer->fd);
+                free(peer->in);
+                free(peer->unique);
+                free(peer->name);
+                free(peer);
+        }
+
+        for (i = 0; i < _REPLAY_CLASS_N; ++i)
+                free(replay->stats[i].latencies);
+
+        free(replay->peers);
+        free(replay->messages);
+        if (replay->data)
+                munmap((void *)replay->data, replay->n_data);
+        if (replay->null_fd >= 0)
+                close(replay->null_fd);
+        if (replay->epoll_fd >= 0)
+                close(replay->epoll_fd);
+}
+
+static uint64_t replay_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint32_t replay_read_u32(const uint8_t *p, bool big_endian) {
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return big_endian ? be32toh(v) : le32toh(v);
+}
+
+static void replay_write_u32(uint8_t *p, bool big_endian, uint32_t v) {
+        v = big_endian ? htobe32(v) : htole32(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static int replay_read_string(const uint8_t *data, size_t n_data, bool big_endian, size_t *ip, char type, const char **stringp) {
+        size_t i = *ip, n;
+
+        if (type == 'g') {
+                if (i >= n_data)
+                        return -1;
+                n = data[i++];
+        } else {
+                i = c_align_to(i, 4);
+                if (i + 4 > n_data)
+                        return -1;
+                /* strings are bounded by the message size, hence no overflow */
+                n = replay_read_u32(data + i, big_endian);
+                i += 4;
+        }
+
+        if (n >= n_data || i + n >= n_data || data[i + n])
+                return -1;
+
+        *stringp = (const char *)data + i;
+        *ip = i + n + 1;
+        return 0;
+}
+
+static int replay_parse(ReplayMessage *m, const uint8_t *data, size_t n_data) {
+        const char *string;
+        size_t i, n_fields;
+        uint32_t value;
+        uint8_t code;
+        char type;
+        int r;
+
+        /*
+         * Parse the fixed header and the header fields of a single message.
+         * All strings point into @data, they are terminated in the wire format
+         * already. Anything unexpected makes the message unusable.
+         */
+
+        if (n_data < 16 || (data[0] != 'l' && data[0] != 'B') || data[3] != 1)
+                return -1;
+
+        m->big_endian = data[0] == 'B';
+        m->type = data[1];
+        m->flags = data[2];
+        m->n_body = replay_read_u32(data + 4, m->big_endian);
+        m->serial = replay_read_u32(data + 8, m->big_endian);
+        n_fields = replay_read_u32(data + 12, m->big_endian);
+
+        if (n_fields > n_data - 16 ||
+            m->n_body > n_data ||
+            c_align8(16 + n_fields) + m->n_body != n_data)
+                return -1;
+
+        for (i = 16; i < 16 + n_fields; ) {
+                i = c_align8(i);
+                if (i + 4 > 16 + n_fields || data[i + 1] != 1 || data[i + 3])
+                        return -1;
+
+                code = data[i];
+                type = data[i + 2];
+                i += 4;
+
+                switch (type) {
+                case 's':
+                case 'o':
+                case 'g':
+                        r = replay_read_string(data, 16 + n_fields, m->big_endian, &i, type, &string);
+                        if (r)
+                                return r;
+
+                        switch (code) {
+                        case 1: m->path = string; break;
+                        case 2: m->interface = string; break;
+                        case 3: m->member = string; break;
+                        case 4: m->error_name = string; break;
+                        case 6: m->destination = string; break;
+                        case 7: m->sender = string; break;
+                        case 8: m->signature = string; break;
+                        }
+                        break;
+                case 'u':
+                        i = c_align_to(i, 4);
+                        if (i + 4 > 16 + n_fields)
+                                return -1;
+
+                        value = replay_read_u32(data + i, m->big_endian);
+                        i += 4;
+
+                        switch (code) {
+                        case 5: m->reply_serial = value; break;
+                        case 9: m->n_fds = value; break;
+                        }
+                        break;
+                default:
+                        return -1;
+                }
+        }
+
+        m->body = data + c_align8(16 + n_fields);
+        return 0;
+}
+
+static int replay_compare_name(const void *a, const void *b) {
+        return strcmp(((const ReplayPeer *)a)->name, ((const ReplayPeer *)b)->name);
+}
+
+static int replay_compare_unique(const void *a, const void *b) {
+        return strcmp(((const ReplayPeer *)a)->unique, ((const ReplayPeer *)b)->unique);
+}
+
+static int replay_compare_serial(const void *a, const void *b) {
+        const ReplayMessage *ma = a, *mb = b;
+
+        if (ma->peer != mb->peer)
+                return ma->peer < mb->peer ? -1 : 1;
+        if (ma->serial != mb->serial)
+                return ma->serial < mb->serial ? -1 : 1;
+        return 0;
+}
+
+static ReplayPeer *replay_find_peer(Replay *replay, const char *name) {
+        ReplayPeer key = { .name = (char *)name }, **p;
+
+        p = tfind(&key, &replay->names, replay_compare_name);
+        return p ? *p : NULL;
+}
+
+static ReplayPeer *replay_get_peer(Replay *replay, const char *name) {
+        ReplayPeer *peer, **p;
+
+        peer = replay_find_peer(replay, name);
+        if (peer)
+                return peer;
+
+        peer = calloc(1, sizeof(*peer));
+        assert(peer);
+
+        peer->fd = -1;
+        peer->name = strdup(name);
+        assert(peer->name);
+
+        p = tsearch(peer, &replay->names, replay_compare_name);
+        assert(p && *p == peer);
+
+        replay->peers = realloc(replay->peers, (replay->n_peers + 1) * sizeof(*replay->peers));
+        assert(replay->peers);
+        replay->peers[replay->n_peers++] = peer;
+
+        return peer;
+}
+
+static ReplayMessage *replay_find_message(Replay *replay, ReplayPeer *peer, uint32_t serial) {
+        ReplayMessage key = { .peer = peer, .serial = serial }, **p;
+
+        p = tfind(&key, &replay->serials, replay_compare_serial);
+        return p ? *p : NULL;
+}
+
+static void replay_add_message(Replay *replay, ReplayMessage *m) {
+        ReplayMessage **p;
+
+        /* a reused serial supersedes the previous message */
+        p = tsearch(m, &replay->serials, replay_compare_serial);
+        assert(p);
+        *p = m;
+}
+
+static void replay_classify(Replay *replay, ReplayMessage *m) {
+        const char *name, *old_owner, *new_owner;
+        ReplayPeer *peer;
+        ReplayMessage *call;
+        size_t i;
+
+        if (!m->sender)
+                return;
+
+        if (!strcmp(m->sender, "org.freedesktop.DBus")) {
+                /*
+                 * Of all driver messages, only the NameOwnerChanged signals
+                 * dropping unique names are of interest, they tell when a
+                 * peer disconnected.
+                 */
+                if (m->type != 4 || !m->member || strcmp(m->member, "NameOwnerChanged") ||
+                    !m->signature || strcmp(m->signature, "sss"))
+                        return;
+
+                i = 0;
+                if (replay_read_string(m->body, m->n_body, m->big_endian, &i, 's', &name) ||
+                    replay_read_string(m->body, m->n_body, m->big_endian, &i, 's', &old_owner) ||
+                    replay_read_string(m->body, m->n_body, m->big_endian, &i, 's', &new_owner))
+                        return;
+
+                if (*name != ':' || strcmp(name, old_owner) || *new_owner)
+                        return;
+
+                m->peer = replay_find_peer(replay, name);
+                if (m->peer)
+                        m->action = REPLAY_ACTION_DISCONNECT;
+
+                return;
+        }
+
+        peer = replay_get_peer(replay, m->sender);
+        m->peer = peer;
+
+        if (m->type == 1 && m->destination && !strcmp(m->destination, "org.freedesktop.DBus") &&
+            m->member && !strcmp(m->member, "Hello")) {
+                if (!peer->seen) {
+                        peer->seen = true;
+                        peer->hello = m;
+                        m->action = REPLAY_ACTION_CONNECT;
+                        replay_add_message(replay, m);
+                }
+                return;
+        }
+
+        /* peers that connected before the capture started are set up upfront */
+        if (!peer->seen) {
+                peer->seen = true;
+                peer->implicit = true;
+        }
+
+        if (m->destination && *m->destination == ':') {
+                m->target = replay_get_peer(replay, m->destination);
+                if (!m->target->seen) {
+                        m->target->seen = true;
+                        m->target->implicit = true;
+                }
+        }
+
+        if (m->type == 2 || m->type == 3) {
+                if (!m->target)
+                        return;
+
+                call = replay_find_message(replay, m->target, m->reply_serial);
+                if (!call || call->type != 1 || call->action != REPLAY_ACTION_SEND)
+                        return;
+
+                m->call = call;
+                call->replied = true;
+        }
+
+        if (m->n_fds > REPLAY_FD_MAX)
+                return;
+
+        m->action = REPLAY_ACTION_SEND;
+        replay_add_message(replay, m);
+}
+
+static void replay_load(Replay *replay, const char *path) {
+        const uint8_t *p, *end;
+        struct stat st;
+        uint32_t header[6], record[4];
+        size_t n;
+        int fd, r;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                fprintf(stderr, "Cannot open '%s': %m\n", path);
+                exit(1);
+        }
+
+        r = fstat(fd, &st);
+        assert(r >= 0);
+
+        if (st.st_size < (off_t)sizeof(header)) {
+                fprintf(stderr, "'%s' is not a capture\n", path);
+                exit(1);
+        }
+
+        replay->n_data = st.st_size;
+        replay->data = mmap(NULL, replay->n_data, PROT_READ, MAP_PRIVATE, fd, 0);
+        assert(replay->data != MAP_FAILED);
+        close(fd);
+
+        memcpy(header, replay->data, sizeof(header));
+        if (header[0] != 0xa1b2c3d4 || header[5] != REPLAY_LINKTYPE_DBUS) {
+                fprintf(stderr, "'%s' is not a D-Bus capture\n", path);
+                exit(1);
+        }
+
+        /*
+         * Count the records first, so the message array is allocated once
+         * and messages can be referenced by pointer while loading.
+         */
+        end = replay->data + replay->n_data;
+        n = 0;
+        for (p = replay->data + sizeof(header); end - p >= (ssize_t)sizeof(record); p += sizeof(record) + record[2]) {
+                memcpy(record, p, sizeof(record));
+                if (record[2] > (size_t)(end - p) - sizeof(record))
+                        break;
+                ++n;
+        }
+
+        replay->messages = calloc(n ?: 1, sizeof(*replay->messages));
+        assert(replay->messages);
+
+        for (p = replay->data + sizeof(header); replay->n_messages < n; p += sizeof(record) + record[2]) {
+                ReplayMessage *m = &replay->messages[replay->n_messages];
+
+                memcpy(record, p, sizeof(record));
+
+                /* truncated and malformed messages cannot be replayed */
+                if (record[2] < record[3] || replay_parse(m, p + sizeof(record), record[2])) {
+                        *m = (ReplayMessage){};
+                        ++replay->n_skipped;
+                        --n;
+                        continue;
+                }
+
+                m->ts = (uint64_t)record[0] * UINT64_C(1000000000) + (uint64_t)record[1] * UINT64_C(1000);
+                replay_classify(replay, m);
+                if (m->action == REPLAY_ACTION_SKIP)
+                        ++replay->n_skipped;
+
+                ++replay->n_messages;
+        }
+}
+
+static void replay_account(Replay *replay, unsigned int class, uint64_t nsec) {
+        ReplayStats *stats = &replay->stats[class];
+
+        if (stats->n_latencies >= stats->n_latencies_size) {
+                stats->n_latencies_size = (stats->n_latencies_size ?: 1024) * 2;
+                stats->latencies = realloc(stats->latencies, stats->n_latencies_size * sizeof(*stats->latencies));
+                assert(stats->latencies);
+        }
+
+        stats->latencies[stats->n_latencies++] = nsec;
+}
+
+static void replay_drop(Replay *replay, ReplayPeer *peer) {
+        if (peer->fd < 0)
+                return;
+
+        close(peer->fd);
+        peer->fd = -1;
+        peer->dead = true;
+
+        /* calls of a disconnected peer are never answered */
+        replay->n_window -= peer->n_pending;
+        peer->n_pending = 0;
+}
+
+static void replay_handle(Replay *replay, ReplayPeer *peer, const uint8_t *data, size_t n_data) {
+        ReplayMessage in = {}, *m;
+        ReplayPeer key = {}, **sender;
+        const char *unique;
+        size_t i;
+
+        ++replay->n_received;
+
+        if (replay_parse(&in, data, n_data))
+                return;
+
+        if (in.type == 2 || in.type == 3) {
+                m = (!peer->unique && peer->hello && in.reply_serial == peer->hello->serial) ?
+                        peer->hello : replay_find_message(replay, peer, in.reply_serial);
+                if (!m || !m->sent || m->answered)
+                        return;
+
+                m->answered = true;
+
+                if (m == peer->hello) {
+                        replay_account(replay, REPLAY_CLASS_CONNECT, replay_now() - m->ts_sent);
+
+                        i = 0;
+                        if (in.type != 2 || !in.signature || strcmp(in.signature, "s") ||
+                            replay_read_string(in.body, in.n_body, in.big_endian, &i, 's', &unique)) {
+                                replay_drop(replay, peer);
+                                return;
+                        }
+
+                        peer->unique = strdup(unique);
+                        assert(peer->unique);
+                        sender = tsearch(peer, &replay->uniques, replay_compare_unique);
+                        assert(sender);
+                } else {
+                        replay_account(replay, REPLAY_CLASS_CALL, replay_now() - m->ts_sent);
+
+                        if (m->windowed) {
+                                --replay->n_window;
+                                --peer->n_pending;
+                        }
+                }
+        } else if (in.sender) {
+                key.unique = (char *)in.sender;
+                sender = tfind(&key, &replay->uniques, replay_compare_unique);
+                if (!sender)
+                        return;
+
+                m = replay_find_message(replay, *sender, in.serial);
+                if (!m || !m->sent)
+                        return;
+
+                m->delivered = true;
+
+                if (in.type == 4)
+                        replay_account(replay, REPLAY_CLASS_SIGNAL, replay_now() - m->ts_sent);
+        }
+}
+
+static void replay_read(Replay *replay, ReplayPeer *peer) {
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(int) * REPLAY_FD_MAX)];
+        } control;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        uint8_t *p, *end;
+        size_t i, n;
+        ssize_t l;
+
+        for (;;) {
+                if (peer->n_in_size - peer->n_in < 4096) {
+                        peer->n_in_size = (peer->n_in_size ?: 4096) * 2;
+                        peer->in = realloc(peer->in, peer->n_in_size);
+                        assert(peer->in);
+                }
+
+                iov = (struct iovec){ peer->in + peer->n_in, peer->n_in_size - peer->n_in };
+                msg = (struct msghdr){
+                        .msg_iov = &iov,
+                        .msg_iovlen = 1,
+                        .msg_control = &control,
+                        .msg_controllen = sizeof(control),
+                };
+
+                l = recvmsg(peer->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+                if (l < 0 && (errno == EAGAIN || errno == EINTR))
+                        break;
+                if (l <= 0) {
+                        replay_drop(replay, peer);
+                        return;
+                }
+
+                /* received file-descriptors are of no interest */
+                for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                                continue;
+
+                        for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i)
+                                close(((int *)CMSG_DATA(cmsg))[i]);
+                }
+
+                peer->n_in += l;
+        }
+
+        p = peer->in;
+        end = peer->in + peer->n_in;
+
+        /* the SASL replies to our pipelined AUTH and NEGOTIATE_UNIX_FD */
+        while (peer->n_auth) {
+                uint8_t *eol = memmem(p, end - p, "\r\n", 2);
+
+                if (!eol)
+                        break;
+
+                if (strncmp((char *)p, "OK ", 3) && strncmp((char *)p, "AGREE_UNIX_FD", 13)) {
+                        replay_drop(replay, peer);
+                        return;
+                }
+
+                p = eol + 2;
+                --peer->n_auth;
+        }
+
+        while (!peer->n_auth && end - p >= 16) {
+                n = replay_read_u32(p + 12, p[0] == 'B');
+                n = c_align8(16 + n) + replay_read_u32(p + 4, p[0] == 'B');
+                if ((size_t)(end - p) < n)
+                        break;
+
+                replay_handle(replay, peer, p, n);
+                if (peer->dead)
+                        return;
+
+                p += n;
+        }
+
+        peer->n_in = end - p;
+        memmove(peer->in, p, peer->n_in);
+}
+
+static bool replay_dispatch(Replay *replay, uint64_t timeout) {
+        struct epoll_event events[REPLAY_EVENTS_MAX];
+        ReplayPeer *peer;
+        int i, n;
+
+        n = epoll_wait(replay->epoll_fd, events, C_ARRAY_SIZE(events), (timeout + 999999) / 1000000);
+        if (n < 0 && errno == EINTR)
+                return false;
+        assert(n >= 0);
+
+        for (i = 0; i < n; ++i) {
+                peer = events[i].data.ptr;
+                if (peer->fd >= 0)
+                        replay_read(replay, peer);
+        }
+
+        return n > 0;
+}
+
+static void replay_send(Replay *replay, ReplayPeer *peer, ReplayMessage *m) {
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(int) * REPLAY_FD_MAX)];
+        } control;
+        const char *destination;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        uint8_t *data;
+        size_t i, n, n_data, n_fields;
+        ssize_t l;
+
+        destination = m->target ? m->target->unique : m->destination;
+
+        /* every string field takes at most 8 bytes of padding and framing */
+        n_data = 16 + 16 * 8;
+        n_data += m->path ? strlen(m->path) + 16 : 0;
+        n_data += m->interface ? strlen(m->interface) + 16 : 0;
+        n_data += m->member ? strlen(m->member) + 16 : 0;
+        n_data += m->error_name ? strlen(m->error_name) + 16 : 0;
+        n_data += destination ? strlen(destination) + 16 : 0;
+        n_data += m->signature ? strlen(m->signature) + 16 : 0;
+        n_data += m->n_body;
+
+        data = calloc(1, n_data);
+        assert(data);
+
+        data[0] = m->big_endian ? 'B' : 'l';
+        data[1] = m->type;
+        data[2] = m->flags;
+        data[3] = 1;
+        replay_write_u32(data + 4, m->big_endian, m->n_body);
+        replay_write_u32(data + 8, m->big_endian, m->serial);
+
+        i = 16;
+
+#define REPLAY_WRITE_STRING(_code, _type, _string)                              \
+        if (_string) {                                                          \
+                n = strlen(_string);                                            \
+                i = c_align8(i);                                                \
+                data[i++] = (_code);                                            \
+                data[i++] = 1;                                                  \
+                data[i++] = (_type);                                            \
+                data[i++] = 0;                                                  \
+                if ((_type) == 'g') {                                           \
+                        data[i++] = n;                                          \
+                } else {                                                        \
+                        replay_write_u32(data + i, m->big_endian, n);           \
+                        i += 4;                                                 \
+                }                                                               \
+                memcpy(data + i, (_string), n + 1);                             \
+                i += n + 1;                                                     \
+        }
+
+#define REPLAY_WRITE_U32(_code, _value)                                         \
+        if (_value) {                                                           \
+                i = c_align8(i);                                                \
+                data[i++] = (_code);                                            \
+                data[i++] = 1;                                                  \
+                data[i++] = 'u';                                                \
+                data[i++] = 0;                                                  \
+                replay_write_u32(data + i, m->big_endian, (_value));            \
+                i += 4;                                                         \
+        }
+
+        REPLAY_WRITE_STRING(1, 'o', m->path);
+        REPLAY_WRITE_STRING(2, 's', m->interface);
+        REPLAY_WRITE_STRING(3, 's', m->member);
+        REPLAY_WRITE_STRING(4, 's', m->error_name);
+        REPLAY_WRITE_U32(5, m->reply_serial);
+        REPLAY_WRITE_STRING(6, 's', destination);
+        REPLAY_WRITE_STRING(8, 'g', m->signature);
+        REPLAY_WRITE_U32(9, m->n_fds);
+
+#undef REPLAY_WRITE_U32
+#undef REPLAY_WRITE_STRING
+
+        n_fields = i - 16;
+        replay_write_u32(data + 12, m->big_endian, n_fields);
+
+        i = c_align8(i);
+        memcpy(data + i, m->body, m->n_body);
+        n_data = i + m->n_body;
+
+        msg = (struct msghdr){ .msg_iov = &iov, .msg_iovlen = 1 };
+        if (m->n_fds) {
+                msg.msg_control = &control;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int) * m->n_fds);
+
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * m->n_fds);
+                for (i = 0; i < m->n_fds; ++i)
+                        memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &replay->null_fd, sizeof(int));
+        }
+
+        m->ts_sent = replay_now();
+        m->sent = true;
+
+        for (i = 0; i < n_data && peer->fd >= 0; ) {
+                iov = (struct iovec){ data + i, n_data - i };
+
+                l = sendmsg(peer->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (l < 0 && (errno == EAGAIN || errno == EINTR)) {
+                        /* keep reading, so the broker never stalls on us */
+                        replay_dispatch(replay, 1000 * 1000);
+                        continue;
+                } else if (l < 0) {
+                        replay_drop(replay, peer);
+                        break;
+                }
+
+                /* file-descriptors travel with the first chunk only */
+                msg.msg_control = NULL;
+                msg.msg_controllen = 0;
+                i += l;
+        }
+
+        ++replay->n_sent;
+        free(data);
+}
+
+static void replay_connect(Replay *replay, ReplayPeer *peer) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = peer };
+        char auth[256], uid[32];
+        size_t i, n;
+        ssize_t l;
+        int r;
+
+        util_broker_connect_fd(replay->broker, &peer->fd);
+
+        r = epoll_ctl(replay->epoll_fd, EPOLL_CTL_ADD, peer->fd, &event);
+        assert(r >= 0);
+
+        r = snprintf(uid, sizeof(uid), "%u", (unsigned int)getuid());
+        assert(r > 0 && r < (int)sizeof(uid));
+
+        n = 0;
+        auth[n++] = 0;
+        n += sprintf(auth + n, "AUTH EXTERNAL ");
+        for (i = 0; uid[i]; ++i)
+                n += sprintf(auth + n, "%02x", (unsigned char)uid[i]);
+        n += sprintf(auth + n, "\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\n");
+
+        /* the SASL exchange is tiny, so it always fits the socket buffer */
+        l = send(peer->fd, auth, n, MSG_NOSIGNAL);
+        assert(l == (ssize_t)n);
+        peer->n_auth = 2;
+
+        if (!peer->hello) {
+                /* peers that predate the capture get a Hello() of their own */
+                peer->hello = &peer->hello_storage;
+                *peer->hello = (ReplayMessage){
+                        .type = 1,
+                        .serial = UINT32_MAX,
+                        .path = "/org/freedesktop/DBus",
+                        .interface = "org.freedesktop.DBus",
+                        .member = "Hello",
+                        .destination = "org.freedesktop.DBus",
+                        .peer = peer,
+                        .action = REPLAY_ACTION_CONNECT,
+                };
+        }
+
+        replay_send(replay, peer, peer->hello);
+}
+
+static void replay_wait(Replay *replay, bool (*done_fn)(Replay *replay, void *userdata), void *userdata) {
+        uint64_t ts, deadline;
+
+        /* wait for @done_fn, but never longer than the timeout without progress */
+        deadline = replay_now() + REPLAY_TIMEOUT_NSEC;
+        while (!done_fn(replay, userdata)) {
+                ts = replay_now();
+                if (ts >= deadline)
+                        break;
+
+                if (replay_dispatch(replay, deadline - ts))
+                        deadline = replay_now() + REPLAY_TIMEOUT_NSEC;
+        }
+}
+
+static bool replay_is_connected(Replay *replay, void *userdata) {
+        ReplayPeer *peer = userdata;
+
+        return peer->unique || peer->fd < 0;
+}
+
+static bool replay_is_delivered(Replay *replay, void *userdata) {
+        ReplayMessage *m = userdata;
+
+        return m->delivered || !m->sent || m->peer->fd < 0;
+}
+
+static bool replay_has_window(Replay *replay, void *userdata) {
+        return replay->n_window < REPLAY_WINDOW_MAX;
+}
+
+static bool replay_is_idle(Replay *replay, void *userdata) {
+        return !replay->n_window;
+}
+
+static void replay_step(Replay *replay, ReplayMessage *m) {
+        ReplayPeer *peer = m->peer;
+
+        switch (m->action) {
+        case REPLAY_ACTION_CONNECT:
+                replay_connect(replay, peer);
+                replay_wait(replay, replay_is_connected, peer);
+                break;
+
+        case REPLAY_ACTION_DISCONNECT:
+                replay_drop(replay, peer);
+                break;
+
+        case REPLAY_ACTION_SEND:
+                if (!peer->unique || peer->fd < 0 || (m->target && !m->target->unique)) {
+                        ++replay->n_skipped;
+                        break;
+                }
+
+                if (m->call) {
+                        /* replies must not overtake the call they answer */
+                        replay_wait(replay, replay_is_delivered, m->call);
+                        if (!m->call->delivered) {
+                                ++replay->n_skipped;
+                                break;
+                        }
+                } else if (m->type == 1 && !(m->flags & 0x1) &&
+                           (m->replied || !strcmp(m->destination ?: "", "org.freedesktop.DBus"))) {
+                        /*
+                         * Only calls that are known to be answered count
+                         * towards the window, since it would never drain
+                         * otherwise.
+                         */
+                        if (replay->speed <= 0)
+                                replay_wait(replay, replay_has_window, NULL);
+
+                        m->windowed = true;
+                        ++replay->n_window;
+                        ++peer->n_pending;
+                }
+
+                replay_send(replay, peer, m);
+                break;
+        }
+}
+
+static int replay_compare_u64(const void *a, const void *b) {
+        uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+        return ua < ub ? -1 : ua > ub;
+}
+
+static void replay_report_latencies(Replay *replay, const char *name, unsigned int class) {
+        ReplayStats *stats = &replay->stats[class];
+        uint64_t *v = stats->latencies;
+        size_t n = stats->n_latencies;
+
+        qsort(v, n, sizeof(*v), replay_compare_u64);
+
+        printf(", \"%s\": { \"operations\": %zu, \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 " }",
+               name,
+               n,
+               n ? v[(n - 1) * 50 / 100] : 0,
+               n ? v[(n - 1) * 90 / 100] : 0,
+               n ? v[(n - 1) * 99 / 100] : 0,
+               n ? v[n - 1] : 0);
+}
+
+static int replay_run(double speed, const char *path) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        Replay replay = REPLAY_NULL;
+        uint64_t ts, ts_start, deadline;
+        ReplayMessage *m;
+        size_t i;
+
+        replay.speed = speed;
+        replay_load(&replay, path);
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+        replay.broker = broker;
+
+        replay.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(replay.epoll_fd >= 0);
+
+        replay.null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        assert(replay.null_fd >= 0);
+
+        /* peers that connected before the capture started are not timed */
+        for (i = 0; i < replay.n_peers; ++i) {
+                if (!replay.peers[i]->implicit)
+                        continue;
+
+                replay_connect(&replay, replay.peers[i]);
+                replay_wait(&replay, replay_is_connected, replay.peers[i]);
+        }
+
+        replay.stats[REPLAY_CLASS_CONNECT].n_latencies = 0;
+        replay.n_sent = 0;
+        replay.n_received = 0;
+
+        ts_start = replay_now();
+
+        for (i = 0; i < replay.n_messages; ++i) {
+                m = &replay.messages[i];
+
+                if (m->action == REPLAY_ACTION_SKIP)
+                        continue;
+
+                if (speed > 0) {
+                        deadline = ts_start + (m->ts - replay.messages[0].ts) / speed;
+                        while ((ts = replay_now()) < deadline)
+                                replay_dispatch(&replay, deadline - ts);
+                }
+
+                replay_step(&replay, m);
+        }
+
+        replay_wait(&replay, replay_is_idle, NULL);
+
+        ts = replay_now() - ts_start;
+
+        printf("{ \"benchmark\": \"replay\", \"daemon\": \"%s\", \"speed\": %g, \"peers\": %zu, \"sent\": %zu, \"received\": %zu, \"skipped\": %zu, \"unanswered\": %zu, \"nsec\": %" PRIu64,
+               getenv("DBUS_BROKER_TEST_DAEMON") ? "dbus-daemon" : "dbus-broker",
+               speed,
+               replay.n_peers,
+               replay.n_sent,
+               replay.n_received,
+               replay.n_skipped,
+               replay.n_window,
+               ts);
+        replay_report_latencies(&replay, "connect", REPLAY_CLASS_CONNECT);
+        replay_report_latencies(&replay, "call", REPLAY_CLASS_CALL);
+        replay_report_latencies(&replay, "signal", REPLAY_CLASS_SIGNAL);
+        printf(" }\n");
+        fflush(stdout);
+
+        for (i = 0; i < replay.n_peers; ++i)
+                replay_drop(&replay, replay.peers[i]);
+
+        util_broker_terminate(broker);
+        replay_deinit(&replay);
+
+        return 0;
+}
+
+static int replay_record(const char *address, const char *path) {
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+        _c_cleanup_(c_closep) int fd = -1, sfd = -1, out = -1;
+        struct pollfd fds[2];
+        uint8_t buffer[64 * 1024];
+        uint64_t n_bytes = 0;
+        sigset_t mask;
+        ssize_t l, k;
+        int r, s[2];
+
+        if (address) {
+                r = sd_bus_new(&bus);
+                assert(r >= 0);
+
+                r = sd_bus_set_address(bus, address);
+                assert(r >= 0);
+
+                r = sd_bus_set_bus_client(bus, true);
+                assert(r >= 0);
+
+                r = sd_bus_start(bus);
+        } else {
+                r = sd_bus_open_system(&bus);
+        }
+        if (r < 0) {
+                fprintf(stderr, "Cannot connect to the bus: %s\n", strerror(-r));
+                return 1;
+        }
+
+        out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) {
+                fprintf(stderr, "Cannot open '%s': %m\n", path);
+                return 1;
+        }
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s);
+        assert(!r);
+        fd = s[1];
+
+        /* an empty rule set captures all traffic on the bus */
+        r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Monitoring",
+                               "BecomeCaptureMonitor", NULL, NULL,
+                               "asuh", 0, 0, s[0]);
+        close(s[0]);
+        if (r < 0) {
+                fprintf(stderr, "Cannot become capture monitor: %s\n", strerror(-r));
+                return 1;
+        }
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        r = sigprocmask(SIG_BLOCK, &mask, NULL);
+        assert(r >= 0);
+
+        sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+        assert(sfd >= 0);
+
+        fds[0] = (struct pollfd){ .fd = fd, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = sfd, .events = POLLIN };
+
+        for (;;) {
+                r = poll(fds, C_ARRAY_SIZE(fds), -1);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                assert(r >= 0);
+
+                if (fds[1].revents)
+                        break;
+
+                l = read(fd, buffer, sizeof(buffer));
+                if (l < 0 && errno == EINTR)
+                        continue;
+                if (l <= 0)
+                        break;
+
+                for (k = 0; k < l; ) {
+                        r = write(out, buffer + k, l - k);
+                        if (r < 0 && errno == EINTR)
+                                continue;
+                        if (r < 0) {
+                                fprintf(stderr, "Cannot write '%s': %m\n", path);
+                                return 1;
+                        }
+                        k += r;
+                }
+
+                n_bytes += l;
+        }
+
+        fprintf(stderr, "Captured %" PRIu64 " bytes to '%s'\n", n_bytes, path);
+        return 0;
+}
+
+static void replay_usage(void) {
+        fprintf(stderr,
+                "Usage: bench-replay record [--address ADDRESS] FILE\n"
+                "       bench-replay replay [--speed FACTOR|max] FILE\n");
+        exit(1);
+}
+
+int main(int argc, char **argv) {
+        const char *address = NULL, *file = NULL;
+        bool has_speed = false;
+        double speed = 1;
+        char *end;
+        int i;
+
+        if (argc < 2)
+                replay_usage();
+
+        for (i = 2; i < argc; ++i) {
+                if (!strcmp(argv[i], "--address") && i + 1 < argc) {
+                        address = argv[++i];
+                } else if (!strcmp(argv[i], "--speed") && i + 1 < argc) {
+                        has_speed = true;
+                        if (!strcmp(argv[++i], "max")) {
+                                speed = 0;
+                        } else {
+                                errno = 0;
+                                speed = strtod(argv[i], &end);
+                                if (errno || *end || speed <= 0)
+                                        replay_usage();
+                        }
+                } else if (!file && argv[i][0] != '-') {
+                        file = argv[i];
+                } else {
+                        replay_usage();
+                }
+        }
+
+        if (!file)
+                replay_usage();
+
+        if (!strcmp(argv[1], "record") && !has_speed)
+                return replay_record(address, file);
+        else if (!strcmp(argv[1], "replay") && !address)
+                return replay_run(speed, file);
+
+        replay_usage();
+        return 1;
+}
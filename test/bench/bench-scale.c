@@ -0,0 +1,267 @@
+/*
+ * Broker Scaling Benchmark
+ *
+ * This ramps a broker spawned via the test infrastructure up to 100k peers,
+ * 50k names, and 500k match rules. At every step, it records the resident
+ * memory of the broker per peer, the rate at which new peers connect, and the
+ * latency of a broadcast that is matched by a single rule out of all of them.
+ * Hence, any per-message cost that grows with the number of peers, names or
+ * match rules shows up directly.
+ *
+ * Results are written to stdout as CSV, one line per step, so they can be
+ * graphed across releases. An optional argument lowers the number of peers
+ * to ramp up to. The ramp is also capped by RLIMIT_NOFILE, since every peer
+ * takes one file-descriptor in the benchmark and one in the broker.
+ */
+
+#include <c-macro.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "util-broker.h"
+
+#define BENCH_SCALE_PEERS_MAX (100 * 1000)
+#define BENCH_SCALE_MATCHES_PER_PEER (5)
+#define BENCH_SCALE_PROBES (1000) /* enough for p99 to be distinct from the maximum */
+#define BENCH_SCALE_FDS_RESERVED (256) /* for the broker, launcher and sd-bus, beyond the peers */
+
+static const size_t bench_scale_steps[] = { 1000, 10000, 25000, 50000, 100000 };
+
+/* the per-user quotas of the broker must not limit the ramp */
+static const char * const bench_scale_args[] = {
+        "--max-bytes", "68719476736",
+        "--max-matches", "16777216",
+        "--max-objects", "16777216",
+        NULL,
+};
+
+static uint64_t bench_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint64_t bench_rss(pid_t pid) {
+        char path[64], line[256];
+        uint64_t rss = 0;
+        FILE *f;
+        int r;
+
+        r = snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+        assert(r > 0 && r < (int)sizeof(path));
+
+        f = fopen(path, "re");
+        assert(f);
+
+        while (fgets(line, sizeof(line), f)) {
+                if (!strncmp(line, "VmRSS:", strlen("VmRSS:"))) {
+                        rss = strtoull(line + strlen("VmRSS:"), NULL, 10);
+                        break;
+                }
+        }
+
+        fclose(f);
+        return rss;
+}
+
+static size_t bench_fd_limit(void) {
+        struct rlimit rl;
+        int r;
+
+        r = getrlimit(RLIMIT_NOFILE, &rl);
+        assert(!r);
+
+        /* the broker is forked from us, so it inherits the raised limit */
+        rl.rlim_cur = rl.rlim_max;
+        r = setrlimit(RLIMIT_NOFILE, &rl);
+        assert(!r);
+
+        if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > SIZE_MAX)
+                return SIZE_MAX;
+        if (rl.rlim_cur <= BENCH_SCALE_FDS_RESERVED)
+                return 0;
+
+        return rl.rlim_cur - BENCH_SCALE_FDS_RESERVED;
+}
+
+static int bench_compare_u64(const void *a, const void *b) {
+        uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+        return ua < ub ? -1 : ua > ub;
+}
+
+/* nearest-rank percentile of the sorted array @v */
+static uint64_t bench_percentile(const uint64_t *v, size_t n, unsigned int percent) {
+        size_t rank = (n * percent + 99) / 100;
+
+        return v[rank ? rank - 1 : 0];
+}
+
+static void bench_scale_setup(sd_bus **peers, size_t i) {
+        char rules[BENCH_SCALE_MATCHES_PER_PEER][256];
+        const char *unique;
+        size_t j;
+        int r;
+
+        /*
+         * Every peer installs rules of all the kinds the broker indexes
+         * differently: rules on a well-known sender, wildcard rules, and
+         * rules on a unique name. Only the first rule of each peer is ever
+         * matched by the probe, all others have to be skipped.
+         */
+
+        r = sd_bus_get_unique_name(peers[i ? i - 1 : 0], &unique);
+        assert(r >= 0);
+
+        r = snprintf(rules[0], sizeof(rules[0]),
+                     "type='signal',sender='org.bus1.Bench.Probe',interface='org.bus1.Bench',member='Probe',arg0='%zu'", i);
+        assert(r > 0 && r < (int)sizeof(rules[0]));
+        r = snprintf(rules[1], sizeof(rules[1]),
+                     "type='signal',sender='org.bus1.Bench.Probe',interface='org.bus1.Bench',member='Other',arg0='%zu'", i);
+        assert(r > 0 && r < (int)sizeof(rules[1]));
+        r = snprintf(rules[2], sizeof(rules[2]),
+                     "type='signal',interface='org.bus1.Bench',member='Wildcard%zu'", i);
+        assert(r > 0 && r < (int)sizeof(rules[2]));
+        r = snprintf(rules[3], sizeof(rules[3]),
+                     "type='signal',path='/org/bus1/Bench/%zu'", i);
+        assert(r > 0 && r < (int)sizeof(rules[3]));
+        r = snprintf(rules[4], sizeof(rules[4]),
+                     "type='signal',sender='%s',member='Unique'", unique);
+        assert(r > 0 && r < (int)sizeof(rules[4]));
+
+        for (j = 0; j < BENCH_SCALE_MATCHES_PER_PEER; ++j) {
+                r = sd_bus_call_method(peers[i], "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "AddMatch", NULL, NULL,
+                                       "s", rules[j]);
+                assert(r >= 0);
+        }
+
+        /* every second peer owns a well-known name */
+        if (i % 2) {
+                r = snprintf(rules[0], sizeof(rules[0]), "org.bus1.Bench.Name%zu", i);
+                assert(r > 0 && r < (int)sizeof(rules[0]));
+
+                r = sd_bus_request_name(peers[i], rules[0], 0);
+                assert(r > 0);
+        }
+}
+
+static uint64_t bench_scale_probe(sd_bus *probe, sd_bus *receiver, size_t i) {
+        char arg[32];
+        uint64_t ts;
+        int r;
+
+        r = snprintf(arg, sizeof(arg), "%zu", i);
+        assert(r > 0 && r < (int)sizeof(arg));
+
+        ts = bench_now();
+
+        r = sd_bus_emit_signal(probe, "/org/bus1/Bench", "org.bus1.Bench", "Probe", "s", arg);
+        assert(r >= 0);
+
+        for (;;) {
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                r = sd_bus_process(receiver, &m);
+                assert(r >= 0);
+
+                if (m && sd_bus_message_is_signal(m, "org.bus1.Bench", "Probe"))
+                        break;
+
+                if (!r) {
+                        r = sd_bus_wait(receiver, UINT64_MAX);
+                        assert(r >= 0);
+                }
+        }
+
+        return bench_now() - ts;
+}
+
+int main(int argc, char **argv) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *probe = NULL;
+        uint64_t latencies[BENCH_SCALE_PROBES];
+        uint64_t ts, ts_connect, ts_setup, rss, rss_base;
+        size_t i, k, step, n_max, n_peers = 0;
+        sd_bus **peers;
+        int r;
+
+        /* the ramp relies on quotas only dbus-broker lets us raise */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return 77;
+
+        n_max = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_SCALE_PEERS_MAX;
+        if (n_max > bench_fd_limit()) {
+                fprintf(stderr, "RLIMIT_NOFILE caps the ramp at %zu peers\n", bench_fd_limit());
+                n_max = bench_fd_limit();
+        }
+
+        peers = calloc(n_max ?: 1, sizeof(*peers));
+        assert(peers);
+
+        util_broker_new(&broker);
+        broker->args = bench_scale_args;
+        util_broker_spawn(broker);
+
+        util_broker_connect(broker, &probe);
+
+        r = sd_bus_request_name(probe, "org.bus1.Bench.Probe", 0);
+        assert(r > 0);
+
+        rss_base = bench_rss(broker->child_pid);
+
+        printf("peers,names,matches,rss_kib,rss_per_peer_bytes,connects_per_sec,matches_per_sec,broadcast_p50_nsec,broadcast_p99_nsec,broadcast_max_nsec\n");
+        fflush(stdout);
+
+        for (step = 0; step < C_ARRAY_SIZE(bench_scale_steps) && n_peers < n_max; ++step) {
+                k = c_min(bench_scale_steps[step], n_max);
+
+                ts = bench_now();
+                for (i = n_peers; i < k; ++i)
+                        util_broker_connect(broker, &peers[i]);
+                ts_connect = bench_now() - ts;
+
+                ts = bench_now();
+                for (i = n_peers; i < k; ++i)
+                        bench_scale_setup(peers, i);
+                ts_setup = bench_now() - ts;
+
+                for (i = 0; i < C_ARRAY_SIZE(latencies); ++i)
+                        latencies[i] = bench_scale_probe(probe, peers[(i * 7919) % k], (i * 7919) % k);
+
+                qsort(latencies, C_ARRAY_SIZE(latencies), sizeof(*latencies), bench_compare_u64);
+
+                rss = bench_rss(broker->child_pid);
+
+                printf("%zu,%zu,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                       k,
+                       k / 2,
+                       k * BENCH_SCALE_MATCHES_PER_PEER,
+                       rss,
+                       rss > rss_base ? (rss - rss_base) * 1024 / k : 0,
+                       ts_connect ? (uint64_t)(k - n_peers) * UINT64_C(1000000000) / ts_connect : 0,
+                       ts_setup ? (uint64_t)(k - n_peers) * BENCH_SCALE_MATCHES_PER_PEER * UINT64_C(1000000000) / ts_setup : 0,
+                       bench_percentile(latencies, C_ARRAY_SIZE(latencies), 50),
+                       bench_percentile(latencies, C_ARRAY_SIZE(latencies), 99),
+                       latencies[C_ARRAY_SIZE(latencies) - 1]);
+                fflush(stdout);
+
+                n_peers = k;
+        }
+
+        for (i = 0; i < n_peers; ++i)
+                sd_bus_flush_close_unref(peers[i]);
+        free(peers);
+
+        util_broker_terminate(broker);
+
+        return 0;
+}
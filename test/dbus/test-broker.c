@@ -3,9 +3,24 @@
  */
 
 #include <c-macro.h>
+#include <c-syscall.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "util-broker.h"
 
+/* signature of the policy variant of SetPolicy(), see util_append_policy() */
+#define TEST_POLICY_T                                                           \
+                "("                                                             \
+                "(bta(btbs)a(btssssub)a(btssssub))"                             \
+                "a(u(bta(btbs)a(btssssub)a(btssssub)))"                         \
+                "a(u(bta(btbs)a(btssssub)a(btssssub)))"                         \
+                "a(ss)"                                                         \
+                ")"
+
 static void test_dummy(void) {
         _c_cleanup_(util_broker_freep) Broker *broker = NULL;
 
@@ -81,6 +96,60 @@ static void test_self_ping(void) {
         util_broker_terminate(broker);
 }
 
+static void test_large_message(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /*
+         * Sends a large call to a peer that does not exist, and verifies it
+         * fails, and the connection is still usable afterwards. The broker
+         * rejects such calls before it receives their body.
+         */
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+                _c_cleanup_(c_freep) void *data = NULL;
+                size_t n_data = 1024 * 1024;
+
+                util_broker_connect(broker, &bus);
+
+                data = calloc(1, n_data);
+                assert(data);
+
+                r = sd_bus_message_new_method_call(bus,
+                                                   &m,
+                                                   ":1.1000000",
+                                                   "/org/example/Foo",
+                                                   "org.example.Foo",
+                                                   "Bar");
+                assert(r >= 0);
+
+                r = sd_bus_message_append_array(m, 'y', data, n_data);
+                assert(r >= 0);
+
+                r = sd_bus_call(bus, m, 0, &error, NULL);
+                assert(r < 0);
+                assert(!strcmp(error.name, "org.freedesktop.DBus.Error.NameHasNoOwner"));
+
+                r = sd_bus_call_method(bus,
+                                       "org.freedesktop.DBus",
+                                       "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus",
+                                       "GetId",
+                                       NULL,
+                                       NULL,
+                                       NULL);
+                assert(r >= 0);
+        }
+
+        util_broker_terminate(broker);
+}
+
 static int test_ping_pong_fn(sd_bus_message *m, void *userdata, sd_bus_error *error) {
         sd_event *event = userdata;
         const sd_bus_error *e;
@@ -153,11 +222,611 @@ static void test_ping_pong(void) {
         util_broker_terminate(broker);
 }
 
+static void test_slow_consumer(void) {
+        static const char * const args[] = { "--slow-consumer-bytes", "65536", NULL };
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *sender = NULL, *consumer = NULL;
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        _c_cleanup_(c_freep) void *data = NULL;
+        const char *unique, *key;
+        uint64_t n_drops = 0;
+        size_t n_data = 16 * 1024;
+        unsigned int i;
+        int r;
+
+        /* --slow-consumer-bytes is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        /*
+         * Subscribes a peer to signals that it then never reads, and floods
+         * it with broadcasts. Once its queue exceeds the configured limit,
+         * the broker must drop further signals to it, rather than queueing
+         * them until the peer runs into its quota.
+         */
+
+        util_broker_new(&broker);
+        broker->args = args;
+        util_broker_spawn(broker);
+
+        util_broker_connect(broker, &consumer);
+        util_broker_connect(broker, &sender);
+
+        r = sd_bus_get_unique_name(consumer, &unique);
+        assert(r >= 0);
+
+        r = sd_bus_call_method(consumer, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                               "AddMatch", NULL, NULL,
+                               "s", "type='signal',interface='org.example.Foo'");
+        assert(r >= 0);
+
+        data = calloc(1, n_data);
+        assert(data);
+
+        for (i = 0; i < 256; ++i) {
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                r = sd_bus_message_new_signal(sender, &m, "/org/example/Foo", "org.example.Foo", "Bar");
+                assert(r >= 0);
+
+                r = sd_bus_message_append_array(m, 'y', data, n_data);
+                assert(r >= 0);
+
+                r = sd_bus_send(sender, m, NULL);
+                assert(r >= 0);
+        }
+
+        /* the call is dispatched only after all signals before it */
+        r = sd_bus_call_method(sender, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Debug.Stats",
+                               "GetConnectionStats", NULL, &reply,
+                               "s", unique);
+        assert(r >= 0);
+
+        r = sd_bus_message_enter_container(reply, 'a', "{sv}");
+        assert(r >= 0);
+
+        while ((r = sd_bus_message_enter_container(reply, 'e', "sv")) > 0) {
+                r = sd_bus_message_read(reply, "s", &key);
+                assert(r >= 0);
+
+                if (!strcmp(key, "org.bus1.DBus.Debug.Stats.SlowConsumerDrops"))
+                        r = sd_bus_message_read(reply, "v", "t", &n_drops);
+                else
+                        r = sd_bus_message_skip(reply, "v");
+                assert(r >= 0);
+
+                r = sd_bus_message_exit_container(reply);
+                assert(r >= 0);
+        }
+        assert(r >= 0);
+        assert(n_drops > 0);
+
+        /* the consumer is still connected, and can catch up */
+        r = sd_bus_call_method(consumer, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                               "GetId", NULL, NULL,
+                               "");
+        assert(r >= 0);
+
+        sender = sd_bus_flush_close_unref(sender);
+        consumer = sd_bus_flush_close_unref(consumer);
+        util_broker_terminate(broker);
+}
+
+static void test_listen(int *fdp, struct sockaddr_un *address, socklen_t *n_address) {
+        int r, fd;
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        assert(fd >= 0);
+
+        /* let the kernel pick a random address */
+        *address = (struct sockaddr_un){ .sun_family = AF_UNIX };
+        r = bind(fd, (struct sockaddr *)address, offsetof(struct sockaddr_un, sun_path));
+        assert(r >= 0);
+
+        *n_address = sizeof(*address);
+        r = getsockname(fd, (struct sockaddr *)address, n_address);
+        assert(r >= 0);
+
+        r = listen(fd, 256);
+        assert(r >= 0);
+
+        *fdp = fd;
+}
+
+static void test_add_bus(void) {
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *controller = NULL;
+        _c_cleanup_(c_closep) int listener_fd = -1;
+        struct sockaddr_un address;
+        socklen_t n_address;
+        sigset_t signew;
+        int r, pair[2];
+
+        /* AddBus() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        sigemptyset(&signew);
+        sigaddset(&signew, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &signew, NULL);
+
+        r = sd_event_new(&event);
+        assert(r >= 0);
+
+        test_listen(&listener_fd, &address, &n_address);
+        util_fork_broker(&controller, event, listener_fd, NULL, NULL, NULL);
+
+        /*
+         * Create a second bus in the same broker, driven by its own
+         * controller, and verify clients can connect to it.
+         */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *hosted = NULL, *bus = NULL;
+                _c_cleanup_(c_closep) int hosted_fd = -1, fd = -1;
+                const char *unique = NULL;
+
+                r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(controller, NULL, "/org/bus1/DBus/Broker", "org.bus1.DBus.Broker",
+                                       "AddBus", NULL, NULL,
+                                       "h", pair[1]);
+                assert(r >= 0);
+                c_close(pair[1]);
+
+                r = sd_bus_new(&hosted);
+                assert(r >= 0);
+
+                /* consumes the fd */
+                r = sd_bus_set_fd(hosted, pair[0], pair[0]);
+                assert(r >= 0);
+
+                r = sd_bus_start(hosted);
+                assert(r >= 0);
+
+                test_listen(&hosted_fd, &address, &n_address);
+                util_controller_add_listener(hosted, "/org/bus1/DBus/Listener/0", hosted_fd);
+
+                fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                assert(fd >= 0);
+
+                r = connect(fd, (struct sockaddr *)&address, n_address);
+                assert(r >= 0);
+
+                r = sd_bus_new(&bus);
+                assert(r >= 0);
+
+                /* consumes the fd */
+                r = sd_bus_set_fd(bus, fd, fd);
+                fd = -1;
+                assert(r >= 0);
+
+                r = sd_bus_set_bus_client(bus, true);
+                assert(r >= 0);
+
+                r = sd_bus_start(bus);
+                assert(r >= 0);
+
+                r = sd_bus_get_unique_name(bus, &unique);
+                assert(!r);
+                assert(unique);
+        }
+
+        /* the broker keeps running after a hosted bus is gone */
+        {
+                r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(controller, NULL, "/org/bus1/DBus/Broker", "org.bus1.DBus.Broker",
+                                       "AddBus", NULL, NULL,
+                                       "h", pair[1]);
+                assert(r >= 0);
+
+                c_close(pair[1]);
+                c_close(pair[0]);
+        }
+}
+
+static void test_stage_part(sd_bus *controller, bool first, bool deny) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(controller, &m, NULL,
+                                           "/org/bus1/DBus/Listener/0", "org.bus1.DBus.Listener",
+                                           "StagePolicy");
+        assert(r >= 0);
+
+        r = sd_bus_message_append(m, "b", first);
+        assert(r >= 0);
+
+        r = sd_bus_message_open_container(m, 'v', "(a(u(" POLICY_T_BATCH "))a(u(" POLICY_T_BATCH ")))");
+        assert(r >= 0);
+
+        r = sd_bus_message_open_container(m, 'r', "a(u(" POLICY_T_BATCH "))a(u(" POLICY_T_BATCH "))");
+        assert(r >= 0);
+
+        r = sd_bus_message_open_container(m, 'a', "(u(" POLICY_T_BATCH "))");
+        assert(r >= 0);
+
+        /* refuse connections of our own uid, with precedence over the default */
+        if (deny) {
+                r = sd_bus_message_append(m, "(u(bta(btbs)a(btssssub)a(btssssub)))",
+                                          (uint32_t)getuid(), false, (uint64_t)2, 0, 0, 0);
+                assert(r >= 0);
+        }
+
+        r = sd_bus_message_close_container(m);
+        assert(r >= 0);
+
+        r = sd_bus_message_open_container(m, 'a', "(u(" POLICY_T_BATCH "))");
+        assert(r >= 0);
+
+        r = sd_bus_message_close_container(m);
+        assert(r >= 0);
+
+        r = sd_bus_message_close_container(m);
+        assert(r >= 0);
+
+        r = sd_bus_message_close_container(m);
+        assert(r >= 0);
+
+        r = sd_bus_call(controller, m, -1, NULL, NULL);
+        assert(r >= 0);
+}
+
+static void test_stage_invalid(sd_bus *controller) {
+        _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        int r;
+
+        r = sd_bus_call_method(controller, NULL, "/org/bus1/DBus/Listener/0", "org.bus1.DBus.Listener",
+                               "StagePolicy", &error, NULL,
+                               "bv", false, "s", "foobar");
+        assert(r < 0);
+}
+
+static void test_set_policy(sd_bus *controller) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(controller, &m, NULL,
+                                           "/org/bus1/DBus/Listener/0", "org.bus1.DBus.Listener",
+                                           "SetPolicy");
+        assert(r >= 0);
+
+        r = util_append_policy(m);
+        assert(r >= 0);
+
+        r = sd_bus_call(controller, m, -1, NULL, NULL);
+        assert(r >= 0);
+}
+
+static int test_connect_to(struct sockaddr_un *address, socklen_t n_address, sd_bus **busp) {
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+        const char *unique;
+        int r, fd;
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        assert(fd >= 0);
+
+        r = connect(fd, (struct sockaddr *)address, n_address);
+        assert(r >= 0);
+
+        r = sd_bus_new(&bus);
+        assert(r >= 0);
+
+        /* consumes the fd */
+        r = sd_bus_set_fd(bus, fd, fd);
+        assert(r >= 0);
+
+        r = sd_bus_set_bus_client(bus, true);
+        assert(r >= 0);
+
+        r = sd_bus_start(bus);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_get_unique_name(bus, &unique);
+        if (r < 0)
+                return r;
+
+        *busp = bus;
+        bus = NULL;
+        return 0;
+}
+
+static int test_try_connect(struct sockaddr_un *address, socklen_t n_address) {
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+
+        return test_connect_to(address, n_address, &bus);
+}
+
+static void test_set_connect_policy(sd_bus *controller, bool allow) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(controller, &m, NULL,
+                                           "/org/bus1/DBus/Listener/0", "org.bus1.DBus.Listener",
+                                           "SetPolicy");
+        assert(r >= 0);
+
+        /* allow everything, but connecting only if @allow is set */
+        r = sd_bus_message_append(m,
+                                  "v", TEST_POLICY_T,
+                                  allow, (uint64_t)1,
+                                  1, true, (uint64_t)1, true, "",
+                                  1, true, (uint64_t)1, "", "", "", "", 0, false,
+                                  1, true, (uint64_t)1, "", "", "", "", 0, false,
+                                  0,
+                                  0,
+                                  0);
+        assert(r >= 0);
+
+        r = sd_bus_call(controller, m, -1, NULL, NULL);
+        assert(r >= 0);
+}
+
+static void test_stage_policy(void) {
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *controller = NULL;
+        _c_cleanup_(c_closep) int listener_fd = -1;
+        struct sockaddr_un address;
+        socklen_t n_address;
+        sigset_t signew;
+        int r;
+
+        /* StagePolicy() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        sigemptyset(&signew);
+        sigaddset(&signew, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &signew, NULL);
+
+        r = sd_event_new(&event);
+        assert(r >= 0);
+
+        test_listen(&listener_fd, &address, &n_address);
+        util_fork_broker(&controller, event, listener_fd, NULL, NULL, NULL);
+
+        r = test_try_connect(&address, n_address);
+        assert(r >= 0);
+
+        /* staged parts take effect with the following SetPolicy() */
+        test_stage_part(controller, true, true);
+        test_set_policy(controller);
+
+        r = test_try_connect(&address, n_address);
+        assert(r < 0);
+
+        /* SetPolicy() consumes the staged policy */
+        test_set_policy(controller);
+
+        r = test_try_connect(&address, n_address);
+        assert(r >= 0);
+
+        /* a transfer aborted halfway does not leak into the next one */
+        test_stage_part(controller, true, true);
+        test_stage_part(controller, true, false);
+        test_set_policy(controller);
+
+        r = test_try_connect(&address, n_address);
+        assert(r >= 0);
+
+        /* an invalid part drops the staged policy altogether */
+        test_stage_part(controller, true, true);
+        test_stage_invalid(controller);
+        test_set_policy(controller);
+
+        r = test_try_connect(&address, n_address);
+        assert(r >= 0);
+
+        /* later parts add to the staged policy */
+        test_stage_part(controller, true, false);
+        test_stage_part(controller, false, true);
+        test_set_policy(controller);
+
+        r = test_try_connect(&address, n_address);
+        assert(r < 0);
+}
+
+static void test_set_invalid(sd_bus *controller) {
+        _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        int r;
+
+        r = sd_bus_call_method(controller, NULL, "/org/bus1/DBus/Listener/0", "org.bus1.DBus.Listener",
+                               "SetPolicy", &error, NULL,
+                               "v", "s", "foobar");
+        assert(r < 0);
+}
+
+static void test_reload_policy(void) {
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *controller = NULL;
+        _c_cleanup_(c_closep) int listener_fd = -1;
+        struct sockaddr_un address;
+        socklen_t n_address;
+        sigset_t signew;
+        int r;
+
+        /* SetPolicy() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        sigemptyset(&signew);
+        sigaddset(&signew, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &signew, NULL);
+
+        r = sd_event_new(&event);
+        assert(r >= 0);
+
+        test_listen(&listener_fd, &address, &n_address);
+        util_fork_broker(&controller, event, listener_fd, NULL, NULL, NULL);
+
+        /* a reload replaces the policy of a running listener */
+        test_set_connect_policy(controller, false);
+
+        r = test_try_connect(&address, n_address);
+        assert(r < 0);
+
+        /* a rejected reload keeps the previous policy in place */
+        test_set_invalid(controller);
+
+        r = test_try_connect(&address, n_address);
+        assert(r < 0);
+
+        /* the staged parts of a rejected reload are dropped */
+        test_stage_part(controller, true, true);
+        test_set_invalid(controller);
+        test_set_policy(controller);
+
+        r = test_try_connect(&address, n_address);
+        assert(r >= 0);
+}
+
+static void test_set_xmit_policy(sd_bus *controller) {
+        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(controller, &m, NULL,
+                                           "/org/bus1/DBus/Listener/0", "org.bus1.DBus.Listener",
+                                           "SetPolicy");
+        assert(r >= 0);
+
+        /*
+         * Allow everything by default, but on top of that, refuse sending
+         * Foo.Secret to owners of org.example.Hidden, and refuse everyone
+         * receiving Foo.Private.
+         */
+        r = sd_bus_message_append(m,
+                                  "v", TEST_POLICY_T,
+                                  true, (uint64_t)1,
+                                  1, true, (uint64_t)1, true, "",
+                                  1, true, (uint64_t)1, "", "", "", "", 0, false,
+                                  1, true, (uint64_t)1, "", "", "", "", 0, false,
+                                  1,
+                                  (uint32_t)getuid(), true, (uint64_t)2,
+                                  0,
+                                  1, false, (uint64_t)2, "org.example.Hidden", "", "org.example.Foo", "Secret", 0, false,
+                                  1, false, (uint64_t)2, "", "", "org.example.Foo", "Private", 0, false,
+                                  0,
+                                  0);
+        assert(r >= 0);
+
+        r = sd_bus_call(controller, m, -1, NULL, NULL);
+        assert(r >= 0);
+}
+
+static void test_expect_signal(sd_bus *bus, const char *member) {
+        int r;
+
+        /* skip anything but our own signals, like NameAcquired */
+        for (;;) {
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                r = sd_bus_process(bus, &m);
+                assert(r >= 0);
+
+                if (m && sd_bus_message_is_signal(m, "org.example.Foo", NULL)) {
+                        assert(!strcmp(sd_bus_message_get_member(m), member));
+                        return;
+                }
+
+                if (!r) {
+                        r = sd_bus_wait(bus, UINT64_MAX);
+                        assert(r >= 0);
+                }
+        }
+}
+
+static void test_broadcast_policy(void) {
+        _c_cleanup_(sd_event_unrefp) sd_event *event = NULL;
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *controller = NULL, *sender = NULL, *named = NULL;
+        _c_cleanup_(c_closep) int listener_fd = -1;
+        sd_bus *anonymous[4] = {};
+        struct sockaddr_un address;
+        socklen_t n_address;
+        sigset_t signew;
+        size_t i;
+        int r;
+
+        /*
+         * Receivers without names that share their policy share a granted
+         * verdict of a broadcast, and it is evaluated only once for all of
+         * them. Make sure a receiver with names interleaved with them is
+         * still checked on its own, and denials, which are never shared, are
+         * still applied to every receiver.
+         */
+
+        /* SetPolicy() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        sigemptyset(&signew);
+        sigaddset(&signew, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &signew, NULL);
+
+        r = sd_event_new(&event);
+        assert(r >= 0);
+
+        test_listen(&listener_fd, &address, &n_address);
+        util_fork_broker(&controller, event, listener_fd, NULL, NULL, NULL);
+
+        test_set_xmit_policy(controller);
+
+        r = test_connect_to(&address, n_address, &sender);
+        assert(r >= 0);
+
+        for (i = 0; i < C_ARRAY_SIZE(anonymous); ++i) {
+                r = test_connect_to(&address, n_address, &anonymous[i]);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(anonymous[i], "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "AddMatch", NULL, NULL,
+                                       "s", "type='signal',interface='org.example.Foo'");
+                assert(r >= 0);
+
+                /* subscribe the named receiver in the middle of the others */
+                if (i == C_ARRAY_SIZE(anonymous) / 2) {
+                        r = test_connect_to(&address, n_address, &named);
+                        assert(r >= 0);
+
+                        r = sd_bus_request_name(named, "org.example.Hidden", 0);
+                        assert(r >= 0);
+
+                        r = sd_bus_call_method(named, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                               "AddMatch", NULL, NULL,
+                                               "s", "type='signal',interface='org.example.Foo'");
+                        assert(r >= 0);
+                }
+        }
+
+        r = sd_bus_emit_signal(sender, "/org/example/Foo", "org.example.Foo", "Secret", "");
+        assert(r >= 0);
+        r = sd_bus_emit_signal(sender, "/org/example/Foo", "org.example.Foo", "Private", "");
+        assert(r >= 0);
+        r = sd_bus_emit_signal(sender, "/org/example/Foo", "org.example.Foo", "Public", "");
+        assert(r >= 0);
+
+        for (i = 0; i < C_ARRAY_SIZE(anonymous); ++i) {
+                test_expect_signal(anonymous[i], "Secret");
+                test_expect_signal(anonymous[i], "Public");
+                anonymous[i] = sd_bus_flush_close_unref(anonymous[i]);
+        }
+
+        test_expect_signal(named, "Public");
+}
+
 int main(int argc, char **argv) {
         test_dummy();
         test_connect();
         test_self_ping();
         test_ping_pong();
+        test_slow_consumer();
+        test_large_message();
+        test_add_bus();
+        test_stage_policy();
+        test_reload_policy();
+        test_broadcast_policy();
 
         return 0;
 }
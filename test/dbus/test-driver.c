@@ -3,7 +3,12 @@
  */
 
 #include <c-macro.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "../../src/dbus/protocol.h"
 #include "util-broker.h"
 
@@ -712,6 +717,126 @@ static void test_list_names(void) {
         util_broker_terminate(broker);
 }
 
+static void test_list_names_paged(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /* ListNamesPaged() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /* page through all names, one at a time, in canonical order */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(c_freep) char *cursor = NULL;
+                const char *unique_name, *name, *next;
+                bool found_unique_name = false;
+                size_t n_names = 0;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_get_unique_name(bus, &unique_name);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "RequestName", NULL, NULL,
+                                       "su", "com.example.foo", 0);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "RequestName", NULL, NULL,
+                                       "su", "com.example.bar", 0);
+                assert(r >= 0);
+
+                cursor = strdup("");
+                assert(cursor);
+
+                do {
+                        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+
+                        r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                               "ListNamesPaged", NULL, &reply,
+                                               "su", cursor, 1);
+                        assert(r >= 0);
+
+                        r = sd_bus_message_enter_container(reply, 'a', "s");
+                        assert(r >= 0);
+                        r = sd_bus_message_read(reply, "s", &name);
+                        assert(r > 0);
+                        r = sd_bus_message_exit_container(reply);
+                        assert(r >= 0);
+                        r = sd_bus_message_read(reply, "s", &next);
+                        assert(r > 0);
+
+                        switch (n_names++) {
+                        case 0:
+                                assert(!strcmp(name, "org.freedesktop.DBus"));
+                                break;
+                        default:
+                                if (!strcmp(name, unique_name))
+                                        found_unique_name = true;
+                                else if (name[0] != ':')
+                                        assert(found_unique_name);
+                                break;
+                        }
+
+                        if (!strcmp(name, "com.example.foo"))
+                                assert(!*next);
+                        else
+                                assert(!strcmp(next, name));
+
+                        free(cursor);
+                        cursor = strdup(next);
+                        assert(cursor);
+                } while (*cursor);
+
+                assert(found_unique_name);
+                assert(n_names >= 4);
+        }
+
+        /* released names are dropped from the listing right away */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                const char *name, *next;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "RequestName", NULL, NULL,
+                                       "su", "com.example.baz", 0);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "ReleaseName", NULL, NULL,
+                                       "s", "com.example.baz");
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "ListNamesPaged", NULL, &reply,
+                                       "su", "com.example.bar", 0);
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'a', "s");
+                assert(r >= 0);
+
+                while ((r = sd_bus_message_read(reply, "s", &name)) > 0)
+                        assert(strcmp(name, "com.example.baz"));
+                assert(r >= 0);
+
+                r = sd_bus_message_exit_container(reply);
+                assert(r >= 0);
+                r = sd_bus_message_read(reply, "s", &next);
+                assert(r > 0);
+                assert(!*next);
+        }
+
+        util_broker_terminate(broker);
+}
+
 static void test_list_activatable_names(void) {
         _c_cleanup_(util_broker_freep) Broker *broker = NULL;
         int r;
@@ -1197,6 +1322,435 @@ static void test_get_adt_audit_session_data(void) {
         util_broker_terminate(broker);
 }
 
+static void test_get_name_owners(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /* GetNameOwners() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /* names without owner are omitted from the reply */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                const char *unique_name, *name, *owner;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_get_unique_name(bus, &unique_name);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "RequestName", NULL, NULL,
+                                       "su", "com.example.foo", 0);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "GetNameOwners", NULL, &reply,
+                                       "as", 3, "com.example.foo", "com.example.bar", "org.freedesktop.DBus");
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'a', "{ss}");
+                assert(r >= 0);
+
+                r = sd_bus_message_read(reply, "{ss}", &name, &owner);
+                assert(r > 0);
+                assert(!strcmp(name, "com.example.foo"));
+                assert(!strcmp(owner, unique_name));
+
+                r = sd_bus_message_read(reply, "{ss}", &name, &owner);
+                assert(r > 0);
+                assert(!strcmp(name, "org.freedesktop.DBus"));
+                assert(!strcmp(owner, "org.freedesktop.DBus"));
+
+                r = sd_bus_message_read(reply, "{ss}", &name, &owner);
+                assert(r == 0);
+
+                r = sd_bus_message_exit_container(reply);
+                assert(r >= 0);
+        }
+
+        /* credentials are reported for each name with an owner */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                const char *unique_name, *name;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_get_unique_name(bus, &unique_name);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "GetConnectionCredentialsBatch", NULL, &reply,
+                                       "as", 2, "com.example.bar", unique_name);
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'a', "{sa{sv}}");
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'e', "sa{sv}");
+                assert(r > 0);
+
+                r = sd_bus_message_read(reply, "s", &name);
+                assert(r > 0);
+                assert(!strcmp(name, unique_name));
+
+                r = sd_bus_message_skip(reply, "a{sv}");
+                assert(r >= 0);
+
+                r = sd_bus_message_exit_container(reply);
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'e', "sa{sv}");
+                assert(r == 0);
+
+                r = sd_bus_message_exit_container(reply);
+                assert(r >= 0);
+        }
+
+        /* batches are limited to 1024 entries */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                static const char * const methods[] = { "GetNameOwners", "GetConnectionCredentialsBatch" };
+                char *names[1026] = {};
+                size_t i, n;
+
+                util_broker_connect(broker, &bus);
+
+                for (i = 0; i < C_ARRAY_SIZE(methods); ++i) {
+                        for (n = 1024; n <= 1025; ++n) {
+                                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *call = NULL;
+                                _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+
+                                for (size_t k = 0; k < n; ++k)
+                                        names[k] = (char *)"com.example.foo";
+
+                                r = sd_bus_message_new_method_call(bus, &call, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                                                   "org.freedesktop.DBus", methods[i]);
+                                assert(r >= 0);
+
+                                r = sd_bus_message_append_strv(call, names);
+                                assert(r >= 0);
+
+                                r = sd_bus_call(bus, call, 0, &error, NULL);
+                                if (n > 1024) {
+                                        assert(r < 0);
+                                        assert(!strcmp(error.name, "org.freedesktop.DBus.Error.LimitsExceeded"));
+                                } else {
+                                        assert(r >= 0);
+                                }
+                        }
+                }
+        }
+
+        util_broker_terminate(broker);
+}
+
+static void test_add_matches(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /* AddMatches() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /* add a set of matches, and remove them individually */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "AddMatches", NULL, NULL,
+                                       "as", 2, "sender=org.freedesktop.DBus", "type=signal,interface=com.example.foo");
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "RemoveMatch", NULL, NULL,
+                                       "s", "sender=org.freedesktop.DBus");
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "RemoveMatch", NULL, NULL,
+                                       "s", "type=signal,interface=com.example.foo");
+                assert(r >= 0);
+        }
+
+        /* an invalid rule rejects the whole set */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_error_free) sd_bus_error error1 = SD_BUS_ERROR_NULL, error2 = SD_BUS_ERROR_NULL;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "AddMatches", &error1, NULL,
+                                       "as", 2, "sender=org.freedesktop.DBus", "type=invalid");
+                assert(r < 0);
+                assert(!strcmp(error1.name, "org.freedesktop.DBus.Error.MatchRuleInvalid"));
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "RemoveMatch", &error2, NULL,
+                                       "s", "sender=org.freedesktop.DBus");
+                assert(r < 0);
+                assert(!strcmp(error2.name, "org.freedesktop.DBus.Error.MatchRuleNotFound"));
+        }
+
+        util_broker_terminate(broker);
+}
+
+static void test_signal_coalescing(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /* SetSignalCoalescing() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /* coalescing can be enabled and disabled again */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "SetSignalCoalescing", NULL, NULL,
+                                       "b", true);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "SetSignalCoalescing", NULL, NULL,
+                                       "b", false);
+                assert(r >= 0);
+        }
+
+        /* signals that list disjoint properties are all delivered */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *sender = NULL, *receiver = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                static const char *properties[] = { "Foo", "Bar", "Baz" };
+                const char *unique, *key;
+                uint64_t n_coalesced = UINT64_MAX;
+                size_t i, n_received = 0;
+
+                util_broker_connect(broker, &sender);
+                util_broker_connect(broker, &receiver);
+
+                r = sd_bus_get_unique_name(receiver, &unique);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(receiver, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "SetSignalCoalescing", NULL, NULL,
+                                       "b", true);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(receiver, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "AddMatch", NULL, NULL,
+                                       "s", "type='signal',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged'");
+                assert(r >= 0);
+
+                for (i = 0; i < C_ARRAY_SIZE(properties); ++i) {
+                        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                        r = sd_bus_message_new_signal(sender, &m, "/org/example/Foo", "org.freedesktop.DBus.Properties", "PropertiesChanged");
+                        assert(r >= 0);
+
+                        r = sd_bus_message_append(m, "sa{sv}as", "org.example.Foo", 1, properties[i], "u", (uint32_t)i, 0);
+                        assert(r >= 0);
+
+                        r = sd_bus_send(sender, m, NULL);
+                        assert(r >= 0);
+                }
+
+                /* the call is dispatched only after all signals before it */
+                r = sd_bus_call_method(sender, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Debug.Stats",
+                                       "GetConnectionStats", NULL, &reply,
+                                       "s", unique);
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'a', "{sv}");
+                assert(r >= 0);
+
+                while ((r = sd_bus_message_enter_container(reply, 'e', "sv")) > 0) {
+                        r = sd_bus_message_read(reply, "s", &key);
+                        assert(r >= 0);
+
+                        if (!strcmp(key, "org.bus1.DBus.Debug.Stats.CoalescedSignals")) {
+                                r = sd_bus_message_read(reply, "v", "t", &n_coalesced);
+                                assert(r >= 0);
+                        } else {
+                                r = sd_bus_message_skip(reply, "v");
+                                assert(r >= 0);
+                        }
+
+                        r = sd_bus_message_exit_container(reply);
+                        assert(r >= 0);
+                }
+                assert(r >= 0);
+                assert(!n_coalesced);
+
+                while (n_received < C_ARRAY_SIZE(properties)) {
+                        _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                        const char *interface, *property;
+
+                        r = sd_bus_process(receiver, &m);
+                        assert(r >= 0);
+
+                        if (m && sd_bus_message_is_signal(m, "org.freedesktop.DBus.Properties", "PropertiesChanged")) {
+                                r = sd_bus_message_read(m, "s", &interface);
+                                assert(r >= 0);
+                                assert(!strcmp(interface, "org.example.Foo"));
+
+                                r = sd_bus_message_enter_container(m, 'a', "{sv}");
+                                assert(r >= 0);
+
+                                r = sd_bus_message_enter_container(m, 'e', "sv");
+                                assert(r > 0);
+
+                                r = sd_bus_message_read(m, "s", &property);
+                                assert(r >= 0);
+                                assert(!strcmp(property, properties[n_received++]));
+                        } else if (!r) {
+                                r = sd_bus_wait(receiver, UINT64_MAX);
+                                assert(r >= 0);
+                        }
+                }
+        }
+
+        util_broker_terminate(broker);
+}
+
+static void test_reply_priority(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /* SetReplyPriority() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /* reply priority can be enabled and disabled again */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                const char *id;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "SetReplyPriority", NULL, NULL,
+                                       "b", true);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "GetId", NULL, &reply,
+                                       "");
+                assert(r >= 0);
+
+                r = sd_bus_message_read(reply, "s", &id);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "SetReplyPriority", NULL, NULL,
+                                       "b", false);
+                assert(r >= 0);
+        }
+
+        util_broker_terminate(broker);
+}
+
+static void test_setup_shared_memory(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /* SetupSharedMemory() is an extension of dbus-broker */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /*
+         * The reply hands over a sealed memfd and a datagram socket. Any
+         * message after it is exchanged through the rings, which sd-bus does
+         * not speak, so the connection is not used any further.
+         */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                socklen_t n_type = sizeof(int);
+                int memfd, wake_fd, type;
+                struct stat st;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "SetupSharedMemory", NULL, &reply,
+                                       "");
+                assert(r >= 0);
+
+                r = sd_bus_message_read(reply, "hh", &memfd, &wake_fd);
+                assert(r >= 0);
+
+                r = fstat(memfd, &st);
+                assert(r >= 0);
+                assert(st.st_size > 0);
+
+                r = fcntl(memfd, F_GET_SEALS);
+                assert(r >= 0 && (r & F_SEAL_SHRINK));
+
+                r = getsockopt(wake_fd, SOL_SOCKET, SO_TYPE, &type, &n_type);
+                assert(r >= 0 && type == SOCK_DGRAM);
+        }
+
+        /*
+         * FDs cannot be passed through the rings. Calls with FDs to a peer
+         * using shared memory are refused with an error, rather than being
+         * delivered without their FDs.
+         */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *shm = NULL, *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+                _c_cleanup_(c_closep) int fd = -1;
+                const char *unique;
+
+                util_broker_connect(broker, &shm);
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_get_unique_name(shm, &unique);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(shm, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                       "SetupSharedMemory", NULL, &reply,
+                                       "");
+                assert(r >= 0);
+
+                fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                assert(fd >= 0);
+
+                r = sd_bus_call_method(bus, unique, "/", "org.example.Foo", "Bar", &error, NULL,
+                                       "h", fd);
+                assert(r < 0);
+                assert(!strcmp(error.name, "org.freedesktop.DBus.Error.NotSupported"));
+        }
+
+        util_broker_terminate(broker);
+}
+
 static void test_get_id(void) {
         _c_cleanup_(util_broker_freep) Broker *broker = NULL;
         int r;
@@ -1285,6 +1839,227 @@ static void test_become_monitor(void) {
         util_broker_terminate(broker);
 }
 
+static void test_become_capture_monitor(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        uint32_t header[6];
+        ssize_t l;
+        int r, p[2], s[2];
+
+        /* capture monitors are a dbus-broker extension */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /* become capture monitor */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+
+                util_broker_connect(broker, &bus);
+
+                r = pipe2(p, O_CLOEXEC);
+                assert(!r);
+
+                r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s);
+                assert(!r);
+
+                /* only stream sockets are accepted */
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Monitoring",
+                                       "BecomeCaptureMonitor", &error, NULL,
+                                       "asuh", 0, 0, p[1]);
+                assert(r < 0);
+                assert(!strcmp(error.name, "org.freedesktop.DBus.Error.InvalidArgs"));
+
+                close(p[1]);
+                close(p[0]);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Monitoring",
+                                       "BecomeCaptureMonitor", NULL, NULL,
+                                       "asuh", 0, 0, s[0]);
+                assert(r >= 0);
+
+                close(s[0]);
+
+                /* the capture starts with the pcap header */
+                l = recv(s[1], header, sizeof(header), MSG_WAITALL);
+                assert(l == sizeof(header));
+                assert(header[0] == 0xa1b2c3d4);
+                assert(header[5] == 231);
+
+                /* new peers show up with their Hello() and NameOwnerChanged */
+                {
+                        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *peer = NULL;
+                        uint32_t record[4];
+                        char data[4096];
+                        bool found = false;
+                        size_t i;
+
+                        util_broker_connect(broker, &peer);
+
+                        for (i = 0; i < 8 && !found; ++i) {
+                                l = recv(s[1], record, sizeof(record), MSG_WAITALL);
+                                assert(l == sizeof(record));
+                                assert(record[2] <= sizeof(data));
+
+                                l = recv(s[1], data, record[2], MSG_WAITALL);
+                                assert(l == (ssize_t)record[2]);
+
+                                found = data[1] == 4 && memmem(data, l, "NameOwnerChanged", strlen("NameOwnerChanged"));
+                        }
+                        assert(found);
+                }
+
+                close(s[1]);
+        }
+
+        util_broker_terminate(broker);
+}
+
+static void test_stats(void) {
+        _c_cleanup_(util_broker_freep) Broker *broker = NULL;
+        int r;
+
+        /* the statistics keys of dbus-daemon differ from ours */
+        if (getenv("DBUS_BROKER_TEST_DAEMON"))
+                return;
+
+        util_broker_new(&broker);
+        util_broker_spawn(broker);
+
+        /* query the bus-wide statistics */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                bool found = false, found_selinux = false;
+                const char *key;
+                uint64_t n_hits;
+                uint32_t n;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Debug.Stats",
+                                       "GetStats", NULL, &reply,
+                                       "");
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'a', "{sv}");
+                assert(r >= 0);
+
+                while ((r = sd_bus_message_enter_container(reply, 'e', "sv")) > 0) {
+                        r = sd_bus_message_read(reply, "s", &key);
+                        assert(r >= 0);
+
+                        if (!strcmp(key, "ActiveConnections")) {
+                                r = sd_bus_message_read(reply, "v", "u", &n);
+                                assert(r >= 0);
+                                assert(n >= 1);
+                                found = true;
+                        } else if (!strcmp(key, "org.bus1.DBus.Debug.Stats.SELinuxCacheHits")) {
+                                r = sd_bus_message_read(reply, "v", "t", &n_hits);
+                                assert(r >= 0);
+                                found_selinux = true;
+                        } else {
+                                r = sd_bus_message_skip(reply, "v");
+                                assert(r >= 0);
+                        }
+
+                        r = sd_bus_message_exit_container(reply);
+                        assert(r >= 0);
+                }
+                assert(r >= 0);
+                assert(found);
+                assert(found_selinux);
+        }
+
+        /* query the statistics of our own connection */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                const char *unique, *key, *name = NULL;
+                uint64_t n_received = 0;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_get_unique_name(bus, &unique);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Debug.Stats",
+                                       "GetConnectionStats", NULL, &reply,
+                                       "s", unique);
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'a', "{sv}");
+                assert(r >= 0);
+
+                while ((r = sd_bus_message_enter_container(reply, 'e', "sv")) > 0) {
+                        r = sd_bus_message_read(reply, "s", &key);
+                        assert(r >= 0);
+
+                        if (!strcmp(key, "UniqueName"))
+                                r = sd_bus_message_read(reply, "v", "s", &name);
+                        else if (!strcmp(key, "org.bus1.DBus.Debug.Stats.MessagesReceived"))
+                                r = sd_bus_message_read(reply, "v", "t", &n_received);
+                        else
+                                r = sd_bus_message_skip(reply, "v");
+                        assert(r >= 0);
+
+                        r = sd_bus_message_exit_container(reply);
+                        assert(r >= 0);
+                }
+                assert(r >= 0);
+
+                /* Hello() and this call */
+                assert(name && !strcmp(name, unique));
+                assert(n_received >= 2);
+        }
+
+        /* query the heavy hitters, which are accounted from the first query on */
+        {
+                _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+                _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                const char *unique, *interface, *member, *sender;
+                bool found = false;
+                uint64_t count;
+                unsigned int i;
+
+                util_broker_connect(broker, &bus);
+
+                r = sd_bus_get_unique_name(bus, &unique);
+                assert(r >= 0);
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Debug.Stats",
+                                       "GetHeavyHitters", NULL, NULL,
+                                       "");
+                assert(r >= 0);
+
+                for (i = 0; i < 8; ++i) {
+                        r = sd_bus_emit_signal(bus, "/org/example", "org.example.Foo", "Bar", "");
+                        assert(r >= 0);
+                }
+
+                r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Debug.Stats",
+                                       "GetHeavyHitters", NULL, &reply,
+                                       "");
+                assert(r >= 0);
+
+                r = sd_bus_message_enter_container(reply, 'a', "(ssst)");
+                assert(r >= 0);
+
+                while ((r = sd_bus_message_read(reply, "(ssst)", &interface, &member, &sender, &count)) > 0) {
+                        if (!strcmp(interface, "org.example.Foo") && !strcmp(member, "Bar") && !strcmp(sender, unique)) {
+                                assert(count >= 8);
+                                found = true;
+                        }
+                }
+                assert(r >= 0);
+                assert(found);
+        }
+
+        util_broker_terminate(broker);
+}
+
 int main(int argc, char **argv) {
         test_hello();
         test_request_name();
@@ -1292,14 +2067,22 @@ int main(int argc, char **argv) {
         test_get_name_owner();
         test_name_has_owner();
         test_list_names();
+        test_list_names_paged();
         test_list_activatable_names();
         test_list_queued_owners();
         test_get_connection_unix_user();
         test_get_connection_unix_process_id();
         test_get_adt_audit_session_data();
+        test_get_name_owners();
+        test_add_matches();
+        test_signal_coalescing();
+        test_reply_priority();
+        test_setup_shared_memory();
         test_get_id();
         test_introspect();
         test_become_monitor();
+        test_become_capture_monitor();
+        test_stats();
 
         return 0;
 }
@@ -39,19 +39,7 @@ static int util_event_sigchld(sd_event_source *source, const siginfo_t *si, void
                              (si->si_code == CLD_EXITED) ? si->si_status : EXIT_FAILURE);
 }
 
-#define POLICY_T_BATCH                                                          \
-                "bt"                                                            \
-                "a(btbs)"                                                       \
-                "a(btssssub)"                                                   \
-                "a(btssssub)"
-
-#define POLICY_T                                                                \
-                "(" POLICY_T_BATCH ")"                                          \
-                "a(u(" POLICY_T_BATCH "))"                                      \
-                "a(u(" POLICY_T_BATCH "))"                                      \
-                "a(ss)"
-
-static int util_append_policy(sd_bus_message *m) {
+int util_append_policy(sd_bus_message *m) {
         int r;
 
         r = sd_bus_message_open_container(m, 'v', "(" POLICY_T ")");
@@ -119,10 +107,37 @@ static int util_append_policy(sd_bus_message *m) {
         return 0;
 }
 
-void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pidp) {
-        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+void util_controller_add_listener(sd_bus *bus, const char *path, int listener_fd) {
         _c_cleanup_(sd_bus_message_unrefp) sd_bus_message *message = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(bus,
+                                           &message,
+                                           NULL,
+                                           "/org/bus1/DBus/Broker",
+                                           "org.bus1.DBus.Broker",
+                                           "AddListener");
+        assert(r >= 0);
+
+        r = sd_bus_message_append(message,
+                                  "ohs",
+                                  path,
+                                  listener_fd,
+                                  NULL);
+        assert(r >= 0);
+
+        r = util_append_policy(message);
+        assert(r >= 0);
+
+        r = sd_bus_call(bus, message, -1, NULL, NULL);
+        assert(r >= 0);
+}
+
+void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, const char * const *args, pid_t *pidp, pid_t *childp) {
+        _c_cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
         _c_cleanup_(c_freep) char *fdstr = NULL;
+        const char *argv[64];
+        size_t i, n_argv = 0;
         int r, pair[2];
         pid_t pid;
 
@@ -147,16 +162,26 @@ void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pi
                 r = asprintf(&fdstr, "%d", pair[1]);
                 assert(r >= 0);
 
-                r = execl("./src/dbus-broker",
-                          "./src/dbus-broker",
-                          "--verbose",
-                          "--controller", fdstr,
-                          (char *)NULL);
-                /* execl(2) only returns on error */
+                /* @args are appended to the fixed arguments */
+                argv[n_argv++] = "./src/dbus-broker";
+                argv[n_argv++] = "--verbose";
+                argv[n_argv++] = "--controller";
+                argv[n_argv++] = fdstr;
+                for (i = 0; args && args[i]; ++i) {
+                        assert(n_argv < C_ARRAY_SIZE(argv) - 1);
+                        argv[n_argv++] = args[i];
+                }
+                argv[n_argv] = NULL;
+
+                r = execv(argv[0], (char **)argv);
+                /* execv(2) only returns on error */
                 assert(r >= 0);
                 abort();
         }
 
+        if (childp)
+                *childp = pid;
+
         r = sd_event_add_child(event, NULL, pid, WEXITED, util_event_sigchld, NULL);
         assert(r >= 0);
 
@@ -173,26 +198,7 @@ void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pi
         r = sd_bus_start(bus);
         assert(r >= 0);
 
-        r = sd_bus_message_new_method_call(bus,
-                                           &message,
-                                           NULL,
-                                           "/org/bus1/DBus/Broker",
-                                           "org.bus1.DBus.Broker",
-                                           "AddListener");
-        assert(r >= 0);
-
-        r = sd_bus_message_append(message,
-                                  "ohs",
-                                  "/org/bus1/DBus/Listener/0",
-                                  listener_fd,
-                                  NULL);
-        assert(r >= 0);
-
-        r = util_append_policy(message);
-        assert(r >= 0);
-
-        r = sd_bus_call(bus, message, -1, NULL, NULL);
-        assert(r >= 0);
+        util_controller_add_listener(bus, "/org/bus1/DBus/Listener/0", listener_fd);
 
         *busp = bus;
         bus = NULL;
@@ -303,10 +309,11 @@ static void *util_broker_thread(void *userdata) {
         util_event_new(&event);
 
         if (broker->listener_fd >= 0) {
-                util_fork_broker(&bus, event, broker->listener_fd, &broker->pid);
+                util_fork_broker(&bus, event, broker->listener_fd, broker->args, &broker->pid, &broker->child_pid);
         } else {
                 assert(broker->listener_fd < 0);
                 util_fork_daemon(event, broker->pipe_fds[1], &broker->pid);
+                broker->child_pid = broker->pid;
         }
 
         broker->pipe_fds[1] = c_close(broker->pipe_fds[1]);
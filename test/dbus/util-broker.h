@@ -16,12 +16,14 @@
 typedef struct Broker Broker;
 
 struct Broker {
+        const char * const *args;
         pthread_t thread;
         struct sockaddr_un address;
         socklen_t n_address;
         int listener_fd;
         int pipe_fds[2];
         pid_t pid;
+        pid_t child_pid;
 };
 
 #define BROKER_NULL {                                                           \
@@ -32,10 +34,27 @@ struct Broker {
                 .pipe_fds[1] = -1,                                              \
         }
 
+/* policy */
+
+#define POLICY_T_BATCH                                                          \
+                "bt"                                                            \
+                "a(btbs)"                                                       \
+                "a(btssssub)"                                                   \
+                "a(btssssub)"
+
+#define POLICY_T                                                                \
+                "(" POLICY_T_BATCH ")"                                          \
+                "a(u(" POLICY_T_BATCH "))"                                      \
+                "a(u(" POLICY_T_BATCH "))"                                      \
+                "a(ss)"
+
+int util_append_policy(sd_bus_message *m);
+
 /* misc */
 
 void util_event_new(sd_event **eventp);
-void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, pid_t *pidp);
+void util_controller_add_listener(sd_bus *bus, const char *path, int listener_fd);
+void util_fork_broker(sd_bus **busp, sd_event *event, int listener_fd, const char * const *args, pid_t *pidp, pid_t *childp);
 void util_fork_daemon(sd_event *event, int pipe_fd, pid_t *pidp);
 
 /* broker */